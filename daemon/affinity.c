@@ -0,0 +1,139 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * CPU placement of the threads (see affinity.h)
+ */
+#include "config.h"
+#include "affinity.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <pthread.h>
+#include <sched.h>
+
+/* Set up before the threads are started, and only read after that */
+static int *cpus;
+static int ncpus;
+static int nworkers;
+
+static bool bind_cpus(const int *list, int n) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int ii = 0; ii < n; ++ii) {
+        CPU_SET(list[ii], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+static bool add_cpu(int cpu) {
+    for (int ii = 0; ii < ncpus; ++ii) {
+        if (cpus[ii] == cpu) {
+            return true;
+        }
+    }
+    int *ptr = realloc(cpus, (ncpus + 1) * sizeof(*cpus));
+    if (ptr == NULL) {
+        return false;
+    }
+    cpus = ptr;
+    cpus[ncpus++] = cpu;
+    return true;
+}
+
+bool affinity_init(const char *list, char *err, size_t errsz) {
+    const char *p = list;
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            goto bad;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                goto bad;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            goto bad;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            if (!add_cpu((int)cpu)) {
+                snprintf(err, errsz, "Failed to allocate memory");
+                return false;
+            }
+        }
+        if (*end == ',') {
+            ++end;
+        } else if (*end != '\0') {
+            goto bad;
+        }
+        p = end;
+    }
+    if (ncpus == 0) {
+        goto bad;
+    }
+
+    if (!bind_cpus(cpus, ncpus)) {
+        snprintf(err, errsz, "Can't run on the CPUs %s", list);
+        return false;
+    }
+    return true;
+
+bad:
+    snprintf(err, errsz, "Invalid CPU list: %s", list);
+    return false;
+}
+
+void affinity_set_workers(int nthr) {
+    nworkers = nthr;
+}
+
+int affinity_worker_cpu(int index) {
+    if (ncpus == 0 || index < 0 || index >= nworkers) {
+        return -1;
+    }
+    return cpus[index % ncpus];
+}
+
+bool affinity_bind_worker(int index) {
+    int cpu = affinity_worker_cpu(index);
+    if (cpu == -1) {
+        return ncpus == 0 || bind_cpus(cpus, ncpus);
+    }
+    return bind_cpus(&cpu, 1);
+}
+
+void affinity_bind_background(void) {
+    if (ncpus > nworkers) {
+        bind_cpus(cpus + nworkers, ncpus - nworkers);
+    } else if (ncpus > 0) {
+        bind_cpus(cpus, ncpus);
+    }
+}
+
+#else
+
+bool affinity_init(const char *list, char *err, size_t errsz) {
+    snprintf(err, errsz, "CPU affinity is not supported on this platform");
+    return false;
+}
+
+void affinity_set_workers(int nthr) {
+}
+
+int affinity_worker_cpu(int index) {
+    return -1;
+}
+
+bool affinity_bind_worker(int index) {
+    return true;
+}
+
+void affinity_bind_background(void) {
+}
+#endif
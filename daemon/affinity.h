@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Where the threads run (-Y). Worker thread n is pinned to the nth CPU of
+ * the list (around again if there are more workers than CPUs), and its
+ * SO_REUSEPORT listening socket (-N) asks for the connections whose
+ * packets arrive on that CPU. The other threads of the daemon run on all
+ * the CPUs of the list, and the background threads of the engines and
+ * extensions (place_background_thread in the server API) on the ones that
+ * don't have a worker, or on all of them when every one has.
+ *
+ * There is no NUMA policy of our own: a list of the CPUs of one node keeps
+ * memcached there, and the memory follows the thread that touches it
+ * first.
+ */
+
+/**
+ * Take the CPU list ("0-3,8,10-11") and move the calling thread (and so
+ * every thread it starts from now on) to those CPUs.
+ *
+ * @param err where to put what went wrong
+ * @return false if the list doesn't make sense
+ */
+bool affinity_init(const char *list, char *err, size_t errsz);
+
+/**
+ * The first nworkers CPUs of the list are for the worker threads (set
+ * before they're started)
+ */
+void affinity_set_workers(int nworkers);
+
+/**
+ * The CPU worker thread index is pinned to, -1 if it isn't
+ */
+int affinity_worker_cpu(int index);
+
+/**
+ * Pin the calling thread to the CPU of worker index (or to all the CPUs
+ * of the list if index isn't a worker)
+ *
+ * @return false if we were told to and couldn't
+ */
+bool affinity_bind_worker(int index);
+
+/**
+ * Move the calling thread to the CPUs for the background threads
+ */
+void affinity_bind_background(void);
+
+#endif
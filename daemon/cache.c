@@ -26,8 +26,18 @@ static bool inFreeList(cache_t *cache, void *object) {
     }
     return rv;
 }
+
+static bool inMagazine(struct cache_magazine *mag, void *object) {
+    bool rv = false;
+    for (int i = 0; mag != NULL && i < mag->count; i++) {
+        rv |= mag->ptr[i] == object;
+    }
+    return rv;
+}
 #endif
 
+static void release_magazine(void *arg);
+
 cache_t* cache_create(const char *name, size_t bufsize, size_t align,
                       cache_constructor_t* constructor,
                       cache_destructor_t* destructor) {
@@ -42,6 +52,14 @@ cache_t* cache_create(const char *name, size_t bufsize, size_t align,
         return NULL;
     }
 
+    if (pthread_key_create(&ret->key, release_magazine) != 0) {
+        pthread_mutex_destroy(&ret->mutex);
+        free(ret);
+        free(nm);
+        free(ptr);
+        return NULL;
+    }
+
     ret->name = nm;
     ret->ptr = ptr;
     ret->freetotal = initial_pool_size;
@@ -66,13 +84,90 @@ static inline void* get_object(void *ptr) {
 #endif
 }
 
+static void destroy_object(cache_t *cache, void *ptr) {
+    if (cache->destructor) {
+        cache->destructor(get_object(ptr), NULL);
+    }
+    free(ptr);
+}
+
+/*
+ * Put an object in the depot. Called with the mutex held.
+ */
+static void depot_push(cache_t *cache, void *ptr) {
+    assert(!inFreeList(cache, ptr));
+    if (cache->freecurr < cache->freetotal) {
+        cache->ptr[cache->freecurr++] = ptr;
+        assert(inFreeList(cache, ptr));
+    } else {
+        /* try to enlarge free connections array */
+        size_t newtotal = cache->freetotal * 2;
+        void **new_free = realloc(cache->ptr, sizeof(char *) * newtotal);
+        if (new_free) {
+            cache->freetotal = newtotal;
+            cache->ptr = new_free;
+            cache->ptr[cache->freecurr++] = ptr;
+            assert(inFreeList(cache, ptr));
+        } else {
+            destroy_object(cache, ptr);
+            assert(!inFreeList(cache, ptr));
+        }
+    }
+}
+
+/*
+ * Called when a thread exits: give its objects back to the depot.
+ */
+static void release_magazine(void *arg) {
+    struct cache_magazine *mag = arg;
+    cache_t *cache = mag->cache;
+
+    pthread_mutex_lock(&cache->mutex);
+    while (mag->count > 0) {
+        depot_push(cache, mag->ptr[--mag->count]);
+    }
+    struct cache_magazine **pp = &cache->magazines;
+    while (*pp != mag) {
+        pp = &(*pp)->next;
+    }
+    *pp = mag->next;
+    pthread_mutex_unlock(&cache->mutex);
+    free(mag);
+}
+
+/*
+ * Get the magazine of the calling thread, creating it the first time.
+ * If we fail to create it we go through the depot every time.
+ */
+static struct cache_magazine *get_magazine(cache_t *cache) {
+    struct cache_magazine *mag = pthread_getspecific(cache->key);
+    if (mag == NULL && (mag = calloc(1, sizeof(*mag))) != NULL) {
+        mag->cache = cache;
+        if (pthread_setspecific(cache->key, mag) != 0) {
+            free(mag);
+            return NULL;
+        }
+        pthread_mutex_lock(&cache->mutex);
+        mag->next = cache->magazines;
+        cache->magazines = mag;
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    return mag;
+}
+
 void cache_destroy(cache_t *cache) {
-    while (cache->freecurr > 0) {
-        void *ptr = cache->ptr[--cache->freecurr];
-        if (cache->destructor) {
-            cache->destructor(get_object(ptr), NULL);
+    /* The magazines of the threads that are still around */
+    pthread_key_delete(cache->key);
+    while (cache->magazines != NULL) {
+        struct cache_magazine *mag = cache->magazines;
+        cache->magazines = mag->next;
+        while (mag->count > 0) {
+            destroy_object(cache, mag->ptr[--mag->count]);
         }
-        free(ptr);
+        free(mag);
+    }
+    while (cache->freecurr > 0) {
+        destroy_object(cache, cache->ptr[--cache->freecurr]);
     }
     free(cache->name);
     free(cache->ptr);
@@ -81,13 +176,29 @@ void cache_destroy(cache_t *cache) {
 }
 
 void* cache_alloc(cache_t *cache) {
-    void *ret;
+    void *ret = NULL;
     void *object;
-    pthread_mutex_lock(&cache->mutex);
-    if (cache->freecurr > 0) {
-        ret = cache->ptr[--cache->freecurr];
+    struct cache_magazine *mag = get_magazine(cache);
+
+    if (mag == NULL || mag->count == 0) {
+        /* Refill half of the magazine from the depot */
+        pthread_mutex_lock(&cache->mutex);
+        if (cache->freecurr > 0) {
+            ret = cache->ptr[--cache->freecurr];
+            assert(!inFreeList(cache, ret));
+            while (mag != NULL && mag->count < CACHE_MAGAZINE_SIZE / 2 &&
+                   cache->freecurr > 0) {
+                mag->ptr[mag->count++] = cache->ptr[--cache->freecurr];
+            }
+        }
+        pthread_mutex_unlock(&cache->mutex);
+    } else {
+        ret = mag->ptr[--mag->count];
+    }
+    assert(ret == NULL || !inMagazine(mag, ret));
+
+    if (ret != NULL) {
         object = get_object(ret);
-        assert(!inFreeList(cache, ret));
     } else {
         object = ret = malloc(cache->bufsize);
         if (ret != NULL) {
@@ -100,7 +211,6 @@ void* cache_alloc(cache_t *cache) {
             }
         }
     }
-    pthread_mutex_unlock(&cache->mutex);
 
 #ifndef NDEBUG
     if (object != NULL) {
@@ -118,7 +228,6 @@ void* cache_alloc(cache_t *cache) {
 
 void cache_free(cache_t *cache, void *object) {
     void *ptr = object;
-    pthread_mutex_lock(&cache->mutex);
 
 #ifndef NDEBUG
     /* validate redzone... */
@@ -126,7 +235,6 @@ void cache_free(cache_t *cache, void *object) {
                &redzone_pattern, sizeof(redzone_pattern)) != 0) {
         raise(SIGABRT);
         cache_error = 1;
-        pthread_mutex_unlock(&cache->mutex);
         return;
     }
     uint64_t *pre = ptr;
@@ -134,32 +242,27 @@ void cache_free(cache_t *cache, void *object) {
     if (*pre != redzone_pattern) {
         raise(SIGABRT);
         cache_error = -1;
-        pthread_mutex_unlock(&cache->mutex);
         return;
     }
     ptr = pre;
 #endif
-    assert(!inFreeList(cache, ptr));
-    if (cache->freecurr < cache->freetotal) {
-        cache->ptr[cache->freecurr++] = ptr;
-        assert(inFreeList(cache, ptr));
+
+    struct cache_magazine *mag = get_magazine(cache);
+    assert(!inMagazine(mag, ptr));
+    if (mag != NULL && mag->count < CACHE_MAGAZINE_SIZE) {
+        mag->ptr[mag->count++] = ptr;
+        return;
+    }
+
+    /* Move half of the magazine to the depot */
+    pthread_mutex_lock(&cache->mutex);
+    while (mag != NULL && mag->count > CACHE_MAGAZINE_SIZE / 2) {
+        depot_push(cache, mag->ptr[--mag->count]);
+    }
+    if (mag != NULL) {
+        mag->ptr[mag->count++] = ptr;
     } else {
-        /* try to enlarge free connections array */
-        size_t newtotal = cache->freetotal * 2;
-        void **new_free = realloc(cache->ptr, sizeof(char *) * newtotal);
-        if (new_free) {
-            cache->freetotal = newtotal;
-            cache->ptr = new_free;
-            cache->ptr[cache->freecurr++] = ptr;
-            assert(inFreeList(cache, ptr));
-        } else {
-            if (cache->destructor) {
-                cache->destructor(ptr, NULL);
-            }
-            free(ptr);
-            assert(!inFreeList(cache, ptr));
-        }
+        depot_push(cache, ptr);
     }
     pthread_mutex_unlock(&cache->mutex);
 }
-
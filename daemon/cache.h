@@ -38,6 +38,21 @@ typedef int cache_constructor_t(void* obj, void* notused1, int notused2);
  */
 typedef void cache_destructor_t(void* obj, void* notused);
 
+/** The number of free objects a thread keeps for itself */
+#define CACHE_MAGAZINE_SIZE 32
+
+/**
+ * The free objects of a thread (see cache_alloc()). Only the thread
+ * owning it touches the objects, next is protected by the mutex of the
+ * cache.
+ */
+struct cache_magazine {
+    struct cache_magazine *next;
+    void *cache;
+    int count;
+    void *ptr[CACHE_MAGAZINE_SIZE];
+};
+
 /**
  * Definition of the structure to keep track of the internal details of
  * the cache allocator. Touching any of these variables results in
@@ -48,7 +63,7 @@ typedef struct {
     pthread_mutex_t mutex;
     /** Name of the cache objects in this cache (provided by the caller) */
     char *name;
-    /** List of pointers to available buffers in this cache */
+    /** List of pointers to available buffers in this cache (the depot) */
     void **ptr;
     /** The size of each element in this cache */
     size_t bufsize;
@@ -60,6 +75,10 @@ typedef struct {
     cache_constructor_t* constructor;
     /** The destructor to be called each time before we release memory */
     cache_destructor_t* destructor;
+    /** The magazine of the calling thread */
+    pthread_key_t key;
+    /** All of the magazines of the cache */
+    struct cache_magazine *magazines;
 } cache_t;
 
 /**
@@ -88,7 +107,8 @@ cache_t* cache_create(const char* name, size_t bufsize, size_t align,
  *
  * Destroy and invalidate an object cache. You should return all buffers allocated
  * with cache_alloc by using cache_free before calling this function. Not doing
- * so results in undefined behavior (the buffers may or may not be invalidated)
+ * so results in undefined behavior (the buffers may or may not be invalidated).
+ * No other thread may use the cache while (or after) it's destroyed.
  *
  * @param handle the handle to the object cache to destroy.
  */
@@ -96,6 +116,12 @@ void cache_destroy(cache_t* handle);
 /**
  * Allocate an object from the cache.
  *
+ * Every thread has a magazine of up to CACHE_MAGAZINE_SIZE free objects,
+ * and allocates from it (and frees to it) without taking the mutex. When
+ * it's empty (or full) we move half of a magazine from (or to) the depot
+ * shared by the threads, with the mutex held. The magazine of a thread
+ * goes back to the depot when the thread exits.
+ *
  * @param handle the handle to the object cache to allocate from
  * @return a pointer to an initialized object from the cache, or NULL if
  *         the allocation cannot be satisfied.
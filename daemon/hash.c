@@ -2,14 +2,19 @@
 /*
  * Hash table
  *
- * The hash function used here is by Bob Jenkins, 1996:
+ * The default hash function used here is by Bob Jenkins, 1996:
  *    <http://burtleburtle.net/bob/hash/doobs.html>
  *       "By Bob Jenkins, 1996.  bob_jenkins@burtleburtle.net.
  *       You may use this code any way you wish, private, educational,
  *       or commercial.  It's free."
  *
+ * and the alternative (-H murmur3) is MurmurHash3 (x86_32) by Austin
+ * Appleby, which is in the public domain:
+ *    <https://github.com/aappleby/smhasher>
  */
 #include "config.h"
+#include <string.h>
+
 #include "memcached.h"
 
 /*
@@ -118,7 +123,7 @@ and these came close:
 }
 
 #if HASH_LITTLE_ENDIAN == 1
-uint32_t hash(
+uint32_t jenkins_hash(
   const void *key,       /* the key to hash */
   size_t      length,    /* length of the key */
   const uint32_t    initval)   /* initval */
@@ -299,7 +304,7 @@ uint32_t hash(
  * from hashlittle() on all machines.  hashbig() takes advantage of
  * big-endian byte ordering.
  */
-uint32_t hash( const void *key, size_t length, const uint32_t initval)
+uint32_t jenkins_hash( const void *key, size_t length, const uint32_t initval)
 {
   uint32_t a,b,c;
   union { const void *ptr; size_t i; } u; /* to cast key to (size_t) happily */
@@ -425,3 +430,81 @@ uint32_t hash( const void *key, size_t length, const uint32_t initval)
 #else /* HASH_XXX_ENDIAN == 1 */
 #error Must define HASH_BIG_ENDIAN or HASH_LITTLE_ENDIAN
 #endif /* HASH_XXX_ENDIAN == 1 */
+
+static inline uint32_t rotl32(uint32_t x, int8_t r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32_t fmix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+uint32_t murmur3_hash(const void *key, size_t length, const uint32_t initval)
+{
+    const uint8_t *data = key;
+    const size_t nblocks = length / 4;
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+    uint32_t h1 = initval;
+    uint32_t k1;
+
+    for (size_t i = 0; i < nblocks; i++) {
+        /* the keys aren't aligned */
+        memcpy(&k1, data + i * 4, sizeof(k1));
+        k1 *= c1;
+        k1 = rotl32(k1, 15);
+        k1 *= c2;
+
+        h1 ^= k1;
+        h1 = rotl32(h1, 13);
+        h1 = h1 * 5 + 0xe6546b64;
+    }
+
+    const uint8_t *tail = data + nblocks * 4;
+    k1 = 0;
+    switch (length & 3) {
+    case 3: k1 ^= (uint32_t)tail[2] << 16;
+            /* FALLTHROUGH */
+    case 2: k1 ^= (uint32_t)tail[1] << 8;
+            /* FALLTHROUGH */
+    case 1: k1 ^= tail[0];
+            k1 *= c1;
+            k1 = rotl32(k1, 15);
+            k1 *= c2;
+            h1 ^= k1;
+    }
+
+    h1 ^= (uint32_t)length;
+    return fmix32(h1);
+}
+
+static const struct {
+    const char *name;
+    hash_func func;
+} hash_algorithms[] = {
+    { "jenkins", jenkins_hash },
+    { "murmur3", murmur3_hash }
+};
+
+hash_func hash = jenkins_hash;
+static const char *hash_name = "jenkins";
+
+bool hash_init(const char *name) {
+    for (size_t ii = 0; ii < sizeof(hash_algorithms) / sizeof(hash_algorithms[0]); ++ii) {
+        if (strcmp(hash_algorithms[ii].name, name) == 0) {
+            hash = hash_algorithms[ii].func;
+            hash_name = hash_algorithms[ii].name;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *hash_algorithm(void) {
+    return hash_name;
+}
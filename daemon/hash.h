@@ -5,7 +5,24 @@
 extern "C" {
 #endif
 
-uint32_t hash(const void *key, size_t length, const uint32_t initval);
+typedef uint32_t (*hash_func)(const void *key, size_t length,
+                              const uint32_t initval);
+
+uint32_t jenkins_hash(const void *key, size_t length, const uint32_t initval);
+uint32_t murmur3_hash(const void *key, size_t length, const uint32_t initval);
+
+/** The hash function selected with hash_init() (jenkins by default) */
+extern hash_func hash;
+
+/**
+ * Select the hash function used for the keys
+ * @param name "jenkins" or "murmur3"
+ * @return false if there is no hash function with that name
+ */
+bool hash_init(const char *name);
+
+/** The name of the hash function we use */
+const char *hash_algorithm(void);
 
 #ifdef    __cplusplus
 }
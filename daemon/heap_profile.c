@@ -0,0 +1,376 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Sampled heap profile (see heap_profile.h)
+ */
+#include "config.h"
+#include "heap_profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+#if defined(HAVE_LINK_H) && defined(HAVE_DL_ITERATE_PHDR)
+#include <link.h>
+#endif
+
+#define HEAP_PROFILE_BUCKETS 4096
+#define HEAP_PROFILE_MODULES 8
+
+struct heap_sample {
+    struct heap_sample *next;
+    const void *ptr;
+    size_t weight;
+    enum heap_owner owner;
+    int nframes;
+    void *frames[HEAP_PROFILE_FRAMES];
+};
+
+/* The live samples with the same owner and call stack */
+struct heap_stack {
+    const struct heap_sample *sample;
+    uint64_t bytes;
+    uint64_t samples;
+    char **symbols;
+};
+
+struct heap_module {
+    uintptr_t start;
+    uintptr_t end;
+    enum heap_owner owner;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    size_t interval;
+    struct heap_sample *buckets[HEAP_PROFILE_BUCKETS];
+    struct heap_owner_stats owners[HEAP_NOWNERS];
+    struct heap_module modules[HEAP_PROFILE_MODULES];
+    int nmodules;
+} profile = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/*
+ * The hooks run inside malloc and free, so they can't use the pthread
+ * keys (setting one up may allocate). busy is set while the profiler
+ * allocates or frees on its own behalf, so it doesn't see itself.
+ */
+static __thread struct {
+    size_t bytes;
+    enum heap_owner owner;
+    bool busy;
+} heap_thread;
+
+static const char *owner_names[HEAP_NOWNERS] = {
+    [HEAP_OTHER] = "other",
+    [HEAP_CONNECTION] = "connection",
+    [HEAP_ENGINE] = "engine",
+    [HEAP_TAP] = "tap",
+    [HEAP_STATS] = "stats"
+};
+
+static inline struct heap_sample **heap_bucket(const void *ptr) {
+    uintptr_t p = (uintptr_t)ptr >> 4;
+    return &profile.buckets[(p ^ (p >> 12)) % HEAP_PROFILE_BUCKETS];
+}
+
+bool heap_profile_init(size_t interval) {
+    if (interval == 0) {
+        return false;
+    }
+#ifdef HAVE_EXECINFO_H
+    /* The first backtrace() loads the unwinder, get it over with here */
+    void *frames[HEAP_PROFILE_FRAMES];
+    heap_thread.busy = true;
+    backtrace(frames, HEAP_PROFILE_FRAMES);
+    heap_thread.busy = false;
+#endif
+    pthread_mutex_lock(&profile.lock);
+    profile.interval = interval;
+    pthread_mutex_unlock(&profile.lock);
+    return true;
+}
+
+#if defined(HAVE_LINK_H) && defined(HAVE_DL_ITERATE_PHDR)
+/* Find the executable segment of the object containing m->start */
+static int heap_module_find(struct dl_phdr_info *info, size_t size, void *arg) {
+    struct heap_module *m = arg;
+    (void)size;
+    for (int ii = 0; ii < info->dlpi_phnum; ++ii) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[ii];
+        if (ph->p_type != PT_LOAD || (ph->p_flags & PF_X) == 0) {
+            continue;
+        }
+        uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+        if (m->start >= start && m->start < start + ph->p_memsz) {
+            m->start = start;
+            m->end = start + ph->p_memsz;
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
+bool heap_profile_add_module(const void *addr, enum heap_owner owner) {
+    bool ret = false;
+#if defined(HAVE_LINK_H) && defined(HAVE_DL_ITERATE_PHDR)
+    struct heap_module m = { .start = (uintptr_t)addr, .owner = owner };
+    if (dl_iterate_phdr(heap_module_find, &m) == 0) {
+        return false;
+    }
+    pthread_mutex_lock(&profile.lock);
+    if (profile.nmodules < HEAP_PROFILE_MODULES) {
+        profile.modules[profile.nmodules++] = m;
+        ret = true;
+    }
+    pthread_mutex_unlock(&profile.lock);
+#else
+    (void)addr;
+    (void)owner;
+#endif
+    return ret;
+}
+
+enum heap_owner heap_profile_set_owner(enum heap_owner owner) {
+    enum heap_owner prev = heap_thread.owner;
+    heap_thread.owner = owner;
+    return prev;
+}
+
+/*
+ * The modules get the allocations they make, but a stats buffer is a
+ * stats buffer even when it's the engine adding to it. Called with the
+ * lock held.
+ */
+static enum heap_owner heap_classify(const struct heap_sample *s,
+                                     enum heap_owner owner) {
+    if (owner == HEAP_STATS) {
+        return owner;
+    }
+    for (int ii = 0; ii < s->nframes; ++ii) {
+        uintptr_t pc = (uintptr_t)s->frames[ii];
+        for (int jj = 0; jj < profile.nmodules; ++jj) {
+            if (pc >= profile.modules[jj].start &&
+                pc < profile.modules[jj].end) {
+                return profile.modules[jj].owner;
+            }
+        }
+    }
+    return owner;
+}
+
+void heap_profile_new_hook(const void *ptr, size_t size) {
+    size_t interval = *(volatile size_t *)&profile.interval;
+    if (interval == 0 || ptr == NULL || heap_thread.busy) {
+        return;
+    }
+
+    heap_thread.bytes += size;
+    if (heap_thread.bytes < interval) {
+        return;
+    }
+    heap_thread.bytes %= interval;
+
+    heap_thread.busy = true;
+    struct heap_sample *s = malloc(sizeof(*s));
+    if (s != NULL) {
+        s->ptr = ptr;
+        s->weight = size > interval ? size : interval;
+        s->nframes = 0;
+#ifdef HAVE_EXECINFO_H
+        /* Leave ourselves out */
+        void *frames[HEAP_PROFILE_FRAMES + 1];
+        int nframes = backtrace(frames, HEAP_PROFILE_FRAMES + 1);
+        if (nframes > 1) {
+            s->nframes = nframes - 1;
+            memcpy(s->frames, frames + 1, s->nframes * sizeof(void *));
+        }
+#endif
+
+        struct heap_sample **bucket = heap_bucket(ptr);
+        pthread_mutex_lock(&profile.lock);
+        s->owner = heap_classify(s, heap_thread.owner);
+        s->next = *bucket;
+        *bucket = s;
+        struct heap_owner_stats *o = &profile.owners[s->owner];
+        o->alloc_bytes += s->weight;
+        o->live_bytes += s->weight;
+        o->live_samples++;
+        pthread_mutex_unlock(&profile.lock);
+    }
+    heap_thread.busy = false;
+}
+
+void heap_profile_delete_hook(const void *ptr) {
+    struct heap_sample **pos = heap_bucket(ptr);
+    /* Most of what's freed was never sampled */
+    if (ptr == NULL || *(struct heap_sample * volatile *)pos == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&profile.lock);
+    while (*pos != NULL && (*pos)->ptr != ptr) {
+        pos = &(*pos)->next;
+    }
+    struct heap_sample *s = *pos;
+    if (s != NULL) {
+        *pos = s->next;
+        struct heap_owner_stats *o = &profile.owners[s->owner];
+        o->live_bytes -= s->weight;
+        o->live_samples--;
+    }
+    pthread_mutex_unlock(&profile.lock);
+
+    if (s != NULL) {
+        bool busy = heap_thread.busy;
+        heap_thread.busy = true;
+        free(s);
+        heap_thread.busy = busy;
+    }
+}
+
+bool heap_profile_enabled(void) {
+    return *(volatile size_t *)&profile.interval != 0;
+}
+
+size_t heap_profile_interval(void) {
+    return *(volatile size_t *)&profile.interval;
+}
+
+const char *heap_profile_owner_name(enum heap_owner owner) {
+    return owner < HEAP_NOWNERS ? owner_names[owner] : "unknown";
+}
+
+void heap_profile_stats(struct heap_owner_stats stats[HEAP_NOWNERS]) {
+    pthread_mutex_lock(&profile.lock);
+    memcpy(stats, profile.owners, sizeof(profile.owners));
+    pthread_mutex_unlock(&profile.lock);
+}
+
+static int heap_sample_compare(const void *a, const void *b) {
+    const struct heap_sample *x = a;
+    const struct heap_sample *y = b;
+    if (x->owner != y->owner) {
+        return x->owner < y->owner ? -1 : 1;
+    }
+    if (x->nframes != y->nframes) {
+        return x->nframes < y->nframes ? -1 : 1;
+    }
+    return memcmp(x->frames, y->frames, x->nframes * sizeof(void *));
+}
+
+static int heap_stack_compare(const void *a, const void *b) {
+    const struct heap_stack *x = a;
+    const struct heap_stack *y = b;
+    if (x->bytes != y->bytes) {
+        return x->bytes > y->bytes ? -1 : 1;
+    }
+    return 0;
+}
+
+char *heap_profile_dump(int *length) {
+    const char *header = "heap profile: %"PRIu64" bytes in %"PRIu64
+                         " samples, 1 sample every %zu bytes\r\n";
+    const char *format = "%"PRIu64" bytes in %"PRIu64" samples (%s)\r\n";
+    bool busy = heap_thread.busy;
+    struct heap_sample *samples = NULL;
+    struct heap_stack *stacks = NULL;
+    uint64_t nsamples = 0;
+    size_t nstacks = 0;
+    char *buf = NULL;
+
+    /* We don't want to see the copies (or to wait for the lock in our
+     * own hook while we hold it) */
+    heap_thread.busy = true;
+    pthread_mutex_lock(&profile.lock);
+    for (int ii = 0; ii < HEAP_NOWNERS; ++ii) {
+        nsamples += profile.owners[ii].live_samples;
+    }
+    if (nsamples > 0 &&
+        (samples = malloc(nsamples * sizeof(*samples))) == NULL) {
+        pthread_mutex_unlock(&profile.lock);
+        heap_thread.busy = busy;
+        return NULL;
+    }
+    size_t count = 0;
+    for (int ii = 0; ii < HEAP_PROFILE_BUCKETS; ++ii) {
+        for (struct heap_sample *s = profile.buckets[ii]; s; s = s->next) {
+            samples[count++] = *s;
+        }
+    }
+    size_t interval = profile.interval;
+    pthread_mutex_unlock(&profile.lock);
+
+    if (count > 0) {
+        qsort(samples, count, sizeof(*samples), heap_sample_compare);
+        if ((stacks = calloc(count, sizeof(*stacks))) == NULL) {
+            goto done;
+        }
+    }
+
+    uint64_t total = 0;
+    for (size_t ii = 0; ii < count; ++ii) {
+        if (nstacks == 0 ||
+            heap_sample_compare(stacks[nstacks - 1].sample, &samples[ii]) != 0) {
+            stacks[nstacks++].sample = &samples[ii];
+        }
+        stacks[nstacks - 1].bytes += samples[ii].weight;
+        stacks[nstacks - 1].samples++;
+        total += samples[ii].weight;
+    }
+    if (nstacks > 1) {
+        qsort(stacks, nstacks, sizeof(*stacks), heap_stack_compare);
+    }
+
+    /* Room for the numbers (20 digits each) and every frame */
+    size_t size = strlen(header) + 3 * 20 + sizeof("END\r\n");
+    for (size_t ii = 0; ii < nstacks; ++ii) {
+        const struct heap_sample *s = stacks[ii].sample;
+        size += strlen(format) + 2 * 20 + strlen(owner_names[s->owner]);
+#ifdef HAVE_EXECINFO_H
+        stacks[ii].symbols = backtrace_symbols((void * const *)s->frames,
+                                               s->nframes);
+#endif
+        for (int jj = 0; jj < s->nframes; ++jj) {
+            size += sizeof("    \r\n") + 2 + 2 * sizeof(void *);
+            if (stacks[ii].symbols != NULL) {
+                size += strlen(stacks[ii].symbols[jj]);
+            }
+        }
+    }
+
+    if ((buf = malloc(size)) == NULL) {
+        goto done;
+    }
+    int pos = snprintf(buf, size, header, total, (uint64_t)count, interval);
+    for (size_t ii = 0; ii < nstacks; ++ii) {
+        const struct heap_sample *s = stacks[ii].sample;
+        pos += snprintf(buf + pos, size - pos, format, stacks[ii].bytes,
+                        stacks[ii].samples, owner_names[s->owner]);
+        for (int jj = 0; jj < s->nframes; ++jj) {
+            if (stacks[ii].symbols != NULL) {
+                pos += snprintf(buf + pos, size - pos, "    %s\r\n",
+                                stacks[ii].symbols[jj]);
+            } else {
+                pos += snprintf(buf + pos, size - pos, "    %p\r\n",
+                                s->frames[jj]);
+            }
+        }
+    }
+    memcpy(buf + pos, "END\r\n", 6);
+    *length = pos + 5;
+
+done:
+    for (size_t ii = 0; ii < nstacks; ++ii) {
+        free(stacks[ii].symbols);
+    }
+    free(stacks);
+    free(samples);
+    heap_thread.busy = busy;
+    return buf;
+}
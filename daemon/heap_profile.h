@@ -0,0 +1,86 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef HEAP_PROFILE_H
+#define HEAP_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A sampled heap profiler driven by the allocator hooks (see
+ * alloc_hooks.h). Every thread takes a sample each time it has allocated
+ * another interval bytes, and remembers the call stack of the sample
+ * until the memory is freed again. A sample stands for interval bytes
+ * (or its own size if it's bigger), so the live samples estimate where
+ * the heap that isn't in the slabs goes.
+ */
+
+/**
+ * Who we charge an allocation to
+ */
+enum heap_owner {
+    HEAP_OTHER = 0,
+    /** the connection state machine (buffers, iovecs, msghdrs...) */
+    HEAP_CONNECTION,
+    /** anything allocated by code in the engine modules */
+    HEAP_ENGINE,
+    /** TAP streams */
+    HEAP_TAP,
+    /** the stats buffers */
+    HEAP_STATS,
+    HEAP_NOWNERS
+};
+
+/** The deepest stack we record */
+#define HEAP_PROFILE_FRAMES 16
+
+struct heap_owner_stats {
+    /** estimated bytes allocated since we started sampling */
+    uint64_t alloc_bytes;
+    /** estimated bytes still allocated */
+    uint64_t live_bytes;
+    /** the samples behind live_bytes */
+    uint64_t live_samples;
+};
+
+/**
+ * Start sampling every interval bytes. The caller installs
+ * heap_profile_new_hook / heap_profile_delete_hook in the allocator.
+ */
+bool heap_profile_init(size_t interval);
+
+/**
+ * Charge the allocations made by code in the module (shared object)
+ * containing addr to owner, whatever the thread is doing. Call it
+ * before the hooks are installed.
+ */
+bool heap_profile_add_module(const void *addr, enum heap_owner owner);
+
+/**
+ * Charge the allocations of the calling thread to owner (until the
+ * next call)
+ *
+ * @return the previous owner of the thread
+ */
+enum heap_owner heap_profile_set_owner(enum heap_owner owner);
+
+void heap_profile_new_hook(const void *ptr, size_t size);
+void heap_profile_delete_hook(const void *ptr);
+
+bool heap_profile_enabled(void);
+size_t heap_profile_interval(void);
+const char *heap_profile_owner_name(enum heap_owner owner);
+
+/**
+ * Get the totals of every owner
+ */
+void heap_profile_stats(struct heap_owner_stats stats[HEAP_NOWNERS]);
+
+/**
+ * Describe the live samples, grouped by owner and call stack, biggest
+ * first. The caller frees the buffer.
+ */
+/*@null@*/
+char *heap_profile_dump(int *length);
+
+#endif
@@ -0,0 +1,633 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Batched socket I/O through io_uring or an I/O completion port
+ * (see io_ring.h)
+ */
+#include "config.h"
+#include "io_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && \
+    defined(IORING_FEAT_FAST_POLL) && defined(IORING_FEAT_NODROP)
+
+struct io_ring {
+    int fd;
+    struct {
+        unsigned int *head;
+        unsigned int *tail;
+        unsigned int *mask;
+        unsigned int *flags;
+        unsigned int *array;
+        unsigned int entries;
+        /* requests queued but not yet made visible to the kernel */
+        unsigned int local_tail;
+        struct io_uring_sqe *sqes;
+    } sq;
+    struct {
+        unsigned int *head;
+        unsigned int *tail;
+        unsigned int *mask;
+        struct io_uring_cqe *cqes;
+    } cq;
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_map_size;
+};
+
+static int sys_io_uring_setup(unsigned int entries,
+                              struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode,
+                                 void *arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void io_ring_unmap(struct io_ring *ring) {
+    if (ring->sq.sqes != NULL) {
+        munmap(ring->sq.sqes, ring->sqes_map_size);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != NULL) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+}
+
+static void *io_ring_map(int fd, size_t size, off_t offset) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+struct io_ring *io_ring_create(unsigned int entries, unsigned int cq_entries,
+                               int efd) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (cq_entries > entries) {
+        params.flags |= IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+#ifdef IORING_SETUP_CLAMP
+        params.flags |= IORING_SETUP_CLAMP;
+#endif
+    }
+
+    struct io_ring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd == -1) {
+        free(ring);
+        return NULL;
+    }
+
+    /*
+     * We don't want to deal with dropped completions or with the kernel
+     * handing us -EAGAIN for sockets that aren't ready yet.
+     */
+    const unsigned int required = IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL;
+    if ((params.features & required) != required) {
+        goto error;
+    }
+
+    ring->sq_map_size = params.sq_off.array +
+        params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = io_ring_map(ring->fd, ring->sq_map_size,
+                               IORING_OFF_SQ_RING);
+    if (ring->sq_map == NULL) {
+        goto error;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = io_ring_map(ring->fd, ring->cq_map_size,
+                                   IORING_OFF_CQ_RING);
+        if (ring->cq_map == NULL) {
+            goto error;
+        }
+    }
+    ring->sqes_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq.sqes = io_ring_map(ring->fd, ring->sqes_map_size,
+                                IORING_OFF_SQES);
+    if (ring->sq.sqes == NULL) {
+        goto error;
+    }
+
+    char *sq = ring->sq_map;
+    ring->sq.head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq.tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq.mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq.flags = (unsigned int *)(sq + params.sq_off.flags);
+    ring->sq.array = (unsigned int *)(sq + params.sq_off.array);
+    ring->sq.entries = params.sq_entries;
+    ring->sq.local_tail = *ring->sq.tail;
+
+    char *cq = ring->cq_map;
+    ring->cq.head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq.tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq.mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cq.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_EVENTFD,
+                              &efd, 1) == -1) {
+        goto error;
+    }
+
+    return ring;
+
+ error:
+    io_ring_unmap(ring);
+    close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+void io_ring_destroy(struct io_ring *ring) {
+    if (ring != NULL) {
+        io_ring_unmap(ring);
+        close(ring->fd);
+        free(ring);
+    }
+}
+
+int io_ring_submit(struct io_ring *ring) {
+    unsigned int head = __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE);
+    unsigned int to_submit = ring->sq.local_tail - head;
+    if (to_submit == 0) {
+        return 0;
+    }
+
+    __atomic_store_n(ring->sq.tail, ring->sq.local_tail, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = sys_io_uring_enter(ring->fd, to_submit, 0, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret;
+}
+
+static struct io_uring_sqe *io_ring_get_sqe(struct io_ring *ring) {
+    unsigned int head = __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE);
+    if (ring->sq.local_tail - head >= ring->sq.entries) {
+        /* The queue is full, so push out what we've got */
+        if (io_ring_submit(ring) == -1) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE);
+        if (ring->sq.local_tail - head >= ring->sq.entries) {
+            return NULL;
+        }
+    }
+
+    unsigned int idx = ring->sq.local_tail & *ring->sq.mask;
+    struct io_uring_sqe *sqe = &ring->sq.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq.array[idx] = idx;
+    ring->sq.local_tail++;
+    return sqe;
+}
+
+bool io_ring_recv(struct io_ring *ring, int fd, void *buf, size_t len,
+                  void *data) {
+    struct io_uring_sqe *sqe = io_ring_get_sqe(ring);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->user_data = (uintptr_t)data;
+    return true;
+}
+
+bool io_ring_sendmsg(struct io_ring *ring, int fd, const struct msghdr *m,
+                     void *data) {
+    struct io_uring_sqe *sqe = io_ring_get_sqe(ring);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)m;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)data;
+    return true;
+}
+
+int io_ring_reap(struct io_ring *ring, io_ring_handler_t *handler) {
+    int total = 0;
+
+    while (true) {
+        unsigned int head = *ring->cq.head;
+        unsigned int tail = __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+#ifdef IORING_SQ_CQ_OVERFLOW
+            /* Let the kernel flush the completions it had to hold back */
+            if (__atomic_load_n(ring->sq.flags, __ATOMIC_ACQUIRE) &
+                IORING_SQ_CQ_OVERFLOW) {
+                if (sys_io_uring_enter(ring->fd, 0, 0,
+                                       IORING_ENTER_GETEVENTS) != -1) {
+                    continue;
+                }
+            }
+#endif
+            break;
+        }
+
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cq.cqes[head & *ring->cq.mask];
+            void *data = (void *)(uintptr_t)cqe->user_data;
+            int res = cqe->res;
+            ++head;
+            /* Release the slot before the handler queues new requests */
+            __atomic_store_n(ring->cq.head, head, __ATOMIC_RELEASE);
+            handler(data, res);
+            ++total;
+        }
+    }
+
+    return total;
+}
+
+const char *io_ring_kind(void) {
+    return "io_uring";
+}
+
+#elif defined(WIN32)
+
+/*
+ * The Windows version runs on an I/O completion port. A socket can only
+ * ever be associated with one port, and the connections move between the
+ * worker threads, so all of the rings share a single port and a thread
+ * blocking on it. That thread hands every completion to the ring the
+ * request was queued on and sends a byte to the ring's socket (the efd we
+ * were created with) once there is something to reap.
+ */
+#include <pthread.h>
+
+struct io_ring_op {
+    /* must be first, GetQueuedCompletionStatus() hands it back to us */
+    WSAOVERLAPPED overlapped;
+    struct io_ring *ring;
+    SOCKET sfd;
+    bool send;
+    WSABUF buf;
+    WSABUF *bufs;
+    DWORD nbufs;
+    void *data;
+    int res;
+    struct io_ring_op *next;
+};
+
+struct io_ring {
+    SOCKET notify;
+    /* the ops nobody uses, only touched by the owning thread */
+    struct io_ring_op *ops;
+    struct io_ring_op *free;
+    /* queued since the last io_ring_submit() */
+    struct io_ring_op *queued;
+    struct io_ring_op **queued_tail;
+
+    /* protects the fields below */
+    pthread_mutex_t lock;
+    struct io_ring_op *done;
+    struct io_ring_op **done_tail;
+    /* issued and not completed yet */
+    unsigned int inflight;
+    /* io_ring_destroy() was called before the last completion came in */
+    bool closed;
+};
+
+static HANDLE io_port;
+static pthread_once_t io_port_once = PTHREAD_ONCE_INIT;
+
+static void io_ring_free(struct io_ring *ring) {
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->ops);
+    free(ring);
+}
+
+/*
+ * Move op to the completions of its ring (called with the lock held)
+ * Returns true if the ring has to be woken up
+ */
+static bool io_ring_complete(struct io_ring *ring, struct io_ring_op *op,
+                             int res) {
+    bool wakeup = (ring->done == NULL);
+    op->res = res;
+    op->next = NULL;
+    *ring->done_tail = op;
+    ring->done_tail = &op->next;
+    return wakeup;
+}
+
+static int io_ring_error(int error) {
+    if (error == WSAECONNRESET || error == WSAECONNABORTED ||
+        error == WSAENETRESET || error == WSAESHUTDOWN) {
+        return -ECONNRESET;
+    }
+    mapErr(error);
+    return errno != 0 ? -errno : -EIO;
+}
+
+static void *io_port_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        DWORD bytes;
+        ULONG_PTR key;
+        LPOVERLAPPED overlapped = NULL;
+        BOOL ok = GetQueuedCompletionStatus(io_port, &bytes, &key,
+                                            &overlapped, INFINITE);
+        if (overlapped == NULL) {
+            if (!ok && GetLastError() == ERROR_ABANDONED_WAIT_0) {
+                /* the port is gone */
+                return NULL;
+            }
+            continue;
+        }
+
+        struct io_ring_op *op = (struct io_ring_op *)overlapped;
+        struct io_ring *ring = op->ring;
+        int res = (int)bytes;
+        if (!ok) {
+            DWORD flags;
+            WSAGetOverlappedResult(op->sfd, &op->overlapped, &bytes,
+                                   FALSE, &flags);
+            res = io_ring_error(WSAGetLastError());
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        --ring->inflight;
+        if (ring->closed) {
+            bool last = (ring->inflight == 0);
+            pthread_mutex_unlock(&ring->lock);
+            if (last) {
+                io_ring_free(ring);
+            }
+            continue;
+        }
+        bool wakeup = io_ring_complete(ring, op, res);
+        pthread_mutex_unlock(&ring->lock);
+
+        if (wakeup) {
+            char c = 1;
+            send(ring->notify, &c, 1, 0);
+        }
+    }
+}
+
+static void io_port_init(void) {
+    io_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    if (io_port != NULL) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, io_port_main, NULL) != 0) {
+            CloseHandle(io_port);
+            io_port = NULL;
+        }
+    }
+}
+
+struct io_ring *io_ring_create(unsigned int entries, unsigned int cq_entries,
+                               int efd) {
+    (void)entries;
+    pthread_once(&io_port_once, io_port_init);
+    if (io_port == NULL || cq_entries == 0) {
+        return NULL;
+    }
+
+    struct io_ring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    /* Every connection has at most one request in flight */
+    ring->ops = calloc(cq_entries, sizeof(*ring->ops));
+    if (ring->ops == NULL || pthread_mutex_init(&ring->lock, NULL) != 0) {
+        free(ring->ops);
+        free(ring);
+        return NULL;
+    }
+    for (unsigned int ii = 0; ii < cq_entries; ++ii) {
+        ring->ops[ii].ring = ring;
+        ring->ops[ii].next = ring->free;
+        ring->free = &ring->ops[ii];
+    }
+    ring->notify = (SOCKET)efd;
+    ring->queued_tail = &ring->queued;
+    ring->done_tail = &ring->done;
+    return ring;
+}
+
+void io_ring_destroy(struct io_ring *ring) {
+    if (ring != NULL) {
+        pthread_mutex_lock(&ring->lock);
+        bool busy = (ring->inflight != 0);
+        ring->closed = true;
+        pthread_mutex_unlock(&ring->lock);
+        if (!busy) {
+            io_ring_free(ring);
+        }
+    }
+}
+
+static struct io_ring_op *io_ring_queue(struct io_ring *ring, int fd,
+                                        void *data) {
+    struct io_ring_op *op = ring->free;
+    if (op == NULL) {
+        return NULL;
+    }
+
+    /* Associating a socket twice fails with ERROR_INVALID_PARAMETER */
+    if (CreateIoCompletionPort((HANDLE)(SOCKET)fd, io_port, 0, 0) == NULL &&
+        GetLastError() != ERROR_INVALID_PARAMETER) {
+        return NULL;
+    }
+
+    ring->free = op->next;
+    memset(&op->overlapped, 0, sizeof(op->overlapped));
+    op->sfd = (SOCKET)fd;
+    op->data = data;
+    op->next = NULL;
+    *ring->queued_tail = op;
+    ring->queued_tail = &op->next;
+    return op;
+}
+
+bool io_ring_recv(struct io_ring *ring, int fd, void *buf, size_t len,
+                  void *data) {
+    struct io_ring_op *op = io_ring_queue(ring, fd, data);
+    if (op == NULL) {
+        return false;
+    }
+    op->send = false;
+    op->buf.buf = buf;
+    op->buf.len = (u_long)len;
+    op->bufs = &op->buf;
+    op->nbufs = 1;
+    return true;
+}
+
+bool io_ring_sendmsg(struct io_ring *ring, int fd, const struct msghdr *m,
+                     void *data) {
+    struct io_ring_op *op = io_ring_queue(ring, fd, data);
+    if (op == NULL) {
+        return false;
+    }
+    /* WSASend() gathers the iovecs the same way sendmsg() does */
+    op->send = true;
+    op->bufs = (WSABUF *)m->msg_iov;
+    op->nbufs = (DWORD)m->msg_iovlen;
+    return true;
+}
+
+int io_ring_submit(struct io_ring *ring) {
+    struct io_ring_op *op = ring->queued;
+    int total = 0;
+    bool wakeup = false;
+
+    ring->queued = NULL;
+    ring->queued_tail = &ring->queued;
+
+    while (op != NULL) {
+        struct io_ring_op *next = op->next;
+        DWORD flags = 0;
+        int ret;
+
+        pthread_mutex_lock(&ring->lock);
+        ++ring->inflight;
+        pthread_mutex_unlock(&ring->lock);
+
+        if (op->send) {
+            ret = WSASend(op->sfd, op->bufs, op->nbufs, NULL, 0,
+                          &op->overlapped, NULL);
+        } else {
+            ret = WSARecv(op->sfd, op->bufs, op->nbufs, NULL, &flags,
+                          &op->overlapped, NULL);
+        }
+
+        /*
+         * The port gets a completion for everything that didn't fail
+         * right away (even if it's done already)
+         */
+        int error;
+        if (ret == SOCKET_ERROR &&
+            (error = WSAGetLastError()) != WSA_IO_PENDING) {
+            pthread_mutex_lock(&ring->lock);
+            --ring->inflight;
+            wakeup |= io_ring_complete(ring, op, io_ring_error(error));
+            pthread_mutex_unlock(&ring->lock);
+        }
+        ++total;
+        op = next;
+    }
+
+    if (wakeup) {
+        char c = 1;
+        send(ring->notify, &c, 1, 0);
+    }
+    return total;
+}
+
+int io_ring_reap(struct io_ring *ring, io_ring_handler_t *handler) {
+    pthread_mutex_lock(&ring->lock);
+    struct io_ring_op *op = ring->done;
+    ring->done = NULL;
+    ring->done_tail = &ring->done;
+    pthread_mutex_unlock(&ring->lock);
+
+    int total = 0;
+    while (op != NULL) {
+        struct io_ring_op *next = op->next;
+        void *data = op->data;
+        int res = op->res;
+        /* the handler may queue the next request of the connection */
+        op->next = ring->free;
+        ring->free = op;
+        handler(data, res);
+        ++total;
+        op = next;
+    }
+    return total;
+}
+
+const char *io_ring_kind(void) {
+    return "iocp";
+}
+
+#else
+
+struct io_ring *io_ring_create(unsigned int entries, unsigned int cq_entries,
+                               int efd) {
+    (void)entries;
+    (void)cq_entries;
+    (void)efd;
+    return NULL;
+}
+
+void io_ring_destroy(struct io_ring *ring) {
+    (void)ring;
+}
+
+bool io_ring_recv(struct io_ring *ring, int fd, void *buf, size_t len,
+                  void *data) {
+    (void)ring; (void)fd; (void)buf; (void)len; (void)data;
+    return false;
+}
+
+bool io_ring_sendmsg(struct io_ring *ring, int fd, const struct msghdr *m,
+                     void *data) {
+    (void)ring; (void)fd; (void)m; (void)data;
+    return false;
+}
+
+int io_ring_submit(struct io_ring *ring) {
+    (void)ring;
+    return -1;
+}
+
+int io_ring_reap(struct io_ring *ring, io_ring_handler_t *handler) {
+    (void)ring;
+    (void)handler;
+    return 0;
+}
+
+const char *io_ring_kind(void) {
+    return NULL;
+}
+
+#endif
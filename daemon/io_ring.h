@@ -0,0 +1,81 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A minimal wrapper around a Linux io_uring instance, talking to the kernel
+ * through the raw system calls so that we don't depend on liburing.
+ * Requests are queued with io_ring_recv() / io_ring_sendmsg() and handed to
+ * the kernel in one batch by io_ring_submit(). The completions are signalled
+ * through an eventfd so that the ring can be driven from a libevent loop.
+ *
+ * On Windows the same interface runs on an I/O completion port: the
+ * requests are issued as overlapped WSARecv() / WSASend() calls by
+ * io_ring_submit(), and a byte is sent to the socket passed as efd when
+ * there are completions to reap.
+ *
+ * On other platforms io_ring_create() always returns NULL.
+ */
+struct io_ring;
+struct msghdr;
+
+/**
+ * Called for each completed request.
+ *
+ * @param data the cookie passed when the request was queued
+ * @param res the result of the operation (-errno on failure)
+ */
+typedef void io_ring_handler_t(void *data, int res);
+
+/**
+ * Create a new ring.
+ *
+ * @param entries the size of the submission queue
+ * @param cq_entries the size of the completion queue
+ * @param efd an eventfd the kernel signals when completions are posted
+ *            (the sending end of a socketpair on Windows)
+ * @return the new ring, or NULL if io_uring isn't usable on this system
+ */
+struct io_ring *io_ring_create(unsigned int entries, unsigned int cq_entries,
+                               int efd);
+
+void io_ring_destroy(struct io_ring *ring);
+
+/**
+ * Queue a recv into buf. The request isn't seen by the kernel until the
+ * next io_ring_submit() (unless the submission queue is full).
+ */
+bool io_ring_recv(struct io_ring *ring, int fd, void *buf, size_t len,
+                  void *data);
+
+/**
+ * Queue a sendmsg of m. m and the iovecs it refers to must stay untouched
+ * until the completion is delivered.
+ */
+bool io_ring_sendmsg(struct io_ring *ring, int fd, const struct msghdr *m,
+                     void *data);
+
+/**
+ * Hand all of the queued requests to the kernel.
+ *
+ * @return the number of requests submitted or -1 on failure
+ */
+int io_ring_submit(struct io_ring *ring);
+
+/**
+ * Deliver all of the posted completions to handler.
+ *
+ * @return the number of completions delivered
+ */
+int io_ring_reap(struct io_ring *ring, io_ring_handler_t *handler);
+
+/**
+ * The name of the implementation: "io_uring", "iocp" or NULL if there is
+ * none on this platform.
+ */
+const char *io_ring_kind(void);
+
+#endif
@@ -15,9 +15,47 @@
 #include "isasl.h"
 #include "memcached.h"
 
+/*
+ * The user table is never changed once it's published: a refresh builds
+ * a new one and swaps the pointer. An authentication only holds
+ * uhash_lock to take a reference to the current table, so the workers
+ * never wait for a refresh (or for the file it reads).
+ */
+struct user_db {
+    /** the authentications using the table, plus one while it's current */
+    int refcount;
+    uint32_t mask;
+    int nusers;
+    user_db_entry_t *buckets[];
+};
+
 static pthread_mutex_t uhash_lock = PTHREAD_MUTEX_INITIALIZER;
-static user_db_entry_t **user_ht;
-static const int n_uht_buckets = 12289;
+static struct user_db *user_db;
+
+/*
+ * The refreshes are done by a thread of their own, started with the
+ * first one. The connections asking for one while it's busy are all
+ * answered by the next reload.
+ */
+struct refresh_waiter {
+    const void *cookie;
+    struct refresh_waiter *next;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool started;
+    struct refresh_waiter *waiters;
+    struct isasl_stats stats;
+} refresher = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/* The password file as it was when we loaded it (only for the loader) */
+static struct stat loaded_st;
+static bool loaded;
 
 static void kill_whitey(char *s) {
     for (int i = strlen(s) - 1; i > 0 && isspace(s[i]); i--) {
@@ -25,73 +63,125 @@ static void kill_whitey(char *s) {
     }
 }
 
-static int u_hash_key(const char *u)
+static uint32_t u_hash_key(const char *u)
 {
-    uint32_t h = hash(u, strlen(u), 0) % n_uht_buckets;
-    assert(h < n_uht_buckets);
-    return h;
+    return hash(u, strlen(u), 0);
 }
 
-static char *find_pw(const char *u, char **cfg)
+static void free_entries(user_db_entry_t *e)
 {
-    assert(u);
-    assert(user_ht);
+    while (e) {
+        user_db_entry_t *n = e->next;
+        free(e->username);
+        free(e->config);
+        free(e);
+        e = n;
+    }
+}
 
-    int h = u_hash_key(u);
+static void user_db_release(struct user_db *db)
+{
+    if (db != NULL && __sync_sub_and_fetch(&db->refcount, 1) == 0) {
+        for (uint32_t i = 0; i <= db->mask; i++) {
+            free_entries(db->buckets[i]);
+        }
+        free(db);
+    }
+}
 
-    user_db_entry_t *e = user_ht[h];
-    while (e && strcmp(e->username, u) != 0) {
-        e = e->next;
+static struct user_db *user_db_acquire(void)
+{
+    pthread_mutex_lock(&uhash_lock);
+    struct user_db *db = user_db;
+    if (db != NULL) {
+        __sync_add_and_fetch(&db->refcount, 1);
     }
+    pthread_mutex_unlock(&uhash_lock);
+    return db;
+}
 
-    if (e != NULL) {
-        *cfg = e->config;
-        return e->password;
-    } else {
-        return NULL;
+static void user_db_publish(struct user_db *db)
+{
+    pthread_mutex_lock(&uhash_lock);
+    struct user_db *old = user_db;
+    user_db = db;
+    pthread_mutex_unlock(&uhash_lock);
+    user_db_release(old);
+}
+
+static const user_db_entry_t *find_user(const struct user_db *db,
+                                        const char *u)
+{
+    assert(u);
+    uint32_t h = u_hash_key(u);
+
+    const user_db_entry_t *e = db->buckets[h & db->mask];
+    while (e && (e->hash != h || strcmp(e->username, u) != 0)) {
+        e = e->next;
     }
+    return e;
 }
 
-static void store_pw(user_db_entry_t **ht,
-                     const char *u,
-                     const char *p,
-                     const char *cfg)
+static user_db_entry_t *new_entry(const char *u,
+                                  const char *p,
+                                  const char *cfg)
 {
-    assert(ht);
     assert(u);
     assert(p);
+    size_t pwlen = strlen(p);
+    if (pwlen >= ISASL_PW_MAX) {
+        return NULL;
+    }
     user_db_entry_t *e = calloc(1, sizeof(user_db_entry_t));
     assert(e);
     e->username = strdup(u);
     assert(e->username);
-    e->password = strdup(p);
-    assert(e->password);
+    e->hash = u_hash_key(u);
+    e->pwlen = pwlen;
+    memcpy(e->password, p, pwlen);
     e->config = cfg ? strdup(cfg) : NULL;
     assert(!cfg || e->config);
+    return e;
+}
 
-    int h = u_hash_key(u);
+/*
+ * Put the entries (in the order of the file) in a table of their own,
+ * with at least twice the buckets as there are users.
+ */
+static struct user_db *build_user_db(user_db_entry_t *entries, int nusers)
+{
+    uint32_t nbuckets = 64;
+    while (nbuckets < (uint32_t)nusers * 2) {
+        nbuckets <<= 1;
+    }
 
-    e->next = ht[h];
-    ht[h] = e;
+    struct user_db *db = calloc(1, sizeof(*db) +
+                                nbuckets * sizeof(user_db_entry_t *));
+    if (db == NULL) {
+        free_entries(entries);
+        return NULL;
+    }
+    db->refcount = 1;
+    db->mask = nbuckets - 1;
+    db->nusers = nusers;
+
+    while (entries) {
+        user_db_entry_t *e = entries;
+        entries = e->next;
+        e->next = db->buckets[e->hash & db->mask];
+        db->buckets[e->hash & db->mask] = e;
+    }
+    return db;
 }
 
-static void free_user_ht(void)
+static bool same_file(const struct stat *a, const struct stat *b)
 {
-    if (user_ht) {
-        for (int i = 0; i < n_uht_buckets; i++) {
-            while (user_ht[i]) {
-                user_db_entry_t *e = user_ht[i];
-                user_db_entry_t *n = e->next;
-                free(e->username);
-                free(e->password);
-                free(e->config);
-                free(e);
-                user_ht[i] = n;
-            }
-        }
-        free(user_ht);
-        user_ht = NULL;
-    }
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+        a->st_size == b->st_size && a->st_mtime == b->st_mtime &&
+#ifdef __linux__
+        a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+#endif
+        a->st_ctime == b->st_ctime;
 }
 
 static const char *get_isasl_filename(void)
@@ -99,6 +189,11 @@ static const char *get_isasl_filename(void)
     return getenv("ISASL_PWFILE");
 }
 
+/**
+ * (Re)load the user table, unless the file is the one we loaded last
+ * time. Only called by one thread at a time (main() at startup, then the
+ * refresh thread).
+ */
 static int load_user_db(void)
 {
     const char *filename = get_isasl_filename();
@@ -111,14 +206,17 @@ static int load_user_db(void)
         return SASL_FAIL;
     }
 
-    user_db_entry_t **new_ut = calloc(n_uht_buckets,
-                                      sizeof(user_db_entry_t*));
-
-    if (!new_ut) {
+    struct stat st;
+    bool have_st = fstat(fileno(sfile), &st) == 0;
+    if (have_st && loaded && same_file(&st, &loaded_st)) {
         fclose(sfile);
-        return SASL_NOMEM;
+        return SASL_OK;
     }
 
+    user_db_entry_t *entries = NULL;
+    user_db_entry_t **tail = &entries;
+    int nusers = 0;
+
     // File has lines that are newline terminated.
     // File may have comment lines that must being with '#'.
     // Lines should look like...
@@ -159,12 +257,23 @@ static int load_user_db(void)
                     }
                 }
             }
-            store_pw(new_ut, uname, p, cfg);
+            user_db_entry_t *e = new_entry(uname, p, cfg);
+            if (e != NULL) {
+                *tail = e;
+                tail = &e->next;
+                ++nusers;
+            }
        }
     }
 
     fclose(sfile);
 
+    /* A later line for the same user wins, like it always did */
+    struct user_db *new_db = build_user_db(entries, nusers);
+    if (new_db == NULL) {
+        return SASL_NOMEM;
+    }
+
     if (settings.verbose) {
         settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
                                         "Loaded isasl db from %s\n",
@@ -172,10 +281,13 @@ static int load_user_db(void)
     }
 
     /* Replace the current configuration with the new one */
-    pthread_mutex_lock(&uhash_lock);
-    free_user_ht();
-    user_ht = new_ut;
-    pthread_mutex_unlock(&uhash_lock);
+    user_db_publish(new_db);
+    loaded_st = st;
+    loaded = have_st;
+
+    pthread_mutex_lock(&refresher.mutex);
+    refresher.stats.reloads++;
+    pthread_mutex_unlock(&refresher.mutex);
 
     return SASL_OK;
 }
@@ -232,12 +344,40 @@ int sasl_listmech(sasl_conn_t *conn,
     return SASL_OK;
 }
 
-static bool check_up(const char *username, const char *password, char **cfg)
+/*
+ * Compare all of the (zero padded) password buffers, so the time it
+ * takes doesn't tell how much of the password was right.
+ */
+static bool password_equal(const user_db_entry_t *e,
+                           const char *password, size_t pwlen)
 {
-    pthread_mutex_lock(&uhash_lock);
-    char *pw = find_pw(username, cfg);
-    bool rv = pw && (strcmp(password, pw) == 0);
-    pthread_mutex_unlock(&uhash_lock);
+    size_t diff = e->pwlen ^ pwlen;
+    for (int i = 0; i < ISASL_PW_MAX; i++) {
+        diff |= (unsigned char)(e->password[i] ^ password[i]);
+    }
+    return diff == 0;
+}
+
+static bool check_up(const char *username, const char *password,
+                     size_t pwlen, sasl_conn_t *conn)
+{
+    static const user_db_entry_t nobody;
+    struct user_db *db = user_db_acquire();
+    if (db == NULL) {
+        return false;
+    }
+
+    const user_db_entry_t *e = find_user(db, username);
+    bool rv = password_equal(e ? e : &nobody, password, pwlen) && e;
+    if (rv) {
+        free(conn->username);
+        free(conn->config);
+        conn->username = strdup(username);
+        assert(conn->username);
+        conn->config = e->config ? strdup(e->config) : NULL;
+        assert(!e->config || conn->config);
+    }
+    user_db_release(db);
     return rv;
 }
 
@@ -261,27 +401,14 @@ int sasl_server_start(sasl_conn_t *conn,
         }
         if (clientinlen > 2 && clientinlen < 128 && clientin[0] == '\0') {
             const char *username = clientin + 1;
-            char password[256];
+            char password[ISASL_PW_MAX];
             int pwlen = clientinlen - 2 - strlen(username);
             assert(pwlen >= 0);
-            if (pwlen < 256) {
-                char *cfg = NULL;
-                password[pwlen] = '\0';
+            if (pwlen < ISASL_PW_MAX) {
+                memset(password, 0, sizeof(password));
                 memcpy(password, clientin + 2 + strlen(username), pwlen);
 
-                if (check_up(username, password, &cfg)) {
-                    if (conn->username) {
-                        free(conn->username);
-                        conn->username = NULL;
-                    }
-                    if (conn->config) {
-                        free(conn->config);
-                        conn->config = NULL;
-                    }
-                    conn->username = strdup(username);
-                    assert(conn->username);
-                    conn->config = strdup(cfg);
-                    assert(conn->config);
+                if (check_up(username, password, pwlen, conn)) {
                     rv = SASL_OK;
                 }
             }
@@ -319,41 +446,89 @@ int sasl_getprop(sasl_conn_t *conn, int propnum,
     return SASL_OK;
 }
 
-static void *isasl_refresh_main(void *c)
+static void *isasl_refresh_main(void *arg)
 {
-    int rv = load_user_db();
-    if (rv == SASL_OK) {
-        notify_io_complete(c, ENGINE_SUCCESS);
-    } else {
-        notify_io_complete(c, ENGINE_EINVAL);
-    }
+    pthread_mutex_lock(&refresher.mutex);
+    while (true) {
+        while (refresher.waiters == NULL) {
+            pthread_cond_wait(&refresher.cond, &refresher.mutex);
+        }
+        struct refresh_waiter *waiters = refresher.waiters;
+        refresher.waiters = NULL;
+        pthread_mutex_unlock(&refresher.mutex);
+
+        uint64_t start = timings_now();
+        int rv = load_user_db();
+        uint64_t elapsed = timings_now() - start;
+
+        while (waiters != NULL) {
+            struct refresh_waiter *next = waiters->next;
+            notify_io_complete(waiters->cookie,
+                               rv == SASL_OK ? ENGINE_SUCCESS : ENGINE_EINVAL);
+            free(waiters);
+            waiters = next;
+        }
 
+        pthread_mutex_lock(&refresher.mutex);
+        refresher.stats.refresh_ns += elapsed;
+    }
     return NULL;
 }
 
 ENGINE_ERROR_CODE isasl_refresh(conn *c)
 {
-    pthread_t tid;
-    pthread_attr_t attr;
-    int err;
-
-    if (pthread_attr_init(&attr) != 0 ||
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0)
-    {
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                        "Failed to initialize pthread attributes: %s",
-                                        strerror(errno));
-        return ENGINE_DISCONNECT;
+    struct refresh_waiter *waiter = malloc(sizeof(*waiter));
+    if (waiter == NULL) {
+        return ENGINE_ENOMEM;
     }
+    waiter->cookie = c;
+
+    pthread_mutex_lock(&refresher.mutex);
+    if (!refresher.started) {
+        pthread_t tid;
+        pthread_attr_t attr;
+        int err;
+
+        if (pthread_attr_init(&attr) != 0 ||
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0)
+        {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "Failed to initialize pthread attributes: %s",
+                                            strerror(errno));
+            pthread_mutex_unlock(&refresher.mutex);
+            free(waiter);
+            return ENGINE_DISCONNECT;
+        }
 
-    err = pthread_create(&tid, &attr, isasl_refresh_main, c);
-    if (err != 0) {
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                        "Failed to create isasl db "
-                                        "update thread: %s",
-                                        strerror(err));
-        return ENGINE_DISCONNECT;
+        err = pthread_create(&tid, &attr, isasl_refresh_main, NULL);
+        if (err != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                            "Failed to create isasl db "
+                                            "update thread: %s",
+                                            strerror(err));
+            pthread_mutex_unlock(&refresher.mutex);
+            free(waiter);
+            return ENGINE_DISCONNECT;
+        }
+        refresher.started = true;
     }
 
+    waiter->next = refresher.waiters;
+    refresher.waiters = waiter;
+    refresher.stats.refreshes++;
+    pthread_cond_signal(&refresher.cond);
+    pthread_mutex_unlock(&refresher.mutex);
+
     return ENGINE_EWOULDBLOCK;
 }
+
+void isasl_get_stats(struct isasl_stats *stats)
+{
+    pthread_mutex_lock(&refresher.mutex);
+    *stats = refresher.stats;
+    pthread_mutex_unlock(&refresher.mutex);
+
+    struct user_db *db = user_db_acquire();
+    stats->users = db ? db->nusers : 0;
+    user_db_release(db);
+}
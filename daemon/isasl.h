@@ -1,6 +1,8 @@
 #ifndef ISASL_H
 #define ISASL_H 1
 
+#include <stdint.h>
+
 #define SASL_CB_LIST_END   0  /* end of list */
 
 #define SASL_USERNAME     0 /* pointer to NUL terminated user name */
@@ -17,13 +19,27 @@ typedef struct sasl_conn {
     char *config;
 } sasl_conn_t;
 
+/* The size of the (zero padded) password buffers */
+#define ISASL_PW_MAX 256
+
 typedef struct user_db_entry {
     char *username;
-    char *password;
     char *config;
+    uint32_t hash;      /* of the username */
+    uint32_t pwlen;
+    char password[ISASL_PW_MAX];
     struct user_db_entry *next;
 } user_db_entry_t;
 
+struct isasl_stats {
+    uint64_t users;
+    /** refreshes asked for, and the times the file was loaded */
+    uint64_t refreshes;
+    uint64_t reloads;
+    /** time spent by the refresh thread */
+    uint64_t refresh_ns;
+};
+
 void sasl_dispose(sasl_conn_t **pconn);
 
 int sasl_server_init(const sasl_callback_t *callbacks,
@@ -63,6 +79,8 @@ int sasl_server_step(sasl_conn_t *conn,
 int sasl_getprop(sasl_conn_t *conn, int propnum,
                  const void **pvalue);
 
+void isasl_get_stats(struct isasl_stats *stats);
+
 #define SASL_OK       0
 #define SASL_CONTINUE 1
 #define SASL_FAIL     -1        /* generic failure */
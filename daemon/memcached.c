@@ -17,6 +17,10 @@
 #include "memcached.h"
 #include "memcached/extension_loggers.h"
 #include "alloc_hooks.h"
+#include "udp.h"
+#include "affinity.h"
+#include "heap_profile.h"
+#include "taskpool.h"
 #include "utilities/engine_loader.h"
 
 #include <signal.h>
@@ -33,6 +37,15 @@
 #include <stdarg.h>
 #include <stddef.h>
 
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#define HAVE_ZEROCOPY 1
+#endif
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
 typedef union {
     item_info info;
     char bytes[sizeof(item_info) + ((IOV_MAX - 1) * sizeof(struct iovec))];
@@ -43,16 +56,52 @@ static inline void item_set_cas(const void *cookie, item *it, uint64_t cas) {
     settings.engine.v1->item_set_cas(settings.engine.v0, cookie, it, cas);
 }
 
-/* The item must always be called "it" */
+/* The layout of the engine's items, if it publishes one */
+static const item_layout *engine_item_layout;
+
+/*
+ * Get the item_info of an item, reading it straight out of the item when
+ * the engine told us where everything is
+ */
+static inline bool get_item_info(const void *cookie, const item *it,
+                                 item_info *info) {
+    const item_layout *l = engine_item_layout;
+    if (l != NULL && info->nvalue >= 1) {
+        const char *p = it;
+        uint16_t iflag;
+        memcpy(&iflag, p + l->iflag, sizeof(iflag));
+        if ((iflag & l->iflag_indirect) == 0) {
+            const char *key = p + l->header;
+            info->cas = 0;
+            if (iflag & l->iflag_cas) {
+                memcpy(&info->cas, key, sizeof(info->cas));
+                key += sizeof(info->cas);
+            }
+            memcpy(&info->exptime, p + l->exptime, sizeof(info->exptime));
+            memcpy(&info->nbytes, p + l->nbytes, sizeof(info->nbytes));
+            memcpy(&info->flags, p + l->flags, sizeof(info->flags));
+            memcpy(&info->nkey, p + l->nkey, sizeof(info->nkey));
+            info->clsid = *(const uint8_t*)(p + l->clsid);
+            info->key = key;
+            info->nvalue = 1;
+            info->value[0].iov_base = (char*)key + info->nkey;
+            info->value[0].iov_len = info->nbytes;
+            return true;
+        }
+    }
+    return settings.engine.v1->get_item_info(settings.engine.v0, cookie,
+                                             it, info);
+}
+
 #define SLAB_GUTS(conn, thread_stats, slab_op, thread_op) \
-    thread_stats->slab_stats[info.info.clsid].slab_op++;
+    thread_stats_add(thread_stats->slab_stats.slab_op, 1);
 
 #define THREAD_GUTS(conn, thread_stats, slab_op, thread_op) \
-    thread_stats->thread_op++;
+    thread_stats_add(thread_stats->thread_op, 1);
 
 #define THREAD_GUTS2(conn, thread_stats, slab_op, thread_op) \
-    thread_stats->slab_op++; \
-    thread_stats->thread_op++;
+    thread_stats_add(thread_stats->slab_op, 1); \
+    thread_stats_add(thread_stats->thread_op, 1);
 
 #define SLAB_THREAD_GUTS(conn, thread_stats, slab_op, thread_op) \
     SLAB_GUTS(conn, thread_stats, slab_op, thread_op) \
@@ -60,9 +109,7 @@ static inline void item_set_cas(const void *cookie, item *it, uint64_t cas) {
 
 #define STATS_INCR1(GUTS, conn, slab_op, thread_op, key, nkey) { \
     struct thread_stats *thread_stats = get_thread_stats(conn); \
-    pthread_mutex_lock(&thread_stats->mutex); \
     GUTS(conn, thread_stats, slab_op, thread_op); \
-    pthread_mutex_unlock(&thread_stats->mutex); \
 }
 
 #define STATS_INCR(conn, op, key, nkey) \
@@ -86,26 +133,26 @@ static inline void item_set_cas(const void *cookie, item *it, uint64_t cas) {
 #define STATS_NOKEY(conn, op) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    pthread_mutex_lock(&thread_stats->mutex); \
-    thread_stats->op++; \
-    pthread_mutex_unlock(&thread_stats->mutex); \
+    thread_stats_add(thread_stats->op, 1); \
 }
 
 #define STATS_NOKEY2(conn, op1, op2) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    pthread_mutex_lock(&thread_stats->mutex); \
-    thread_stats->op1++; \
-    thread_stats->op2++; \
-    pthread_mutex_unlock(&thread_stats->mutex); \
+    thread_stats_add(thread_stats->op1, 1); \
+    thread_stats_add(thread_stats->op2, 1); \
 }
 
 #define STATS_ADD(conn, op, amt) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    pthread_mutex_lock(&thread_stats->mutex); \
-    thread_stats->op += amt; \
-    pthread_mutex_unlock(&thread_stats->mutex); \
+    thread_stats_add(thread_stats->op, amt); \
+}
+
+/* Count the bytes for the connection too */
+#define TRAFFIC_ADD(conn, op, amt) { \
+    STATS_ADD(conn, op, amt); \
+    (conn)->traffic.op += (amt); \
 }
 
 volatile sig_atomic_t memcached_shutdown;
@@ -158,6 +205,14 @@ static void write_and_free(conn *c, char *buf, int bytes);
 static int ensure_iov_space(conn *c);
 static int add_iov(conn *c, const void *buf, int len);
 static int add_msghdr(conn *c);
+static bool conn_use_zerocopy(conn *c);
+static void conn_zerocopy_hold(conn *c);
+static void tap_compress_destroy(conn *c);
+static void conn_release_mget(conn *c);
+static void conn_coalesce_reset(conn *c);
+static void conn_release_items(conn *c);
+static void stats_sub_free(conn *c);
+static void conn_run(conn *c, const short which);
 
 
 /* time handling */
@@ -262,6 +317,9 @@ static void stats_reset(const void *cookie) {
     stats_prefix_clear();
     STATS_UNLOCK();
     threadlocal_stats_reset(get_independent_stats(conn));
+    threads_timings_reset();
+    threads_cycles_reset();
+    threads_topclients_reset();
     settings.engine.v1->reset_stats(settings.engine.v0, cookie);
 }
 
@@ -282,6 +340,7 @@ static void settings_init(void) {
     settings.chunk_size = 48;         /* space for a modest key and value */
     settings.num_threads = 4;         /* N workers */
     settings.num_threads_per_udp = 0;
+    settings.num_threads_min = 0;     /* no scaling */
     settings.prefix_delimiter = ':';
     settings.detail_enabled = 0;
     settings.allow_detailed = true;
@@ -293,8 +352,82 @@ static void settings_init(void) {
     settings.extensions.logger = get_stderr_logger();
     settings.num_ports = 1;
     settings.tcp_nodelay = getenv("MEMCACHED_DISABLE_TCP_NODELAY") == NULL;
+#ifdef TCP_CORK
+    settings.tcp_cork = getenv("MEMCACHED_DISABLE_TCP_CORK") == NULL;
+#else
+    settings.tcp_cork = false;
+#endif
+    settings.reuseport = false;
+    settings.conn_placement = CONN_PLACEMENT_ROUND_ROBIN;
+    settings.conn_migrate = false;
+    settings.io_backend = IO_BACKEND_LIBEVENT;
+    settings.zerocopy_min = 0;
+    settings.tap_compress_min = 128;
+    settings.heap_sample = 0;
+    settings.state_cycles = false;
+    settings.slowlog_usec = 0;
+    settings.slowlog_sample = 0;
+    settings.tls_port = 0;
+    settings.tls_cert = NULL;
+    settings.tls_key = NULL;
+    settings.bulk_classes = NULL;
+    settings.cpu_affinity = NULL;
+    settings.idle_timeout = 0;
+    settings.hibernate_timeout = 0;
+    settings.task_threads[TASK_POOL_IO] = 4;
+    settings.task_threads[TASK_POOL_CPU] = 2;
+    settings.bulk_budget = DEFAULT_BULK_BUDGET;
+}
+
+/*
+ * A connection and the initial size of its lists, carved out of the
+ * arena of a pool (see initialize_connections()). The lists only leave
+ * the slot when they grow, and go back to it when they're shrunk.
+ */
+struct conn_slot {
+    conn conn;
+    struct conn_pool *pool; /* the pool it goes back to */
+    item *ilist[ITEM_LIST_INITIAL];
+    char *suffixlist[SUFFIX_LIST_INITIAL];
+    struct iovec iov[IOV_LIST_INITIAL];
+    struct msghdr msglist[MSG_LIST_INITIAL];
+};
+
+static inline struct conn_slot *conn_slot(conn *c) {
+    return (struct conn_slot *)c;
+}
+
+/*
+ * Resize a list of a connection to n elements, moving it out of the slot
+ * (or back into it). The list is unchanged if we fail.
+ *
+ * @return the new list, NULL if we're out of memory
+ */
+static void *conn_list_resize(void *list, void *initial, size_t initial_size,
+                              size_t oldsize, size_t newsize) {
+    if (newsize <= initial_size) {
+        if (list != initial) {
+            memcpy(initial, list, newsize);
+            free(list);
+        }
+        return initial;
+    }
+    if (list != initial) {
+        return realloc(list, newsize);
+    }
+    void *ret = malloc(newsize);
+    if (ret != NULL) {
+        memcpy(ret, list, oldsize < newsize ? oldsize : newsize);
+    }
+    return ret;
 }
 
+#define CONN_LIST_RESIZE(c, list, oldn, newn) \
+    conn_list_resize((c)->list, conn_slot(c)->list, \
+                     sizeof(conn_slot(c)->list), \
+                     sizeof((c)->list[0]) * (oldn), \
+                     sizeof((c)->list[0]) * (newn))
+
 /*
  * Adds a message header to a connection.
  *
@@ -307,7 +440,7 @@ static int add_msghdr(conn *c)
     assert(c != NULL);
 
     if (c->msgsize == c->msgused) {
-        msg = realloc(c->msglist, c->msgsize * 2 * sizeof(struct msghdr));
+        msg = CONN_LIST_RESIZE(c, msglist, c->msgsize, c->msgsize * 2);
         if (! msg)
             return -1;
         c->msglist = msg;
@@ -322,9 +455,9 @@ static int add_msghdr(conn *c)
 
     msg->msg_iov = &c->iov[c->iovused];
 
-    if (c->request_addr_size > 0) {
-        msg->msg_name = &c->request_addr;
-        msg->msg_namelen = c->request_addr_size;
+    if (c->udp != NULL && c->udp->request_addr_size > 0) {
+        msg->msg_name = &c->udp->request_addr;
+        msg->msg_namelen = c->udp->request_addr_size;
     }
 
     c->msgbytes = 0;
@@ -361,21 +494,42 @@ static uint64_t get_listen_disabled_num(void) {
     return ret;
 }
 
-static void disable_listen(void) {
+static void set_listen_events(conn *list, bool enable) {
+    conn *next;
+    for (next = list; next; next = next->next) {
+        update_event(next, enable ? EV_READ | EV_PERSIST : 0);
+        if (listen(next->sfd, enable ? settings.backlog : 1) != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "listen() failed",
+                                            strerror(errno));
+        }
+    }
+}
+
+/*
+ * Stop accepting new connections on the listening sockets owned by the
+ * calling thread. With reuseport every worker thread owns its own set of
+ * listening sockets, and only that thread may touch their events.
+ */
+static void disable_listen(conn *c) {
     pthread_mutex_lock(&listen_state.mutex);
     listen_state.disabled = true;
     listen_state.count = 10;
     ++listen_state.num_disable;
     pthread_mutex_unlock(&listen_state.mutex);
 
-    conn *next;
-    for (next = listen_conn; next; next = next->next) {
-        update_event(next, 0);
-        if (listen(next->sfd, 1) != 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "listen() failed",
-                                            strerror(errno));
-        }
+    if (c->thread != NULL) {
+        c->thread->listen_disabled = true;
+        set_listen_events(c->thread->listen_conn, false);
+    } else {
+        set_listen_events(listen_conn, false);
+    }
+}
+
+void update_thread_listen_events(LIBEVENT_THREAD *me) {
+    if (me->listen_disabled && !is_listen_disabled()) {
+        me->listen_disabled = false;
+        set_listen_events(me->listen_conn, true);
     }
 }
 
@@ -405,133 +559,93 @@ void safe_close(SOCKET sfd) {
 
 /**
  * Reset all of the dynamic buffers used by a connection back to their
- * default sizes. The strategy for resizing the buffers is to allocate a
- * new one of the correct size and free the old one if the allocation succeeds
- * instead of using realloc to change the buffer size (because realloc may
- * not shrink the buffers, and will also copy the memory). If the allocation
- * fails the buffer will be unchanged.
+ * default sizes: the lists that have grown are freed, and the connection
+ * goes back to the ones in its slot.
+ *
+ * The read and write buffers aren't part of a constructed connection;
+ * conn_new() or conn_acquire_buffers() sets them up, and conn_close()
+ * releases them.
  *
  * @param c the connection to resize the buffers for
- * @return true if all allocations succeeded, false if one or more of the
- *         allocations failed.
  */
-static bool conn_reset_buffersize(conn *c) {
-    bool ret = true;
-
-    if (c->rsize != DATA_BUFFER_SIZE) {
-        void *ptr = malloc(DATA_BUFFER_SIZE);
-        if (ptr != NULL) {
-            free(c->rbuf);
-            c->rbuf = ptr;
-            c->rsize = DATA_BUFFER_SIZE;
-        } else {
-            ret = false;
-        }
-    }
-
-    if (c->wsize != DATA_BUFFER_SIZE) {
-        void *ptr = malloc(DATA_BUFFER_SIZE);
-        if (ptr != NULL) {
-            free(c->wbuf);
-            c->wbuf = ptr;
-            c->wsize = DATA_BUFFER_SIZE;
-        } else {
-            ret = false;
-        }
-    }
+static void conn_reset_buffersize(conn *c) {
+    struct conn_slot *slot = conn_slot(c);
 
-    if (c->isize != ITEM_LIST_INITIAL) {
-        void *ptr = malloc(sizeof(item *) * ITEM_LIST_INITIAL);
-        if (ptr != NULL) {
-            free(c->ilist);
-            c->ilist = ptr;
-            c->isize = ITEM_LIST_INITIAL;
-        } else {
-            ret = false;
-        }
+    if (c->ilist != slot->ilist) {
+        free(c->ilist);
+        c->ilist = slot->ilist;
     }
+    c->isize = ITEM_LIST_INITIAL;
 
-    if (c->suffixsize != SUFFIX_LIST_INITIAL) {
-        void *ptr = malloc(sizeof(char *) * SUFFIX_LIST_INITIAL);
-        if (ptr != NULL) {
-            free(c->suffixlist);
-            c->suffixlist = ptr;
-            c->suffixsize = SUFFIX_LIST_INITIAL;
-        } else {
-            ret = false;
-        }
+    if (c->suffixlist != slot->suffixlist) {
+        free(c->suffixlist);
+        c->suffixlist = slot->suffixlist;
     }
+    c->suffixsize = SUFFIX_LIST_INITIAL;
 
-    if (c->iovsize != IOV_LIST_INITIAL) {
-        void *ptr = malloc(sizeof(struct iovec) * IOV_LIST_INITIAL);
-        if (ptr != NULL) {
-            free(c->iov);
-            c->iov = ptr;
-            c->iovsize = IOV_LIST_INITIAL;
-        } else {
-            ret = false;
-        }
+    if (c->iov != slot->iov) {
+        free(c->iov);
+        c->iov = slot->iov;
     }
+    c->iovsize = IOV_LIST_INITIAL;
 
-    if (c->msgsize != MSG_LIST_INITIAL) {
-        void *ptr = malloc(sizeof(struct msghdr) * MSG_LIST_INITIAL);
-        if (ptr != NULL) {
-            free(c->msglist);
-            c->msglist = ptr;
-            c->msgsize = MSG_LIST_INITIAL;
-        } else {
-            ret = false;
-        }
+    if (c->msglist != slot->msglist) {
+        free(c->msglist);
+        c->msglist = slot->msglist;
     }
-
-    return ret;
+    c->msgsize = MSG_LIST_INITIAL;
 }
 
 /**
- * Constructor for all memory allocations of connection objects. Initialize
- * all members and allocate the transfer buffers.
+ * Constructor for all connection objects. Initialize all members and
+ * point the lists at the ones in the slot.
  *
- * @param buffer The memory allocated by the object cache
- * @return 0 on success, 1 if we failed to allocate memory
+ * @param slot the slot of the connection
+ * @param pool the pool it belongs to
  */
-static int conn_constructor(conn *c) {
+static void conn_constructor(struct conn_slot *slot, struct conn_pool *pool) {
+    conn *c = &slot->conn;
     memset(c, 0, sizeof(*c));
     MEMCACHED_CONN_CREATE(c);
 
+    slot->pool = pool;
     c->state = conn_immediate_close;
     c->sfd = INVALID_SOCKET;
-    if (!conn_reset_buffersize(c)) {
-        free(c->rbuf);
-        free(c->wbuf);
-        free(c->ilist);
-        free(c->suffixlist);
-        free(c->iov);
-        free(c->msglist);
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING,
-                                        NULL,
-                                        "Failed to allocate buffers for connection\n");
-        return 1;
-    }
+    conn_reset_buffersize(c);
 
     STATS_LOCK();
     stats.conn_structs++;
     STATS_UNLOCK();
+}
 
-    return 0;
+static void conn_udp_destroy(conn *c) {
+    if (c->udp != NULL) {
+        udp_reader_destroy(c->udp->reader);
+        free(c->udp->hdrbuf);
+        free(c->udp);
+        c->udp = NULL;
+    }
 }
 
 /**
  * Destructor for all connection objects. Release all allocated resources.
  *
- * @param buffer The memory allocated by the objec cache
+ * @param c the connection
  */
 static void conn_destructor(conn *c) {
-    free(c->rbuf);
-    free(c->wbuf);
-    free(c->ilist);
-    free(c->suffixlist);
-    free(c->iov);
-    free(c->msglist);
+    /* The pooled buffers of live connections go away with the pools */
+    if (!c->rbuf_pooled) {
+        free(c->rbuf);
+    }
+    if (!c->wbuf_pooled) {
+        free(c->wbuf);
+    }
+    conn_reset_buffersize(c);
+    free(c->zc_items);
+    free(c->mget);
+    free(c->mstore);
+    free(c->riov);
+    conn_udp_destroy(c);
 
     STATS_LOCK();
     stats.conn_structs--;
@@ -539,102 +653,133 @@ static void conn_destructor(conn *c) {
 }
 
 /*
- * Free list management for connections.
+ * Free list management for connections. Every thread takes them from a
+ * pool of its own (the dispatcher shares one with a worker), and they go
+ * back to the pool they came from, so the pools are next to never
+ * contended. The pools are preallocated out of one arena; when a pool
+ * runs out we allocate more slots one at a time, up to maxconns in all.
  */
+struct conn_pool {
+    pthread_mutex_t mutex;
+    conn *free;
+};
+
 struct connections {
-    conn* free;
-    conn** all;
+    struct conn_pool *pools;
+    int npools;
+    int next_pool;  /* the pool of the next thread to ask for one */
+    struct conn_slot *arena;
+    int narena;
+    /* All of the connections (the arena first), and the next free entry */
     pthread_mutex_t mutex;
+    conn **all;
     int next;
 } connections = {
     .mutex = PTHREAD_MUTEX_INITIALIZER
 };
 
+static __thread struct conn_pool *thread_conn_pool;
+
 static void initialize_connections(void)
 {
-    connections.all = calloc(settings.maxconns, sizeof(conn*));
-    if (connections.all == NULL) {
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                        "Failed to allocate memory for connections");
-        exit(EX_OSERR);
-    }
-
     int preallocate = settings.maxconns / 2;
     if (preallocate < 1000) {
         preallocate = settings.maxconns;
     }
 
-    for (connections.next = 0; connections.next < preallocate; ++connections.next) {
-        connections.all[connections.next] = malloc(sizeof(conn));
-        if (conn_constructor(connections.all[connections.next]) != 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "Failed to allocate memory for connections");
-            exit(EX_OSERR);
+    connections.npools = settings.num_threads;
+    connections.pools = calloc(connections.npools, sizeof(struct conn_pool));
+    connections.all = calloc(settings.maxconns, sizeof(conn *));
+    connections.arena = calloc(preallocate, sizeof(struct conn_slot));
+    if (connections.pools == NULL || connections.all == NULL ||
+        connections.arena == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to allocate memory for connections");
+        exit(EX_OSERR);
+    }
+    connections.narena = preallocate;
+
+    /* Every pool gets a contiguous part of the arena */
+    int perpool = preallocate / connections.npools;
+    for (int ii = 0; ii < connections.npools; ++ii) {
+        struct conn_pool *pool = &connections.pools[ii];
+        pthread_mutex_init(&pool->mutex, NULL);
+        int start = ii * perpool;
+        int end = ii == connections.npools - 1 ? preallocate : start + perpool;
+        for (int jj = end - 1; jj >= start; --jj) {
+            struct conn_slot *slot = &connections.arena[jj];
+            conn_constructor(slot, pool);
+            slot->conn.next = pool->free;
+            pool->free = &slot->conn;
+            connections.all[jj] = &slot->conn;
         }
-        connections.all[connections.next]->next = connections.free;
-        connections.free = connections.all[connections.next];
     }
+    connections.next = preallocate;
 }
 
 static void destroy_connections(void)
 {
-    for (int ii = 0; ii < settings.maxconns; ++ii) {
-        if (connections.all[ii]) {
-            conn *c = connections.all[ii];
-            conn_destructor(c);
-            free(c);
+    for (int ii = 0; ii < connections.next; ++ii) {
+        conn_destructor(connections.all[ii]);
+        if (ii >= connections.narena) {
+            free(connections.all[ii]);
         }
     }
+    for (int ii = 0; ii < connections.npools; ++ii) {
+        pthread_mutex_destroy(&connections.pools[ii].mutex);
+    }
 
+    free(connections.arena);
     free(connections.all);
+    free(connections.pools);
 }
 
 static conn *allocate_connection(void) {
     conn *ret;
+    struct conn_pool *pool = thread_conn_pool;
+
+    if (pool == NULL) {
+        int ii = __atomic_fetch_add(&connections.next_pool, 1,
+                                    __ATOMIC_RELAXED);
+        pool = thread_conn_pool = &connections.pools[ii % connections.npools];
+    }
 
-    pthread_mutex_lock(&connections.mutex);
-    ret = connections.free;
+    pthread_mutex_lock(&pool->mutex);
+    ret = pool->free;
     if (ret != NULL) {
-        connections.free = connections.free->next;
+        pool->free = ret->next;
         ret->next = NULL;
     }
-    pthread_mutex_unlock(&connections.mutex);
+    pthread_mutex_unlock(&pool->mutex);
 
     if (ret == NULL) {
-        ret = malloc(sizeof(conn));
-        if (ret == NULL) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "Failed to allocate memory for connection");
-            return NULL;
+        struct conn_slot *slot = NULL;
+        pthread_mutex_lock(&connections.mutex);
+        if (connections.next < settings.maxconns &&
+            (slot = malloc(sizeof(*slot))) != NULL) {
+            conn_constructor(slot, pool);
+            connections.all[connections.next++] = &slot->conn;
         }
+        pthread_mutex_unlock(&connections.mutex);
 
-        if (conn_constructor(ret) != 0) {
-            conn_destructor(ret);
-            free(ret);
+        if (slot == NULL) {
             settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                                             "Failed to allocate memory for connection");
             return NULL;
         }
-
-        pthread_mutex_lock(&connections.mutex);
-        if (connections.next == settings.maxconns) {
-            free(ret);
-            ret = NULL;
-        } else {
-            connections.all[connections.next++] = ret;
-        }
-        pthread_mutex_unlock(&connections.mutex);
+        ret = &slot->conn;
     }
 
     return ret;
 }
 
 static void release_connection(conn *c) {
+    struct conn_pool *pool = conn_slot(c)->pool;
     c->sfd = INVALID_SOCKET;
-    pthread_mutex_lock(&connections.mutex);
-    c->next = connections.free;
-    connections.free = c;
-    pthread_mutex_unlock(&connections.mutex);
+    pthread_mutex_lock(&pool->mutex);
+    c->next = pool->free;
+    pool->free = c;
+    pthread_mutex_unlock(&pool->mutex);
 }
 
 static const char *substate_text(enum bin_substates state) {
@@ -651,6 +796,7 @@ static const char *substate_text(enum bin_substates state) {
     case bin_reading_sasl_auth: return "bin_reading_sasl_auth";
     case bin_reading_sasl_auth_data: return "bin_reading_sasl_auth_data";
     case bin_reading_packet: return "bin_reading_packet";
+    case ascii_read_set_value: return "ascii_read_set_value";
     default:
         return "illegal";
     }
@@ -658,6 +804,7 @@ static const char *substate_text(enum bin_substates state) {
 
 static const char *protocol_text(enum protocol protocol) {
     switch (protocol) {
+    case ascii_prot: return "ascii";
     case binary_prot: return "binary";
     case negotiating_prot: return "negotiating";
     default:
@@ -685,10 +832,26 @@ static void add_connection_stats(ADD_STAT add_stats, conn *d, conn *c) {
         append_stat("transport", add_stats, d, "%s",
                     transport_text(c->transport));
         append_stat("nevents", add_stats, d, "%u", c->nevents);
+        append_stat("priority", add_stats, d, "%s",
+                    c->bulk ? "bulk" : "interactive");
+        append_stat("peer", add_stats, d, "%s", c->peer);
+        append_stat("ops", add_stats, d, "%"PRIu64, c->traffic.ops);
+        append_stat("bytes_read", add_stats, d, "%"PRIu64,
+                    c->traffic.bytes_read);
+        append_stat("bytes_written", add_stats, d, "%"PRIu64,
+                    c->traffic.bytes_written);
+        append_stat("engine_cycles", add_stats, d, "%"PRIu64,
+                    c->traffic.engine_cycles);
         if (c->sasl_conn != NULL) {
             append_stat("sasl_conn", add_stats, d, "%p", c->sasl_conn);
         }
         append_stat("state", add_stats, d, "%s", state_text(c->state));
+        if (c->idle_list != NULL) {
+            append_stat("idle", add_stats, d, "%u",
+                        current_time - c->idle_since);
+            append_stat("hibernating", add_stats, d, "%d",
+                        (int)(c->idle_list == &c->thread->hibernating));
+        }
         if (c->protocol == binary_prot) {
             append_stat("substate", add_stats, d, "%s",
                         substate_text(c->substate));
@@ -731,9 +894,19 @@ static void add_connection_stats(ADD_STAT add_stats, conn *d, conn *c) {
 
         if (c->transport == udp_transport) {
             // @todo we should dump the packet header
-            append_stat("request_id", add_stats, d, "%u", c->request_id);
-            append_stat("hdrbuf", add_stats, d, "%p", c->hdrbuf);
-            append_stat("hdrsize", add_stats, d, "%d", c->hdrsize);
+            append_stat("request_id", add_stats, d, "%u", c->udp->request_id);
+            append_stat("hdrbuf", add_stats, d, "%p", c->udp->hdrbuf);
+            append_stat("hdrsize", add_stats, d, "%d", c->udp->hdrsize);
+            if (c->udp->reader != NULL) {
+                struct udp_reader_stats us;
+                udp_reader_stats(c->udp->reader, &us);
+                append_stat("udp_batches", add_stats, d, "%"PRIu64, us.batches);
+                append_stat("udp_datagrams", add_stats, d, "%"PRIu64,
+                            us.datagrams);
+                append_stat("udp_reassembled", add_stats, d, "%"PRIu64,
+                            us.reassembled);
+                append_stat("udp_dropped", add_stats, d, "%"PRIu64, us.dropped);
+            }
         }
 
         append_stat("noreply", add_stats, d, "%d", c->noreply);
@@ -776,145 +949,556 @@ static void connection_stats(ADD_STAT add_stats, conn *c) {
     }
 }
 
-conn *conn_new(const SOCKET sfd, const int parent_port,
-               STATE_FUNC init_state, const int event_flags,
-               const int read_buffer_size, enum network_transport transport,
-               struct event_base *base, struct timeval *timeout) {
-    conn *c = allocate_connection();
-    if (c == NULL) {
-        return NULL;
+/*
+ * A TCP connection of a worker thread doesn't hold on to its read and
+ * write buffers while it's idle. When it starts waiting for the next
+ * request with nothing left in the buffers it gives them back to the
+ * pool of its thread (buffer_cache), and it takes new ones when there is
+ * something to read. The read buffer comes in a few sizes: the connection
+ * asks for one that would have fit what it read the last time around
+ * (rsize_hint), so that a client sending big requests doesn't have to
+ * grow the buffer every time. Buffers that have grown beyond the pooled
+ * sizes are allocated with malloc() and freed when the connection goes
+ * idle. Since cache_alloc() may hand out a pointer into the middle of an
+ * allocation, a pooled buffer must never be passed to realloc() or free();
+ * rbuf_pooled and wbuf_pooled tell where the buffers came from.
+ */
+static int conn_buffer_class(uint32_t size) {
+    for (int ii = 0; ii < CONN_BUFFER_CLASSES; ++ii) {
+        if (size == (uint32_t)DATA_BUFFER_SIZE << ii) {
+            return ii;
+        }
     }
+    return -1;
+}
 
-    assert(c->thread == NULL);
-
-    if (c->rsize < read_buffer_size) {
-        void *mem = malloc(read_buffer_size);
-        if (mem) {
-            c->rsize = read_buffer_size;
-            free(c->rbuf);
-            c->rbuf = mem;
-        } else {
-            assert(c->thread == NULL);
-            release_connection(c);
-            return NULL;
-        }
+static char *conn_buffer_alloc(LIBEVENT_THREAD *t, uint32_t size,
+                               bool *pooled) {
+    int clsid = conn_buffer_class(size);
+    if (clsid == -1) {
+        *pooled = false;
+        return malloc(size);
     }
 
-    c->transport = transport;
-    c->protocol = settings.binding_protocol;
+    char *buf = cache_alloc(t->buffer_cache[clsid]);
+    if (buf != NULL && t->buffers_free[clsid] > 0) {
+        --t->buffers_free[clsid];
+    }
+    *pooled = true;
+    return buf;
+}
 
-    if (IS_UDP(transport)) {
-        c->request_addr_size = sizeof(c->request_addr);
+static void conn_buffer_free(LIBEVENT_THREAD *t, char *buf, uint32_t size,
+                             bool pooled) {
+    if (pooled) {
+        int clsid = conn_buffer_class(size);
+        assert(clsid != -1);
+        cache_free(t->buffer_cache[clsid], buf);
+        ++t->buffers_free[clsid];
     } else {
-        c->request_addr_size = 0;
+        free(buf);
     }
+}
 
-    if (settings.verbose > 1) {
-        if (init_state == conn_listening) {
-            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
-                                            "<%d server listening (%s)\n", sfd,
-                                            protocol_text(c->protocol));
-        } else if (IS_UDP(transport)) {
-            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
-                                            "<%d server listening (udp)\n", sfd);
-        } else if (c->protocol == negotiating_prot) {
-            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
-                                            "<%d new auto-negotiating client connection\n",
-                                            sfd);
-        } else if (c->protocol == binary_prot) {
-            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
-                                            "<%d new binary client connection.\n", sfd);
-        } else {
-            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
-                                            "<%d new unknown (%d) client connection\n",
-                                            sfd, c->protocol);
-            assert(false);
+static bool conn_acquire_buffers(conn *c) {
+    LIBEVENT_THREAD *t = c->thread;
+    assert(t != NULL);
+    assert(c->rbuf == NULL && c->wbuf == NULL);
+
+    c->rbuf = conn_buffer_alloc(t, c->rsize_hint, &c->rbuf_pooled);
+    c->wbuf = conn_buffer_alloc(t, DATA_BUFFER_SIZE, &c->wbuf_pooled);
+    if (c->rbuf == NULL || c->wbuf == NULL) {
+        if (c->rbuf != NULL) {
+            conn_buffer_free(t, c->rbuf, c->rsize_hint, c->rbuf_pooled);
+        }
+        if (c->wbuf != NULL) {
+            conn_buffer_free(t, c->wbuf, DATA_BUFFER_SIZE, c->wbuf_pooled);
         }
+        c->rbuf = c->wbuf = NULL;
+        return false;
     }
 
-    c->sfd = sfd;
-    c->parent_port = parent_port;
-    c->state = init_state;
-    c->rlbytes = 0;
-    c->cmd = -1;
-    c->ascii_cmd = NULL;
-    c->rbytes = c->wbytes = 0;
-    c->wcurr = c->wbuf;
+    c->rsize = c->rsize_hint;
+    c->wsize = DATA_BUFFER_SIZE;
     c->rcurr = c->rbuf;
-    c->ritem = 0;
-    c->icurr = c->ilist;
-    c->suffixcurr = c->suffixlist;
-    c->ileft = 0;
-    c->suffixleft = 0;
-    c->iovused = 0;
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->next = NULL;
-    c->list_state = 0;
-
-    c->write_and_go = init_state;
-    c->write_and_free = 0;
-    c->item = 0;
-
-    c->noreply = false;
-
-    event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
-    event_base_set(base, &c->event);
-    c->ev_flags = event_flags;
+    c->wcurr = c->wbuf;
+    c->rbytes_peak = 0;
+    c->buffers_pinned = true;
+    t->buffers_pinned += c->rsize + c->wsize;
+    return true;
+}
 
-    if (!register_event(c, timeout)) {
-        assert(c->thread == NULL);
-        release_connection(c);
-        return NULL;
+/*
+ * Give back (or free) the read and write buffers. t is the thread running
+ * the connection.
+ */
+static void conn_release_buffers(conn *c, LIBEVENT_THREAD *t) {
+    if (c->buffers_pinned) {
+        t->buffers_pinned -= c->rsize + c->wsize;
+        c->buffers_pinned = false;
     }
+    if (c->rbuf != NULL) {
+        conn_buffer_free(t, c->rbuf, c->rsize, c->rbuf_pooled);
+    }
+    if (c->wbuf != NULL) {
+        conn_buffer_free(t, c->wbuf, c->wsize, c->wbuf_pooled);
+    }
+    c->rbuf = c->rcurr = NULL;
+    c->wbuf = c->wcurr = NULL;
+    c->rsize = c->wsize = 0;
+    c->rbuf_pooled = c->wbuf_pooled = false;
+}
 
-    STATS_LOCK();
-    stats.total_conns++;
-    STATS_UNLOCK();
-
-    c->aiostat = ENGINE_SUCCESS;
-    c->ewouldblock = false;
-    c->refcount = 1;
+/*
+ * Called when the connection starts waiting for the next request
+ */
+static void conn_idle_buffers(conn *c) {
+    if (!c->buffers_pinned || c->rbytes != 0 || c->ncoalesced != 0 ||
+        c->tap_iterator != NULL || c->ewouldblock) {
+        return;
+    }
 
-    MEMCACHED_CONN_ALLOCATE(c->sfd);
+    /* Go for what we needed, but don't drop the size too quickly */
+    uint32_t size = DATA_BUFFER_SIZE;
+    while (size < c->rbytes_peak && conn_buffer_class(size * 2) != -1) {
+        size *= 2;
+    }
+    if (size < c->rsize_hint / 2) {
+        size = c->rsize_hint / 2;
+    }
+    c->rsize_hint = size;
 
-    perform_callbacks(ON_CONNECT, NULL, c);
+    conn_release_buffers(c, c->thread);
+}
 
-    return c;
+/*
+ * With -o the connections waiting for a request are on the idle list of
+ * their thread, in the order they got there. Once a second the thread
+ * closes the ones that have been idle for idle_timeout seconds, and
+ * hibernates the ones that have been idle for hibernate_timeout: they
+ * give up everything they can get again when the next request comes in
+ * (the lists that have grown, the arrays of the quiet gets and stores,
+ * the OpenSSL buffers), and keep the socket, the SASL identity and what
+ * the engine has for them. They're moved to the hibernating list, so
+ * that neither list has to be walked further than what's due.
+ */
+static void conn_idle_link(conn *c, struct conn_idle_list *list) {
+    c->idle_list = list;
+    c->idle_next = NULL;
+    c->idle_prev = list->tail;
+    if (list->tail != NULL) {
+        list->tail->idle_next = c;
+    } else {
+        list->head = c;
+    }
+    list->tail = c;
+    ++list->count;
 }
 
-static void conn_cleanup(conn *c) {
-    assert(c != NULL);
+static void conn_idle_unlink(conn *c) {
+    struct conn_idle_list *list = c->idle_list;
+    if (c->idle_prev != NULL) {
+        c->idle_prev->idle_next = c->idle_next;
+    } else {
+        list->head = c->idle_next;
+    }
+    if (c->idle_next != NULL) {
+        c->idle_next->idle_prev = c->idle_prev;
+    } else {
+        list->tail = c->idle_prev;
+    }
+    --list->count;
+    c->idle_list = NULL;
+    c->idle_prev = c->idle_next = NULL;
+}
 
-    if (c->item) {
-        settings.engine.v1->release(settings.engine.v0, c, c->item);
-        c->item = 0;
+/*
+ * The connection waits for the next request (in conn_read, or for the
+ * first one of a new connection). The next change of its state takes it
+ * off the idle list again.
+ */
+void conn_went_idle(conn *c) {
+    if ((settings.idle_timeout != 0 || settings.hibernate_timeout != 0) &&
+        c->idle_list == NULL && !IS_UDP(c->transport) &&
+        c->stats_sub == NULL) {
+        c->idle_since = current_time;
+        conn_idle_link(c, &c->thread->idle);
+    }
+}
+
+static void conn_hibernate(conn *c) {
+    if (!c->io_pending) {
+        /* (a recv in the ring has the lists) */
+        conn_reset_buffersize(c);
+    }
+    if (c->mget_next == c->mget_count) {
+        free(c->mget);
+        c->mget = NULL;
+        c->mget_next = c->mget_count = 0;
+    }
+    if (c->mstore_next == c->mstore_count) {
+        free(c->mstore);
+        c->mstore = NULL;
+        c->mstore_next = c->mstore_count = 0;
+    }
+    free(c->riov);
+    c->riov = NULL;
+    c->riovsize = 0;
+    if (c->zc_nitems == 0) {
+        free(c->zc_items);
+        c->zc_items = NULL;
+    }
+    if (c->dynamic_buffer.buffer != NULL) {
+        free(c->dynamic_buffer.buffer);
+        c->dynamic_buffer.buffer = NULL;
+        c->dynamic_buffer.size = c->dynamic_buffer.offset = 0;
+    }
+    if (c->tls != NULL) {
+        tls_release_buffers(c->tls);
     }
+}
 
-    if (c->ileft != 0) {
-        for (; c->ileft > 0; c->ileft--,c->icurr++) {
-            settings.engine.v1->release(settings.engine.v0, c, *(c->icurr));
+/*
+ * Resize the read buffer, keeping its content like realloc() would
+ */
+static bool conn_resize_rbuf(conn *c, uint32_t nsize) {
+    char *buf;
+    if (c->rbuf_pooled) {
+        buf = malloc(nsize);
+        if (buf == NULL) {
+            return false;
+        }
+        memcpy(buf, c->rbuf, c->rsize < nsize ? c->rsize : nsize);
+        conn_buffer_free(c->thread, c->rbuf, c->rsize, true);
+        c->rbuf_pooled = false;
+    } else {
+        buf = realloc(c->rbuf, nsize);
+        if (buf == NULL) {
+            return false;
         }
     }
 
-    if (c->suffixleft != 0) {
-        for (; c->suffixleft > 0; c->suffixleft--, c->suffixcurr++) {
-            cache_free(c->thread->suffix_cache, *(c->suffixcurr));
+    if (c->buffers_pinned) {
+        c->thread->buffers_pinned += (int64_t)nsize - c->rsize;
+    }
+    c->rbuf = buf;
+    c->rsize = nsize;
+    return true;
+}
+
+/*
+ * The clients are summed up by their address (their connections come
+ * from different ports)
+ */
+static void conn_set_peer(conn *c, SOCKET sfd, enum network_transport transport) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    strcpy(c->peer, "unknown");
+    if (IS_UDP(transport)) {
+        strcpy(c->peer, "udp");
+    } else if (transport == local_transport) {
+        strcpy(c->peer, "unix");
+    } else if (getpeername(sfd, (struct sockaddr *)&addr, &addrlen) == 0) {
+        if (addr.ss_family == AF_INET) {
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr,
+                      c->peer, sizeof(c->peer));
+        } else if (addr.ss_family == AF_INET6) {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr,
+                      c->peer, sizeof(c->peer));
+        }
+    }
+}
+
+/*
+ * Hand what the connection did since the last time to the heaviest
+ * clients of its thread
+ */
+static void conn_push_traffic(conn *c) {
+    struct client_traffic delta = {
+        .ops = c->traffic.ops - c->traffic_pushed.ops,
+        .bytes_read = c->traffic.bytes_read - c->traffic_pushed.bytes_read,
+        .bytes_written = c->traffic.bytes_written - c->traffic_pushed.bytes_written,
+        .engine_cycles = c->traffic.engine_cycles - c->traffic_pushed.engine_cycles
+    };
+    if (c->thread == NULL || (delta.ops == 0 && delta.bytes_read == 0 &&
+                              delta.bytes_written == 0)) {
+        return;
+    }
+
+    c->peer_slot = topclients_add(&c->thread->top_peers, c->peer_slot,
+                                  c->peer, &delta);
+    if (c->sasl_conn != NULL) {
+        const void *user = NULL;
+        sasl_getprop(c->sasl_conn, SASL_USERNAME, &user);
+        if (user != NULL) {
+            c->user_slot = topclients_add(&c->thread->top_users, c->user_slot,
+                                          user, &delta);
+        }
+    }
+    c->traffic_pushed = c->traffic;
+}
+
+/*
+ * The ports and the SASL users whose connections are bulk (-G)
+ */
+static struct {
+    int *ports;
+    int nports;
+    char **users;
+    int nusers;
+} bulk_classes;
+
+static bool parse_bulk_classes(const char *spec) {
+    char *list = strdup(spec);
+    char *b;
+    if (list == NULL) {
+        return false;
+    }
+    for (char *p = strtok_r(list, ",", &b); p != NULL;
+         p = strtok_r(NULL, ",", &b)) {
+        int32_t port;
+        if (safe_strtol(p, &port)) {
+            int *ports = realloc(bulk_classes.ports,
+                                 (bulk_classes.nports + 1) * sizeof(*ports));
+            if (port <= 0 || ports == NULL) {
+                free(list);
+                return false;
+            }
+            bulk_classes.ports = ports;
+            bulk_classes.ports[bulk_classes.nports++] = port;
+        } else {
+            char **users = realloc(bulk_classes.users,
+                                   (bulk_classes.nusers + 1) * sizeof(*users));
+            if (users == NULL) {
+                free(list);
+                return false;
+            }
+            bulk_classes.users = users;
+            bulk_classes.users[bulk_classes.nusers++] = strdup(p);
+        }
+    }
+    free(list);
+    return true;
+}
+
+static bool is_bulk_port(int port) {
+    for (int ii = 0; ii < bulk_classes.nports; ++ii) {
+        if (bulk_classes.ports[ii] == port) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_bulk_user(const char *user) {
+    for (int ii = 0; ii < bulk_classes.nusers; ++ii) {
+        if (strcmp(bulk_classes.users[ii], user) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * A connection that used up its requests for this event waits with the
+ * bulk ones, so that it doesn't keep them out for good
+ */
+static short conn_priority(const conn *c) {
+    return c->bulk || c->nevents < 0 ?
+        CONN_PRIORITY_BULK : CONN_PRIORITY_INTERACTIVE;
+}
+
+static void conn_set_event(conn *c, struct event_base *base, short flags) {
+    event_set(&c->event, c->sfd, flags, event_handler, (void *)c);
+    event_base_set(base, &c->event);
+    c->ev_flags = flags;
+    c->ev_priority = conn_priority(c);
+    /* The dispatcher's base has a single priority */
+    if (event_priority_set(&c->event, c->ev_priority) == -1) {
+        c->ev_priority = CONN_PRIORITY_INTERACTIVE;
+    }
+}
+
+conn *conn_new(const SOCKET sfd, const int parent_port,
+               STATE_FUNC init_state, const int event_flags,
+               const int read_buffer_size, enum network_transport transport,
+               struct event_base *base, struct timeval *timeout) {
+    conn *c = allocate_connection();
+    if (c == NULL) {
+        return NULL;
+    }
+
+    assert(c->thread == NULL);
+    assert(c->rbuf == NULL && c->wbuf == NULL);
+
+    /* TCP clients take their buffers from the pool when they need them */
+    c->rsize_hint = DATA_BUFFER_SIZE;
+    if ((init_state != conn_new_cmd && init_state != conn_tls_handshake) ||
+        IS_UDP(transport)) {
+        c->rbuf = malloc(read_buffer_size);
+        c->wbuf = malloc(DATA_BUFFER_SIZE);
+        if (c->rbuf == NULL || c->wbuf == NULL) {
+            free(c->rbuf);
+            free(c->wbuf);
+            c->rbuf = c->wbuf = NULL;
+            release_connection(c);
+            return NULL;
+        }
+        c->rsize = read_buffer_size;
+        c->wsize = DATA_BUFFER_SIZE;
+    }
+
+    c->transport = transport;
+    c->protocol = settings.binding_protocol;
+
+    if (IS_UDP(transport)) {
+        assert(c->udp == NULL);
+        if ((c->udp = calloc(1, sizeof(*c->udp))) == NULL) {
+            free(c->rbuf);
+            free(c->wbuf);
+            c->rbuf = c->wbuf = NULL;
+            release_connection(c);
+            return NULL;
+        }
+        c->udp->request_addr_size = sizeof(c->udp->request_addr);
+    }
+
+    if (settings.verbose > 1) {
+        if (init_state == conn_listening) {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                            "<%d server listening (%s)\n", sfd,
+                                            protocol_text(c->protocol));
+        } else if (IS_UDP(transport)) {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                            "<%d server listening (udp)\n", sfd);
+        } else if (c->protocol == negotiating_prot) {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                            "<%d new auto-negotiating client connection\n",
+                                            sfd);
+        } else if (c->protocol == binary_prot) {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                            "<%d new binary client connection.\n", sfd);
+        } else {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                            "<%d new unknown (%d) client connection\n",
+                                            sfd, c->protocol);
+            assert(false);
         }
     }
 
+    c->sfd = sfd;
+    c->parent_port = parent_port;
+    c->state = init_state;
+    c->rlbytes = 0;
+    c->cmd = -1;
+    c->ascii_cmd = NULL;
+    c->rbytes = c->wbytes = 0;
+    c->wcurr = c->wbuf;
+    c->rcurr = c->rbuf;
+    c->ritem = 0;
+    c->riovused = c->riovcurr = 0;
+    c->icurr = c->ilist;
+    c->suffixcurr = c->suffixlist;
+    c->ileft = 0;
+    c->suffixleft = 0;
+    c->iovused = 0;
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->next = NULL;
+    c->list_state = 0;
+
+    c->write_and_go = init_state == conn_tls_handshake ? conn_new_cmd : init_state;
+    c->write_and_free = 0;
+    c->item = 0;
+
+    c->noreply = false;
+    c->io_pending = c->io_done = false;
+    c->zc_iov = -1;
+    c->zc_enabled = false;
+    c->zc_next = c->zc_done = 0;
+    c->zc_nitems = 0;
+    c->zc_close_wait = 0;
+    c->mget_next = c->mget_count = 0;
+    c->mstore_next = c->mstore_count = 0;
+    c->ncoalesced = 0;
+    c->coalesced_bytes = c->wcoalesced = 0;
+    c->resp_iov = 0;
+    c->flushing = false;
+    c->corked = false;
+    c->timing_start = c->timing_blocked = c->timing_block_start = 0;
+    memset(&c->traffic, 0, sizeof(c->traffic));
+    memset(&c->traffic_pushed, 0, sizeof(c->traffic_pushed));
+    c->peer_slot = c->user_slot = -1;
+    conn_set_peer(c, sfd, transport);
+    assert(c->tls == NULL);
+
+    c->nevents = settings.reqs_per_event;
+    c->bulk = init_state != conn_listening && is_bulk_port(parent_port);
+    conn_set_event(c, base, event_flags);
+
+    if (!register_event(c, timeout)) {
+        assert(c->thread == NULL);
+        release_connection(c);
+        return NULL;
+    }
+
+    STATS_LOCK();
+    stats.total_conns++;
+    STATS_UNLOCK();
+
+    c->aiostat = ENGINE_SUCCESS;
+    c->ewouldblock = false;
+    c->refcount = 1;
+
+    MEMCACHED_CONN_ALLOCATE(c->sfd);
+
+    perform_callbacks(ON_CONNECT, NULL, c);
+
+    return c;
+}
+
+static void conn_cleanup(conn *c) {
+    assert(c != NULL);
+
+    if (c->item) {
+        settings.engine.v1->release(settings.engine.v0, c, c->item);
+        c->item = 0;
+    }
+
+    /* The socket is closed, so the kernel won't send from these anymore */
+    for (int ii = 0; ii < c->zc_nitems; ++ii) {
+        settings.engine.v1->release(settings.engine.v0, c,
+                                    c->zc_items[ii].item);
+    }
+    c->zc_nitems = 0;
+    c->riovused = c->riovcurr = 0;
+    conn_release_mget(c);
+    c->mstore_next = c->mstore_count = 0;
+    conn_coalesce_reset(c);
+
+    conn_release_items(c);
+
     if (c->write_and_free) {
         free(c->write_and_free);
         c->write_and_free = 0;
     }
 
+    conn_push_traffic(c);
+    tls_session_destroy(c->tls);
+    c->tls = NULL;
     if (c->sasl_conn) {
         sasl_dispose(&c->sasl_conn);
         c->sasl_conn = NULL;
     }
 
+    stats_sub_free(c);
     c->engine_storage = NULL;
     c->tap_iterator = NULL;
+    free(c->tap_flow.window);
+    memset(&c->tap_flow, 0, sizeof(c->tap_flow));
+    tap_compress_destroy(c);
+    conn_udp_destroy(c);
     c->thread = NULL;
     assert(c->next == NULL);
     c->ascii_cmd = NULL;
@@ -937,8 +1521,11 @@ void conn_close(conn *c) {
                                         "Current connection was in the pending-io list.. Nuking it\n");
     }
     c->thread->pending_io = list_remove(c->thread->pending_io, c);
+    thread_conn_closed(c->thread);
 
+    LIBEVENT_THREAD *thread = c->thread;
     conn_cleanup(c);
+    conn_release_buffers(c, thread);
 
     /*
      * The contract with the object cache is that we should return the
@@ -965,23 +1552,16 @@ static void conn_shrink(conn *c) {
         return;
 
     if (c->rsize > READ_BUFFER_HIGHWAT && c->rbytes < DATA_BUFFER_SIZE) {
-        char *newbuf;
-
         if (c->rcurr != c->rbuf)
             memmove(c->rbuf, c->rcurr, (size_t)c->rbytes);
 
-        newbuf = (char *)realloc((void *)c->rbuf, DATA_BUFFER_SIZE);
-
-        if (newbuf) {
-            c->rbuf = newbuf;
-            c->rsize = DATA_BUFFER_SIZE;
-        }
+        conn_resize_rbuf(c, DATA_BUFFER_SIZE);
         /* TODO check other branch... */
         c->rcurr = c->rbuf;
     }
 
     if (c->isize > ITEM_LIST_HIGHWAT) {
-        item **newbuf = (item**) realloc((void *)c->ilist, ITEM_LIST_INITIAL * sizeof(c->ilist[0]));
+        item **newbuf = CONN_LIST_RESIZE(c, ilist, c->isize, ITEM_LIST_INITIAL);
         if (newbuf) {
             c->ilist = newbuf;
             c->isize = ITEM_LIST_INITIAL;
@@ -990,7 +1570,8 @@ static void conn_shrink(conn *c) {
     }
 
     if (c->msgsize > MSG_LIST_HIGHWAT) {
-        struct msghdr *newbuf = (struct msghdr *) realloc((void *)c->msglist, MSG_LIST_INITIAL * sizeof(c->msglist[0]));
+        struct msghdr *newbuf = CONN_LIST_RESIZE(c, msglist, c->msgsize,
+                                                 MSG_LIST_INITIAL);
         if (newbuf) {
             c->msglist = newbuf;
             c->msgsize = MSG_LIST_INITIAL;
@@ -999,7 +1580,8 @@ static void conn_shrink(conn *c) {
     }
 
     if (c->iovsize > IOV_LIST_HIGHWAT) {
-        struct iovec *newbuf = (struct iovec *) realloc((void *)c->iov, IOV_LIST_INITIAL * sizeof(c->iov[0]));
+        struct iovec *newbuf = CONN_LIST_RESIZE(c, iov, c->iovsize,
+                                                IOV_LIST_INITIAL);
         if (newbuf) {
             c->iov = newbuf;
             c->iovsize = IOV_LIST_INITIAL;
@@ -1042,6 +1624,8 @@ const char *state_text(STATE_FUNC state) {
         return "conn_immediate_close";
     } else if (state == conn_refresh_isasl) {
         return "conn_refresh_isasl";
+    } else if (state == conn_tls_handshake) {
+        return "conn_tls_handshake";
     } else {
         return "Unknown";
     }
@@ -1056,6 +1640,13 @@ void conn_set_state(conn *c, STATE_FUNC state) {
     assert(c != NULL);
 
     if (state != c->state) {
+        if (c->idle_list != NULL) {
+            if (c->idle_list == &c->thread->hibernating) {
+                ++c->thread->wakeups;
+            }
+            conn_idle_unlink(c);
+        }
+
         /*
          * The connections in the "tap thread" behaves differently than
          * normal connections because they operate in a full duplex mode.
@@ -1085,6 +1676,74 @@ void conn_set_state(conn *c, STATE_FUNC state) {
     }
 }
 
+/* The states in thread_cycles.state (the busy ones first) */
+static STATE_FUNC const cycle_states[CONN_NSTATES] = {
+    conn_new_cmd, conn_waiting, conn_read, conn_parse_cmd, conn_nread,
+    conn_write, conn_mwrite, conn_ship_log, conn_swallow, conn_closing,
+    conn_pending_close, conn_immediate_close, conn_setup_tap_stream,
+    conn_refresh_isasl, conn_tls_handshake, conn_listening
+};
+
+static const char *const engine_call_names[ENGINE_NCALLS] = {
+    [ENGINE_CALL_GET] = "get",
+    [ENGINE_CALL_ALLOCATE] = "allocate",
+    [ENGINE_CALL_STORE] = "store",
+    [ENGINE_CALL_REMOVE] = "remove",
+    [ENGINE_CALL_ARITHMETIC] = "arithmetic",
+    [ENGINE_CALL_FLUSH] = "flush",
+    [ENGINE_CALL_STATS] = "get_stats",
+    [ENGINE_CALL_UNKNOWN_COMMAND] = "unknown_command",
+    [ENGINE_CALL_TAP_ITERATOR] = "tap_iterator",
+    [ENGINE_CALL_TAP_NOTIFY] = "tap_notify"
+};
+
+/*
+ * Run the current state of c, and count its cycles in thr (the state may
+ * release c or move it to another thread)
+ */
+static bool conn_run_state_counted(conn *c, LIBEVENT_THREAD *thr) {
+    STATE_FUNC state = c->state;
+    uint64_t start = timings_cycles();
+    bool ret = state(c);
+    uint64_t cycles = timings_cycles() - start;
+
+    for (int ii = 0; ii < CONN_NSTATES; ++ii) {
+        if (cycle_states[ii] == state) {
+            struct cycle_counter *cc = &thr->cycles.state[ii];
+            cc->calls++;
+            cc->cycles += cycles;
+            break;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Wrap the engine calls in engine_cycles_start() / engine_cycles_end()
+ * to count them (they're counted in the state making them as well). The
+ * connection and the slow request log keep the engine time too.
+ */
+static inline uint64_t engine_cycles_start(const conn *c) {
+    if (c->thread != NULL) {
+        return timings_cycles();
+    }
+    return 0;
+}
+
+static inline void engine_cycles_end(conn *c, enum engine_call call,
+                                     uint64_t start) {
+    if (start != 0) {
+        uint64_t cycles = timings_cycles() - start;
+        c->timing_engine += cycles;
+        c->traffic.engine_cycles += cycles;
+        if (settings.state_cycles) {
+            struct cycle_counter *cc = &c->thread->cycles.engine[call];
+            cc->calls++;
+            cc->cycles += cycles;
+        }
+    }
+}
+
 /*
  * Ensures that there is room for another struct iovec in a connection's
  * iov list.
@@ -1096,8 +1755,8 @@ static int ensure_iov_space(conn *c) {
 
     if (c->iovused >= c->iovsize) {
         int i, iovnum;
-        struct iovec *new_iov = (struct iovec *)realloc(c->iov,
-                                (c->iovsize * 2) * sizeof(struct iovec));
+        struct iovec *new_iov = CONN_LIST_RESIZE(c, iov, c->iovsize,
+                                                 c->iovsize * 2);
         if (! new_iov)
             return -1;
         c->iov = new_iov;
@@ -1184,24 +1843,24 @@ static int build_udp_headers(conn *c) {
 
     assert(c != NULL);
 
-    if (c->msgused > c->hdrsize) {
+    if (c->msgused > c->udp->hdrsize) {
         void *new_hdrbuf;
-        if (c->hdrbuf)
-            new_hdrbuf = realloc(c->hdrbuf, c->msgused * 2 * UDP_HEADER_SIZE);
+        if (c->udp->hdrbuf)
+            new_hdrbuf = realloc(c->udp->hdrbuf, c->msgused * 2 * UDP_HEADER_SIZE);
         else
             new_hdrbuf = malloc(c->msgused * 2 * UDP_HEADER_SIZE);
         if (! new_hdrbuf)
             return -1;
-        c->hdrbuf = (unsigned char *)new_hdrbuf;
-        c->hdrsize = c->msgused * 2;
+        c->udp->hdrbuf = (unsigned char *)new_hdrbuf;
+        c->udp->hdrsize = c->msgused * 2;
     }
 
-    hdr = c->hdrbuf;
+    hdr = c->udp->hdrbuf;
     for (i = 0; i < c->msgused; i++) {
         c->msglist[i].msg_iov[0].iov_base = (void*)hdr;
         c->msglist[i].msg_iov[0].iov_len = UDP_HEADER_SIZE;
-        *hdr++ = c->request_id / 256;
-        *hdr++ = c->request_id % 256;
+        *hdr++ = c->udp->request_id / 256;
+        *hdr++ = c->udp->request_id % 256;
         *hdr++ = i / 256;
         *hdr++ = i % 256;
         *hdr++ = c->msgused / 256;
@@ -1382,14 +2041,18 @@ static void add_bin_header(conn *c, uint16_t err, uint8_t hdr_len, uint16_t key_
 
     assert(c);
 
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->iovused = 0;
-    if (add_msghdr(c) != 0) {
-        /* XXX:  out_string is inappropriate here */
-        out_string(c, "SERVER_ERROR out of memory");
-        return;
+    c->zc_iov = -1;
+    if (c->ncoalesced == 0) {
+        c->msgcurr = 0;
+        c->msgused = 0;
+        c->iovused = 0;
+        if (add_msghdr(c) != 0) {
+            /* XXX:  out_string is inappropriate here */
+            out_string(c, "SERVER_ERROR out of memory");
+            return;
+        }
     }
+    c->resp_iov = c->iovused;
 
     header = (protocol_binary_response_header *)c->wbuf;
 
@@ -1528,8 +2191,15 @@ static void write_bin_packet(conn *c, protocol_binary_response_status err, int s
                                         buffer);
     }
 
+    /* The message has to outlive this function, so put it in the wbuf */
+    size_t maxlen = c->wsize - sizeof(protocol_binary_response_header);
+    if (len > maxlen) {
+        len = maxlen;
+    }
     add_bin_header(c, err, 0, 0, len);
-    add_iov(c, buffer, len);
+    char *ofs = c->wbuf + sizeof(protocol_binary_response_header);
+    memcpy(ofs, buffer, len);
+    add_iov(c, ofs, len);
     conn_set_state(c, conn_mwrite);
     if (swallow > 0) {
         c->sbytes = swallow;
@@ -1592,6 +2262,7 @@ static void complete_incr_bin(conn *c) {
     ENGINE_ERROR_CODE ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
     if (ret == ENGINE_SUCCESS) {
+        uint64_t cycles = engine_cycles_start(c);
         ret = settings.engine.v1->arithmetic(settings.engine.v0,
                                              c, key, nkey, incr,
                                              req->message.body.expiration != 0xffffffff,
@@ -1599,6 +2270,7 @@ static void complete_incr_bin(conn *c) {
                                              &c->cas,
                                              &rsp->message.body.value,
                                              c->binary_header.request.vbucket);
+        engine_cycles_end(c, ENGINE_CALL_ARITHMETIC, cycles);
     }
 
     switch (ret) {
@@ -1652,54 +2324,13 @@ static void complete_incr_bin(conn *c) {
     }
 }
 
-static void complete_update_bin(conn *c) {
-    protocol_binary_response_status eno = PROTOCOL_BINARY_RESPONSE_EINVAL;
-    assert(c != NULL);
-
-    item *it = c->item;
-    item_info_holder info = { .info = { .nvalue = 1 } };
-    if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
-                                           (void*)&info)) {
-        settings.engine.v1->release(settings.engine.v0, c, it);
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                        "%d: Failed to get item info\n",
-                                        c->sfd);
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
-        return;
-    }
-
-    ENGINE_ERROR_CODE ret = c->aiostat;
-    c->aiostat = ENGINE_SUCCESS;
-    if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->store(settings.engine.v0, c,
-                                        it, &c->cas, c->store_op,
-                                        c->binary_header.request.vbucket);
-    }
-
-#ifdef ENABLE_DTRACE
-    switch (c->cmd) {
-    case OPERATION_ADD:
-        MEMCACHED_COMMAND_ADD(c->sfd, info.info.key, info.info.nkey,
-                              (ret == ENGINE_SUCCESS) ? info.info.nbytes : -1, c->cas);
-        break;
-    case OPERATION_REPLACE:
-        MEMCACHED_COMMAND_REPLACE(c->sfd, info.info.key, info.info.nkey,
-                                  (ret == ENGINE_SUCCESS) ? info.info.nbytes : -1, c->cas);
-        break;
-    case OPERATION_APPEND:
-        MEMCACHED_COMMAND_APPEND(c->sfd, info.info.key, info.info.nkey,
-                                 (ret == ENGINE_SUCCESS) ? info.info.nbytes : -1, c->cas);
-        break;
-    case OPERATION_PREPEND:
-        MEMCACHED_COMMAND_PREPEND(c->sfd, info.info.key, info.info.nkey,
-                                  (ret == ENGINE_SUCCESS) ? info.info.nbytes : -1, c->cas);
-        break;
-    case OPERATION_SET:
-        MEMCACHED_COMMAND_SET(c->sfd, info.info.key, info.info.nkey,
-                              (ret == ENGINE_SUCCESS) ? info.info.nbytes : -1, c->cas);
-        break;
-    }
-#endif
+/*
+ * Send the response for a store (if we have to), and count it in the
+ * statistics
+ */
+static void write_bin_store_response(conn *c, ENGINE_ERROR_CODE ret,
+                                     const void *key, uint16_t nkey) {
+    protocol_binary_response_status eno;
 
     switch (ret) {
     case ENGINE_SUCCESS:
@@ -1744,10 +2375,10 @@ static void complete_update_bin(conn *c) {
     if (c->store_op == OPERATION_CAS) {
         switch (ret) {
         case ENGINE_SUCCESS:
-            SLAB_INCR(c, cas_hits, info.info.key, info.info.nkey);
+            SLAB_INCR(c, cas_hits, key, nkey);
             break;
         case ENGINE_KEY_EEXISTS:
-            SLAB_INCR(c, cas_badval, info.info.key, info.info.nkey);
+            SLAB_INCR(c, cas_badval, key, nkey);
             break;
         case ENGINE_KEY_ENOENT:
             STATS_NOKEY(c, cas_misses);
@@ -1756,16 +2387,179 @@ static void complete_update_bin(conn *c) {
             ;
         }
     } else {
-        SLAB_INCR(c, cmd_set, info.info.key, info.info.nkey);
+        SLAB_INCR(c, cmd_set, key, nkey);
     }
+}
 
-    if (!c->ewouldblock) {
-        /* release the c->item reference */
-        settings.engine.v1->release(settings.engine.v0, c, c->item);
+static void complete_update_bin(conn *c) {
+    assert(c != NULL);
+
+    item *it = c->item;
+    item_info_holder info = { .info = { .nvalue = IOV_MAX } };
+    if (!get_item_info(c, it, (void*)&info)) {
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "%d: Failed to get item info\n",
+                                        c->sfd);
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
+        return;
+    }
+
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+    if (ret == ENGINE_SUCCESS) {
+        uint64_t cycles = engine_cycles_start(c);
+        ret = settings.engine.v1->store(settings.engine.v0, c,
+                                        it, &c->cas, c->store_op,
+                                        c->binary_header.request.vbucket);
+        engine_cycles_end(c, ENGINE_CALL_STORE, cycles);
+    }
+
+#ifdef ENABLE_DTRACE
+    switch (c->cmd) {
+    case OPERATION_ADD:
+        MEMCACHED_COMMAND_ADD(c->sfd, info.info.key, info.info.nkey,
+                              (ret == ENGINE_SUCCESS) ? info.info.nbytes : -1, c->cas);
+        break;
+    case OPERATION_REPLACE:
+        MEMCACHED_COMMAND_REPLACE(c->sfd, info.info.key, info.info.nkey,
+                                  (ret == ENGINE_SUCCESS) ? info.info.nbytes : -1, c->cas);
+        break;
+    case OPERATION_APPEND:
+        MEMCACHED_COMMAND_APPEND(c->sfd, info.info.key, info.info.nkey,
+                                 (ret == ENGINE_SUCCESS) ? info.info.nbytes : -1, c->cas);
+        break;
+    case OPERATION_PREPEND:
+        MEMCACHED_COMMAND_PREPEND(c->sfd, info.info.key, info.info.nkey,
+                                  (ret == ENGINE_SUCCESS) ? info.info.nbytes : -1, c->cas);
+        break;
+    case OPERATION_SET:
+        MEMCACHED_COMMAND_SET(c->sfd, info.info.key, info.info.nkey,
+                              (ret == ENGINE_SUCCESS) ? info.info.nbytes : -1, c->cas);
+        break;
+    }
+#endif
+
+    write_bin_store_response(c, ret, info.info.key, info.info.nkey);
+
+    if (!c->ewouldblock) {
+        /* release the c->item reference */
+        settings.engine.v1->release(settings.engine.v0, c, c->item);
         c->item = 0;
     }
 }
 
+/*
+ * A client fetching many keys typically sends a long run of GETQ / GETKQ
+ * packets, and most of the time they're all in the input buffer when we
+ * process the first one. If the engine implements get_multi we look up all
+ * of them in one call, and stash the results in c->mget for process_bin_get
+ * to pick up as it works its way through the packets. The batch is limited
+ * to the packets already received (we never wait for more), so the packets
+ * after the first are processed next in the same order.
+ */
+#define MGET_MAX_KEYS 64
+
+static void conn_release_mget(conn *c) {
+    for (; c->mget_next < c->mget_count; ++c->mget_next) {
+        get_multi_key *key = &c->mget[c->mget_next];
+        if (key->status == ENGINE_SUCCESS) {
+            settings.engine.v1->release(settings.engine.v0, c, key->item);
+        }
+    }
+    c->mget_next = c->mget_count = 0;
+}
+
+/*
+ * Collect the quiet gets following the current one in the input buffer
+ * and look them up (together with the current key) through get_multi.
+ */
+static bool conn_fetch_mget(conn *c, const char *key, size_t nkey) {
+    const char *ptr = c->rcurr;
+    size_t avail = c->rbytes;
+    int nkeys = 1;
+
+    while (nkeys < MGET_MAX_KEYS &&
+           avail >= sizeof(protocol_binary_request_header)) {
+        protocol_binary_request_header req;
+        memcpy(&req, ptr, sizeof(req));
+        uint16_t keylen = ntohs(req.request.keylen);
+        uint32_t bodylen = ntohl(req.request.bodylen);
+
+        if (req.request.magic != PROTOCOL_BINARY_REQ ||
+            (req.request.opcode != PROTOCOL_BINARY_CMD_GETQ &&
+             req.request.opcode != PROTOCOL_BINARY_CMD_GETKQ) ||
+            req.request.extlen != 0 || keylen == 0 ||
+            keylen > KEY_MAX_LENGTH || bodylen != keylen ||
+            avail - sizeof(req) < bodylen) {
+            break;
+        }
+
+        if (c->mget == NULL) {
+            c->mget = malloc(MGET_MAX_KEYS * sizeof(*c->mget));
+            if (c->mget == NULL) {
+                return false;
+            }
+        }
+        c->mget[nkeys].key = ptr + sizeof(req);
+        c->mget[nkeys].nkey = keylen;
+        c->mget[nkeys].vbucket = ntohs(req.request.vbucket);
+        ++nkeys;
+
+        ptr += sizeof(req) + bodylen;
+        avail -= sizeof(req) + bodylen;
+    }
+
+    if (nkeys == 1) {
+        /* Nothing to batch it with */
+        return false;
+    }
+
+    c->mget[0].key = key;
+    c->mget[0].nkey = (uint16_t)nkey;
+    c->mget[0].vbucket = c->binary_header.request.vbucket;
+    uint64_t cycles = engine_cycles_start(c);
+    ENGINE_ERROR_CODE ret = settings.engine.v1->get_multi(settings.engine.v0,
+                                                          c, c->mget, nkeys);
+    engine_cycles_end(c, ENGINE_CALL_GET, cycles);
+    if (ret != ENGINE_SUCCESS) {
+        return false;
+    }
+
+    c->mget_next = 0;
+    c->mget_count = nkeys;
+    return true;
+}
+
+static ENGINE_ERROR_CODE bin_get_item(conn *c, item **it,
+                                      const char *key, size_t nkey) {
+    if (c->mget_next == c->mget_count && c->noreply &&
+        settings.engine.v1->get_multi != NULL) {
+        conn_fetch_mget(c, key, nkey);
+    }
+
+    if (c->mget_next < c->mget_count) {
+        get_multi_key *entry = &c->mget[c->mget_next];
+        if (entry->nkey != nkey) {
+            /* We're out of sync with the batch (shouldn't happen) */
+            conn_release_mget(c);
+        } else {
+            ++c->mget_next;
+            if (entry->status != ENGINE_EWOULDBLOCK) {
+                *it = entry->item;
+                return entry->status;
+            }
+        }
+    }
+
+    uint64_t cycles = engine_cycles_start(c);
+    ENGINE_ERROR_CODE ret = settings.engine.v1->get(settings.engine.v0, c, it,
+                                                    key, nkey,
+                                                    c->binary_header.request.vbucket);
+    engine_cycles_end(c, ENGINE_CALL_GET, cycles);
+    return ret;
+}
+
 static void process_bin_get(conn *c) {
     item *it;
 
@@ -1785,8 +2579,7 @@ static void process_bin_get(conn *c) {
     ENGINE_ERROR_CODE ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
     if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->get(settings.engine.v0, c, &it, key, nkey,
-                                      c->binary_header.request.vbucket);
+        ret = bin_get_item(c, &it, key, nkey);
     }
 
     uint16_t keylen;
@@ -1795,8 +2588,7 @@ static void process_bin_get(conn *c) {
 
     switch (ret) {
     case ENGINE_SUCCESS:
-        if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
-                                               (void*)&info)) {
+        if (!get_item_info(c, it, (void*)&info)) {
             settings.engine.v1->release(settings.engine.v0, c, it);
             settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                             "%d: Failed to get item info\n",
@@ -1807,6 +2599,7 @@ static void process_bin_get(conn *c) {
 
         keylen = 0;
         bodylen = sizeof(rsp->message.body) + info.info.nbytes;
+        c->timing_value = info.info.nbytes;
 
         STATS_HIT(c, get, key, nkey);
 
@@ -1825,6 +2618,11 @@ static void process_bin_get(conn *c) {
             add_iov(c, info.info.key, nkey);
         }
 
+        if (settings.zerocopy_min != 0 &&
+            info.info.nbytes >= settings.zerocopy_min &&
+            conn_use_zerocopy(c)) {
+            c->zc_iov = c->iovused;
+        }
         for (int ii = 0; ii < info.info.nvalue; ++ii) {
             add_iov(c, info.info.value[ii].iov_base,
                     info.info.value[ii].iov_len);
@@ -1841,6 +2639,11 @@ static void process_bin_get(conn *c) {
         if (c->noreply) {
             conn_set_state(c, conn_new_cmd);
         } else {
+            /* The client stores the value with this CAS if it got a lease */
+            if (settings.engine.v1->get_lease != NULL) {
+                c->cas = settings.engine.v1->get_lease(settings.engine.v0, c,
+                                                       key, nkey);
+            }
             if (c->cmd == PROTOCOL_BINARY_CMD_GETK) {
                 char *ofs = c->wbuf + sizeof(protocol_binary_response_header);
                 add_bin_header(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT,
@@ -1985,6 +2788,468 @@ static void append_stats(const char *key, const uint16_t klen,
     assert(c->dynamic_buffer.offset <= c->dynamic_buffer.size);
 }
 
+static const char *const opcode_names[256] = {
+    [PROTOCOL_BINARY_CMD_GET] = "get",
+    [PROTOCOL_BINARY_CMD_SET] = "set",
+    [PROTOCOL_BINARY_CMD_ADD] = "add",
+    [PROTOCOL_BINARY_CMD_REPLACE] = "replace",
+    [PROTOCOL_BINARY_CMD_DELETE] = "delete",
+    [PROTOCOL_BINARY_CMD_INCREMENT] = "incr",
+    [PROTOCOL_BINARY_CMD_DECREMENT] = "decr",
+    [PROTOCOL_BINARY_CMD_QUIT] = "quit",
+    [PROTOCOL_BINARY_CMD_FLUSH] = "flush",
+    [PROTOCOL_BINARY_CMD_GETQ] = "getq",
+    [PROTOCOL_BINARY_CMD_NOOP] = "noop",
+    [PROTOCOL_BINARY_CMD_VERSION] = "version",
+    [PROTOCOL_BINARY_CMD_GETK] = "getk",
+    [PROTOCOL_BINARY_CMD_GETKQ] = "getkq",
+    [PROTOCOL_BINARY_CMD_APPEND] = "append",
+    [PROTOCOL_BINARY_CMD_PREPEND] = "prepend",
+    [PROTOCOL_BINARY_CMD_STAT] = "stat",
+    [PROTOCOL_BINARY_CMD_SETQ] = "setq",
+    [PROTOCOL_BINARY_CMD_ADDQ] = "addq",
+    [PROTOCOL_BINARY_CMD_REPLACEQ] = "replaceq",
+    [PROTOCOL_BINARY_CMD_DELETEQ] = "deleteq",
+    [PROTOCOL_BINARY_CMD_INCREMENTQ] = "incrq",
+    [PROTOCOL_BINARY_CMD_DECREMENTQ] = "decrq",
+    [PROTOCOL_BINARY_CMD_QUITQ] = "quitq",
+    [PROTOCOL_BINARY_CMD_FLUSHQ] = "flushq",
+    [PROTOCOL_BINARY_CMD_APPENDQ] = "appendq",
+    [PROTOCOL_BINARY_CMD_PREPENDQ] = "prependq",
+    [PROTOCOL_BINARY_CMD_VERBOSITY] = "verbosity",
+    [PROTOCOL_BINARY_CMD_TOUCH] = "touch",
+    [PROTOCOL_BINARY_CMD_GAT] = "gat",
+    [PROTOCOL_BINARY_CMD_GATQ] = "gatq",
+    [PROTOCOL_BINARY_CMD_SASL_LIST_MECHS] = "sasl_list_mechs",
+    [PROTOCOL_BINARY_CMD_SASL_AUTH] = "sasl_auth",
+    [PROTOCOL_BINARY_CMD_SASL_STEP] = "sasl_step",
+    [PROTOCOL_BINARY_CMD_SET_VBUCKET] = "set_vbucket",
+    [PROTOCOL_BINARY_CMD_GET_VBUCKET] = "get_vbucket",
+    [PROTOCOL_BINARY_CMD_DEL_VBUCKET] = "del_vbucket",
+    [PROTOCOL_BINARY_CMD_TAP_CONNECT] = "tap_connect",
+    [PROTOCOL_BINARY_CMD_SCRUB] = "scrub",
+    [PROTOCOL_BINARY_CMD_ISASL_REFRESH] = "isasl_refresh",
+    [PROTOCOL_BINARY_CMD_SLABS_REASSIGN] = "slabs_reassign",
+    [PROTOCOL_BINARY_CMD_STATS_SUBSCRIBE] = "stats_subscribe",
+    [PROTOCOL_BINARY_CMD_SNAPSHOT] = "snapshot",
+    [PROTOCOL_BINARY_CMD_NS_BUMP] = "ns_bump",
+    [PROTOCOL_BINARY_CMD_THREADS] = "threads"
+};
+
+static void timings_stats_histogram(ADD_STAT add_stats, conn *c,
+                                    const char *prefix,
+                                    const uint64_t *histo) {
+    static const struct {
+        const char *name;
+        double fraction;
+    } percentiles[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 }
+    };
+    char key[128];
+    uint64_t count = 0;
+
+    for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+        count += histo[ii];
+    }
+    snprintf(key, sizeof(key), "%s:count", prefix);
+    append_stat(key, add_stats, c, "%"PRIu64, count);
+    if (count == 0) {
+        return;
+    }
+
+    for (size_t ii = 0; ii < sizeof(percentiles) / sizeof(percentiles[0]); ++ii) {
+        snprintf(key, sizeof(key), "%s:%s", prefix, percentiles[ii].name);
+        append_stat(key, add_stats, c, "%"PRIu64,
+                    timings_percentile(histo, percentiles[ii].fraction));
+    }
+    for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+        if (histo[ii] != 0) {
+            uint64_t lo, hi;
+            timings_bucket_range(ii, &lo, &hi);
+            snprintf(key, sizeof(key), "%s:%"PRIu64"-%"PRIu64, prefix, lo, hi);
+            append_stat(key, add_stats, c, "%"PRIu64, histo[ii]);
+        }
+    }
+}
+
+/*
+ * "stats timings": the latency histograms of every opcode we've seen, in
+ * nanoseconds. <op>:* is the time we spent serving the requests,
+ * <op>:blocked:* the time the ones that got an EWOULDBLOCK spent waiting
+ * for the engine.
+ */
+static void timings_stats(ADD_STAT add_stats, conn *c) {
+    struct timing_histogram *histo = malloc(sizeof(*histo));
+    if (histo == NULL) {
+        return;
+    }
+
+    for (int op = 0; op < 256; ++op) {
+        memset(histo, 0, sizeof(*histo));
+        if (!threads_timings_aggregate((uint8_t)op, histo)) {
+            continue;
+        }
+
+        char prefix[64];
+        if (opcode_names[op] != NULL) {
+            snprintf(prefix, sizeof(prefix), "%s", opcode_names[op]);
+        } else {
+            snprintf(prefix, sizeof(prefix), "0x%02x", op);
+        }
+        timings_stats_histogram(add_stats, c, prefix, histo->server);
+        strcat(prefix, ":blocked");
+        timings_stats_histogram(add_stats, c, prefix, histo->blocked);
+    }
+
+    free(histo);
+}
+
+/*
+ * "stats tapstreams": the throughput of the TAP streams we produce, the
+ * state of their flow control window (if they asked for one) and how
+ * well their values compress. Connections sending us compressed values
+ * show up with the inflate stats only.
+ */
+static void tap_compress_stats(ADD_STAT add_stats, conn *c, SOCKET sfd,
+                               const char *what, uint64_t msgs,
+                               uint64_t bytes, uint64_t zbytes, uint64_t ns) {
+    char key[64];
+    snprintf(key, sizeof(key), "tap_%lu:%s_msgs", (long)sfd, what);
+    append_stat(key, add_stats, c, "%"PRIu64, msgs);
+    snprintf(key, sizeof(key), "tap_%lu:%s_bytes", (long)sfd, what);
+    append_stat(key, add_stats, c, "%"PRIu64, bytes);
+    snprintf(key, sizeof(key), "tap_%lu:%s_wire_bytes", (long)sfd, what);
+    append_stat(key, add_stats, c, "%"PRIu64, zbytes);
+    snprintf(key, sizeof(key), "tap_%lu:%s_ratio", (long)sfd, what);
+    append_stat(key, add_stats, c, "%.2f",
+                zbytes != 0 ? (double)bytes / zbytes : 0.0);
+    snprintf(key, sizeof(key), "tap_%lu:%s_usec", (long)sfd, what);
+    append_stat(key, add_stats, c, "%"PRIu64, ns / 1000);
+}
+
+static void tap_streams_stats(ADD_STAT add_stats, conn *c) {
+    static const char *names[] = {
+        "sent_msgs", "sent_bytes", "writes", "bytes_per_sec",
+        "acks", "nacks", "window_msgs", "window_max_msgs",
+        "window_bytes", "window_max_bytes", "window_full", "waited_usec"
+    };
+    uint64_t now = timings_now();
+
+    for (int ii = 0; ii < settings.maxconns && connections.all[ii]; ++ii) {
+        conn *t = connections.all[ii];
+        struct tap_flow *f = &t->tap_flow;
+        struct tap_compress *z = &t->tap_compress;
+        char key[64];
+        if (z->inflated_msgs != 0) {
+            tap_compress_stats(add_stats, c, t->sfd, "inflate",
+                               z->inflated_msgs, z->inflated_bytes_out,
+                               z->inflated_bytes_in, z->inflate_ns);
+        }
+        if (t->tap_iterator == NULL || f->connected == 0) {
+            continue;
+        }
+
+        uint64_t age = now > f->connected ? now - f->connected : 1;
+        uint64_t waited = f->waited_ns;
+        if (f->full_since != 0 && now > f->full_since) {
+            waited += now - f->full_since;
+        }
+        uint64_t values[] = {
+            f->sent_msgs, f->sent_bytes, f->writes,
+            (uint64_t)(f->sent_bytes * 1e9 / age),
+            f->acks, f->nacks, f->msgs, f->max_msgs,
+            f->bytes, f->max_bytes, f->full, waited / 1000
+        };
+        /* The window is only there with flow control */
+        int nvalues = f->enabled ? 12 : 4;
+        for (int jj = 0; jj < nvalues; ++jj) {
+            snprintf(key, sizeof(key), "tap_%lu:%s", (long)t->sfd, names[jj]);
+            append_stat(key, add_stats, c, "%"PRIu64, values[jj]);
+        }
+        if (z->enabled || z->msgs != 0) {
+            tap_compress_stats(add_stats, c, t->sfd, "compress", z->msgs,
+                               z->bytes_in, z->bytes_out, z->ns);
+        }
+    }
+}
+
+/*
+ * "stats states": the cycles the worker threads spent in every state of
+ * the connections, and in the engine calls made from them, since "stats
+ * states on". The engine calls are part of the state that made them.
+ */
+static void states_stats(ADD_STAT add_stats, conn *c) {
+    struct thread_cycles *cycles = malloc(sizeof(*cycles));
+    if (cycles == NULL) {
+        return;
+    }
+    threads_cycles_aggregate(cycles);
+    double per_usec = timings_cycles_per_usec();
+
+    append_stat("enabled", add_stats, c, "%s",
+                settings.state_cycles ? "true" : "false");
+    append_stat("cycles_per_usec", add_stats, c, "%.2f", per_usec);
+    for (int ii = 0; ii < CONN_NSTATES + ENGINE_NCALLS; ++ii) {
+        struct cycle_counter *cc;
+        char prefix[64];
+        if (ii < CONN_NSTATES) {
+            cc = &cycles->state[ii];
+            snprintf(prefix, sizeof(prefix), "%s", state_text(cycle_states[ii]));
+        } else {
+            cc = &cycles->engine[ii - CONN_NSTATES];
+            snprintf(prefix, sizeof(prefix), "engine_%s",
+                     engine_call_names[ii - CONN_NSTATES]);
+        }
+        if (cc->calls == 0) {
+            continue;
+        }
+
+        char key[80];
+        snprintf(key, sizeof(key), "%s:calls", prefix);
+        append_stat(key, add_stats, c, "%"PRIu64, cc->calls);
+        snprintf(key, sizeof(key), "%s:cycles", prefix);
+        append_stat(key, add_stats, c, "%"PRIu64, cc->cycles);
+        snprintf(key, sizeof(key), "%s:usec", prefix);
+        append_stat(key, add_stats, c, "%"PRIu64,
+                    (uint64_t)(cc->cycles / per_usec));
+    }
+    free(cycles);
+}
+
+static void topclients_stats(ADD_STAT add_stats, conn *c, bool users) {
+    int nclients;
+    struct topclient *clients = threads_topclients(users, &nclients);
+    if (clients == NULL) {
+        return;
+    }
+
+    double per_usec = timings_cycles_per_usec();
+    if (nclients > TOPCLIENTS_SIZE) {
+        nclients = TOPCLIENTS_SIZE;
+    }
+    for (int ii = 0; ii < nclients; ++ii) {
+        struct topclient *tc = &clients[ii];
+        const char *prefix = users ? "user" : "peer";
+        char key[128];
+
+        snprintf(key, sizeof(key), "%s:%s:ops", prefix, tc->name);
+        append_stat(key, add_stats, c, "%"PRIu64, tc->traffic.ops);
+        snprintf(key, sizeof(key), "%s:%s:ops_error", prefix, tc->name);
+        append_stat(key, add_stats, c, "%"PRIu64, tc->ops_error);
+        snprintf(key, sizeof(key), "%s:%s:bytes_read", prefix, tc->name);
+        append_stat(key, add_stats, c, "%"PRIu64, tc->traffic.bytes_read);
+        snprintf(key, sizeof(key), "%s:%s:bytes_written", prefix, tc->name);
+        append_stat(key, add_stats, c, "%"PRIu64, tc->traffic.bytes_written);
+        snprintf(key, sizeof(key), "%s:%s:engine_usec", prefix, tc->name);
+        append_stat(key, add_stats, c, "%"PRIu64,
+                    per_usec > 0 ? (uint64_t)(tc->traffic.engine_cycles / per_usec) : 0);
+    }
+    free(clients);
+}
+
+/*
+ * "stats clients": the clients sending the most requests, by address and
+ * by SASL user. Every worker thread keeps its TOPCLIENTS_SIZE heaviest
+ * ones (see topclients.h) and the connections add to them between the
+ * requests, so we only look at the threads' tables.
+ */
+static void clients_stats(ADD_STAT add_stats, conn *c) {
+    topclients_stats(add_stats, c, false);
+    topclients_stats(add_stats, c, true);
+}
+
+/* The pools running the tasks of the engines (see submit_task()) */
+static struct taskpool task_pools[TASK_POOL_COUNT];
+
+static ENGINE_ERROR_CODE submit_task(const void *cookie, task_pool_t pool,
+                                     TASK_FUNC fn, void *arg) {
+    if (pool >= TASK_POOL_COUNT) {
+        return ENGINE_EINVAL;
+    }
+    return taskpool_submit(&task_pools[pool], cookie, fn, arg);
+}
+
+/*
+ * "stats tasks": the queues and the latencies of the task pools. The
+ * times are the totals in microseconds, the averages are per task.
+ */
+static void tasks_stats(ADD_STAT add_stats, conn *c) {
+    for (int ii = 0; ii < TASK_POOL_COUNT; ++ii) {
+        struct taskpool *pool = &task_pools[ii];
+        struct taskpool_stats ts;
+        taskpool_get_stats(pool, &ts);
+        uint64_t started = ts.submitted - ts.queued;
+
+        char key[64];
+#define TASKS_STAT(stat, fmt, val) \
+        snprintf(key, sizeof(key), "%s:%s", pool->name, stat); \
+        append_stat(key, add_stats, c, fmt, val)
+        TASKS_STAT("threads", "%d", pool->nthreads);
+        TASKS_STAT("queued", "%u", ts.queued);
+        TASKS_STAT("max_queued", "%u", ts.max_queued);
+        TASKS_STAT("submitted", "%"PRIu64, ts.submitted);
+        TASKS_STAT("completed", "%"PRIu64, ts.completed);
+        TASKS_STAT("stolen", "%"PRIu64, ts.stolen);
+        TASKS_STAT("rejected", "%"PRIu64, ts.rejected);
+        TASKS_STAT("wait_usec", "%"PRIu64, ts.wait_ns / 1000);
+        TASKS_STAT("run_usec", "%"PRIu64, ts.run_ns / 1000);
+        TASKS_STAT("avg_wait_usec", "%"PRIu64,
+                   started > 0 ? ts.wait_ns / 1000 / started : 0);
+        TASKS_STAT("avg_run_usec", "%"PRIu64,
+                   ts.completed > 0 ? ts.run_ns / 1000 / ts.completed : 0);
+#undef TASKS_STAT
+    }
+}
+
+/*
+ * "stats slowlog": the requests slower than -w and the ones sampled by
+ * -y, newest first. The times are in microseconds; a sampled request
+ * tells how long it took to read it as well.
+ */
+static void slowlog_stats(ADD_STAT add_stats, conn *c) {
+    append_stat("threshold_usec", add_stats, c, "%u", settings.slowlog_usec);
+    append_stat("sample", add_stats, c, "%u", settings.slowlog_sample);
+    append_stat("recorded", add_stats, c, "%"PRIu64, slowlog_count());
+
+    struct slowlog_entry *entries = calloc(SLOWLOG_SIZE, sizeof(*entries));
+    if (entries == NULL) {
+        return;
+    }
+
+    int nentries = slowlog_read(entries, SLOWLOG_SIZE);
+    for (int ii = 0; ii < nentries; ++ii) {
+        struct slowlog_entry *e = &entries[ii];
+        char key[80];
+
+#define SLOWLOG_STAT(name, fmt, ...) \
+        snprintf(key, sizeof(key), "%"PRIu64":%s", e->id, name); \
+        append_stat(key, add_stats, c, fmt, __VA_ARGS__)
+
+        SLOWLOG_STAT("time", "%"PRIu64, e->time);
+        SLOWLOG_STAT("conn", "%u", e->conn);
+        if (opcode_names[e->opcode] != NULL) {
+            SLOWLOG_STAT("opcode", "%s", opcode_names[e->opcode]);
+        } else {
+            SLOWLOG_STAT("opcode", "0x%02x", e->opcode);
+        }
+        SLOWLOG_STAT("key", "%.*s",
+                     (int)(e->nkey < SLOWLOG_KEY ? e->nkey : SLOWLOG_KEY),
+                     e->key);
+        SLOWLOG_STAT("key_len", "%u", e->nkey);
+        SLOWLOG_STAT("bucket", "%s", e->bucket);
+        SLOWLOG_STAT("value_size", "%u", e->value_size);
+        SLOWLOG_STAT("total_usec", "%"PRIu64, e->total_ns / 1000);
+        SLOWLOG_STAT("engine_usec", "%"PRIu64, e->engine_ns / 1000);
+        SLOWLOG_STAT("blocked_usec", "%"PRIu64, e->blocked_ns / 1000);
+        SLOWLOG_STAT("ewouldblocks", "%u", e->nblocked);
+        SLOWLOG_STAT("kind", "%s", e->sampled ? "sample" : "slow");
+        if (e->sampled) {
+            uint64_t known = e->read_ns + e->engine_ns + e->blocked_ns;
+            SLOWLOG_STAT("read_usec", "%"PRIu64, e->read_ns / 1000);
+            SLOWLOG_STAT("other_usec", "%"PRIu64,
+                         e->total_ns > known ? (e->total_ns - known) / 1000 : 0);
+        }
+#undef SLOWLOG_STAT
+    }
+    free(entries);
+}
+
+/*
+ * "stats memory": what the allocator says about the heap and, with -A,
+ * the estimated bytes allocated (and still allocated) by every part of
+ * the server. "stats memory dump" has the call stacks behind them.
+ */
+static void memory_stats(ADD_STAT add_stats, conn *c) {
+    allocator_ext_stat ext[8];
+    allocator_stats alloc = { .ext_stats = ext };
+    int next = mc_get_extra_stats_size();
+
+    append_stat("allocator", add_stats, c, "%s",
+                get_alloc_hooks_type() == tcmalloc ? "tcmalloc" : "none");
+    if (get_alloc_hooks_type() != none && next <= 8) {
+        alloc.ext_stats_size = next;
+        mc_get_allocator_stats(&alloc);
+        append_stat("allocated_bytes", add_stats, c, "%zu",
+                    alloc.allocated_size);
+        append_stat("heap_bytes", add_stats, c, "%zu", alloc.heap_size);
+        append_stat("free_bytes", add_stats, c, "%zu", alloc.free_size);
+        append_stat("fragmentation_bytes", add_stats, c, "%zu",
+                    alloc.fragmentation_size);
+        for (int ii = 0; ii < next; ++ii) {
+            append_stat(ext[ii].key, add_stats, c, "%zu", ext[ii].value);
+        }
+    }
+
+    append_stat("heap_sample", add_stats, c, "%zu", heap_profile_interval());
+    if (!heap_profile_enabled()) {
+        return;
+    }
+
+    struct heap_owner_stats owners[HEAP_NOWNERS];
+    heap_profile_stats(owners);
+    for (int ii = 0; ii < HEAP_NOWNERS; ++ii) {
+        const char *name = heap_profile_owner_name(ii);
+        char key[64];
+        snprintf(key, sizeof(key), "%s:alloc_bytes", name);
+        append_stat(key, add_stats, c, "%"PRIu64, owners[ii].alloc_bytes);
+        snprintf(key, sizeof(key), "%s:live_bytes", name);
+        append_stat(key, add_stats, c, "%"PRIu64, owners[ii].live_bytes);
+        snprintf(key, sizeof(key), "%s:live_samples", name);
+        append_stat(key, add_stats, c, "%"PRIu64, owners[ii].live_samples);
+    }
+}
+
+/*
+ * Report the stats of a group (the key of STAT) through add_stats. The
+ * subcommands of STAT that do something else are up to the caller.
+ */
+static ENGINE_ERROR_CODE collect_stats(conn *c, const char *group,
+                                       size_t ngroup, ADD_STAT add_stats) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    enum heap_owner owner = heap_profile_set_owner(HEAP_STATS);
+
+    if (ngroup == 0) {
+        /* request all statistics */
+        uint64_t cycles = engine_cycles_start(c);
+        ret = settings.engine.v1->get_stats(settings.engine.v0, c, NULL, 0,
+                                            add_stats);
+        engine_cycles_end(c, ENGINE_CALL_STATS, cycles);
+        if (ret == ENGINE_SUCCESS) {
+            server_stats(add_stats, c, false);
+        }
+    } else if (strncmp(group, "settings", 8) == 0) {
+        process_stat_settings(add_stats, c);
+    } else if (strncmp(group, "aggregate", 9) == 0) {
+        server_stats(add_stats, c, true);
+    } else if (strncmp(group, "connections", 11) == 0) {
+        connection_stats(add_stats, c);
+    } else if (strncmp(group, "threads", 7) == 0) {
+        threads_stats(add_stats, c);
+    } else if (strncmp(group, "timings", 7) == 0) {
+        timings_stats(add_stats, c);
+    } else if (strncmp(group, "tapstreams", 10) == 0) {
+        tap_streams_stats(add_stats, c);
+    } else if (strncmp(group, "memory", 6) == 0) {
+        memory_stats(add_stats, c);
+    } else if (strncmp(group, "states", 6) == 0) {
+        states_stats(add_stats, c);
+    } else if (strncmp(group, "slowlog", 7) == 0) {
+        slowlog_stats(add_stats, c);
+    } else if (strncmp(group, "clients", 7) == 0) {
+        clients_stats(add_stats, c);
+    } else if (strncmp(group, "tasks", 5) == 0) {
+        tasks_stats(add_stats, c);
+    } else {
+        uint64_t cycles = engine_cycles_start(c);
+        ret = settings.engine.v1->get_stats(settings.engine.v0, c,
+                                            group, ngroup, add_stats);
+        engine_cycles_end(c, ENGINE_CALL_STATS, cycles);
+    }
+
+    heap_profile_set_owner(owner);
+    return ret;
+}
+
 static void process_bin_stat(conn *c) {
     char *subcommand = binary_get_key(c);
     size_t nkey = c->binary_header.request.keylen;
@@ -2004,19 +3269,37 @@ static void process_bin_stat(conn *c) {
 
     if (ret == ENGINE_SUCCESS) {
         if (nkey == 0) {
-            /* request all statistics */
-            ret = settings.engine.v1->get_stats(settings.engine.v0, c, NULL, 0, append_stats);
-            if (ret == ENGINE_SUCCESS) {
-                server_stats(&append_stats, c, false);
-            }
+            ret = collect_stats(c, subcommand, nkey, append_stats);
         } else if (strncmp(subcommand, "reset", 5) == 0) {
             stats_reset(c);
             settings.engine.v1->reset_stats(settings.engine.v0, c);
-        } else if (strncmp(subcommand, "settings", 8) == 0) {
-            process_stat_settings(&append_stats, c);
         } else if (strncmp(subcommand, "cachedump", 9) == 0) {
             write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, 0);
             return;
+        } else if ((nkey == 9 && strncmp(subcommand, "states on", 9) == 0) ||
+                   (nkey == 10 && strncmp(subcommand, "states off", 10) == 0)) {
+            if (!settings.allow_detailed) {
+                write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, 0);
+                return;
+            }
+            settings.state_cycles = subcommand[8] == 'n';
+        } else if (strncmp(subcommand, "memory dump", 11) == 0) {
+            if (!settings.allow_detailed || !heap_profile_enabled()) {
+                write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, 0);
+                return;
+            }
+            enum heap_owner owner = heap_profile_set_owner(HEAP_STATS);
+            int len;
+            char *dump_buf = heap_profile_dump(&len);
+            if (dump_buf != NULL) {
+                append_stats("memory", strlen("memory"), dump_buf, len, c);
+                free(dump_buf);
+            }
+            heap_profile_set_owner(owner);
+            if (dump_buf == NULL) {
+                write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
+                return;
+            }
         } else if (strncmp(subcommand, "detail", 6) == 0) {
             char *subcmd_pos = subcommand + 6;
             if (settings.allow_detailed) {
@@ -2042,14 +3325,8 @@ static void process_bin_stat(conn *c) {
                 write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
                 return;
             }
-        } else if (strncmp(subcommand, "aggregate", 9) == 0) {
-            server_stats(&append_stats, c, true);
-        } else if (strncmp(subcommand, "connections", 11) == 0) {
-            connection_stats(&append_stats, c);
         } else {
-            ret = settings.engine.v1->get_stats(settings.engine.v0, c,
-                                                subcommand, nkey,
-                                                append_stats);
+            ret = collect_stats(c, subcommand, nkey, append_stats);
         }
     }
 
@@ -2082,61 +3359,337 @@ static void process_bin_stat(conn *c) {
     }
 }
 
-static void bin_read_chunk(conn *c, enum bin_substates next_substate, uint32_t chunk) {
-    assert(c);
-    c->substate = next_substate;
-    c->rlbytes = chunk;
-
-    /* Ok... do we have room for everything in our buffer? */
-    ptrdiff_t offset = c->rcurr + sizeof(protocol_binary_request_header) - c->rbuf;
-    if (c->rlbytes > c->rsize - offset) {
-        size_t nsize = c->rsize;
-        size_t size = c->rlbytes + sizeof(protocol_binary_request_header);
-
-        while (size > nsize) {
-            nsize *= 2;
-        }
+/*
+ * A stats subscription pushes the stats of a group that changed since the
+ * last push, so a client that watches a server doesn't have to send (and
+ * we don't have to parse) a STAT request every interval, and it doesn't
+ * get the full text of every stat each time. The stats are still
+ * collected every interval: we compare them with the values we pushed
+ * last, and send the numbers as deltas.
+ */
+static void stats_sub_reset(struct stats_subscription *sub) {
+    for (uint32_t ii = 0; ii < sub->nstats; ++ii) {
+        free(sub->stats[ii].name);
+        free(sub->stats[ii].value);
+    }
+    free(sub->stats);
+    sub->stats = NULL;
+    sub->nstats = sub->size = sub->cursor = 0;
+}
 
-        if (nsize != c->rsize) {
-            if (settings.verbose > 1) {
-                settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
-                        "%d: Need to grow buffer from %lu to %lu\n",
-                        c->sfd, (unsigned long)c->rsize, (unsigned long)nsize);
-            }
-            char *newm = realloc(c->rbuf, nsize);
-            if (newm == NULL) {
-                if (settings.verbose) {
-                    settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
-                            "%d: Failed to grow buffer.. closing connection\n",
-                            c->sfd);
-                }
-                conn_set_state(c, conn_closing);
-                return;
-            }
+static void stats_sub_free(conn *c) {
+    struct stats_subscription *sub = c->stats_sub;
+    if (sub == NULL) {
+        return;
+    }
+    if (evtimer_pending(&sub->timer, NULL)) {
+        evtimer_del(&sub->timer);
+    }
+    stats_sub_reset(sub);
+    free(sub);
+    c->stats_sub = NULL;
+}
 
-            c->rbuf= newm;
-            /* rcurr should point to the same offset in the packet */
-            c->rcurr = c->rbuf + offset - sizeof(protocol_binary_request_header);
-            c->rsize = nsize;
-        }
-        if (c->rbuf != c->rcurr) {
-            memmove(c->rbuf, c->rcurr, c->rbytes);
-            c->rcurr = c->rbuf;
-            if (settings.verbose > 1) {
-                settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
-                                                "%d: Repack input buffer\n",
-                                                c->sfd);
-            }
+static uint32_t stats_sub_lookup(struct stats_subscription *sub,
+                                 const char *key, uint16_t klen) {
+    for (uint32_t ii = 0; ii < sub->nstats; ++ii) {
+        uint32_t id = (sub->cursor + ii) % sub->nstats;
+        if (sub->stats[id].nname == klen &&
+            memcmp(sub->stats[id].name, key, klen) == 0) {
+            return id;
         }
     }
-
-    /* preserve the header in the buffer.. */
-    c->ritem = c->rcurr + sizeof(protocol_binary_request_header);
-    conn_set_state(c, conn_nread);
+    return sub->nstats;
 }
 
-static void bin_read_key(conn *c, enum bin_substates next_substate, int extra) {
-    bin_read_chunk(c, next_substate, c->keylen + extra);
+/* Parse a stat that is a plain unsigned number */
+static bool stats_sub_number(const char *val, uint16_t vlen, uint64_t *out) {
+    char buffer[24];
+    if (vlen == 0 || vlen >= sizeof(buffer) || !isdigit(val[0])) {
+        return false;
+    }
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    return safe_strtoull(buffer, out);
+}
+
+static void stats_sub_add_stat(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    conn *c = (conn*)cookie;
+    struct stats_subscription *sub = c->stats_sub;
+
+    if (klen == 0 || vlen > UINT16_MAX) {
+        return;
+    }
+
+    uint32_t id = stats_sub_lookup(sub, key, klen);
+    if (id == sub->nstats && id > UINT16_MAX) {
+        return;
+    }
+    struct sub_stat *stat = id < sub->nstats ? &sub->stats[id] : NULL;
+    if (stat != NULL && stat->nvalue == vlen &&
+        memcmp(stat->value, val, vlen) == 0) {
+        sub->cursor = id + 1;
+        return;
+    }
+
+    /* The biggest entry is a definition */
+    if (!grow_dynamic_buffer(c, 7 + klen + vlen)) {
+        return;
+    }
+    char *value = malloc(vlen + 1);
+    if (value == NULL) {
+        return;
+    }
+    if (stat == NULL) {
+        if (sub->nstats == sub->size) {
+            uint32_t nsize = sub->size ? sub->size * 2 : 64;
+            struct sub_stat *stats = realloc(sub->stats,
+                                             nsize * sizeof(*stats));
+            if (stats == NULL) {
+                free(value);
+                return;
+            }
+            sub->stats = stats;
+            sub->size = nsize;
+        }
+        stat = &sub->stats[id];
+        if ((stat->name = malloc(klen)) == NULL) {
+            free(value);
+            return;
+        }
+        memcpy(stat->name, key, klen);
+        stat->nname = klen;
+        stat->value = NULL;
+        stat->nvalue = 0;
+        sub->nstats++;
+    }
+
+    char *dst = c->dynamic_buffer.buffer + c->dynamic_buffer.offset;
+    uint16_t nid = htons((uint16_t)id);
+    uint16_t nvalue = htons((uint16_t)vlen);
+    uint64_t prev, next;
+    memcpy(dst, &nid, sizeof(nid));
+    dst += sizeof(nid);
+    if (stat->value == NULL) {
+        uint16_t nname = htons(klen);
+        *dst++ = PROTOCOL_BINARY_STATS_DEFINE;
+        memcpy(dst, &nname, sizeof(nname));
+        memcpy(dst + 2, &nvalue, sizeof(nvalue));
+        memcpy(dst + 4, key, klen);
+        memcpy(dst + 4 + klen, val, vlen);
+        dst += 4 + klen + vlen;
+    } else if (stats_sub_number(stat->value, stat->nvalue, &prev) &&
+               stats_sub_number(val, (uint16_t)vlen, &next)) {
+        uint64_t delta = memcached_htonll(next - prev);
+        *dst++ = PROTOCOL_BINARY_STATS_DELTA;
+        memcpy(dst, &delta, sizeof(delta));
+        dst += sizeof(delta);
+    } else {
+        *dst++ = PROTOCOL_BINARY_STATS_VALUE;
+        memcpy(dst, &nvalue, sizeof(nvalue));
+        memcpy(dst + 2, val, vlen);
+        dst += 2 + vlen;
+    }
+    c->dynamic_buffer.offset = dst - c->dynamic_buffer.buffer;
+
+    memcpy(value, val, vlen);
+    free(stat->value);
+    stat->value = value;
+    stat->nvalue = (uint16_t)vlen;
+    sub->cursor = id + 1;
+}
+
+/* Collect the next push of the subscription in the dynamic buffer */
+static ENGINE_ERROR_CODE stats_sub_collect(conn *c) {
+    struct stats_subscription *sub = c->stats_sub;
+    size_t hdrlen = sizeof(protocol_binary_response_header);
+
+    c->dynamic_buffer.offset = 0;
+    if (!grow_dynamic_buffer(c, hdrlen)) {
+        return ENGINE_ENOMEM;
+    }
+    c->dynamic_buffer.offset = hdrlen;
+    sub->cursor = 0;
+
+    ENGINE_ERROR_CODE ret = collect_stats(c, sub->group, sub->ngroup,
+                                          stats_sub_add_stat);
+    if (ret != ENGINE_SUCCESS) {
+        /* We don't know what made it out; start over with definitions */
+        stats_sub_reset(sub);
+        return ret;
+    }
+
+    protocol_binary_response_header *header;
+    header = (void*)c->dynamic_buffer.buffer;
+    memset(header, 0, hdrlen);
+    header->response.magic = (uint8_t)PROTOCOL_BINARY_RES;
+    header->response.opcode = PROTOCOL_BINARY_CMD_STATS_SUBSCRIBE;
+    header->response.bodylen = htonl((uint32_t)(c->dynamic_buffer.offset -
+                                                hdrlen));
+    header->response.opaque = sub->opaque;
+    return ENGINE_SUCCESS;
+}
+
+static void stats_sub_push(conn *c) {
+    c->stats_sub->due = false;
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    if (add_msghdr(c) == 0 && stats_sub_collect(c) == ENGINE_SUCCESS) {
+        write_and_free(c, c->dynamic_buffer.buffer, c->dynamic_buffer.offset);
+        c->dynamic_buffer.buffer = NULL;
+    } else {
+        conn_set_state(c, conn_new_cmd);
+    }
+}
+
+/*
+ * The push is sent by conn_waiting, so it never gets in the middle of a
+ * response. If the connection is busy it goes out when it's done.
+ */
+static void stats_sub_handler(const int fd, const short which, void *arg) {
+    conn *c = arg;
+    struct stats_subscription *sub = c->stats_sub;
+
+    if (memcached_shutdown) {
+        return;
+    }
+
+    evtimer_add(&sub->timer, &sub->interval);
+    sub->due = true;
+    if (c->state == conn_read && c->rbytes == 0 && !c->io_pending &&
+        !c->ewouldblock) {
+        conn_set_state(c, conn_waiting);
+        conn_run(c, 0);
+    }
+}
+
+static void process_bin_stats_subscribe(conn *c) {
+    char *packet = (c->rcurr - (c->binary_header.request.bodylen +
+                                sizeof(c->binary_header)));
+    protocol_binary_request_stats_subscribe *req = (void*)packet;
+    uint32_t interval = ntohl(req->message.body.interval);
+    const char *group = packet + sizeof(req->bytes);
+    uint16_t ngroup = c->binary_header.request.keylen;
+
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+    c->ewouldblock = false;
+
+    stats_sub_free(c);
+    if (ret == ENGINE_SUCCESS) {
+        if (interval == 0) {
+            write_bin_response(c, NULL, 0, 0, 0);
+            return;
+        }
+        if (IS_UDP(c->transport)) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, 0);
+            return;
+        }
+        if (ngroup > 0 && (strncmp(group, "reset", 5) == 0 ||
+                           strncmp(group, "detail", 6) == 0 ||
+                           strncmp(group, "cachedump", 9) == 0)) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
+            return;
+        }
+
+        struct stats_subscription *sub = calloc(1, sizeof(*sub) + ngroup);
+        if (sub == NULL) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
+            return;
+        }
+        sub->interval.tv_sec = interval / 1000;
+        sub->interval.tv_usec = (interval % 1000) * 1000;
+        sub->opaque = c->opaque;
+        sub->ngroup = ngroup;
+        memcpy(sub->group, group, ngroup);
+        evtimer_set(&sub->timer, stats_sub_handler, c);
+        event_base_set(c->thread->base, &sub->timer);
+        event_priority_set(&sub->timer, CONN_PRIORITY_INTERACTIVE);
+        c->stats_sub = sub;
+
+        ret = stats_sub_collect(c);
+    }
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        evtimer_add(&c->stats_sub->timer, &c->stats_sub->interval);
+        write_and_free(c, c->dynamic_buffer.buffer, c->dynamic_buffer.offset);
+        c->dynamic_buffer.buffer = NULL;
+        break;
+    case ENGINE_EWOULDBLOCK:
+        /* We'll set it up again when the engine is done */
+        stats_sub_free(c);
+        c->ewouldblock = true;
+        break;
+    case ENGINE_DISCONNECT:
+        stats_sub_free(c);
+        conn_set_state(c, conn_closing);
+        break;
+    default:
+        stats_sub_free(c);
+        write_bin_packet(c, engine_error_2_protocol_error(ret), 0);
+    }
+}
+
+static void bin_read_chunk(conn *c, enum bin_substates next_substate, uint32_t chunk) {
+    assert(c);
+    c->substate = next_substate;
+    c->rlbytes = chunk;
+
+    /* Ok... do we have room for everything in our buffer? */
+    ptrdiff_t offset = c->rcurr + sizeof(protocol_binary_request_header) - c->rbuf;
+    if (c->rlbytes > c->rsize - offset) {
+        size_t nsize = c->rsize;
+        size_t size = c->rlbytes + sizeof(protocol_binary_request_header);
+
+        if (size > c->rbytes_peak) {
+            c->rbytes_peak = size;
+        }
+
+        while (size > nsize) {
+            nsize *= 2;
+        }
+
+        if (nsize != c->rsize) {
+            if (settings.verbose > 1) {
+                settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                        "%d: Need to grow buffer from %lu to %lu\n",
+                        c->sfd, (unsigned long)c->rsize, (unsigned long)nsize);
+            }
+            if (!conn_resize_rbuf(c, nsize)) {
+                if (settings.verbose) {
+                    settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                            "%d: Failed to grow buffer.. closing connection\n",
+                            c->sfd);
+                }
+                conn_set_state(c, conn_closing);
+                return;
+            }
+
+            /* rcurr should point to the same offset in the packet */
+            c->rcurr = c->rbuf + offset - sizeof(protocol_binary_request_header);
+        }
+        if (c->rbuf != c->rcurr) {
+            memmove(c->rbuf, c->rcurr, c->rbytes);
+            c->rcurr = c->rbuf;
+            if (settings.verbose > 1) {
+                settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                                "%d: Repack input buffer\n",
+                                                c->sfd);
+            }
+        }
+    }
+
+    /* preserve the header in the buffer.. */
+    c->ritem = c->rcurr + sizeof(protocol_binary_request_header);
+    conn_set_state(c, conn_nread);
+}
+
+static void bin_read_key(conn *c, enum bin_substates next_substate, int extra) {
+    bin_read_chunk(c, next_substate, c->keylen + extra);
 }
 
 
@@ -2262,6 +3815,7 @@ static void process_bin_complete_sasl_auth(conn *c) {
     const char *challenge = vlen == 0 ? NULL : (stmp->data + nkey);
 
     int result=-1;
+    uint64_t start = timings_now();
 
     switch (c->cmd) {
     case PROTOCOL_BINARY_CMD_SASL_AUTH:
@@ -2285,6 +3839,7 @@ static void process_bin_complete_sasl_auth(conn *c) {
         }
         break;
     }
+    STATS_ADD(c, auth_ns, timings_now() - start);
 
     free(c->item);
     c->item = NULL;
@@ -2303,6 +3858,9 @@ static void process_bin_complete_sasl_auth(conn *c) {
         get_auth_data(c, &data);
         perform_callbacks(ON_AUTH, (const void*)&data, c);
         STATS_NOKEY(c, auth_cmds);
+        if (data.username != NULL && is_bulk_user(data.username)) {
+            c->bulk = true;
+        }
         break;
     case SASL_CONTINUE:
         add_bin_header(c, PROTOCOL_BINARY_RESPONSE_AUTH_CONTINUE, 0, 0, outlen);
@@ -2422,7 +3980,230 @@ struct tap_stats {
     struct tap_cmd_stats received;
 } tap_stats = { .mutex = PTHREAD_MUTEX_INITIALIZER };
 
+/*
+ * We keep building messages while the write buffer has room for the
+ * header of a mutation and this much engine specific data
+ */
+#define TAP_WBUF_RESERVE 256
+
+static bool tap_window_full(conn *c) {
+    struct tap_flow *f = &c->tap_flow;
+    return f->enabled && (f->msgs == f->max_msgs ||
+                          (f->max_bytes != 0 && f->bytes >= f->max_bytes));
+}
+
+/* Account for a message we're shipping (of nbytes bytes) */
+static void tap_flow_sent(conn *c, uint32_t nbytes, bool engine_ack) {
+    struct tap_flow *f = &c->tap_flow;
+    f->sent_msgs++;
+    f->sent_bytes += nbytes;
+    if (f->enabled) {
+        struct tap_window_entry *e = &f->window[(f->head + f->msgs) % f->max_msgs];
+        e->nbytes = nbytes;
+        e->engine_ack = engine_ack;
+        f->msgs++;
+        f->bytes += nbytes;
+        if (tap_window_full(c)) {
+            f->full++;
+            f->full_since = timings_now();
+        }
+    }
+}
+
+/*
+ * The consumer acked the oldest message in the window
+ *
+ * @return true if the engine asked for the ack (or we didn't), so it
+ *              should be told about it
+ */
+static bool tap_flow_acked(conn *c, uint16_t status) {
+    struct tap_flow *f = &c->tap_flow;
+    if (!f->enabled || f->msgs == 0) {
+        return true;
+    }
+
+    bool full = tap_window_full(c);
+    struct tap_window_entry *e = &f->window[f->head];
+    f->head = (f->head + 1) % f->max_msgs;
+    f->msgs--;
+    f->bytes -= e->nbytes;
+    f->acks++;
+    if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        f->nacks++;
+    }
+    if (full && !tap_window_full(c)) {
+        f->waited_ns += timings_now() - f->full_since;
+        f->full_since = 0;
+    }
+    return e->engine_ack;
+}
+
+#ifdef HAVE_ZLIB_H
+/* A compressed value, kept until the write it's part of is complete */
+struct tap_zbuf {
+    struct tap_zbuf *next;
+    char data[];
+};
+
+/*
+ * Deflate the value of info for a TAP mutation
+ *
+ * @return the compressed value (and its size in nbytes), or NULL if we
+ *         should send it as it is
+ */
+static char *tap_deflate_value(conn *c, item_info *info, uint32_t *nbytes) {
+    struct tap_compress *z = &c->tap_compress;
+    uint64_t start = timings_now();
+
+    if (z->deflate == NULL) {
+        z->deflate = calloc(1, sizeof(z_stream));
+        if (z->deflate == NULL ||
+            deflateInit(z->deflate, Z_BEST_SPEED) != Z_OK) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                            "%d: Failed to initialize zlib. Not compressing the tap stream\n",
+                                            c->sfd);
+            free(z->deflate);
+            z->deflate = NULL;
+            z->enabled = false;
+            return NULL;
+        }
+    } else {
+        deflateReset(z->deflate);
+    }
+
+    z_stream *s = z->deflate;
+    uLong bound = deflateBound(s, info->nbytes);
+    struct tap_zbuf *buf = malloc(sizeof(*buf) + sizeof(uint32_t) + bound);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    s->next_out = (Bytef*)buf->data + sizeof(uint32_t);
+    s->avail_out = bound;
+    int rv = Z_OK;
+    for (int ii = 0; ii < info->nvalue && rv == Z_OK; ++ii) {
+        bool last = ii == info->nvalue - 1;
+        s->next_in = info->value[ii].iov_base;
+        s->avail_in = info->value[ii].iov_len;
+        rv = deflate(s, last ? Z_FINISH : Z_NO_FLUSH);
+        if (rv == Z_BUF_ERROR && !last) {
+            /* an empty chunk */
+            rv = Z_OK;
+        }
+    }
+
+    z->ns += timings_now() - start;
+    if (rv != Z_STREAM_END ||
+        s->total_out + sizeof(uint32_t) >= info->nbytes) {
+        /* It didn't get any smaller */
+        free(buf);
+        return NULL;
+    }
+
+    uint32_t size = htonl(info->nbytes);
+    memcpy(buf->data, &size, sizeof(size));
+    *nbytes = s->total_out + sizeof(uint32_t);
+    buf->next = z->bufs;
+    z->bufs = buf;
+    z->msgs++;
+    z->bytes_in += info->nbytes;
+    z->bytes_out += *nbytes;
+    return buf->data;
+}
+
+/*
+ * Inflate a value sent to us with TAP_FLAG_COMPRESSED. The result is
+ * valid until the next call.
+ */
+static ENGINE_ERROR_CODE tap_inflate_value(conn *c, char **data,
+                                           uint32_t *ndata) {
+    struct tap_compress *z = &c->tap_compress;
+    uint64_t start = timings_now();
+    uint32_t size;
+
+    if (*ndata < sizeof(size)) {
+        return ENGINE_EINVAL;
+    }
+    memcpy(&size, *data, sizeof(size));
+    size = ntohl(size);
+    if (size > settings.item_size_max) {
+        return ENGINE_E2BIG;
+    }
+
+    if (z->inflate == NULL) {
+        z->inflate = calloc(1, sizeof(z_stream));
+        if (z->inflate == NULL || inflateInit(z->inflate) != Z_OK) {
+            free(z->inflate);
+            z->inflate = NULL;
+            return ENGINE_ENOMEM;
+        }
+    } else {
+        inflateReset(z->inflate);
+    }
+    if (z->nvalue < size) {
+        char *value = realloc(z->value, size);
+        if (value == NULL) {
+            return ENGINE_ENOMEM;
+        }
+        z->value = value;
+        z->nvalue = size;
+    }
+
+    z_stream *s = z->inflate;
+    s->next_in = (Bytef*)*data + sizeof(size);
+    s->avail_in = *ndata - sizeof(size);
+    s->next_out = (Bytef*)z->value;
+    s->avail_out = size;
+    if (inflate(s, Z_FINISH) != Z_STREAM_END || s->total_out != size) {
+        return ENGINE_EINVAL;
+    }
+
+    z->inflated_msgs++;
+    z->inflated_bytes_in += *ndata;
+    z->inflated_bytes_out += size;
+    z->inflate_ns += timings_now() - start;
+    *data = z->value;
+    *ndata = size;
+    return ENGINE_SUCCESS;
+}
+#endif
+
+/* Free the compressed values of the last write */
+static void tap_compress_release(conn *c) {
+#ifdef HAVE_ZLIB_H
+    while (c->tap_compress.bufs != NULL) {
+        struct tap_zbuf *next = c->tap_compress.bufs->next;
+        free(c->tap_compress.bufs);
+        c->tap_compress.bufs = next;
+    }
+#endif
+}
+
+static void tap_compress_destroy(conn *c) {
+    struct tap_compress *z = &c->tap_compress;
+    tap_compress_release(c);
+#ifdef HAVE_ZLIB_H
+    if (z->deflate != NULL) {
+        deflateEnd(z->deflate);
+        free(z->deflate);
+    }
+    if (z->inflate != NULL) {
+        inflateEnd(z->inflate);
+        free(z->inflate);
+    }
+#endif
+    free(z->value);
+    memset(z, 0, sizeof(*z));
+}
+
 static void ship_tap_log(conn *c) {
+    if (tap_window_full(c)) {
+        /* Wait for the consumer to ack something (we're woken up by the
+         * read event) */
+        c->ewouldblock = true;
+        return;
+    }
+
     c->msgcurr = 0;
     c->msgused = 0;
     c->iovused = 0;
@@ -2436,6 +4217,8 @@ static void ship_tap_log(conn *c) {
     }
     /* @todo add check for buffer overflow of c->wbuf) */
     c->wcurr = c->wbuf;
+    /* The last write is complete */
+    tap_compress_release(c);
 
     bool more_data = true;
     bool send_data = false;
@@ -2443,11 +4226,12 @@ static void ship_tap_log(conn *c) {
 
     item *it;
     uint32_t bodylen;
-    int ii = 0;
     c->icurr = c->ilist;
     do {
-        /* @todo fixme! */
-        if (ii++ == 10) {
+        /* Pack as many messages as we can in one write */
+        if (c->ileft == c->isize || tap_window_full(c) ||
+            c->wsize - (c->wcurr - c->wbuf) <
+            sizeof(protocol_binary_request_tap_mutation) + TAP_WBUF_RESERVE) {
             break;
         }
 
@@ -2458,9 +4242,31 @@ static void ship_tap_log(conn *c) {
         uint32_t seqno;
         uint16_t vbucket;
 
+        uint64_t cycles = engine_cycles_start(c);
         tap_event_t event = c->tap_iterator(settings.engine.v0, c, &it,
                                             &engine, &nengine, &ttl,
                                             &tap_flags, &seqno, &vbucket);
+        engine_cycles_end(c, ENGINE_CALL_TAP_ITERATOR, cycles);
+        bool message = (event != TAP_NOOP && event != TAP_PAUSE &&
+                        event != TAP_DISCONNECT);
+        if (message && nengine > c->wsize - (c->wcurr - c->wbuf) -
+            sizeof(protocol_binary_request_tap_mutation)) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                            "%d: Engine specific data too big (%u bytes). Shutting down tap connection\n",
+                                            c->sfd, (unsigned int)nengine);
+            if (event == TAP_MUTATION || event == TAP_DELETION ||
+                event == TAP_CHECKPOINT_START || event == TAP_CHECKPOINT_END) {
+                settings.engine.v1->release(settings.engine.v0, c, it);
+            }
+            disconnect = true;
+            break;
+        }
+
+        bool engine_ack = (tap_flags & TAP_FLAG_ACK) != 0;
+        if (message && c->tap_flow.enabled) {
+            tap_flags |= TAP_FLAG_ACK;
+        }
+        uint32_t nsent = 0;
         union {
             protocol_binary_request_tap_mutation mutation;
             protocol_binary_request_tap_delete delete;
@@ -2496,8 +4302,7 @@ static void ship_tap_log(conn *c) {
         case TAP_CHECKPOINT_START:
         case TAP_CHECKPOINT_END:
         case TAP_MUTATION:
-            if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
-                                                   (void*)&info)) {
+            if (!get_item_info(c, it, (void*)&info)) {
                 settings.engine.v1->release(settings.engine.v0, c, it);
                 settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                                 "%d: Failed to get item info\n", c->sfd);
@@ -2525,15 +4330,29 @@ static void ship_tap_log(conn *c) {
                 pthread_mutex_unlock(&tap_stats.mutex);
             }
 
+            char *value = NULL;
+            uint32_t nvalue = info.info.nbytes;
+#ifdef HAVE_ZLIB_H
+            if (event == TAP_MUTATION && c->tap_compress.enabled &&
+                (tap_flags & TAP_FLAG_NO_VALUE) == 0 &&
+                info.info.nbytes >= settings.tap_compress_min) {
+                value = tap_deflate_value(c, &info.info, &nvalue);
+                if (value != NULL) {
+                    tap_flags |= TAP_FLAG_COMPRESSED;
+                }
+            }
+#endif
+
             msg.mutation.message.header.request.cas = memcached_htonll(info.info.cas);
             msg.mutation.message.header.request.keylen = htons(info.info.nkey);
             msg.mutation.message.header.request.extlen = 16;
 
             bodylen = 16 + info.info.nkey + nengine;
             if ((tap_flags & TAP_FLAG_NO_VALUE) == 0) {
-                bodylen += info.info.nbytes;
+                bodylen += nvalue;
             }
             msg.mutation.message.header.request.bodylen = htonl(bodylen);
+            nsent = sizeof(protocol_binary_request_header) + bodylen;
 
             if ((tap_flags & TAP_FLAG_NETWORK_BYTE_ORDER) == 0) {
                 msg.mutation.message.body.item.flags = htonl(info.info.flags);
@@ -2558,7 +4377,9 @@ static void ship_tap_log(conn *c) {
             }
 
             add_iov(c, info.info.key, info.info.nkey);
-            if ((tap_flags & TAP_FLAG_NO_VALUE) == 0) {
+            if (value != NULL) {
+                add_iov(c, value, nvalue);
+            } else if ((tap_flags & TAP_FLAG_NO_VALUE) == 0) {
                 for (int xx = 0; xx < info.info.nvalue; ++xx) {
                     add_iov(c, info.info.value[xx].iov_base,
                             info.info.value[xx].iov_len);
@@ -2568,8 +4389,7 @@ static void ship_tap_log(conn *c) {
             break;
         case TAP_DELETION:
             /* This is a delete */
-            if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
-                                                   (void*)&info)) {
+            if (!get_item_info(c, it, (void*)&info)) {
                 settings.engine.v1->release(settings.engine.v0, c, it);
                 settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                                 "%d: Failed to get item info\n", c->sfd);
@@ -2586,6 +4406,7 @@ static void ship_tap_log(conn *c) {
                 bodylen += info.info.nbytes;
             }
             msg.delete.message.header.request.bodylen = htonl(bodylen);
+            nsent = sizeof(protocol_binary_request_header) + bodylen;
 
             memcpy(c->wcurr, msg.delete.bytes, sizeof(msg.delete.bytes));
             add_iov(c, c->wcurr, sizeof(msg.delete.bytes));
@@ -2641,6 +4462,7 @@ static void ship_tap_log(conn *c) {
             }
 
             msg.flush.message.header.request.bodylen = htonl(8 + nengine);
+            nsent = sizeof(protocol_binary_request_header) + 8 + nengine;
             memcpy(c->wcurr, msg.flush.bytes, sizeof(msg.flush.bytes));
             add_iov(c, c->wcurr, sizeof(msg.flush.bytes));
             c->wcurr += sizeof(msg.flush.bytes);
@@ -2655,10 +4477,15 @@ static void ship_tap_log(conn *c) {
         default:
             abort();
         }
+
+        if (nsent != 0) {
+            tap_flow_sent(c, nsent, engine_ack);
+        }
     } while (more_data);
 
     c->ewouldblock = false;
     if (send_data) {
+        c->tap_flow.writes++;
         conn_set_state(c, conn_mwrite);
         if (disconnect) {
             c->write_and_go = conn_closing;
@@ -2687,20 +4514,32 @@ static ENGINE_ERROR_CODE default_unknown_command(EXTENSION_BINARY_PROTOCOL_DESCR
                                                  protocol_binary_request_header *request,
                                                  ADD_RESPONSE response)
 {
-    return settings.engine.v1->unknown_command(handle, cookie, request, response);
+    uint64_t cycles = engine_cycles_start(cookie);
+    ENGINE_ERROR_CODE ret = settings.engine.v1->unknown_command(handle, cookie,
+                                                                request,
+                                                                response);
+    engine_cycles_end((conn *)cookie, ENGINE_CALL_UNKNOWN_COMMAND, cycles);
+    return ret;
 }
 
 struct request_lookup {
     EXTENSION_BINARY_PROTOCOL_DESCRIPTOR *descriptor;
     BINARY_COMMAND_CALLBACK callback;
+    /** The engine's handler for the opcode, unless an extension took it */
+    ENGINE_COMMAND_HANDLER engine;
 };
 
+/*
+ * Written at startup (extensions, then the engine) and only read after
+ * that, so the workers look the opcodes up without locks
+ */
 static struct request_lookup request_handlers[0x100];
 
 static void initialize_binary_lookup_map(void) {
     for (int ii = 0; ii < 0x100; ++ii) {
         request_handlers[ii].descriptor = NULL;
         request_handlers[ii].callback = default_unknown_command;
+        request_handlers[ii].engine = NULL;
     }
 }
 
@@ -2709,23 +4548,71 @@ static void setup_binary_lookup_cmd(EXTENSION_BINARY_PROTOCOL_DESCRIPTOR *descri
                                     BINARY_COMMAND_CALLBACK new_handler) {
     request_handlers[cmd].descriptor = descriptor;
     request_handlers[cmd].callback = new_handler;
+    request_handlers[cmd].engine = NULL;
 }
 
-static void process_bin_unknown_packet(conn *c) {
-    void *packet = c->rcurr - (c->binary_header.request.bodylen +
-                               sizeof(c->binary_header));
-    ENGINE_ERROR_CODE ret = c->aiostat;
-    c->aiostat = ENGINE_SUCCESS;
-    c->ewouldblock = false;
+static void setup_engine_command_handlers(void) {
+    if (settings.engine.v1->get_command_handlers == NULL) {
+        return;
+    }
 
-    if (ret == ENGINE_SUCCESS) {
-        struct request_lookup *rq = request_handlers + c->binary_header.request.opcode;
-        ret = rq->callback(rq->descriptor, settings.engine.v0, c, packet,
-                           binary_response_handler);
+    ENGINE_COMMAND_HANDLER handlers[0x100] = { NULL };
+    settings.engine.v1->get_command_handlers(settings.engine.v0, handlers);
+    for (int ii = 0; ii < 0x100; ++ii) {
+        if (request_handlers[ii].descriptor == NULL) {
+            request_handlers[ii].engine = handlers[ii];
+        }
     }
+}
 
-    switch (ret) {
-    case ENGINE_SUCCESS:
+/*
+ * Hand a command we don't know to whoever registered the opcode: an
+ * extension, the engine's handler (with the key taken out and hashed),
+ * or the engine's unknown_command.
+ */
+static ENGINE_ERROR_CODE dispatch_unknown_command(conn *c,
+                                                  protocol_binary_request_header *request,
+                                                  ADD_RESPONSE response) {
+    struct request_lookup *rq = request_handlers + request->request.opcode;
+    if (rq->engine == NULL) {
+        return rq->callback(rq->descriptor, settings.engine.v0, c, request,
+                            response);
+    }
+
+    engine_command cmd = {
+        .request = request,
+        .extlen = request->request.extlen,
+        .nkey = ntohs(request->request.keylen)
+    };
+    cmd.ext = request->bytes + sizeof(request->bytes);
+    cmd.key = (char *)cmd.ext + cmd.extlen;
+    cmd.value = (char *)cmd.key + cmd.nkey;
+    cmd.nvalue = ntohl(request->request.bodylen) - cmd.extlen - cmd.nkey;
+    if (cmd.nkey == 0) {
+        cmd.key = NULL;
+    } else {
+        cmd.hash = hash(cmd.key, cmd.nkey, 0);
+    }
+
+    uint64_t cycles = engine_cycles_start(c);
+    ENGINE_ERROR_CODE ret = rq->engine(settings.engine.v0, c, &cmd, response);
+    engine_cycles_end(c, ENGINE_CALL_UNKNOWN_COMMAND, cycles);
+    return ret;
+}
+
+static void process_bin_unknown_packet(conn *c) {
+    void *packet = c->rcurr - (c->binary_header.request.bodylen +
+                               sizeof(c->binary_header));
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+    c->ewouldblock = false;
+
+    if (ret == ENGINE_SUCCESS) {
+        ret = dispatch_unknown_command(c, packet, binary_response_handler);
+    }
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
         if (c->dynamic_buffer.buffer != NULL) {
             write_and_free(c, c->dynamic_buffer.buffer, c->dynamic_buffer.offset);
             c->dynamic_buffer.buffer = NULL;
@@ -2784,9 +4671,26 @@ static void process_bin_tap_connect(conn *c) {
         c->binary_header.request.extlen -
         c->binary_header.request.keylen;
 
+    uint32_t window[2] = { 0, 0 };
     if (c->binary_header.request.extlen == 4) {
         flags = ntohl(req->message.body.flags);
 
+        if (flags & TAP_CONNECT_FLOW_CONTROL) {
+            /* The window is at the end, and it's none of the engine's
+             * business */
+            if (ndata < sizeof(window)) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                                "%d: ERROR: Invalid tap connect message\n",
+                                                c->sfd);
+                conn_set_state(c, conn_closing);
+                return ;
+            }
+            ndata -= sizeof(window);
+            memcpy(window, data + ndata, sizeof(window));
+            window[0] = ntohl(window[0]);
+            window[1] = ntohl(window[1]);
+        }
+
         if (flags & TAP_CONNECT_FLAG_BACKFILL) {
             /* the userdata has to be at least 8 bytes! */
             if (ndata < 8) {
@@ -2817,7 +4721,8 @@ static void process_bin_tap_connect(conn *c) {
 
     TAP_ITERATOR iterator = settings.engine.v1->get_tap_iterator(
         settings.engine.v0, c, key, c->binary_header.request.keylen,
-        flags, data, ndata);
+        flags & ~(TAP_CONNECT_FLOW_CONTROL | TAP_CONNECT_COMPRESSION),
+        data, ndata);
 
     if (iterator == NULL) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
@@ -2826,8 +4731,33 @@ static void process_bin_tap_connect(conn *c) {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, 0);
         c->write_and_go = conn_closing;
     } else {
+        struct tap_flow *f = &c->tap_flow;
+        if (flags & TAP_CONNECT_FLOW_CONTROL) {
+            f->max_msgs = window[0];
+            if (f->max_msgs == 0 || f->max_msgs > TAP_FLOW_MAX_MSGS) {
+                f->max_msgs = TAP_FLOW_MAX_MSGS;
+            }
+            f->max_bytes = window[1];
+            f->window = calloc(f->max_msgs, sizeof(*f->window));
+            if (f->window == NULL) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                                "%d: Failed to allocate the tap window\n",
+                                                c->sfd);
+                conn_set_state(c, conn_closing);
+                return ;
+            }
+            f->enabled = true;
+        }
+        f->connected = timings_now();
+#ifdef HAVE_ZLIB_H
+        /* Without zlib we just send the values as they are */
+        c->tap_compress.enabled = (flags & TAP_CONNECT_COMPRESSION) &&
+            settings.tap_compress_min != 0;
+#endif
+
         c->tap_iterator = iterator;
         c->which = EV_WRITE;
+        c->bulk = true;
         conn_set_state(c, conn_ship_log);
     }
 }
@@ -2870,9 +4800,19 @@ static void process_bin_tap_packet(tap_event_t event, conn *c) {
             key += 8;
             data += 8;
             ndata -= 8;
+
+            if ((tap_flags & TAP_FLAG_COMPRESSED) && ret == ENGINE_SUCCESS) {
+#ifdef HAVE_ZLIB_H
+                ret = tap_inflate_value(c, &data, &ndata);
+#else
+                ret = ENGINE_ENOTSUP;
+#endif
+                tap_flags &= ~TAP_FLAG_COMPRESSED;
+            }
         }
 
         if (ret == ENGINE_SUCCESS) {
+            uint64_t cycles = engine_cycles_start(c);
             ret = settings.engine.v1->tap_notify(settings.engine.v0, c,
                                                  engine_specific, nengine,
                                                  ttl - 1, tap_flags,
@@ -2882,6 +4822,7 @@ static void process_bin_tap_packet(tap_event_t event, conn *c) {
                                                  memcached_ntohll(tap->message.header.request.cas),
                                                  data, ndata,
                                                  c->binary_header.request.vbucket);
+            engine_cycles_end(c, ENGINE_CALL_TAP_NOTIFY, cycles);
         }
     }
 
@@ -2911,11 +4852,16 @@ static void process_bin_tap_ack(conn *c) {
     char *key = packet + sizeof(rsp->bytes);
 
     ENGINE_ERROR_CODE ret = ENGINE_DISCONNECT;
-    if (settings.engine.v1->tap_notify != NULL) {
+    if (!tap_flow_acked(c, status)) {
+        /* We asked for it to keep the window going */
+        ret = ENGINE_SUCCESS;
+    } else if (settings.engine.v1->tap_notify != NULL) {
+        uint64_t cycles = engine_cycles_start(c);
         ret = settings.engine.v1->tap_notify(settings.engine.v0, c, NULL, 0, 0, status,
                                              TAP_ACK, seqno, key,
                                              c->binary_header.request.keylen, 0, 0,
                                              0, NULL, 0, 0);
+        engine_cycles_end(c, ENGINE_CALL_TAP_NOTIFY, cycles);
     }
 
     if (ret == ENGINE_DISCONNECT) {
@@ -2946,6 +4892,18 @@ static void process_bin_verbosity(conn *c) {
     write_bin_response(c, NULL, 0, 0, 0);
 }
 
+static void process_bin_threads(conn *c) {
+    char *packet = (c->rcurr - (c->binary_header.request.bodylen +
+                                sizeof(c->binary_header)));
+    protocol_binary_request_threads *req = (void*)packet;
+    uint32_t nthr = ntohl(req->message.body.threads);
+    if (nthr > (uint32_t)settings.num_threads || !threads_set_active((int)nthr)) {
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
+        return;
+    }
+    write_bin_response(c, NULL, 0, 0, 0);
+}
+
 static void process_bin_packet(conn *c) {
     /* @todo this should be an array of funciton pointers and call through */
     switch (c->binary_header.request.opcode) {
@@ -3003,6 +4961,12 @@ static void process_bin_packet(conn *c) {
     case PROTOCOL_BINARY_CMD_ISASL_REFRESH:
         process_bin_isasl_refresh(c);
         break;
+    case PROTOCOL_BINARY_CMD_STATS_SUBSCRIBE:
+        process_bin_stats_subscribe(c);
+        break;
+    case PROTOCOL_BINARY_CMD_THREADS:
+        process_bin_threads(c);
+        break;
     default:
         process_bin_unknown_packet(c);
     }
@@ -3024,6 +4988,28 @@ static RESPONSE_HANDLER response_handlers[256] = {
     [PROTOCOL_BINARY_CMD_TAP_CHECKPOINT_END] = process_bin_tap_ack
 };
 
+/* Start the clock (and maybe the trace) for a request */
+static void conn_timing_begin(conn *c, uint8_t opcode, uint32_t value_size) {
+    c->timing_start = timings_now();
+    c->timing_blocked = 0;
+    c->timing_opcode = opcode;
+    c->traffic.ops++;
+    c->timing_traced = settings.slowlog_usec != 0 || settings.slowlog_sample != 0;
+    if (c->timing_traced) {
+        c->timing_nblocked = 0;
+        c->timing_nkey = 0;
+        c->timing_engine = 0;
+        c->timing_read = 0;
+        c->timing_value = value_size;
+        c->timing_sampled = false;
+        if (settings.slowlog_sample != 0 &&
+            ++c->thread->slowlog_skipped >= settings.slowlog_sample) {
+            c->thread->slowlog_skipped = 0;
+            c->timing_sampled = true;
+        }
+    }
+}
+
 static void dispatch_bin_command(conn *c) {
     int protocol_error = 0;
 
@@ -3040,6 +5026,22 @@ static void dispatch_bin_command(conn *c) {
     MEMCACHED_PROCESS_COMMAND_START(c->sfd, c->rcurr, c->rbytes);
     c->noreply = true;
 
+    conn_timing_begin(c, c->binary_header.request.opcode,
+                      bodylen - keylen - extlen);
+
+    if (c->mget_next < c->mget_count &&
+        c->cmd != PROTOCOL_BINARY_CMD_GETQ &&
+        c->cmd != PROTOCOL_BINARY_CMD_GETKQ) {
+        conn_release_mget(c);
+    }
+    if (c->mstore_next < c->mstore_count &&
+        c->cmd != PROTOCOL_BINARY_CMD_SETQ &&
+        c->cmd != PROTOCOL_BINARY_CMD_ADDQ &&
+        c->cmd != PROTOCOL_BINARY_CMD_REPLACEQ) {
+        /* They're stored already, there is nothing to release */
+        c->mstore_next = c->mstore_count = 0;
+    }
+
     /* binprot supports 16bit keys, but internals are still 8bit */
     if (keylen > KEY_MAX_LENGTH) {
         handle_binary_protocol_error(c);
@@ -3221,8 +5223,28 @@ static void dispatch_bin_command(conn *c) {
                 bin_read_chunk(c, bin_reading_packet, 0);
             }
             break;
+        case PROTOCOL_BINARY_CMD_STATS_SUBSCRIBE:
+            if (extlen == 4 && bodylen == extlen + keylen) {
+                bin_read_chunk(c, bin_reading_packet, bodylen);
+            } else {
+                protocol_error = 1;
+            }
+            break;
+        case PROTOCOL_BINARY_CMD_THREADS:
+            if (extlen == 4 && keylen == 0 && bodylen == 4) {
+                bin_read_chunk(c, bin_reading_packet, bodylen);
+            } else {
+                protocol_error = 1;
+            }
+            break;
         default:
-            if (settings.engine.v1->unknown_command == NULL) {
+            if (request_handlers[c->binary_header.request.opcode].engine != NULL) {
+                if (bodylen >= (uint32_t)keylen + extlen) {
+                    bin_read_chunk(c, bin_reading_packet, bodylen);
+                } else {
+                    protocol_error = 1;
+                }
+            } else if (settings.engine.v1->unknown_command == NULL) {
                 write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND,
                                 bodylen);
             } else {
@@ -3234,6 +5256,191 @@ static void dispatch_bin_command(conn *c) {
         handle_binary_protocol_error(c);
 }
 
+/*
+ * Read the value of an item straight into the (pieces of the) item. The
+ * first piece goes in ritem, and the rest are kept in riov.
+ */
+static bool conn_set_ritem(conn *c, const item_info *info) {
+    int npieces = info->nvalue - 1;
+    if (npieces > c->riovsize) {
+        struct iovec *riov = realloc(c->riov, npieces * sizeof(*riov));
+        if (riov == NULL) {
+            return false;
+        }
+        c->riov = riov;
+        c->riovsize = npieces;
+    }
+    if (npieces > 0) {
+        memcpy(c->riov, info->value + 1, npieces * sizeof(*c->riov));
+    }
+    c->riovused = npieces > 0 ? npieces : 0;
+    c->riovcurr = 0;
+    c->ritem = info->value[0].iov_base;
+    c->rlbytes = info->value[0].iov_len;
+    return true;
+}
+
+/*
+ * Batch loaders send long runs of SETQ / ADDQ / REPLACEQ, and like the
+ * quiet gets (see conn_fetch_mget) most of them are in the input buffer
+ * already when we process the first one. If the engine implements
+ * allocate_multi and store_multi we allocate and store all of them (with
+ * the current one) in two calls, and stash the results in c->mstore for
+ * process_bin_update to send the responses as it works its way through
+ * the packets. Only the packets we got in full are batched, and the batch
+ * ends before the first item we can't allocate so that the packets after
+ * it are handled (in order) the usual way.
+ */
+#define MSTORE_MAX_ITEMS 64
+
+static ENGINE_STORE_OPERATION bin_store_op(uint8_t cmd, uint64_t cas) {
+    switch (cmd) {
+    case PROTOCOL_BINARY_CMD_ADD:
+        return OPERATION_ADD;
+    case PROTOCOL_BINARY_CMD_SET:
+        return cas != 0 ? OPERATION_CAS : OPERATION_SET;
+    case PROTOCOL_BINARY_CMD_REPLACE:
+        return cas != 0 ? OPERATION_CAS : OPERATION_REPLACE;
+    default:
+        assert(0);
+    }
+    return OPERATION_SET;
+}
+
+static uint8_t bin_quiet_store_cmd(uint8_t opcode) {
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_SETQ:
+        return PROTOCOL_BINARY_CMD_SET;
+    case PROTOCOL_BINARY_CMD_ADDQ:
+        return PROTOCOL_BINARY_CMD_ADD;
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+        return PROTOCOL_BINARY_CMD_REPLACE;
+    default:
+        return 0;
+    }
+}
+
+static bool conn_store_multi(conn *c, const char *key, uint16_t nkey,
+                             uint32_t vlen, uint32_t flags,
+                             rel_time_t exptime) {
+    allocate_multi_item alloc[MSTORE_MAX_ITEMS];
+    store_multi_item store[MSTORE_MAX_ITEMS];
+    const char *values[MSTORE_MAX_ITEMS];
+    uint64_t cas[MSTORE_MAX_ITEMS];
+    uint8_t cmd[MSTORE_MAX_ITEMS];
+    uint16_t vbucket[MSTORE_MAX_ITEMS];
+
+    alloc[0].key = key;
+    alloc[0].nkey = nkey;
+    alloc[0].nbytes = vlen;
+    alloc[0].flags = flags;
+    alloc[0].exptime = exptime;
+    values[0] = c->rcurr;
+    cas[0] = c->binary_header.request.cas;
+    cmd[0] = c->cmd;
+    vbucket[0] = c->binary_header.request.vbucket;
+
+    const char *ptr = c->rcurr + vlen;
+    size_t avail = c->rbytes - vlen;
+    int nitems = 1;
+    while (nitems < MSTORE_MAX_ITEMS &&
+           avail >= sizeof(protocol_binary_request_set)) {
+        protocol_binary_request_set req;
+        memcpy(&req, ptr, sizeof(req));
+        uint16_t keylen = ntohs(req.message.header.request.keylen);
+        uint32_t bodylen = ntohl(req.message.header.request.bodylen);
+
+        /* The same checks dispatch_bin_command does */
+        if (req.message.header.request.magic != PROTOCOL_BINARY_REQ ||
+            (cmd[nitems] = bin_quiet_store_cmd(req.message.header.request.opcode)) == 0 ||
+            req.message.header.request.extlen != 8 || keylen == 0 ||
+            keylen > KEY_MAX_LENGTH || bodylen < keylen + 8 ||
+            avail - sizeof(req.message.header) < bodylen) {
+            break;
+        }
+
+        alloc[nitems].key = ptr + sizeof(req);
+        alloc[nitems].nkey = keylen;
+        alloc[nitems].nbytes = bodylen - keylen - 8;
+        alloc[nitems].flags = req.message.body.flags;
+        alloc[nitems].exptime = ntohl(req.message.body.expiration);
+        values[nitems] = ptr + sizeof(req) + keylen;
+        cas[nitems] = memcached_ntohll(req.message.header.request.cas);
+        vbucket[nitems] = ntohs(req.message.header.request.vbucket);
+        ++nitems;
+
+        ptr += sizeof(req.message.header) + bodylen;
+        avail -= sizeof(req.message.header) + bodylen;
+    }
+
+    if (nitems == 1) {
+        return false;
+    }
+    uint64_t cycles = engine_cycles_start(c);
+    ENGINE_ERROR_CODE ret = settings.engine.v1->allocate_multi(settings.engine.v0,
+                                                               c, alloc, nitems);
+    engine_cycles_end(c, ENGINE_CALL_ALLOCATE, cycles);
+    if (ret != ENGINE_SUCCESS) {
+        return false;
+    }
+
+    int count = 0;
+    while (count < nitems && alloc[count].status == ENGINE_SUCCESS) {
+        item_info_holder info = { .info = { .nvalue = IOV_MAX } };
+        item *it = alloc[count].item;
+        if (!get_item_info(c, it, (void*)&info)) {
+            break;
+        }
+        const char *value = values[count];
+        for (int ii = 0; ii < info.info.nvalue; ++ii) {
+            memcpy(info.info.value[ii].iov_base, value,
+                   info.info.value[ii].iov_len);
+            value += info.info.value[ii].iov_len;
+        }
+        item_set_cas(c, it, cas[count]);
+        store[count].item = it;
+        store[count].operation = bin_store_op(cmd[count], cas[count]);
+        store[count].vbucket = vbucket[count];
+        ++count;
+    }
+    for (int ii = count; ii < nitems; ++ii) {
+        if (alloc[ii].status == ENGINE_SUCCESS) {
+            settings.engine.v1->release(settings.engine.v0, c, alloc[ii].item);
+        }
+    }
+
+    bool stored = false;
+    if (count > 1 && (c->mstore != NULL ||
+        (c->mstore = malloc(MSTORE_MAX_ITEMS * sizeof(*c->mstore))) != NULL)) {
+        uint64_t cycles = engine_cycles_start(c);
+        stored = settings.engine.v1->store_multi(settings.engine.v0, c, store,
+                                                 count) == ENGINE_SUCCESS;
+        engine_cycles_end(c, ENGINE_CALL_STORE, cycles);
+    }
+    for (int ii = 0; ii < count; ++ii) {
+        if (stored) {
+            struct mstore_result *res = &c->mstore[ii];
+            res->status = store[ii].status;
+            if (res->status == ENGINE_EWOULDBLOCK) {
+                /* Not allowed here; the client may try again */
+                res->status = ENGINE_TMPFAIL;
+            }
+            res->operation = store[ii].operation;
+            res->cas = store[ii].cas;
+            res->nkey = alloc[ii].nkey;
+            res->cmd = cmd[ii];
+        }
+        settings.engine.v1->release(settings.engine.v0, c, store[ii].item);
+    }
+    if (!stored) {
+        return false;
+    }
+
+    c->mstore_next = 0;
+    c->mstore_count = count;
+    return true;
+}
+
 static void process_bin_update(conn *c) {
     char *key;
     uint16_t nkey;
@@ -3280,20 +5487,45 @@ static void process_bin_update(conn *c) {
         stats_prefix_record_set(key, nkey);
     }
 
+    if (c->mstore_next == c->mstore_count && c->noreply &&
+        c->aiostat == ENGINE_SUCCESS && c->rbytes >= vlen &&
+        settings.engine.v1->allocate_multi != NULL &&
+        settings.engine.v1->store_multi != NULL) {
+        conn_store_multi(c, key, nkey, vlen, req->message.body.flags,
+                         expiration);
+    }
+
+    if (c->mstore_next < c->mstore_count) {
+        struct mstore_result *res = &c->mstore[c->mstore_next];
+        if (res->nkey != nkey || res->cmd != c->cmd || c->rbytes < vlen) {
+            /* We're out of sync with the batch (shouldn't happen) */
+            c->mstore_next = c->mstore_count = 0;
+        } else {
+            /* The value went into the item already */
+            ++c->mstore_next;
+            c->rcurr += vlen;
+            c->rbytes -= vlen;
+            c->cas = res->cas;
+            c->store_op = res->operation;
+            write_bin_store_response(c, res->status, key, nkey);
+            return;
+        }
+    }
+
     ENGINE_ERROR_CODE ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
     c->ewouldblock = false;
-    item_info_holder info = { .info = { .nvalue = 1 } };
+    item_info_holder info = { .info = { .nvalue = IOV_MAX } };
 
     if (ret == ENGINE_SUCCESS) {
+        uint64_t cycles = engine_cycles_start(c);
         ret = settings.engine.v1->allocate(settings.engine.v0, c,
                                            &it, key, nkey,
                                            vlen,
                                            req->message.body.flags,
                                            expiration);
-        if (ret == ENGINE_SUCCESS && !settings.engine.v1->get_item_info(settings.engine.v0,
-                                                                        c, it,
-                                                                        (void*)&info)) {
+        engine_cycles_end(c, ENGINE_CALL_ALLOCATE, cycles);
+        if (ret == ENGINE_SUCCESS && !get_item_info(c, it, (void*)&info)) {
             settings.engine.v1->release(settings.engine.v0, c, it);
             write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
             return;
@@ -3303,32 +5535,14 @@ static void process_bin_update(conn *c) {
     switch (ret) {
     case ENGINE_SUCCESS:
         item_set_cas(c, it, c->binary_header.request.cas);
+        c->store_op = bin_store_op(c->cmd, c->binary_header.request.cas);
 
-        switch (c->cmd) {
-        case PROTOCOL_BINARY_CMD_ADD:
-            c->store_op = OPERATION_ADD;
-            break;
-        case PROTOCOL_BINARY_CMD_SET:
-            if (c->binary_header.request.cas != 0) {
-                c->store_op = OPERATION_CAS;
-            } else {
-                c->store_op = OPERATION_SET;
-            }
-            break;
-        case PROTOCOL_BINARY_CMD_REPLACE:
-            if (c->binary_header.request.cas != 0) {
-                c->store_op = OPERATION_CAS;
-            } else {
-                c->store_op = OPERATION_REPLACE;
-            }
-            break;
-        default:
-            assert(0);
+        if (!conn_set_ritem(c, &info.info)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, vlen);
+            return;
         }
-
         c->item = it;
-        c->ritem = info.info.value[0].iov_base;
-        c->rlbytes = vlen;
         conn_set_state(c, conn_nread);
         c->substate = bin_read_set_value;
         break;
@@ -3386,15 +5600,15 @@ static void process_bin_append_prepend(conn *c) {
     ENGINE_ERROR_CODE ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
     c->ewouldblock = false;
-    item_info_holder info = { .info =  { .nvalue = 1 } };
+    item_info_holder info = { .info =  { .nvalue = IOV_MAX } };
 
     if (ret == ENGINE_SUCCESS) {
+        uint64_t cycles = engine_cycles_start(c);
         ret = settings.engine.v1->allocate(settings.engine.v0, c,
                                            &it, key, nkey,
                                            vlen, 0, 0);
-        if (ret == ENGINE_SUCCESS && !settings.engine.v1->get_item_info(settings.engine.v0,
-                                                                        c, it,
-                                                                        (void*)&info)) {
+        engine_cycles_end(c, ENGINE_CALL_ALLOCATE, cycles);
+        if (ret == ENGINE_SUCCESS && !get_item_info(c, it, (void*)&info)) {
             settings.engine.v1->release(settings.engine.v0, c, it);
             write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
             return;
@@ -3416,9 +5630,12 @@ static void process_bin_append_prepend(conn *c) {
             assert(0);
         }
 
+        if (!conn_set_ritem(c, &info.info)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, vlen);
+            return;
+        }
         c->item = it;
-        c->ritem = info.info.value[0].iov_base;
-        c->rlbytes = vlen;
         conn_set_state(c, conn_nread);
         c->substate = bin_read_set_value;
         break;
@@ -3453,8 +5670,10 @@ static void process_bin_flush(conn *c) {
                                         (long)exptime);
     }
 
+    uint64_t cycles = engine_cycles_start(c);
     ENGINE_ERROR_CODE ret;
     ret = settings.engine.v1->flush(settings.engine.v0, c, exptime);
+    engine_cycles_end(c, ENGINE_CALL_FLUSH, cycles);
 
     if (ret == ENGINE_SUCCESS) {
         write_bin_response(c, NULL, 0, 0, 0);
@@ -3491,44 +5710,937 @@ static void process_bin_delete(conn *c) {
         if (settings.detail_enabled) {
             stats_prefix_record_delete(key, nkey);
         }
+        uint64_t cycles = engine_cycles_start(c);
         ret = settings.engine.v1->remove(settings.engine.v0, c, key, nkey,
                                          &cas, c->binary_header.request.vbucket);
+        engine_cycles_end(c, ENGINE_CALL_REMOVE, cycles);
     }
 
-    /* For some reason the SLAB_INCR tries to access this... */
-    item_info_holder info = { .info = { .nvalue = 1 } };
     switch (ret) {
     case ENGINE_SUCCESS:
         c->cas = cas;
         write_bin_response(c, NULL, 0, 0, 0);
         SLAB_INCR(c, delete_hits, key, nkey);
         break;
-    case ENGINE_KEY_EEXISTS:
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, 0);
+    case ENGINE_KEY_EEXISTS:
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, 0);
+        break;
+    case ENGINE_KEY_ENOENT:
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0);
+        STATS_INCR(c, delete_misses, key, nkey);
+        break;
+    case ENGINE_NOT_MY_VBUCKET:
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET, 0);
+        break;
+    case ENGINE_TMPFAIL:
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ETMPFAIL, 0);
+        break;
+    case ENGINE_EWOULDBLOCK:
+        c->ewouldblock = true;
+        break;
+    default:
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
+    }
+}
+
+/*
+ * Remember the key (what fits of it) for the slow request log, while it's
+ * still in the input buffer
+ */
+static void slowlog_trace_key(conn *c) {
+    uint16_t nkey = c->binary_header.request.keylen;
+    if (nkey != 0 && c->timing_nkey == 0) {
+        const char *key;
+        if (c->substate == bin_reading_packet) {
+            key = c->rcurr - c->binary_header.request.bodylen +
+                c->binary_header.request.extlen;
+        } else {
+            key = binary_get_key(c);
+        }
+
+        size_t len = nkey < SLOWLOG_KEY ? nkey : SLOWLOG_KEY;
+        for (size_t ii = 0; ii < len; ++ii) {
+            c->timing_key[ii] = isgraph(key[ii]) ? key[ii] : '.';
+        }
+        c->timing_nkey = nkey;
+    }
+}
+
+/*
+ * Remember the key and how long it took to read the request for the slow
+ * request log
+ */
+static void slowlog_trace_read(conn *c) {
+    slowlog_trace_key(c);
+    if (c->timing_sampled) {
+        c->timing_read = timings_now() - c->timing_start;
+    }
+}
+
+/*
+ * The ASCII protocol. A command is a line of tokens separated by spaces
+ * and ended by "\r\n" (or just "\n"). The line is parsed where it is in
+ * the input buffer and isn't changed, so that we can parse it again when
+ * the engine makes us wait (the line is only consumed once the command
+ * went through). Only the commands most clients use are there: get,
+ * gets, set, add, replace, cas, delete, incr, decr, touch, version and
+ * quit.
+ */
+#define ASCII_MAX_TOKENS 8
+#define ASCII_MAX_LINE 2048
+/* A multi-get may be a lot longer than any other command */
+#define ASCII_MAX_GET_LINE (64 * 1024)
+
+static bool ascii_next_token(const char **ptr, const char *end,
+                             mc_extension_token_t *token) {
+    const char *p = *ptr;
+    while (p < end && *p == ' ') {
+        ++p;
+    }
+    if (p == end) {
+        *ptr = p;
+        return false;
+    }
+    token->value = (char *)p;
+    while (p < end && *p != ' ') {
+        ++p;
+    }
+    token->length = p - token->value;
+    *ptr = p;
+    return true;
+}
+
+/*
+ * Split the line in tokens. Returns the number of tokens, or -1 if there
+ * are more than max.
+ */
+static int ascii_tokenize(const char *line, const char *end,
+                          mc_extension_token_t *tokens, int max) {
+    int ntokens = 0;
+    mc_extension_token_t token;
+    while (ascii_next_token(&line, end, &token)) {
+        if (ntokens == max) {
+            return -1;
+        }
+        tokens[ntokens++] = token;
+    }
+    return ntokens;
+}
+
+static bool ascii_token_is(const mc_extension_token_t *token, const char *str) {
+    size_t len = strlen(str);
+    return token->length == len && memcmp(token->value, str, len) == 0;
+}
+
+/* The numbers are copied out to be NUL terminated for the conversion */
+static bool ascii_token_uint64(const mc_extension_token_t *token,
+                               uint64_t *out) {
+    char buf[24];
+    if (token->length == 0 || token->length >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, token->value, token->length);
+    buf[token->length] = '\0';
+    return safe_strtoull(buf, out);
+}
+
+static bool ascii_token_uint32(const mc_extension_token_t *token,
+                               uint32_t *out) {
+    char buf[16];
+    if (token->length == 0 || token->length >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, token->value, token->length);
+    buf[token->length] = '\0';
+    return safe_strtoul(buf, out);
+}
+
+static bool ascii_token_int32(const mc_extension_token_t *token,
+                              int32_t *out) {
+    char buf[16];
+    if (token->length == 0 || token->length >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, token->value, token->length);
+    buf[token->length] = '\0';
+    return safe_strtol(buf, out);
+}
+
+/*
+ * The expiration time of an ASCII command. A negative one means that
+ * the item expires right away, so we give the engine a time long past.
+ */
+static rel_time_t ascii_exptime(int32_t exptime) {
+    return exptime < 0 ? REALTIME_MAXDELTA + 1 : (rel_time_t)exptime;
+}
+
+/* Is the last token "noreply"? (It's dropped from the tokens if it is) */
+static bool ascii_noreply(mc_extension_token_t *tokens, int *ntokens) {
+    if (*ntokens > 0 && ascii_token_is(&tokens[*ntokens - 1], "noreply")) {
+        --*ntokens;
+        return true;
+    }
+    return false;
+}
+
+/* Release the items (and suffixes) of a response we didn't send */
+static void conn_release_items(conn *c) {
+    for (; c->ileft > 0; c->ileft--, c->icurr++) {
+        settings.engine.v1->release(settings.engine.v0, c, *(c->icurr));
+    }
+    for (; c->suffixleft > 0; c->suffixleft--, c->suffixcurr++) {
+        cache_free(c->thread->suffix_cache, *(c->suffixcurr));
+    }
+}
+
+static bool conn_hold_item(conn *c, item *it) {
+    if (c->ileft == 0) {
+        c->icurr = c->ilist;
+    }
+    if (c->icurr - c->ilist + c->ileft == c->isize) {
+        item **ilist = CONN_LIST_RESIZE(c, ilist, c->isize, c->isize * 2);
+        if (ilist == NULL) {
+            return false;
+        }
+        c->icurr = ilist + (c->icurr - c->ilist);
+        c->ilist = ilist;
+        c->isize *= 2;
+    }
+    c->icurr[c->ileft++] = it;
+    return true;
+}
+
+static char *conn_new_suffix(conn *c) {
+    if (c->suffixleft == 0) {
+        c->suffixcurr = c->suffixlist;
+    }
+    if (c->suffixcurr - c->suffixlist + c->suffixleft == c->suffixsize) {
+        char **list = CONN_LIST_RESIZE(c, suffixlist, c->suffixsize,
+                                       c->suffixsize * 2);
+        if (list == NULL) {
+            return NULL;
+        }
+        c->suffixcurr = list + (c->suffixcurr - c->suffixlist);
+        c->suffixlist = list;
+        c->suffixsize *= 2;
+    }
+    char *suffix = cache_alloc(c->thread->suffix_cache);
+    if (suffix != NULL) {
+        c->suffixcurr[c->suffixleft++] = suffix;
+    }
+    return suffix;
+}
+
+/*
+ * Add "VALUE <key> <flags> <bytes>[ <cas>]\r\n<data>\r\n" for the item
+ * to the response. The key and the data are sent from the item, which
+ * is held until the response is sent.
+ */
+static bool ascii_add_value(conn *c, item *it, bool return_cas) {
+    item_info_holder info = { .info = { .nvalue = IOV_MAX } };
+    if (!get_item_info(c, it, (void*)&info)) {
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "%d: Failed to get item info\n",
+                                        c->sfd);
+        return false;
+    }
+    if (!conn_hold_item(c, it)) {
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        return false;
+    }
+
+    char *suffix = conn_new_suffix(c);
+    if (suffix == NULL) {
+        return false;
+    }
+    /* The flags are kept the way the binary protocol sends them */
+    int len;
+    if (return_cas) {
+        len = snprintf(suffix, SUFFIX_SIZE, " %u %u %"PRIu64"\r\n",
+                       ntohl(info.info.flags), info.info.nbytes,
+                       info.info.cas);
+    } else {
+        len = snprintf(suffix, SUFFIX_SIZE, " %u %u\r\n",
+                       ntohl(info.info.flags), info.info.nbytes);
+    }
+
+    if (add_iov(c, "VALUE ", 6) != 0 ||
+        add_iov(c, info.info.key, info.info.nkey) != 0 ||
+        add_iov(c, suffix, len) != 0) {
+        return false;
+    }
+    for (int ii = 0; ii < info.info.nvalue; ++ii) {
+        if (add_iov(c, info.info.value[ii].iov_base,
+                    info.info.value[ii].iov_len) != 0) {
+            return false;
+        }
+    }
+    c->timing_value += info.info.nbytes;
+    return add_iov(c, "\r\n", 2) == 0;
+}
+
+/*
+ * "get <key>*" and "gets <key>*". The keys are looked up MGET_MAX_KEYS
+ * at a time through get_multi (like a run of quiet binary gets), and all
+ * of the values go in the one response.
+ */
+static void process_ascii_get(conn *c, const char *keys, const char *end,
+                              bool return_cas) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    mc_extension_token_t token;
+    bool failed = false;
+    int nkeys = 0;
+
+    /* A retry after we had to wait starts on the first key again */
+    c->aiostat = ENGINE_SUCCESS;
+    c->timing_value = 0;
+
+    if (c->mget == NULL &&
+        (c->mget = malloc(MGET_MAX_KEYS * sizeof(*c->mget))) == NULL) {
+        out_string(c, "SERVER_ERROR out of memory");
+        return;
+    }
+
+    while (!failed && ret == ENGINE_SUCCESS) {
+        int n = 0;
+        while (n < MGET_MAX_KEYS && ascii_next_token(&keys, end, &token)) {
+            if (token.length > KEY_MAX_LENGTH) {
+                conn_release_items(c);
+                out_string(c, "CLIENT_ERROR bad command line format");
+                return;
+            }
+            c->mget[n].key = token.value;
+            c->mget[n].nkey = (uint16_t)token.length;
+            c->mget[n].vbucket = 0;
+            c->mget[n].status = ENGINE_EWOULDBLOCK;
+            ++n;
+        }
+        if (n == 0) {
+            break;
+        }
+        nkeys += n;
+
+        if (n > 1 && settings.engine.v1->get_multi != NULL) {
+            uint64_t cycles = engine_cycles_start(c);
+            if (settings.engine.v1->get_multi(settings.engine.v0, c,
+                                              c->mget, n) != ENGINE_SUCCESS) {
+                for (int ii = 0; ii < n; ++ii) {
+                    c->mget[ii].status = ENGINE_EWOULDBLOCK;
+                }
+            }
+            engine_cycles_end(c, ENGINE_CALL_GET, cycles);
+        }
+
+        for (int ii = 0; ii < n; ++ii) {
+            get_multi_key *key = &c->mget[ii];
+            if (ret == ENGINE_SUCCESS && key->status == ENGINE_EWOULDBLOCK) {
+                uint64_t cycles = engine_cycles_start(c);
+                key->status = settings.engine.v1->get(settings.engine.v0, c,
+                                                      &key->item, key->key,
+                                                      key->nkey, 0);
+                engine_cycles_end(c, ENGINE_CALL_GET, cycles);
+            }
+
+            switch (key->status) {
+            case ENGINE_SUCCESS:
+                if (ret != ENGINE_SUCCESS || failed) {
+                    settings.engine.v1->release(settings.engine.v0, c,
+                                                key->item);
+                } else {
+                    STATS_HIT(c, get, key->key, key->nkey);
+                    failed = !ascii_add_value(c, key->item, return_cas);
+                }
+                break;
+            case ENGINE_KEY_ENOENT:
+                STATS_MISS(c, get, key->key, key->nkey);
+                break;
+            case ENGINE_EWOULDBLOCK:
+            case ENGINE_DISCONNECT:
+                if (ret == ENGINE_SUCCESS) {
+                    ret = key->status;
+                }
+                break;
+            default:
+                ;
+            }
+            if (settings.detail_enabled && key->status != ENGINE_EWOULDBLOCK) {
+                stats_prefix_record_get(key->key, key->nkey,
+                                        key->status == ENGINE_SUCCESS);
+            }
+        }
+    }
+
+    if (nkeys == 0) {
+        out_string(c, "ERROR");
+        return;
+    }
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        if (!failed && add_iov(c, "END\r\n", 5) == 0) {
+            conn_set_state(c, conn_mwrite);
+        } else {
+            conn_release_items(c);
+            out_string(c, "SERVER_ERROR out of memory writing get response");
+        }
+        break;
+    case ENGINE_EWOULDBLOCK:
+        /* Throw away what we have and do it all again when we're woken */
+        conn_release_items(c);
+        c->msgcurr = 0;
+        c->msgused = 0;
+        c->iovused = 0;
+        add_msghdr(c);
+        c->ewouldblock = true;
+        break;
+    default:
+        conn_release_items(c);
+        conn_set_state(c, conn_closing);
+    }
+}
+
+/*
+ * "set|add|replace <key> <flags> <exptime> <bytes> [noreply]" and
+ * "cas <key> <flags> <exptime> <bytes> <cas> [noreply]". The data is read
+ * straight into the item, and the "\r\n" after it into ascii_crlf.
+ */
+static void process_ascii_update(conn *c, mc_extension_token_t *tokens,
+                                 int ntokens, ENGINE_STORE_OPERATION op) {
+    uint32_t flags;
+    int32_t exptime;
+    int32_t vlen;
+    uint64_t cas = 0;
+
+    if (ntokens != (op == OPERATION_CAS ? 6 : 5) ||
+        tokens[1].length > KEY_MAX_LENGTH ||
+        !ascii_token_uint32(&tokens[2], &flags) ||
+        !ascii_token_int32(&tokens[3], &exptime) ||
+        !ascii_token_int32(&tokens[4], &vlen) ||
+        (op == OPERATION_CAS && !ascii_token_uint64(&tokens[5], &cas))) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    if (vlen < 0 || vlen > INT32_MAX - 2) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        conn_set_state(c, conn_closing);
+        return;
+    }
+
+    const char *key = tokens[1].value;
+    uint16_t nkey = (uint16_t)tokens[1].length;
+    if (settings.detail_enabled) {
+        stats_prefix_record_set(key, nkey);
+    }
+
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+    item_info_holder info = { .info = { .nvalue = IOV_MAX } };
+    item *it = NULL;
+
+    if (ret == ENGINE_SUCCESS) {
+        uint64_t cycles = engine_cycles_start(c);
+        ret = settings.engine.v1->allocate(settings.engine.v0, c,
+                                           &it, key, nkey, vlen,
+                                           htonl(flags),
+                                           ascii_exptime(exptime));
+        engine_cycles_end(c, ENGINE_CALL_ALLOCATE, cycles);
+        if (ret == ENGINE_SUCCESS &&
+            !get_item_info(c, it, (void*)&info)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            ret = ENGINE_FAILED;
+        }
+    }
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        item_set_cas(c, it, cas);
+        c->store_op = op;
+        c->timing_value = vlen;
+        if (!conn_set_ritem(c, &info.info)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            c->sbytes = vlen + 2;
+            out_string(c, "SERVER_ERROR out of memory storing object");
+            return;
+        }
+        /* The "\r\n" is one more piece to read */
+        if (c->riovused == c->riovsize) {
+            struct iovec *riov = realloc(c->riov, (c->riovsize + 1) *
+                                         sizeof(*riov));
+            if (riov == NULL) {
+                settings.engine.v1->release(settings.engine.v0, c, it);
+                c->sbytes = vlen + 2;
+                out_string(c, "SERVER_ERROR out of memory storing object");
+                return;
+            }
+            c->riov = riov;
+            c->riovsize++;
+        }
+        c->riov[c->riovused].iov_base = c->ascii_crlf;
+        c->riov[c->riovused].iov_len = 2;
+        c->riovused++;
+        c->item = it;
+        c->substate = ascii_read_set_value;
+        conn_set_state(c, conn_nread);
+        break;
+    case ENGINE_EWOULDBLOCK:
+        c->ewouldblock = true;
+        break;
+    case ENGINE_DISCONNECT:
+        conn_set_state(c, conn_closing);
+        break;
+    default:
+        c->sbytes = vlen + 2;
+        if (ret == ENGINE_E2BIG) {
+            out_string(c, "SERVER_ERROR object too large for cache");
+        } else {
+            out_string(c, "SERVER_ERROR out of memory storing object");
+        }
+        /* Like a failed binary set, the old value goes */
+        if (op == OPERATION_SET) {
+            settings.engine.v1->remove(settings.engine.v0, c, key, nkey,
+                                       &cas, 0);
+        }
+    }
+}
+
+static void complete_update_ascii(conn *c) {
+    item *it = c->item;
+    item_info_holder info = { .info = { .nvalue = IOV_MAX } };
+
+    if (memcmp(c->ascii_crlf, "\r\n", 2) != 0) {
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        c->item = NULL;
+        out_string(c, "CLIENT_ERROR bad data chunk");
+        return;
+    }
+
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+    if (ret == ENGINE_SUCCESS) {
+        uint64_t cycles = engine_cycles_start(c);
+        ret = settings.engine.v1->store(settings.engine.v0, c, it, &c->cas,
+                                        c->store_op, 0);
+        engine_cycles_end(c, ENGINE_CALL_STORE, cycles);
+    }
+    get_item_info(c, it, (void*)&info);
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        out_string(c, "STORED");
+        break;
+    case ENGINE_KEY_EEXISTS:
+        out_string(c, "EXISTS");
+        break;
+    case ENGINE_KEY_ENOENT:
+        out_string(c, "NOT_FOUND");
+        break;
+    case ENGINE_NOT_STORED:
+        out_string(c, "NOT_STORED");
+        break;
+    case ENGINE_ENOMEM:
+        out_string(c, "SERVER_ERROR out of memory storing object");
+        break;
+    case ENGINE_EWOULDBLOCK:
+        c->ewouldblock = true;
+        return;
+    case ENGINE_DISCONNECT:
+        conn_set_state(c, conn_closing);
+        break;
+    default:
+        out_string(c, "SERVER_ERROR unhandled storage type");
+    }
+
+    if (c->store_op == OPERATION_CAS) {
+        switch (ret) {
+        case ENGINE_SUCCESS:
+            SLAB_INCR(c, cas_hits, info.info.key, info.info.nkey);
+            break;
+        case ENGINE_KEY_EEXISTS:
+            SLAB_INCR(c, cas_badval, info.info.key, info.info.nkey);
+            break;
+        case ENGINE_KEY_ENOENT:
+            STATS_NOKEY(c, cas_misses);
+            break;
+        default:
+            ;
+        }
+    } else {
+        SLAB_INCR(c, cmd_set, info.info.key, info.info.nkey);
+    }
+
+    settings.engine.v1->release(settings.engine.v0, c, it);
+    c->item = NULL;
+}
+
+/* "delete <key> [0] [noreply]" (the 0 is what old clients send) */
+static void process_ascii_delete(conn *c, mc_extension_token_t *tokens,
+                                 int ntokens) {
+    if (ntokens > 3 || tokens[1].length > KEY_MAX_LENGTH ||
+        (ntokens == 3 && !ascii_token_is(&tokens[2], "0"))) {
+        out_string(c, "CLIENT_ERROR bad command line format.  "
+                   "Usage: delete <key> [noreply]");
+        return;
+    }
+
+    const char *key = tokens[1].value;
+    size_t nkey = tokens[1].length;
+    uint64_t cas = 0;
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+
+    if (ret == ENGINE_SUCCESS) {
+        if (settings.detail_enabled) {
+            stats_prefix_record_delete(key, nkey);
+        }
+        uint64_t cycles = engine_cycles_start(c);
+        ret = settings.engine.v1->remove(settings.engine.v0, c, key, nkey,
+                                         &cas, 0);
+        engine_cycles_end(c, ENGINE_CALL_REMOVE, cycles);
+    }
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        out_string(c, "DELETED");
+        SLAB_INCR(c, delete_hits, key, nkey);
+        break;
+    case ENGINE_KEY_ENOENT:
+        out_string(c, "NOT_FOUND");
+        STATS_INCR(c, delete_misses, key, nkey);
+        break;
+    case ENGINE_EWOULDBLOCK:
+        c->ewouldblock = true;
+        break;
+    case ENGINE_DISCONNECT:
+        conn_set_state(c, conn_closing);
+        break;
+    default:
+        out_string(c, "SERVER_ERROR failed to delete item");
+    }
+}
+
+/* "incr|decr <key> <delta> [noreply]" */
+static void process_ascii_arithmetic(conn *c, mc_extension_token_t *tokens,
+                                     int ntokens, bool incr) {
+    uint64_t delta;
+    if (ntokens != 3 || tokens[1].length > KEY_MAX_LENGTH) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    if (!ascii_token_uint64(&tokens[2], &delta)) {
+        out_string(c, "CLIENT_ERROR invalid numeric delta argument");
+        return;
+    }
+
+    const char *key = tokens[1].value;
+    size_t nkey = tokens[1].length;
+    uint64_t cas;
+    uint64_t result;
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+
+    if (ret == ENGINE_SUCCESS) {
+        uint64_t cycles = engine_cycles_start(c);
+        ret = settings.engine.v1->arithmetic(settings.engine.v0, c, key, nkey,
+                                             incr, false, delta, 0, 0,
+                                             &cas, &result, 0);
+        engine_cycles_end(c, ENGINE_CALL_ARITHMETIC, cycles);
+    }
+
+    switch (ret) {
+    case ENGINE_SUCCESS: {
+        char buf[INCR_MAX_STORAGE_LEN];
+        snprintf(buf, sizeof(buf), "%"PRIu64, result);
+        out_string(c, buf);
+        if (incr) {
+            STATS_INCR(c, incr_hits, key, nkey);
+        } else {
+            STATS_INCR(c, decr_hits, key, nkey);
+        }
+        break;
+    }
+    case ENGINE_KEY_ENOENT:
+        out_string(c, "NOT_FOUND");
+        if (incr) {
+            STATS_INCR(c, incr_misses, key, nkey);
+        } else {
+            STATS_INCR(c, decr_misses, key, nkey);
+        }
+        break;
+    case ENGINE_EINVAL:
+        out_string(c, "CLIENT_ERROR cannot increment or decrement "
+                   "non-numeric value");
+        break;
+    case ENGINE_ENOMEM:
+        out_string(c, "SERVER_ERROR out of memory");
+        break;
+    case ENGINE_EWOULDBLOCK:
+        c->ewouldblock = true;
+        break;
+    case ENGINE_DISCONNECT:
+        conn_set_state(c, conn_closing);
+        break;
+    default:
+        out_string(c, "SERVER_ERROR failed to update the value");
+    }
+}
+
+static bool ascii_status_handler(const void *key, uint16_t keylen,
+                                 const void *ext, uint8_t extlen,
+                                 const void *body, uint32_t bodylen,
+                                 uint8_t datatype, uint16_t status,
+                                 uint64_t cas, const void *cookie) {
+    ((conn *)cookie)->ascii_status = status;
+    return true;
+}
+
+/*
+ * "touch <key> <exptime> [noreply]". The engines do touch as a binary
+ * command, so that's what we hand them.
+ */
+static void process_ascii_touch(conn *c, mc_extension_token_t *tokens,
+                                int ntokens) {
+    int32_t exptime;
+    if (ntokens != 3 || tokens[1].length > KEY_MAX_LENGTH ||
+        !ascii_token_int32(&tokens[2], &exptime)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+    if (ret == ENGINE_SUCCESS) {
+        union {
+            protocol_binary_request_touch request;
+            char bytes[sizeof(protocol_binary_request_touch) + KEY_MAX_LENGTH];
+        } packet;
+        memset(&packet, 0, sizeof(packet.request));
+        packet.request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+        packet.request.message.header.request.opcode = PROTOCOL_BINARY_CMD_TOUCH;
+        packet.request.message.header.request.keylen = htons((uint16_t)tokens[1].length);
+        packet.request.message.header.request.extlen = 4;
+        packet.request.message.header.request.bodylen = htonl(4 + tokens[1].length);
+        packet.request.message.body.expiration = htonl(ascii_exptime(exptime));
+        /* The struct is padded, the key goes right after the extras */
+        memcpy(packet.bytes + sizeof(packet.request.message.header) + 4,
+               tokens[1].value, tokens[1].length);
+
+        c->ascii_status = PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+        ret = dispatch_unknown_command(c, &packet.request.message.header,
+                                       ascii_status_handler);
+    }
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        switch (c->ascii_status) {
+        case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+            out_string(c, "TOUCHED");
+            break;
+        case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+            out_string(c, "NOT_FOUND");
+            break;
+        default:
+            out_string(c, "SERVER_ERROR failed to touch the item");
+        }
+        break;
+    case ENGINE_EWOULDBLOCK:
+        c->ewouldblock = true;
+        break;
+    case ENGINE_DISCONNECT:
+        conn_set_state(c, conn_closing);
+        break;
+    case ENGINE_ENOTSUP:
+        out_string(c, "ERROR");
+        break;
+    default:
+        out_string(c, "SERVER_ERROR failed to touch the item");
+    }
+}
+
+/* Map the command to the opcode we keep its timings (and slowlog) under */
+static int ascii_command_opcode(const mc_extension_token_t *cmd) {
+    static const struct {
+        const char *name;
+        uint8_t opcode;
+    } commands[] = {
+        { "get", PROTOCOL_BINARY_CMD_GET },
+        { "gets", PROTOCOL_BINARY_CMD_GET },
+        { "set", PROTOCOL_BINARY_CMD_SET },
+        { "add", PROTOCOL_BINARY_CMD_ADD },
+        { "replace", PROTOCOL_BINARY_CMD_REPLACE },
+        { "cas", PROTOCOL_BINARY_CMD_SET },
+        { "delete", PROTOCOL_BINARY_CMD_DELETE },
+        { "incr", PROTOCOL_BINARY_CMD_INCREMENT },
+        { "decr", PROTOCOL_BINARY_CMD_DECREMENT },
+        { "touch", PROTOCOL_BINARY_CMD_TOUCH },
+        { "version", PROTOCOL_BINARY_CMD_VERSION },
+        { "quit", PROTOCOL_BINARY_CMD_QUIT }
+    };
+    for (size_t ii = 0; ii < sizeof(commands) / sizeof(commands[0]); ++ii) {
+        if (ascii_token_is(cmd, commands[ii].name)) {
+            return commands[ii].opcode;
+        }
+    }
+    return -1;
+}
+
+static void process_ascii_command(conn *c, const char *line, const char *end) {
+    mc_extension_token_t tokens[ASCII_MAX_TOKENS];
+    const char *rest = line;
+    mc_extension_token_t cmd;
+
+    c->noreply = false;
+    if (!ascii_next_token(&rest, end, &cmd)) {
+        out_string(c, "ERROR");
+        return;
+    }
+
+    int opcode = ascii_command_opcode(&cmd);
+    if (opcode == -1) {
+        out_string(c, "ERROR");
+        return;
+    }
+    if (settings.require_sasl) {
+        /* There's no way to authenticate (only -B auto gets here) */
+        out_string(c, "CLIENT_ERROR authentication required");
+        c->write_and_go = conn_closing;
+        return;
+    }
+
+    c->cmd = opcode;
+    if (c->timing_start == 0) {
+        /* (It isn't 0 when we parse the line again after a wait) */
+        conn_timing_begin(c, (uint8_t)opcode, 0);
+    }
+
+    if (opcode == PROTOCOL_BINARY_CMD_GET) {
+        process_ascii_get(c, rest, end, cmd.length == 4);
+        return;
+    }
+
+    int ntokens = ascii_tokenize(line, end, tokens, ASCII_MAX_TOKENS);
+    if (ntokens == -1) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    c->noreply = ascii_noreply(tokens, &ntokens);
+    if (ntokens >= 2 && c->timing_traced) {
+        c->timing_nkey = tokens[1].length;
+        memcpy(c->timing_key, tokens[1].value,
+               c->timing_nkey < SLOWLOG_KEY ? c->timing_nkey : SLOWLOG_KEY);
+    }
+
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_VERSION:
+        out_string(c, "VERSION " VERSION);
+        return;
+    case PROTOCOL_BINARY_CMD_QUIT:
+        conn_set_state(c, conn_closing);
+        return;
+    default:
+        break;
+    }
+
+    if (ntokens < 2) {
+        out_string(c, "ERROR");
+        return;
+    }
+
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_SET:
+        process_ascii_update(c, tokens, ntokens,
+                             ascii_token_is(&cmd, "cas") ?
+                             OPERATION_CAS : OPERATION_SET);
+        break;
+    case PROTOCOL_BINARY_CMD_ADD:
+        process_ascii_update(c, tokens, ntokens, OPERATION_ADD);
         break;
-    case ENGINE_KEY_ENOENT:
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0);
-        STATS_INCR(c, delete_misses, key, nkey);
+    case PROTOCOL_BINARY_CMD_REPLACE:
+        process_ascii_update(c, tokens, ntokens, OPERATION_REPLACE);
         break;
-    case ENGINE_NOT_MY_VBUCKET:
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET, 0);
+    case PROTOCOL_BINARY_CMD_DELETE:
+        process_ascii_delete(c, tokens, ntokens);
         break;
-    case ENGINE_TMPFAIL:
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ETMPFAIL, 0);
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+        process_ascii_arithmetic(c, tokens, ntokens,
+                                 opcode == PROTOCOL_BINARY_CMD_INCREMENT);
         break;
-    case ENGINE_EWOULDBLOCK:
-        c->ewouldblock = true;
+    case PROTOCOL_BINARY_CMD_TOUCH:
+        process_ascii_touch(c, tokens, ntokens);
         break;
     default:
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
+        out_string(c, "ERROR");
+    }
+}
+
+/*
+ * Process the line at the start of the input buffer, if we have it all.
+ * Returns 0 if we need more data.
+ */
+static int try_read_ascii_command(conn *c) {
+    char *el = memchr(c->rcurr, '\n', c->rbytes);
+    if (el == NULL) {
+        size_t max = ASCII_MAX_LINE;
+        if (c->rbytes >= 4 && memcmp(c->rcurr, "get", 3) == 0) {
+            max = ASCII_MAX_GET_LINE;
+        }
+        if (c->rbytes > max) {
+            if (settings.verbose) {
+                settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                        "%d: Command line too long\n", c->sfd);
+            }
+            out_string(c, "CLIENT_ERROR line too long");
+            c->write_and_go = conn_closing;
+            return 1;
+        }
+        return 0;
+    }
+
+    const char *end = el;
+    if (end > c->rcurr && end[-1] == '\r') {
+        --end;
+    }
+    if (settings.verbose > 1) {
+        settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                        "<%d %.*s\n", c->sfd,
+                                        (int)(end - c->rcurr), c->rcurr);
+    }
+
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    if (add_msghdr(c) != 0) {
+        out_string(c, "SERVER_ERROR out of memory");
+        return 1;
+    }
+
+    c->ewouldblock = false;
+    process_ascii_command(c, c->rcurr, end);
+    if (c->ewouldblock) {
+        /* The line is parsed again when we're told to go on */
+        unregister_event(c);
+        return 1;
     }
+
+    size_t len = el + 1 - c->rcurr;
+    c->rcurr += len;
+    c->rbytes -= len;
+    return 1;
 }
 
 static void complete_nread(conn *c) {
     assert(c != NULL);
     assert(c->cmd >= 0);
 
+    if (c->timing_traced && c->timing_start != 0) {
+        slowlog_trace_read(c);
+    }
+
     switch(c->substate) {
+    case ascii_read_set_value:
+        complete_update_ascii(c);
+        break;
     case bin_reading_set_header:
         if (c->cmd == PROTOCOL_BINARY_CMD_APPEND ||
                 c->cmd == PROTOCOL_BINARY_CMD_PREPEND) {
@@ -3590,10 +6702,17 @@ static void reset_cmd_handler(conn *c) {
     c->cmd = -1;
     c->substate = bin_no_state;
     if(c->item != NULL) {
-        settings.engine.v1->release(settings.engine.v0, c, c->item);
+        if (c->zc_iov != -1) {
+            conn_zerocopy_hold(c);
+        } else {
+            settings.engine.v1->release(settings.engine.v0, c, c->item);
+        }
         c->item = NULL;
     }
-    conn_shrink(c);
+    c->zc_iov = -1;
+    if (c->ncoalesced == 0) {
+        conn_shrink(c);
+    }
     if (c->rbytes > 0) {
         conn_set_state(c, conn_parse_cmd);
     } else {
@@ -3654,8 +6773,7 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
                                     &thread_stats);
     }
 
-    struct slab_stats slab_stats;
-    slab_stats_aggregate(&thread_stats, &slab_stats);
+    struct slab_stats slab_stats = thread_stats.slab_stats;
 
 #ifndef __WIN32__
     struct rusage usage;
@@ -3698,6 +6816,13 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     APPEND_STAT("cmd_flush", "%"PRIu64, thread_stats.cmd_flush);
     APPEND_STAT("auth_cmds", "%"PRIu64, thread_stats.auth_cmds);
     APPEND_STAT("auth_errors", "%"PRIu64, thread_stats.auth_errors);
+    APPEND_STAT("auth_ns", "%"PRIu64, thread_stats.auth_ns);
+    struct isasl_stats isasl;
+    isasl_get_stats(&isasl);
+    APPEND_STAT("auth_users", "%"PRIu64, isasl.users);
+    APPEND_STAT("auth_refreshes", "%"PRIu64, isasl.refreshes);
+    APPEND_STAT("auth_reloads", "%"PRIu64, isasl.reloads);
+    APPEND_STAT("auth_refresh_ns", "%"PRIu64, isasl.refresh_ns);
     APPEND_STAT("get_hits", "%"PRIu64, slab_stats.get_hits);
     APPEND_STAT("get_misses", "%"PRIu64, thread_stats.get_misses);
     APPEND_STAT("delete_misses", "%"PRIu64, thread_stats.delete_misses);
@@ -3716,10 +6841,38 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     APPEND_STAT("listen_disabled_num", "%"PRIu64, get_listen_disabled_num());
     APPEND_STAT("rejected_conns", "%" PRIu64, (unsigned long long)stats.rejected_conns);
     APPEND_STAT("threads", "%d", settings.num_threads);
+    APPEND_STAT("threads_active", "%d", threads_active());
     APPEND_STAT("conn_yields", "%" PRIu64, (unsigned long long)thread_stats.conn_yields);
+    APPEND_STAT("bulk_yields", "%"PRIu64, thread_stats.bulk_yields);
+    APPEND_STAT("zerocopy_bytes", "%"PRIu64, thread_stats.zerocopy_bytes);
+    APPEND_STAT("zerocopy_fallbacks", "%"PRIu64, thread_stats.zerocopy_fallbacks);
+    APPEND_STAT("coalesced_responses", "%"PRIu64, thread_stats.coalesced_responses);
+    APPEND_STAT("nread_readahead", "%"PRIu64, thread_stats.nread_readahead);
+    APPEND_STAT("sendmsgs", "%"PRIu64, thread_stats.sendmsgs);
+    APPEND_STAT("tcp_corked", "%"PRIu64, thread_stats.tcp_corked);
+    if (settings.tls_port != 0) {
+        APPEND_STAT("tls_handshakes", "%"PRIu64, thread_stats.tls_handshakes);
+        APPEND_STAT("tls_handshake_errors", "%"PRIu64,
+                    thread_stats.tls_handshake_errors);
+        APPEND_STAT("tls_offloaded", "%"PRIu64, thread_stats.tls_offloaded);
+    }
     STATS_UNLOCK();
 
+    uint64_t buffers_pooled;
+    int64_t buffers_pinned;
+    threads_buffer_stats(&buffers_pooled, &buffers_pinned);
+    APPEND_STAT("conn_buffers_pooled", "%"PRIu64, buffers_pooled);
+    APPEND_STAT("conn_buffers_pinned", "%"PRId64, buffers_pinned);
+
+    uint64_t idle_kicks, hibernating, hibernations, wakeups;
+    threads_idle_stats(&idle_kicks, &hibernating, &hibernations, &wakeups);
+    APPEND_STAT("idle_kicks", "%"PRIu64, idle_kicks);
+    APPEND_STAT("conn_hibernating", "%"PRIu64, hibernating);
+    APPEND_STAT("conn_hibernations", "%"PRIu64, hibernations);
+    APPEND_STAT("conn_wakeups", "%"PRIu64, wakeups);
+
     APPEND_STAT("tcp_nodelay", "%s", settings.tcp_nodelay ? "enable" : "disable");
+    APPEND_STAT("tcp_cork", "%s", settings.tcp_cork ? "enable" : "disable");
 
     /*
      * Add tap stats (only if non-zero)
@@ -3781,6 +6934,30 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     }
 }
 
+static const char *conn_placement_text(enum conn_placement policy) {
+    switch (policy) {
+    case CONN_PLACEMENT_ROUND_ROBIN:
+        return "round-robin";
+    case CONN_PLACEMENT_CONNS:
+        return "conns";
+    case CONN_PLACEMENT_LOAD:
+        return "load";
+    }
+    return "unknown";
+}
+
+static const char *io_backend_text(enum io_backend backend) {
+    switch (backend) {
+    case IO_BACKEND_LIBEVENT:
+        return "libevent";
+    case IO_BACKEND_IO_URING:
+        return "io_uring";
+    case IO_BACKEND_IOCP:
+        return "iocp";
+    }
+    return "unknown";
+}
+
 static void process_stat_settings(ADD_STAT add_stats, void *c) {
     assert(add_stats);
     APPEND_STAT("maxbytes", "%u", (unsigned int)settings.maxbytes);
@@ -3797,7 +6974,15 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("growth_factor", "%.2f", settings.factor);
     APPEND_STAT("chunk_size", "%d", settings.chunk_size);
     APPEND_STAT("num_threads", "%d", settings.num_threads);
+    APPEND_STAT("num_threads_min", "%d", settings.num_threads_min);
     APPEND_STAT("num_threads_per_udp", "%d", settings.num_threads_per_udp);
+    APPEND_STAT("udp_gso", "%s", udp_gso_enabled() ? "yes" : "no");
+    APPEND_STAT("cpu_affinity", "%s",
+                settings.cpu_affinity ? settings.cpu_affinity : "NULL");
+    APPEND_STAT("tls_port", "%d", settings.tls_port);
+    if (settings.tls_cert != NULL) {
+        APPEND_STAT("tls_cert", "%s", settings.tls_cert);
+    }
     APPEND_STAT("stat_key_prefix", "%c", settings.prefix_delimiter);
     APPEND_STAT("detail_enabled", "%s",
                 settings.detail_enabled ? "yes" : "no");
@@ -3805,6 +6990,9 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
                 settings.allow_detailed ? "yes" : "no");
     APPEND_STAT("reqs_per_event", "%d", settings.reqs_per_event);
     APPEND_STAT("reqs_per_tap_event", "%d", settings.reqs_per_tap_event);
+    APPEND_STAT("bulk_classes", "%s",
+                settings.bulk_classes ? settings.bulk_classes : "NULL");
+    APPEND_STAT("bulk_budget", "%u", settings.bulk_budget);
     APPEND_STAT("cas_enabled", "%s", settings.use_cas ? "yes" : "no");
     APPEND_STAT("tcp_backlog", "%d", settings.backlog);
     APPEND_STAT("binding_protocol", "%s",
@@ -3830,6 +7018,22 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     }
 
     APPEND_STAT("tcp_nodelay", "%s", settings.tcp_nodelay ? "enable" : "disable");
+    APPEND_STAT("tcp_cork", "%s", settings.tcp_cork ? "enable" : "disable");
+    APPEND_STAT("reuseport", "%s", settings.reuseport ? "enable" : "disable");
+    APPEND_STAT("conn_placement", "%s", conn_placement_text(settings.conn_placement));
+    APPEND_STAT("conn_migrate", "%s", settings.conn_migrate ? "enable" : "disable");
+    APPEND_STAT("idle_timeout", "%u", settings.idle_timeout);
+    APPEND_STAT("hibernate_timeout", "%u", settings.hibernate_timeout);
+    APPEND_STAT("io_backend", "%s", io_backend_text(settings.io_backend));
+    APPEND_STAT("zerocopy_min", "%zu", settings.zerocopy_min);
+    APPEND_STAT("tap_compress_min", "%zu", settings.tap_compress_min);
+    APPEND_STAT("heap_sample", "%zu", settings.heap_sample);
+    APPEND_STAT("state_cycles", "%s", settings.state_cycles ? "on" : "off");
+    APPEND_STAT("slowlog_usec", "%u", settings.slowlog_usec);
+    APPEND_STAT("slowlog_sample", "%u", settings.slowlog_sample);
+    APPEND_STAT("hash_algorithm", "%s", hash_algorithm());
+    APPEND_STAT("task_threads_io", "%d", settings.task_threads[TASK_POOL_IO]);
+    APPEND_STAT("task_threads_cpu", "%d", settings.task_threads[TASK_POOL_CPU]);
 }
 
 /*
@@ -3843,6 +7047,8 @@ static int try_read_command(conn *c) {
     if (c->protocol == negotiating_prot || c->transport == udp_transport)  {
         if ((unsigned char)c->rbuf[0] == (unsigned char)PROTOCOL_BINARY_REQ) {
             c->protocol = binary_prot;
+        } else if (settings.binding_protocol != binary_prot) {
+            c->protocol = ascii_prot;
         }
 
         if (settings.verbose > 1) {
@@ -3911,12 +7117,14 @@ static int try_read_command(conn *c) {
                 return -1;
             }
 
-            c->msgcurr = 0;
-            c->msgused = 0;
-            c->iovused = 0;
-            if (add_msghdr(c) != 0) {
-                out_string(c, "SERVER_ERROR out of memory");
-                return 0;
+            if (c->ncoalesced == 0) {
+                c->msgcurr = 0;
+                c->msgused = 0;
+                c->iovused = 0;
+                if (add_msghdr(c) != 0) {
+                    out_string(c, "SERVER_ERROR out of memory");
+                    return 0;
+                }
             }
 
             c->cmd = c->binary_header.request.opcode;
@@ -3930,44 +7138,68 @@ static int try_read_command(conn *c) {
             c->rbytes -= sizeof(c->binary_header);
             c->rcurr += sizeof(c->binary_header);
         }
+    } else if (c->protocol == ascii_prot) {
+        return try_read_ascii_command(c);
     }
 
     return 1;
 }
 
 /*
- * read a UDP request.
+ * Is the connection still on OpenSSL rather than on kTLS?
  */
-static enum try_read_result try_read_udp(conn *c) {
-    int res;
+static bool conn_tls_userspace(const conn *c) {
+    return c->tls != NULL && !tls_offloaded(c->tls);
+}
 
-    assert(c != NULL);
+static ssize_t conn_recv(conn *c, void *buf, size_t len) {
+    if (conn_tls_userspace(c)) {
+        return tls_recv(c->tls, buf, len);
+    }
+    return recv(c->sfd, buf, len, 0);
+}
 
-    c->request_addr_size = sizeof(c->request_addr);
-    res = recvfrom(c->sfd, c->rbuf, c->rsize,
-                   0, (struct sockaddr *)&c->request_addr, &c->request_addr_size);
-    if (res > 8) {
-        unsigned char *buf = (unsigned char *)c->rbuf;
-        STATS_ADD(c, bytes_read, res);
+/*
+ * read a UDP request (the reader takes a batch of datagrams off the
+ * socket at a time and puts the requests in several frames together)
+ */
+static enum try_read_result try_read_udp(conn *c) {
+    assert(c != NULL);
 
-        /* Beginning of UDP packet is the request ID; save it. */
-        c->request_id = buf[0] * 256 + buf[1];
+    if (c->udp->reader == NULL && (c->udp->reader = udp_reader_create()) == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "Couldn't allocate the UDP reader\n");
+        return READ_NO_DATA_RECEIVED;
+    }
 
-        /* If this is a multi-packet request, drop it. */
-        if (buf[4] != 0 || buf[5] != 1) {
-            out_string(c, "SERVER_ERROR multi-packet request not supported");
-            return READ_NO_DATA_RECEIVED;
-        }
+    uint64_t nread = 0;
+    uint16_t request_id = 0;
+    size_t res = udp_reader_next(c->udp->reader, c->sfd, c->rbuf, c->rsize,
+                                 &request_id, &c->udp->request_addr,
+                                 &c->udp->request_addr_size, &nread,
+                                 current_time);
+    if (nread > 0) {
+        TRAFFIC_ADD(c, bytes_read, nread);
+    }
+    if (res == 0) {
+        return READ_NO_DATA_RECEIVED;
+    }
 
-        /* Don't care about any of the rest of the header. */
-        res -= 8;
-        memmove(c->rbuf, c->rbuf + 8, res);
+    c->udp->request_id = request_id;
+    c->rbytes += res;
+    c->rcurr = c->rbuf;
+    return READ_DATA_RECEIVED;
+}
 
-        c->rbytes += res;
-        c->rcurr = c->rbuf;
-        return READ_DATA_RECEIVED;
+/*
+ * Is there input we already took off the socket (so that libevent won't
+ * tell us about it)?
+ */
+static bool conn_input_pending(const conn *c) {
+    if (IS_UDP(c->transport)) {
+        return c->udp->reader != NULL && udp_reader_pending(c->udp->reader);
     }
-    return READ_NO_DATA_RECEIVED;
+    return conn_tls_userspace(c) && tls_pending(c->tls);
 }
 
 /*
@@ -3982,12 +7214,37 @@ static enum try_read_result try_read_udp(conn *c) {
  *
  * @return enum try_read_result
  */
+/*
+ * The input buffer (at rbuf) is full. There's no point making it bigger
+ * for a binary request whose body won't fit in it anyway: the value of a
+ * store is read straight into the item, and the other bodies get a
+ * buffer of the right size when we read them (bin_read_chunk). The
+ * bigger buffer would only be filled with the value for us to copy it
+ * out again.
+ */
+static bool conn_rbuf_worth_growing(const conn *c) {
+    if (c->protocol != binary_prot ||
+        c->rbytes < sizeof(protocol_binary_request_header)) {
+        return true;
+    }
+    const protocol_binary_request_header *req = (const void *)c->rbuf;
+    return req->request.magic != (uint8_t)PROTOCOL_BINARY_REQ ||
+        ntohl(req->request.bodylen) + sizeof(*req) <= c->rsize;
+}
+
 static enum try_read_result try_read_network(conn *c) {
     enum try_read_result gotdata = READ_NO_DATA_RECEIVED;
     int res;
     int num_allocs = 0;
     assert(c != NULL);
 
+    if (c->rbuf == NULL && !conn_acquire_buffers(c)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "Couldn't get buffers for connection\n");
+        conn_set_state(c, conn_closing);
+        return READ_MEMORY_ERROR;
+    }
+
     if (c->rcurr != c->rbuf) {
         if (c->rbytes != 0) /* otherwise there's nothing to copy */
             memmove(c->rbuf, c->rcurr, c->rbytes);
@@ -3996,12 +7253,11 @@ static enum try_read_result try_read_network(conn *c) {
 
     while (1) {
         if (c->rbytes >= c->rsize) {
-            if (num_allocs == 4) {
+            if (num_allocs == 4 || !conn_rbuf_worth_growing(c)) {
                 return gotdata;
             }
             ++num_allocs;
-            char *new_rbuf = realloc(c->rbuf, c->rsize * 2);
-            if (!new_rbuf) {
+            if (!conn_resize_rbuf(c, c->rsize * 2)) {
                 if (settings.verbose > 0) {
                  settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
                           "Couldn't realloc input buffer\n");
@@ -4011,17 +7267,20 @@ static enum try_read_result try_read_network(conn *c) {
                 c->write_and_go = conn_closing;
                 return READ_MEMORY_ERROR;
             }
-            c->rcurr = c->rbuf = new_rbuf;
-            c->rsize *= 2;
+            c->rcurr = c->rbuf;
         }
 
         int avail = c->rsize - c->rbytes;
-        res = recv(c->sfd, c->rbuf + c->rbytes, avail, 0);
+        res = conn_recv(c, c->rbuf + c->rbytes, avail);
         if (res > 0) {
-            STATS_ADD(c, bytes_read, res);
+            TRAFFIC_ADD(c, bytes_read, res);
             gotdata = READ_DATA_RECEIVED;
             c->rbytes += res;
-            if (res == avail) {
+            if (c->rbytes > c->rbytes_peak) {
+                c->rbytes_peak = c->rbytes;
+            }
+            /* OpenSSL hands out a record at a time */
+            if (res == avail || conn_tls_userspace(c)) {
                 continue;
             } else {
                 break;
@@ -4042,6 +7301,289 @@ static enum try_read_result try_read_network(conn *c) {
     return gotdata;
 }
 
+/*
+ * The io_uring and IOCP backends serve the TCP connections of the worker
+ * threads that managed to set up a ring. While a request is in flight the
+ * connection is kept out of the readiness notifications, and the state
+ * machine is resumed from conn_io_complete() with the result in io_res.
+ */
+static bool conn_use_ring(const conn *c) {
+    return c->thread != NULL && c->thread->ring != NULL &&
+        !IS_UDP(c->transport) && !conn_tls_userspace(c);
+}
+
+static bool conn_ring_recv(conn *c) {
+    if (c->rcurr != c->rbuf) {
+        if (c->rbytes != 0)
+            memmove(c->rbuf, c->rcurr, c->rbytes);
+        c->rcurr = c->rbuf;
+    }
+
+    if (c->rbytes >= c->rsize) {
+        if (!conn_resize_rbuf(c, c->rsize * 2)) {
+            /* let try_read_network() deal with it */
+            return false;
+        }
+        c->rcurr = c->rbuf;
+    }
+
+    if (!update_event(c, 0) ||
+        !io_ring_recv(c->thread->ring, c->sfd, c->rbuf + c->rbytes,
+                      c->rsize - c->rbytes, c)) {
+        return false;
+    }
+    c->io_pending = true;
+    thread_ring_queued(c->thread);
+    return true;
+}
+
+static bool conn_ring_sendmsg(conn *c, struct msghdr *m) {
+    if (!update_event(c, 0) ||
+        !io_ring_sendmsg(c->thread->ring, c->sfd, m, c)) {
+        return false;
+    }
+    c->io_pending = true;
+    thread_ring_queued(c->thread);
+    return true;
+}
+
+/*
+ * Pick up the result of the recv conn_ring_recv() queued
+ */
+static enum try_read_result try_read_ring(conn *c) {
+    int res = c->io_res;
+    c->io_done = false;
+
+    if (res > 0) {
+        TRAFFIC_ADD(c, bytes_read, res);
+        c->rbytes += res;
+        if (c->rbytes > c->rbytes_peak) {
+            c->rbytes_peak = c->rbytes;
+        }
+        return READ_DATA_RECEIVED;
+    }
+    if (res == 0) {
+        return READ_ERROR;
+    }
+    if (res == -EAGAIN || res == -EWOULDBLOCK || res == -EINTR) {
+        return READ_NO_DATA_RECEIVED;
+    }
+    settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                    "%d Closing connection due to read error: %s",
+                                    c->sfd, strerror(-res));
+    return READ_ERROR;
+}
+
+/*
+ * With -Z the values of big enough items are sent with MSG_ZEROCOPY, so
+ * that the kernel transmits them straight from the item memory. The
+ * response header lives in the connection's write buffer which is reused
+ * for the next response, so it is sent (and copied) separately. The kernel
+ * numbers the zero-copy sends on a socket and reports on the error queue of
+ * the socket when it is done with them (waking us up with an error event).
+ * Until then we hold on to the reference to the item.
+ */
+#define ZEROCOPY_MAX_HELD 32
+#define ZEROCOPY_CLOSE_POLL 10000   /* usec between checks when closing */
+#define ZEROCOPY_CLOSE_WAIT 3000    /* give up after 30 seconds */
+
+static void conn_zerocopy_release(conn *c) {
+    int ii = 0;
+    while (ii < c->zc_nitems &&
+           (int32_t)(c->zc_done - c->zc_items[ii].id) >= 0) {
+        settings.engine.v1->release(settings.engine.v0, c,
+                                    c->zc_items[ii].item);
+        ++ii;
+    }
+    if (ii > 0) {
+        c->zc_nitems -= ii;
+        memmove(c->zc_items, c->zc_items + ii,
+                c->zc_nitems * sizeof(c->zc_items[0]));
+    }
+}
+
+/*
+ * Keep c->item until the kernel completed the zero-copy sends made so far
+ */
+static void conn_zerocopy_hold(conn *c) {
+    assert(c->item != NULL);
+    assert(c->zc_nitems < ZEROCOPY_MAX_HELD);
+    if (c->zc_done == c->zc_next) {
+        settings.engine.v1->release(settings.engine.v0, c, c->item);
+    } else {
+        c->zc_items[c->zc_nitems].item = c->item;
+        c->zc_items[c->zc_nitems].id = c->zc_next;
+        ++c->zc_nitems;
+    }
+    c->item = NULL;
+}
+
+#ifdef HAVE_ZEROCOPY
+static bool conn_use_zerocopy(conn *c) {
+    /* kTLS doesn't take MSG_ZEROCOPY */
+    if (c->transport != tcp_transport || c->tls != NULL || conn_use_ring(c)) {
+        return false;
+    }
+
+    if (c->zc_items == NULL) {
+        c->zc_items = malloc(ZEROCOPY_MAX_HELD * sizeof(c->zc_items[0]));
+        if (c->zc_items == NULL) {
+            STATS_NOKEY(c, zerocopy_fallbacks);
+            return false;
+        }
+    }
+
+    if (!c->zc_enabled) {
+        int flags = 1;
+        if (setsockopt(c->sfd, SOL_SOCKET, SO_ZEROCOPY,
+                       (void *)&flags, sizeof(flags)) == -1) {
+            STATS_NOKEY(c, zerocopy_fallbacks);
+            return false;
+        }
+        c->zc_enabled = true;
+    }
+
+    if (c->zc_nitems == ZEROCOPY_MAX_HELD) {
+        /* The client is too far behind reading the responses */
+        STATS_NOKEY(c, zerocopy_fallbacks);
+        return false;
+    }
+
+    return true;
+}
+
+static ssize_t conn_sendmsg(conn *c, struct msghdr *m) {
+    if (c->zc_iov == -1) {
+        return sendmsg(c->sfd, m, 0);
+    }
+
+    ssize_t res;
+    struct iovec *zc = c->iov + c->zc_iov;
+    if (m->msg_iov < zc) {
+        /* Send the header up to the value the normal way */
+        size_t iovlen = m->msg_iovlen;
+        int flags = 0;
+        if (m->msg_iov + iovlen > zc) {
+            m->msg_iovlen = zc - m->msg_iov;
+            flags = MSG_MORE;
+        }
+        res = sendmsg(c->sfd, m, flags);
+        m->msg_iovlen = iovlen;
+        return res;
+    }
+
+    res = sendmsg(c->sfd, m, MSG_ZEROCOPY);
+    if (res > 0) {
+        ++c->zc_next;
+        STATS_ADD(c, zerocopy_bytes, res);
+    } else if (res == -1 && errno == ENOBUFS) {
+        /* We're out of socket option memory for the notifications */
+        STATS_NOKEY(c, zerocopy_fallbacks);
+        res = sendmsg(c->sfd, m, 0);
+    }
+    return res;
+}
+
+/*
+ * Pick up the completion notifications from the error queue of the socket
+ * and release the items the kernel is done with. The (TCP) notifications
+ * arrive in the order of the sends.
+ */
+static void conn_zerocopy_reap(conn *c) {
+    union {
+        char buf[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                            sizeof(struct sockaddr_in6))];
+        struct cmsghdr align;
+    } control;
+
+    while (true) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        if (recvmsg(c->sfd, &msg, MSG_ERRQUEUE) == -1) {
+            break;
+        }
+
+        struct cmsghdr *cm;
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err *serr = (void *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            /* sends ee_info up to ee_data are done */
+            uint32_t count = serr->ee_data - serr->ee_info + 1;
+            c->zc_done += count;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                STATS_ADD(c, zerocopy_fallbacks, count);
+            }
+        }
+    }
+
+    conn_zerocopy_release(c);
+}
+
+/*
+ * Returns true once the connection may be closed, that is when the kernel
+ * no longer sends from any of the items we hold. Otherwise the connection
+ * checks back in a little while.
+ */
+static bool conn_zerocopy_drained(conn *c) {
+    if (c->item != NULL && c->zc_iov != -1) {
+        conn_zerocopy_hold(c);
+    }
+    c->zc_iov = -1;
+
+    if (c->zc_next != c->zc_done) {
+        conn_zerocopy_reap(c);
+    }
+    if (c->zc_nitems == 0) {
+        return true;
+    }
+
+    if (++c->zc_close_wait > ZEROCOPY_CLOSE_WAIT) {
+        /* Reset the connection so that the kernel drops what it's got */
+        struct linger ling = {1, 0};
+        setsockopt(c->sfd, SOL_SOCKET, SO_LINGER,
+                   (void *)&ling, sizeof(ling));
+        return true;
+    }
+
+    if (c->ev_flags != EV_PERSIST) {
+        struct timeval tv = { .tv_sec = 0, .tv_usec = ZEROCOPY_CLOSE_POLL };
+        if (c->registered_in_libevent && !unregister_event(c)) {
+            return true;
+        }
+        conn_set_event(c, c->thread->base, EV_PERSIST);
+        if (!register_event(c, &tv)) {
+            return true;
+        }
+    }
+    return false;
+}
+#else
+static bool conn_use_zerocopy(conn *c) {
+    return false;
+}
+
+static ssize_t conn_sendmsg(conn *c, struct msghdr *m) {
+    return sendmsg(c->sfd, m, 0);
+}
+
+static void conn_zerocopy_reap(conn *c) {
+    conn_zerocopy_release(c);
+}
+
+static bool conn_zerocopy_drained(conn *c) {
+    return true;
+}
+#endif
+
 bool register_event(conn *c, struct timeval *timeout) {
     assert(!c->registered_in_libevent);
     assert(c->sfd != INVALID_SOCKET);
@@ -4077,7 +7619,7 @@ bool update_event(conn *c, const int new_flags) {
     assert(c != NULL);
 
     struct event_base *base = c->event.ev_base;
-    if (c->ev_flags == new_flags)
+    if (c->ev_flags == new_flags && c->ev_priority == conn_priority(c))
         return true;
 
     settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
@@ -4089,9 +7631,7 @@ bool update_event(conn *c, const int new_flags) {
         return false;
     }
 
-    event_set(&c->event, c->sfd, new_flags, event_handler, (void *)c);
-    event_base_set(base, &c->event);
-    c->ev_flags = new_flags;
+    conn_set_event(c, base, new_flags);
 
     return register_event(c, NULL);
 }
@@ -4105,6 +7645,75 @@ bool update_event(conn *c, const int new_flags) {
  *   TRANSMIT_SOFT_ERROR Can't write any more right now.
  *   TRANSMIT_HARD_ERROR Can't write (c->state is set to conn_closing)
  */
+/*
+ * Send as many of the frames of a UDP response as we can in one go (a
+ * datagram goes out whole or not at all)
+ */
+static enum transmit_result transmit_udp(conn *c) {
+    size_t nbytes;
+    int res = udp_send(c->sfd, c->msglist + c->msgcurr,
+                       c->msgused - c->msgcurr, &nbytes);
+    if (res > 0) {
+        TRAFFIC_ADD(c, bytes_written, nbytes);
+        for (int ii = 0; ii < res; ++ii) {
+            c->msglist[c->msgcurr++].msg_iovlen = 0;
+        }
+        return TRANSMIT_INCOMPLETE;
+    }
+
+    if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+            conn_set_state(c, conn_closing);
+            return TRANSMIT_HARD_ERROR;
+        }
+        return TRANSMIT_SOFT_ERROR;
+    }
+
+    if (settings.verbose > 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "Failed to send UDP response: %s\n",
+                                        strerror(errno));
+    }
+    /* Drop the response and go on with the next request */
+    conn_set_state(c, conn_read);
+    return TRANSMIT_HARD_ERROR;
+}
+
+/*
+ * With TCP_NODELAY every response we write goes out in a segment of its
+ * own, which is what we want for a client waiting for it but not for one
+ * that has more requests in the input buffer. For those we cork the socket
+ * until the connection goes back to the event loop (see conn_run()), so
+ * that the kernel sends full segments, and uncorking pushes out the rest.
+ */
+static void conn_cork(conn *c) {
+#ifdef TCP_CORK
+    if (!settings.tcp_cork || c->corked || c->transport != tcp_transport ||
+        c->rbytes == 0 || c->nevents <= 0 || conn_use_ring(c)) {
+        return;
+    }
+    int flags = 1;
+    if (setsockopt(c->sfd, IPPROTO_TCP, TCP_CORK,
+                   (void *)&flags, sizeof(flags)) == 0) {
+        c->corked = true;
+        STATS_NOKEY(c, tcp_corked);
+    }
+#endif
+}
+
+static void conn_uncork(conn *c) {
+#ifdef TCP_CORK
+    if (c->corked) {
+        int flags = 0;
+        c->corked = false;
+        if (c->sfd != INVALID_SOCKET) {
+            setsockopt(c->sfd, IPPROTO_TCP, TCP_CORK,
+                       (void *)&flags, sizeof(flags));
+        }
+    }
+#endif
+}
+
 static enum transmit_result transmit(conn *c) {
     assert(c != NULL);
 
@@ -4118,9 +7727,33 @@ static enum transmit_result transmit(conn *c) {
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
 
-        res = sendmsg(c->sfd, m, 0);
+        if (c->io_pending) {
+            return TRANSMIT_SOFT_ERROR;
+        }
+
+        if (c->io_done) {
+            c->io_done = false;
+            res = c->io_res;
+            if (res < 0) {
+                errno = -res;
+                res = -1;
+            }
+        } else if (conn_use_ring(c) && conn_ring_sendmsg(c, m)) {
+            return TRANSMIT_SOFT_ERROR;
+        } else if (IS_UDP(c->transport)) {
+            return transmit_udp(c);
+        } else {
+            conn_cork(c);
+            if (conn_tls_userspace(c)) {
+                res = tls_sendmsg(c->tls, m);
+            } else {
+                res = conn_sendmsg(c, m);
+            }
+            STATS_NOKEY(c, sendmsgs);
+        }
+
         if (res > 0) {
-            STATS_ADD(c, bytes_written, res);
+            TRAFFIC_ADD(c, bytes_written, res);
 
             /* We've written some of the data. Remove the completed
                iovec entries from the list of pending writes. */
@@ -4190,7 +7823,7 @@ bool conn_listening(conn *c)
         if (errno == EMFILE) {
             settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                             "Too many open connections\n");
-            disable_listen();
+            disable_listen(c);
         } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
             settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                             "Failed to accept new client: %s\n",
@@ -4228,12 +7861,44 @@ bool conn_listening(conn *c)
         return false;
     }
 
-    dispatch_conn_new(sfd, c->parent_port, conn_new_cmd, EV_READ | EV_PERSIST,
-                      DATA_BUFFER_SIZE, tcp_transport);
+    STATE_FUNC init_state = tls_is_listener(c->sfd) ?
+        conn_tls_handshake : conn_new_cmd;
+    if (c->thread != NULL && !thread_parked(c->thread)) {
+        /* Accepted on the worker's own (reuseport) socket, so keep it here */
+        conn *nc = conn_new(sfd, c->parent_port, init_state,
+                            EV_READ | EV_PERSIST, DATA_BUFFER_SIZE,
+                            tcp_transport, c->thread->base, NULL);
+        if (nc == NULL) {
+            STATS_LOCK();
+            --port_instance->curr_conns;
+            STATS_UNLOCK();
+            safe_close(sfd);
+        } else {
+            nc->thread = c->thread;
+            thread_conn_opened(c->thread);
+            conn_went_idle(nc);
+        }
+    } else {
+        dispatch_conn_new(sfd, c->parent_port, init_state,
+                          EV_READ | EV_PERSIST, DATA_BUFFER_SIZE,
+                          tcp_transport);
+    }
 
     return false;
 }
 
+/*
+ * Has a bulk connection run for longer than it may in one event? (-g)
+ */
+static bool conn_over_budget(conn *c) {
+    if (!c->bulk || settings.bulk_budget == 0 || c->thread == NULL ||
+        timings_now() - c->run_start < settings.bulk_budget * (uint64_t)1000) {
+        return false;
+    }
+    STATS_NOKEY(c, bulk_yields);
+    return true;
+}
+
 /**
  * Ship tap log to the other end. This state differs with all other states
  * in the way that it support full duplex dialog. We're listening to both read
@@ -4277,6 +7942,9 @@ bool conn_ship_log(conn *c) {
         c->nevents = settings.reqs_per_tap_event;
     } else if (c->which & EV_WRITE) {
         --c->nevents;
+        if (c->nevents >= 0 && conn_over_budget(c)) {
+            c->nevents = -1;
+        }
         if (c->nevents >= 0) {
             c->ewouldblock = false;
             ship_tap_log(c);
@@ -4300,6 +7968,40 @@ bool conn_ship_log(conn *c) {
 }
 
 bool conn_waiting(conn *c) {
+    if (c->stats_sub != NULL && c->stats_sub->due) {
+        stats_sub_push(c);
+        return true;
+    }
+
+    if (conn_input_pending(c)) {
+        /* The rest of the last batch is already off the socket */
+        conn_set_state(c, conn_read);
+        return true;
+    }
+
+    /*
+     * The subscription timer lives in the event base of this thread. A
+     * parked thread hands all of its connections over.
+     */
+    if ((settings.conn_migrate || thread_parked(c->thread)) &&
+        !IS_UDP(c->transport) &&
+        c->tap_iterator == NULL && c->stats_sub == NULL && !c->ewouldblock &&
+        dispatch_conn_migrate(c)) {
+        return false;
+    }
+
+    if (conn_use_ring(c)) {
+        /* It may have come here from a thread without a ring */
+        if ((c->rbuf != NULL || conn_acquire_buffers(c)) &&
+            conn_ring_recv(c)) {
+            conn_set_state(c, conn_read);
+            conn_went_idle(c);
+            return false;
+        }
+    } else {
+        conn_idle_buffers(c);
+    }
+
     if (!update_event(c, EV_READ | EV_PERSIST)) {
         if (settings.verbose > 0) {
             settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
@@ -4309,11 +8011,23 @@ bool conn_waiting(conn *c) {
         return true;
     }
     conn_set_state(c, conn_read);
+    conn_went_idle(c);
     return false;
 }
 
 bool conn_read(conn *c) {
-    int res = IS_UDP(c->transport) ? try_read_udp(c) : try_read_network(c);
+    int res;
+    if (c->io_pending) {
+        /* wait for the ring to complete the recv */
+        return false;
+    } else if (c->io_done) {
+        res = try_read_ring(c);
+    } else if (IS_UDP(c->transport)) {
+        res = try_read_udp(c);
+    } else {
+        res = try_read_network(c);
+    }
+
     switch (res) {
     case READ_NO_DATA_RECEIVED:
         conn_set_state(c, conn_waiting);
@@ -4341,14 +8055,214 @@ bool conn_parse_cmd(conn *c) {
     return !c->ewouldblock;
 }
 
+/*
+ * A client with a deep pipeline has the next requests sitting in the input
+ * buffer by the time we're done with the current one. Instead of sending
+ * every response with its own sendmsg, conn_mwrite holds a response back
+ * (leaving its iovecs in the msghdrs) when the next request is complete in
+ * the input buffer, and goes on with that one. The responses share the
+ * write buffer: wbuf is moved past the part used by the responses held
+ * back (wcoalesced remembers by how much), and the items they refer to are
+ * parked in ilist until everything is sent.
+ *
+ * We send what we've got as soon as the next request isn't there yet (or
+ * isn't one of the simple commands below), when we'd run out of iovecs,
+ * write buffer or COALESCE_MAX_BYTES, and before the connection yields
+ * because it has used up reqs_per_event.
+ */
+static bool conn_coalesce_command(uint8_t opcode) {
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+    case PROTOCOL_BINARY_CMD_NOOP:
+    case PROTOCOL_BINARY_CMD_VERSION:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Can we go on with the next request before we send the responses we
+ * have (with another nbytes in them)?
+ */
+static bool conn_coalesce_more(conn *c, uint32_t nbytes) {
+    if (c->protocol != binary_prot || IS_UDP(c->transport) ||
+        c->nevents <= 0 || c->zc_iov != -1 ||
+        c->iovused + COALESCE_IOV_RESERVE > IOV_MAX ||
+        c->coalesced_bytes + nbytes >= COALESCE_MAX_BYTES ||
+        c->rbytes < sizeof(protocol_binary_request_header)) {
+        return false;
+    }
+
+    protocol_binary_request_header req;
+    memcpy(&req, c->rcurr, sizeof(req));
+    return req.request.magic == PROTOCOL_BINARY_REQ &&
+        conn_coalesce_command(req.request.opcode) &&
+        c->rbytes - sizeof(req) >= ntohl(req.request.bodylen);
+}
+
+/*
+ * Hold back the response we just built if we can send it together with
+ * the response to the next request.
+ */
+static bool conn_coalesce_response(conn *c) {
+    if (c->protocol != binary_prot || c->flushing ||
+        c->write_and_go != conn_new_cmd ||
+        c->write_and_free != NULL ||
+        !conn_coalesce_command(c->binary_header.request.opcode)) {
+        return false;
+    }
+
+    /* Find out how much of the write buffer the response uses */
+    uint32_t used = 0;
+    uint32_t nbytes = 0;
+    for (int ii = c->resp_iov; ii < c->iovused; ++ii) {
+        const char *base = c->iov[ii].iov_base;
+        if (base >= c->wbuf && base < c->wbuf + c->wsize) {
+            uint32_t end = (uint32_t)(base - c->wbuf) + c->iov[ii].iov_len;
+            if (end > used) {
+                used = end;
+            }
+        }
+        nbytes += c->iov[ii].iov_len;
+    }
+    used = (used + 7) & ~7;
+
+    if (used + COALESCE_WBUF_RESERVE > c->wsize ||
+        !conn_coalesce_more(c, nbytes)) {
+        return false;
+    }
+
+    if (c->item != NULL) {
+        if (c->ileft == 0) {
+            c->icurr = c->ilist;
+        }
+        if (c->icurr - c->ilist + c->ileft == c->isize) {
+            item **ilist = CONN_LIST_RESIZE(c, ilist, c->isize, c->isize * 2);
+            if (ilist == NULL) {
+                return false;
+            }
+            c->icurr = ilist + (c->icurr - c->ilist);
+            c->ilist = ilist;
+            c->isize *= 2;
+        }
+        c->icurr[c->ileft++] = c->item;
+        c->item = NULL;
+    }
+
+    c->wbuf += used;
+    c->wsize -= used;
+    c->wcoalesced += used;
+    c->coalesced_bytes += nbytes;
+    c->ncoalesced++;
+    STATS_NOKEY(c, coalesced_responses);
+    return true;
+}
+
+/* Give the responses we've sent back the write buffer */
+static void conn_coalesce_reset(conn *c) {
+    c->wbuf -= c->wcoalesced;
+    c->wsize += c->wcoalesced;
+    c->wcoalesced = 0;
+    c->coalesced_bytes = 0;
+    c->ncoalesced = 0;
+    c->flushing = false;
+}
+
+/*
+ * Put the request the connection just finished in the slow request log
+ */
+static void slowlog_record(conn *c, uint64_t elapsed) {
+    struct slowlog_entry entry = {
+        .time = process_started + current_time,
+        .conn = (uint32_t)c->sfd,
+        .opcode = c->timing_opcode,
+        .sampled = c->timing_sampled,
+        .nblocked = c->timing_nblocked,
+        .nkey = c->timing_nkey,
+        .value_size = c->timing_value,
+        .total_ns = elapsed,
+        .blocked_ns = c->timing_blocked,
+        .read_ns = c->timing_read
+    };
+
+    memcpy(entry.key, c->timing_key,
+           c->timing_nkey < SLOWLOG_KEY ? c->timing_nkey : SLOWLOG_KEY);
+    double cycles_per_usec = timings_cycles_per_usec();
+    if (cycles_per_usec > 0) {
+        entry.engine_ns = (uint64_t)(c->timing_engine * 1000 / cycles_per_usec);
+    }
+    if (c->sasl_conn != NULL) {
+        const void *user = NULL;
+        sasl_getprop(c->sasl_conn, SASL_USERNAME, &user);
+        if (user != NULL) {
+            strncpy(entry.bucket, user, sizeof(entry.bucket) - 1);
+        }
+    }
+    slowlog_add(&entry);
+}
+
+/*
+ * The request is done (or its response is queued). The time it spent
+ * waiting for the engine to complete an EWOULDBLOCK is kept apart.
+ */
+static void conn_timing_done(conn *c) {
+    uint64_t elapsed = timings_now() - c->timing_start;
+    uint64_t blocked = c->timing_blocked;
+    timings_record(&c->thread->timings, c->timing_opcode,
+                   elapsed > blocked ? elapsed - blocked : 0, blocked);
+    c->timing_start = 0;
+
+    if (c->timing_traced &&
+        (c->timing_sampled || (settings.slowlog_usec != 0 &&
+                               elapsed >= settings.slowlog_usec * 1000ULL))) {
+        slowlog_record(c, elapsed);
+    }
+}
+
 bool conn_new_cmd(conn *c) {
+    if (c->timing_start != 0) {
+        conn_timing_done(c);
+    }
+    conn_push_traffic(c);
+
+    if (c->ncoalesced > 0 && !conn_coalesce_more(c, 0)) {
+        /* Send the responses we've held back before we go on */
+        c->flushing = true;
+        c->write_and_go = conn_new_cmd;
+        conn_set_state(c, conn_mwrite);
+        return true;
+    }
+
     /* Only process nreqs at a time to avoid starving other connections */
     --c->nevents;
+    if (c->nevents >= 0 && conn_over_budget(c)) {
+        c->nevents = -1;
+    }
     if (c->nevents >= 0) {
         reset_cmd_handler(c);
     } else {
         STATS_NOKEY(c, conn_yields);
-        if (c->rbytes > 0) {
+        if (c->rbytes > 0 || conn_input_pending(c)) {
             /* We have already read in data into the input buffer,
                so libevent will most likely not signal read events
                on the socket (unless more data is available. As a
@@ -4389,9 +8303,9 @@ bool conn_swallow(conn *c) {
     }
 
     /*  now try reading from the socket */
-    res = recv(c->sfd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize, 0);
+    res = conn_recv(c, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
     if (res > 0) {
-        STATS_ADD(c, bytes_read, res);
+        TRAFFIC_ADD(c, bytes_read, res);
         c->sbytes -= res;
         return true;
     }
@@ -4424,11 +8338,46 @@ bool conn_swallow(conn *c) {
 
 }
 
+/*
+ * Move on to the next piece of the value we're reading (see
+ * conn_set_ritem()) when we're done with the current one. Returns false
+ * if there is nothing more to read.
+ */
+/* Is the value read into the input buffer (like the bodies of packets)? */
+static bool conn_ritem_in_rbuf(const conn *c) {
+    return c->rbuf != NULL && c->ritem >= c->rbuf &&
+        c->ritem < c->rbuf + c->rsize;
+}
+
+static bool conn_nread_next(conn *c) {
+    while (c->rlbytes == 0 && c->riovcurr < c->riovused) {
+        c->ritem = c->riov[c->riovcurr].iov_base;
+        c->rlbytes = c->riov[c->riovcurr].iov_len;
+        c->riovcurr++;
+    }
+    return c->rlbytes != 0;
+}
+
+/* Account for res bytes read into the pieces of the value */
+static void conn_nread_advance(conn *c, size_t res) {
+    while (res > 0) {
+        uint32_t len = res < c->rlbytes ? (uint32_t)res : c->rlbytes;
+        c->ritem += len;
+        c->rlbytes -= len;
+        res -= len;
+        if (!conn_nread_next(c)) {
+            assert(res == 0);
+            break;
+        }
+    }
+}
+
 bool conn_nread(conn *c) {
     ssize_t res;
 
-    if (c->rlbytes == 0) {
+    if (!conn_nread_next(c)) {
         bool block = c->ewouldblock = false;
+        c->riovused = c->riovcurr = 0;
         complete_nread(c);
         if (c->ewouldblock) {
             unregister_event(c);
@@ -4437,7 +8386,7 @@ bool conn_nread(conn *c) {
         return !block;
     }
     /* first check if we have leftovers in the conn_read buffer */
-    if (c->rbytes > 0) {
+    while (c->rbytes > 0) {
         uint32_t tocopy = c->rbytes > c->rlbytes ? c->rlbytes : c->rbytes;
         if (c->ritem != c->rcurr) {
             memmove(c->ritem, c->rcurr, tocopy);
@@ -4446,21 +8395,73 @@ bool conn_nread(conn *c) {
         c->rlbytes -= tocopy;
         c->rcurr += tocopy;
         c->rbytes -= tocopy;
-        if (c->rlbytes == 0) {
+        if (!conn_nread_next(c)) {
             return true;
         }
     }
 
     /*  now try reading from the socket */
-    res = recv(c->sfd, c->ritem, c->rlbytes, 0);
-    if (res > 0) {
-        STATS_ADD(c, bytes_read, res);
-        if (c->rcurr == c->ritem) {
-            c->rcurr += res;
+    if (!conn_tls_userspace(c) &&
+        (c->riovcurr < c->riovused || !conn_ritem_in_rbuf(c))) {
+        /*
+         * Read into as many of the pieces as we can at once. If that's
+         * the rest of the value we read on into the input buffer, where
+         * the next request is likely to be: that saves a read per request
+         * for a client sending a stream of big values.
+         */
+        struct iovec iov[64];
+        const int maxiov = (int)(sizeof(iov) / sizeof(iov[0])) - 1;
+        int niov = 1;
+        size_t value = c->rlbytes;
+        iov[0].iov_base = c->ritem;
+        iov[0].iov_len = c->rlbytes;
+        int ii;
+        for (ii = c->riovcurr; ii < c->riovused && niov < maxiov; ++ii) {
+            value += c->riov[ii].iov_len;
+            iov[niov++] = c->riov[ii];
+        }
+        if (ii == c->riovused && c->rbuf != NULL && c->rbytes == 0) {
+            if (c->rcurr + sizeof(protocol_binary_request_header) >
+                c->rbuf + c->rsize) {
+                /* Only the slow request log still wants the request */
+                if (c->timing_traced && c->timing_start != 0) {
+                    slowlog_trace_key(c);
+                }
+                c->rcurr = c->rbuf;
+            }
+            iov[niov].iov_base = c->rcurr;
+            iov[niov].iov_len = c->rbuf + c->rsize - c->rcurr;
+            ++niov;
+        }
+        res = readv(c->sfd, iov, niov);
+        if (res > 0) {
+            TRAFFIC_ADD(c, bytes_read, res);
+            if ((size_t)res > value) {
+                c->rbytes = res - value;
+                if (c->rcurr + c->rbytes - c->rbuf > c->rbytes_peak) {
+                    c->rbytes_peak = c->rcurr + c->rbytes - c->rbuf;
+                }
+                STATS_NOKEY(c, nread_readahead);
+                res = value;
+            }
+            conn_nread_advance(c, res);
+            return true;
+        }
+    } else {
+        res = conn_recv(c, c->ritem, c->rlbytes);
+        if (res > 0) {
+            TRAFFIC_ADD(c, bytes_read, res);
+            if (c->riovcurr < c->riovused) {
+                conn_nread_advance(c, res);
+                return true;
+            }
+            if (c->rcurr == c->ritem) {
+                c->rcurr += res;
+            }
+            c->ritem += res;
+            c->rlbytes -= res;
+            return true;
         }
-        c->ritem += res;
-        c->rlbytes -= res;
-        return true;
     }
     if (res == 0) { /* end of stream */
         conn_set_state(c, conn_closing);
@@ -4514,6 +8515,12 @@ bool conn_write(conn *c) {
 }
 
 bool conn_mwrite(conn *c) {
+    if (conn_coalesce_response(c)) {
+        conn_set_state(c, conn_new_cmd);
+        return true;
+    }
+    c->flushing = true;
+
     if (IS_UDP(c->transport) && c->msgcurr == 0 && build_udp_headers(c) != 0) {
         if (settings.verbose > 0) {
             settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
@@ -4525,19 +8532,9 @@ bool conn_mwrite(conn *c) {
 
     switch (transmit(c)) {
     case TRANSMIT_COMPLETE:
+        conn_coalesce_reset(c);
         if (c->state == conn_mwrite) {
-            while (c->ileft > 0) {
-                item *it = *(c->icurr);
-                settings.engine.v1->release(settings.engine.v0, c, it);
-                c->icurr++;
-                c->ileft--;
-            }
-            while (c->suffixleft > 0) {
-                char *suffix = *(c->suffixcurr);
-                cache_free(c->thread->suffix_cache, suffix);
-                c->suffixcurr++;
-                c->suffixleft--;
-            }
+            conn_release_items(c);
             /* XXX:  I don't know why this wasn't the general case */
             if(c->protocol == binary_prot) {
                 conn_set_state(c, c->write_and_go);
@@ -4614,6 +8611,16 @@ bool conn_closing(conn *c) {
         return false;
     }
 
+    if (c->io_pending) {
+        /* Make the request in flight fail so that we may close the socket */
+        shutdown(c->sfd, SHUT_RDWR);
+        return false;
+    }
+
+    if (!conn_zerocopy_drained(c)) {
+        return false;
+    }
+
     // We don't want any network notifications anymore..
     unregister_event(c);
     safe_close(c->sfd);
@@ -4653,15 +8660,138 @@ bool conn_refresh_isasl(conn *c) {
     return true;
 }
 
-void event_handler(const int fd, const short which, void *arg) {
-    conn *c = arg;
-    assert(c != NULL);
+/*
+ * The first state of the clients of the TLS port. Once the handshake is
+ * done the connection goes on like any other one, on kTLS if the kernel
+ * took over.
+ */
+bool conn_tls_handshake(conn *c) {
+    if (c->tls == NULL && (c->tls = tls_session_create(c->sfd)) == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                        "Failed to create the TLS session\n");
+        conn_set_state(c, conn_closing);
+        return true;
+    }
 
-    if (memcached_shutdown) {
-        event_base_loopbreak(c->event.ev_base);
-        return ;
+    int flags;
+    switch (tls_handshake(c->tls)) {
+    case TLS_HANDSHAKE_DONE:
+        STATS_NOKEY(c, tls_handshakes);
+        if (tls_offloaded(c->tls)) {
+            STATS_NOKEY(c, tls_offloaded);
+        }
+        conn_set_state(c, conn_new_cmd);
+        return true;
+    case TLS_HANDSHAKE_WANT_READ:
+        flags = EV_READ | EV_PERSIST;
+        break;
+    case TLS_HANDSHAKE_WANT_WRITE:
+        flags = EV_WRITE | EV_PERSIST;
+        break;
+    default:
+        STATS_NOKEY(c, tls_handshake_errors);
+        if (settings.verbose > 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                                            "%d: TLS handshake failed\n",
+                                            c->sfd);
+        }
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+
+    if (!update_event(c, flags)) {
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Remove an idle connection from its thread's event base so that it can
+ * be handed to another thread (see dispatch_conn_migrate())
+ */
+bool conn_detach_thread(conn *c) {
+    assert(c->thread != NULL);
+    assert(!list_contains(c->thread->pending_io, c));
+
+    if (c->ntimers > 0) {
+        /* They're in the wheel of this thread */
+        return false;
+    }
+
+    if (c->registered_in_libevent && !unregister_event(c)) {
+        return false;
+    }
+
+    if (c->idle_list != NULL) {
+        conn_idle_unlink(c);
+    }
+    c->thread = NULL;
+    conn_set_state(c, conn_read);
+    return true;
+}
+
+/*
+ * Close and hibernate the idle connections of the thread that are due
+ * (see conn_idle_link())
+ */
+void conn_idle_reap(LIBEVENT_THREAD *me) {
+    rel_time_t now = current_time;
+    conn *c;
+
+    LOCK_THREAD(me);
+    if (settings.idle_timeout != 0) {
+        struct conn_idle_list *lists[] = { &me->hibernating, &me->idle };
+        for (int ii = 0; ii < 2; ++ii) {
+            while ((c = lists[ii]->head) != NULL &&
+                   now - c->idle_since >= settings.idle_timeout) {
+                if (settings.verbose > 0) {
+                    settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                            "%d: closing idle connection\n", c->sfd);
+                }
+                ++me->idle_kicks;
+                conn_set_state(c, conn_closing);
+                while (c->state(c)) {
+                    /* run it till it's gone or waits */
+                }
+            }
+        }
+    }
+
+    if (settings.hibernate_timeout != 0) {
+        while ((c = me->idle.head) != NULL &&
+               now - c->idle_since >= settings.hibernate_timeout) {
+            conn_hibernate(c);
+            conn_idle_unlink(c);
+            conn_idle_link(c, &me->hibernating);
+            ++me->hibernations;
+        }
+    }
+    UNLOCK_THREAD(me);
+}
+
+/* Called by the thread an idle connection was handed to */
+void conn_attach_thread(conn *c, LIBEVENT_THREAD *thread) {
+    assert(c->thread == NULL);
+    c->thread = thread;
+    conn_set_event(c, thread->base, EV_READ | EV_PERSIST);
+    if (register_event(c, NULL)) {
+        conn_went_idle(c);
+    } else {
+        /* Close it from this thread the next time it runs */
+        conn_set_state(c, conn_closing);
+        LOCK_THREAD(thread);
+        if (add_conn_to_pending_io_list(c)) {
+            notify_thread(thread);
+        }
+        UNLOCK_THREAD(thread);
     }
+}
 
+/*
+ * Run the state machine of a connection until it blocks
+ */
+static void conn_run(conn *c, const short which) {
     LIBEVENT_THREAD *thr = c->thread;
     if (!is_listen_thread()) {
         assert(thr);
@@ -4675,9 +8805,10 @@ void event_handler(const int fd, const short which, void *arg) {
     }
 
     c->which = which;
-
-    /* sanity */
-    assert(fd == c->sfd);
+    if (c->zc_next != c->zc_done) {
+        /* The completions woke us up (as an error on the socket) */
+        conn_zerocopy_reap(c);
+    }
     perform_callbacks(ON_SWITCH_CONN, c, c);
 
 
@@ -4686,22 +8817,74 @@ void event_handler(const int fd, const short which, void *arg) {
         c->nevents = settings.reqs_per_tap_event;
     }
 
-    do {
-        if (settings.verbose) {
-            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
-                                            "%d - Running task: (%s)\n",
-                                            c->sfd, state_text(c->state));
-        }
-    } while (c->state(c));
+    uint64_t start = 0;
+    if (thr) {
+        c->run_start = start = timings_now();
+        if (c->timing_block_start != 0) {
+            MEMCACHED_CONN_RESUME(c->sfd, c->cmd,
+                                  (int64_t)(start - c->timing_block_start));
+            c->timing_blocked += start - c->timing_block_start;
+            c->timing_block_start = 0;
+        }
+    }
+
+    enum heap_owner owner = heap_profile_set_owner(HEAP_CONNECTION);
+    bool counted = thr != NULL && settings.state_cycles;
+    bool more;
+    do {
+        if (settings.verbose) {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                            "%d - Running task: (%s)\n",
+                                            c->sfd, state_text(c->state));
+        }
+        heap_profile_set_owner(c->state == conn_ship_log ?
+                               HEAP_TAP : HEAP_CONNECTION);
+        more = counted ? conn_run_state_counted(c, thr) : c->state(c);
+    } while (more);
+    conn_uncork(c);
+    heap_profile_set_owner(owner);
+
+    if (thr) {
+        uint64_t end = timings_now();
+        thr->busy_usec += (end - start) / 1000;
+        if (c->ewouldblock && c->timing_start != 0) {
+            MEMCACHED_CONN_BLOCK(c->sfd, c->cmd);
+            c->timing_nblocked++;
+            c->timing_block_start = end;
+        }
+        UNLOCK_THREAD(thr);
+    }
+}
+
+void event_handler(const int fd, const short which, void *arg) {
+    conn *c = arg;
+    assert(c != NULL);
+
+    if (memcached_shutdown) {
+        event_base_loopbreak(c->event.ev_base);
+        return ;
+    }
+
+    /* sanity */
+    assert(fd == c->sfd);
+    conn_run(c, which);
+}
 
-    if (thr) {
-        UNLOCK_THREAD(thr);
-    }
+/*
+ * Called by the worker thread for every request completed by its
+ * io_uring (see thread_ring_process())
+ */
+void conn_io_complete(void *arg, int res) {
+    conn *c = arg;
+    assert(c->io_pending);
+    c->io_pending = false;
+    c->io_done = true;
+    c->io_res = res;
+    conn_run(c, 0);
 }
 
 static void dispatch_event_handler(int fd, short which, void *arg) {
-    char buffer[80];
-    ssize_t nr = recv(fd, buffer, sizeof(buffer), 0);
+    ssize_t nr = drain_notification_pipe(arg);
 
     if (nr != -1 && is_listen_disabled()) {
         bool enable = false;
@@ -4713,14 +8896,10 @@ static void dispatch_event_handler(int fd, short which, void *arg) {
         }
         pthread_mutex_unlock(&listen_state.mutex);
         if (enable) {
-            conn *next;
-            for (next = listen_conn; next; next = next->next) {
-                update_event(next, EV_READ | EV_PERSIST);
-                if (listen(next->sfd, settings.backlog) != 0) {
-                    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                    "listen() failed",
-                                                    strerror(errno));
-                }
+            set_listen_events(listen_conn, true);
+            if (settings.reuseport) {
+                /* The workers re-enable their own listening sockets */
+                notify_worker_threads();
             }
         }
     }
@@ -4796,12 +8975,175 @@ static void maximize_sndbuf(const int sfd) {
  *        when they are successfully added to the list of ports we
  *        listen on.
  */
+static void set_tcp_socket_options(SOCKET sfd) {
+    struct linger ling = {0, 0};
+    int flags = 1;
+    int error;
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+    if (error != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "setsockopt(SO_KEEPALIVE): %s",
+                                        strerror(errno));
+    }
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+    if (error != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "setsockopt(SO_LINGER): %s",
+                                        strerror(errno));
+    }
+
+    if (settings.tcp_nodelay) {
+        error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(TCP_NODELAY): %s",
+                                            strerror(errno));
+        }
+    }
+
+#ifdef SO_REUSEPORT
+    if (settings.reuseport) {
+        error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(SO_REUSEPORT): %s",
+                                            strerror(errno));
+        }
+    }
+#endif
+}
+
+/*
+ * With reuseport every worker thread gets its own listening socket bound
+ * to the same address as sfd, so that the kernel spreads the incoming
+ * connections over the workers instead of having the dispatcher accept
+ * all of them. sfd itself is handed to the first worker.
+ */
+static bool server_socket_reuseport(SOCKET sfd, const struct addrinfo *ai,
+                                    int port) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int flags = 1;
+
+    /* Bind to the port we got from the kernel if we asked for any port */
+    if (getsockname(sfd, (struct sockaddr*)&addr, &addrlen) != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "getsockname(): %s", strerror(errno));
+        return false;
+    }
+
+    for (int ii = 0; ii < settings.num_threads; ++ii) {
+        SOCKET s = sfd;
+        if (ii > 0) {
+            if ((s = new_socket((struct addrinfo*)ai)) == INVALID_SOCKET) {
+                return false;
+            }
+#ifdef IPV6_V6ONLY
+            if (ai->ai_family == AF_INET6) {
+                setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+            }
+#endif
+            setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+            set_tcp_socket_options(s);
+            if (bind(s, (struct sockaddr*)&addr, addrlen) == SOCKET_ERROR ||
+                listen(s, settings.backlog) == SOCKET_ERROR) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                                "Failed to add reuseport listener: %s",
+                                                strerror(errno));
+                safe_close(s);
+                return false;
+            }
+            if (tls_is_listener(sfd)) {
+                tls_add_listener(s);
+            }
+        }
+
+#ifdef SO_INCOMING_CPU
+        int cpu = affinity_worker_cpu(ii);
+        if (cpu != -1 &&
+            setsockopt(s, SOL_SOCKET, SO_INCOMING_CPU,
+                       (void *)&cpu, sizeof(cpu)) == -1) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(SO_INCOMING_CPU): %s",
+                                            strerror(errno));
+        }
+#endif
+        dispatch_listen_conn(ii, s, port);
+        STATS_LOCK();
+        ++stats.curr_conns;
+        ++stats.daemon_conns;
+        struct listening_port *port_instance = get_listening_port_instance(port);
+        assert(port_instance);
+        ++port_instance->curr_conns;
+        STATS_UNLOCK();
+    }
+
+    return true;
+}
+
+/*
+ * Every worker serving a UDP port gets its own socket bound to the same
+ * address when we can (SO_REUSEPORT), so that the kernel keeps sending
+ * the datagrams of a client to the same worker and the frames of a
+ * request end up in the same place. Where we can't they all share sfd.
+ */
+static void server_socket_udp(SOCKET sfd, const struct addrinfo *ai,
+                              int port, enum network_transport transport) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    bool shared = true;
+    int flags = 1;
+
+#ifdef SO_REUSEPORT
+    shared = getsockname(sfd, (struct sockaddr*)&addr, &addrlen) != 0;
+#endif
+
+    for (int c = 0; c < settings.num_threads_per_udp; c++) {
+        SOCKET s = sfd;
+        if (c > 0 && !shared) {
+            if ((s = new_socket((struct addrinfo*)ai)) != INVALID_SOCKET) {
+#ifdef IPV6_V6ONLY
+                if (ai->ai_family == AF_INET6) {
+                    setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+                }
+#endif
+#ifdef SO_REUSEPORT
+                setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+#endif
+                maximize_sndbuf(s);
+                if (bind(s, (struct sockaddr*)&addr, addrlen) == SOCKET_ERROR) {
+                    safe_close(s);
+                    s = INVALID_SOCKET;
+                }
+            }
+            if (s == INVALID_SOCKET) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                                "Failed to add a UDP socket for every worker, "
+                                                "the rest share one: %s",
+                                                strerror(errno));
+                shared = true;
+                s = sfd;
+            }
+        }
+
+        /* this is guaranteed to hit all threads because we round-robin */
+        dispatch_conn_new(s, port, conn_read, EV_READ | EV_PERSIST,
+                          UDP_READ_BUFFER_SIZE, transport);
+        STATS_LOCK();
+        ++stats.curr_conns;
+        ++stats.daemon_conns;
+        STATS_UNLOCK();
+    }
+}
+
 static int server_socket(const char *interface,
                          int port,
                          enum network_transport transport,
+                         bool tls,
                          FILE *portnumber_file) {
     int sfd;
-    struct linger ling = {0, 0};
     struct addrinfo *ai;
     struct addrinfo *next;
     struct addrinfo hints = { .ai_flags = AI_PASSIVE,
@@ -4854,29 +9196,13 @@ static int server_socket(const char *interface,
         setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
         if (IS_UDP(transport)) {
             maximize_sndbuf(sfd);
-        } else {
-            error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(SO_KEEPALIVE): %s",
-                                                strerror(errno));
-            }
-
-            error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(SO_LINGER): %s",
-                                                strerror(errno));
-            }
-
-            if (settings.tcp_nodelay) {
-                error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
-                if (error != 0) {
-                    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                    "setsockopt(TCP_NODELAY): %s",
-                                                    strerror(errno));
-                }
+#ifdef SO_REUSEPORT
+            if (settings.num_threads_per_udp > 1) {
+                setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
             }
+#endif
+        } else {
+            set_tcp_socket_options(sfd);
         }
 
         if (bind(sfd, next->ai_addr, next->ai_addrlen) == SOCKET_ERROR) {
@@ -4909,30 +9235,29 @@ static int server_socket(const char *interface,
                 } my_sockaddr;
                 socklen_t len = sizeof(my_sockaddr);
                 if (getsockname(sfd, (struct sockaddr*)&my_sockaddr, &len)==0) {
+                    const char *kind = IS_UDP(transport) ? "UDP" :
+                        tls ? "TLS" : "TCP";
                     if (next->ai_addr->sa_family == AF_INET) {
-                        fprintf(portnumber_file, "%s INET: %u\n",
-                                IS_UDP(transport) ? "UDP" : "TCP",
+                        fprintf(portnumber_file, "%s INET: %u\n", kind,
                                 ntohs(my_sockaddr.in.sin_port));
                     } else {
-                        fprintf(portnumber_file, "%s INET6: %u\n",
-                                IS_UDP(transport) ? "UDP" : "TCP",
+                        fprintf(portnumber_file, "%s INET6: %u\n", kind,
                                 ntohs(my_sockaddr.in6.sin6_port));
                     }
                 }
             }
         }
 
-        if (IS_UDP(transport)) {
-            int c;
+        if (tls) {
+            tls_add_listener(sfd);
+        }
 
-            for (c = 0; c < settings.num_threads_per_udp; c++) {
-                /* this is guaranteed to hit all threads because we round-robin */
-                dispatch_conn_new(sfd, port, conn_read, EV_READ | EV_PERSIST,
-                                  UDP_READ_BUFFER_SIZE, transport);
-                STATS_LOCK();
-                ++stats.curr_conns;
-                ++stats.daemon_conns;
-                STATS_UNLOCK();
+        if (IS_UDP(transport)) {
+            server_socket_udp(sfd, next, port, transport);
+        } else if (settings.reuseport) {
+            if (!server_socket_reuseport(sfd, next, port)) {
+                freeaddrinfo(ai);
+                return 1;
             }
         } else {
             if (!(listen_conn_add = conn_new(sfd, port, conn_listening,
@@ -4967,7 +9292,8 @@ static int server_sockets(int port, enum network_transport transport,
             stats.listening_ports[0].port = port == -1 ? 0 : port;
             stats.listening_ports[0].maxconns = settings.maxconns;
         }
-        return server_socket(settings.inter, port, transport, portnumber_file);
+        return server_socket(settings.inter, port, transport, false,
+                             portnumber_file);
     } else {
         // tokenize them and bind to each one of them..
         char *b;
@@ -5033,7 +9359,8 @@ static int server_sockets(int port, enum network_transport transport,
             if (strcmp(p, "*") == 0) {
                 p = NULL;
             }
-            ret |= server_socket(p, the_port, transport, portnumber_file);
+            ret |= server_socket(p, the_port, transport, false,
+                                 portnumber_file);
         }
         // For ports whose max connection limit is missing from cmd
         if (!IS_UDP(transport) && num_zero_max_conns > 0) {
@@ -5050,6 +9377,46 @@ static int server_sockets(int port, enum network_transport transport,
     }
 }
 
+/*
+ * Listen for TLS clients on settings.tls_port, on the interfaces we
+ * listen on for the others (whatever port they give). The port has the
+ * last entry of stats.listening_ports.
+ */
+static int server_sockets_tls(FILE *portnumber_file) {
+    struct listening_port *port = &stats.listening_ports[settings.num_ports - 1];
+    port->port = settings.tls_port == -1 ? 0 : settings.tls_port;
+    port->maxconns = settings.maxconns;
+
+    if (settings.inter == NULL) {
+        return server_socket(NULL, settings.tls_port, tcp_transport, true,
+                             portnumber_file);
+    }
+
+    char *b;
+    int ret = 0;
+    char *list = strdup(settings.inter);
+    if (list == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to allocate memory for parsing server interface string\n");
+        return 1;
+    }
+    for (char *p = strtok_r(list, ";,", &b);
+         p != NULL;
+         p = strtok_r(NULL, ";,", &b)) {
+        char *s = strchr(p, ':');
+        if (s != NULL) {
+            *s = '\0';
+        }
+        if (strcmp(p, "*") == 0) {
+            p = NULL;
+        }
+        ret |= server_socket(p, settings.tls_port, tcp_transport, true,
+                             portnumber_file);
+    }
+    free(list);
+    return ret;
+}
+
 static int new_socket_unix(void) {
     int sfd;
 
@@ -5170,6 +9537,7 @@ static void clock_handler(const int fd, const short which, void *arg) {
     evtimer_add(&clockevent, &t);
 
     set_current_time();
+    threads_update_load();
 }
 
 static void usage(void) {
@@ -5213,12 +9581,51 @@ static void usage(void) {
            "              \":\" (colon). If this option is specified, stats collection\n"
            "              is turned on automatically; if not, then it may be turned on\n"
            "              by sending the \"stats detail on\" command to the server.\n");
-    printf("-t <num>      number of threads to use (default: 4)\n");
+    printf("-t <num>[,<min>] number of threads to use (default: 4), scaled down\n"
+           "              to <min> when they're idle and up again on load\n");
     printf("-R            Maximum number of requests per event, limits the number of\n"
            "              requests process for a given connection to prevent \n"
            "              starvation (default: 20)\n");
+    printf("-G <list>     Serve the connections to these ports and from these SASL\n"
+           "              users (comma separated) after the others, like the TAP\n"
+           "              streams\n");
+    printf("-g <usec>     The time such a bulk connection may run before it\n"
+           "              yields (default: 1000, 0 = no limit)\n");
     printf("-C            Disable use of CAS\n");
     printf("-b            Set the backlog queue limit (default: 1024)\n");
+    printf("-T <num>      TLS port number to listen on (default: 0, off)\n"
+           "-K <cert>[,<key>] PEM files with the certificate chain and the\n"
+           "              private key for TLS (the key may be in the first)\n");
+    printf("-N            Give each worker thread its own SO_REUSEPORT listening\n"
+           "              socket, instead of accepting all TCP connections in\n"
+           "              the dispatcher thread\n");
+    printf("-Y <cpus>     Pin the worker threads to these CPUs (like 0-7,16-23),\n"
+           "              one each in turn, and run the other threads on them\n");
+    printf("-j <policy>   How to pick the worker thread for a new connection, one\n"
+           "              of round-robin (default), conns (fewest connections) or\n"
+           "              load (least busy event loop)\n");
+    printf("-J            Move idle connections away from busy worker threads\n");
+    printf("-o <close>[,<hibernate>] Close the connections that have been idle\n"
+           "              for <close> seconds, and shrink the ones idle for\n"
+           "              <hibernate> seconds to what they need to wait for the\n"
+           "              next request (default: 0,0, never)\n");
+    printf("-O <io>[,<cpu>] Threads of the pools running the blocking tasks of\n"
+           "              the engines (default: 4,2)\n");
+    printf("-W <backend>  Network I/O backend for the worker threads, one of\n"
+           "              libevent (default), io_uring (Linux only) or\n"
+           "              iocp (Windows only)\n");
+    printf("-Z <size>     Send values of at least <size> bytes with MSG_ZEROCOPY\n"
+           "              (Linux only, default: off)\n");
+    printf("-z <size>     Compress the values of at least <size> bytes in TAP\n"
+           "              streams that ask for it (default: 128, 0 = never)\n");
+    printf("-A <size>     Sample the heap every <size> bytes allocated (needs an\n"
+           "              allocator with hooks, default: off)\n");
+    printf("-w <usec>     Log the requests taking <usec> microseconds or more\n"
+           "              (\"stats slowlog\", default: off)\n");
+    printf("-y <n>        Log one request in <n> whatever it takes, with the time\n"
+           "              spent reading it (default: off)\n");
+    printf("-H <hash>     Hash function for the keys, one of jenkins (default)\n"
+           "              or murmur3\n");
     printf("-B            Binding protocol - one of ascii, binary, or auto (default)\n");
     printf("-I            Override the size of each slab page. Adjusts max item size\n"
            "              (default: 1mb, min: 1k, max: 128m)\n");
@@ -5229,7 +9636,8 @@ static void usage(void) {
     printf("-e config     Pass config as configuration options to the storage engine\n");
     printf("\nEnvironment variables:\n"
            "MEMCACHED_PORT_FILENAME   File to write port information to\n"
-           "MEMCACHED_REQS_TAP_EVENT  Similar to -R but for tap_ship_log\n");
+           "MEMCACHED_REQS_TAP_EVENT  Similar to -R but for tap_ship_log\n"
+           "MEMCACHED_DISABLE_TCP_CORK Don't cork the sockets of pipelining clients\n");
 }
 
 static void usage_license(void) {
@@ -5472,21 +9880,21 @@ static int num_independent_stats(void) {
 }
 
 static void *new_independent_stats(void) {
-    int nrecords = num_independent_stats();
-    struct thread_stats *ts = calloc(nrecords, sizeof(struct thread_stats));
-    for (int ii = 0; ii < nrecords; ii++) {
-        pthread_mutex_init(&ts[ii].mutex, NULL);
+    size_t size = num_independent_stats() * sizeof(struct thread_stats);
+#ifdef HAVE_POSIX_MEMALIGN
+    void *ts;
+    if (posix_memalign(&ts, CACHE_LINE_SIZE, size) != 0) {
+        return NULL;
     }
+    memset(ts, 0, size);
     return ts;
+#else
+    return calloc(1, size);
+#endif
 }
 
 static void release_independent_stats(void *stats) {
-    int nrecords = num_independent_stats();
-    struct thread_stats *ts = stats;
-    for (int ii = 0; ii < nrecords; ii++) {
-        pthread_mutex_destroy(&ts[ii].mutex);
-    }
-    free(ts);
+    free(stats);
 }
 
 static inline struct thread_stats* get_independent_stats(conn *c) {
@@ -5526,6 +9934,15 @@ static rel_time_t get_current_time(void)
     return current_time;
 }
 
+uint64_t get_current_time_msec(void)
+{
+    struct timeval timer;
+
+    gettimeofday(&timer, NULL);
+    return (uint64_t)(timer.tv_sec - process_started) * 1000 +
+        timer.tv_usec / 1000;
+}
+
 static void count_eviction(const void *cookie, const void *key, const int nkey) {
     (void)cookie;
     (void)key;
@@ -5843,13 +10260,14 @@ static SERVER_HANDLE_V1 *get_server_api(void)
 {
     static SERVER_CORE_API core_api = {
         .server_version = get_server_version,
-        .hash = hash,
         .realtime = realtime,
         .abstime = abstime,
         .get_current_time = get_current_time,
+        .get_current_time_msec = get_current_time_msec,
         .parse_config = parse_config,
         .shutdown = shutdown_server,
-        .get_config = get_config
+        .get_config = get_config,
+        .place_background_thread = affinity_bind_background
     };
 
     static SERVER_COOKIE_API server_cookie_api = {
@@ -5859,7 +10277,10 @@ static SERVER_HANDLE_V1 *get_server_api(void)
         .get_socket_fd = get_socket_fd,
         .notify_io_complete = notify_io_complete,
         .reserve = reserve_cookie,
-        .release = release_cookie
+        .release = release_cookie,
+        .add_timer = thread_add_timer,
+        .cancel_timer = thread_cancel_timer,
+        .submit_task = submit_task
     };
 
     static SERVER_STAT_API server_stat_api = {
@@ -5910,6 +10331,8 @@ static SERVER_HANDLE_V1 *get_server_api(void)
     if (rv.engine == NULL) {
         rv.engine = settings.engine.v0;
     }
+    /* Selected with -H */
+    core_api.hash = hash;
 
     return &rv;
 }
@@ -6061,8 +10484,25 @@ int main (int argc, char **argv) {
           "D:"  /* prefix delimiter? */
           "L"   /* Large memory pages */
           "R:"  /* max requests per event */
+          "G:"  /* bulk connection classes */
+          "g:"  /* bulk connection time budget */
           "C"   /* Disable use of CAS */
           "b:"  /* backlog queue limit */
+          "N"   /* SO_REUSEPORT listener per worker */
+          "j:"  /* connection placement policy */
+          "J"   /* connection migration */
+          "o:"  /* idle connection timeouts */
+          "W:"  /* network I/O backend */
+          "O:"  /* task pool threads */
+          "Z:"  /* zero-copy send threshold */
+          "z:"  /* TAP value compression threshold */
+          "A:"  /* heap profile sample interval */
+          "w:"  /* slow request log threshold */
+          "y:"  /* slow request log sampling */
+          "Y:"  /* CPUs to run the threads on */
+          "T:"  /* TLS port number to listen on */
+          "K:"  /* TLS certificate chain and key */
+          "H:"  /* hash function */
           "B:"  /* Binding protocol */
           "I:"  /* Max item size */
           "S"   /* Sasl ON */
@@ -6180,13 +10620,25 @@ int main (int argc, char **argv) {
             old_opts += sprintf(old_opts, "chunk_size=%u;",
                                 settings.chunk_size);
             break;
-        case 't':
-            settings.num_threads = atoi(optarg);
+        case 't': {
+            char *end;
+            settings.num_threads = (int)strtol(optarg, &end, 10);
             if (settings.num_threads <= 0) {
                 settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                         "Number of threads must be greater than 0\n");
                 return 1;
             }
+            settings.num_threads_min = 0;
+            if (*end == ',') {
+                settings.num_threads_min = (int)strtol(end + 1, &end, 10);
+            }
+            if (*end != '\0' || settings.num_threads_min < 0 ||
+                settings.num_threads_min > settings.num_threads) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Invalid value for the threads: %s\n"
+                        " -- should be <num>[,<min>] (<min> at most <num>)\n", optarg);
+                return 1;
+            }
             /* There're other problems when you get above 64 threads.
              * In the future we should portably detect # of cores for the
              * default.
@@ -6199,6 +10651,7 @@ int main (int argc, char **argv) {
                         " your machine or less.\n");
             }
             break;
+        }
         case 'D':
             settings.prefix_delimiter = optarg[0];
             settings.detail_enabled = 1;
@@ -6214,12 +10667,200 @@ int main (int argc, char **argv) {
         case 'b' :
             settings.backlog = atoi(optarg);
             break;
+        case 'j':
+            if (strcmp(optarg, "round-robin") == 0) {
+                settings.conn_placement = CONN_PLACEMENT_ROUND_ROBIN;
+            } else if (strcmp(optarg, "conns") == 0) {
+                settings.conn_placement = CONN_PLACEMENT_CONNS;
+            } else if (strcmp(optarg, "load") == 0) {
+                settings.conn_placement = CONN_PLACEMENT_LOAD;
+            } else {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Invalid value for connection placement: %s\n"
+                        " -- should be one of round-robin, conns or load\n", optarg);
+                exit(EX_USAGE);
+            }
+            break;
+        case 'J':
+            settings.conn_migrate = true;
+            break;
+        case 'o': {
+            char *end;
+            long idle = strtol(optarg, &end, 10);
+            long hibernate = 0;
+            if (*end == ',') {
+                hibernate = strtol(end + 1, &end, 10);
+            }
+            if (*end != '\0' || idle < 0 || hibernate < 0 ||
+                idle > REALTIME_MAXDELTA || hibernate > REALTIME_MAXDELTA) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Invalid value for the idle timeouts: %s\n"
+                        " -- should be <close>[,<hibernate>] in seconds\n",
+                        optarg);
+                exit(EX_USAGE);
+            }
+            settings.idle_timeout = (uint32_t)idle;
+            settings.hibernate_timeout = (uint32_t)hibernate;
+            break;
+        }
+        case 'O': {
+            char *end;
+            long io = strtol(optarg, &end, 10);
+            long cpu = settings.task_threads[TASK_POOL_CPU];
+            if (*end == ',') {
+                cpu = strtol(end + 1, &end, 10);
+            }
+            if (*end != '\0' || io < 0 || io > 256 || cpu < 0 || cpu > 256) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Invalid value for the task pool threads: %s\n"
+                        " -- should be <io>[,<cpu>] (0 to 256 each)\n", optarg);
+                exit(EX_USAGE);
+            }
+            settings.task_threads[TASK_POOL_IO] = (int)io;
+            settings.task_threads[TASK_POOL_CPU] = (int)cpu;
+            break;
+        }
+        case 'W':
+            if (strcmp(optarg, "libevent") == 0) {
+                settings.io_backend = IO_BACKEND_LIBEVENT;
+            } else if (strcmp(optarg, "io_uring") == 0) {
+                settings.io_backend = IO_BACKEND_IO_URING;
+            } else if (strcmp(optarg, "iocp") == 0) {
+                settings.io_backend = IO_BACKEND_IOCP;
+            } else {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Invalid value for the I/O backend: %s\n"
+                        " -- should be one of libevent, io_uring or iocp\n",
+                        optarg);
+                exit(EX_USAGE);
+            }
+            break;
+        case 'Z':
+#ifdef HAVE_ZEROCOPY
+            unit = optarg[strlen(optarg)-1];
+            size_max = atoi(optarg);
+            if (unit == 'k' || unit == 'K') {
+                size_max *= 1024;
+            } else if (unit == 'm' || unit == 'M') {
+                size_max *= 1024 * 1024;
+            }
+            if (size_max <= 0) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "The zero-copy threshold must be a positive size\n");
+                return 1;
+            }
+            settings.zerocopy_min = size_max;
+#else
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "MSG_ZEROCOPY is not supported on this platform\n");
+#endif
+            break;
+        case 'z':
+            unit = optarg[strlen(optarg)-1];
+            size_max = atoi(optarg);
+            if (unit == 'k' || unit == 'K') {
+                size_max *= 1024;
+            } else if (unit == 'm' || unit == 'M') {
+                size_max *= 1024 * 1024;
+            }
+            if (size_max < 0) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "The tap compression threshold can't be negative\n");
+                return 1;
+            }
+            settings.tap_compress_min = size_max;
+            break;
+        case 'A':
+            unit = optarg[strlen(optarg)-1];
+            size_max = atoi(optarg);
+            if (unit == 'k' || unit == 'K') {
+                size_max *= 1024;
+            } else if (unit == 'm' || unit == 'M') {
+                size_max *= 1024 * 1024;
+            }
+            if (size_max <= 0) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "The heap sample interval must be a positive size\n");
+                return 1;
+            }
+            settings.heap_sample = size_max;
+            break;
+        case 'w':
+            if (!safe_strtoul(optarg, &settings.slowlog_usec) ||
+                settings.slowlog_usec == 0) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "The slow request threshold must be a positive number of microseconds\n");
+                return 1;
+            }
+            break;
+        case 'y':
+            if (!safe_strtoul(optarg, &settings.slowlog_sample) ||
+                settings.slowlog_sample == 0) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "The slow request log sample rate must be greater than 0\n");
+                return 1;
+            }
+            break;
+        case 'G':
+            if (!parse_bulk_classes(optarg)) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Invalid bulk connection class: %s\n", optarg);
+                return 1;
+            }
+            settings.bulk_classes = strdup(optarg);
+            break;
+        case 'g':
+            if (!safe_strtoul(optarg, &settings.bulk_budget)) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Invalid bulk connection time budget: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'Y':
+            {
+                /* Now, so that the extensions loaded after it start there */
+                char err[512];
+                if (!affinity_init(optarg, err, sizeof(err))) {
+                    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                                    "%s\n", err);
+                    return 1;
+                }
+                settings.cpu_affinity = strdup(optarg);
+            }
+            break;
+        case 'T':
+            settings.tls_port = atoi(optarg);
+            break;
+        case 'K':
+            settings.tls_cert = strdup(optarg);
+            if ((settings.tls_key = strchr(settings.tls_cert, ',')) != NULL) {
+                *settings.tls_key++ = '\0';
+            }
+            break;
+        case 'N' :
+#ifdef SO_REUSEPORT
+            settings.reuseport = true;
+#else
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "SO_REUSEPORT is not supported on this platform\n");
+#endif
+            break;
+        case 'H':
+            if (!hash_init(optarg)) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Invalid value for the hash function: %s\n"
+                        " -- should be one of jenkins or murmur3\n", optarg);
+                exit(EX_USAGE);
+            }
+            break;
         case 'B':
             protocol_specified = true;
             if (strcmp(optarg, "auto") == 0) {
                 settings.binding_protocol = negotiating_prot;
             } else if (strcmp(optarg, "binary") == 0) {
                 settings.binding_protocol = binary_prot;
+            } else if (strcmp(optarg, "ascii") == 0) {
+                settings.binding_protocol = ascii_prot;
             } else {
                 settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                         "Invalid value for binding protocol: %s\n"
@@ -6330,6 +10971,24 @@ int main (int argc, char **argv) {
         settings.num_ports = num_ports;
     }
 
+    affinity_set_workers(settings.num_threads);
+
+    if (settings.tls_port != 0) {
+        char err[512];
+        if (settings.tls_cert == NULL) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "ERROR: -T needs the certificate and the key (-K)\n");
+            exit(EX_USAGE);
+        }
+        if (!tls_init(settings.tls_cert, settings.tls_key, err, sizeof(err))) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "ERROR: Can't set up TLS: %s\n", err);
+            exit(EX_USAGE);
+        }
+        /* The TLS port has a listening_ports entry of its own */
+        ++settings.num_ports;
+    }
+
     if (settings.require_sasl) {
         if (!protocol_specified) {
             settings.binding_protocol = binary_prot;
@@ -6339,6 +10998,11 @@ int main (int argc, char **argv) {
                         "ERROR: You cannot use auto-negotiating protocol while requiring SASL.\n");
                 exit(EX_USAGE);
             }
+            if (settings.binding_protocol == ascii_prot) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "ERROR: You cannot use the ASCII protocol while requiring SASL.\n");
+                exit(EX_USAGE);
+            }
         }
     }
 
@@ -6515,9 +11179,33 @@ int main (int argc, char **argv) {
     if (settings.engine.v1->arithmetic == NULL) {
         settings.engine.v1->arithmetic = internal_arithmetic;
     }
+    setup_engine_command_handlers();
+    if (settings.engine.v1->get_item_layout != NULL) {
+        engine_item_layout = settings.engine.v1->get_item_layout(settings.engine.v0);
+    }
+
+    if (settings.heap_sample != 0) {
+        if (get_alloc_hooks_type() == none) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "The heap profile needs an allocator with hooks "
+                    "(tcmalloc), not sampling the heap\n");
+        } else {
+            func_ptr engine_code = {
+                .func = (void *(*)())settings.engine.v1->get_info
+            };
+            heap_profile_add_module(engine_code.ptr, HEAP_ENGINE);
+            if (!mc_add_delete_hook(heap_profile_delete_hook) ||
+                !heap_profile_init(settings.heap_sample) ||
+                !mc_add_new_hook(heap_profile_new_hook)) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Failed to install the heap profile hooks\n");
+            }
+        }
+    }
 
     /* initialize other stuff */
     stats_init();
+    timings_cycles_calibrate();
 
     default_independent_stats = new_independent_stats();
 
@@ -6536,6 +11224,19 @@ int main (int argc, char **argv) {
     /* start up worker threads if MT mode */
     thread_init(settings.num_threads, main_base, dispatch_event_handler);
 
+    /* A connection has a task in a pool at a time at most */
+    static const char *task_pool_names[TASK_POOL_COUNT] = { "io", "cpu" };
+    for (int ii = 0; ii < TASK_POOL_COUNT; ++ii) {
+        if (!taskpool_init(&task_pools[ii], task_pool_names[ii],
+                           settings.task_threads[ii], settings.maxconns,
+                           notify_io_complete, affinity_bind_background)) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to start the %s task pool\n",
+                    task_pool_names[ii]);
+            exit(EX_OSERR);
+        }
+    }
+
     /* initialise clock event */
     clock_handler(0, 0, 0);
 
@@ -6578,6 +11279,13 @@ int main (int argc, char **argv) {
             exit(EX_OSERR);
         }
 
+        if (settings.tls_port != 0 && server_sockets_tls(portnumber_file)) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "failed to listen on TLS port %d: %s",
+                                            settings.tls_port, strerror(errno));
+            exit(EX_OSERR);
+        }
+
         /*
          * initialization order: first create the listening sockets
          * (may need root on low ports), then drop root if needed,
@@ -6618,6 +11326,9 @@ int main (int argc, char **argv) {
                                         "Initiating shutdown\n");
     }
     threads_shutdown();
+    for (int ii = 0; ii < TASK_POOL_COUNT; ++ii) {
+        taskpool_destroy(&task_pools[ii]);
+    }
 
     settings.engine.v1->destroy(settings.engine.v0, false);
 
@@ -16,6 +16,27 @@
 #include "cache.h"
 
 #include "sasl_defs.h"
+#include "io_ring.h"
+#include "timings.h"
+#include "slowlog.h"
+#include "topclients.h"
+#include "timer_wheel.h"
+#include "tls.h"
+
+#if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+#define ATOMIC_CAS(ptr, oldval, newval) \
+            ((oldval) == atomic_cas_32((volatile uint32_t*)(ptr), \
+                                       (oldval), (newval)))
+#define ATOMIC_CAS_PTR(ptr, oldval, newval) \
+            ((void*)(oldval) == atomic_cas_ptr((volatile void*)(ptr), \
+                                               (oldval), (newval)))
+#else
+#define ATOMIC_CAS(ptr, oldval, newval) \
+            __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define ATOMIC_CAS_PTR(ptr, oldval, newval) \
+            __sync_bool_compare_and_swap(ptr, oldval, newval)
+#endif
 
 /** Maximum length of a key. */
 #define KEY_MAX_LENGTH 250
@@ -28,9 +49,9 @@
 #define UDP_MAX_PAYLOAD_SIZE 1400
 #define UDP_HEADER_SIZE 8
 #define MAX_SENDBUF_SIZE (256 * 1024 * 1024)
-/* I'm told the max length of a 64-bit num converted to string is 20 bytes.
- * Plus a few for spaces, \r\n, \0 */
-#define SUFFIX_SIZE 24
+/* " <flags> <bytes> <cas>\r\n" of an ASCII "gets": two 32-bit and a
+ * 64-bit number, the spaces, \r\n and \0 */
+#define SUFFIX_SIZE 48
 
 /** Initial size of list of items being returned by "get". */
 #define ITEM_LIST_INITIAL 200
@@ -50,6 +71,17 @@
 #define IOV_LIST_HIGHWAT 600
 #define MSG_LIST_HIGHWAT 100
 
+/*
+ * Sizes of the read buffers kept in the per-thread pools, DATA_BUFFER_SIZE
+ * doubled up to READ_BUFFER_HIGHWAT
+ */
+#define CONN_BUFFER_CLASSES 3
+
+/* Limits for the responses to pipelined requests we collect in one write */
+#define COALESCE_MAX_BYTES (64 * 1024)
+#define COALESCE_WBUF_RESERVE 512
+#define COALESCE_IOV_RESERVE 8
+
 /* Binary protocol stuff */
 #define MIN_BIN_PKT_LENGTH 16
 #define BIN_PKT_HDR_WORDS (MIN_BIN_PKT_LENGTH/sizeof(uint32_t))
@@ -67,6 +99,16 @@
 
 #define DEFAULT_REQS_PER_EVENT     20
 #define DEFAULT_REQS_PER_TAP_EVENT 50
+#define DEFAULT_BULK_BUDGET        1000
+
+/*
+ * The priorities of the events in a worker's event base: libevent runs
+ * the bulk ones (TAP streams and the connections named with -G) only
+ * when no interactive connection is ready.
+ */
+#define CONN_PRIORITY_INTERACTIVE 0
+#define CONN_PRIORITY_BULK        1
+#define CONN_PRIORITIES           2
 
 /** Append a simple stat with a stat name, value format and value */
 #define APPEND_STAT(name, fmt, val) \
@@ -95,10 +137,12 @@ enum bin_substates {
     bin_read_flush_exptime,
     bin_reading_sasl_auth,
     bin_reading_sasl_auth_data,
-    bin_reading_packet
+    bin_reading_packet,
+    ascii_read_set_value
 };
 
 enum protocol {
+    ascii_prot = 3,
     binary_prot = 4,
     negotiating_prot /* Discovering the protocol */
 };
@@ -111,7 +155,7 @@ enum network_transport {
 
 #define IS_UDP(x) (x == udp_transport)
 
-/** Stats stored per slab (and per thread). */
+/** Stats of the requests that found (or stored) an item. */
 struct slab_stats {
     uint64_t  cmd_set;
     uint64_t  get_hits;
@@ -120,11 +164,26 @@ struct slab_stats {
     uint64_t  cas_badval;
 };
 
+#define CACHE_LINE_SIZE 64
+
+#ifdef __GNUC__
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+#else
+#define CACHE_ALIGNED
+#endif
+
 /**
  * Stats stored per-thread.
+ *
+ * Every worker thread has its own slot in an array of these (one array per
+ * bucket), and it is the only one updating the counters in there. They're
+ * bumped with a relaxed load and store (see thread_stats_add), so there's
+ * no lock and no locked instruction in the way of the requests, and the
+ * slots are cache line aligned so that the threads don't share lines.
+ * Readers add up the slots without locking; a reset may lose against a
+ * thread bumping the same counter at that very moment.
  */
 struct thread_stats {
-    pthread_mutex_t   mutex;
     uint64_t          cmd_get;
     uint64_t          get_misses;
     uint64_t          delete_misses;
@@ -137,10 +196,34 @@ struct thread_stats {
     uint64_t          bytes_written;
     uint64_t          cmd_flush;
     uint64_t          conn_yields; /* # of yields for connections (-R option)*/
+    uint64_t          bulk_yields; /* bulk connections out of time (-g) */
     uint64_t          auth_cmds;
     uint64_t          auth_errors;
-    struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
-};
+    uint64_t          auth_ns; /* time spent checking the credentials */
+    uint64_t          zerocopy_bytes; /* bytes sent with MSG_ZEROCOPY (-Z) */
+    uint64_t          zerocopy_fallbacks; /* zero-copy sends that got copied */
+    uint64_t          coalesced_responses; /* responses sent with the next one */
+    uint64_t          nread_readahead; /* values read with the next request */
+    uint64_t          sendmsgs; /* writes of responses to TCP and UNIX sockets */
+    uint64_t          tcp_corked; /* times we corked a pipelining connection */
+    uint64_t          tls_handshakes;
+    uint64_t          tls_handshake_errors;
+    uint64_t          tls_offloaded; /* handshakes after which kTLS took over */
+    struct slab_stats slab_stats;
+} CACHE_ALIGNED;
+
+#ifdef __GNUC__
+#define thread_stats_get(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define thread_stats_set(counter, val) \
+    __atomic_store_n(&(counter), (val), __ATOMIC_RELAXED)
+#else
+#define thread_stats_get(counter) (*(volatile uint64_t *)&(counter))
+#define thread_stats_set(counter, val) \
+    (*(volatile uint64_t *)&(counter) = (val))
+#endif
+/* Only for the thread owning the counter */
+#define thread_stats_add(counter, amt) \
+    thread_stats_set(counter, thread_stats_get(counter) + (amt))
 
 /**
  * Listening port.
@@ -167,6 +250,20 @@ struct stats {
 
 #define MAX_VERBOSITY_LEVEL 2
 
+/* How dispatch_conn_new() picks the worker thread for a new connection */
+enum conn_placement {
+    CONN_PLACEMENT_ROUND_ROBIN,
+    CONN_PLACEMENT_CONNS,       /* fewest connections */
+    CONN_PLACEMENT_LOAD         /* least busy event loop */
+};
+
+/* How the worker threads do their network I/O */
+enum io_backend {
+    IO_BACKEND_LIBEVENT,        /* readiness notifications and plain syscalls */
+    IO_BACKEND_IO_URING,        /* batched recv/sendmsg through io_uring */
+    IO_BACKEND_IOCP             /* overlapped WSARecv/WSASend on Windows */
+};
+
 /* When adding a setting, be sure to update process_stat_settings */
 /**
  * Globally accessible settings as derived from the commandline.
@@ -185,6 +282,7 @@ struct settings {
     double factor;          /* chunk size growth factor */
     int chunk_size;
     int num_threads;        /* number of worker (without dispatcher) libevent threads to run */
+    int num_threads_min;    /* scale the workers down to this many (0: don't) */
     int num_threads_per_udp; /* number of worker threads serving each udp socket */
     char prefix_delimiter;  /* character that marks a key prefix (for stats) */
     int detail_enabled;     /* nonzero if we're collecting detailed stats */
@@ -211,6 +309,26 @@ struct settings {
     } extensions;
     int num_ports;
     bool tcp_nodelay;
+    bool tcp_cork;          /* cork the socket while replying to a pipeline */
+    bool reuseport;         /* SO_REUSEPORT listening socket per worker */
+    enum conn_placement conn_placement;
+    bool conn_migrate;      /* move idle connections off busy threads */
+    enum io_backend io_backend;
+    size_t zerocopy_min;    /* send values this big with MSG_ZEROCOPY (0 = off) */
+    size_t tap_compress_min; /* compress TAP values this big (0 = off) */
+    size_t heap_sample;     /* heap profile sample interval (0 = off) */
+    volatile bool state_cycles; /* count the cycles per state ("stats states on") */
+    uint32_t slowlog_usec;  /* log requests slower than this (0 = off) */
+    uint32_t slowlog_sample; /* log one request in this many (0 = off) */
+    int tls_port;           /* TCP port for TLS clients (0 = none) */
+    char *tls_cert;         /* certificate chain and key for them */
+    char *tls_key;
+    char *bulk_classes;     /* ports and SASL users served as bulk (-G) */
+    uint32_t bulk_budget;   /* usec a bulk connection may run per event */
+    char *cpu_affinity;     /* the CPUs to run the threads on (-Y) */
+    uint32_t idle_timeout;  /* close connections idle this long (s, 0 = never) */
+    uint32_t hibernate_timeout; /* hibernate them after this long (s, 0 = never) */
+    int task_threads[TASK_POOL_COUNT]; /* threads of the task pools (-O) */
 };
 
 struct engine_event_handler {
@@ -228,18 +346,101 @@ enum thread_type {
     DISPATCHER = 15
 };
 
+/*
+ * The cycles the worker threads spend in every state of the connections
+ * and in the engine calls they make from there ("stats states"). Only the
+ * thread itself counts in them, and only while settings.state_cycles is
+ * set.
+ */
+#define CONN_NSTATES 16
+
+enum engine_call {
+    ENGINE_CALL_GET,
+    ENGINE_CALL_ALLOCATE,
+    ENGINE_CALL_STORE,
+    ENGINE_CALL_REMOVE,
+    ENGINE_CALL_ARITHMETIC,
+    ENGINE_CALL_FLUSH,
+    ENGINE_CALL_STATS,
+    ENGINE_CALL_UNKNOWN_COMMAND,
+    ENGINE_CALL_TAP_ITERATOR,
+    ENGINE_CALL_TAP_NOTIFY,
+    ENGINE_NCALLS
+};
+
+struct cycle_counter {
+    uint64_t calls;
+    uint64_t cycles;
+};
+
+struct thread_cycles {
+    struct cycle_counter state[CONN_NSTATES];
+    struct cycle_counter engine[ENGINE_NCALLS];
+};
+
+/* The connections of a thread waiting for a request, longest idle first */
+struct conn_idle_list {
+    struct conn *head;
+    struct conn *tail;
+    unsigned int count;
+};
+
 typedef struct {
     pthread_t thread_id;        /* unique ID of this thread */
     struct event_base *base;    /* libevent handle this thread uses */
     struct event notify_event;  /* listen event for notify pipe */
-    SOCKET notify[2];           /* notification pipes */
+    SOCKET notify[2];           /* notification pipes (or one eventfd) */
+    volatile uint32_t notify_pending; /* a wakeup is on its way */
     struct conn_queue *new_conn_queue; /* queue of new connections to handle */
     cache_t *suffix_cache;      /* suffix cache */
+    cache_t *buffer_cache[CONN_BUFFER_CLASSES]; /* buffers of idle conns */
     pthread_mutex_t mutex;      /* Mutex to lock protect access to the pending_io */
     bool is_locked;
     struct conn *pending_io;    /* List of connection with pending async io ops */
     int index;                  /* index of this thread in the threads array */
     enum thread_type type;      /* Type of IO this thread processes */
+    struct conn *listen_conn;   /* The thread's own (reuseport) listeners */
+    bool listen_disabled;       /* listen_conn is disabled (out of fds) */
+
+    /* The load on the thread, protected by the stats lock */
+    int conn_count;             /* client connections served by the thread */
+    unsigned int loop_busy;     /* % of the last second spent running conns */
+    uint64_t migrated_in;
+    uint64_t migrated_out;
+    /* Only updated by the thread itself */
+    uint64_t busy_usec;         /* total time spent running connections */
+    uint64_t last_busy_usec;    /* busy_usec at the last load update */
+    rel_time_t last_migration;
+    unsigned int buffers_free[CONN_BUFFER_CLASSES]; /* in buffer_cache */
+    int64_t buffers_pinned;     /* bytes of buffers held by connections */
+    struct thread_timings timings; /* latencies per opcode */
+    struct thread_cycles cycles; /* cycles per state / engine call */
+    uint32_t slowlog_skipped;   /* requests since the last sampled one */
+    struct topclients top_peers; /* the heaviest clients by address */
+    struct topclients top_users; /* and by SASL user */
+
+    /* The io_uring and IOCP backends (-W io_uring, -W iocp) */
+    struct io_ring *ring;       /* NULL if the thread runs on plain libevent */
+    SOCKET ring_notify[2];      /* signalled on ring completions (a socketpair
+                                   or one eventfd) */
+    struct event ring_event;    /* listen event for ring completions */
+    struct event ring_flush;    /* submits everything queued in this round */
+    bool ring_flush_pending;
+
+    /* The timers of the connections (see thread_add_timer()) */
+    struct timer_wheel timers;
+    struct event timer_event;   /* due when the wheel has work to do */
+    uint64_t timer_due;         /* when timer_event fires, 0 if not armed */
+    bool running_timers;        /* in the timer callbacks (not locked) */
+    cache_t *timer_cache;
+
+    /* The idle connections (see conn_idle_reap()) */
+    struct conn_idle_list idle;        /* waiting for a request */
+    struct conn_idle_list hibernating; /* and hibernated after a while */
+    struct event idle_event;    /* runs the reaper every second */
+    uint64_t idle_kicks;        /* connections closed for being idle */
+    uint64_t hibernations;
+    uint64_t wakeups;           /* requests on hibernated connections */
 
     rel_time_t last_checked;
 } LIBEVENT_THREAD;
@@ -260,24 +461,122 @@ typedef struct {
 
 extern void notify_thread(LIBEVENT_THREAD *thread);
 extern void notify_dispatcher(void);
+extern void notify_worker_threads(void);
+extern void update_thread_listen_events(LIBEVENT_THREAD *me);
 extern bool create_notification_pipe(LIBEVENT_THREAD *me);
+extern void destroy_notification_pipe(LIBEVENT_THREAD *me);
+extern ssize_t drain_notification_pipe(LIBEVENT_THREAD *me);
+extern void thread_ring_queued(LIBEVENT_THREAD *me);
 
 typedef struct conn conn;
 typedef bool (*STATE_FUNC)(conn *);
 
+/* An item the kernel may still be sending from (see conn_zerocopy_hold()) */
+struct zerocopy_item {
+    void *item;
+    uint32_t id;    /* the item is free once this many sends completed */
+};
+
+/* The most messages a TAP stream may have waiting for an ack */
+#define TAP_FLOW_MAX_MSGS 4096
+
+/**
+ * A TAP message waiting for an ack
+ */
+struct tap_window_entry {
+    uint32_t nbytes;
+    bool engine_ack; /* the engine asked for it, so it gets the ack */
+};
+
+/**
+ * The state and statistics of a TAP stream we produce. With flow control
+ * (TAP_CONNECT_FLOW_CONTROL) every message asks for an ack, and we stop
+ * shipping when max_msgs messages or max_bytes bytes are unacked.
+ */
+struct tap_flow {
+    bool enabled;
+    uint32_t max_msgs;
+    uint32_t max_bytes;
+    struct tap_window_entry *window; /* ring of max_msgs entries */
+    uint32_t head;      /* the oldest unacked message */
+    uint32_t msgs;      /* number of unacked messages */
+    uint64_t bytes;     /* number of unacked bytes */
+
+    uint64_t connected; /* timings_now() when the stream started */
+    uint64_t sent_msgs;
+    uint64_t sent_bytes;
+    uint64_t writes;    /* number of batches of messages we wrote */
+    uint64_t acks;
+    uint64_t nacks;     /* acks with an error status */
+    uint64_t full;      /* number of times the window filled up */
+    uint64_t full_since; /* when it filled up (0 if it isn't) */
+    uint64_t waited_ns; /* time spent waiting for the consumer */
+};
+
+struct z_stream_s;
+struct tap_zbuf;
+
+/**
+ * Compression of the values in TAP mutations (zlib). On a stream we
+ * produce with TAP_CONNECT_COMPRESSION the values of at least
+ * settings.tap_compress_min bytes are deflated; on a connection sending
+ * us mutations the values with TAP_FLAG_COMPRESSED are inflated before
+ * they're handed to the engine.
+ */
+struct tap_compress {
+    bool enabled;
+    struct z_stream_s *deflate;
+    struct z_stream_s *inflate;
+    struct tap_zbuf *bufs; /* compressed values of the write in progress */
+    char *value;           /* the last value we inflated */
+    uint32_t nvalue;       /* the size of the buffer for it */
+
+    uint64_t msgs;          /* values we compressed */
+    uint64_t bytes_in;      /* their size */
+    uint64_t bytes_out;     /* their size on the wire */
+    uint64_t ns;            /* time spent compressing */
+    uint64_t inflated_msgs;
+    uint64_t inflated_bytes_in;  /* size on the wire */
+    uint64_t inflated_bytes_out;
+    uint64_t inflate_ns;
+};
+
+/**
+ * What a UDP "connection" needs besides the rest (allocated by conn_new()
+ * for the UDP sockets only)
+ */
+struct conn_udp {
+    int    request_id; /* Incoming UDP request ID */
+    struct sockaddr_storage request_addr; /* Who sent the most recent request */
+    socklen_t request_addr_size;
+    unsigned char *hdrbuf; /* udp packet headers */
+    int    hdrsize;   /* number of headers' worth of space is allocated */
+    struct udp_reader *reader; /* the datagrams read ahead (see udp.h) */
+};
+
 /**
  * The structure representing a connection into memcached.
+ *
+ * The fields the state machine goes through for every request come
+ * first, so that they share the first few cache lines; the ones used
+ * once per connection or by some of them only (timings, SASL, TAP, ...)
+ * follow.
  */
 struct conn {
     SOCKET sfd;
-    int nevents;
-    sasl_conn_t *sasl_conn;
     STATE_FUNC   state;
     enum bin_substates substate;
-    bool   registered_in_libevent;
-    struct event event;
+    enum protocol protocol;   /* which protocol this connection speaks */
+    enum network_transport transport; /* what transport is used by this connection */
+    int nevents;
     short  ev_flags;
     short  which;   /** which events were just triggered */
+    bool   noreply;   /* True if the reply should not be sent. */
+    bool ewouldblock;
+    uint8_t refcount; /* number of references to the object */
+    uint32_t ntimers; /* timers pending (they hold one reference) */
+    ENGINE_ERROR_CODE aiostat;
+    LIBEVENT_THREAD *thread; /* Pointer to the thread object serving this connection */
 
     char   *rbuf;   /** buffer to read commands into */
     char   *rcurr;  /** but if we parsed some already, this is where we stopped */
@@ -295,7 +594,8 @@ struct conn {
     char   *ritem;  /** when we read in an item's value, it goes here */
     uint32_t rlbytes;
 
-    /* data for the nread state */
+    /* data for the swallow state */
+    int    sbytes;    /* how many bytes to swallow */
 
     /**
      * item is used to hold an item structure created after reading the command
@@ -306,9 +606,13 @@ struct conn {
     void   *item;     /* for commands set/add/replace  */
     ENGINE_STORE_OPERATION    store_op; /* which one is it: set/add/replace */
 
-
-    /* data for the swallow state */
-    int    sbytes;    /* how many bytes to swallow */
+    /* Binary protocol stuff */
+    short cmd; /* current command being processed */
+    int opaque;
+    int keylen;
+    uint64_t cas; /* the cas to return */
+    /* This is where the binary header goes */
+    protocol_binary_request_header binary_header;
 
     /* data for the mwrite state */
     struct iovec *iov;
@@ -321,6 +625,13 @@ struct conn {
     int    msgcurr;   /* element in msglist[] being transmitted now */
     int    msgbytes;  /* number of bytes in current msg */
 
+    int    ncoalesced; /* responses held back to be sent with the next one */
+    uint32_t coalesced_bytes; /* the number of bytes in those responses */
+    uint32_t wcoalesced; /* the part of the write buffer (before wbuf) they use */
+    int    resp_iov;  /* first element in iov[] of the current response */
+    bool   flushing;  /* transmit() started on the current msghdrs */
+    bool   corked;  /** TCP_CORK is on (until we go back to the event loop) */
+
     item   **ilist;   /* list of items to write out */
     int    isize;
     item   **icurr;
@@ -331,20 +642,64 @@ struct conn {
     char   **suffixcurr;
     int    suffixleft;
 
-    enum protocol protocol;   /* which protocol this connection speaks */
-    enum network_transport transport; /* what transport is used by this connection */
+    /* Quiet gets looked up ahead of time through get_multi */
+    get_multi_key *mget;
+    int mget_next;    /* the entry for the next quiet get to process */
+    int mget_count;   /* the number of entries in the current batch */
 
-    /* data for UDP clients */
-    int    request_id; /* Incoming UDP request ID, if this is a UDP "connection" */
-    struct sockaddr_storage request_addr; /* Who sent the most recent request */
-    socklen_t request_addr_size;
-    unsigned char *hdrbuf; /* udp packet headers */
-    int    hdrsize;   /* number of headers' worth of space is allocated */
+    /* Quiet stores done ahead of time through store_multi */
+    struct mstore_result *mstore;
+    int mstore_next;  /* the entry for the next quiet store to process */
+    int mstore_count; /* the number of entries in the current batch */
 
-    bool   noreply;   /* True if the reply should not be sent. */
-    /* current stats command */
+    /**
+     * The rest of the value (after ritem) when the engine stores it in
+     * pieces. riov[riovcurr .. riovused - 1] are still to be read.
+     */
+    struct iovec *riov;
+    int    riovsize;
+    int    riovused;
+    int    riovcurr;
+
+    uint32_t rbytes_peak; /** most data we had in rbuf since we got it */
+    uint32_t rsize_hint;  /** size of the rbuf to take from the pool */
+    bool   rbuf_pooled;   /** rbuf came from the thread's buffer_cache */
+    bool   wbuf_pooled;
+    bool   buffers_pinned; /** rbuf and wbuf count in thread's buffers_pinned */
+
+    bool bulk;      /** served after the interactive connections (-G) */
+    uint64_t run_start; /** timings_now() when this event started */
+    bool   registered_in_libevent;
+    short  ev_priority;
+    int list_state; /* bitmask of list state data for this connection */
+    conn   *next;     /* Used for generating a list of conn structures */
+    struct event event;
 
-    uint8_t refcount; /* number of references to the object */
+    /* Timing of the current request (0 if we're not timing one) */
+    uint64_t timing_start;
+    uint64_t timing_blocked;     /** ns the request waited for the engine */
+    uint64_t timing_block_start; /** when it started waiting (or 0) */
+    uint8_t  timing_opcode;
+    /* What the slow request log wants to know (only with -w or -y) */
+    bool     timing_traced;      /** we're keeping track of all this */
+    bool     timing_sampled;     /** it's recorded whatever it takes */
+    uint16_t timing_nblocked;    /** EWOULDBLOCKs from the engine */
+    uint16_t timing_nkey;        /** length of the key (0 until we have it) */
+    char     timing_key[SLOWLOG_KEY];
+    uint32_t timing_value;       /** size of the value sent or received */
+    uint64_t timing_engine;      /** cycles spent in engine calls */
+    uint64_t timing_read;        /** ns until the whole request was in */
+
+    /* What the client did, summed up by address and user in the thread */
+    struct client_traffic traffic;        /** since it connected */
+    struct client_traffic traffic_pushed; /** what the thread has of it */
+    char peer[TOPCLIENTS_NAME];          /** its address, without the port */
+    int peer_slot;                       /** hints for topclients_add() */
+    int user_slot;
+
+    struct conn_udp *udp; /* for UDP clients (NULL for the others) */
+    struct tls_session *tls; /* for the clients of the TLS port (see tls.h) */
+    sasl_conn_t *sasl_conn;
 
     struct {
         char *buffer;
@@ -356,24 +711,67 @@ struct conn {
 
     /** Current ascii protocol */
     EXTENSION_ASCII_PROTOCOL_DESCRIPTOR *ascii_cmd;
+    char ascii_crlf[2];     /* what followed the data of a store */
+    uint16_t ascii_status;  /* of the binary command an ASCII one went to */
 
+    TAP_ITERATOR tap_iterator;
+    struct tap_flow tap_flow;
+    struct tap_compress tap_compress;
+    int parent_port; /* Listening port that creates this connection instance */
 
-    /* Binary protocol stuff */
-    /* This is where the binary header goes */
-    protocol_binary_request_header binary_header;
-    uint64_t cas; /* the cas to return */
-    short cmd; /* current command being processed */
-    int opaque;
-    int keylen;
+    /* io_uring backend */
+    bool io_pending;  /* a recv or sendmsg is in flight in the thread's ring */
+    bool io_done;     /* io_res holds the result of the last one */
+    int io_res;
+
+    /* MSG_ZEROCOPY sends (-Z) */
+    int zc_iov;       /* first iovec of the response to send without copy, or -1 */
+    bool zc_enabled;  /* SO_ZEROCOPY is set on the socket */
+    uint32_t zc_next; /* number of zero-copy sends made on the socket */
+    uint32_t zc_done; /* number of them the kernel reported as completed */
+    struct zerocopy_item *zc_items;
+    int zc_nitems;
+    int zc_isize;
+    int zc_close_wait; /* number of times conn_closing() waited for them */
+
+    /* The stats group pushed to the connection (see STATS_SUBSCRIBE) */
+    struct stats_subscription *stats_sub;
+
+    /* The idle list of its thread it's on (NULL if it's not idle) */
+    struct conn_idle_list *idle_list;
+    conn *idle_prev;
+    conn *idle_next;
+    rel_time_t idle_since;
+};
 
-    int list_state; /* bitmask of list state data for this connection */
-    conn   *next;     /* Used for generating a list of conn structures */
-    LIBEVENT_THREAD *thread; /* Pointer to the thread object serving this connection */
+/* The outcome of a quiet store done ahead of time (see conn_store_multi) */
+struct mstore_result {
+    ENGINE_ERROR_CODE status;
+    ENGINE_STORE_OPERATION operation;
+    uint64_t cas;
+    uint16_t nkey;
+    uint8_t cmd;
+};
 
-    ENGINE_ERROR_CODE aiostat;
-    bool ewouldblock;
-    TAP_ITERATOR tap_iterator;
-    int parent_port; /* Listening port that creates this connection instance */
+/* A stat the way a stats subscription pushed it last */
+struct sub_stat {
+    char *name;
+    char *value;
+    uint16_t nname;
+    uint16_t nvalue;
+};
+
+struct stats_subscription {
+    struct event timer;
+    struct timeval interval;
+    uint32_t opaque;
+    bool due;          /* a push waits for the connection to become idle */
+    struct sub_stat *stats; /* indexed by the id of the stat */
+    uint32_t nstats;
+    uint32_t size;
+    uint32_t cursor;   /* the stats arrive in the same order every time */
+    uint16_t ngroup;
+    char group[];
 };
 
 /* States for the connection list_state */
@@ -419,6 +817,29 @@ int  dispatch_event_add(int thread, conn *c);
 void dispatch_conn_new(SOCKET sfd, int parent_port,
                        STATE_FUNC init_state, int event_flags,
                        int read_buffer_size, enum network_transport transport);
+void dispatch_listen_conn(int thread, SOCKET sfd, int parent_port);
+bool dispatch_conn_migrate(conn *c);
+bool conn_detach_thread(conn *c);
+void conn_io_complete(void *arg, int res);
+void conn_attach_thread(conn *c, LIBEVENT_THREAD *thread);
+void conn_went_idle(conn *c);
+void conn_idle_reap(LIBEVENT_THREAD *thread);
+bool thread_parked(LIBEVENT_THREAD *thread);
+int threads_active(void);
+bool threads_set_active(int nthr);
+void thread_conn_opened(LIBEVENT_THREAD *thread);
+void thread_conn_closed(LIBEVENT_THREAD *thread);
+void threads_update_load(void);
+void threads_stats(ADD_STAT add_stats, conn *c);
+void threads_buffer_stats(uint64_t *pooled, int64_t *pinned);
+void threads_idle_stats(uint64_t *kicks, uint64_t *hibernating,
+                        uint64_t *hibernations, uint64_t *wakeups);
+bool threads_timings_aggregate(uint8_t opcode, struct timing_histogram *out);
+void threads_timings_reset(void);
+void threads_cycles_aggregate(struct thread_cycles *out);
+void threads_cycles_reset(void);
+struct topclient *threads_topclients(bool users, int *nclients);
+void threads_topclients_reset(void);
 
 /* Lock wrappers for cache functions that are called from main loop. */
 void accept_new_conns(const bool do_accept);
@@ -431,13 +852,16 @@ void STATS_UNLOCK(void);
 void threadlocal_stats_clear(struct thread_stats *stats);
 void threadlocal_stats_reset(struct thread_stats *thread_stats);
 void threadlocal_stats_aggregate(struct thread_stats *thread_stats, struct thread_stats *stats);
-void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out);
 
 /* Stat processing functions */
 void append_stat(const char *name, ADD_STAT add_stats, conn *c,
                  const char *fmt, ...);
 
 void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status);
+server_timer_t *thread_add_timer(const void *cookie, uint32_t msec,
+                                 TIMER_CALLBACK cb, void *cb_data);
+void thread_cancel_timer(server_timer_t *timer);
+uint64_t get_current_time_msec(void);
 void conn_set_state(conn *c, STATE_FUNC state);
 const char *state_text(STATE_FUNC state);
 void safe_close(SOCKET sfd);
@@ -477,6 +901,7 @@ bool conn_mwrite(conn *c);
 bool conn_ship_log(conn *c);
 bool conn_setup_tap_stream(conn *c);
 bool conn_refresh_isasl(conn *c);
+bool conn_tls_handshake(conn *c);
 
 /* If supported, give compiler hints for branch prediction. */
 #if !defined(__builtin_expect) && (!defined(__GNUC__) || (__GNUC__ == 2 && __GNUC_MINOR__ < 96))
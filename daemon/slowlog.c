@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The slow request log (see slowlog.h)
+ */
+#include "config.h"
+#include "slowlog.h"
+
+#include <string.h>
+
+#if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+#define slowlog_ticket(head) (atomic_add_64_nv((head), 1) - 1)
+#define slowlog_wfence() membar_producer()
+#define slowlog_rfence() membar_consumer()
+#else
+#define slowlog_ticket(head) __sync_fetch_and_add((head), 1)
+#define slowlog_wfence() __sync_synchronize()
+#define slowlog_rfence() __sync_synchronize()
+#endif
+
+/*
+ * The writer of entry n makes seq odd (2n + 1) while it copies the entry
+ * in, and 2n + 2 when it's done. A reader only takes what had the same
+ * seq before and after it copied it.
+ */
+struct slowlog_slot {
+    volatile uint64_t seq;
+    struct slowlog_entry entry;
+};
+
+static struct {
+    volatile uint64_t head;
+    struct slowlog_slot slots[SLOWLOG_SIZE];
+} slowlog;
+
+void slowlog_add(struct slowlog_entry *entry) {
+    uint64_t ticket = slowlog_ticket(&slowlog.head);
+    struct slowlog_slot *slot = &slowlog.slots[ticket % SLOWLOG_SIZE];
+
+    entry->id = ticket;
+    slot->seq = 2 * ticket + 1;
+    slowlog_wfence();
+    memcpy(&slot->entry, entry, sizeof(*entry));
+    slowlog_wfence();
+    slot->seq = 2 * ticket + 2;
+}
+
+int slowlog_read(struct slowlog_entry *out, int max) {
+    uint64_t head = slowlog.head;
+    int count = 0;
+
+    for (uint64_t ii = 0; ii < SLOWLOG_SIZE && ii < head && count < max; ++ii) {
+        uint64_t ticket = head - 1 - ii;
+        struct slowlog_slot *slot = &slowlog.slots[ticket % SLOWLOG_SIZE];
+        uint64_t seq = slot->seq;
+        if (seq != 2 * ticket + 2) {
+            /* Still being written, or overwritten already */
+            continue;
+        }
+        slowlog_rfence();
+        memcpy(&out[count], &slot->entry, sizeof(out[count]));
+        slowlog_rfence();
+        if (slot->seq == seq) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+uint64_t slowlog_count(void) {
+    return slowlog.head;
+}
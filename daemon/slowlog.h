@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The last SLOWLOG_SIZE slow (or sampled) requests. The worker threads
+ * add to the ring without taking a lock; an entry that's overwritten
+ * while somebody reads it is left out of what they get.
+ */
+#define SLOWLOG_SIZE 256
+/** The part of the key we keep */
+#define SLOWLOG_KEY 32
+#define SLOWLOG_BUCKET 32
+
+struct slowlog_entry {
+    /** the number of the entry (set by slowlog_add) */
+    uint64_t id;
+    /** when the request was done (unix time) */
+    uint64_t time;
+    uint32_t conn;
+    uint8_t opcode;
+    /** recorded because of the sampling, not because it was slow */
+    bool sampled;
+    /** the number of EWOULDBLOCKs from the engine */
+    uint16_t nblocked;
+    /** the length of the whole key (key has the first SLOWLOG_KEY bytes) */
+    uint16_t nkey;
+    char key[SLOWLOG_KEY];
+    /** the user the connection authenticated as ("" if none) */
+    char bucket[SLOWLOG_BUCKET];
+    uint32_t value_size;
+    /** from the header until the response was queued */
+    uint64_t total_ns;
+    /** time spent in engine calls */
+    uint64_t engine_ns;
+    /** time spent waiting for the engine to complete an EWOULDBLOCK */
+    uint64_t blocked_ns;
+    /** time until the whole request was read (sampled requests only) */
+    uint64_t read_ns;
+};
+
+void slowlog_add(struct slowlog_entry *entry);
+
+/**
+ * Copy the entries in the ring to out, newest first
+ *
+ * @return the number of entries copied
+ */
+int slowlog_read(struct slowlog_entry *out, int max);
+
+/**
+ * The number of entries ever added
+ */
+uint64_t slowlog_count(void);
+
+#endif
@@ -13,61 +13,111 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stddef.h>
 
 /*
- * Stats are tracked on the basis of key prefixes. This is a simple
- * fixed-size hash of prefixes; we run the prefixes through the same
- * CRC function used by the cache hashtable.
+ * Stats are tracked on the basis of key prefixes. Every thread recording
+ * them has a table of its own (the worker threads never wait for each
+ * other), holding at most PREFIX_TABLE_SIZE prefixes: when a new one shows
+ * up in a full table it takes the place of the one with the fewest
+ * requests and inherits its counts (the "space saving" algorithm, as in
+ * topclients.h), so the busy prefixes are always there and a count is
+ * overestimated by no more than the error we report with it. The tables
+ * are merged when somebody asks for the stats.
  */
+#define PREFIX_TABLE_SIZE 256
+#define PREFIX_HASH_SIZE 512
+
 typedef struct _prefix_stats PREFIX_STATS;
 struct _prefix_stats {
-    char         *prefix;
-    size_t        prefix_len;
     uint64_t      num_gets;
     uint64_t      num_sets;
     uint64_t      num_deletes;
     uint64_t      num_hits;
-    PREFIX_STATS *next;
+    /** how many of the requests may belong to the prefixes it displaced */
+    uint64_t      error;
+    uint32_t      hash;
+    /** the next one in the hash chain, -1 for none */
+    int           next;
+    size_t        prefix_len;
+    char          prefix[KEY_MAX_LENGTH + 1];
 };
 
-#define PREFIX_HASH_SIZE 256
+struct prefix_table {
+    /** protects the table from stats_prefix_dump() and _clear() */
+    pthread_mutex_t mutex;
+    struct prefix_table *next;
+    int nused;
+    int buckets[PREFIX_HASH_SIZE];
+    PREFIX_STATS prefixes[PREFIX_TABLE_SIZE];
+};
+
+/* The tables of all of the threads */
+static pthread_mutex_t prefix_tables_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct prefix_table *prefix_tables;
+static __thread struct prefix_table *thread_prefixes;
 
-static PREFIX_STATS *prefix_stats[PREFIX_HASH_SIZE];
-static int num_prefixes = 0;
-static int total_prefix_size = 0;
+static void prefix_table_clear(struct prefix_table *t) {
+    t->nused = 0;
+    for (int ii = 0; ii < PREFIX_HASH_SIZE; ++ii) {
+        t->buckets[ii] = -1;
+    }
+}
 
 void stats_prefix_init() {
-    memset(prefix_stats, 0, sizeof(prefix_stats));
 }
 
 /*
- * Cleans up all our previously collected stats. NOTE: the stats lock is
- * assumed to be held when this is called.
+ * Cleans up all our previously collected stats.
  */
 void stats_prefix_clear() {
-    int i;
-
-    for (i = 0; i < PREFIX_HASH_SIZE; i++) {
-        PREFIX_STATS *cur, *next;
-        for (cur = prefix_stats[i]; cur != NULL; cur = next) {
-            next = cur->next;
-            free(cur->prefix);
-            free(cur);
+    pthread_mutex_lock(&prefix_tables_mutex);
+    for (struct prefix_table *t = prefix_tables; t != NULL; t = t->next) {
+        pthread_mutex_lock(&t->mutex);
+        prefix_table_clear(t);
+        pthread_mutex_unlock(&t->mutex);
+    }
+    pthread_mutex_unlock(&prefix_tables_mutex);
+}
+
+static struct prefix_table *get_prefix_table(void) {
+    if (thread_prefixes == NULL) {
+        struct prefix_table *t = malloc(sizeof(*t));
+        if (t == NULL) {
+            return NULL;
         }
-        prefix_stats[i] = NULL;
+        pthread_mutex_init(&t->mutex, NULL);
+        prefix_table_clear(t);
+
+        pthread_mutex_lock(&prefix_tables_mutex);
+        t->next = prefix_tables;
+        prefix_tables = t;
+        pthread_mutex_unlock(&prefix_tables_mutex);
+        thread_prefixes = t;
     }
-    num_prefixes = 0;
-    total_prefix_size = 0;
+    return thread_prefixes;
 }
 
 /*
- * Returns the stats structure for a prefix, creating it if it's not already
- * in the list.
+ * Take the prefix out of the hash chain it's in
+ */
+static void prefix_unlink(struct prefix_table *t, int slot) {
+    int *pos = &t->buckets[t->prefixes[slot].hash % PREFIX_HASH_SIZE];
+    while (*pos != slot) {
+        assert(*pos != -1);
+        pos = &t->prefixes[*pos].next;
+    }
+    *pos = t->prefixes[slot].next;
+}
+
+/*
+ * Returns the stats structure for a prefix in the table of the calling
+ * thread (locked), making room for it if it's not already there. Returns
+ * NULL if the key has no prefix.
  */
 /*@null@*/
-static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey) {
-    PREFIX_STATS *pfs;
-    uint32_t hashval;
+static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey,
+                                       struct prefix_table **table) {
     size_t length;
     bool bailout = true;
 
@@ -80,39 +130,54 @@ static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey) {
         }
     }
 
-    if (bailout) {
+    struct prefix_table *t;
+    if (bailout || length > KEY_MAX_LENGTH ||
+        (t = get_prefix_table()) == NULL) {
         return NULL;
     }
 
-    hashval = hash(key, length, 0) % PREFIX_HASH_SIZE;
+    uint32_t hashval = hash(key, length, 0);
+    pthread_mutex_lock(&t->mutex);
+    *table = t;
 
-    for (pfs = prefix_stats[hashval]; NULL != pfs; pfs = pfs->next) {
-        if (strncmp(pfs->prefix, key, length) == 0)
+    int *bucket = &t->buckets[hashval % PREFIX_HASH_SIZE];
+    for (int slot = *bucket; slot != -1; slot = t->prefixes[slot].next) {
+        PREFIX_STATS *pfs = &t->prefixes[slot];
+        if (pfs->hash == hashval && pfs->prefix_len == length &&
+            memcmp(pfs->prefix, key, length) == 0) {
             return pfs;
+        }
     }
 
-    pfs = calloc(sizeof(PREFIX_STATS), 1);
-    if (NULL == pfs) {
-        perror("Can't allocate space for stats structure: calloc");
-        return NULL;
-    }
-
-    pfs->prefix = malloc(length + 1);
-    if (NULL == pfs->prefix) {
-        perror("Can't allocate space for copy of prefix: malloc");
-        free(pfs);
-        return NULL;
+    int slot;
+    PREFIX_STATS *pfs;
+    if (t->nused < PREFIX_TABLE_SIZE) {
+        slot = t->nused++;
+        pfs = &t->prefixes[slot];
+        memset(pfs, 0, offsetof(PREFIX_STATS, prefix));
+    } else {
+        /* Replace the one with the fewest requests, keeping its counts */
+        slot = 0;
+        uint64_t fewest = UINT64_MAX;
+        for (int ii = 0; ii < PREFIX_TABLE_SIZE; ++ii) {
+            PREFIX_STATS *p = &t->prefixes[ii];
+            uint64_t total = p->num_gets + p->num_sets + p->num_deletes;
+            if (total < fewest) {
+                fewest = total;
+                slot = ii;
+            }
+        }
+        prefix_unlink(t, slot);
+        pfs = &t->prefixes[slot];
+        pfs->error = fewest;
     }
 
-    strncpy(pfs->prefix, key, length);
-    pfs->prefix[length] = '\0';      /* because strncpy() sucks */
+    memcpy(pfs->prefix, key, length);
+    pfs->prefix[length] = '\0';
     pfs->prefix_len = length;
-
-    pfs->next = prefix_stats[hashval];
-    prefix_stats[hashval] = pfs;
-
-    num_prefixes++;
-    total_prefix_size += length;
+    pfs->hash = hashval;
+    pfs->next = *bucket;
+    *bucket = slot;
 
     return pfs;
 }
@@ -121,45 +186,45 @@ static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey) {
  * Records a "get" of a key.
  */
 void stats_prefix_record_get(const char *key, const size_t nkey, const bool is_hit) {
-    PREFIX_STATS *pfs;
-
-    STATS_LOCK();
-    pfs = stats_prefix_find(key, nkey);
+    struct prefix_table *t;
+    PREFIX_STATS *pfs = stats_prefix_find(key, nkey, &t);
     if (NULL != pfs) {
         pfs->num_gets++;
         if (is_hit) {
             pfs->num_hits++;
         }
+        pthread_mutex_unlock(&t->mutex);
     }
-    STATS_UNLOCK();
 }
 
 /*
  * Records a "delete" of a key.
  */
 void stats_prefix_record_delete(const char *key, const size_t nkey) {
-    PREFIX_STATS *pfs;
-
-    STATS_LOCK();
-    pfs = stats_prefix_find(key, nkey);
+    struct prefix_table *t;
+    PREFIX_STATS *pfs = stats_prefix_find(key, nkey, &t);
     if (NULL != pfs) {
         pfs->num_deletes++;
+        pthread_mutex_unlock(&t->mutex);
     }
-    STATS_UNLOCK();
 }
 
 /*
  * Records a "set" of a key.
  */
 void stats_prefix_record_set(const char *key, const size_t nkey) {
-    PREFIX_STATS *pfs;
-
-    STATS_LOCK();
-    pfs = stats_prefix_find(key, nkey);
+    struct prefix_table *t;
+    PREFIX_STATS *pfs = stats_prefix_find(key, nkey, &t);
     if (NULL != pfs) {
         pfs->num_sets++;
+        pthread_mutex_unlock(&t->mutex);
     }
-    STATS_UNLOCK();
+}
+
+static int prefix_compare(const void *a, const void *b) {
+    const PREFIX_STATS *pa = *(const PREFIX_STATS * const *)a;
+    const PREFIX_STATS *pb = *(const PREFIX_STATS * const *)b;
+    return strcmp(pa->prefix, pb->prefix);
 }
 
 /*
@@ -167,11 +232,62 @@ void stats_prefix_record_set(const char *key, const size_t nkey) {
  */
 /*@null@*/
 char *stats_prefix_dump(int *length) {
-    const char *format = "PREFIX %s get %llu hit %llu set %llu del %llu\r\n";
-    PREFIX_STATS *pfs;
-    char *buf;
-    int i, pos;
-    size_t size = 0, written = 0, total_written = 0;
+    const char *format = "PREFIX %s get %llu hit %llu set %llu del %llu";
+    const char *error_format = " error %llu";
+    PREFIX_STATS *merged = NULL;
+    PREFIX_STATS **sorted = NULL;
+    int nmerged = 0;
+    char *buf = NULL;
+
+    /*
+     * Copy the prefixes of all of the tables (every table is locked
+     * while we copy it) and add up the ones of the same name
+     */
+    pthread_mutex_lock(&prefix_tables_mutex);
+    int ntables = 0;
+    for (struct prefix_table *t = prefix_tables; t != NULL; t = t->next) {
+        ++ntables;
+    }
+    if (ntables > 0) {
+        merged = malloc(sizeof(PREFIX_STATS) * ntables * PREFIX_TABLE_SIZE);
+        sorted = malloc(sizeof(PREFIX_STATS *) * ntables * PREFIX_TABLE_SIZE);
+        if (merged == NULL || sorted == NULL) {
+            pthread_mutex_unlock(&prefix_tables_mutex);
+            perror("Can't allocate stats response: malloc");
+            free(merged);
+            free(sorted);
+            return NULL;
+        }
+    }
+    for (struct prefix_table *t = prefix_tables; t != NULL; t = t->next) {
+        pthread_mutex_lock(&t->mutex);
+        memcpy(merged + nmerged, t->prefixes, sizeof(PREFIX_STATS) * t->nused);
+        nmerged += t->nused;
+        pthread_mutex_unlock(&t->mutex);
+    }
+    pthread_mutex_unlock(&prefix_tables_mutex);
+
+    for (int ii = 0; ii < nmerged; ++ii) {
+        sorted[ii] = &merged[ii];
+    }
+    qsort(sorted, nmerged, sizeof(PREFIX_STATS *), prefix_compare);
+    int nprefixes = 0;
+    size_t total_prefix_size = 0;
+    for (int ii = 0; ii < nmerged; ++ii) {
+        PREFIX_STATS *pfs = sorted[ii];
+        if (nprefixes > 0 &&
+            strcmp(sorted[nprefixes - 1]->prefix, pfs->prefix) == 0) {
+            PREFIX_STATS *to = sorted[nprefixes - 1];
+            to->num_gets += pfs->num_gets;
+            to->num_hits += pfs->num_hits;
+            to->num_sets += pfs->num_sets;
+            to->num_deletes += pfs->num_deletes;
+            to->error += pfs->error;
+        } else {
+            sorted[nprefixes++] = pfs;
+            total_prefix_size += pfs->prefix_len;
+        }
+    }
 
     /*
      * Figure out how big the buffer needs to be. This is the sum of the
@@ -179,34 +295,41 @@ char *stats_prefix_dump(int *length) {
      * the per-prefix output with 20-digit values for all the counts,
      * plus space for the "END" at the end.
      */
-    STATS_LOCK();
-    size = strlen(format) + total_prefix_size +
-           num_prefixes * (strlen(format) - 2 /* %s */
-                           + 4 * (20 - 4)) /* %llu replaced by 20-digit num */
+    size_t size = total_prefix_size +
+           nprefixes * (strlen(format) + strlen(error_format) + 2
+                        - 2 /* %s */
+                        + 5 * (20 - 4)) /* %llu replaced by 20-digit num */
                            + sizeof("END\r\n");
     buf = malloc(size);
     if (NULL == buf) {
         perror("Can't allocate stats response: malloc");
-        STATS_UNLOCK();
+        free(merged);
+        free(sorted);
         return NULL;
     }
 
-    pos = 0;
-    for (i = 0; i < PREFIX_HASH_SIZE; i++) {
-        for (pfs = prefix_stats[i]; NULL != pfs; pfs = pfs->next) {
-            written = snprintf(buf + pos, size-pos, format,
-                           pfs->prefix, pfs->num_gets, pfs->num_hits,
-                           pfs->num_sets, pfs->num_deletes);
-            pos += written;
-            total_written += written;
-            assert(total_written < size);
+    size_t pos = 0;
+    for (int ii = 0; ii < nprefixes; ++ii) {
+        PREFIX_STATS *pfs = sorted[ii];
+        pos += snprintf(buf + pos, size - pos, format, pfs->prefix,
+                        (unsigned long long)pfs->num_gets,
+                        (unsigned long long)pfs->num_hits,
+                        (unsigned long long)pfs->num_sets,
+                        (unsigned long long)pfs->num_deletes);
+        if (pfs->error != 0) {
+            pos += snprintf(buf + pos, size - pos, error_format,
+                            (unsigned long long)pfs->error);
         }
+        memcpy(buf + pos, "\r\n", 2);
+        pos += 2;
+        assert(pos < size);
     }
+    free(merged);
+    free(sorted);
 
-    STATS_UNLOCK();
     memcpy(buf + pos, "END\r\n", 6);
 
-    *length = pos + 5;
+    *length = (int)pos + 5;
     return buf;
 }
 
@@ -0,0 +1,230 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The task pools of the server (see taskpool.h)
+ */
+#include "config.h"
+#include "taskpool.h"
+#include "timings.h"
+
+#include <assert.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct task {
+    struct task *next;
+    const void *cookie;
+    TASK_FUNC fn;
+    void *arg;
+    /** when it was submitted (timings_now()) */
+    uint64_t submitted;
+};
+
+struct taskpool_thread {
+    struct taskpool *pool;
+    int index;
+};
+
+/* The queue a submitter puts its tasks in (the same one every time) */
+static __thread int submitter = -1;
+static int nsubmitters;
+
+static void queue_push(struct task_queue *q, struct task *t) {
+    t->next = NULL;
+    pthread_mutex_lock(&q->mutex);
+    if (q->tail == NULL) {
+        q->head = t;
+    } else {
+        q->tail->next = t;
+    }
+    q->tail = t;
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static struct task *queue_pop(struct task_queue *q) {
+    pthread_mutex_lock(&q->mutex);
+    struct task *t = q->head;
+    if (t != NULL) {
+        q->head = t->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return t;
+}
+
+/*
+ * Our own queue first, then the ones of the other threads
+ */
+static struct task *taskpool_take(struct taskpool *pool, int me,
+                                  bool *stolen) {
+    for (int ii = 0; ii < pool->nthreads; ++ii) {
+        struct task *t = queue_pop(&pool->queues[(me + ii) % pool->nthreads]);
+        if (t != NULL) {
+            *stolen = ii != 0;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void *taskpool_main(void *arg) {
+    struct taskpool_thread *thread = arg;
+    struct taskpool *pool = thread->pool;
+    int me = thread->index;
+    free(thread);
+
+    if (pool->thread_init != NULL) {
+        pool->thread_init();
+    }
+
+    while (true) {
+        bool stolen;
+        struct task *t = taskpool_take(pool, me, &stolen);
+        uint64_t start = timings_now();
+
+        pthread_mutex_lock(&pool->lock);
+        if (t == NULL) {
+            if (pool->stats.queued == 0) {
+                if (pool->shutdown) {
+                    pthread_mutex_unlock(&pool->lock);
+                    break;
+                }
+                ++pool->idle;
+                pthread_cond_wait(&pool->cond, &pool->lock);
+                --pool->idle;
+                pthread_mutex_unlock(&pool->lock);
+            } else {
+                /* The submitter is about to put it in its queue */
+                pthread_mutex_unlock(&pool->lock);
+                sched_yield();
+            }
+            continue;
+        }
+        --pool->stats.queued;
+        pool->stats.wait_ns += start - t->submitted;
+        if (stolen) {
+            ++pool->stats.stolen;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        ENGINE_ERROR_CODE status = t->fn(t->cookie, t->arg);
+        uint64_t elapsed = timings_now() - start;
+        __sync_add_and_fetch(&pool->stats.run_ns, elapsed);
+        __sync_add_and_fetch(&pool->stats.completed, 1);
+
+        pool->done(t->cookie, status);
+        free(t);
+    }
+
+    return NULL;
+}
+
+bool taskpool_init(struct taskpool *pool, const char *name, int nthreads,
+                   uint32_t max_queued, TASK_DONE done,
+                   void (*thread_init)(void)) {
+    memset(pool, 0, sizeof(*pool));
+    pool->name = name;
+    pool->max_queued = max_queued;
+    pool->done = done;
+    pool->thread_init = thread_init;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    if (nthreads == 0) {
+        return true;
+    }
+
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    pool->queues = calloc(nthreads, sizeof(struct task_queue));
+    if (pool->threads == NULL || pool->queues == NULL) {
+        free(pool->threads);
+        free(pool->queues);
+        return false;
+    }
+    for (int ii = 0; ii < nthreads; ++ii) {
+        pthread_mutex_init(&pool->queues[ii].mutex, NULL);
+    }
+
+    for (int ii = 0; ii < nthreads; ++ii) {
+        struct taskpool_thread *thread = malloc(sizeof(*thread));
+        if (thread == NULL) {
+            taskpool_destroy(pool);
+            return false;
+        }
+        thread->pool = pool;
+        thread->index = ii;
+        if (pthread_create(&pool->threads[ii], NULL, taskpool_main,
+                           thread) != 0) {
+            free(thread);
+            taskpool_destroy(pool);
+            return false;
+        }
+        /* Count it now: taskpool_destroy() joins the ones started */
+        pool->nthreads = ii + 1;
+    }
+    return true;
+}
+
+void taskpool_destroy(struct taskpool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int ii = 0; ii < pool->nthreads; ++ii) {
+        pthread_join(pool->threads[ii], NULL);
+    }
+    free(pool->threads);
+    free(pool->queues);
+    pool->threads = NULL;
+    pool->queues = NULL;
+    pool->nthreads = 0;
+}
+
+ENGINE_ERROR_CODE taskpool_submit(struct taskpool *pool, const void *cookie,
+                                  TASK_FUNC fn, void *arg) {
+    if (pool->nthreads == 0) {
+        return ENGINE_ENOTSUP;
+    }
+
+    struct task *t = malloc(sizeof(*t));
+    if (t == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    t->cookie = cookie;
+    t->fn = fn;
+    t->arg = arg;
+    t->submitted = timings_now();
+
+    if (submitter == -1) {
+        submitter = __sync_fetch_and_add(&nsubmitters, 1);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->shutdown || pool->stats.queued >= pool->max_queued) {
+        ++pool->stats.rejected;
+        pthread_mutex_unlock(&pool->lock);
+        free(t);
+        return ENGINE_TMPFAIL;
+    }
+    if (++pool->stats.queued > pool->stats.max_queued) {
+        pool->stats.max_queued = pool->stats.queued;
+    }
+    ++pool->stats.submitted;
+    if (pool->idle > 0) {
+        pthread_cond_signal(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    queue_push(&pool->queues[submitter % pool->nthreads], t);
+    return ENGINE_EWOULDBLOCK;
+}
+
+void taskpool_get_stats(struct taskpool *pool, struct taskpool_stats *stats) {
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+    stats->completed = __sync_add_and_fetch(&pool->stats.completed, 0);
+    stats->run_ns = __sync_add_and_fetch(&pool->stats.run_ns, 0);
+}
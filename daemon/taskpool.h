@@ -0,0 +1,92 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <memcached/engine.h>
+
+/*
+ * A pool of threads running the tasks the engines hand us with
+ * submit_task() (see server_api.h). Every thread of the pool has a queue
+ * of its own, and a submitter sticks to one of them (the worker threads
+ * are spread over the queues), so the submitters and the pool threads
+ * don't all meet on one lock. A pool thread that runs out of tasks takes
+ * them from the queues of the others before it goes to sleep.
+ */
+
+/** Called with the status of a task once it has run */
+typedef void (*TASK_DONE)(const void *cookie, ENGINE_ERROR_CODE status);
+
+struct task;
+
+struct task_queue {
+    pthread_mutex_t mutex;
+    struct task *head;
+    struct task *tail;
+} __attribute__((aligned(64)));
+
+struct taskpool_stats {
+    /** what's in the queues now, and the most there ever was */
+    uint32_t queued;
+    uint32_t max_queued;
+    uint64_t submitted;
+    uint64_t completed;
+    /** tasks taken from the queue of another thread */
+    uint64_t stolen;
+    /** tasks refused because the pool was full */
+    uint64_t rejected;
+    /** time the tasks spent in the queues, and running */
+    uint64_t wait_ns;
+    uint64_t run_ns;
+};
+
+struct taskpool {
+    const char *name;
+    int nthreads;
+    uint32_t max_queued;
+    TASK_DONE done;
+    void (*thread_init)(void);
+    pthread_t *threads;
+    struct task_queue *queues;
+
+    /** Protects the fields below */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int idle;
+    bool shutdown;
+    struct taskpool_stats stats;
+};
+
+/**
+ * Start the threads of a pool
+ *
+ * @param name the name of the pool (in the stats)
+ * @param nthreads the number of threads (0 for a pool refusing tasks)
+ * @param max_queued the most tasks we keep in the queues
+ * @param done called for every task that has run
+ * @param thread_init called by every thread when it starts (may be NULL)
+ * @return false if we failed to start them
+ */
+bool taskpool_init(struct taskpool *pool, const char *name, int nthreads,
+                   uint32_t max_queued, TASK_DONE done,
+                   void (*thread_init)(void));
+
+/**
+ * Stop the threads once they've run the tasks queued
+ */
+void taskpool_destroy(struct taskpool *pool);
+
+/**
+ * Queue a task
+ *
+ * @return ENGINE_EWOULDBLOCK if it's queued (see submit_task())
+ */
+ENGINE_ERROR_CODE taskpool_submit(struct taskpool *pool, const void *cookie,
+                                  TASK_FUNC fn, void *arg);
+
+void taskpool_get_stats(struct taskpool *pool, struct taskpool_stats *stats);
+
+#endif
@@ -4,6 +4,7 @@
  */
 #include "config.h"
 #include "memcached.h"
+#include "affinity.h"
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
@@ -14,6 +15,9 @@
 #include <signal.h>
 #include <pthread.h>
 #include <fcntl.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #define ITEMS_PER_ALLOC 64
 
@@ -29,16 +33,19 @@ struct conn_queue_item {
     int               event_flags;
     int               read_buffer_size;
     enum network_transport     transport;
+    conn             *conn;     /* An existing connection moving threads */
     CQ_ITEM          *next;
 };
 
-/* A connection queue. */
+/*
+ * A connection queue. Any thread may push items onto the head of the
+ * list with a CAS, while the thread owning the queue takes the whole
+ * list at once and keeps it (in FIFO order) in items.
+ */
 typedef struct conn_queue CQ;
 struct conn_queue {
-    CQ_ITEM *head;
-    CQ_ITEM *tail;
-    pthread_mutex_t lock;
-    pthread_cond_t  cond;
+    CQ_ITEM *volatile head;
+    CQ_ITEM *items;
 };
 
 /* Connection lock around accepting new connections */
@@ -75,29 +82,35 @@ static void thread_libevent_process(int fd, short which, void *arg);
  * Initializes a connection queue.
  */
 static void cq_init(CQ *cq) {
-    pthread_mutex_init(&cq->lock, NULL);
-    pthread_cond_init(&cq->cond, NULL);
     cq->head = NULL;
-    cq->tail = NULL;
+    cq->items = NULL;
 }
 
 /*
  * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
+ * one. This may only be called by the thread owning the queue.
  * Returns the item, or NULL if no item is available
  */
 static CQ_ITEM *cq_pop(CQ *cq) {
-    CQ_ITEM *item;
-
-    pthread_mutex_lock(&cq->lock);
-    item = cq->head;
-    if (NULL != item) {
-        cq->head = item->next;
-        if (NULL == cq->head)
-            cq->tail = NULL;
+    if (cq->items == NULL && cq->head != NULL) {
+        CQ_ITEM *list;
+        do {
+            list = cq->head;
+        } while (!ATOMIC_CAS_PTR(&cq->head, list, NULL));
+
+        /* The list is in LIFO order */
+        while (list != NULL) {
+            CQ_ITEM *next = list->next;
+            list->next = cq->items;
+            cq->items = list;
+            list = next;
+        }
     }
-    pthread_mutex_unlock(&cq->lock);
 
+    CQ_ITEM *item = cq->items;
+    if (item != NULL) {
+        cq->items = item->next;
+    }
     return item;
 }
 
@@ -105,16 +118,11 @@ static CQ_ITEM *cq_pop(CQ *cq) {
  * Adds an item to a connection queue.
  */
 static void cq_push(CQ *cq, CQ_ITEM *item) {
-    item->next = NULL;
-
-    pthread_mutex_lock(&cq->lock);
-    if (NULL == cq->tail)
-        cq->head = item;
-    else
-        cq->tail->next = item;
-    cq->tail = item;
-    pthread_cond_signal(&cq->cond);
-    pthread_mutex_unlock(&cq->lock);
+    CQ_ITEM *head;
+    do {
+        head = cq->head;
+        item->next = head;
+    } while (!ATOMIC_CAS_PTR(&cq->head, head, item));
 }
 
 /*
@@ -185,10 +193,9 @@ static void create_worker(void *(*func)(void *), void *arg, pthread_t *id) {
 
 /****************************** LIBEVENT THREADS *****************************/
 
-bool create_notification_pipe(LIBEVENT_THREAD *me)
-{
+static bool create_socketpair(SOCKET *fds) {
     if (evutil_socketpair(SOCKETPAIR_AF, SOCK_STREAM, 0,
-                          (void*)me->notify) == SOCKET_ERROR) {
+                          (void*)fds) == SOCKET_ERROR) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                                         "Can't create notify pipe: %s",
                                         strerror(errno));
@@ -197,22 +204,95 @@ bool create_notification_pipe(LIBEVENT_THREAD *me)
 
     for (int j = 0; j < 2; ++j) {
         int flags = 1;
-        setsockopt(me->notify[j], IPPROTO_TCP,
+        setsockopt(fds[j], IPPROTO_TCP,
                    TCP_NODELAY, (void *)&flags, sizeof(flags));
-        setsockopt(me->notify[j], SOL_SOCKET,
+        setsockopt(fds[j], SOL_SOCKET,
                    SO_REUSEADDR, (void *)&flags, sizeof(flags));
 
 
-        if (evutil_make_socket_nonblocking(me->notify[j]) == -1) {
+        if (evutil_make_socket_nonblocking(fds[j]) == -1) {
             settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                                             "Failed to enable non-blocking: %s",
                                             strerror(errno));
+            safe_close(fds[0]);
+            safe_close(fds[1]);
             return false;
         }
     }
     return true;
 }
 
+/*
+ * On Linux the notifications go through an eventfd, where a read returns
+ * the number of notifications since the last read. Elsewhere we use a
+ * socketpair and send a byte per notification.
+ */
+bool create_notification_pipe(LIBEVENT_THREAD *me)
+{
+    me->notify_pending = 0;
+#ifdef HAVE_SYS_EVENTFD_H
+    int efd = eventfd(0, EFD_NONBLOCK);
+    if (efd != -1) {
+        me->notify[0] = me->notify[1] = efd;
+        return true;
+    }
+#endif
+
+    return create_socketpair(me->notify);
+}
+
+void destroy_notification_pipe(LIBEVENT_THREAD *me) {
+    if (me->notify[0] == me->notify[1]) {
+        close(me->notify[0]);
+    } else {
+        safe_close(me->notify[0]);
+        safe_close(me->notify[1]);
+    }
+}
+
+/*
+ * Read all of the pending notifications.
+ * Returns the number of notifications read (or -1 if there was none)
+ */
+ssize_t drain_notification_pipe(LIBEVENT_THREAD *me) {
+#ifdef HAVE_SYS_EVENTFD_H
+    if (me->notify[0] == me->notify[1]) {
+        uint64_t count;
+        if (read(me->notify[0], &count, sizeof(count)) != sizeof(count)) {
+            return -1;
+        }
+        return (ssize_t)count;
+    }
+#endif
+
+    ssize_t total = -1;
+    ssize_t nr;
+    while ((nr = recv(me->notify[0], devnull, sizeof(devnull), 0)) > 0) {
+        total = (total == -1) ? nr : total + nr;
+    }
+    return total;
+}
+
+static void send_notification(LIBEVENT_THREAD *thread) {
+#ifdef HAVE_SYS_EVENTFD_H
+    if (thread->notify[0] == thread->notify[1]) {
+        uint64_t one = 1;
+        if (write(thread->notify[1], &one, sizeof(one)) != sizeof(one)) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "Failed to notify thread: %s",
+                                            strerror(errno));
+        }
+        return;
+    }
+#endif
+
+    if (send(thread->notify[1], "", 1, 0) != 1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to notify thread: %s",
+                                        strerror(errno));
+    }
+}
+
 static void setup_dispatcher(struct event_base *main_base,
                              void (*dispatcher_callback)(int, short, void *))
 {
@@ -225,7 +305,7 @@ static void setup_dispatcher(struct event_base *main_base,
     }
     /* Listen for notifications from other threads */
     event_set(&dispatcher_thread.notify_event, dispatcher_thread.notify[0],
-              EV_READ | EV_PERSIST, dispatcher_callback, &dispatcher_callback);
+              EV_READ | EV_PERSIST, dispatcher_callback, &dispatcher_thread);
     event_base_set(dispatcher_thread.base, &dispatcher_thread.notify_event);
 
     if (event_add(&dispatcher_thread.notify_event, 0) == -1) {
@@ -235,13 +315,159 @@ static void setup_dispatcher(struct event_base *main_base,
     }
 }
 
+/*
+ * The timers of the connections. Every worker thread keeps them in a
+ * timer wheel ticking in milliseconds (get_current_time_msec()), with a
+ * libevent timer on its base due when the wheel has something to do.
+ * The timers of a connection hold one reference on it between them.
+ */
+struct server_timer {
+    struct timer_entry entry; /* first: the wheel hands us this */
+    conn *c;
+    TIMER_CALLBACK cb;
+    void *cb_data;
+};
+
+static void thread_arm_timers(LIBEVENT_THREAD *me) {
+    uint64_t next = timer_wheel_next(&me->timers);
+    if (next == UINT64_MAX) {
+        if (me->timer_due != 0) {
+            evtimer_del(&me->timer_event);
+            me->timer_due = 0;
+        }
+        return;
+    }
+
+    uint64_t due = me->timers.now + next;
+    if (me->timer_due != 0 && me->timer_due <= due) {
+        return;
+    }
+
+    uint64_t now = get_current_time_msec();
+    uint64_t delay = due > now ? due - now : 0;
+    struct timeval tv = {
+        .tv_sec = (long)(delay / 1000),
+        .tv_usec = (long)(delay % 1000) * 1000
+    };
+    evtimer_add(&me->timer_event, &tv);
+    me->timer_due = due;
+}
+
+/*
+ * A timer of the connection fired or was cancelled. We're on the thread
+ * of the connection, holding its lock unless we're running the timers.
+ */
+static void conn_timer_done(conn *c) {
+    LIBEVENT_THREAD *thr = c->thread;
+    if (--c->ntimers > 0) {
+        return;
+    }
+
+    if (thr->running_timers) {
+        LOCK_THREAD(thr);
+    }
+    --c->refcount;
+    int notify = 0;
+    if (c->refcount == 1 && c->state == conn_pending_close) {
+        /* It was waiting for us to go away */
+        notify = add_conn_to_pending_io_list(c);
+    }
+    if (thr->running_timers) {
+        UNLOCK_THREAD(thr);
+    }
+
+    if (notify) {
+        notify_thread(thr);
+    }
+}
+
+static void thread_timer_fire(struct timer_entry *entry, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    server_timer_t *timer = (server_timer_t *)entry;
+    conn *c = timer->c;
+
+    timer->cb(c, timer->cb_data);
+    cache_free(me->timer_cache, timer);
+    conn_timer_done(c);
+}
+
+static void thread_timers_process(int fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    me->timer_due = 0;
+    me->running_timers = true;
+    timer_wheel_advance(&me->timers, get_current_time_msec(),
+                        thread_timer_fire, me);
+    me->running_timers = false;
+    thread_arm_timers(me);
+}
+
+server_timer_t *thread_add_timer(const void *cookie, uint32_t msec,
+                                 TIMER_CALLBACK cb, void *cb_data) {
+    conn *c = (conn *)cookie;
+    assert(c);
+    LIBEVENT_THREAD *thr = c->thread;
+    if (thr == NULL || thr->timer_cache == NULL) {
+        /* Not served by a worker thread */
+        return NULL;
+    }
+    assert(pthread_equal(pthread_self(), thr->thread_id));
+
+    server_timer_t *timer = cache_alloc(thr->timer_cache);
+    if (timer == NULL) {
+        return NULL;
+    }
+    timer->entry.armed = false;
+    timer->c = c;
+    timer->cb = cb;
+    timer->cb_data = cb_data;
+
+    uint64_t now = get_current_time_msec();
+    if (thr->timers.count == 0) {
+        /* Catch up with the time the wheel was idle (nothing fires) */
+        timer_wheel_advance(&thr->timers, now, thread_timer_fire, thr);
+    }
+    timer_wheel_add(&thr->timers, &timer->entry, now + msec);
+    if (c->ntimers++ == 0) {
+        ++c->refcount;
+    }
+    thread_arm_timers(thr);
+
+    return timer;
+}
+
+void thread_cancel_timer(server_timer_t *timer) {
+    conn *c = timer->c;
+    LIBEVENT_THREAD *thr = c->thread;
+    assert(pthread_equal(pthread_self(), thr->thread_id));
+
+    if (!timer_wheel_cancel(&thr->timers, &timer->entry)) {
+        /* We're in its callback */
+        return;
+    }
+    cache_free(thr->timer_cache, timer);
+    conn_timer_done(c);
+    thread_arm_timers(thr);
+}
+
+/* Once a second with -o (see conn_idle_reap()) */
+static void thread_idle_process(int fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    conn_idle_reap(me);
+
+    struct timeval tv = { .tv_sec = 1 };
+    evtimer_add(&me->idle_event, &tv);
+}
+
 /*
  * Set up a thread's information.
  */
 static void setup_thread(LIBEVENT_THREAD *me) {
     me->type = GENERAL;
+    topclients_init(&me->top_peers);
+    topclients_init(&me->top_users);
     me->base = event_base_new();
-    if (! me->base) {
+    if (! me->base ||
+        event_base_priority_init(me->base, CONN_PRIORITIES) == -1) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                                         "Can't allocate event base\n");
         exit(1);
@@ -252,6 +478,7 @@ static void setup_thread(LIBEVENT_THREAD *me) {
               EV_READ | EV_PERSIST,
               thread_libevent_process, me);
     event_base_set(me->base, &me->notify_event);
+    event_priority_set(&me->notify_event, CONN_PRIORITY_INTERACTIVE);
 
     if (event_add(&me->notify_event, 0) == -1) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
@@ -281,6 +508,164 @@ static void setup_thread(LIBEVENT_THREAD *me) {
                                         "Failed to create suffix cache\n");
         exit(EXIT_FAILURE);
     }
+
+    for (int ii = 0; ii < CONN_BUFFER_CLASSES; ++ii) {
+        me->buffer_cache[ii] = cache_create("buffers", DATA_BUFFER_SIZE << ii,
+                                            sizeof(char*), NULL, NULL);
+        if (me->buffer_cache[ii] == NULL) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "Failed to create buffer cache\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    me->timer_cache = cache_create("timers", sizeof(server_timer_t),
+                                   sizeof(char*), NULL, NULL);
+    if (me->timer_cache == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to create timer cache\n");
+        exit(EXIT_FAILURE);
+    }
+    timer_wheel_init(&me->timers, get_current_time_msec());
+    evtimer_set(&me->timer_event, thread_timers_process, me);
+    event_base_set(me->base, &me->timer_event);
+    event_priority_set(&me->timer_event, CONN_PRIORITY_INTERACTIVE);
+
+    if (settings.idle_timeout != 0 || settings.hibernate_timeout != 0) {
+        struct timeval tv = { .tv_sec = 1 };
+        evtimer_set(&me->idle_event, thread_idle_process, me);
+        event_base_set(me->base, &me->idle_event);
+        evtimer_add(&me->idle_event, &tv);
+    }
+}
+
+/*
+ * The io_uring backend. Every worker thread owns a ring that the
+ * connections queue their recv/sendmsg requests on while the thread runs
+ * its event loop. Everything queued during one round of the loop is handed
+ * to the kernel with a single io_uring_enter() from the ring_flush event,
+ * which libevent runs after the other active events. The kernel signals
+ * the completions through an eventfd we watch like any other descriptor.
+ *
+ * The IOCP backend on Windows is driven the same way: the ring_flush event
+ * issues the overlapped WSARecv/WSASend calls queued in the round, and the
+ * thread of the completion port wakes us up through a socketpair.
+ */
+#define IO_RING_ENTRIES 256
+
+static void thread_ring_flush(int fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    me->ring_flush_pending = false;
+    if (io_ring_submit(me->ring) == -1 && errno != EAGAIN && errno != EBUSY) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to submit %s requests: %s",
+                                        io_ring_kind(),
+                                        strerror(errno));
+    }
+}
+
+static void thread_ring_process(int fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+#ifdef HAVE_SYS_EVENTFD_H
+    uint64_t count;
+    if (read(me->ring_notify[0], &count, sizeof(count)) != sizeof(count) &&
+        errno != EAGAIN) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Can't read from io_uring eventfd: %s",
+                                        strerror(errno));
+    }
+#else
+    while (recv(me->ring_notify[0], devnull, sizeof(devnull), 0) > 0) {
+        continue;
+    }
+#endif
+
+    if (memcached_shutdown) {
+         event_base_loopbreak(me->base);
+         return ;
+    }
+
+    io_ring_reap(me->ring, conn_io_complete);
+}
+
+/*
+ * Called every time a request is queued on the thread's ring
+ */
+void thread_ring_queued(LIBEVENT_THREAD *me) {
+    if (!me->ring_flush_pending) {
+        me->ring_flush_pending = true;
+        event_active(&me->ring_flush, EV_WRITE, 0);
+    }
+}
+
+static void close_ring_notify(LIBEVENT_THREAD *me) {
+    if (me->ring_notify[0] == me->ring_notify[1]) {
+        close(me->ring_notify[0]);
+    } else {
+        safe_close(me->ring_notify[0]);
+        safe_close(me->ring_notify[1]);
+    }
+}
+
+static const char *ring_backend_name(void) {
+    return settings.io_backend == IO_BACKEND_IOCP ? "iocp" : "io_uring";
+}
+
+static bool setup_thread_ring(LIBEVENT_THREAD *me) {
+#if defined(HAVE_SYS_EVENTFD_H) || defined(WIN32)
+    /* The ring we have here has to be the one that was asked for */
+    const char *kind = io_ring_kind();
+    if (kind == NULL || strcmp(kind, ring_backend_name()) != 0) {
+        return false;
+    }
+
+#ifdef HAVE_SYS_EVENTFD_H
+    int efd = eventfd(0, EFD_NONBLOCK);
+    if (efd == -1) {
+        return false;
+    }
+    me->ring_notify[0] = me->ring_notify[1] = efd;
+#else
+    if (!create_socketpair(me->ring_notify)) {
+        return false;
+    }
+#endif
+
+    /* Every connection may have a request in flight */
+    me->ring = io_ring_create(IO_RING_ENTRIES, settings.maxconns,
+                              (int)me->ring_notify[1]);
+    if (me->ring == NULL) {
+        close_ring_notify(me);
+        return false;
+    }
+
+    event_set(&me->ring_event, me->ring_notify[0], EV_READ | EV_PERSIST,
+              thread_ring_process, me);
+    event_base_set(me->base, &me->ring_event);
+    event_priority_set(&me->ring_event, CONN_PRIORITY_INTERACTIVE);
+    event_set(&me->ring_flush, -1, 0, thread_ring_flush, me);
+    event_base_set(me->base, &me->ring_flush);
+    event_priority_set(&me->ring_flush, CONN_PRIORITY_INTERACTIVE);
+
+    if (event_add(&me->ring_event, 0) == -1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Can't monitor the %s notifications\n",
+                                        io_ring_kind());
+        exit(1);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void destroy_thread_ring(LIBEVENT_THREAD *me) {
+    if (me->ring != NULL) {
+        event_del(&me->ring_event);
+        io_ring_destroy(me->ring);
+        close_ring_notify(me);
+        me->ring = NULL;
+    }
 }
 
 /*
@@ -292,6 +677,12 @@ static void *worker_libevent(void *arg) {
     /* Any per-thread setup can happen here; thread_init() will block until
      * all threads have finished initializing.
      */
+    if (!affinity_bind_worker(me->index)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Can't pin worker thread %d to CPU %d\n",
+                                        me->index,
+                                        affinity_worker_cpu(me->index));
+    }
 
     pthread_mutex_lock(&init_lock);
     init_count++;
@@ -321,8 +712,13 @@ static void thread_libevent_process(int fd, short which, void *arg) {
     assert(me->type == GENERAL);
     CQ_ITEM *item;
 
-    if (recv(fd, devnull, sizeof(devnull), 0) == -1) {
-        if (settings.verbose > 0) {
+    /*
+     * Clear the flag before we look at the queues, so that anything
+     * queued from now on sends a new notification.
+     */
+    ATOMIC_CAS(&me->notify_pending, 1, 0);
+    if (drain_notification_pipe(me) == -1) {
+        if (settings.verbose > 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
             settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                                             "Can't read from libevent pipe: %s\n",
                                             strerror(errno));
@@ -335,6 +731,12 @@ static void thread_libevent_process(int fd, short which, void *arg) {
     }
 
     while ((item = cq_pop(me->new_conn_queue)) != NULL) {
+        if (item->conn != NULL) {
+            conn_attach_thread(item->conn, me);
+            cqi_free(item);
+            continue;
+        }
+
         conn *c = conn_new(item->sfd, item->parent_port, item->init_state,
                            item->event_flags, item->read_buffer_size,
                            item->transport, me->base, NULL);
@@ -350,14 +752,29 @@ static void thread_libevent_process(int fd, short which, void *arg) {
                             item->sfd);
                 }
                 closesocket(item->sfd);
+                if (item->init_state == conn_new_cmd ||
+                    item->init_state == conn_tls_handshake) {
+                    thread_conn_closed(me);
+                }
             }
         } else {
             assert(c->thread == NULL);
             c->thread = me;
+            if (item->init_state == conn_listening) {
+                c->next = me->listen_conn;
+                me->listen_conn = c;
+            } else if (item->init_state == conn_new_cmd ||
+                       item->init_state == conn_tls_handshake) {
+                conn_went_idle(c);
+            }
         }
         cqi_free(item);
     }
 
+    if (me->listen_conn != NULL) {
+        update_thread_listen_events(me);
+    }
+
     LOCK_THREAD(me);
     conn* pending = me->pending_io;
     me->pending_io = NULL;
@@ -498,19 +915,65 @@ void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status)
 static int last_thread = -1;
 
 /*
- * Dispatches a new connection to another thread. This is only ever called
- * from the main thread, either during initialization (for UDP) or because
- * of an incoming connection.
+ * The new connections go to threads[0 .. active_threads), and the
+ * connections of the workers past them move off at their next request
+ * (see dispatch_conn_migrate()). Protected by the stats lock.
  */
-void dispatch_conn_new(SOCKET sfd, int parent_port,
-                       STATE_FUNC init_state, int event_flags,
-                       int read_buffer_size, enum network_transport transport) {
-    CQ_ITEM *item = cqi_new();
-    int tid = (last_thread + 1) % settings.num_threads;
+static int active_threads;
+/* Scale the workers between settings.num_threads_min and -t on their load */
+static bool scale_auto;
+/* The seconds in a row the active workers could have done with one less */
+static int scale_idle;
+static uint64_t scale_ups;
+static uint64_t scale_downs;
+
+/* Start another worker once the active ones are this busy on average */
+#define SCALE_UP_BUSY 75
+/* Park one once the others could take its load and stay below this */
+#define SCALE_DOWN_BUSY 50
+#define SCALE_DOWN_SECONDS 10
+
+/* Don't move connections around for small differences in the load */
+#define MIGRATE_BUSY_DELTA 25
+#define MIGRATE_CONN_DELTA 2
 
-    LIBEVENT_THREAD *thread = threads + tid;
+/*
+ * Pick the worker thread for a new connection. The caller must hold the
+ * stats lock. Ties are broken round-robin so that an idle server still
+ * spreads the connections over all of the threads.
+ */
+static LIBEVENT_THREAD *select_thread(enum conn_placement policy) {
+    int tid = (last_thread + 1) % active_threads;
+
+    if (policy != CONN_PLACEMENT_ROUND_ROBIN) {
+        int best = tid;
+        for (int ii = 1; ii < active_threads; ++ii) {
+            int next = (tid + ii) % active_threads;
+            LIBEVENT_THREAD *a = threads + next;
+            LIBEVENT_THREAD *b = threads + best;
+            if (policy == CONN_PLACEMENT_LOAD && a->loop_busy != b->loop_busy) {
+                if (a->loop_busy < b->loop_busy) {
+                    best = next;
+                }
+            } else if (a->conn_count < b->conn_count) {
+                best = next;
+            }
+        }
+        tid = best;
+    }
 
     last_thread = tid;
+    return threads + tid;
+}
+
+/*
+ * Queues a new connection for the given thread and wakes it up.
+ */
+static void dispatch_conn_to(LIBEVENT_THREAD *thread, SOCKET sfd,
+                             int parent_port, STATE_FUNC init_state,
+                             int event_flags, int read_buffer_size,
+                             enum network_transport transport) {
+    CQ_ITEM *item = cqi_new();
 
     item->sfd = sfd;
     item->parent_port = parent_port;
@@ -518,6 +981,7 @@ void dispatch_conn_new(SOCKET sfd, int parent_port,
     item->event_flags = event_flags;
     item->read_buffer_size = read_buffer_size;
     item->transport = transport;
+    item->conn = NULL;
 
     cq_push(thread->new_conn_queue, item);
 
@@ -525,6 +989,107 @@ void dispatch_conn_new(SOCKET sfd, int parent_port,
     notify_thread(thread);
 }
 
+/*
+ * Dispatches a new connection to another thread. This is called from the
+ * main thread, either during initialization (for UDP) or because of an
+ * incoming connection, and by a parked worker for the connections it
+ * accepts on its own listening sockets.
+ */
+void dispatch_conn_new(SOCKET sfd, int parent_port,
+                       STATE_FUNC init_state, int event_flags,
+                       int read_buffer_size, enum network_transport transport) {
+    LIBEVENT_THREAD *thread;
+
+    /* The UDP sockets must hit all of the threads */
+    if (IS_UDP(transport) ||
+        (init_state != conn_new_cmd && init_state != conn_tls_handshake)) {
+        int tid = (last_thread + 1) % settings.num_threads;
+        last_thread = tid;
+        thread = threads + tid;
+    } else {
+        pthread_mutex_lock(&stats_lock);
+        thread = select_thread(settings.conn_placement);
+        ++thread->conn_count;
+        pthread_mutex_unlock(&stats_lock);
+    }
+
+    dispatch_conn_to(thread, sfd, parent_port, init_state,
+                     event_flags, read_buffer_size, transport);
+}
+
+/*
+ * Move an idle connection to a less loaded worker thread if the current
+ * thread is much busier than the others. This is called by the thread
+ * owning the connection in between two requests. The thread hands off
+ * at most one connection per second so that it gets to see the effect
+ * on the load before it moves another one, unless it is parked: then
+ * all of its connections go.
+ *
+ * Returns true if the connection is on its way to another thread, in
+ * which case the caller must not touch it any more.
+ */
+bool dispatch_conn_migrate(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+    LIBEVENT_THREAD *thread = NULL;
+
+    if (!thread_parked(me) && me->last_migration == current_time) {
+        return false;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    if (thread_parked(me)) {
+        thread = select_thread(settings.conn_placement);
+    } else if (settings.conn_placement == CONN_PLACEMENT_LOAD) {
+        thread = select_thread(CONN_PLACEMENT_LOAD);
+        if (me->loop_busy < thread->loop_busy + MIGRATE_BUSY_DELTA) {
+            thread = NULL;
+        }
+    } else {
+        thread = select_thread(CONN_PLACEMENT_CONNS);
+        if (me->conn_count < thread->conn_count + MIGRATE_CONN_DELTA) {
+            thread = NULL;
+        }
+    }
+    if (thread != NULL) {
+        --me->conn_count;
+        ++me->migrated_out;
+        ++thread->conn_count;
+        ++thread->migrated_in;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    me->last_migration = current_time;
+    if (thread == NULL || !conn_detach_thread(c)) {
+        if (thread != NULL) {
+            /* Undo the accounting, the connection stays here */
+            pthread_mutex_lock(&stats_lock);
+            ++me->conn_count;
+            --me->migrated_out;
+            --thread->conn_count;
+            --thread->migrated_in;
+            pthread_mutex_unlock(&stats_lock);
+        }
+        return false;
+    }
+
+    CQ_ITEM *item = cqi_new();
+    memset(item, 0, sizeof(*item));
+    item->conn = c;
+    cq_push(thread->new_conn_queue, item);
+    notify_thread(thread);
+    return true;
+}
+
+/*
+ * Hands a (reuseport) listening socket to the given worker thread, which
+ * accepts the connections on it from its own event base.
+ */
+void dispatch_listen_conn(int thread, SOCKET sfd, int parent_port) {
+    assert(thread >= 0 && thread < settings.num_threads);
+    dispatch_conn_to(threads + thread, sfd, parent_port, conn_listening,
+                     EV_READ | EV_PERSIST, 1, tcp_transport);
+}
+
 /*
  * Returns true if this is the thread that listens for new TCP connections.
  */
@@ -537,8 +1102,267 @@ int is_listen_thread() {
 #endif
 }
 
+/*
+ * The dispatcher counts the notifications (see dispatch_event_handler()),
+ * so they're never coalesced.
+ */
 void notify_dispatcher(void) {
-    notify_thread(&dispatcher_thread);
+    send_notification(&dispatcher_thread);
+}
+
+bool thread_parked(LIBEVENT_THREAD *thread) {
+    return thread->index >= active_threads;
+}
+
+/* Just a snapshot, the caller may hold the stats lock */
+int threads_active(void) {
+    return active_threads;
+}
+
+/*
+ * Serve the new connections with the first nthr workers, and move the
+ * connections of the others to them. 0 goes back to what we started with:
+ * all of the workers, scaled on their load if -t gave a minimum.
+ */
+bool threads_set_active(int nthr) {
+    if (nthr < 0 || nthr > settings.num_threads) {
+        return false;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    if (nthr == 0) {
+        scale_auto = settings.num_threads_min > 0;
+        active_threads = settings.num_threads;
+    } else {
+        scale_auto = false;
+        active_threads = nthr;
+    }
+    scale_idle = 0;
+    pthread_mutex_unlock(&stats_lock);
+    return true;
+}
+
+/*
+ * Called once a second with the stats lock held: start another worker if
+ * the active ones are busy, and park the last one once the others could
+ * have done its work for SCALE_DOWN_SECONDS.
+ */
+static void threads_autoscale(void) {
+    unsigned int busy = 0;
+    for (int ii = 0; ii < active_threads; ++ii) {
+        busy += threads[ii].loop_busy;
+    }
+
+    int nthr = active_threads;
+    if (active_threads < settings.num_threads &&
+        busy >= SCALE_UP_BUSY * (unsigned int)active_threads) {
+        ++active_threads;
+        ++scale_ups;
+        scale_idle = 0;
+    } else if (active_threads > settings.num_threads_min &&
+               busy < SCALE_DOWN_BUSY * (unsigned int)(active_threads - 1)) {
+        if (++scale_idle >= SCALE_DOWN_SECONDS) {
+            --active_threads;
+            ++scale_downs;
+            scale_idle = 0;
+        }
+    } else {
+        scale_idle = 0;
+    }
+
+    if (nthr != active_threads && settings.verbose > 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+                "Serving the connections with %d worker threads\n",
+                active_threads);
+    }
+}
+
+void thread_conn_opened(LIBEVENT_THREAD *thread) {
+    pthread_mutex_lock(&stats_lock);
+    ++thread->conn_count;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void thread_conn_closed(LIBEVENT_THREAD *thread) {
+    pthread_mutex_lock(&stats_lock);
+    --thread->conn_count;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Called once a second from the clock handler to update the share of
+ * the last second each worker spent running its connections.
+ */
+void threads_update_load(void) {
+    static struct timeval last;
+    struct timeval now;
+
+    if (threads == NULL) {
+        return;
+    }
+
+    gettimeofday(&now, NULL);
+    uint64_t elapsed = (now.tv_sec - last.tv_sec) * 1000000ULL +
+        now.tv_usec - last.tv_usec;
+    last = now;
+    if (elapsed == 0) {
+        return;
+    }
+
+    for (int ii = 0; ii < settings.num_threads; ++ii) {
+        uint64_t busy = threads[ii].busy_usec;
+        uint64_t delta = busy - threads[ii].last_busy_usec;
+        threads[ii].last_busy_usec = busy;
+        unsigned int pct = (unsigned int)(delta * 100 / elapsed);
+        pthread_mutex_lock(&stats_lock);
+        threads[ii].loop_busy = pct > 100 ? 100 : pct;
+        pthread_mutex_unlock(&stats_lock);
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    if (scale_auto) {
+        threads_autoscale();
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void threads_stats(ADD_STAT add_stats, conn *c) {
+    char key[64];
+
+    pthread_mutex_lock(&stats_lock);
+    append_stat("active", add_stats, c, "%d", active_threads);
+    append_stat("scale_ups", add_stats, c, "%"PRIu64, scale_ups);
+    append_stat("scale_downs", add_stats, c, "%"PRIu64, scale_downs);
+    for (int ii = 0; ii < settings.num_threads; ++ii) {
+        LIBEVENT_THREAD *t = threads + ii;
+        snprintf(key, sizeof(key), "thread_%d:conn_count", ii);
+        append_stat(key, add_stats, c, "%d", t->conn_count);
+        snprintf(key, sizeof(key), "thread_%d:loop_busy", ii);
+        append_stat(key, add_stats, c, "%u", t->loop_busy);
+        snprintf(key, sizeof(key), "thread_%d:busy_usec", ii);
+        append_stat(key, add_stats, c, "%"PRIu64, t->busy_usec);
+        snprintf(key, sizeof(key), "thread_%d:migrated_in", ii);
+        append_stat(key, add_stats, c, "%"PRIu64, t->migrated_in);
+        snprintf(key, sizeof(key), "thread_%d:migrated_out", ii);
+        append_stat(key, add_stats, c, "%"PRIu64, t->migrated_out);
+        snprintf(key, sizeof(key), "thread_%d:cpu", ii);
+        append_stat(key, add_stats, c, "%d", affinity_worker_cpu(ii));
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * The buffer pools are only touched by their own thread, so this is just
+ * a snapshot. A connection may give its buffers back on another thread
+ * than the one it took them on, which is why only the sum makes sense.
+ */
+void threads_buffer_stats(uint64_t *pooled, int64_t *pinned) {
+    *pooled = 0;
+    *pinned = 0;
+    for (int ii = 0; ii < nthreads; ++ii) {
+        for (int jj = 0; jj < CONN_BUFFER_CLASSES; ++jj) {
+            *pooled += (uint64_t)threads[ii].buffers_free[jj] *
+                (DATA_BUFFER_SIZE << jj);
+        }
+        *pinned += threads[ii].buffers_pinned;
+    }
+}
+
+/*
+ * A snapshot like threads_buffer_stats(), the counters belong to their
+ * threads
+ */
+void threads_idle_stats(uint64_t *kicks, uint64_t *hibernating,
+                        uint64_t *hibernations, uint64_t *wakeups) {
+    *kicks = *hibernating = *hibernations = *wakeups = 0;
+    for (int ii = 0; ii < nthreads; ++ii) {
+        *kicks += threads[ii].idle_kicks;
+        *hibernating += threads[ii].hibernating.count;
+        *hibernations += threads[ii].hibernations;
+        *wakeups += threads[ii].wakeups;
+    }
+}
+
+/*
+ * Add up the histograms of the opcode from all of the threads
+ */
+bool threads_timings_aggregate(uint8_t opcode, struct timing_histogram *out) {
+    bool found = false;
+    for (int ii = 0; ii < nthreads; ++ii) {
+        if (timings_aggregate(&threads[ii].timings, opcode, out)) {
+            found = true;
+        }
+    }
+    return found;
+}
+
+void threads_timings_reset(void) {
+    for (int ii = 0; ii < nthreads; ++ii) {
+        timings_reset(&threads[ii].timings);
+    }
+}
+
+/*
+ * Add up the cycles of all of the threads
+ */
+void threads_cycles_aggregate(struct thread_cycles *out) {
+    memset(out, 0, sizeof(*out));
+    for (int ii = 0; ii < nthreads; ++ii) {
+        volatile struct thread_cycles *t = &threads[ii].cycles;
+        for (int jj = 0; jj < CONN_NSTATES; ++jj) {
+            out->state[jj].calls += t->state[jj].calls;
+            out->state[jj].cycles += t->state[jj].cycles;
+        }
+        for (int jj = 0; jj < ENGINE_NCALLS; ++jj) {
+            out->engine[jj].calls += t->engine[jj].calls;
+            out->engine[jj].cycles += t->engine[jj].cycles;
+        }
+    }
+}
+
+/*
+ * Like threads_timings_reset(), a thread counting at the same time may
+ * keep what it had
+ */
+void threads_cycles_reset(void) {
+    for (int ii = 0; ii < nthreads; ++ii) {
+        memset(&threads[ii].cycles, 0, sizeof(threads[ii].cycles));
+    }
+}
+
+/*
+ * Add up the heaviest clients of all of the threads, by peer address or
+ * by SASL user, most ops first. The caller frees what we return.
+ */
+struct topclient *threads_topclients(bool users, int *nclients) {
+    int max = TOPCLIENTS_SIZE * nthreads;
+    struct topclient *out = malloc(max * sizeof(*out));
+    if (out == NULL) {
+        return NULL;
+    }
+
+    int nout = 0;
+    for (int ii = 0; ii < nthreads; ++ii) {
+        nout = topclients_merge(out, nout, max,
+                                users ? &threads[ii].top_users :
+                                        &threads[ii].top_peers);
+    }
+    topclients_sort(out, nout);
+    *nclients = nout;
+    return out;
+}
+
+void threads_topclients_reset(void) {
+    for (int ii = 0; ii < nthreads; ++ii) {
+        topclients_reset(&threads[ii].top_peers);
+        topclients_reset(&threads[ii].top_users);
+    }
+}
+
+void notify_worker_threads(void) {
+    for (int ii = 0; ii < settings.num_threads; ++ii) {
+        notify_thread(&threads[ii]);
+    }
 }
 
 /******************************* GLOBAL STATS ******************************/
@@ -552,86 +1376,83 @@ void STATS_UNLOCK() {
 }
 
 void threadlocal_stats_clear(struct thread_stats *stats) {
-    stats->cmd_get = 0;
-    stats->get_misses = 0;
-    stats->delete_misses = 0;
-    stats->incr_misses = 0;
-    stats->decr_misses = 0;
-    stats->incr_hits = 0;
-    stats->decr_hits = 0;
-    stats->cas_misses = 0;
-    stats->bytes_written = 0;
-    stats->bytes_read = 0;
-    stats->cmd_flush = 0;
-    stats->conn_yields = 0;
-    stats->auth_cmds = 0;
-    stats->auth_errors = 0;
-
-    memset(stats->slab_stats, 0,
-           sizeof(struct slab_stats) * MAX_NUMBER_OF_SLAB_CLASSES);
+    memset(stats, 0, sizeof(*stats));
 }
 
 void threadlocal_stats_reset(struct thread_stats *thread_stats) {
     int ii;
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        pthread_mutex_lock(&thread_stats[ii].mutex);
-        threadlocal_stats_clear(&thread_stats[ii]);
-        pthread_mutex_unlock(&thread_stats[ii].mutex);
+        struct thread_stats *ts = &thread_stats[ii];
+        thread_stats_set(ts->cmd_get, 0);
+        thread_stats_set(ts->get_misses, 0);
+        thread_stats_set(ts->delete_misses, 0);
+        thread_stats_set(ts->incr_misses, 0);
+        thread_stats_set(ts->decr_misses, 0);
+        thread_stats_set(ts->incr_hits, 0);
+        thread_stats_set(ts->decr_hits, 0);
+        thread_stats_set(ts->cas_misses, 0);
+        thread_stats_set(ts->bytes_written, 0);
+        thread_stats_set(ts->bytes_read, 0);
+        thread_stats_set(ts->cmd_flush, 0);
+        thread_stats_set(ts->conn_yields, 0);
+        thread_stats_set(ts->bulk_yields, 0);
+        thread_stats_set(ts->auth_cmds, 0);
+        thread_stats_set(ts->auth_errors, 0);
+        thread_stats_set(ts->auth_ns, 0);
+        thread_stats_set(ts->zerocopy_bytes, 0);
+        thread_stats_set(ts->zerocopy_fallbacks, 0);
+        thread_stats_set(ts->coalesced_responses, 0);
+        thread_stats_set(ts->nread_readahead, 0);
+        thread_stats_set(ts->sendmsgs, 0);
+        thread_stats_set(ts->tcp_corked, 0);
+        thread_stats_set(ts->tls_handshakes, 0);
+        thread_stats_set(ts->tls_handshake_errors, 0);
+        thread_stats_set(ts->tls_offloaded, 0);
+        thread_stats_set(ts->slab_stats.cmd_set, 0);
+        thread_stats_set(ts->slab_stats.get_hits, 0);
+        thread_stats_set(ts->slab_stats.delete_hits, 0);
+        thread_stats_set(ts->slab_stats.cas_hits, 0);
+        thread_stats_set(ts->slab_stats.cas_badval, 0);
     }
 }
 
 void threadlocal_stats_aggregate(struct thread_stats *thread_stats, struct thread_stats *stats) {
-    int ii, sid;
+    int ii;
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        pthread_mutex_lock(&thread_stats[ii].mutex);
-
-        stats->cmd_get += thread_stats[ii].cmd_get;
-        stats->get_misses += thread_stats[ii].get_misses;
-        stats->delete_misses += thread_stats[ii].delete_misses;
-        stats->decr_misses += thread_stats[ii].decr_misses;
-        stats->incr_misses += thread_stats[ii].incr_misses;
-        stats->decr_hits += thread_stats[ii].decr_hits;
-        stats->incr_hits += thread_stats[ii].incr_hits;
-        stats->cas_misses += thread_stats[ii].cas_misses;
-        stats->bytes_read += thread_stats[ii].bytes_read;
-        stats->bytes_written += thread_stats[ii].bytes_written;
-        stats->cmd_flush += thread_stats[ii].cmd_flush;
-        stats->conn_yields += thread_stats[ii].conn_yields;
-        stats->auth_cmds += thread_stats[ii].auth_cmds;
-        stats->auth_errors += thread_stats[ii].auth_errors;
-
-        for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-            stats->slab_stats[sid].cmd_set +=
-                thread_stats[ii].slab_stats[sid].cmd_set;
-            stats->slab_stats[sid].get_hits +=
-                thread_stats[ii].slab_stats[sid].get_hits;
-            stats->slab_stats[sid].delete_hits +=
-                thread_stats[ii].slab_stats[sid].delete_hits;
-            stats->slab_stats[sid].cas_hits +=
-                thread_stats[ii].slab_stats[sid].cas_hits;
-            stats->slab_stats[sid].cas_badval +=
-                thread_stats[ii].slab_stats[sid].cas_badval;
-        }
-
-        pthread_mutex_unlock(&thread_stats[ii].mutex);
-    }
-}
-
-void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out) {
-    int sid;
-
-    out->cmd_set = 0;
-    out->get_hits = 0;
-    out->delete_hits = 0;
-    out->cas_hits = 0;
-    out->cas_badval = 0;
-
-    for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-        out->cmd_set += stats->slab_stats[sid].cmd_set;
-        out->get_hits += stats->slab_stats[sid].get_hits;
-        out->delete_hits += stats->slab_stats[sid].delete_hits;
-        out->cas_hits += stats->slab_stats[sid].cas_hits;
-        out->cas_badval += stats->slab_stats[sid].cas_badval;
+        struct thread_stats *ts = &thread_stats[ii];
+        stats->cmd_get += thread_stats_get(ts->cmd_get);
+        stats->get_misses += thread_stats_get(ts->get_misses);
+        stats->delete_misses += thread_stats_get(ts->delete_misses);
+        stats->decr_misses += thread_stats_get(ts->decr_misses);
+        stats->incr_misses += thread_stats_get(ts->incr_misses);
+        stats->decr_hits += thread_stats_get(ts->decr_hits);
+        stats->incr_hits += thread_stats_get(ts->incr_hits);
+        stats->cas_misses += thread_stats_get(ts->cas_misses);
+        stats->bytes_read += thread_stats_get(ts->bytes_read);
+        stats->bytes_written += thread_stats_get(ts->bytes_written);
+        stats->cmd_flush += thread_stats_get(ts->cmd_flush);
+        stats->conn_yields += thread_stats_get(ts->conn_yields);
+        stats->bulk_yields += thread_stats_get(ts->bulk_yields);
+        stats->auth_cmds += thread_stats_get(ts->auth_cmds);
+        stats->auth_errors += thread_stats_get(ts->auth_errors);
+        stats->auth_ns += thread_stats_get(ts->auth_ns);
+        stats->zerocopy_bytes += thread_stats_get(ts->zerocopy_bytes);
+        stats->zerocopy_fallbacks += thread_stats_get(ts->zerocopy_fallbacks);
+        stats->coalesced_responses += thread_stats_get(ts->coalesced_responses);
+        stats->nread_readahead += thread_stats_get(ts->nread_readahead);
+        stats->sendmsgs += thread_stats_get(ts->sendmsgs);
+        stats->tcp_corked += thread_stats_get(ts->tcp_corked);
+        stats->tls_handshakes += thread_stats_get(ts->tls_handshakes);
+        stats->tls_handshake_errors += thread_stats_get(ts->tls_handshake_errors);
+        stats->tls_offloaded += thread_stats_get(ts->tls_offloaded);
+
+        stats->slab_stats.cmd_set += thread_stats_get(ts->slab_stats.cmd_set);
+        stats->slab_stats.get_hits += thread_stats_get(ts->slab_stats.get_hits);
+        stats->slab_stats.delete_hits +=
+            thread_stats_get(ts->slab_stats.delete_hits);
+        stats->slab_stats.cas_hits += thread_stats_get(ts->slab_stats.cas_hits);
+        stats->slab_stats.cas_badval +=
+            thread_stats_get(ts->slab_stats.cas_badval);
     }
 }
 
@@ -645,6 +1466,8 @@ void thread_init(int nthr, struct event_base *main_base,
                  void (*dispatcher_callback)(int, short, void *)) {
     int i;
     nthreads = nthr + 1;
+    active_threads = nthr;
+    scale_auto = settings.num_threads_min > 0;
 
     cqi_freelist = NULL;
 
@@ -670,6 +1493,17 @@ void thread_init(int nthr, struct event_base *main_base,
         threads[i].index = i;
 
         setup_thread(&threads[i]);
+
+        if (settings.io_backend != IO_BACKEND_LIBEVENT &&
+            !setup_thread_ring(&threads[i])) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "%s is not available, falling back to libevent\n",
+                    ring_backend_name());
+            for (int j = 0; j < i; ++j) {
+                destroy_thread_ring(&threads[j]);
+            }
+            settings.io_backend = IO_BACKEND_LIBEVENT;
+        }
     }
 
     /* Create threads after we've done all the libevent setup. */
@@ -693,9 +1527,13 @@ void threads_shutdown(void)
         pthread_join(thread_ids[ii], NULL);
     }
     for (int ii = 0; ii < nthreads; ++ii) {
-        safe_close(threads[ii].notify[0]);
-        safe_close(threads[ii].notify[1]);
+        destroy_notification_pipe(&threads[ii]);
+        destroy_thread_ring(&threads[ii]);
         cache_destroy(threads[ii].suffix_cache);
+        for (int jj = 0; jj < CONN_BUFFER_CLASSES; ++jj) {
+            cache_destroy(threads[ii].buffer_cache[jj]);
+        }
+        timings_destroy(&threads[ii].timings);
         event_base_free(threads[ii].base);
 
         CQ_ITEM *it;
@@ -709,11 +1547,13 @@ void threads_shutdown(void)
     free(threads);
 }
 
+/*
+ * Wake up a worker thread. The notifications are coalesced, so that all
+ * of them sent before the thread gets to run cost a single write.
+ */
 void notify_thread(LIBEVENT_THREAD *thread) {
-    if (send(thread->notify[1], "", 1, 0) != 1) {
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                        "Failed to notify thread: %s",
-                                        strerror(errno));
+    if (ATOMIC_CAS(&thread->notify_pending, 0, 1)) {
+        send_notification(thread);
     }
 }
 
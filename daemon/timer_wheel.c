@@ -0,0 +1,140 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The timers of a worker thread (see timer_wheel.h)
+ */
+#include "config.h"
+#include "timer_wheel.h"
+
+#include <string.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+/** The number of ticks the wheel reaches */
+#define TIMER_WHEEL_SPAN (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now) {
+    memset(w, 0, sizeof(*w));
+    w->now = now;
+}
+
+static void link_entry(struct timer_entry **slot, struct timer_entry *entry) {
+    entry->next = *slot;
+    if (entry->next != NULL) {
+        entry->next->pprev = &entry->next;
+    }
+    entry->pprev = slot;
+    *slot = entry;
+}
+
+static void unlink_entry(struct timer_entry *entry) {
+    *entry->pprev = entry->next;
+    if (entry->next != NULL) {
+        entry->next->pprev = entry->pprev;
+    }
+    entry->next = NULL;
+    entry->pprev = NULL;
+}
+
+/*
+ * Put a timer in the slot for its expiry. One that is due goes in the
+ * slot of the current tick (we're moving it down while running the tick),
+ * and one beyond the reach of the wheel in the last slot it reaches.
+ */
+static void place_entry(struct timer_wheel *w, struct timer_entry *entry) {
+    uint64_t when = entry->expires > w->now ? entry->expires : w->now;
+    uint64_t delta = when - w->now;
+    if (delta >= TIMER_WHEEL_SPAN) {
+        when = w->now + TIMER_WHEEL_SPAN - 1;
+        delta = TIMER_WHEEL_SPAN - 1;
+    }
+
+    int level = 0;
+    while (delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        ++level;
+    }
+    int idx = (int)((when >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    link_entry(&w->slots[level][idx], entry);
+}
+
+void timer_wheel_add(struct timer_wheel *w, struct timer_entry *entry,
+                     uint64_t expires) {
+    if (entry->armed) {
+        timer_wheel_cancel(w, entry);
+    }
+    entry->expires = expires > w->now ? expires : w->now + 1;
+    entry->armed = true;
+    ++w->count;
+    place_entry(w, entry);
+}
+
+bool timer_wheel_cancel(struct timer_wheel *w, struct timer_entry *entry) {
+    if (!entry->armed) {
+        return false;
+    }
+    unlink_entry(entry);
+    entry->armed = false;
+    --w->count;
+    return true;
+}
+
+/*
+ * Move the timers of the slots of the upper levels starting with this
+ * tick down to where they belong now
+ */
+static void cascade(struct timer_wheel *w) {
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        uint64_t mask = (1ULL << (TIMER_WHEEL_BITS * level)) - 1;
+        if ((w->now & mask) != 0) {
+            break;
+        }
+        int idx = (int)((w->now >> (TIMER_WHEEL_BITS * level)) &
+                        TIMER_WHEEL_MASK);
+        struct timer_entry *list = w->slots[level][idx];
+        w->slots[level][idx] = NULL;
+        while (list != NULL) {
+            struct timer_entry *next = list->next;
+            place_entry(w, list);
+            list = next;
+        }
+    }
+}
+
+uint32_t timer_wheel_advance(struct timer_wheel *w, uint64_t now,
+                             TIMER_FIRE fire, void *arg) {
+    uint32_t fired = 0;
+
+    while (w->now < now) {
+        if (w->count == 0) {
+            /* Nothing to run on the way */
+            w->now = now;
+            break;
+        }
+
+        ++w->now;
+        cascade(w);
+
+        struct timer_entry **slot = &w->slots[0][w->now & TIMER_WHEEL_MASK];
+        struct timer_entry *entry;
+        while ((entry = *slot) != NULL) {
+            unlink_entry(entry);
+            entry->armed = false;
+            --w->count;
+            ++fired;
+            fire(entry, arg);
+        }
+    }
+
+    return fired;
+}
+
+uint64_t timer_wheel_next(const struct timer_wheel *w) {
+    if (w->count == 0) {
+        return UINT64_MAX;
+    }
+
+    uint64_t tick = w->now + 1;
+    while ((tick & TIMER_WHEEL_MASK) != 0 &&
+           w->slots[0][tick & TIMER_WHEEL_MASK] == NULL) {
+        ++tick;
+    }
+    return tick - w->now;
+}
@@ -0,0 +1,77 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A hierarchical timer wheel: the timers of a worker thread (see
+ * thread_add_timer()). The time is counted in ticks (milliseconds for the
+ * workers). Level 0 has a slot per tick for the next TIMER_WHEEL_SLOTS
+ * ticks, and every level above it has a slot per TIMER_WHEEL_SLOTS slots
+ * of the level below. A timer goes into the lowest level that reaches
+ * its expiry, and when level 0 wraps around the next slot of level 1 is
+ * spread over level 0 (and so on up), so adding, cancelling and firing
+ * a timer are all O(1). Timers further away than the wheel reaches wait
+ * in the top level and are put back when their slot comes around.
+ *
+ * The wheel isn't thread safe: it belongs to the thread running it.
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer_entry {
+    struct timer_entry *next;
+    /** The pointer to us in the slot (the head or the one before us) */
+    struct timer_entry **pprev;
+    /** The tick the timer fires at */
+    uint64_t expires;
+    /** true while the timer is in a wheel */
+    bool armed;
+};
+
+struct timer_wheel {
+    /** The last tick we ran */
+    uint64_t now;
+    /** The number of timers in the wheel */
+    uint32_t count;
+    struct timer_entry *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+typedef void (*TIMER_FIRE)(struct timer_entry *entry, void *arg);
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+
+/**
+ * Arm a timer to fire at the given tick (the next tick if it's gone by)
+ */
+void timer_wheel_add(struct timer_wheel *w, struct timer_entry *entry,
+                     uint64_t expires);
+
+/**
+ * Disarm a timer
+ * @return false if it wasn't armed (it fired already)
+ */
+bool timer_wheel_cancel(struct timer_wheel *w, struct timer_entry *entry);
+
+/**
+ * Run the wheel up to the given tick, firing the timers that expire. The
+ * entries are disarmed before fire is called, so it may add them again
+ * (or free them).
+ *
+ * @return the number of timers fired
+ */
+uint32_t timer_wheel_advance(struct timer_wheel *w, uint64_t now,
+                             TIMER_FIRE fire, void *arg);
+
+/**
+ * The number of ticks we may sleep before the wheel has something to
+ * do: fire a timer or move some down a level
+ *
+ * @return UINT64_MAX if there are no timers
+ */
+uint64_t timer_wheel_next(const struct timer_wheel *w);
+
+#endif
@@ -0,0 +1,165 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Per opcode latency histograms (see timings.h)
+ */
+#include "config.h"
+#include "timings.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#ifdef __GNUC__
+#define counter_get(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define counter_set(counter, val) \
+    __atomic_store_n(&(counter), (val), __ATOMIC_RELAXED)
+#define histogram_get(ptr) __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+#define histogram_publish(ptr, val) \
+    __atomic_store_n(&(ptr), (val), __ATOMIC_RELEASE)
+#else
+#define counter_get(counter) (*(volatile uint64_t *)&(counter))
+#define counter_set(counter, val) (*(volatile uint64_t *)&(counter) = (val))
+#define histogram_get(ptr) (*(struct timing_histogram * volatile *)&(ptr))
+#define histogram_publish(ptr, val) \
+    (*(struct timing_histogram * volatile *)&(ptr) = (val))
+#endif
+
+uint64_t timings_now(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+#endif
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+}
+
+static struct {
+    uint64_t cycles;
+    uint64_t ns;
+} calibration;
+
+void timings_cycles_calibrate(void) {
+    calibration.ns = timings_now();
+    calibration.cycles = timings_cycles();
+}
+
+double timings_cycles_per_usec(void) {
+    uint64_t ns = timings_now();
+    uint64_t cycles = timings_cycles();
+    if (ns <= calibration.ns || cycles <= calibration.cycles) {
+        return 1000.0;
+    }
+    return (double)(cycles - calibration.cycles) * 1000.0 /
+           (double)(ns - calibration.ns);
+}
+
+static int timings_bucket(uint64_t ns) {
+    if (ns < TIMING_SUB) {
+        return (int)ns;
+    }
+
+    int msb;
+#ifdef __GNUC__
+    msb = 63 - __builtin_clzll(ns);
+#else
+    msb = 0;
+    for (uint64_t v = ns; v > 1; v >>= 1) {
+        ++msb;
+    }
+#endif
+    if (msb > TIMING_MAX_BIT) {
+        return TIMING_BUCKETS - 1;
+    }
+    int sub = (int)(ns >> (msb - TIMING_SUB_BITS)) & (TIMING_SUB - 1);
+    return (msb - TIMING_SUB_BITS + 1) * TIMING_SUB + sub;
+}
+
+void timings_bucket_range(int bucket, uint64_t *lo, uint64_t *hi) {
+    if (bucket < TIMING_SUB) {
+        *lo = *hi = (uint64_t)bucket;
+        return;
+    }
+    int shift = bucket / TIMING_SUB - 1;
+    uint64_t sub = (uint64_t)(bucket % TIMING_SUB);
+    *lo = (TIMING_SUB + sub) << shift;
+    *hi = *lo + (1ULL << shift) - 1;
+}
+
+void timings_record(struct thread_timings *t, uint8_t opcode,
+                    uint64_t server_ns, uint64_t blocked_ns) {
+    struct timing_histogram *h = t->op[opcode];
+    if (h == NULL) {
+        if ((h = calloc(1, sizeof(*h))) == NULL) {
+            return;
+        }
+        histogram_publish(t->op[opcode], h);
+    }
+
+    int bucket = timings_bucket(server_ns);
+    counter_set(h->server[bucket], counter_get(h->server[bucket]) + 1);
+    if (blocked_ns != 0) {
+        bucket = timings_bucket(blocked_ns);
+        counter_set(h->blocked[bucket], counter_get(h->blocked[bucket]) + 1);
+    }
+}
+
+bool timings_aggregate(struct thread_timings *t, uint8_t opcode,
+                       struct timing_histogram *out) {
+    struct timing_histogram *h = histogram_get(t->op[opcode]);
+    if (h == NULL) {
+        return false;
+    }
+    for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+        out->server[ii] += counter_get(h->server[ii]);
+        out->blocked[ii] += counter_get(h->blocked[ii]);
+    }
+    return true;
+}
+
+void timings_reset(struct thread_timings *t) {
+    for (int op = 0; op < 256; ++op) {
+        struct timing_histogram *h = histogram_get(t->op[op]);
+        if (h != NULL) {
+            for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+                counter_set(h->server[ii], 0);
+                counter_set(h->blocked[ii], 0);
+            }
+        }
+    }
+}
+
+void timings_destroy(struct thread_timings *t) {
+    for (int op = 0; op < 256; ++op) {
+        free(t->op[op]);
+        t->op[op] = NULL;
+    }
+}
+
+uint64_t timings_percentile(const uint64_t *histo, double fraction) {
+    uint64_t total = 0;
+    for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+        total += histo[ii];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t wanted = (uint64_t)(total * fraction);
+    if (wanted == 0) {
+        wanted = 1;
+    }
+    uint64_t seen = 0;
+    uint64_t lo, hi = 0;
+    for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+        seen += histo[ii];
+        if (seen >= wanted) {
+            timings_bucket_range(ii, &lo, &hi);
+            break;
+        }
+    }
+    return hi;
+}
@@ -0,0 +1,103 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef TIMINGS_H
+#define TIMINGS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Log-linear latency histograms (in the spirit of HdrHistogram). Every
+ * power of two of nanoseconds is split in 1 << TIMING_SUB_BITS buckets,
+ * so a bucket is never more than 25% wide, up to about 30 minutes.
+ * Anything slower ends up in the last bucket.
+ */
+#define TIMING_SUB_BITS 2
+#define TIMING_SUB (1 << TIMING_SUB_BITS)
+#define TIMING_MAX_BIT 40
+#define TIMING_BUCKETS ((TIMING_MAX_BIT - TIMING_SUB_BITS + 2) * TIMING_SUB)
+
+/**
+ * The timings of one opcode on one worker thread
+ */
+struct timing_histogram {
+    /** time spent serving the request */
+    uint64_t server[TIMING_BUCKETS];
+    /** time spent waiting for the engine (only requests that blocked) */
+    uint64_t blocked[TIMING_BUCKETS];
+};
+
+/**
+ * The histograms of a worker thread, allocated when an opcode is seen
+ * for the first time. Only the thread itself records in them; the
+ * readers may run on any other thread.
+ */
+struct thread_timings {
+    struct timing_histogram *op[256];
+};
+
+/**
+ * A monotonic clock in nanoseconds
+ */
+uint64_t timings_now(void);
+
+/**
+ * A cheap cycle counter: the TSC on x86, the monotonic clock (in ns)
+ * anywhere else
+ */
+static inline uint64_t timings_cycles(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#else
+    return timings_now();
+#endif
+}
+
+/**
+ * Start measuring the rate of timings_cycles() against timings_now()
+ */
+void timings_cycles_calibrate(void);
+
+/**
+ * The cycles in a microsecond (measured since timings_cycles_calibrate())
+ */
+double timings_cycles_per_usec(void);
+
+/**
+ * Record a request for opcode (called by the owner of t)
+ *
+ * @param server_ns the time we spent on the request
+ * @param blocked_ns the time it was waiting for the engine (0 if it didn't
+ *                   block)
+ */
+void timings_record(struct thread_timings *t, uint8_t opcode,
+                    uint64_t server_ns, uint64_t blocked_ns);
+
+/**
+ * Add the histogram of opcode in t to out.
+ *
+ * @return false if t doesn't have any timings for the opcode
+ */
+bool timings_aggregate(struct thread_timings *t, uint8_t opcode,
+                       struct timing_histogram *out);
+
+/**
+ * Zero all the histograms in t. A request recorded by the owner at the
+ * same time may survive the reset.
+ */
+void timings_reset(struct thread_timings *t);
+
+void timings_destroy(struct thread_timings *t);
+
+/**
+ * The range of values (in ns) counted in a bucket
+ */
+void timings_bucket_range(int bucket, uint64_t *lo, uint64_t *hi);
+
+/**
+ * The upper bound (in ns) of the bucket holding the given fraction of
+ * the samples in histo (one of the two arrays of a histogram), or 0 if
+ * it's empty
+ */
+uint64_t timings_percentile(const uint64_t *histo, double fraction);
+
+#endif
@@ -0,0 +1,282 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * TLS termination with kernel offload (see tls.h)
+ */
+#include "config.h"
+#include "tls.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static SOCKET *listeners;
+static int nlisteners;
+
+void tls_add_listener(SOCKET sfd) {
+    SOCKET *ptr = realloc(listeners, (nlisteners + 1) * sizeof(*listeners));
+    if (ptr != NULL) {
+        listeners = ptr;
+        listeners[nlisteners++] = sfd;
+    }
+}
+
+bool tls_is_listener(SOCKET sfd) {
+    for (int ii = 0; ii < nlisteners; ++ii) {
+        if (listeners[ii] == sfd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef HAVE_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+/** The most we put in one record when we write it ourselves */
+#define TLS_RECORD_SIZE 16384
+
+struct tls_session {
+    SSL *ssl;
+    bool offloaded;
+};
+
+static SSL_CTX *ctx;
+
+static void tls_error(const char *what, char *err, size_t errsz) {
+    char buf[256];
+    ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+    snprintf(err, errsz, "%s: %s", what, buf);
+}
+
+bool tls_init(const char *cert, const char *key, char *err, size_t errsz) {
+    if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+        tls_error("Failed to create the TLS context", err, errsz);
+        return false;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* A client going away without a close_notify is just going away */
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_NO_RENEGOTIATION
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    /* The tickets would be the first thing to write after the handshake */
+    SSL_CTX_set_num_tickets(ctx, 0);
+#endif
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1) {
+        tls_error(cert, err, errsz);
+        goto fail;
+    }
+    if (key == NULL) {
+        key = cert;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        tls_error(key, err, errsz);
+        goto fail;
+    }
+    return true;
+
+fail:
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    return false;
+}
+
+struct tls_session *tls_session_create(SOCKET sfd) {
+    struct tls_session *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        return NULL;
+    }
+    if (ctx == NULL || (session->ssl = SSL_new(ctx)) == NULL ||
+        SSL_set_fd(session->ssl, sfd) != 1) {
+        tls_session_destroy(session);
+        return NULL;
+    }
+    SSL_set_accept_state(session->ssl);
+    return session;
+}
+
+void tls_session_destroy(struct tls_session *session) {
+    if (session != NULL) {
+        /* The socket is closed by the connection, not by SSL_free() */
+        SSL_free(session->ssl);
+        free(session);
+    }
+}
+
+enum tls_handshake_result tls_handshake(struct tls_session *session) {
+    ERR_clear_error();
+    int res = SSL_do_handshake(session->ssl);
+    if (res == 1) {
+#ifndef OPENSSL_NO_KTLS
+        session->offloaded =
+            BIO_get_ktls_send(SSL_get_wbio(session->ssl)) &&
+            BIO_get_ktls_recv(SSL_get_rbio(session->ssl));
+#endif
+        return TLS_HANDSHAKE_DONE;
+    }
+
+    switch (SSL_get_error(session->ssl, res)) {
+    case SSL_ERROR_WANT_READ:
+        return TLS_HANDSHAKE_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return TLS_HANDSHAKE_WANT_WRITE;
+    default:
+        return TLS_HANDSHAKE_ERROR;
+    }
+}
+
+bool tls_offloaded(const struct tls_session *session) {
+    return session->offloaded;
+}
+
+bool tls_pending(const struct tls_session *session) {
+    return SSL_pending(session->ssl) > 0;
+}
+
+void tls_release_buffers(struct tls_session *session) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    /* Fails (and keeps them) if a record is half read or written */
+    (void)SSL_free_buffers(session->ssl);
+#endif
+}
+
+/*
+ * Map what SSL_read() or SSL_write() returned to what recv() or
+ * sendmsg() would have
+ */
+static ssize_t tls_result(struct tls_session *session, int res) {
+    switch (SSL_get_error(session->ssl, res)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0) {
+            errno = ECONNRESET;
+        }
+        return -1;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+ssize_t tls_recv(struct tls_session *session, void *buf, size_t len) {
+    ERR_clear_error();
+    errno = 0;
+    int res = SSL_read(session->ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+    if (res > 0) {
+        return res;
+    }
+    return tls_result(session, res);
+}
+
+ssize_t tls_sendmsg(struct tls_session *session, const struct msghdr *m) {
+    char record[TLS_RECORD_SIZE];
+    ssize_t total = 0;
+    size_t ii = 0;
+    size_t offset = 0;
+
+    /*
+     * Gather the iovecs into records of our own, instead of putting the
+     * header and the value of a response in records of their own. A write
+     * that has to wait is retried with the same data, which is what
+     * OpenSSL wants.
+     */
+    while (ii < m->msg_iovlen) {
+        size_t len = 0;
+        size_t jj = ii;
+        size_t off = offset;
+        while (jj < m->msg_iovlen && len < sizeof(record)) {
+            size_t n = m->msg_iov[jj].iov_len - off;
+            if (n > sizeof(record) - len) {
+                n = sizeof(record) - len;
+            }
+            memcpy(record + len, (char *)m->msg_iov[jj].iov_base + off, n);
+            len += n;
+            off += n;
+            if (off == m->msg_iov[jj].iov_len) {
+                ++jj;
+                off = 0;
+            }
+        }
+        if (len == 0) {
+            break;
+        }
+
+        ERR_clear_error();
+        errno = 0;
+        int res = SSL_write(session->ssl, record, (int)len);
+        if (res <= 0) {
+            if (total > 0) {
+                return total;
+            }
+            return tls_result(session, res);
+        }
+        total += res;
+        if ((size_t)res < len) {
+            return total;
+        }
+        ii = jj;
+        offset = off;
+    }
+    return total;
+}
+
+#else
+
+bool tls_init(const char *cert, const char *key, char *err, size_t errsz) {
+    snprintf(err, errsz, "memcached was built without TLS (OpenSSL)");
+    return false;
+}
+
+struct tls_session *tls_session_create(SOCKET sfd) {
+    return NULL;
+}
+
+void tls_session_destroy(struct tls_session *session) {
+    assert(session == NULL);
+}
+
+enum tls_handshake_result tls_handshake(struct tls_session *session) {
+    return TLS_HANDSHAKE_ERROR;
+}
+
+bool tls_offloaded(const struct tls_session *session) {
+    return false;
+}
+
+bool tls_pending(const struct tls_session *session) {
+    return false;
+}
+
+void tls_release_buffers(struct tls_session *session) {
+}
+
+ssize_t tls_recv(struct tls_session *session, void *buf, size_t len) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t tls_sendmsg(struct tls_session *session, const struct msghdr *m) {
+    errno = ENOTSUP;
+    return -1;
+}
+#endif
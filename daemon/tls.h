@@ -0,0 +1,78 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef TLS_H
+#define TLS_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * TLS for the clients connecting to the port given with -T. The handshake
+ * runs with OpenSSL on the worker thread, and when it's done OpenSSL hands
+ * the keys to the kernel (kTLS, TCP_ULP "tls"). Once the kernel does the
+ * records in both directions the connection is read and written like any
+ * other one. Where it can't (no tls module, a cipher or a protocol version
+ * the kernel doesn't do) the connection stays with OpenSSL in userspace:
+ * tls_recv() and tls_sendmsg() stand in for recv() and sendmsg().
+ */
+
+struct tls_session;
+
+enum tls_handshake_result {
+    TLS_HANDSHAKE_DONE,
+    TLS_HANDSHAKE_WANT_READ,
+    TLS_HANDSHAKE_WANT_WRITE,
+    TLS_HANDSHAKE_ERROR
+};
+
+/**
+ * Load the certificate chain and the private key (both PEM; the key may
+ * be in the certificate file).
+ *
+ * @param key the key file, or NULL if it's in the certificate file
+ * @param err where to put what went wrong
+ * @return false if we can't serve TLS with them
+ */
+bool tls_init(const char *cert, const char *key, char *err, size_t errsz);
+
+/**
+ * Remember that the connections accepted on sfd talk TLS (all of them
+ * are added at startup, before the threads accept anything).
+ */
+void tls_add_listener(SOCKET sfd);
+bool tls_is_listener(SOCKET sfd);
+
+/*@null@*/
+struct tls_session *tls_session_create(SOCKET sfd);
+void tls_session_destroy(struct tls_session *session);
+
+enum tls_handshake_result tls_handshake(struct tls_session *session);
+
+/**
+ * Does the kernel do the records in both directions? (Only known once the
+ * handshake is done.)
+ */
+bool tls_offloaded(const struct tls_session *session);
+
+/**
+ * Is there data OpenSSL already read off the socket? (The socket won't
+ * tell us about it.)
+ */
+bool tls_pending(const struct tls_session *session);
+
+/**
+ * Free the record buffers OpenSSL keeps for the session (it allocates
+ * them again when they're needed), if there's nothing in them.
+ */
+void tls_release_buffers(struct tls_session *session);
+
+/**
+ * recv() and sendmsg() through OpenSSL: -1 with errno set to EAGAIN if we
+ * have to wait for the socket, 0 from tls_recv() if the client closed the
+ * session.
+ */
+ssize_t tls_recv(struct tls_session *session, void *buf, size_t len);
+ssize_t tls_sendmsg(struct tls_session *session, const struct msghdr *m);
+
+#endif
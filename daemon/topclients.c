@@ -0,0 +1,111 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The heaviest clients of a worker thread (see topclients.h)
+ */
+#include "config.h"
+#include "topclients.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void topclients_init(struct topclients *t) {
+    pthread_mutex_init(&t->mutex, NULL);
+    t->nused = 0;
+}
+
+void topclients_reset(struct topclients *t) {
+    pthread_mutex_lock(&t->mutex);
+    t->nused = 0;
+    pthread_mutex_unlock(&t->mutex);
+}
+
+static void traffic_add(struct client_traffic *to,
+                        const struct client_traffic *from) {
+    to->ops += from->ops;
+    to->bytes_read += from->bytes_read;
+    to->bytes_written += from->bytes_written;
+    to->engine_cycles += from->engine_cycles;
+}
+
+int topclients_add(struct topclients *t, int hint, const char *name,
+                   const struct client_traffic *delta) {
+    pthread_mutex_lock(&t->mutex);
+
+    int slot = -1;
+    if (hint >= 0 && hint < t->nused &&
+        strcmp(t->clients[hint].name, name) == 0) {
+        slot = hint;
+    } else {
+        for (int ii = 0; ii < t->nused; ++ii) {
+            if (strcmp(t->clients[ii].name, name) == 0) {
+                slot = ii;
+                break;
+            }
+        }
+    }
+
+    if (slot == -1) {
+        struct topclient *client;
+        if (t->nused < TOPCLIENTS_SIZE) {
+            slot = t->nused++;
+            client = &t->clients[slot];
+            memset(client, 0, sizeof(*client));
+        } else {
+            /* Replace the one with the fewest ops, keeping its count */
+            slot = 0;
+            for (int ii = 1; ii < TOPCLIENTS_SIZE; ++ii) {
+                if (t->clients[ii].traffic.ops < t->clients[slot].traffic.ops) {
+                    slot = ii;
+                }
+            }
+            client = &t->clients[slot];
+            uint64_t ops = client->traffic.ops;
+            memset(client, 0, sizeof(*client));
+            client->traffic.ops = client->ops_error = ops;
+        }
+        strncpy(client->name, name, sizeof(client->name) - 1);
+    }
+
+    traffic_add(&t->clients[slot].traffic, delta);
+    pthread_mutex_unlock(&t->mutex);
+    return slot;
+}
+
+int topclients_merge(struct topclient *out, int nout, int max,
+                     struct topclients *t) {
+    pthread_mutex_lock(&t->mutex);
+    for (int ii = 0; ii < t->nused; ++ii) {
+        struct topclient *client = &t->clients[ii];
+        int jj;
+        for (jj = 0; jj < nout; ++jj) {
+            if (strcmp(out[jj].name, client->name) == 0) {
+                break;
+            }
+        }
+        if (jj == nout) {
+            if (nout == max) {
+                continue;
+            }
+            memset(&out[jj], 0, sizeof(out[jj]));
+            memcpy(out[jj].name, client->name, sizeof(out[jj].name));
+            ++nout;
+        }
+        traffic_add(&out[jj].traffic, &client->traffic);
+        out[jj].ops_error += client->ops_error;
+    }
+    pthread_mutex_unlock(&t->mutex);
+    return nout;
+}
+
+static int topclient_compare(const void *a, const void *b) {
+    const struct topclient *x = a;
+    const struct topclient *y = b;
+    if (x->traffic.ops == y->traffic.ops) {
+        return 0;
+    }
+    return x->traffic.ops > y->traffic.ops ? -1 : 1;
+}
+
+void topclients_sort(struct topclient *clients, int nclients) {
+    qsort(clients, nclients, sizeof(*clients), topclient_compare);
+}
@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef TOPCLIENTS_H
+#define TOPCLIENTS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The heaviest clients of a worker thread, by peer address or by SASL
+ * user. A table holds at most TOPCLIENTS_SIZE clients and when a new one
+ * shows up in a full table it takes the place of the one with the fewest
+ * ops (the "space saving" algorithm): it inherits that count, so a
+ * client's ops are never underestimated and overestimated by no more
+ * than ops_error. Anybody sending more than 1 / TOPCLIENTS_SIZE of the
+ * ops is in the table.
+ */
+#define TOPCLIENTS_SIZE 64
+/** Big enough for an IPv6 address */
+#define TOPCLIENTS_NAME 48
+
+struct client_traffic {
+    uint64_t ops;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    /** cycles spent in engine calls (see timings_cycles()) */
+    uint64_t engine_cycles;
+};
+
+struct topclient {
+    char name[TOPCLIENTS_NAME];
+    struct client_traffic traffic;
+    /** how many of the ops may belong to the clients it displaced */
+    uint64_t ops_error;
+};
+
+struct topclients {
+    pthread_mutex_t mutex;
+    int nused;
+    struct topclient clients[TOPCLIENTS_SIZE];
+};
+
+void topclients_init(struct topclients *t);
+void topclients_reset(struct topclients *t);
+
+/**
+ * Add what a client did to the table.
+ *
+ * @param hint where the client was the last time (-1 if unknown)
+ * @return where it is now (pass it as the hint the next time)
+ */
+int topclients_add(struct topclients *t, int hint, const char *name,
+                   const struct client_traffic *delta);
+
+/**
+ * Merge the clients of a table into out (sorted or not) by their names
+ *
+ * @param nout the number of clients in out
+ * @param max what out has room for
+ * @return the number of clients in out
+ */
+int topclients_merge(struct topclient *out, int nout, int max,
+                     struct topclients *t);
+
+/**
+ * Sort the clients by their ops, most first
+ */
+void topclients_sort(struct topclient *clients, int nclients);
+
+#endif
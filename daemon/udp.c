@@ -0,0 +1,388 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Batched I/O for the UDP transport (see udp.h)
+ */
+#include "config.h"
+#include "udp.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#ifdef HAVE_NETINET_UDP_H
+#include <netinet/udp.h>
+#endif
+
+#include "memcached.h"
+
+#if defined(UDP_SEGMENT) && defined(__linux__)
+#define HAVE_UDP_GSO 1
+/** The kernel takes no more segments than this in one send */
+#define UDP_GSO_MAX_SEGMENTS 64
+#define UDP_GSO_MAX_BYTES 65000
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/** The frames of a request that came in more than one */
+struct udp_partial {
+    bool used;
+    uint16_t request_id;
+    uint16_t nframes;
+    uint16_t nreceived;
+    time_t started;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    size_t nbytes;
+    char *frames[UDP_MAX_FRAMES];
+    uint32_t sizes[UDP_MAX_FRAMES];
+};
+
+struct udp_reader {
+    /** the datagrams of the last batch, from next to count are left */
+    int next;
+    int count;
+    struct {
+        char *data;
+        size_t len;
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+    } datagrams[UDP_BATCH];
+    struct udp_partial partial[UDP_REASSEMBLY];
+    struct udp_reader_stats stats;
+};
+
+struct udp_reader *udp_reader_create(void) {
+    struct udp_reader *reader = calloc(1, sizeof(*reader));
+    if (reader == NULL) {
+        return NULL;
+    }
+    for (int ii = 0; ii < UDP_BATCH; ++ii) {
+        if ((reader->datagrams[ii].data = malloc(UDP_READ_BUFFER_SIZE)) == NULL) {
+            udp_reader_destroy(reader);
+            return NULL;
+        }
+    }
+    return reader;
+}
+
+static void partial_reset(struct udp_partial *p) {
+    for (int ii = 0; ii < UDP_MAX_FRAMES; ++ii) {
+        free(p->frames[ii]);
+    }
+    memset(p, 0, sizeof(*p));
+}
+
+void udp_reader_destroy(struct udp_reader *reader) {
+    if (reader == NULL) {
+        return;
+    }
+    for (int ii = 0; ii < UDP_BATCH; ++ii) {
+        free(reader->datagrams[ii].data);
+    }
+    for (int ii = 0; ii < UDP_REASSEMBLY; ++ii) {
+        partial_reset(&reader->partial[ii]);
+    }
+    free(reader);
+}
+
+bool udp_reader_pending(const struct udp_reader *reader) {
+    return reader->next < reader->count;
+}
+
+void udp_reader_stats(const struct udp_reader *reader,
+                      struct udp_reader_stats *stats) {
+    *stats = reader->stats;
+}
+
+/*
+ * Read the next batch of datagrams
+ *
+ * @return false if there was nothing to read
+ */
+static bool udp_reader_fill(struct udp_reader *reader, SOCKET sfd,
+                            uint64_t *nread) {
+    reader->next = reader->count = 0;
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int ii = 0; ii < UDP_BATCH; ++ii) {
+        iov[ii].iov_base = reader->datagrams[ii].data;
+        iov[ii].iov_len = UDP_READ_BUFFER_SIZE;
+        msgs[ii].msg_hdr.msg_iov = &iov[ii];
+        msgs[ii].msg_hdr.msg_iovlen = 1;
+        msgs[ii].msg_hdr.msg_name = &reader->datagrams[ii].addr;
+        msgs[ii].msg_hdr.msg_namelen = sizeof(reader->datagrams[ii].addr);
+    }
+
+    int res = recvmmsg(sfd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (res <= 0) {
+        return false;
+    }
+    for (int ii = 0; ii < res; ++ii) {
+        reader->datagrams[ii].len = msgs[ii].msg_len;
+        reader->datagrams[ii].addrlen = msgs[ii].msg_hdr.msg_namelen;
+        *nread += msgs[ii].msg_len;
+    }
+    reader->count = res;
+#else
+    reader->datagrams[0].addrlen = sizeof(reader->datagrams[0].addr);
+    ssize_t res = recvfrom(sfd, reader->datagrams[0].data, UDP_READ_BUFFER_SIZE,
+                           0, (struct sockaddr *)&reader->datagrams[0].addr,
+                           &reader->datagrams[0].addrlen);
+    if (res <= 0) {
+        return false;
+    }
+    reader->datagrams[0].len = res;
+    *nread += res;
+    reader->count = 1;
+#endif
+    reader->stats.batches++;
+    reader->stats.datagrams += reader->count;
+    return true;
+}
+
+/*
+ * Find the request a frame belongs to, or make room for it (in a free
+ * slot, one that timed out or the oldest one)
+ */
+static struct udp_partial *partial_find(struct udp_reader *reader,
+                                        uint16_t request_id,
+                                        const struct sockaddr_storage *addr,
+                                        socklen_t addrlen, time_t now) {
+    struct udp_partial *victim = NULL;
+    for (int ii = 0; ii < UDP_REASSEMBLY; ++ii) {
+        struct udp_partial *p = &reader->partial[ii];
+        if (p->used && p->request_id == request_id && p->addrlen == addrlen &&
+            memcmp(&p->addr, addr, addrlen) == 0) {
+            return p;
+        }
+        if (p->used && now - p->started > UDP_REASSEMBLY_TIMEOUT) {
+            reader->stats.dropped += p->nreceived;
+            partial_reset(p);
+        }
+        if (!p->used) {
+            if (victim == NULL || victim->used) {
+                victim = p;
+            }
+        } else if (victim == NULL ||
+                   (victim->used && p->started < victim->started)) {
+            victim = p;
+        }
+    }
+
+    if (victim->used) {
+        reader->stats.dropped += victim->nreceived;
+        partial_reset(victim);
+    }
+    victim->used = true;
+    victim->request_id = request_id;
+    victim->started = now;
+    memcpy(&victim->addr, addr, addrlen);
+    victim->addrlen = addrlen;
+    return victim;
+}
+
+size_t udp_reader_next(struct udp_reader *reader, SOCKET sfd,
+                       char *buf, size_t bufsz, uint16_t *request_id,
+                       struct sockaddr_storage *addr, socklen_t *addrlen,
+                       uint64_t *nread, time_t now) {
+    while (true) {
+        if (reader->next == reader->count &&
+            !udp_reader_fill(reader, sfd, nread)) {
+            return 0;
+        }
+
+        int dd = reader->next++;
+        const unsigned char *hdr = (void*)reader->datagrams[dd].data;
+        size_t len = reader->datagrams[dd].len;
+        if (len <= UDP_HEADER_SIZE) {
+            reader->stats.dropped++;
+            continue;
+        }
+
+        uint16_t id = hdr[0] * 256 + hdr[1];
+        uint16_t seq = hdr[2] * 256 + hdr[3];
+        uint16_t nframes = hdr[4] * 256 + hdr[5];
+        len -= UDP_HEADER_SIZE;
+
+        if (nframes == 1 && seq == 0) {
+            if (len > bufsz) {
+                reader->stats.dropped++;
+                continue;
+            }
+            memcpy(buf, hdr + UDP_HEADER_SIZE, len);
+            *request_id = id;
+            memcpy(addr, &reader->datagrams[dd].addr,
+                   reader->datagrams[dd].addrlen);
+            *addrlen = reader->datagrams[dd].addrlen;
+            return len;
+        }
+
+        if (nframes == 0 || nframes > UDP_MAX_FRAMES || seq >= nframes) {
+            reader->stats.dropped++;
+            continue;
+        }
+
+        struct udp_partial *p = partial_find(reader, id,
+                                             &reader->datagrams[dd].addr,
+                                             reader->datagrams[dd].addrlen,
+                                             now);
+        if (p->nframes == 0) {
+            p->nframes = nframes;
+        }
+        if (p->nframes != nframes || p->frames[seq] != NULL ||
+            p->nbytes + len > bufsz ||
+            (p->frames[seq] = malloc(len)) == NULL) {
+            /* Not the request we thought, a duplicate or too big */
+            reader->stats.dropped += p->nreceived + 1;
+            partial_reset(p);
+            continue;
+        }
+        memcpy(p->frames[seq], hdr + UDP_HEADER_SIZE, len);
+        p->sizes[seq] = len;
+        p->nbytes += len;
+        if (++p->nreceived < p->nframes) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (int ii = 0; ii < p->nframes; ++ii) {
+            memcpy(buf + offset, p->frames[ii], p->sizes[ii]);
+            offset += p->sizes[ii];
+        }
+        *request_id = id;
+        memcpy(addr, &p->addr, p->addrlen);
+        *addrlen = p->addrlen;
+        reader->stats.reassembled++;
+        partial_reset(p);
+        return offset;
+    }
+}
+
+#ifdef HAVE_UDP_GSO
+static volatile bool udp_gso = true;
+
+static size_t msg_len(const struct msghdr *m) {
+    size_t len = 0;
+    for (size_t ii = 0; ii < m->msg_iovlen; ++ii) {
+        len += m->msg_iov[ii].iov_len;
+    }
+    return len;
+}
+
+/*
+ * Send the frames of one size (and a shorter last one) in one go and let
+ * the kernel (or the NIC) cut them up again
+ *
+ * @return the number of frames sent, 0 if there weren't enough frames of
+ *         the same size (or the kernel doesn't do it), -1 on errors
+ */
+static int udp_send_gso(SOCKET sfd, struct msghdr *msgs, int nmsgs,
+                        size_t *nbytes) {
+    size_t segment = msg_len(&msgs[0]);
+    size_t total = 0;
+    size_t iovlen = 0;
+    int nsegments;
+
+    for (nsegments = 0; nsegments < nmsgs && nsegments < UDP_GSO_MAX_SEGMENTS;
+         ++nsegments) {
+        struct msghdr *m = &msgs[nsegments];
+        size_t len = msg_len(m);
+        if (len > segment || total + len > UDP_GSO_MAX_BYTES ||
+            iovlen + m->msg_iovlen > IOV_MAX ||
+            m->msg_name != msgs[0].msg_name ||
+            (nsegments > 0 &&
+             m->msg_iov != msgs[nsegments - 1].msg_iov + msgs[nsegments - 1].msg_iovlen)) {
+            break;
+        }
+        total += len;
+        iovlen += m->msg_iovlen;
+        if (len < segment) {
+            ++nsegments;
+            break;
+        }
+    }
+    if (nsegments < 2) {
+        return 0;
+    }
+
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr m = {
+        .msg_name = msgs[0].msg_name,
+        .msg_namelen = msgs[0].msg_namelen,
+        .msg_iov = msgs[0].msg_iov,
+        .msg_iovlen = iovlen,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&m);
+    cm->cmsg_level = IPPROTO_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t size = (uint16_t)segment;
+    memcpy(CMSG_DATA(cm), &size, sizeof(size));
+
+    ssize_t res = sendmsg(sfd, &m, 0);
+    if (res == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        /* No offload for this socket (or device); don't try it again */
+        udp_gso = false;
+        return 0;
+    }
+    *nbytes = res;
+    return nsegments;
+}
+
+bool udp_gso_enabled(void) {
+    return udp_gso;
+}
+#else
+bool udp_gso_enabled(void) {
+    return false;
+}
+#endif
+
+#define UDP_SEND_BATCH 64
+
+int udp_send(SOCKET sfd, struct msghdr *msgs, int nmsgs, size_t *nbytes) {
+    *nbytes = 0;
+#ifdef HAVE_UDP_GSO
+    if (nmsgs > 1 && udp_gso) {
+        int res = udp_send_gso(sfd, msgs, nmsgs, nbytes);
+        if (res != 0) {
+            return res;
+        }
+    }
+#endif
+
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr mm[UDP_SEND_BATCH];
+    int count = nmsgs < UDP_SEND_BATCH ? nmsgs : UDP_SEND_BATCH;
+    for (int ii = 0; ii < count; ++ii) {
+        mm[ii].msg_hdr = msgs[ii];
+        mm[ii].msg_len = 0;
+    }
+    int res = sendmmsg(sfd, mm, count, 0);
+    for (int ii = 0; ii < res; ++ii) {
+        *nbytes += mm[ii].msg_len;
+    }
+    return res;
+#else
+    ssize_t res = sendmsg(sfd, msgs, 0);
+    if (res == -1) {
+        return -1;
+    }
+    *nbytes = res;
+    return 1;
+#endif
+}
@@ -0,0 +1,90 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef UDP_H
+#define UDP_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Batched I/O for the UDP transport. Every datagram starts with an
+ * 8 byte frame header: the request id, the number of the frame, the
+ * number of frames in the request (or response) and 2 reserved bytes.
+ *
+ * The reader takes up to UDP_BATCH datagrams off the socket with one
+ * recvmmsg() and hands them out one request at a time. Requests in more
+ * than one frame are put together again by request id and sender; the
+ * frames of a request that doesn't complete in UDP_REASSEMBLY_TIMEOUT
+ * seconds are dropped.
+ */
+#define UDP_BATCH 8
+/** The requests we put together at the same time */
+#define UDP_REASSEMBLY 4
+#define UDP_REASSEMBLY_TIMEOUT 5
+/** The most frames a request may have */
+#define UDP_MAX_FRAMES 64
+
+struct udp_reader;
+
+struct udp_reader_stats {
+    /** the number of recvmmsg() (or recvfrom()) calls that got something */
+    uint64_t batches;
+    uint64_t datagrams;
+    /** requests put together from more than one frame */
+    uint64_t reassembled;
+    /** frames dropped (bad header, too big, timed out) */
+    uint64_t dropped;
+};
+
+/*@null@*/
+struct udp_reader *udp_reader_create(void);
+void udp_reader_destroy(struct udp_reader *reader);
+
+/**
+ * Get the next complete request sent to the socket (without the frame
+ * headers).
+ *
+ * @param buf where to copy the request
+ * @param bufsz the size of buf
+ * @param request_id set to the id of the request
+ * @param addr set to who sent it
+ * @param addrlen the size of addr, set to the size of the address
+ * @param nread incremented by the number of bytes read from the socket
+ * @param now the current time (for the reassembly timeout)
+ * @return the size of the request, or 0 if there is no complete
+ *         request on the socket
+ */
+size_t udp_reader_next(struct udp_reader *reader, SOCKET sfd,
+                       char *buf, size_t bufsz, uint16_t *request_id,
+                       struct sockaddr_storage *addr, socklen_t *addrlen,
+                       uint64_t *nread, time_t now);
+
+/**
+ * Are there datagrams left from the last batch? (The socket won't tell
+ * us about those.)
+ */
+bool udp_reader_pending(const struct udp_reader *reader);
+
+void udp_reader_stats(const struct udp_reader *reader,
+                      struct udp_reader_stats *stats);
+
+/**
+ * Send the frames of a response (all to the same address). They go in
+ * one sendmsg() with UDP segmentation offload when we can, or in one
+ * sendmmsg().
+ *
+ * @param nbytes set to the number of bytes sent
+ * @return the number of messages sent, or -1 (with errno set)
+ */
+int udp_send(SOCKET sfd, struct msghdr *msgs, int nmsgs, size_t *nbytes);
+
+/**
+ * Are the responses sent with UDP segmentation offload? It's turned off
+ * the first time the kernel refuses it.
+ */
+bool udp_gso_enabled(void);
+
+#endif
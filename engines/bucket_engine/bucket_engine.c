@@ -17,6 +17,8 @@
 #include <assert.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <inttypes.h>
+#include <limits.h>
 
 #include <memcached/engine.h>
 #include "genhash.h"
@@ -27,6 +29,12 @@
 static rel_time_t (*get_current_time)(void);
 static EXTENSION_LOGGER_DESCRIPTOR *logger;
 
+/* The engines may return the value of an item in several pieces */
+typedef union {
+    item_info info;
+    char bytes[sizeof(item_info) + ((IOV_MAX - 1) * sizeof(struct iovec))];
+} item_info_holder;
+
 #if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
 #include <atomic.h>
 static inline int ATOMIC_ADD(volatile int *dest, int value) {
@@ -41,18 +49,33 @@ static inline int ATOMIC_DECR(volatile int *dest) {
     return atomic_dec_32_nv((volatile unsigned int *)dest);
 }
 
+static inline uint64_t ATOMIC_ADD64(volatile uint64_t *dest, int64_t value) {
+    return atomic_add_64_nv(dest, value);
+}
+
 static inline int ATOMIC_CAS(volatile bucket_state_t *dest, int prev, int next) {
     return (prev == atomic_cas_uint((volatile uint_t*)dest, (uint_t)prev,
                                     (uint_t)next));
 }
+
+#define ATOMIC_CAS_PTR(ptr, oldval, newval) \
+            (atomic_cas_ptr(ptr, oldval, newval) == (oldval))
 #else
 #define ATOMIC_ADD(i, by) __sync_add_and_fetch(i, by)
 #define ATOMIC_INCR(i) ATOMIC_ADD(i, 1)
 #define ATOMIC_DECR(i) ATOMIC_ADD(i, -1)
+#define ATOMIC_ADD64(i, by) ATOMIC_ADD(i, by)
 #define ATOMIC_CAS(ptr, oldval, newval) \
             __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define ATOMIC_CAS_PTR(ptr, oldval, newval) ATOMIC_CAS(ptr, oldval, newval)
 #endif
 
+/* The slice of the engines' client counts used by the current thread */
+static pthread_key_t client_shard_key;
+static pthread_once_t client_shard_once = PTHREAD_ONCE_INIT;
+static bool client_shard_keyed;
+static volatile int client_shard_next;
+
 static ENGINE_ERROR_CODE (*upstream_reserve_cookie)(const void *cookie);
 static ENGINE_ERROR_CODE (*upstream_release_cookie)(const void *cookie);
 static ENGINE_ERROR_CODE bucket_engine_reserve_cookie(const void *cookie);
@@ -99,6 +122,22 @@ static ENGINE_ERROR_CODE bucket_get(ENGINE_HANDLE* handle,
                                     const void* key,
                                     const int nkey,
                                     uint16_t vbucket);
+static ENGINE_ERROR_CODE bucket_get_multi(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          get_multi_key *keys,
+                                          int nkeys);
+static uint64_t bucket_get_lease(ENGINE_HANDLE* handle,
+                                 const void* cookie,
+                                 const void* key,
+                                 const int nkey);
+static ENGINE_ERROR_CODE bucket_item_allocate_multi(ENGINE_HANDLE* handle,
+                                                    const void* cookie,
+                                                    allocate_multi_item *items,
+                                                    int nitems);
+static ENGINE_ERROR_CODE bucket_store_multi(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            store_multi_item *items,
+                                            int nitems);
 static ENGINE_ERROR_CODE bucket_get_stats(ENGINE_HANDLE* handle,
                                           const void *cookie,
                                           const char *stat_key,
@@ -138,6 +177,11 @@ static ENGINE_ERROR_CODE bucket_unknown_command(ENGINE_HANDLE* handle,
                                                 protocol_binary_request_header *request,
                                                 ADD_RESPONSE response);
 
+static void bucket_get_command_handlers(ENGINE_HANDLE* handle,
+                                        ENGINE_COMMAND_HANDLER handlers[0x100]);
+
+static void load_command_handlers(proxied_engine_handle_t *peh);
+
 static bool bucket_get_item_info(ENGINE_HANDLE *handle,
                                  const void *cookie,
                                  const item* item,
@@ -209,7 +253,12 @@ struct bucket_engine bucket_engine = {
         .get_tap_iterator = bucket_get_tap_iterator,
         .item_set_cas     = bucket_item_set_cas,
         .get_item_info    = bucket_get_item_info,
-        .errinfo          = bucket_errinfo
+        .errinfo          = bucket_errinfo,
+        .get_multi        = bucket_get_multi,
+        .get_lease        = bucket_get_lease,
+        .allocate_multi   = bucket_item_allocate_multi,
+        .store_multi      = bucket_store_multi,
+        .get_command_handlers = bucket_get_command_handlers
     },
     .initialized = false,
     .shutdown = {
@@ -463,6 +512,38 @@ static void* bucket_get_extension(extension_type_t type) {
     return bucket_engine.upstream_server->extension->get_extension(type);
 }
 
+static void client_shard_init(void) {
+    client_shard_keyed = pthread_key_create(&client_shard_key, NULL) == 0;
+}
+
+/**
+ * The slice of the client counts the calling thread uses. The threads
+ * get one in turn the first time they call into an engine and keep it,
+ * so a client always gives back the count it took from the same slice.
+ */
+static int client_shard(void) {
+    if (!client_shard_keyed) {
+        return 0;
+    }
+    intptr_t shard = (intptr_t)pthread_getspecific(client_shard_key);
+    if (shard == 0) {
+        shard = ATOMIC_INCR(&client_shard_next);
+        pthread_setspecific(client_shard_key, (void*)shard);
+    }
+    return (int)(shard % CLIENT_SHARDS);
+}
+
+/**
+ * The number of clients currently calling into the engine.
+ */
+static int engine_clients(proxied_engine_handle_t *peh) {
+    int total = 0;
+    for (int ii = 0; ii < CLIENT_SHARDS; ++ii) {
+        total += peh->clients[ii].count;
+    }
+    return total;
+}
+
 /* Engine API functions */
 
 /**
@@ -509,6 +590,7 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
     bucket_engine.server.cookie->release = bucket_engine_release_cookie;
 
     logger = bucket_engine.server.extension->get_extension(EXTENSION_LOGGER);
+    pthread_once(&client_shard_once, client_shard_init);
     return ENGINE_SUCCESS;
 }
 
@@ -532,6 +614,86 @@ static void release_handle(proxied_engine_handle_t *peh) {
     }
 }
 
+/**
+ * An immutable copy of the engines table (open addressing on the
+ * bucket names), so that find_bucket doesn't have to take the engines
+ * lock. find_bucket registers itself in registry.readers for as long as
+ * it uses it. Creating or deleting a bucket publishes a new snapshot
+ * and waits for the readers of the old one to leave before freeing it,
+ * and before the caller may free any bucket it no longer lists.
+ */
+struct bucket_snapshot {
+    size_t mask;
+    proxied_engine_handle_t *slots[];
+};
+
+static proxied_engine_handle_t *bucket_snapshot_find(struct bucket_snapshot *snapshot,
+                                                     const char *name,
+                                                     size_t nname) {
+    size_t ii = genhash_string_hash(name, nname) & snapshot->mask;
+    proxied_engine_handle_t *peh;
+    while ((peh = snapshot->slots[ii]) != NULL) {
+        if (peh->name_len == nname && memcmp(peh->name, name, nname) == 0) {
+            return peh;
+        }
+        ii = (ii + 1) & snapshot->mask;
+    }
+    return NULL;
+}
+
+static void bucket_snapshot_add(const void *key, size_t nkey,
+                                const void *val, size_t nval,
+                                void *arg) {
+    (void)nval;
+    struct bucket_snapshot *snapshot = arg;
+    size_t ii = genhash_string_hash(key, nkey) & snapshot->mask;
+    while (snapshot->slots[ii] != NULL) {
+        ii = (ii + 1) & snapshot->mask;
+    }
+    snapshot->slots[ii] = (proxied_engine_handle_t *)val;
+}
+
+/**
+ * Wait for everyone who may still be looking at a snapshot we replaced.
+ */
+static void bucket_registry_synchronize(void) {
+    int epoch = bucket_engine.registry.epoch & 1;
+    ATOMIC_INCR(&bucket_engine.registry.epoch);
+    for (int ii = 0; ii < CLIENT_SHARDS; ++ii) {
+        while (bucket_engine.registry.readers[epoch][ii].count != 0) {
+            usleep(10);
+        }
+    }
+}
+
+/**
+ * Publish a new snapshot of the engines table. If we can't allocate
+ * one, find_bucket falls back to searching the table under the lock.
+ * You must hold the engines lock.
+ */
+static void bucket_registry_publish_UNLOCKED(void) {
+    struct bucket_snapshot *snapshot = NULL;
+    size_t size = 8;
+    while (size < 2 * (size_t)genhash_size(bucket_engine.engines)) {
+        size <<= 1;
+    }
+    snapshot = calloc(1, sizeof(*snapshot) + size * sizeof(snapshot->slots[0]));
+    if (snapshot != NULL) {
+        snapshot->mask = size - 1;
+        genhash_iter(bucket_engine.engines, bucket_snapshot_add, snapshot);
+    }
+
+    struct bucket_snapshot *old = bucket_engine.registry.current;
+    bool swapped = ATOMIC_CAS_PTR(&bucket_engine.registry.current,
+                                  old, snapshot);
+    assert(swapped);
+    (void)swapped;
+    if (old != NULL) {
+        bucket_registry_synchronize();
+        free(old);
+    }
+}
+
 /**
  * Helper function to search for a named bucket in the list of engines
  * You must wrap this call with (un)lock_engines() in order for it to
@@ -566,9 +728,24 @@ static proxied_engine_handle_t* retain_handle(proxied_engine_handle_t *peh) {
  * releasing the handle with release_handle.
 */
 static proxied_engine_handle_t *find_bucket(const char *name) {
-    lock_engines();
-    proxied_engine_handle_t *rv = retain_handle(find_bucket_inner(name));
-    unlock_engines();
+    size_t nname = strlen(name);
+    int shard = client_shard();
+    int epoch = bucket_engine.registry.epoch & 1;
+    volatile int *readers = &bucket_engine.registry.readers[epoch][shard].count;
+
+    ATOMIC_INCR(readers);
+    struct bucket_snapshot *snapshot = bucket_engine.registry.current;
+    proxied_engine_handle_t *rv = NULL;
+    if (snapshot != NULL) {
+        rv = retain_handle(bucket_snapshot_find(snapshot, name, nname));
+    }
+    ATOMIC_DECR(readers);
+
+    if (snapshot == NULL) {
+        lock_engines();
+        rv = retain_handle(find_bucket_inner(name));
+        unlock_engines();
+    }
     return rv;
 }
 
@@ -594,7 +771,8 @@ static ENGINE_ERROR_CODE init_engine_handle(proxied_engine_handle_t *peh, const
     if (bucket_engine.topkeys != 0) {
         peh->topkeys = calloc(TK_SHARDS, sizeof(topkeys_t *));
         for (int i = 0; i < TK_SHARDS; i++) {
-            peh->topkeys[i] = topkeys_init(bucket_engine.topkeys);
+            peh->topkeys[i] = topkeys_init(bucket_engine.topkeys,
+                                           bucket_engine.topkeys_sketch);
         }
         if (peh->topkeys == NULL) {
             bucket_engine.upstream_server->stat->release_stats(peh->stats);
@@ -602,6 +780,20 @@ static ENGINE_ERROR_CODE init_engine_handle(proxied_engine_handle_t *peh, const
             return ENGINE_ENOMEM;
         }
     }
+#ifdef HAVE_POSIX_MEMALIGN
+    void *clients;
+    if (posix_memalign(&clients, CLIENT_SHARD_SIZE,
+                       CLIENT_SHARDS * sizeof(client_shard_t)) != 0) {
+        return ENGINE_ENOMEM;
+    }
+    memset(clients, 0, CLIENT_SHARDS * sizeof(client_shard_t));
+    peh->clients = clients;
+#else
+    peh->clients = calloc(CLIENT_SHARDS, sizeof(client_shard_t));
+    if (peh->clients == NULL) {
+        return ENGINE_ENOMEM;
+    }
+#endif
     peh->refcount = 1;
     peh->name = strdup(name);
     if (peh->name == NULL) {
@@ -630,6 +822,7 @@ static void uninit_engine_handle(proxied_engine_handle_t *peh) {
         }
         free(peh->topkeys);
     }
+    free(peh->clients);
     release_memory((void*)peh->name, peh->name_len);
     /* Note: looks like current engine API allows engine to keep some
      * connections reserved past destroy call return. This implies
@@ -710,6 +903,9 @@ static ENGINE_ERROR_CODE create_bucket_UNLOCKED(struct bucket_engine *e,
                          "Failed to initialize instance. Error code: %d\n", rv);
             }
             rv = ENGINE_FAILED;
+        } else {
+            load_command_handlers(peh);
+            bucket_registry_publish_UNLOCKED();
         }
     } else {
         if (msg) {
@@ -741,14 +937,23 @@ static ENGINE_ERROR_CODE create_bucket_UNLOCKED(struct bucket_engine *e,
  * @param engine the proxied engine
  */
 static void release_engine_handle(proxied_engine_handle_t *engine) {
-    assert(engine->clients > 0);
-    int count = ATOMIC_DECR(&engine->clients);
+    int count = ATOMIC_DECR(&engine->clients[client_shard()].count);
     assert(count >= 0);
-    if (count == 0 && engine->state == STATE_STOPPING) {
+    /* Our slice dropping to zero doesn't tell whether we were the
+     * last client, maybe_start_engine_shutdown sums all of them */
+    if (engine->state == STATE_STOPPING) {
         maybe_start_engine_shutdown(engine);
     }
 }
 
+/**
+ * Count the calling thread in the clients of the engine.
+ */
+static void acquire_engine_handle(proxied_engine_handle_t *engine) {
+    int count = ATOMIC_INCR(&engine->clients[client_shard()].count);
+    assert(count > 0);
+}
+
 /**
  * Returns engine handle for this connection.
  * All access to underlying engine must go through this function, because
@@ -780,6 +985,10 @@ static void release_engine_handle(proxied_engine_handle_t *engine) {
      it cannot happen because our bumped clients count prevents that.
  *
  * Q.E.D.
+ *
+ * The count is split in slices (see client_shard), but a client gives
+ * back what it took from its own slice, so none of them ever goes
+ * negative and a bumped slice still keeps the sum above 0.
  */
 static proxied_engine_handle_t *get_engine_handle(ENGINE_HANDLE *h,
                                                   const void *cookie) {
@@ -797,8 +1006,7 @@ static proxied_engine_handle_t *get_engine_handle(ENGINE_HANDLE *h,
         }
     }
 
-    int count = ATOMIC_INCR(&peh->clients);
-    assert(count > 0);
+    acquire_engine_handle(peh);
 
     if (peh->state != STATE_RUNNING) {
         release_engine_handle(peh);
@@ -825,8 +1033,7 @@ static proxied_engine_handle_t *try_get_engine_handle(ENGINE_HANDLE *h,
     proxied_engine_handle_t *peh = es->peh;
     proxied_engine_handle_t *ret = peh;
 
-    int count = ATOMIC_INCR(&peh->clients);
-    assert(count > 0);
+    acquire_engine_handle(peh);
     if (peh->state != STATE_RUNNING) {
         release_engine_handle(peh);
         ret = NULL;
@@ -1181,6 +1388,8 @@ static ENGINE_ERROR_CODE init_default_bucket(struct bucket_engine* se)
     ret = dv1->initialize(se->default_engine.pe.v0, se->default_bucket_config);
     if (ret != ENGINE_SUCCESS) {
         dv1->destroy(se->default_engine.pe.v0, false);
+    } else {
+        load_command_handlers(&se->default_engine);
     }
 
     return ret;
@@ -1245,6 +1454,9 @@ static ENGINE_ERROR_CODE bucket_initialize(ENGINE_HANDLE* handle,
     if (se->engines == NULL) {
         return ENGINE_ENOMEM;
     }
+    lock_engines();
+    bucket_registry_publish_UNLOCKED();
+    unlock_engines();
 
     se->upstream_server->callback->register_callback(handle, ON_CONNECT,
                                                      handle_connect, se);
@@ -1259,6 +1471,8 @@ static ENGINE_ERROR_CODE bucket_initialize(ENGINE_HANDLE* handle,
     if (se->has_default) {
         if ((ret = init_default_bucket(se)) != ENGINE_SUCCESS) {
             genhash_free(se->engines);
+            free(se->registry.current);
+            se->registry.current = NULL;
             return ret;
         }
     }
@@ -1331,6 +1545,8 @@ static void bucket_destroy(ENGINE_HANDLE* handle,
 
     genhash_free(se->engines);
     se->engines = NULL;
+    free(se->registry.current);
+    se->registry.current = NULL;
     free(se->default_engine_path);
     se->default_engine_path = NULL;
     free(se->admin_user);
@@ -1357,6 +1573,7 @@ static void bucket_destroy(ENGINE_HANDLE* handle,
  */
 static void *engine_shutdown_thread(void *arg) {
     bool skip;
+    bucket_engine.server.core->place_background_thread();
     // XXX:  Move state from STOPPED -> NULL.  This is an unbucket.
     must_lock(&bucket_engine.shutdown.mutex);
     skip = bucket_engine.shutdown.in_progress;
@@ -1399,6 +1616,7 @@ static void *engine_shutdown_thread(void *arg) {
     assert(upd == 1);
     assert(genhash_find(bucket_engine.engines,
                         peh->name, peh->name_len) == NULL);
+    bucket_registry_publish_UNLOCKED();
     unlock_engines();
 
     if (peh->cookie != NULL) {
@@ -1462,7 +1680,7 @@ static void maybe_start_engine_shutdown(proxied_engine_handle_t *e) {
     assert(e->state == STATE_STOPPING || e->state == STATE_STOPPED || e->state == STATE_NULL);
     /* observing 'state' before clients == 0 is _crucial_. See
      * get_engine_handle. */
-    if (e->state == STATE_STOPPING && e->clients == 0 && ATOMIC_CAS(&e->state, STATE_STOPPING, STATE_STOPPED)) {
+    if (e->state == STATE_STOPPING && engine_clients(e) == 0 && ATOMIC_CAS(&e->state, STATE_STOPPING, STATE_STOPPED)) {
         // Spin off a new thread to shut down the engine..
         pthread_attr_t attr;
         pthread_t tid;
@@ -1478,6 +1696,77 @@ static void maybe_start_engine_shutdown(proxied_engine_handle_t *e) {
     }
 }
 
+/**
+ * Account for ops operations on a bucket, and check them against the
+ * quotas for the current second. The window is reset by whoever sees a
+ * new second first, without any lock, so the limits may be overrun by
+ * the requests racing with the reset.
+ *
+ * @return false if the bucket used up its quota for this second (the
+ *         request should fail with ENGINE_TMPFAIL)
+ */
+static bool quota_admit(proxied_engine_handle_t *peh, int ops) {
+    if (bucket_engine.quota_ops != 0 || bucket_engine.quota_bytes != 0) {
+        rel_time_t now = get_current_time();
+        if (peh->quota.window != now) {
+            peh->quota.window = now;
+            peh->quota.window_ops = 0;
+            peh->quota.window_bytes = 0;
+        }
+        if ((bucket_engine.quota_bytes != 0 &&
+             peh->quota.window_bytes >= bucket_engine.quota_bytes) ||
+            (bucket_engine.quota_ops != 0 &&
+             ATOMIC_ADD64(&peh->quota.window_ops, ops) >
+             bucket_engine.quota_ops)) {
+            ATOMIC_ADD64(&peh->quota.throttled, ops);
+            return false;
+        }
+    }
+    ATOMIC_ADD64(&peh->quota.ops, ops);
+    return true;
+}
+
+/**
+ * Account for nbytes of values read or written in a bucket. They count
+ * against the quota of the requests that follow.
+ */
+static void quota_bytes(proxied_engine_handle_t *peh, uint64_t nbytes) {
+    ATOMIC_ADD64(&peh->quota.bytes, nbytes);
+    if (bucket_engine.quota_bytes != 0) {
+        ATOMIC_ADD64(&peh->quota.window_bytes, nbytes);
+    }
+}
+
+/* quota_bytes for an item returned by the engine */
+static void quota_item_bytes(proxied_engine_handle_t *peh,
+                             const void *cookie, const item *itm) {
+    item_info_holder info = { .info = { .nvalue = IOV_MAX } };
+    if (peh->pe.v1->get_item_info(peh->pe.v0, cookie, itm, &info.info)) {
+        quota_bytes(peh, info.info.nbytes);
+    }
+}
+
+static ENGINE_ERROR_CODE get_quota_stats(proxied_engine_handle_t *peh,
+                                         const void *cookie,
+                                         ADD_STAT add_stat) {
+    const struct {
+        const char *key;
+        uint64_t val;
+    } stats[] = {
+        { "quota_ops", bucket_engine.quota_ops },
+        { "quota_bytes", bucket_engine.quota_bytes },
+        { "ops", peh->quota.ops },
+        { "bytes", peh->quota.bytes },
+        { "throttled", peh->quota.throttled }
+    };
+    for (size_t ii = 0; ii < sizeof(stats) / sizeof(stats[0]); ++ii) {
+        char val[32];
+        int vlen = snprintf(val, sizeof(val), "%"PRIu64, stats[ii].val);
+        add_stat(stats[ii].key, strlen(stats[ii].key), val, vlen, cookie);
+    }
+    return ENGINE_SUCCESS;
+}
+
 /**
  * Implementation of the "item_allocate" function in the engine
  * specification. Look up the correct engine and call into the
@@ -1495,9 +1784,15 @@ static ENGINE_ERROR_CODE bucket_item_allocate(ENGINE_HANDLE* handle,
 
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh != NULL) {
-        ENGINE_ERROR_CODE ret;
-        ret = peh->pe.v1->allocate(peh->pe.v0, cookie, itm, key,
-                                   nkey, nbytes, flags, exptime);
+        ENGINE_ERROR_CODE ret = ENGINE_TMPFAIL;
+        /* The store that follows isn't counted again */
+        if (quota_admit(peh, 1)) {
+            ret = peh->pe.v1->allocate(peh->pe.v0, cookie, itm, key,
+                                       nkey, nbytes, flags, exptime);
+            if (ret == ENGINE_SUCCESS) {
+                quota_bytes(peh, nbytes);
+            }
+        }
         release_engine_handle(peh);
         return ret;
     } else {
@@ -1505,6 +1800,52 @@ static ENGINE_ERROR_CODE bucket_item_allocate(ENGINE_HANDLE* handle,
     }
 }
 
+/**
+ * Implementation of the allocate_multi function in the engine api. If
+ * the engine connected to the cookie doesn't implement it we'll just
+ * allocate the items one by one.
+ */
+static ENGINE_ERROR_CODE bucket_item_allocate_multi(ENGINE_HANDLE* handle,
+                                                    const void* cookie,
+                                                    allocate_multi_item *items,
+                                                    int nitems) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh == NULL) {
+        return ENGINE_DISCONNECT;
+    }
+    if (!quota_admit(peh, nitems)) {
+        release_engine_handle(peh);
+        return ENGINE_TMPFAIL;
+    }
+
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    if (peh->pe.v1->allocate_multi) {
+        ret = peh->pe.v1->allocate_multi(peh->pe.v0, cookie, items, nitems);
+    } else {
+        for (int ii = 0; ii < nitems; ++ii) {
+            items[ii].item = NULL;
+            items[ii].status = peh->pe.v1->allocate(peh->pe.v0, cookie,
+                                                    &items[ii].item,
+                                                    items[ii].key,
+                                                    items[ii].nkey,
+                                                    items[ii].nbytes,
+                                                    items[ii].flags,
+                                                    items[ii].exptime);
+        }
+    }
+
+    if (ret == ENGINE_SUCCESS) {
+        for (int ii = 0; ii < nitems; ++ii) {
+            if (items[ii].status == ENGINE_SUCCESS) {
+                quota_bytes(peh, items[ii].nbytes);
+            }
+        }
+    }
+
+    release_engine_handle(peh);
+    return ret;
+}
+
 /**
  * Implementation of the "item_delete" function in the engine
  * specification. Look up the correct engine and call into the
@@ -1519,6 +1860,10 @@ static ENGINE_ERROR_CODE bucket_item_delete(ENGINE_HANDLE* handle,
                                             uint16_t vbucket) {
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh) {
+        if (!quota_admit(peh, 1)) {
+            release_engine_handle(peh);
+            return ENGINE_TMPFAIL;
+        }
         ENGINE_ERROR_CODE ret;
         ret = peh->pe.v1->remove(peh->pe.v0, cookie, key, nkey, cas, vbucket);
         release_engine_handle(peh);
@@ -1570,10 +1915,15 @@ static ENGINE_ERROR_CODE bucket_get(ENGINE_HANDLE* handle,
                                     uint16_t vbucket) {
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh) {
+        if (!quota_admit(peh, 1)) {
+            release_engine_handle(peh);
+            return ENGINE_TMPFAIL;
+        }
         ENGINE_ERROR_CODE ret;
         ret = peh->pe.v1->get(peh->pe.v0, cookie, itm, key, nkey, vbucket);
 
         if (ret == ENGINE_SUCCESS) {
+            quota_item_bytes(peh, cookie, *itm);
             TK(peh->topkeys, get_hits, key, nkey, get_current_time());
         } else if (ret == ENGINE_KEY_ENOENT) {
             TK(peh->topkeys, get_misses, key, nkey, get_current_time());
@@ -1586,6 +1936,75 @@ static ENGINE_ERROR_CODE bucket_get(ENGINE_HANDLE* handle,
     }
 }
 
+/**
+ * Implementation of the get_multi function in the engine api. If the
+ * engine connected to the cookie doesn't implement get_multi we'll just
+ * do the lookups one by one.
+ */
+static ENGINE_ERROR_CODE bucket_get_multi(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          get_multi_key *keys,
+                                          int nkeys) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh == NULL) {
+        return ENGINE_DISCONNECT;
+    }
+    if (!quota_admit(peh, nkeys)) {
+        release_engine_handle(peh);
+        return ENGINE_TMPFAIL;
+    }
+
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    if (peh->pe.v1->get_multi) {
+        ret = peh->pe.v1->get_multi(peh->pe.v0, cookie, keys, nkeys);
+    } else {
+        for (int ii = 0; ii < nkeys; ++ii) {
+            keys[ii].item = NULL;
+            keys[ii].status = peh->pe.v1->get(peh->pe.v0, cookie,
+                                              &keys[ii].item,
+                                              keys[ii].key, keys[ii].nkey,
+                                              keys[ii].vbucket);
+        }
+    }
+
+    if (ret == ENGINE_SUCCESS) {
+        for (int ii = 0; ii < nkeys; ++ii) {
+            if (keys[ii].status == ENGINE_SUCCESS) {
+                quota_item_bytes(peh, cookie, keys[ii].item);
+                TK(peh->topkeys, get_hits, keys[ii].key, keys[ii].nkey,
+                   get_current_time());
+            } else if (keys[ii].status == ENGINE_KEY_ENOENT) {
+                TK(peh->topkeys, get_misses, keys[ii].key, keys[ii].nkey,
+                   get_current_time());
+            }
+        }
+    }
+
+    release_engine_handle(peh);
+    return ret;
+}
+
+/**
+ * Implementation of the get_lease function in the engine api. The
+ * engines that don't hand out leases have no token for anyone.
+ */
+static uint64_t bucket_get_lease(ENGINE_HANDLE* handle,
+                                 const void* cookie,
+                                 const void* key,
+                                 const int nkey) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh == NULL) {
+        return 0;
+    }
+
+    uint64_t token = 0;
+    if (peh->pe.v1->get_lease) {
+        token = peh->pe.v1->get_lease(peh->pe.v0, cookie, key, nkey);
+    }
+    release_engine_handle(peh);
+    return token;
+}
+
 static void add_engine(const void *key, size_t nkey,
                        const void *val, size_t nval,
                        void *arg) {
@@ -1715,6 +2134,9 @@ static ENGINE_ERROR_CODE bucket_get_stats(ENGINE_HANDLE* handle,
             memcmp("topkeys", stat_key, nkey) == 0) {
             rc = topkeys_stats(peh->topkeys, TK_SHARDS, cookie, get_current_time(),
                                add_stat);
+        } else if (nkey == (sizeof("quota") - 1) &&
+                   memcmp("quota", stat_key, nkey) == 0) {
+            rc = get_quota_stats(peh, cookie, add_stat);
         } else {
             rc = peh->pe.v1->get_stats(peh->pe.v0, cookie, stat_key,
                                        nkey, add_stat);
@@ -1723,7 +2145,7 @@ static ENGINE_ERROR_CODE bucket_get_stats(ENGINE_HANDLE* handle,
                 snprintf(statval, sizeof(statval), "%d", peh->refcount - 1);
                 add_stat("bucket_conns", sizeof("bucket_conns") - 1, statval,
                          strlen(statval), cookie);
-                snprintf(statval, sizeof(statval), "%d", peh->clients);
+                snprintf(statval, sizeof(statval), "%d", engine_clients(peh));
                 add_stat("bucket_active_conns", sizeof("bucket_active_conns") -1,
                          statval, strlen(statval), cookie);
             }
@@ -1751,6 +2173,31 @@ static void *bucket_get_stats_struct(ENGINE_HANDLE* handle,
     return ret;
 }
 
+/* Count a store (that didn't block) in the top keys of the bucket */
+static void topkeys_store(proxied_engine_handle_t *peh, const void *cookie,
+                          item *itm, ENGINE_STORE_OPERATION operation,
+                          ENGINE_ERROR_CODE ret) {
+    item_info_holder itm_info = { .info = { .nvalue = IOV_MAX } };
+    if (peh->topkeys == NULL ||
+        !peh->pe.v1->get_item_info(peh->pe.v0, cookie, itm, &itm_info.info)) {
+        return;
+    }
+
+    const void* key = itm_info.info.key;
+    const int nkey = itm_info.info.nkey;
+    if (operation != OPERATION_CAS) {
+        TK(peh->topkeys, cmd_set, key, nkey, get_current_time());
+    } else {
+        if (ret == ENGINE_SUCCESS) {
+            TK(peh->topkeys, cas_hits, key, nkey, get_current_time());
+        } else if (ret == ENGINE_KEY_EEXISTS) {
+            TK(peh->topkeys, cas_badval, key, nkey, get_current_time());
+        } else if (ret == ENGINE_KEY_ENOENT) {
+            TK(peh->topkeys, cas_misses, key, nkey, get_current_time());
+        }
+    }
+}
+
 /**
  * Implementation of the "store" function in the engine
  * specification. Look up the correct engine and call into the
@@ -1767,27 +2214,8 @@ static ENGINE_ERROR_CODE bucket_store(ENGINE_HANDLE* handle,
     if (peh) {
         ENGINE_ERROR_CODE ret;
         ret = peh->pe.v1->store(peh->pe.v0, cookie, itm, cas, operation, vbucket);
-        if (ret != ENGINE_EWOULDBLOCK && peh->topkeys) {
-            item_info itm_info = { .nvalue = 1 };
-            if (peh->pe.v1->get_item_info(peh->pe.v0, cookie, itm, &itm_info)) {
-                const void* key = itm_info.key;
-                const int nkey = itm_info.nkey;
-
-                if (operation != OPERATION_CAS) {
-                    TK(peh->topkeys, cmd_set, key, nkey, get_current_time());
-                } else {
-                    if (ret == ENGINE_SUCCESS) {
-                        TK(peh->topkeys, cas_hits, key, nkey,
-                           get_current_time());
-                    } else if (ret == ENGINE_KEY_EEXISTS) {
-                        TK(peh->topkeys, cas_badval, key, nkey,
-                           get_current_time());
-                    } else if (ret == ENGINE_KEY_ENOENT) {
-                        TK(peh->topkeys, cas_misses, key, nkey,
-                           get_current_time());
-                    }
-                }
-            }
+        if (ret != ENGINE_EWOULDBLOCK) {
+            topkeys_store(peh, cookie, itm, operation, ret);
         }
         release_engine_handle(peh);
         return ret;
@@ -1796,6 +2224,45 @@ static ENGINE_ERROR_CODE bucket_store(ENGINE_HANDLE* handle,
     }
 }
 
+/**
+ * Implementation of the store_multi function in the engine api. If the
+ * engine connected to the cookie doesn't implement it we'll just store
+ * the items one by one.
+ */
+static ENGINE_ERROR_CODE bucket_store_multi(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            store_multi_item *items,
+                                            int nitems) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh == NULL) {
+        return ENGINE_DISCONNECT;
+    }
+
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    if (peh->pe.v1->store_multi) {
+        ret = peh->pe.v1->store_multi(peh->pe.v0, cookie, items, nitems);
+    } else {
+        for (int ii = 0; ii < nitems; ++ii) {
+            items[ii].cas = 0;
+            items[ii].status = peh->pe.v1->store(peh->pe.v0, cookie,
+                                                 items[ii].item,
+                                                 &items[ii].cas,
+                                                 items[ii].operation,
+                                                 items[ii].vbucket);
+        }
+    }
+
+    if (ret == ENGINE_SUCCESS) {
+        for (int ii = 0; ii < nitems; ++ii) {
+            topkeys_store(peh, cookie, items[ii].item, items[ii].operation,
+                          items[ii].status);
+        }
+    }
+
+    release_engine_handle(peh);
+    return ret;
+}
+
 /**
  * Implementation of the "arithmetic" function in the engine
  * specification. Look up the correct engine and call into the
@@ -1816,6 +2283,10 @@ static ENGINE_ERROR_CODE bucket_arithmetic(ENGINE_HANDLE* handle,
                                            uint16_t vbucket) {
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh) {
+        if (!quota_admit(peh, 1)) {
+            release_engine_handle(peh);
+            return ENGINE_TMPFAIL;
+        }
         ENGINE_ERROR_CODE ret;
         ret = peh->pe.v1->arithmetic(peh->pe.v0, cookie, key, nkey,
                                 increment, create, delta, initial,
@@ -2058,6 +2529,15 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
             { .key = "auto_create",
               .datatype = DT_BOOL,
               .value.dt_bool = &me->auto_create },
+            { .key = "quota_ops",
+              .datatype = DT_SIZE,
+              .value.dt_size = &me->quota_ops },
+            { .key = "quota_bytes",
+              .datatype = DT_SIZE,
+              .value.dt_size = &me->quota_bytes },
+            { .key = "topkeys_sketch",
+              .datatype = DT_BOOL,
+              .value.dt_bool = &me->topkeys_sketch },
             { .key = "config_file",
               .datatype = DT_CONFIGFILE },
             { .key = NULL}
@@ -2102,13 +2582,102 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
     out[ntohs(myptr->message.header.request.keylen)] = 0x00;
 
 /**
- * Implementation of the "CREATE" command.
+ * A bucket creation running in the background. It lives in the engine
+ * specific section of the admin connection until the result is sent.
+ */
+struct bucket_create_request {
+    const void *cookie;
+    const char *name;
+    const char *path;
+    const char *config;
+    ENGINE_ERROR_CODE ret;
+    char msg[1024];
+    /** name, path and config (nul terminated) */
+    char data[];
+};
+
+static void send_create_bucket_response(const void *cookie,
+                                        ENGINE_ERROR_CODE ret,
+                                        const char *msg,
+                                        ADD_RESPONSE response) {
+    protocol_binary_response_status rc;
+    switch(ret) {
+    case ENGINE_SUCCESS:
+        rc = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+        break;
+    case ENGINE_KEY_EEXISTS:
+        rc = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+        break;
+    default:
+        rc = PROTOCOL_BINARY_RESPONSE_NOT_STORED;
+    }
+
+    response(NULL, 0, NULL, 0, msg, strlen(msg), 0, rc, 0, cookie);
+}
+
+/**
+ * Load and initialize the engine of a new bucket. Initializing an engine
+ * may take a long time (preallocating or touching all of its memory), so
+ * it's done here rather than on the worker thread of the admin
+ * connection. Like engine_shutdown_thread it's accounted in
+ * bucket_counter, so bucket_destroy waits for it.
+ */
+static void *engine_create_thread(void *arg) {
+    struct bucket_create_request *req = arg;
+    bool skip;
+    bucket_engine.server.core->place_background_thread();
+    must_lock(&bucket_engine.shutdown.mutex);
+    skip = bucket_engine.shutdown.in_progress;
+    if (!skip) {
+        ++bucket_engine.shutdown.bucket_counter;
+    }
+    must_unlock(&bucket_engine.shutdown.mutex);
+
+    if (skip) {
+        // The connection goes away with the rest of the server
+        return NULL;
+    }
+
+    lock_engines();
+    req->ret = create_bucket_UNLOCKED(&bucket_engine, req->name, req->path,
+                                      req->config, NULL, req->msg,
+                                      sizeof(req->msg));
+    unlock_engines();
+
+    // req belongs to the connection again once it's notified
+    bucket_engine.upstream_server->cookie->notify_io_complete(req->cookie,
+                                                              ENGINE_SUCCESS);
+
+    must_lock(&bucket_engine.shutdown.mutex);
+    --bucket_engine.shutdown.bucket_counter;
+    if (bucket_engine.shutdown.in_progress && bucket_engine.shutdown.bucket_counter == 0){
+        pthread_cond_signal(&bucket_engine.shutdown.cond);
+    }
+    must_unlock(&bucket_engine.shutdown.mutex);
+
+    return NULL;
+}
+
+/**
+ * Implementation of the "CREATE" command. The bucket is created by
+ * engine_create_thread, and the client gets EWOULDBLOCK until it's done
+ * (see handle_delete_bucket). When the thread notifies the connection
+ * we're called again with the request in the engine specific section,
+ * and send the result.
  */
 static ENGINE_ERROR_CODE handle_create_bucket(ENGINE_HANDLE* handle,
                                               const void* cookie,
                                               protocol_binary_request_header *request,
                                               ADD_RESPONSE response) {
     struct bucket_engine *e = (void*)handle;
+    struct bucket_create_request *req = bucket_get_engine_specific(cookie);
+    if (req != NULL) {
+        bucket_store_engine_specific(cookie, NULL);
+        send_create_bucket_response(cookie, req->ret, req->msg, response);
+        free(req);
+        return ENGINE_SUCCESS;
+    }
+
     protocol_binary_request_create_bucket *breq = (void*)request;
 
     EXTRACT_KEY(breq, keyz);
@@ -2136,29 +2705,44 @@ static ENGINE_ERROR_CODE handle_create_bucket(ENGINE_HANDLE* handle,
         config = spec + strlen(spec)+1;
     }
 
-    const size_t msglen = 1024;
-    char msg[msglen];
-    msg[0] = 0;
-    lock_engines();
-    ENGINE_ERROR_CODE ret = create_bucket_UNLOCKED(e, keyz, spec, config,
-                                                   NULL, msg, msglen);
-    unlock_engines();
-
-    protocol_binary_response_status rc;
-    switch(ret) {
-    case ENGINE_SUCCESS:
-        rc = PROTOCOL_BINARY_RESPONSE_SUCCESS;
-        break;
-    case ENGINE_KEY_EEXISTS:
-        rc = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
-        break;
-    default:
-        rc = PROTOCOL_BINARY_RESPONSE_NOT_STORED;
+    size_t nname = strlen(keyz) + 1;
+    size_t npath = strlen(spec) + 1;
+    size_t nconfig = strlen(config) + 1;
+    req = calloc(1, sizeof(*req) + nname + npath + nconfig);
+    if (req == NULL) {
+        return ENGINE_ENOMEM;
     }
+    req->cookie = cookie;
+    req->name = memcpy(req->data, keyz, nname);
+    req->path = memcpy(req->data + nname, spec, npath);
+    req->config = memcpy(req->data + nname + npath, config, nconfig);
 
-    response(NULL, 0, NULL, 0, msg, strlen(msg), 0, rc, 0, cookie);
+    bucket_store_engine_specific(cookie, req);
 
-    return ENGINE_SUCCESS;
+    pthread_attr_t attr;
+    pthread_t tid;
+    if (pthread_attr_init(&attr) != 0 ||
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
+        pthread_create(&tid, &attr, engine_create_thread, req) != 0)
+    {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to start creation of \"%s\", creating it "
+                    "on the worker thread", req->name);
+        bucket_store_engine_specific(cookie, NULL);
+        lock_engines();
+        ENGINE_ERROR_CODE ret = create_bucket_UNLOCKED(e, req->name,
+                                                       req->path,
+                                                       req->config, NULL,
+                                                       req->msg,
+                                                       sizeof(req->msg));
+        unlock_engines();
+        send_create_bucket_response(cookie, ret, req->msg, response);
+        free(req);
+        return ENGINE_SUCCESS;
+    }
+    pthread_attr_destroy(&attr);
+
+    return ENGINE_EWOULDBLOCK;
 }
 
 /**
@@ -2222,8 +2806,7 @@ static ENGINE_ERROR_CODE handle_delete_bucket(ENGINE_HANDLE* handle,
             /* bumped clients count protects transition from
              * STATE_RUNNING to STATE_STOPPED while peh->cookie is not
              * yet set. */
-            int count = ATOMIC_INCR(&peh->clients);
-            assert(count > 0);
+            acquire_engine_handle(peh);
             if (ATOMIC_CAS(&peh->state, STATE_RUNNING, STATE_STOPPING)) {
                 peh->cookie = cookie;
                 found = true;
@@ -2394,18 +2977,16 @@ static bool is_authorized(ENGINE_HANDLE* handle, const void* cookie) {
  * cache for erronous requests from these, so ignore all misses etc
  */
 static void update_topkey_command( proxied_engine_handle_t *peh,
-                                   protocol_binary_request_header *request,
+                                   uint8_t opcode,
+                                   const void *key,
+                                   uint16_t nkey,
                                    ENGINE_ERROR_CODE rv)
 {
-    if (request->request.keylen == 0 || rv != ENGINE_SUCCESS) {
+    if (nkey == 0 || rv != ENGINE_SUCCESS) {
         return ;
     }
 
-    uint16_t nkey = ntohs(request->request.keylen);
-    EXTRACT_KEY(((protocol_binary_request_no_extras*)request), keyz);
-    const void* key = keyz;
-
-    switch (request->request.opcode) {
+    switch (opcode) {
     case CMD_GET_REPLICA:
         TK(peh->topkeys, get_replica, key, nkey, get_current_time());
         break;
@@ -2433,6 +3014,38 @@ static void update_topkey_command( proxied_engine_handle_t *peh,
     }
 }
 
+/**
+ * Handle one of the commands bucket_engine implements itself (the user
+ * needs to be authorized as the admin to execute them).
+ */
+static ENGINE_ERROR_CODE handle_admin_command(ENGINE_HANDLE* handle,
+                                              const void* cookie,
+                                              protocol_binary_request_header *request,
+                                              ADD_RESPONSE response)
+{
+    if (!is_authorized(handle, cookie)) {
+        return ENGINE_ENOTSUP;
+    }
+
+    switch(request->request.opcode) {
+    case CREATE_BUCKET:
+    case CREATE_BUCKET_DEPRECATED:
+        return handle_create_bucket(handle, cookie, request, response);
+    case DELETE_BUCKET:
+    case DELETE_BUCKET_DEPRECATED:
+        return handle_delete_bucket(handle, cookie, request, response);
+    case LIST_BUCKETS:
+    case LIST_BUCKETS_DEPRECATED:
+        return handle_list_buckets(handle, cookie, request, response);
+    case SELECT_BUCKET:
+    case SELECT_BUCKET_DEPRECATED:
+        return handle_select_bucket(handle, cookie, request, response);
+    default:
+        assert(false);
+        return ENGINE_ENOTSUP;
+    }
+}
+
 /**
  * Handle one of the "engine-specific" commands. Bucket-engine itself
  * implements a small subset of commands, but the user needs to be
@@ -2444,45 +3057,86 @@ static ENGINE_ERROR_CODE bucket_unknown_command(ENGINE_HANDLE* handle,
                                                 protocol_binary_request_header *request,
                                                 ADD_RESPONSE response)
 {
-    ENGINE_ERROR_CODE rv = ENGINE_ENOTSUP;
     if (is_admin_command(request->request.opcode)) {
-        if (is_authorized(handle, cookie)) {
-            switch(request->request.opcode) {
-            case CREATE_BUCKET:
-            case CREATE_BUCKET_DEPRECATED:
-                rv = handle_create_bucket(handle, cookie, request, response);
-                break;
-            case DELETE_BUCKET:
-            case DELETE_BUCKET_DEPRECATED:
-                rv = handle_delete_bucket(handle, cookie, request, response);
-                break;
-            case LIST_BUCKETS:
-            case LIST_BUCKETS_DEPRECATED:
-                rv = handle_list_buckets(handle, cookie, request, response);
-                break;
-            case SELECT_BUCKET:
-            case SELECT_BUCKET_DEPRECATED:
-                rv = handle_select_bucket(handle, cookie, request, response);
-                break;
-            default:
-                assert(false);
-            }
-        }
-    } else {
-        proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
-        if (peh) {
-            rv = peh->pe.v1->unknown_command(peh->pe.v0, cookie, request,
-                                             response);
-            update_topkey_command(peh, request, rv);
-            release_engine_handle(peh);
-        } else {
-            rv = ENGINE_DISCONNECT;
-        }
+        return handle_admin_command(handle, cookie, request, response);
+    }
+
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh == NULL) {
+        return ENGINE_DISCONNECT;
+    }
+
+    ENGINE_ERROR_CODE rv = peh->pe.v1->unknown_command(peh->pe.v0, cookie,
+                                                       request, response);
+    uint16_t nkey = ntohs(request->request.keylen);
+    if (nkey > 0 && rv == ENGINE_SUCCESS) {
+        EXTRACT_KEY(((protocol_binary_request_no_extras*)request), keyz);
+        update_topkey_command(peh, request->request.opcode, keyz, nkey, rv);
+    }
+    release_engine_handle(peh);
+    return rv;
+}
+
+static ENGINE_ERROR_CODE bucket_admin_command(ENGINE_HANDLE* handle,
+                                              const void* cookie,
+                                              const engine_command *cmd,
+                                              ADD_RESPONSE response)
+{
+    return handle_admin_command(handle, cookie, cmd->request, response);
+}
+
+/**
+ * The handler we give the core for the commands of the buckets: the
+ * command goes to the handler the engine of the connection's bucket
+ * has for it, or to its unknown_command.
+ */
+static ENGINE_ERROR_CODE bucket_engine_command(ENGINE_HANDLE* handle,
+                                               const void* cookie,
+                                               const engine_command *cmd,
+                                               ADD_RESPONSE response)
+{
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh == NULL) {
+        return ENGINE_DISCONNECT;
     }
 
+    uint8_t opcode = cmd->request->request.opcode;
+    ENGINE_ERROR_CODE rv;
+    if (peh->commands[opcode] != NULL) {
+        rv = peh->commands[opcode](peh->pe.v0, cookie, cmd, response);
+    } else {
+        rv = peh->pe.v1->unknown_command(peh->pe.v0, cookie, cmd->request,
+                                         response);
+    }
+    update_topkey_command(peh, opcode, cmd->key, cmd->nkey, rv);
+    release_engine_handle(peh);
     return rv;
 }
 
+/**
+ * We don't know which commands the buckets created later will have, so
+ * we take all of them and look at the bucket's table when they come in.
+ */
+static void bucket_get_command_handlers(ENGINE_HANDLE* handle,
+                                        ENGINE_COMMAND_HANDLER handlers[0x100])
+{
+    for (int ii = 0; ii < 0x100; ++ii) {
+        handlers[ii] = is_admin_command(ii) ? bucket_admin_command :
+            bucket_engine_command;
+    }
+}
+
+/**
+ * Get the handlers of the engine of a bucket (once it's initialized)
+ */
+static void load_command_handlers(proxied_engine_handle_t *peh)
+{
+    memset(peh->commands, 0, sizeof(peh->commands));
+    if (peh->pe.v1->get_command_handlers != NULL) {
+        peh->pe.v1->get_command_handlers(peh->pe.v0, peh->commands);
+    }
+}
+
 /**
  * Notify bucket_engine that we want to reserve this cookie. That
  * means that bucket_engine and memcached can't release the resources
@@ -2514,7 +3168,7 @@ static ENGINE_ERROR_CODE bucket_engine_reserve_cookie(const void *cookie)
     /* This can only be reliably called form engine up-call so that
      * it's impossible to transition to STATE_STOPPED while we're
      * here. */
-    assert(peh->clients >= 0);
+    assert(engine_clients(peh) >= 0);
 
     if (peh->state != STATE_RUNNING) {
         return ENGINE_FAILED;
@@ -19,6 +19,21 @@ typedef enum {
     STATE_STOPPED
 } bucket_state_t;
 
+#define CLIENT_SHARDS 16
+#define CLIENT_SHARD_SIZE 64
+
+/**
+ * A slice of the count of clients calling into an engine, padded to
+ * its own cache line. A thread always counts itself in the same slice,
+ * so the clients hammering a hot bucket don't all write the same line.
+ */
+typedef union client_shard {
+    volatile int count;
+    char pad[CLIENT_SHARD_SIZE];
+} client_shard_t;
+
+struct bucket_snapshot;
+
 typedef struct proxied_engine_handle {
     const char          *name;
     size_t               name_len;
@@ -49,10 +64,26 @@ typedef struct proxied_engine_handle {
      * only happen when bucket is deleted (but can happen later
      * because some connection can hold pointer longer) */
     volatile int         refcount;
-    volatile int clients; /* # of clients currently calling functions in the engine */
+    /* # of clients currently calling functions in the engine, split
+     * in CLIENT_SHARDS slices (see engine_clients) */
+    client_shard_t *clients;
+    /* Usage of the per bucket quotas (see quota_admit) */
+    struct {
+        /* The second the window counts are for */
+        volatile rel_time_t window;
+        volatile uint64_t window_ops;
+        volatile uint64_t window_bytes;
+        /* Totals since the bucket was created */
+        volatile uint64_t ops;
+        volatile uint64_t bytes;
+        volatile uint64_t throttled;
+    } quota;
     const void *cookie;
     void *dlhandle;
     volatile bucket_state_t state;
+    /* The engine's handlers for its commands (see get_command_handlers),
+     * set before the bucket is published */
+    ENGINE_COMMAND_HANDLER commands[0x100];
 } proxied_engine_handle_t;
 
 #define ES_CONNECTED_FLAG 0x1000
@@ -91,6 +122,14 @@ struct bucket_engine {
     proxied_engine_handle_t default_engine;
     pthread_mutex_t engines_mutex;
     genhash_t *engines;
+    /* The lock free copy of engines used by find_bucket */
+    struct {
+        struct bucket_snapshot *volatile current;
+        /* The readers of the snapshot, in two generations so that a
+         * writer waiting for a grace period isn't held up by new ones */
+        volatile int epoch;
+        client_shard_t readers[2][CLIENT_SHARDS];
+    } registry;
     GET_SERVER_API get_server_api;
     SERVER_HANDLE_V1 server;
     SERVER_CALLBACK_API callback_api;
@@ -126,6 +165,12 @@ struct bucket_engine {
     } info;
 
     int topkeys;
+    /* Track the heaviest keys with a sketch instead of the latest ones */
+    bool topkeys_sketch;
+    /* Operations and bytes every bucket may use per second (0 is no
+     * limit) */
+    size_t quota_ops;
+    size_t quota_bytes;
 };
 
 #endif
@@ -6,10 +6,19 @@
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
+#include <stdbool.h>
+#include <string.h>
 
 #include "genhash.h"
 #include "genhash_int.h"
 
+/*
+ * By default the table is open addressing (see insert_slot). Building
+ * with GENHASH_CHAINED gives the original chained layout, which
+ * genhash_bench uses for comparison.
+ */
+
+#ifdef GENHASH_CHAINED
 /* Table of 32 primes by their distance from the nearest power of two */
 static int prime_size_table[]={
     3, 7, 13, 23, 47, 97, 193, 383, 769, 1531, 3067, 6143, 12289, 24571, 49157,
@@ -17,6 +26,7 @@ static int prime_size_table[]={
     25165813, 50331653, 100663291, 201326611, 402653189, 805306357,
     1610612741
 };
+#endif
 
 static inline void*
 dup_key(genhash_t *h, const void *key, size_t klen)
@@ -54,6 +64,19 @@ free_value(genhash_t *h, void *value)
     }
 }
 
+static void
+count_entries(const void *key, size_t klen,
+              const void *val, size_t vlen, void *arg)
+{
+    (void)key;
+    (void)klen;
+    (void)val;
+    (void)vlen;
+    int *count=(int *)arg;
+    (*count)++;
+}
+
+#ifdef GENHASH_CHAINED
 static int
 estimate_table_size(int est)
 {
@@ -250,16 +273,6 @@ genhash_delete(genhash_t* h, const void* k, size_t klen)
     return rv;
 }
 
-int
-genhash_delete_all(genhash_t* h, const void* k, size_t klen)
-{
-    int rv=0;
-    while(genhash_delete(h, k, klen) == 1) {
-        rv++;
-    }
-    return rv;
-}
-
 void
 genhash_iter(genhash_t* h,
              void (*iterfunc)(const void* key, size_t nkey,
@@ -296,18 +309,6 @@ genhash_clear(genhash_t *h)
     return rv;
 }
 
-static void
-count_entries(const void *key, size_t klen,
-              const void *val, size_t vlen, void *arg)
-{
-    (void)key;
-    (void)klen;
-    (void)val;
-    (void)vlen;
-    int *count=(int *)arg;
-    (*count)++;
-}
-
 int
 genhash_size(genhash_t* h) {
     int rv=0;
@@ -316,15 +317,6 @@ genhash_size(genhash_t* h) {
     return rv;
 }
 
-int
-genhash_size_for_key(genhash_t* h, const void* k, size_t klen)
-{
-    int rv=0;
-    assert(h != NULL);
-    genhash_iter_key(h, k, klen, count_entries, &rv);
-    return rv;
-}
-
 void
 genhash_iter_key(genhash_t* h, const void* key, size_t klen,
                  void (*iterfunc)(const void* key, size_t klen,
@@ -345,17 +337,383 @@ genhash_iter_key(genhash_t* h, const void* key, size_t klen,
         }
     }
 }
+#else
+/*
+ * An open addressing table with Robin Hood hashing: an entry never sits
+ * further from its home slot than the entry it would have displaced, so
+ * probes stay short and a miss stops as soon as it meets a slot closer
+ * to home than itself. Deleting shifts the following entries back
+ * instead of leaving tombstones. The hashes of the keys are kept in the
+ * slots, so all the probing happens within the slot array.
+ *
+ * Several entries may share a key (see genhash_store); the most recent
+ * one is kept first.
+ */
+
+/* Keep the table at most 7/8 full */
+#define GENHASH_MIN_SIZE 8
+#define genhash_full(size) ((size) - (size) / 8)
+
+static inline size_t
+home_slot(genhash_t *h, uint32_t hash)
+{
+    /* Fibonacci hashing, so the lower bits of a weak hash are no problem */
+    return (size_t)((uint32_t)(hash * 2654435769U) >> h->shift);
+}
+
+static inline uint32_t
+key_hash(genhash_t *h, const void *k, size_t klen)
+{
+    return (uint32_t)h->ops.hashfunc(k, klen);
+}
+
+static void
+alloc_slots(genhash_t *h, size_t size)
+{
+    int bits = 0;
+    while (((size_t)1 << bits) < size) {
+        bits++;
+    }
+    assert(bits < 32);
+    h->size = size;
+    h->shift = 32 - bits;
+    h->slots = calloc(size, sizeof(struct genhash_slot_t));
+    assert(h->slots != NULL);
+}
+
+/*
+ * Put e in the table with Robin Hood displacement. When before_same is
+ * set it goes in front of the entries with the same key.
+ */
+static void
+insert_slot(genhash_t *h, struct genhash_slot_t e, bool before_same)
+{
+    size_t mask = h->size - 1;
+    size_t n = home_slot(h, e.hash);
+
+    for (e.dist = 1; ; e.dist++, n = (n + 1) & mask) {
+        struct genhash_slot_t *s = &h->slots[n];
+        if (s->dist == 0) {
+            *s = e;
+            break;
+        }
+        if (s->dist < e.dist ||
+            (before_same && s->dist == e.dist && s->hash == e.hash &&
+             h->ops.hasheq(s->key, s->nkey, e.key, e.nkey))) {
+            struct genhash_slot_t tmp = *s;
+            *s = e;
+            e = tmp;
+        }
+    }
+    h->count++;
+}
+
+static void
+grow(genhash_t *h)
+{
+    struct genhash_slot_t *old = h->slots;
+    size_t oldsize = h->size;
+    size_t n;
+
+    alloc_slots(h, oldsize * 2);
+    h->count = 0;
+
+    /* Walk back from a free slot so that every run is re-inserted from
+     * its oldest entry, which keeps the most recent of several entries
+     * with the same key first */
+    for (n = 0; old[n].dist != 0; n++);
+    for (size_t i = 0; i < oldsize; i++) {
+        n = (n + oldsize - 1) & (oldsize - 1);
+        if (old[n].dist != 0) {
+            insert_slot(h, old[n], true);
+        }
+    }
+    free(old);
+}
+
+static struct genhash_slot_t *
+find_slot(genhash_t *h, const void *k, size_t klen)
+{
+    size_t mask = h->size - 1;
+    uint32_t hash = key_hash(h, k, klen);
+    size_t n = home_slot(h, hash);
+
+    for (uint32_t dist = 1; h->slots[n].dist >= dist;
+         dist++, n = (n + 1) & mask) {
+        struct genhash_slot_t *s = &h->slots[n];
+        if (s->hash == hash && h->ops.hasheq(k, klen, s->key, s->nkey)) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static void
+remove_slot(genhash_t *h, struct genhash_slot_t *s)
+{
+    size_t mask = h->size - 1;
+    size_t n = (size_t)(s - h->slots);
+    size_t next;
+
+    for (next = (n + 1) & mask; h->slots[next].dist > 1;
+         n = next, next = (next + 1) & mask) {
+        h->slots[n] = h->slots[next];
+        h->slots[n].dist--;
+    }
+    h->slots[n].dist = 0;
+    h->count--;
+}
+
+genhash_t* genhash_init(int est, struct hash_ops ops)
+{
+    genhash_t* rv=NULL;
+    size_t size=GENHASH_MIN_SIZE;
+    if (est < 1) {
+        return NULL;
+    }
+
+    assert(ops.hashfunc != NULL);
+    assert(ops.hasheq != NULL);
+    assert((ops.dupKey != NULL && ops.freeKey != NULL) || ops.freeKey == NULL);
+    assert((ops.dupValue != NULL && ops.freeValue != NULL) || ops.freeValue == NULL);
+
+    while (genhash_full(size) < (size_t)est) {
+        size <<= 1;
+    }
+    rv=calloc(1, sizeof(genhash_t));
+    assert(rv != NULL);
+    rv->ops=ops;
+    alloc_slots(rv, size);
+
+    return rv;
+}
+
+void
+genhash_free(genhash_t* h)
+{
+    if(h != NULL) {
+        genhash_clear(h);
+        free(h->slots);
+        free(h);
+    }
+}
+
+void
+genhash_store(genhash_t *h, const void* k, size_t klen,
+              const void* v, size_t vlen)
+{
+    struct genhash_slot_t e;
+
+    assert(h != NULL);
+    if (h->count + 1 > genhash_full(h->size)) {
+        grow(h);
+    }
+
+    e.key=dup_key(h, k, klen);
+    e.nkey=klen;
+    e.value=dup_value(h, v, vlen);
+    e.nvalue=vlen;
+    e.hash=key_hash(h, k, klen);
+    insert_slot(h, e, true);
+}
+
+void*
+genhash_find(genhash_t *h, const void* k, size_t klen)
+{
+    struct genhash_slot_t *s;
+
+    assert(h != NULL);
+    s=find_slot(h, k, klen);
+    return s ? s->value : NULL;
+}
+
+enum update_type
+genhash_update(genhash_t* h, const void* k, size_t klen,
+               const void* v, size_t vlen)
+{
+    struct genhash_slot_t *s;
+    enum update_type rv=0;
+
+    assert(h != NULL);
+    s=find_slot(h, k, klen);
+
+    if(s) {
+        free_value(h, s->value);
+        s->value=dup_value(h, v, vlen);
+        rv=MODIFICATION;
+    } else {
+        genhash_store(h, k, klen, v, vlen);
+        rv=NEW;
+    }
+
+    return rv;
+}
+
+enum update_type
+genhash_fun_update(genhash_t* h, const void* k, size_t klen,
+                   void *(*upd)(const void *, const void *, size_t *, void *),
+                   void (*fr)(void*),
+                   void *arg,
+                   const void *def, size_t deflen)
+{
+    (void)deflen;
+    struct genhash_slot_t *s;
+    enum update_type rv=0;
+    size_t newSize = 0;
+
+    assert(h != NULL);
+    s=find_slot(h, k, klen);
+
+    if(s) {
+        void *newValue=upd(k, s->value, &newSize, arg);
+        free_value(h, s->value);
+        s->value=dup_value(h, newValue, newSize);
+        fr(newValue);
+        rv=MODIFICATION;
+    } else {
+        void *newValue=upd(k, def, &newSize, arg);
+        genhash_store(h, k, klen, newValue, newSize);
+        fr(newValue);
+        rv=NEW;
+    }
+
+    return rv;
+}
 
 int
-genhash_string_hash(const void* p, size_t nkey)
+genhash_delete(genhash_t* h, const void* k, size_t klen)
+{
+    struct genhash_slot_t *s;
+
+    assert(h != NULL);
+    s=find_slot(h, k, klen);
+    if(s == NULL) {
+        return 0;
+    }
+
+    /* The free functions might look at the table */
+    struct genhash_slot_t deleteme=*s;
+    remove_slot(h, s);
+    free_key(h, deleteme.key);
+    free_value(h, deleteme.value);
+    return 1;
+}
+
+void
+genhash_iter(genhash_t* h,
+             void (*iterfunc)(const void* key, size_t nkey,
+                              const void* val, size_t nval,
+                              void *arg), void *arg)
 {
-    int rv=5381;
     size_t i=0;
-    char *str=(char *)p;
+    assert(h != NULL);
+
+    for(i=0; i<h->size; i++) {
+        struct genhash_slot_t *s=&h->slots[i];
+        if(s->dist != 0) {
+            iterfunc(s->key, s->nkey, s->value, s->nvalue, arg);
+        }
+    }
+}
+
+int
+genhash_clear(genhash_t *h)
+{
+    size_t i = 0;
+    int rv = 0;
+    assert(h != NULL);
 
-    for(i=0; i < nkey; i++) {
-        rv = ((rv << 5) + rv) ^ str[i];
+    for(i = 0; i < h->size; i++) {
+        struct genhash_slot_t *s=&h->slots[i];
+        if(s->dist != 0) {
+            s->dist = 0;
+            free_key(h, s->key);
+            free_value(h, s->value);
+        }
     }
+    h->count = 0;
 
     return rv;
 }
+
+int
+genhash_size(genhash_t* h) {
+    assert(h != NULL);
+    return (int)h->count;
+}
+
+void
+genhash_iter_key(genhash_t* h, const void* key, size_t klen,
+                 void (*iterfunc)(const void* key, size_t klen,
+                                  const void* val, size_t vlen,
+                                  void *arg), void *arg)
+{
+    size_t mask;
+    uint32_t hash;
+    size_t n;
+
+    assert(h != NULL);
+    mask = h->size - 1;
+    hash = key_hash(h, key, klen);
+    n = home_slot(h, hash);
+
+    for (uint32_t dist = 1; h->slots[n].dist >= dist;
+         dist++, n = (n + 1) & mask) {
+        struct genhash_slot_t *s = &h->slots[n];
+        if (s->hash == hash && h->ops.hasheq(key, klen, s->key, s->nkey)) {
+            iterfunc(s->key, s->nkey, s->value, s->nvalue, arg);
+        }
+    }
+}
+#endif
+
+int
+genhash_delete_all(genhash_t* h, const void* k, size_t klen)
+{
+    int rv=0;
+    while(genhash_delete(h, k, klen) == 1) {
+        rv++;
+    }
+    return rv;
+}
+
+int
+genhash_size_for_key(genhash_t* h, const void* k, size_t klen)
+{
+    int rv=0;
+    assert(h != NULL);
+    genhash_iter_key(h, k, klen, count_entries, &rv);
+    return rv;
+}
+
+/*
+ * A MurmurHash64A style mix, eight bytes at a time, folded to 32 bits.
+ */
+int
+genhash_string_hash(const void* p, size_t nkey)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const unsigned char *str = p;
+    uint64_t rv = 5381 ^ (nkey * m);
+    uint64_t k;
+
+    for (; nkey >= 8; str += 8, nkey -= 8) {
+        memcpy(&k, str, 8);
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        rv ^= k;
+        rv *= m;
+    }
+    if (nkey > 0) {
+        k = 0;
+        memcpy(&k, str, nkey);
+        rv ^= k;
+        rv *= m;
+    }
+
+    rv ^= rv >> 47;
+    rv *= m;
+    rv ^= rv >> 47;
+    return (int)(uint32_t)(rv ^ (rv >> 32));
+}
@@ -0,0 +1,141 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Microbenchmark for genhash. It's built twice, as genhash_bench (open
+ * addressing) and genhash_bench_chained (GENHASH_CHAINED), so the two
+ * layouts can be compared on the same machine:
+ *
+ *   ./genhash_bench [nkeys] [rounds]
+ *   ./genhash_bench_chained [nkeys] [rounds]
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "genhash.h"
+
+#ifdef GENHASH_CHAINED
+#define LAYOUT "chained"
+#else
+#define LAYOUT "open addressing"
+#endif
+
+/* The hash genhash_string_hash used to be */
+static int djb_hash(const void *p, size_t nkey) {
+    int rv = 5381;
+    const char *str = p;
+    for (size_t i = 0; i < nkey; i++) {
+        rv = ((rv << 5) + rv) ^ str[i];
+    }
+    return rv;
+}
+
+static int key_eq(const void *k1, size_t nkey1,
+                  const void *k2, size_t nkey2) {
+    return nkey1 == nkey2 && memcmp(k1, k2, nkey1) == 0;
+}
+
+static void *key_dup(const void *k, size_t nkey) {
+    void *rv = malloc(nkey);
+    memcpy(rv, k, nkey);
+    return rv;
+}
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report(const char *hash, const char *what,
+                   double start, long ops) {
+    printf("%-16s %-8s %-16s %8.1f ns/op\n", LAYOUT, hash, what,
+           (now() - start) * 1e9 / ops);
+}
+
+static void run(const char *name, int (*hashfunc)(const void *, size_t),
+                char **keys, size_t *nkeys, int n, int rounds) {
+    /* The table owns a copy of the keys (like the bucket registry) and
+     * is sized for them up front (like topkeys); the chained layout
+     * never grows */
+    struct hash_ops ops = {
+        .hashfunc = hashfunc,
+        .hasheq = key_eq,
+        .dupKey = key_dup,
+        .freeKey = free
+    };
+    genhash_t *h = genhash_init(n, ops);
+    double start;
+    long found = 0;
+
+    start = now();
+    for (int i = 0; i < n; i++) {
+        genhash_update(h, keys[i], nkeys[i], keys[i], 0);
+    }
+    report(name, "insert", start, n);
+
+    start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < n; i++) {
+            found += genhash_find(h, keys[i], nkeys[i]) != NULL;
+        }
+    }
+    report(name, "find (hit)", start, (long)n * rounds);
+
+    start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < n; i++) {
+            /* same length, never stored */
+            keys[i][0] = '_';
+            found -= genhash_find(h, keys[i], nkeys[i]) != NULL;
+            keys[i][0] = 'k';
+        }
+    }
+    report(name, "find (miss)", start, (long)n * rounds);
+
+    /* Like topkeys: evict and store keys at a constant size */
+    start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < n; i++) {
+            genhash_delete(h, keys[i], nkeys[i]);
+            genhash_update(h, keys[i], nkeys[i], keys[i], 0);
+        }
+    }
+    report(name, "delete+insert", start, (long)n * rounds);
+
+    if (found != (long)n * rounds || genhash_size(h) != n) {
+        fprintf(stderr, "genhash_bench: inconsistent table\n");
+        exit(EXIT_FAILURE);
+    }
+    genhash_free(h);
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    if (n < 1 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [nkeys] [rounds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char **keys = malloc(n * sizeof(char *));
+    size_t *nkeys = malloc(n * sizeof(size_t));
+    srandom(42);
+    for (int i = 0; i < n; i++) {
+        char buf[64];
+        nkeys[i] = snprintf(buf, sizeof(buf), "key:%d:%ld",
+                            i, random() % 1000000);
+        keys[i] = strdup(buf);
+    }
+
+    run("murmur", genhash_string_hash, keys, nkeys, n, rounds);
+    run("djb", djb_hash, keys, nkeys, n, rounds);
+
+    for (int i = 0; i < n; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+    free(nkeys);
+    return EXIT_SUCCESS;
+}
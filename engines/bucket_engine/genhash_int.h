@@ -1,3 +1,6 @@
+#include <stdint.h>
+
+#ifdef GENHASH_CHAINED
 /**
  * \private
  */
@@ -19,3 +22,37 @@ struct _genhash {
     struct hash_ops ops;
     struct genhash_entry_t *buckets[];
 };
+#else
+/**
+ * \private
+ *
+ * A slot of the open addressing (Robin Hood) table. The hash of the key
+ * is kept next to it so that probing only calls hasheq (and touches the
+ * key) when the hashes match.
+ */
+struct genhash_slot_t {
+    /** The key for this entry */
+    void *key;
+    /** Size of the key */
+    size_t nkey;
+    /** The value for this entry */
+    void *value;
+    /** Size of the value */
+    size_t nvalue;
+    /** The hash of the key */
+    uint32_t hash;
+    /** 1 + the distance from the slot the key hashes to, 0 if free */
+    uint32_t dist;
+};
+
+struct _genhash {
+    /** Number of slots (a power of two) */
+    size_t size;
+    /** Number of entries */
+    size_t count;
+    /** 32 - log2(size), for picking the home slot of a hash */
+    int shift;
+    struct hash_ops ops;
+    struct genhash_slot_t *slots;
+};
+#endif
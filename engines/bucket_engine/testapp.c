@@ -270,6 +270,9 @@ static rel_time_t get_current_time(void) {
     return (rel_time_t)time(NULL);
 }
 
+static void place_background_thread(void) {
+}
+
 /**
  * Callback the engines may call to get the public server interface
  * @param interface the requested interface from the server
@@ -283,7 +286,8 @@ static SERVER_HANDLE_V1 *get_server_api(void)
         // .hash = hash,
         // .realtime = realtime,
         .get_current_time = get_current_time,
-        .parse_config = parse_config
+        .parse_config = parse_config,
+        .place_background_thread = place_background_thread
     };
 
     static SERVER_COOKIE_API cookie_api = {
@@ -761,6 +765,29 @@ static void* create_create_bucket_pkt(const char *user, const char *path,
                           buf, strlen(path) + strlen(args) + 1);
 }
 
+/*
+ * Send a CREATE_BUCKET packet, and wait for the bucket to be created
+ * (in the background) if bucket_engine accepted the request
+ */
+static ENGINE_ERROR_CODE create_bucket_command(ENGINE_HANDLE *h,
+                                               ENGINE_HANDLE_V1 *h1,
+                                               const void *cookie,
+                                               void *pkt,
+                                               ADD_RESPONSE response) {
+    pthread_mutex_lock(&notify_mutex);
+    notify_code = ENGINE_FAILED;
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, cookie, pkt, response);
+    if (rv == ENGINE_EWOULDBLOCK) {
+        while (notify_code == ENGINE_FAILED) {
+            pthread_cond_wait(&notify_cond, &notify_mutex);
+        }
+        assert(notify_code == ENGINE_SUCCESS);
+        rv = h1->unknown_command(h, cookie, pkt, response);
+    }
+    pthread_mutex_unlock(&notify_mutex);
+    return rv;
+}
+
 static enum test_result test_create_bucket(ENGINE_HANDLE *h,
                                            ENGINE_HANDLE_V1 *h1) {
     const void *adm_cookie = mk_conn("admin", NULL);
@@ -775,7 +802,7 @@ static enum test_result test_create_bucket(ENGINE_HANDLE *h,
     assert(rv == ENGINE_DISCONNECT);
 
     void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    rv = create_bucket_command(h, h1, adm_cookie, pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
@@ -794,13 +821,13 @@ static enum test_result test_double_create_bucket(ENGINE_HANDLE *h,
     ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
 
     void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    rv = create_bucket_command(h, h1, adm_cookie, pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
 
     pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    rv = create_bucket_command(h, h1, adm_cookie, pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
@@ -822,7 +849,7 @@ static enum test_result test_create_bucket_with_params(ENGINE_HANDLE *h,
     assert(rv == ENGINE_DISCONNECT);
 
     void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "no_alloc");
-    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    rv = create_bucket_command(h, h1, adm_cookie, pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
@@ -841,19 +868,19 @@ static enum test_result test_admin_user(ENGINE_HANDLE *h,
 
     // Test with no user.
     void *pkt = create_create_bucket_pkt("newbucket", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, mk_conn(NULL, NULL), pkt, add_response);
+    rv = create_bucket_command(h, h1, mk_conn(NULL, NULL), pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_ENOTSUP);
 
     // Test with non-admin
     pkt = create_create_bucket_pkt("newbucket", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, mk_conn("notadmin", NULL), pkt, add_response);
+    rv = create_bucket_command(h, h1, mk_conn("notadmin", NULL), pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_ENOTSUP);
 
     // Test with admin
     pkt = create_create_bucket_pkt("newbucket", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, mk_conn("admin", NULL), pkt, add_response);
+    rv = create_bucket_command(h, h1, mk_conn("admin", NULL), pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
@@ -872,7 +899,7 @@ static enum test_result do_test_delete_bucket(ENGINE_HANDLE *h,
     ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
 
     void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    rv = create_bucket_command(h, h1, adm_cookie, pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
@@ -1009,7 +1036,7 @@ static enum test_result do_test_delete_bucket_concurrent(ENGINE_HANDLE *h,
     ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
 
     void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    rv = create_bucket_command(h, h1, adm_cookie, pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
@@ -1123,7 +1150,7 @@ static enum test_result test_delete_bucket_shutdown_race(ENGINE_HANDLE *h,
     ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
 
     void *pkt = create_create_bucket_pkt("mybucket", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    rv = create_bucket_command(h, h1, adm_cookie, pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
@@ -1166,13 +1193,13 @@ static enum test_result test_bucket_name_validation(ENGINE_HANDLE *h,
     ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
 
     void *pkt = create_create_bucket_pkt("bucket one", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, mk_conn("admin", NULL), pkt, add_response);
+    rv = create_bucket_command(h, h1, mk_conn("admin", NULL), pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == PROTOCOL_BINARY_RESPONSE_NOT_STORED);
 
     pkt = create_create_bucket_pkt("", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, mk_conn("admin", NULL), pkt, add_response);
+    rv = create_bucket_command(h, h1, mk_conn("admin", NULL), pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == PROTOCOL_BINARY_RESPONSE_NOT_STORED);
@@ -1206,7 +1233,7 @@ static enum test_result test_list_buckets_one(ENGINE_HANDLE *h,
     // Create a bucket first.
 
     void *pkt = create_create_bucket_pkt("bucket1", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, mk_conn("admin", NULL), pkt, add_response);
+    rv = create_bucket_command(h, h1, mk_conn("admin", NULL), pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
@@ -1232,13 +1259,13 @@ static enum test_result test_list_buckets_two(ENGINE_HANDLE *h,
     // Create two buckets first.
 
     void *pkt = create_create_bucket_pkt("bucket1", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, cookie, pkt, add_response);
+    rv = create_bucket_command(h, h1, cookie, pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
 
     pkt = create_create_bucket_pkt("bucket2", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, cookie, pkt, add_response);
+    rv = create_bucket_command(h, h1, cookie, pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
@@ -1263,7 +1290,7 @@ static enum test_result test_unknown_call(ENGINE_HANDLE *h,
     ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
 
     void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, mk_conn("admin", NULL), pkt, add_response);
+    rv = create_bucket_command(h, h1, mk_conn("admin", NULL), pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
@@ -1281,7 +1308,7 @@ static enum test_result test_select_no_admin(ENGINE_HANDLE *h,
     ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
 
     void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, mk_conn("admin", NULL), pkt, add_response);
+    rv = create_bucket_command(h, h1, mk_conn("admin", NULL), pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
@@ -1367,7 +1394,7 @@ static enum test_result test_stats_bucket(ENGINE_HANDLE *h,
     const void *adm_cookie = mk_conn("admin", NULL);
 
     void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    rv = create_bucket_command(h, h1, adm_cookie, pkt, add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
@@ -1571,11 +1598,75 @@ static enum test_result test_concurrent_connect_disconnect_tap(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
-static enum test_result test_topkeys(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+static volatile bool lookups_done;
+
+static void *bucket_lookup_thread(void *arg) {
+    struct handle_pair *hp = arg;
+    const char *key = "somekey";
+
+    while (!lookups_done) {
+        void *cookie = mk_conn("someuser", NULL);
+        item *itm;
+        ENGINE_ERROR_CODE rv = hp->h1->allocate(hp->h, cookie, &itm,
+                                                key, strlen(key),
+                                                9, 9258, 3600);
+        assert(rv == ENGINE_SUCCESS);
+        hp->h1->release(hp->h, cookie, itm);
+        mock_disconnect(cookie);
+    }
+
+    return NULL;
+}
+
+static enum test_result test_concurrent_bucket_lookups(ENGINE_HANDLE *h,
+                                                       ENGINE_HANDLE_V1 *h1) {
     const void *adm_cookie = mk_conn("admin", NULL);
     void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
-    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    ENGINE_ERROR_CODE rv = create_bucket_command(h, h1, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    const int num_workers = 8;
+    pthread_t workers[num_workers];
+    struct handle_pair hp = {.h = h, .h1 = h1};
+    lookups_done = false;
+    for (int i = 0; i < num_workers; i++) {
+        int r = pthread_create(&workers[i], NULL, bucket_lookup_thread, &hp);
+        assert(r == 0);
+    }
+
+    /* Every new bucket replaces the snapshot the workers look in */
+    for (int i = 0; i < 50; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "bucket%d", i);
+        pkt = create_create_bucket_pkt(name, ENGINE_PATH, "");
+        rv = create_bucket_command(h, h1, adm_cookie, pkt, add_response);
+        free(pkt);
+        assert(rv == ENGINE_SUCCESS);
+        assert(last_status == 0);
+
+        item *itm;
+        const void *cookie = mk_conn(name, NULL);
+        rv = h1->allocate(h, cookie, &itm, "somekey", 7, 9, 9258, 3600);
+        assert(rv == ENGINE_SUCCESS);
+        h1->release(h, cookie, itm);
+    }
+
+    lookups_done = true;
+    for (int i = 0; i < num_workers; i++) {
+        int r = pthread_join(workers[i], NULL);
+        assert(r == 0);
+    }
+
+    return SUCCESS;
+}
+
+static void topkeys_somekey_ops(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                const void *adm_cookie) {
+    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+    void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
+    rv = create_bucket_command(h, h1, adm_cookie, pkt, add_response);
     free(pkt);
 
 
@@ -1588,6 +1679,12 @@ static enum test_result test_topkeys(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
         rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
         free(pkt);
     }
+}
+
+static enum test_result test_topkeys(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+    const void *adm_cookie = mk_conn("admin", NULL);
+    topkeys_somekey_ops(h, h1, adm_cookie);
 
     rv = h1->get_stats(h, adm_cookie, "topkeys", 7, add_stats);
     assert(rv == ENGINE_SUCCESS);
@@ -1598,6 +1695,70 @@ static enum test_result test_topkeys(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_topkeys_sketch(ENGINE_HANDLE *h,
+                                            ENGINE_HANDLE_V1 *h1) {
+    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+    const void *adm_cookie = mk_conn("admin", NULL);
+    topkeys_somekey_ops(h, h1, adm_cookie);
+
+    /* A lot of keys seen once shouldn't push out the hot one */
+    for (int ii = 0; ii < 1000; ++ii) {
+        char key[32];
+        item *it = NULL;
+        snprintf(key, sizeof(key), "cold:%d", ii);
+        h1->get(h, adm_cookie, &it, key, strlen(key), 0);
+    }
+
+    rv = h1->get_stats(h, adm_cookie, "topkeys", 7, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    /* MEMCACHED_TOP_KEYS in the TK_SHARDS shards */
+    assert(genhash_size(stats_hash) <= 80);
+    char *val = genhash_find(stats_hash, "somekey", strlen("somekey"));
+    assert(val != NULL);
+    assert(strstr(val, "get_replica=1,evict=1,getl=1,unlock=1,get_meta=2,set_meta=2,del_meta=2") != NULL);
+    return SUCCESS;
+}
+
+static enum test_result test_bucket_quota(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = mk_conn("admin", NULL);
+    int ok, throttled, total_throttled = 0;
+
+    /* The quota is per second, so start on a new one and retry if the
+     * requests didn't fit in it */
+    do {
+        time_t start = time(NULL);
+        while (time(NULL) == start) {
+            usleep(1000);
+        }
+        start = time(NULL);
+        ok = throttled = 0;
+        for (int ii = 0; ii < 8; ++ii) {
+            item *it = NULL;
+            if (h1->get(h, cookie, &it, "somekey", 7, 0) == ENGINE_TMPFAIL) {
+                ++throttled;
+            } else {
+                ++ok;
+            }
+        }
+        total_throttled += throttled;
+        if (time(NULL) != start) {
+            ok = -1;
+        }
+    } while (ok == -1);
+    assert(ok == 5);
+    assert(throttled == 3);
+
+    ENGINE_ERROR_CODE rv = h1->get_stats(h, cookie, "quota", 5, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    assert(strcmp(genhash_find(stats_hash, "quota_ops", 9), "5") == 0);
+    char expected[16];
+    snprintf(expected, sizeof(expected), "%d", total_throttled);
+    assert(strcmp(genhash_find(stats_hash, "throttled", 9), expected) == 0);
+    assert(genhash_find(stats_hash, "ops", 3) != NULL);
+    return SUCCESS;
+}
+
 static ENGINE_HANDLE_V1 *start_your_engines(const char *cfg) {
     ENGINE_HANDLE_V1 *h = (ENGINE_HANDLE_V1 *)load_engine(".libs/bucket_engine.so",
                                                           cfg);
@@ -1647,12 +1808,17 @@ static int report_test(enum test_result r) {
 }
 
 static void disconnect_all_connections(struct connstruct *c) {
-    if (c) {
-        mock_disconnect(c);
-        disconnect_all_connections(c->next);
+    /* The list may be long (a connection per request in some of the
+     * tests), so don't recurse */
+    for (struct connstruct *p = c; p != NULL; p = p->next) {
+        mock_disconnect(p);
+    }
+    while (c != NULL) {
+        struct connstruct *next = c->next;
         free((void*)c->uname);
         free((void*)c->config);
         free(c);
+        c = next;
     }
 }
 
@@ -1764,8 +1930,8 @@ static void runBench(void) {
     ENGINE_HANDLE *h = (ENGINE_HANDLE*)h1;
     const void *adm_cookie = mk_conn("admin", NULL);
     void *pkt = create_create_bucket_pkt("bench", ENGINE_PATH, "");
-    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
-                                               add_response);
+    ENGINE_ERROR_CODE rv = create_bucket_command(h, h1, adm_cookie, pkt,
+                                             add_response);
     free(pkt);
     assert(rv == ENGINE_SUCCESS);
     assert(last_status == 0);
@@ -1850,7 +2016,12 @@ int main(int argc, char **argv) {
          test_concurrent_connect_disconnect, NULL },
         {"concurrent connect/disconnect (tap)",
          test_concurrent_connect_disconnect_tap, NULL },
+        {"concurrent bucket lookups", test_concurrent_bucket_lookups,
+         DEFAULT_CONFIG_NO_DEF},
         {"topkeys", test_topkeys, NULL },
+        {"topkeys (sketch)", test_topkeys_sketch,
+         DEFAULT_CONFIG ";topkeys_sketch=true"},
+        {"bucket quota", test_bucket_quota, DEFAULT_CONFIG ";quota_ops=5"},
         {NULL, NULL, NULL}
     };
 
@@ -1,3 +1,4 @@
+#include "config.h"
 #include <sys/types.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -6,6 +7,107 @@
 #include <pthread.h>
 #include "topkeys.h"
 
+#if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+#define TK_ATOMIC_INCR(p) atomic_inc_32_nv(p)
+#define TK_BARRIER() membar_enter()
+#else
+#define TK_ATOMIC_INCR(p) __sync_add_and_fetch(p, 1)
+#define TK_BARRIER() __sync_synchronize()
+#endif
+
+/*
+ * The sketch mode.
+ *
+ * Every operation is counted in a Count-Min sketch (TK_SKETCH_DEPTH rows
+ * of counters, the estimate for a key being the smallest of its
+ * counters). The max_keys keys with the highest estimates are kept in a
+ * fixed array of slots, ordered as a min heap on their count, so a key
+ * only takes the place of the lightest one when it has been seen more
+ * often. Nothing is allocated past topkeys_init, and the counters and
+ * the slots of the tracked keys are updated with atomic increments; the
+ * mutex is only taken with trylock (by admissions and aging), so a busy
+ * shard may skip an admission but never blocks a worker. All the counts
+ * are approximate when the same key is hit from several threads while
+ * its slot is being replaced.
+ */
+#define TK_SKETCH_DEPTH 4
+#define TK_SKETCH_MIN_WIDTH 1024
+#define TK_SKETCH_MAX_WIDTH 16384
+/* Longer keys aren't tracked in the sketch mode */
+#define TK_MAX_KEY_LEN 250
+
+static const uint32_t tk_seeds[TK_SKETCH_DEPTH] = {
+    0x9e3779b1, 0x85ebca6b, 0xc2b2ae35, 0x27d4eb2f
+};
+
+typedef struct {
+    volatile uint32_t version; /* odd while the slot is being rewritten */
+    volatile uint32_t count; /* the estimate used for the ranking */
+    int nkey;
+    rel_time_t ctime;
+    volatile rel_time_t atime;
+    volatile uint32_t ops[TK_NOPS];
+    char key[TK_MAX_KEY_LEN];
+} tk_slot_t;
+
+struct tk_sketch {
+    /* 32 - log2(width) */
+    int shift;
+    int max_keys;
+    int nkeys;
+    /* The count of the heap root when it was last rebuilt */
+    volatile uint32_t min_count;
+    volatile uint32_t updates;
+    /* Halve all the counts every age_after updates */
+    uint32_t age_after;
+    /* The hash of the key in every slot (0 if it's free) */
+    volatile uint32_t *hashes;
+    tk_slot_t *slots;
+    /* The slots in use, as a min heap on their count */
+    int *heap;
+    volatile uint32_t counters[];
+};
+
+static struct tk_sketch *tk_sketch_init(int max_keys) {
+    int bits = 0;
+    while ((1 << bits) < TK_SKETCH_MIN_WIDTH ||
+           ((1 << bits) < max_keys * 16 &&
+            (1 << bits) < TK_SKETCH_MAX_WIDTH)) {
+        ++bits;
+    }
+    size_t width = (size_t)1 << bits;
+
+    struct tk_sketch *sk = calloc(1, sizeof(*sk) + TK_SKETCH_DEPTH * width *
+                                  sizeof(uint32_t));
+    if (sk == NULL) {
+        return NULL;
+    }
+    sk->shift = 32 - bits;
+    sk->max_keys = max_keys;
+    sk->age_after = width * 8;
+    sk->hashes = calloc(max_keys, sizeof(uint32_t));
+    sk->slots = calloc(max_keys, sizeof(tk_slot_t));
+    sk->heap = calloc(max_keys, sizeof(int));
+    if (sk->hashes == NULL || sk->slots == NULL || sk->heap == NULL) {
+        free((void*)sk->hashes);
+        free(sk->slots);
+        free(sk->heap);
+        free(sk);
+        return NULL;
+    }
+    return sk;
+}
+
+static void tk_sketch_free(struct tk_sketch *sk) {
+    if (sk != NULL) {
+        free((void*)sk->hashes);
+        free(sk->slots);
+        free(sk->heap);
+        free(sk);
+    }
+}
+
 static topkey_item_t *topkey_item_init(const void *key, int nkey, rel_time_t ct) {
     topkey_item_t *it = calloc(sizeof(topkey_item_t) + nkey, 1);
     assert(it);
@@ -32,7 +134,7 @@ static int my_hash_eq(const void *k1, size_t nkey1,
     return nkey1 == nkey2 && memcmp(k1, k2, nkey1) == 0;
 }
 
-topkeys_t *topkeys_init(int max_keys) {
+topkeys_t *topkeys_init(int max_keys, bool sketch) {
     topkeys_t *tk = calloc(sizeof(topkeys_t), 1);
     if (tk == NULL) {
         return NULL;
@@ -46,6 +148,15 @@ topkeys_t *topkeys_init(int max_keys) {
     tk->list.next = &tk->list;
     tk->list.prev = &tk->list;
 
+    if (sketch) {
+        tk->sketch = tk_sketch_init(max_keys);
+        if (tk->sketch == NULL) {
+            pthread_mutex_destroy(&tk->mutex);
+            free(tk);
+            return NULL;
+        }
+    }
+
     static struct hash_ops my_hash_ops = {
         .hashfunc = genhash_string_hash,
         .hasheq = my_hash_eq,
@@ -65,6 +176,7 @@ topkeys_t *topkeys_init(int max_keys) {
 void topkeys_free(topkeys_t *tk) {
     assert(pthread_mutex_destroy(&tk->mutex)== 0);
     genhash_free(tk->hash);
+    tk_sketch_free(tk->sketch);
     dlist_t *p = tk->list.next;
     while (p != &tk->list) {
         dlist_t *tmp = p->next;
@@ -124,6 +236,151 @@ topkey_item_t *topkeys_item_get_or_create(topkeys_t *tk, const void *key, size_t
     return it;
 }
 
+/* The slot tracking key, or -1 */
+static int tk_sketch_find(struct tk_sketch *sk, uint32_t hash,
+                          const void *key, int nkey) {
+    for (int ii = 0; ii < sk->max_keys; ii++) {
+        if (sk->hashes[ii] == hash) {
+            tk_slot_t *s = &sk->slots[ii];
+            uint32_t version = s->version;
+            TK_BARRIER();
+            if ((version & 1) == 0 && s->nkey == nkey &&
+                memcmp(s->key, key, nkey) == 0) {
+                TK_BARRIER();
+                if (s->version == version) {
+                    return ii;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+/* Sift down the heap entry ii, in a heap of n entries */
+static void tk_sketch_sift_down(struct tk_sketch *sk, int ii, int n) {
+    int *heap = sk->heap;
+    for (;;) {
+        int min = ii;
+        int child = 2 * ii + 1;
+        for (int c = child; c < child + 2 && c < n; c++) {
+            if (sk->slots[heap[c]].count < sk->slots[heap[min]].count) {
+                min = c;
+            }
+        }
+        if (min == ii) {
+            return;
+        }
+        int tmp = heap[ii];
+        heap[ii] = heap[min];
+        heap[min] = tmp;
+        ii = min;
+    }
+}
+
+/*
+ * The tracked keys keep being counted after they're placed in the heap,
+ * so it has to be rebuilt before looking at the root.
+ */
+static void tk_sketch_heapify(struct tk_sketch *sk) {
+    for (int ii = sk->nkeys / 2 - 1; ii >= 0; ii--) {
+        tk_sketch_sift_down(sk, ii, sk->nkeys);
+    }
+}
+
+/* Start tracking a key (called with the mutex held) */
+static void tk_sketch_admit(struct tk_sketch *sk, uint32_t hash,
+                            const void *key, int nkey, enum tk_op op,
+                            uint32_t est, const rel_time_t ct) {
+    int ii;
+    if (sk->nkeys < sk->max_keys) {
+        ii = sk->nkeys;
+        sk->heap[sk->nkeys++] = ii;
+    } else {
+        tk_sketch_heapify(sk);
+        ii = sk->heap[0];
+        if (sk->slots[ii].count >= est) {
+            sk->min_count = sk->slots[ii].count;
+            return;
+        }
+    }
+
+    tk_slot_t *s = &sk->slots[ii];
+    sk->hashes[ii] = 0;
+    ++s->version;
+    TK_BARRIER();
+    memset((void*)s->ops, 0, sizeof(s->ops));
+    s->ops[op] = 1;
+    s->count = est;
+    s->nkey = nkey;
+    s->ctime = s->atime = ct;
+    memcpy(s->key, key, nkey);
+    TK_BARRIER();
+    ++s->version;
+    sk->hashes[ii] = hash;
+
+    if (sk->nkeys == sk->max_keys) {
+        tk_sketch_heapify(sk);
+        sk->min_count = sk->slots[sk->heap[0]].count;
+    }
+}
+
+/* Halve all the counts, so that the keys that used to be hot fade out */
+static void tk_sketch_age(struct tk_sketch *sk) {
+    size_t ncounters = (size_t)TK_SKETCH_DEPTH << (32 - sk->shift);
+    for (size_t ii = 0; ii < ncounters; ii++) {
+        sk->counters[ii] >>= 1;
+    }
+    for (int ii = 0; ii < sk->nkeys; ii++) {
+        sk->slots[ii].count >>= 1;
+    }
+    sk->min_count >>= 1;
+}
+
+void topkeys_sketch_count(topkeys_t *tk, const void *key, size_t nkey,
+                          uint32_t hash, enum tk_op op, const rel_time_t ct) {
+    struct tk_sketch *sk = tk->sketch;
+    uint32_t est = UINT32_MAX;
+    size_t width = (size_t)1 << (32 - sk->shift);
+    for (int r = 0; r < TK_SKETCH_DEPTH; r++) {
+        /* The high bits, the low ones picked the shard */
+        size_t col = (uint32_t)(hash * tk_seeds[r]) >> sk->shift;
+        uint32_t c = TK_ATOMIC_INCR(&sk->counters[r * width + col]);
+        if (c < est) {
+            est = c;
+        }
+    }
+
+    if (nkey <= TK_MAX_KEY_LEN) {
+        if (hash == 0) {
+            hash = 1;
+        }
+        int ii = tk_sketch_find(sk, hash, key, nkey);
+        if (ii >= 0) {
+            tk_slot_t *s = &sk->slots[ii];
+            TK_ATOMIC_INCR(&s->ops[op]);
+            TK_ATOMIC_INCR(&s->count);
+            s->atime = ct;
+        } else if ((sk->nkeys < sk->max_keys || est > sk->min_count) &&
+                   pthread_mutex_trylock(&tk->mutex) == 0) {
+            /* It may have been admitted while we were looking */
+            ii = tk_sketch_find(sk, hash, key, nkey);
+            if (ii >= 0) {
+                TK_ATOMIC_INCR(&sk->slots[ii].ops[op]);
+                TK_ATOMIC_INCR(&sk->slots[ii].count);
+            } else {
+                tk_sketch_admit(sk, hash, key, nkey, op, est, ct);
+            }
+            must_unlock(&tk->mutex);
+        }
+    }
+
+    if (TK_ATOMIC_INCR(&sk->updates) % sk->age_after == 0 &&
+        pthread_mutex_trylock(&tk->mutex) == 0) {
+        tk_sketch_age(sk);
+        must_unlock(&tk->mutex);
+    }
+}
+
 struct tk_context {
     const void *cookie;
     ADD_STAT add_stat;
@@ -143,6 +400,29 @@ static void tk_iterfunc(dlist_t *list, void *arg) {
     c->add_stat(it->ti_key, it->ti_nkey, val_str, vlen, c->cookie);
 }
 
+#define TK_SKETCH_ARGS(name) (int)s->ops[TK_OP_##name],
+
+static void tk_sketch_stats(struct tk_sketch *sk, struct tk_context *c) {
+    /* Heaviest first: sort the heap (which is rebuilt by the next
+     * admission anyway) by descending count */
+    tk_sketch_heapify(sk);
+    int n = sk->nkeys;
+    while (n > 1) {
+        int tmp = sk->heap[0];
+        sk->heap[0] = sk->heap[--n];
+        sk->heap[n] = tmp;
+        tk_sketch_sift_down(sk, 0, n);
+    }
+
+    for (int ii = 0; ii < sk->nkeys; ii++) {
+        tk_slot_t *s = &sk->slots[sk->heap[ii]];
+        char val_str[TK_MAX_VAL_LEN];
+        int vlen = snprintf(val_str, sizeof(val_str) - 1, TK_OPS(TK_FMT)"ctime=%"PRIu32",atime=%"PRIu32, TK_OPS(TK_SKETCH_ARGS)
+                            c->current_time - s->ctime, c->current_time - s->atime);
+        c->add_stat(s->key, s->nkey, val_str, vlen, c->cookie);
+    }
+}
+
 ENGINE_ERROR_CODE topkeys_stats(topkeys_t **tks, size_t shards,
                                 const void *cookie,
                                 const rel_time_t current_time,
@@ -155,15 +435,20 @@ ENGINE_ERROR_CODE topkeys_stats(topkeys_t **tks, size_t shards,
         topkeys_t *tk = tks[i];
         assert(tk);
         must_lock(&tk->mutex);
-        dlist_iter(&tk->list, tk_iterfunc, &context);
+        if (tk->sketch != NULL) {
+            tk_sketch_stats(tk->sketch, &context);
+        } else {
+            dlist_iter(&tk->list, tk_iterfunc, &context);
+        }
         must_unlock(&tk->mutex);
     }
     return ENGINE_SUCCESS;
 }
 
-topkeys_t *tk_get_shard(topkeys_t **tks, const void *key, size_t nkey) {
+topkeys_t *tk_get_shard(topkeys_t **tks, const void *key, size_t nkey,
+                        uint32_t *hash) {
     // This is special-cased for 8
     assert(TK_SHARDS == 8);
-    int khash = genhash_string_hash(key, nkey);
-    return tks[khash & 0x07];
+    *hash = (uint32_t)genhash_string_hash(key, nkey);
+    return tks[*hash & 0x07];
 }
@@ -16,6 +16,11 @@ void must_unlock(pthread_mutex_t *mutex);
     C(evict) C(getl) C(unlock) C(get_meta) C(set_meta)              \
     C(del_meta)
 
+/* Index of every operation in TK_OPS */
+#define TK_ENUM(name) TK_OP_##name,
+enum tk_op { TK_OPS(TK_ENUM) TK_NOPS };
+#undef TK_ENUM
+
 #define TK_MAX_VAL_LEN 500
 
 #define TK_SHARDS 8
@@ -26,14 +31,20 @@ void must_unlock(pthread_mutex_t *mutex);
     if (tks) { \
         assert(key); \
         assert(nkey > 0); \
-        topkeys_t *tk = tk_get_shard((tks), (key), (nkey)); \
-        must_lock(&tk->mutex); \
-        topkey_item_t *tmp = topkeys_item_get_or_create((tk), (key), \
-                                                        (nkey), (ctime)); \
-        if (tmp != NULL) { \
-            tmp->op++; \
+        uint32_t tk_hash; \
+        topkeys_t *tk = tk_get_shard((tks), (key), (nkey), &tk_hash); \
+        if (tk->sketch != NULL) { \
+            topkeys_sketch_count((tk), (key), (nkey), tk_hash, \
+                                 TK_OP_##op, (ctime)); \
+        } else { \
+            must_lock(&tk->mutex); \
+            topkey_item_t *tmp = topkeys_item_get_or_create((tk), (key), \
+                                                            (nkey), (ctime)); \
+            if (tmp != NULL) { \
+                tmp->op++; \
+            } \
+            must_unlock(&tk->mutex); \
         } \
-        must_unlock(&tk->mutex); \
     } \
 }
 
@@ -52,21 +63,44 @@ typedef struct topkey_item {
     char ti_key[]; /* A variable length array in the struct itself */
 } topkey_item_t;
 
+/* The approximate mode, see topkeys_sketch_count */
+struct tk_sketch;
+
 typedef struct topkeys {
     dlist_t list;
     pthread_mutex_t mutex;
     genhash_t *hash;
     int nkeys;
     int max_keys;
+    struct tk_sketch *sketch;
 } topkeys_t;
 
-topkeys_t *topkeys_init(int max_keys);
+/**
+ * Create a shard tracking up to max_keys keys: the most recently used
+ * ones, or the most used ones (approximately) if sketch is set.
+ */
+topkeys_t *topkeys_init(int max_keys, bool sketch);
 void topkeys_free(topkeys_t *topkeys);
-topkeys_t *tk_get_shard(topkeys_t **tk, const void *key, size_t nkey);
+/**
+ * Get the shard for a key
+ * @param hash where to store the hash of the key (for
+ *             topkeys_sketch_count, so that we only hash it once)
+ */
+topkeys_t *tk_get_shard(topkeys_t **tk, const void *key, size_t nkey,
+                        uint32_t *hash);
 topkey_item_t *topkeys_item_get_or_create(topkeys_t *tk,
                                           const void *key,
                                           size_t nkey,
                                           const rel_time_t ctime);
+/**
+ * Count an operation on a key in a sketch mode shard. This doesn't
+ * take the shard mutex (except, with trylock, to start tracking a new
+ * heavy hitter), nor allocate anything. hash is the one tk_get_shard()
+ * returned for the key.
+ */
+void topkeys_sketch_count(topkeys_t *tk, const void *key, size_t nkey,
+                          uint32_t hash, enum tk_op op,
+                          const rel_time_t ctime);
 
 ENGINE_ERROR_CODE topkeys_stats(topkeys_t **tk, size_t n,
                                 const void *cookie,
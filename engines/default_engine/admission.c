@@ -0,0 +1,134 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "default_engine.h"
+
+/* The smallest sketch we use (in counters) */
+#define ADMISSION_MIN_COUNTERS 65536
+/* The number of rows of the sketch: every key has a counter in each */
+#define ADMISSION_ROWS 4
+#define ADMISSION_COUNTER_MAX 0xf
+
+static const uint32_t row_seeds[ADMISSION_ROWS] = {
+    0x97cb3127, 0xb492b66f, 0x9ae16a3b, 0xc2b2ae35
+};
+
+/* All of the rows share one table, with a hash of their own */
+static inline uint32_t admission_index(const struct admission_filter *f,
+                                       uint32_t hv, int row) {
+    uint32_t h = hv ^ row_seeds[row];
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h & f->mask;
+}
+
+static inline unsigned int counter_get(const struct admission_filter *f,
+                                       uint32_t idx) {
+    uint32_t word = ((volatile uint32_t *)f->table)[idx >> 3];
+    return (word >> ((idx & 7) * 4)) & ADMISSION_COUNTER_MAX;
+}
+
+static void counter_incr(struct admission_filter *f, uint32_t idx) {
+    uint32_t *word = &f->table[idx >> 3];
+    unsigned int shift = (idx & 7) * 4;
+    uint32_t old;
+    do {
+        old = *(volatile uint32_t *)word;
+        if (((old >> shift) & ADMISSION_COUNTER_MAX) == ADMISSION_COUNTER_MAX) {
+            return;
+        }
+    } while (!ATOMIC_CAS(word, old, old + (1U << shift)));
+}
+
+/* Halve all of the counters (the accesses go on meanwhile) */
+static void admission_reset(struct admission_filter *f) {
+    size_t nwords = ((size_t)f->mask + 1) / 8;
+    for (size_t ii = 0; ii < nwords; ++ii) {
+        uint32_t old;
+        do {
+            old = *(volatile uint32_t *)&f->table[ii];
+        } while (!ATOMIC_CAS(&f->table[ii], old, (old >> 1) & 0x77777777));
+    }
+    ATOMIC_ADD_64(&f->resets, 1);
+}
+
+ENGINE_ERROR_CODE admission_init(struct default_engine *engine) {
+    struct admission_filter *f = &engine->admission;
+
+    if (!engine->config.admission_filter) {
+        return ENGINE_SUCCESS;
+    }
+
+    size_t ncounters = ADMISSION_MIN_COUNTERS;
+    while (ncounters < engine->config.maxbytes / 256 &&
+           ncounters < ((size_t)1 << 31)) {
+        ncounters <<= 1;
+    }
+    if ((f->table = calloc(ncounters / 8, sizeof(uint32_t))) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    f->mask = (uint32_t)(ncounters - 1);
+    /* Every access bumps ADMISSION_ROWS counters, so they are up to two
+     * on average when we halve them */
+    f->sample = (uint32_t)(ncounters / 2);
+    f->enabled = true;
+    return ENGINE_SUCCESS;
+}
+
+void admission_destroy(struct default_engine *engine) {
+    free(engine->admission.table);
+    engine->admission.table = NULL;
+    engine->admission.enabled = false;
+}
+
+void admission_record(struct default_engine *engine, uint32_t hv) {
+    struct admission_filter *f = &engine->admission;
+    for (int row = 0; row < ADMISSION_ROWS; ++row) {
+        counter_incr(f, admission_index(f, hv, row));
+    }
+    uint32_t additions = ATOMIC_INCR(&f->additions);
+    if (additions == f->sample) {
+        admission_reset(f);
+        ATOMIC_ADD(&f->additions, -f->sample);
+    }
+}
+
+unsigned int admission_estimate(struct default_engine *engine, uint32_t hv) {
+    struct admission_filter *f = &engine->admission;
+    unsigned int min = ADMISSION_COUNTER_MAX;
+    for (int row = 0; row < ADMISSION_ROWS; ++row) {
+        unsigned int count = counter_get(f, admission_index(f, hv, row));
+        if (count < min) {
+            min = count;
+        }
+    }
+    return min;
+}
+
+void admission_stats(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie) {
+    struct admission_filter *f = &engine->admission;
+    const char *prefix = "admission";
+
+    add_statistics(cookie, add_stat, prefix, -1, "enabled", "%s",
+                   f->enabled ? "true" : "false");
+    if (!f->enabled) {
+        return;
+    }
+
+    add_statistics(cookie, add_stat, prefix, -1, "counters", "%u",
+                   f->mask + 1);
+    add_statistics(cookie, add_stat, prefix, -1, "admitted", "%"PRIu64,
+                   f->admitted);
+    add_statistics(cookie, add_stat, prefix, -1, "rejected", "%"PRIu64,
+                   f->rejected);
+    add_statistics(cookie, add_stat, prefix, -1, "resets", "%"PRIu64,
+                   f->resets);
+}
@@ -0,0 +1,79 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+/*
+ * The admission filter (admission_filter=true) keeps the items that are
+ * read over and over from being pushed out by the ones that are set and
+ * never read again (a scan, or the one-hit wonders of a big key space).
+ * It counts the gets and the stores of every key in a TinyLFU sketch: a
+ * count-min sketch of 4-bit counters, which are all halved once we
+ * counted half as many accesses as there are counters, so that it
+ * forgets what was hot a while ago.
+ *
+ * When a slab class is evicting, an item being linked is compared with
+ * the item we'd evict next from the class. Unless the sketch says the new
+ * one was used more, it goes into the probation segment of the LRU (see
+ * enum lru_segment), where the victims are looked for first: the rejected
+ * items take each other's place instead of pushing out the cold segment.
+ * An item hit while in probation is moved out of it like an active item
+ * of the cold segment. The probation segment is kept to a few percent of
+ * the items of the class (its oldest items are moved to the cold one).
+ */
+
+struct admission_filter {
+   bool enabled;
+   /** The counters, 8 in a word */
+   uint32_t *table;
+   /** The number of counters - 1 (a power of two) */
+   uint32_t mask;
+   /** The accesses counted since the counters were halved (atomic) */
+   uint32_t additions;
+   /** The number of accesses we halve the counters after */
+   uint32_t sample;
+
+   /** Statistics (updated atomically) */
+   uint64_t admitted;
+   uint64_t rejected;
+   uint64_t resets;
+};
+
+/**
+ * Allocate the sketch (if admission_filter is set). It gets a counter
+ * for every 256 bytes of cache_size (and 64K of them at least).
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE admission_init(struct default_engine *engine);
+
+/**
+ * Free the sketch
+ * @param engine handle to the storage engine
+ */
+void admission_destroy(struct default_engine *engine);
+
+/**
+ * Count an access to a key (only call it if the filter is enabled)
+ * @param engine handle to the storage engine
+ * @param hv the hash of the key
+ */
+void admission_record(struct default_engine *engine, uint32_t hv);
+
+/**
+ * Get the (approximate) number of recent accesses to a key
+ * @param engine handle to the storage engine
+ * @param hv the hash of the key
+ * @return the estimate (at most 15)
+ */
+unsigned int admission_estimate(struct default_engine *engine, uint32_t hv);
+
+/**
+ * Get the statistics of the filter
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void admission_stats(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie);
+
+#endif
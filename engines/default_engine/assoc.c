@@ -11,149 +11,383 @@
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "default_engine.h"
 
 #define hashsize(n) ((uint32_t)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
+#if defined(HAVE_SYS_MMAN_H) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * Allocate a zero filled table with hashsize(power) buckets. We map the
+ * memory directly (and ask for huge pages if the platform supports it) to
+ * avoid having a huge malloc chunk and the page walk cost of a table
+ * spread over millions of small pages.
+ */
+static item_ref* assoc_alloc_table(struct default_engine *engine,
+                                   unsigned int power) {
+    size_t size = hashsize(power) * sizeof(item_ref);
+#ifdef HAVE_SYS_MMAN_H
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (madvise(ptr, size, MADV_HUGEPAGE) == 0) {
+        engine->assoc.huge_pages = true;
+    }
+#endif
+    return ptr;
+#else
+    return calloc(hashsize(power), sizeof(item_ref));
+#endif
+}
+
+static void assoc_free_table(item_ref *table, unsigned int power) {
+#ifdef HAVE_SYS_MMAN_H
+    if (table != NULL) {
+        munmap((void*)table, hashsize(power) * sizeof(item_ref));
+    }
+#else
+    free(table);
+#endif
+}
+
+/*
+ * The number of filter counters per bucket in the hash table, and the
+ * number of counters we use for a key. That lets about 3% of the keys we
+ * don't have through at a load factor of 1 (and 8% at 1.5, where we
+ * expand the table).
+ */
+#define FILTER_COUNTERS 8
+#define FILTER_HASHES 3
+
+static struct assoc_filter *assoc_filter_alloc(unsigned int power) {
+    size_t size = (size_t)hashsize(power) * FILTER_COUNTERS;
+    struct assoc_filter *filter = calloc(1, sizeof(*filter));
+    if (filter == NULL || (filter->counters = calloc(size, 1)) == NULL) {
+        free(filter);
+        return NULL;
+    }
+    filter->mask = size - 1;
+    return filter;
+}
+
+static void assoc_filter_free(struct assoc_filter *filter) {
+    if (filter != NULL) {
+        free(filter->counters);
+        free(filter);
+    }
+}
+
+/* The step for the double hashing of the hash value */
+static inline uint64_t assoc_filter_step(uint32_t hash) {
+    uint64_t h = hash * 0x9E3779B97F4A7C15ULL;
+    return (h ^ (h >> 29)) | 1;
+}
+
+/*
+ * Count an item in (or out of) the filter. The items of different stripes
+ * may share a counter, so we update them atomically. A counter that
+ * overflows stays stuck at its maximum.
+ */
+static void assoc_filter_update(struct assoc_filter *filter, uint32_t hash,
+                                bool add) {
+    if (filter == NULL) {
+        return;
+    }
+
+    uint64_t step = assoc_filter_step(hash);
+    uint64_t pos = hash;
+    for (int ii = 0; ii < FILTER_HASHES; ++ii, pos += step) {
+        uint8_t *counter = &filter->counters[pos & filter->mask];
+        uint8_t val;
+        do {
+            val = *counter;
+            if (val == UINT8_MAX || (!add && val == 0)) {
+                break;
+            }
+        } while (!ATOMIC_CAS_8(counter, val, (uint8_t)(add ? val + 1 : val - 1)));
+    }
+}
+
+/*
+ * Returns false if we definitely don't have an item with the hash value.
+ * This is called without any locks.
+ */
+bool assoc_maybe_present(struct default_engine *engine, uint32_t hash) {
+    struct assoc_filter *filter = engine->assoc.filter;
+    if (filter == NULL) {
+        return true;
+    }
+
+    uint64_t step = assoc_filter_step(hash);
+    uint64_t pos = hash;
+    for (int ii = 0; ii < FILTER_HASHES; ++ii, pos += step) {
+        if (filter->counters[pos & filter->mask] == 0) {
+            engine->assoc.filter_negatives++;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * The filter let a get through that didn't find anything. The caller holds
+ * the item lock.
+ */
+void assoc_filter_missed(struct default_engine *engine) {
+    if (engine->assoc.filter != NULL) {
+        engine->assoc.filter_false_positives++;
+    }
+}
+
+static uint64_t assoc_time_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 ENGINE_ERROR_CODE assoc_init(struct default_engine *engine) {
-    engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower), sizeof(void *));
-    return (engine->assoc.primary_hashtable != NULL) ? ENGINE_SUCCESS : ENGINE_ENOMEM;
+    engine->assoc.min_hashpower = engine->assoc.hashpower;
+    engine->assoc.primary_hashtable = assoc_alloc_table(engine, engine->assoc.hashpower);
+    if (engine->assoc.primary_hashtable == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    if (engine->config.bloom_filter &&
+        (engine->assoc.filter = assoc_filter_alloc(engine->assoc.hashpower)) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    return ENGINE_SUCCESS;
 }
 
 void assoc_destroy(struct default_engine *engine) {
-    while (engine->assoc.expanding) {
+    while (engine->assoc.expand_pending) {
         usleep(250);
     }
-    free(engine->assoc.primary_hashtable);
+    assoc_free_table(engine->assoc.primary_hashtable, engine->assoc.hashpower);
+    assoc_filter_free(engine->assoc.filter);
+    assoc_filter_free(engine->assoc.retired_filter);
 }
 
-hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
-    hash_item *it;
-    unsigned int oldbucket;
+/* The size of the old table while we move the items */
+static inline unsigned int assoc_old_power(struct default_engine *engine) {
+    return engine->assoc.shrinking ?
+        engine->assoc.hashpower + 1 : engine->assoc.hashpower - 1;
+}
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        it = engine->assoc.old_hashtable[oldbucket];
-    } else {
-        it = engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
+/* Is the bucket hash lives in still in the old table? */
+static inline bool assoc_in_old_table(struct default_engine *engine,
+                                      uint32_t hash) {
+    if (!engine->assoc.expanding) {
+        return false;
+    }
+    /* expand_bucket counts the buckets of the smaller table */
+    unsigned int power = engine->assoc.hashpower;
+    if (!engine->assoc.shrinking) {
+        --power;
     }
+    return (hash & hashmask(power)) >= engine->assoc.expand_bucket;
+}
+
+/* The bucket hash lives in (in the old table if it hasn't moved yet) */
+static inline item_ref *assoc_bucket(struct default_engine *engine,
+                                     uint32_t hash) {
+    if (assoc_in_old_table(engine, hash)) {
+        return &engine->assoc.old_hashtable[hash & hashmask(assoc_old_power(engine))];
+    }
+    return &engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
+}
 
+/*
+ * The top bits of the hash value, kept in the header of the item. The
+ * bucket is picked by the low bits, so the items of a chain have a tag
+ * that doesn't match ours (but one in 256) and we don't have to look at
+ * their key: that's in another cache line for most of them.
+ */
+static inline uint8_t assoc_tag(uint32_t hash) {
+    return (uint8_t)(hash >> 24);
+}
+
+hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
+    hash_item *it = item_deref(engine, *assoc_bucket(engine, hash));
     hash_item *ret = NULL;
+    uint8_t tag = assoc_tag(hash);
     int depth = 0;
     while (it) {
-        if ((nkey == it->nkey) && (memcmp(key, item_get_key(it), nkey) == 0)) {
+        if (it->hash_tag == tag && nkey == it->nkey &&
+            memcmp(key, item_get_key(it), nkey) == 0) {
             ret = it;
             break;
         }
-        it = it->h_next;
+        it = item_deref(engine, it->h_next);
         ++depth;
     }
     MEMCACHED_ASSOC_FIND(key, nkey, depth);
     return ret;
 }
 
-/* returns the address of the item pointer before the key.  if *item == 0,
-   the item wasn't found */
-
-static hash_item** _hashitem_before(struct default_engine *engine,
-                                    uint32_t hash,
-                                    const char *key,
-                                    const size_t nkey) {
-    hash_item **pos;
-    unsigned int oldbucket;
+/*
+ * Pull the bucket for hash into the cache so that a subsequent
+ * assoc_find() doesn't have to wait for it.
+ */
+void assoc_prefetch(struct default_engine *engine, uint32_t hash) {
+#if defined(__GNUC__)
+    __builtin_prefetch(assoc_bucket(engine, hash));
+#else
+    (void)engine;
+    (void)hash;
+#endif
+}
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        pos = &engine->assoc.old_hashtable[oldbucket];
-    } else {
-        pos = &engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
+/*
+ * The second stage of a pipelined lookup: once assoc_prefetch() got the
+ * bucket for hash into the cache, pull in the header and the key of the
+ * first item in its chain (the one assoc_find() compares first).
+ */
+void assoc_prefetch_item(struct default_engine *engine, uint32_t hash) {
+#if defined(__GNUC__)
+    hash_item *it = item_deref(engine, *assoc_bucket(engine, hash));
+    if (it != NULL) {
+        __builtin_prefetch(it);
+        __builtin_prefetch(item_get_key(it));
     }
+#else
+    (void)engine;
+    (void)hash;
+#endif
+}
+
+/* returns the address of the item pointer before the key.  if *item == 0,
+   the item wasn't found */
 
-    while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, item_get_key(*pos), nkey))) {
-        pos = &(*pos)->h_next;
+static item_ref* _hashitem_before(struct default_engine *engine,
+                                  uint32_t hash,
+                                  const char *key,
+                                  const size_t nkey) {
+    item_ref *pos = assoc_bucket(engine, hash);
+    uint8_t tag = assoc_tag(hash);
+    hash_item *it;
+    while ((it = item_deref(engine, *pos)) != NULL &&
+           (it->hash_tag != tag || nkey != it->nkey ||
+            memcmp(key, item_get_key(it), nkey))) {
+        pos = &it->h_next;
     }
     return pos;
 }
 
 static void *assoc_maintenance_thread(void *arg);
+static void *assoc_shrink_thread(void *arg);
 
-/* grows the hashtable to the next power of 2. */
-static void assoc_expand(struct default_engine *engine) {
-    engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
+/*
+ * Start growing the hashtable to the next power of 2 (or shrinking it
+ * to the previous one). The caller holds an item lock, so we can't
+ * switch the tables here (that requires all of the item locks). The
+ * maintenance thread allocates the new table and performs the switch
+ * before it starts moving the buckets.
+ */
+static void assoc_expand(struct default_engine *engine, bool shrink) {
+    int ret = 0;
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    if (pthread_attr_init(&attr) != 0 ||
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
+        (ret = pthread_create(&tid, &attr,
+                              shrink ? assoc_shrink_thread :
+                              assoc_maintenance_thread, engine)) != 0)
+    {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Can't create thread: %s\n", strerror(ret));
+        engine->assoc.expand_pending = 0;
+    }
+}
 
-    engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower + 1), sizeof(void *));
-    if (engine->assoc.primary_hashtable) {
-        engine->assoc.hashpower++;
-        engine->assoc.expanding = true;
-        engine->assoc.expand_bucket = 0;
-
-        /* start a thread to do the expansion */
-        int ret = 0;
-        pthread_t tid;
-        pthread_attr_t attr;
-
-        if (pthread_attr_init(&attr) != 0 ||
-            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
-            (ret = pthread_create(&tid, &attr,
-                                  assoc_maintenance_thread, engine)) != 0)
-        {
-            EXTENSION_LOGGER_DESCRIPTOR *logger;
-            logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-            logger->log(EXTENSION_LOG_WARNING, NULL,
-                        "Can't create thread: %s\n", strerror(ret));
-            engine->assoc.hashpower--;
-            engine->assoc.expanding = false;
-            free(engine->assoc.primary_hashtable);
-            engine->assoc.primary_hashtable =engine->assoc.old_hashtable;
-        }
-    } else {
-        engine->assoc.primary_hashtable = engine->assoc.old_hashtable;
-        /* Bad news, but we can keep running. */
+/*
+ * With hash_shrink_delay we shrink the table to the previous power of 2
+ * once its load factor stayed below 1/8 for that many seconds (it's
+ * still below 1/4 after that, far from where we grow it again). The
+ * caller holds an item lock.
+ */
+static void assoc_check_shrink(struct default_engine *engine,
+                               unsigned int items) {
+    if (engine->config.hash_shrink_delay == 0) {
+        return;
+    }
+    if (engine->assoc.expanding ||
+        engine->assoc.hashpower <= engine->assoc.min_hashpower ||
+        items >= hashsize(engine->assoc.hashpower) / 8) {
+        engine->assoc.low_load = false;
+        return;
+    }
+
+    rel_time_t now = engine->server.core->get_current_time();
+    if (!engine->assoc.low_load) {
+        engine->assoc.low_load_since = now;
+        engine->assoc.low_load = true;
+    } else if (now - engine->assoc.low_load_since >= engine->config.hash_shrink_delay &&
+               ATOMIC_CAS(&engine->assoc.expand_pending, 0, 1)) {
+        engine->assoc.low_load = false;
+        assoc_expand(engine, true);
     }
 }
 
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
 int assoc_insert(struct default_engine *engine, uint32_t hash, hash_item *it) {
-    unsigned int oldbucket;
-
     assert(assoc_find(engine, hash, item_get_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
-
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        it->h_next = engine->assoc.old_hashtable[oldbucket];
-        engine->assoc.old_hashtable[oldbucket] = it;
-    } else {
-        it->h_next = engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
-        engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)] = it;
+    it->hash_tag = assoc_tag(hash);
+
+    item_ref *bucket = assoc_bucket(engine, hash);
+    it->h_next = *bucket;
+    *bucket = item_ref_of(engine, it);
+    if (!assoc_in_old_table(engine, hash)) {
+        /* The moved buckets are in the filter we're building */
+        assoc_filter_update(engine->assoc.next_filter, hash, true);
     }
+    assoc_filter_update(engine->assoc.filter, hash, true);
 
-    engine->assoc.hash_items++;
-    if (! engine->assoc.expanding && engine->assoc.hash_items > (hashsize(engine->assoc.hashpower) * 3) / 2) {
-        assoc_expand(engine);
+    unsigned int items = ATOMIC_INCR(&engine->assoc.hash_items);
+    if (! engine->assoc.expanding &&
+        items > (hashsize(engine->assoc.hashpower) * 3) / 2 &&
+        ATOMIC_CAS(&engine->assoc.expand_pending, 0, 1)) {
+        assoc_expand(engine, false);
+    } else {
+        assoc_check_shrink(engine, items);
     }
 
-    MEMCACHED_ASSOC_INSERT(item_get_key(it), it->nkey, engine->assoc.hash_items);
+    MEMCACHED_ASSOC_INSERT(item_get_key(it), it->nkey, items);
     return 1;
 }
 
 void assoc_delete(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
-    hash_item **before = _hashitem_before(engine, hash, key, nkey);
+    item_ref *before = _hashitem_before(engine, hash, key, nkey);
 
     if (*before) {
-        hash_item *nxt;
-        engine->assoc.hash_items--;
+        hash_item *it = item_deref(engine, *before);
+        unsigned int items = ATOMIC_DECR(&engine->assoc.hash_items);
         /* The DTrace probe cannot be triggered as the last instruction
          * due to possible tail-optimization by the compiler
          */
-        MEMCACHED_ASSOC_DELETE(key, nkey, engine->assoc.hash_items);
-        nxt = (*before)->h_next;
-        (*before)->h_next = 0;   /* probably pointless, but whatever. */
-        *before = nxt;
+        MEMCACHED_ASSOC_DELETE(key, nkey, items);
+        *before = it->h_next;
+        it->h_next = 0;   /* probably pointless, but whatever. */
+        assoc_filter_update(engine->assoc.filter, hash, false);
+        if (!assoc_in_old_table(engine, hash)) {
+            assoc_filter_update(engine->assoc.next_filter, hash, false);
+        }
+        assoc_check_shrink(engine, items);
         return;
     }
     /* Note:  we never actually get here.  the callers don't delete things
@@ -161,50 +395,337 @@ void assoc_delete(struct default_engine *engine, uint32_t hash, const char *key,
     assert(*before != 0);
 }
 
+/*
+ * Walk the buckets of a slice in a table, but for the ones whose low bits
+ * (first_mask) are below first: those were moved to the primary table.
+ */
+static void assoc_walk_table(struct default_engine *engine, item_ref *table,
+                             unsigned int power, uint32_t first,
+                             uint32_t first_mask, uint32_t slice,
+                             ASSOC_WALKFUNC fn, void *cookie) {
+    for (uint64_t bucket = slice; bucket < hashsize(power);
+         bucket += ASSOC_SLICES) {
+        if ((bucket & first_mask) < first) {
+            /* Moved to the primary table */
+            continue;
+        }
+        hash_item *it, *next;
+        for (it = item_deref(engine, table[bucket]); it != NULL; it = next) {
+            next = item_deref(engine, it->h_next);
+            fn(engine, it, cookie);
+        }
+    }
+}
 
+void assoc_walk_slice(struct default_engine *engine, uint32_t slice,
+                      ASSOC_WALKFUNC fn, void *cookie) {
+    /* The old buckets of the slice can't move while we hold its lock, so
+     * the old table is still there if one of them is left */
+    if (engine->assoc.expanding) {
+        unsigned int power = assoc_old_power(engine);
+        unsigned int moved = engine->assoc.shrinking ?
+            engine->assoc.hashpower : power;
+        assoc_walk_table(engine, engine->assoc.old_hashtable, power,
+                         engine->assoc.expand_bucket, hashmask(moved),
+                         slice, fn, cookie);
+    }
+    assoc_walk_table(engine, engine->assoc.primary_hashtable,
+                     engine->assoc.hashpower, 0, 0, slice, fn, cookie);
+}
 
-#define DEFAULT_HASH_BULK_MOVE 1
-int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
 
-static void *assoc_maintenance_thread(void *arg) {
-    struct default_engine *engine = arg;
-    bool done = false;
-    do {
-        int ii;
-        pthread_mutex_lock(&engine->cache_lock);
-
-        for (ii = 0; ii < hash_bulk_move && engine->assoc.expanding; ++ii) {
-            hash_item *it, *next;
-            int bucket;
-
-            for (it = engine->assoc.old_hashtable[engine->assoc.expand_bucket];
-                 NULL != it; it = next) {
-                next = it->h_next;
-
-                bucket = engine->server.core->hash(item_get_key(it), it->nkey, 0)
-                    & hashmask(engine->assoc.hashpower);
-                it->h_next = engine->assoc.primary_hashtable[bucket];
-                engine->assoc.primary_hashtable[bucket] = it;
-            }
 
-            engine->assoc.old_hashtable[engine->assoc.expand_bucket] = NULL;
-            engine->assoc.expand_bucket++;
-            if (engine->assoc.expand_bucket == hashsize(engine->assoc.hashpower - 1)) {
-                engine->assoc.expanding = false;
-                free(engine->assoc.old_hashtable);
-                if (engine->config.verbose > 1) {
-                    EXTENSION_LOGGER_DESCRIPTOR *logger;
-                    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-                    logger->log(EXTENSION_LOG_INFO, NULL,
-                                "Hash table expansion done\n");
-                }
-            }
+/* The number of steps of the current move (see expand_bucket) */
+static inline uint32_t assoc_move_buckets(struct default_engine *engine) {
+    return engine->assoc.shrinking ?
+        hashsize(engine->assoc.hashpower) : hashsize(engine->assoc.hashpower - 1);
+}
+
+/*
+ * When we shrink the table the items of the old buckets b and
+ * b + hashsize(hashpower) go to the bucket b of the new table. They
+ * share the low bits of the hash value, so the item lock of b protects
+ * all three (we never shrink below the table we started with: it has at
+ * least as many buckets as there are lock stripes).
+ */
+static void assoc_merge_next_bucket(struct default_engine *engine) {
+    unsigned int bucket = engine->assoc.expand_bucket;
+    item_ref *old = engine->assoc.old_hashtable;
+
+    for (int ii = 0; ii < 2; ++ii) {
+        unsigned int oldbucket = bucket + ii * hashsize(engine->assoc.hashpower);
+        hash_item *it, *next;
+        for (it = item_deref(engine, old[oldbucket]); it != NULL; it = next) {
+            next = item_deref(engine, it->h_next);
+            it->h_next = engine->assoc.primary_hashtable[bucket];
+            engine->assoc.primary_hashtable[bucket] = item_ref_of(engine, it);
+        }
+        old[oldbucket] = 0;
+    }
+}
+
+/*
+ * Move the items in the next old bucket over to the primary table. The
+ * caller holds the item lock for the bucket. All of the items in an old
+ * bucket share the low bits of the hash value, so they are protected by
+ * the same item lock (and so are the two buckets in the new table we
+ * move them to).
+ */
+static void assoc_split_next_bucket(struct default_engine *engine) {
+    hash_item *it, *next;
+    int bucket;
+    unsigned int oldbucket = engine->assoc.expand_bucket;
+
+    for (it = item_deref(engine, engine->assoc.old_hashtable[oldbucket]);
+         NULL != it; it = next) {
+        next = item_deref(engine, it->h_next);
+
+        uint32_t hash;
+        if (engine->assoc.next_filter == NULL && engine->assoc.hashpower > 24) {
+            /* The bit picking the new bucket is in the tag (and the
+             * others are the ones of the old bucket), so we don't have
+             * to hash the key */
+            hash = ((uint32_t)it->hash_tag << 24) | oldbucket;
+        } else {
+            hash = engine->server.core->hash(item_get_key(it), it->nkey, 0);
+        }
+        bucket = hash & hashmask(engine->assoc.hashpower);
+        it->h_next = engine->assoc.primary_hashtable[bucket];
+        engine->assoc.primary_hashtable[bucket] = item_ref_of(engine, it);
+        assoc_filter_update(engine->assoc.next_filter, hash, true);
+    }
+
+    engine->assoc.old_hashtable[oldbucket] = 0;
+}
+
+/* Move the next bucket. Returns false when the move is complete. */
+static bool assoc_move_next_bucket(struct default_engine *engine) {
+    if (engine->assoc.shrinking) {
+        assoc_merge_next_bucket(engine);
+    } else {
+        assoc_split_next_bucket(engine);
+    }
+
+    engine->assoc.expand_bucket++;
+    if (engine->assoc.expand_bucket == assoc_move_buckets(engine)) {
+        assoc_free_table(engine->assoc.old_hashtable,
+                         assoc_old_power(engine));
+        engine->assoc.old_hashtable = NULL;
+        engine->assoc.expanding = false;
+        engine->assoc.shrinking = false;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Migrate up to hash_bulk_move buckets. Without lock striping all of the
+ * buckets are moved while we hold the cache lock, otherwise we hold the
+ * item lock for one bucket at a time. Either way the lock is released
+ * between the steps so that the request path never waits for more than
+ * one step.
+ */
+static bool assoc_expand_step(struct default_engine *engine) {
+    size_t nbuckets = engine->config.hash_bulk_move;
+    bool more = true;
+
+    if (nbuckets == 0) {
+        nbuckets = 1;
+    }
+
+    uint32_t total = assoc_move_buckets(engine);
+    uint64_t start = assoc_time_usec();
+    if (engine->item_locks == NULL) {
+        /* item_lock() grabs the cache lock for all values */
+        item_lock(engine, 0);
+        while (more && nbuckets-- > 0) {
+            more = assoc_move_next_bucket(engine);
         }
-        if (!engine->assoc.expanding) {
-            done = true;
+        item_unlock(engine, 0);
+    } else {
+        while (more && nbuckets-- > 0) {
+            unsigned int oldbucket = engine->assoc.expand_bucket;
+            item_lock(engine, oldbucket);
+            more = assoc_move_next_bucket(engine);
+            item_unlock(engine, oldbucket);
         }
-        pthread_mutex_unlock(&engine->cache_lock);
-    } while (!done);
+    }
+
+    uint64_t elapsed = assoc_time_usec() - start;
+    MEMCACHED_ASSOC_EXPAND_STEP(engine->assoc.expand_bucket, total,
+                                (int)elapsed);
+    engine->assoc.expand_steps++;
+    engine->assoc.step_usec_last = elapsed;
+    if (elapsed > engine->assoc.step_usec_max) {
+        engine->assoc.step_usec_max = elapsed;
+    }
+    return more;
+}
+
+static void *assoc_maintenance_thread(void *arg) {
+    struct default_engine *engine = arg;
+    uint64_t start = assoc_time_usec();
+
+    engine->server.core->place_background_thread();
 
+    /* Allocate the new table without holding any locks */
+    item_ref *table = assoc_alloc_table(engine, engine->assoc.hashpower + 1);
+    struct assoc_filter *filter = NULL;
+    if (table != NULL && engine->assoc.filter != NULL &&
+        (filter = assoc_filter_alloc(engine->assoc.hashpower + 1)) == NULL) {
+        assoc_free_table(table, engine->assoc.hashpower + 1);
+        table = NULL;
+    }
+    if (table == NULL) {
+        /* Bad news, but we can keep running. */
+        engine->assoc.expand_pending = 0;
+        return NULL;
+    }
+
+    /* Nobody looks at the filter from the previous expansion anymore */
+    assoc_filter_free(engine->assoc.retired_filter);
+    engine->assoc.retired_filter = NULL;
+
+    item_lock_all(engine);
+    engine->assoc.next_filter = filter;
+    engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
+    engine->assoc.primary_hashtable = table;
+    engine->assoc.hashpower++;
+    engine->assoc.expand_bucket = 0;
+    engine->assoc.expanding = true;
+    item_unlock_all(engine);
+    MEMCACHED_ASSOC_EXPAND_START(engine->assoc.hashpower);
+
+    while (assoc_expand_step(engine)) {
+        /* Let the front end threads get the lock(s) between each step */
+    }
+
+    if (filter != NULL) {
+        /* The new filter has all of the items now */
+        item_lock_all(engine);
+        engine->assoc.retired_filter = engine->assoc.filter;
+        engine->assoc.filter = filter;
+        engine->assoc.next_filter = NULL;
+        item_unlock_all(engine);
+    }
+
+    engine->assoc.expansions++;
+    engine->assoc.expand_usec_last = assoc_time_usec() - start;
+    MEMCACHED_ASSOC_EXPAND_DONE(engine->assoc.hashpower,
+                                (int)engine->assoc.expand_usec_last);
+    if (engine->config.verbose > 1) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "Hash table expansion done (%"PRIu64" usec)\n",
+                    engine->assoc.expand_usec_last);
+    }
+
+    engine->assoc.expand_pending = 0;
     return NULL;
 }
+
+/*
+ * Shrink the table to the previous power of 2, like an expansion the
+ * other way around. The filter is kept as it is: it's sized for the
+ * bigger table, which only makes it better at what it does.
+ */
+static void *assoc_shrink_thread(void *arg) {
+    struct default_engine *engine = arg;
+    uint64_t start = assoc_time_usec();
+
+    engine->server.core->place_background_thread();
+
+    item_ref *table = assoc_alloc_table(engine, engine->assoc.hashpower - 1);
+    if (table == NULL) {
+        engine->assoc.expand_pending = 0;
+        return NULL;
+    }
+
+    item_lock_all(engine);
+    engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
+    engine->assoc.primary_hashtable = table;
+    engine->assoc.hashpower--;
+    engine->assoc.expand_bucket = 0;
+    engine->assoc.shrinking = true;
+    engine->assoc.expanding = true;
+    item_unlock_all(engine);
+
+    while (assoc_expand_step(engine)) {
+        /* Let the front end threads get the lock(s) between each step */
+    }
+
+    engine->assoc.shrinks++;
+    engine->assoc.expand_usec_last = assoc_time_usec() - start;
+    if (engine->config.verbose > 1) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "Hash table shrink done (%"PRIu64" usec)\n",
+                    engine->assoc.expand_usec_last);
+    }
+
+    engine->assoc.expand_pending = 0;
+    return NULL;
+}
+
+void assoc_stats(struct default_engine *engine,
+                 ADD_STAT add_stats, const void *cookie) {
+    size_t bytes = hashsize(engine->assoc.hashpower) * sizeof(item_ref);
+    bool expanding = engine->assoc.expanding;
+    bool shrinking = expanding && engine->assoc.shrinking;
+    if (expanding) {
+        bytes += hashsize(assoc_old_power(engine)) * sizeof(item_ref);
+    }
+
+    add_statistics(cookie, add_stats, NULL, -1, "hash_power_level", "%u",
+                   engine->assoc.hashpower);
+    add_statistics(cookie, add_stats, NULL, -1, "hash_bytes", "%zu", bytes);
+    add_statistics(cookie, add_stats, NULL, -1, "hash_items", "%u",
+                   engine->assoc.hash_items);
+    add_statistics(cookie, add_stats, NULL, -1, "hash_huge_pages", "%s",
+                   engine->assoc.huge_pages ? "true" : "false");
+    add_statistics(cookie, add_stats, NULL, -1, "hash_is_expanding", "%s",
+                   expanding && !shrinking ? "true" : "false");
+    if (engine->config.hash_shrink_delay != 0) {
+        add_statistics(cookie, add_stats, NULL, -1, "hash_is_shrinking", "%s",
+                       shrinking ? "true" : "false");
+    }
+    if (expanding) {
+        add_statistics(cookie, add_stats, NULL, -1, "hash_expand_bucket",
+                       "%u", engine->assoc.expand_bucket);
+        add_statistics(cookie, add_stats, NULL, -1, "hash_expand_buckets",
+                       "%u", assoc_move_buckets(engine));
+    }
+    if (engine->assoc.filter != NULL) {
+        uint64_t negatives = engine->assoc.filter_negatives;
+        uint64_t false_positives = engine->assoc.filter_false_positives;
+        add_statistics(cookie, add_stats, NULL, -1, "hash_filter_bytes",
+                       "%zu", (size_t)engine->assoc.filter->mask + 1);
+        add_statistics(cookie, add_stats, NULL, -1, "hash_filter_negatives",
+                       "%"PRIu64, negatives);
+        add_statistics(cookie, add_stats, NULL, -1,
+                       "hash_filter_false_positives", "%"PRIu64,
+                       false_positives);
+        if (negatives + false_positives != 0) {
+            add_statistics(cookie, add_stats, NULL, -1,
+                           "hash_filter_false_positive_rate", "%.4f",
+                           (double)false_positives /
+                           (negatives + false_positives));
+        }
+    }
+    add_statistics(cookie, add_stats, NULL, -1, "hash_expansions", "%"PRIu64,
+                   engine->assoc.expansions);
+    add_statistics(cookie, add_stats, NULL, -1, "hash_expand_steps", "%"PRIu64,
+                   engine->assoc.expand_steps);
+    add_statistics(cookie, add_stats, NULL, -1, "hash_expand_step_last_usec",
+                   "%"PRIu64, engine->assoc.step_usec_last);
+    add_statistics(cookie, add_stats, NULL, -1, "hash_expand_step_max_usec",
+                   "%"PRIu64, engine->assoc.step_usec_max);
+    add_statistics(cookie, add_stats, NULL, -1, "hash_expand_last_usec",
+                   "%"PRIu64, engine->assoc.expand_usec_last);
+    if (engine->config.hash_shrink_delay != 0) {
+        add_statistics(cookie, add_stats, NULL, -1, "hash_shrinks", "%"PRIu64,
+                       engine->assoc.shrinks);
+    }
+}
@@ -1,31 +1,85 @@
 #ifndef ASSOC_H
 #define ASSOC_H
 
+/*
+ * A counting Bloom filter over the hash values of the items in the hash
+ * table (if the engine is configured with bloom_filter). It lets us answer
+ * a get for a key we don't have without taking a lock.
+ */
+struct assoc_filter {
+   uint8_t *counters;
+   uint64_t mask;
+};
+
 struct assoc {
    /* how many powers of 2's worth of buckets we use */
    unsigned int hashpower;
 
 
    /* Main hash table. This is where we look except during expansion. */
-   hash_item** primary_hashtable;
+   item_ref* primary_hashtable;
 
    /*
     * Previous hash table. During expansion, we look here for keys that haven't
     * been moved over to the primary yet.
     */
-   hash_item** old_hashtable;
+   item_ref* old_hashtable;
 
    /* Number of items in the hash table. */
    unsigned int hash_items;
 
-   /* Flag: Are we in the middle of expanding now? */
+   /*
+    * Flag: Are we in the middle of moving the items to a new table? That
+    * is a bigger table unless we're shrinking (see hash_shrink_delay).
+    */
    bool expanding;
+   bool shrinking;
+
+   /* Set (atomically) while the maintenance thread is running */
+   volatile uint32_t expand_pending;
 
    /*
     * During expansion we migrate values with bucket granularity; this is how
-    * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+    * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1
+    * (0 .. hashsize(hashpower) - 1 when we shrink: the buckets of the new
+    * table, each getting two of the old ones).
     */
    unsigned int expand_bucket;
+
+   /* We never shrink the table below the size we started with */
+   unsigned int min_hashpower;
+
+   /*
+    * Set when we saw the load factor go below 1/8, with the time. It's
+    * checked (without a lock) when the items come and go.
+    */
+   bool low_load;
+   rel_time_t low_load_since;
+
+   /* Set if the kernel accepted our request to use huge pages */
+   bool huge_pages;
+
+   /*
+    * The filter for all of the items (NULL if disabled). While we expand
+    * the hash table we build the filter for the new size in next_filter
+    * as we move the buckets. The filter it replaces is kept around until
+    * the next expansion, as someone may still be looking at it.
+    */
+   struct assoc_filter *filter;
+   struct assoc_filter *next_filter;
+   struct assoc_filter *retired_filter;
+
+   /* Filter statistics. The negatives are counted without a lock. */
+   uint64_t filter_negatives;
+   uint64_t filter_false_positives;
+
+   /* Expansion statistics (reported by "stats hash") */
+   uint64_t expansions;
+   uint64_t expand_steps;
+   uint64_t step_usec_last;
+   uint64_t step_usec_max;
+   uint64_t expand_usec_last;
+   uint64_t shrinks;
 };
 
 /* associative array */
@@ -33,11 +87,39 @@ ENGINE_ERROR_CODE assoc_init(struct default_engine *engine);
 void assoc_destroy(struct default_engine *engine);
 hash_item *assoc_find(struct default_engine *engine, uint32_t hash,
                       const char *key, const size_t nkey);
+void assoc_prefetch(struct default_engine *engine, uint32_t hash);
+void assoc_prefetch_item(struct default_engine *engine, uint32_t hash);
+bool assoc_maybe_present(struct default_engine *engine, uint32_t hash);
+void assoc_filter_missed(struct default_engine *engine);
 int assoc_insert(struct default_engine *engine, uint32_t hash,
                  hash_item *item);
 void assoc_delete(struct default_engine *engine, uint32_t hash,
                   const char *key, const size_t nkey);
+
+/*
+ * The hash table is walked a slice at a time: the items of slice n are
+ * in the buckets whose number has n in the low bits, so they all share
+ * those bits of their hash value and item_lock(engine, n) protects them
+ * (there are never more lock stripes than slices).
+ */
+#define ASSOC_SLICES (1 << 16)
+
+typedef void (*ASSOC_WALKFUNC)(struct default_engine *engine,
+                               hash_item *it, void *cookie);
+
+/*
+ * Call fn for every item of a slice (in both tables while we expand).
+ * The caller holds item_lock(engine, slice), and fn may unlink the item
+ * it is given. Walking the slices from 0 to ASSOC_SLICES - 1 visits all
+ * of the items once, unless a table of fewer than ASSOC_SLICES buckets
+ * grows in the meantime (see assoc.expansions): that moves items to
+ * another slice.
+ */
+void assoc_walk_slice(struct default_engine *engine, uint32_t slice,
+                      ASSOC_WALKFUNC fn, void *cookie);
 int start_assoc_maintenance_thread(struct default_engine *engine);
 void stop_assoc_maintenance_thread(struct default_engine *engine);
+void assoc_stats(struct default_engine *engine,
+                 ADD_STAT add_stats, const void *cookie);
 
 #endif
@@ -0,0 +1,511 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "default_engine.h"
+
+static struct checkpoint *checkpoint_create(uint64_t id) {
+    struct checkpoint *cp = calloc(1, sizeof(*cp));
+    if (cp != NULL) {
+        cp->id = id;
+        cp->refcount = 1;
+    }
+    return cp;
+}
+
+static void checkpoint_free_keys(struct checkpoint *cp) {
+    while (cp->keys != NULL) {
+        struct checkpoint_key *k = cp->keys;
+        cp->keys = k->next;
+        free(k);
+    }
+    cp->last = NULL;
+    cp->nkeys = 0;
+}
+
+void checkpoint_release(struct checkpoint *cp) {
+    if (ATOMIC_DECR(&cp->refcount) == 0) {
+        checkpoint_free_keys(cp);
+        free(cp);
+    }
+}
+
+/* Get the log of a vbucket, and create it if it isn't there yet */
+static struct checkpoint_log *checkpoint_log(struct default_engine *engine,
+                                             uint16_t vbucket, bool create) {
+    struct checkpoints *c = &engine->checkpoints;
+    struct checkpoint_log *log =
+        *(struct checkpoint_log * volatile *)&c->logs[vbucket];
+    if (log != NULL || !create) {
+        return log;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if ((log = c->logs[vbucket]) == NULL &&
+        (log = calloc(1, sizeof(*log))) != NULL) {
+        log->first = log->open = checkpoint_create((uint64_t)time(NULL) << 24);
+        if (log->open == NULL || pthread_mutex_init(&log->lock, NULL) != 0) {
+            free(log->open);
+            free(log);
+            log = NULL;
+        } else {
+            __sync_synchronize();
+            c->logs[vbucket] = log;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return log;
+}
+
+/* Close the open checkpoint (if we can start a new one), and drop the
+ * oldest closed ones we don't keep. Called with the log locked. */
+static void do_checkpoint_close(struct default_engine *engine,
+                                struct checkpoint_log *log) {
+    struct checkpoint *cp = checkpoint_create(log->open->id + 1);
+    if (cp == NULL) {
+        /* The open one just gets bigger */
+        return;
+    }
+    log->open->next = cp;
+    log->open = cp;
+    ++log->nclosed;
+    ++log->closed;
+
+    size_t history = engine->config.checkpoint_history;
+    while (log->nclosed > history) {
+        struct checkpoint *oldest = log->first;
+        log->first = oldest->next;
+        --log->nclosed;
+        ++log->trimmed;
+        checkpoint_release(oldest);
+    }
+}
+
+/* Drop the checkpoints of the log (called with it locked). The open one
+ * isn't sent by anyone, so we may reuse it. */
+static void do_checkpoint_reset(struct checkpoint_log *log) {
+    while (log->first != log->open) {
+        struct checkpoint *oldest = log->first;
+        log->first = oldest->next;
+        checkpoint_release(oldest);
+    }
+    checkpoint_free_keys(log->open);
+    log->open->id++;
+    log->nclosed = 0;
+    ++log->resets;
+}
+
+/* Wake the streams waiting for a change */
+static void checkpoint_wake(struct checkpoints *c) {
+    pthread_mutex_lock(&c->lock);
+    c->changed = true;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void do_checkpoint_changed(struct default_engine *engine, uint16_t vbucket,
+                           const void *key, size_t nkey) {
+    struct checkpoint_log *log = checkpoint_log(engine, vbucket, true);
+    if (log == NULL) {
+        /* Nobody streams the vbucket yet (they'd have created it) */
+        return;
+    }
+
+    pthread_mutex_lock(&log->lock);
+    struct checkpoint *cp = log->open;
+    struct checkpoint_key *last = cp->last;
+    /* A replace logs the key twice in a row */
+    if (last == NULL || last->nkey != nkey ||
+        memcmp(last->key, key, nkey) != 0) {
+        struct checkpoint_key *k = malloc(sizeof(*k) + nkey);
+        if (k == NULL) {
+            /* The clients have to backfill rather than miss the change */
+            do_checkpoint_reset(log);
+        } else {
+            k->next = NULL;
+            k->nkey = (uint16_t)nkey;
+            memcpy(k->key, key, nkey);
+            if (last == NULL) {
+                cp->keys = k;
+            } else {
+                last->next = k;
+            }
+            cp->last = k;
+            ++log->keys;
+            if (++cp->nkeys >= engine->config.checkpoint_size) {
+                do_checkpoint_close(engine, log);
+            }
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    if (engine->checkpoints.waiting) {
+        checkpoint_wake(&engine->checkpoints);
+    }
+}
+
+void checkpoint_reset(struct default_engine *engine, uint16_t vbucket) {
+    if (!engine->checkpoints.enabled) {
+        return;
+    }
+    struct checkpoint_log *log = checkpoint_log(engine, vbucket, false);
+    if (log != NULL) {
+        pthread_mutex_lock(&log->lock);
+        do_checkpoint_reset(log);
+        pthread_mutex_unlock(&log->lock);
+    }
+}
+
+void checkpoint_reset_all(struct default_engine *engine) {
+    if (!engine->checkpoints.enabled) {
+        return;
+    }
+    for (uint32_t vb = 0; vb < NUM_VBUCKETS; ++vb) {
+        checkpoint_reset(engine, (uint16_t)vb);
+    }
+}
+
+bool checkpoint_resume(struct default_engine *engine, uint16_t vbucket,
+                       uint64_t *after) {
+    struct checkpoint_log *log = checkpoint_log(engine, vbucket, true);
+    if (log == NULL) {
+        /* The first change creates it with an id after any we have */
+        *after = 0;
+        ATOMIC_ADD_64(&engine->checkpoints.backfills, 1);
+        return false;
+    }
+
+    pthread_mutex_lock(&log->lock);
+    bool ok = *after != 0 && *after + 1 >= log->first->id &&
+              *after < log->open->id;
+    if (!ok) {
+        *after = log->open->id - 1;
+    }
+    pthread_mutex_unlock(&log->lock);
+    ATOMIC_ADD_64(ok ? &engine->checkpoints.resumed :
+                  &engine->checkpoints.backfills, 1);
+    return ok;
+}
+
+struct checkpoint *checkpoint_next(struct default_engine *engine,
+                                   uint16_t vbucket, uint64_t after,
+                                   bool *trimmed) {
+    *trimmed = false;
+    struct checkpoint_log *log = checkpoint_log(engine, vbucket, false);
+    if (log == NULL) {
+        return NULL;
+    }
+
+    struct checkpoint *cp = NULL;
+    pthread_mutex_lock(&log->lock);
+    if (after + 1 < log->first->id || after >= log->open->id) {
+        *trimmed = true;
+    } else {
+        cp = log->first;
+        while (cp->id != after + 1) {
+            cp = cp->next;
+        }
+        if (cp == log->open) {
+            if (cp->nkeys > 0) {
+                do_checkpoint_close(engine, log);
+            }
+            if (cp == log->open) {
+                cp = NULL;
+            }
+        }
+        if (cp != NULL) {
+            ATOMIC_INCR(&cp->refcount);
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    return cp;
+}
+
+void checkpoint_wait(struct default_engine *engine, const void *cookie) {
+    struct checkpoints *c = &engine->checkpoints;
+    pthread_mutex_lock(&c->lock);
+    struct checkpoint_waiter *w = c->waiters;
+    while (w != NULL && w->cookie != cookie) {
+        w = w->next;
+    }
+    if (w == NULL && (w = malloc(sizeof(*w))) != NULL) {
+        w->cookie = cookie;
+        w->next = c->waiters;
+        c->waiters = w;
+        c->waiting = true;
+        engine->server.cookie->reserve(cookie);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void checkpoint_unwait(struct default_engine *engine, const void *cookie) {
+    struct checkpoints *c = &engine->checkpoints;
+    if (!c->enabled) {
+        return;
+    }
+
+    struct checkpoint_waiter *w = NULL;
+    pthread_mutex_lock(&c->lock);
+    struct checkpoint_waiter **pos = &c->waiters;
+    while (*pos != NULL && (*pos)->cookie != cookie) {
+        pos = &(*pos)->next;
+    }
+    if (*pos != NULL) {
+        w = *pos;
+        *pos = w->next;
+        c->waiting = c->waiters != NULL;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (w != NULL) {
+        engine->server.cookie->release(cookie);
+        free(w);
+    }
+}
+
+static void checkpoint_notify(struct default_engine *engine,
+                              struct checkpoint_waiter *waiters,
+                              ENGINE_ERROR_CODE status) {
+    while (waiters != NULL) {
+        struct checkpoint_waiter *w = waiters;
+        waiters = w->next;
+        ATOMIC_ADD_64(&engine->checkpoints.woken, 1);
+        engine->server.cookie->notify_io_complete(w->cookie, status);
+        engine->server.cookie->release(w->cookie);
+        free(w);
+    }
+}
+
+static void *checkpoint_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct checkpoints *c = &engine->checkpoints;
+
+    engine->server.core->place_background_thread();
+
+    pthread_mutex_lock(&c->lock);
+    while (c->running) {
+        if (c->changed && c->waiters != NULL) {
+            struct checkpoint_waiter *waiters = c->waiters;
+            c->waiters = NULL;
+            c->waiting = false;
+            c->changed = false;
+            pthread_mutex_unlock(&c->lock);
+            checkpoint_notify(engine, waiters, ENGINE_SUCCESS);
+            pthread_mutex_lock(&c->lock);
+            continue;
+        }
+        pthread_cond_wait(&c->cond, &c->lock);
+    }
+    struct checkpoint_waiter *waiters = c->waiters;
+    c->waiters = NULL;
+    c->waiting = false;
+    pthread_mutex_unlock(&c->lock);
+
+    checkpoint_notify(engine, waiters, ENGINE_DISCONNECT);
+    return NULL;
+}
+
+ENGINE_ERROR_CODE checkpoint_init(struct default_engine *engine) {
+    struct checkpoints *c = &engine->checkpoints;
+
+    if (engine->config.checkpoint_size == 0) {
+        return ENGINE_SUCCESS;
+    }
+
+    if ((c->logs = calloc(NUM_VBUCKETS, sizeof(*c->logs))) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    if (pthread_cond_init(&c->cond, NULL) != 0) {
+        abort();
+    }
+
+    c->running = true;
+    if (pthread_create(&c->thread, NULL, checkpoint_main, engine) != 0) {
+        c->running = false;
+        pthread_cond_destroy(&c->cond);
+        free(c->logs);
+        c->logs = NULL;
+        return ENGINE_FAILED;
+    }
+    c->enabled = true;
+    return ENGINE_SUCCESS;
+}
+
+void checkpoint_destroy(struct default_engine *engine) {
+    struct checkpoints *c = &engine->checkpoints;
+
+    if (!c->enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->running = false;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->thread, NULL);
+    pthread_cond_destroy(&c->cond);
+
+    for (uint32_t vb = 0; vb < NUM_VBUCKETS; ++vb) {
+        struct checkpoint_log *log = c->logs[vb];
+        if (log == NULL) {
+            continue;
+        }
+        while (log->first != NULL) {
+            struct checkpoint *cp = log->first;
+            log->first = cp->next;
+            checkpoint_release(cp);
+        }
+        pthread_mutex_destroy(&log->lock);
+        free(log);
+    }
+    free(c->logs);
+    c->logs = NULL;
+
+    while (c->cursors != NULL) {
+        struct checkpoint_cursor *cursor = c->cursors;
+        c->cursors = cursor->next;
+        free(cursor->acked);
+        free(cursor);
+    }
+    c->ncursors = 0;
+    c->enabled = false;
+}
+
+/* Called with the checkpoints lock held */
+static struct checkpoint_cursor *do_checkpoint_cursor(struct checkpoints *c,
+                                                      const void *name,
+                                                      size_t nname) {
+    struct checkpoint_cursor *cursor = c->cursors;
+    while (cursor != NULL && (cursor->nname != nname ||
+                              memcmp(cursor->name, name, nname) != 0)) {
+        cursor = cursor->next;
+    }
+    return cursor;
+}
+
+uint64_t checkpoint_acked(struct default_engine *engine, const void *name,
+                          size_t nname, uint16_t vbucket) {
+    struct checkpoints *c = &engine->checkpoints;
+    uint64_t id = 0;
+
+    pthread_mutex_lock(&c->lock);
+    struct checkpoint_cursor *cursor = do_checkpoint_cursor(c, name, nname);
+    for (uint32_t ii = 0; cursor != NULL && ii < cursor->nacked; ++ii) {
+        if (cursor->acked[ii].vbucket == vbucket) {
+            id = cursor->acked[ii].id;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return id;
+}
+
+bool checkpoint_ack(struct default_engine *engine, const void *name,
+                    size_t nname, uint16_t vbucket, uint64_t id) {
+    struct checkpoints *c = &engine->checkpoints;
+    bool ret = false;
+
+    pthread_mutex_lock(&c->lock);
+    struct checkpoint_cursor *cursor = do_checkpoint_cursor(c, name, nname);
+    if (cursor == NULL &&
+        (cursor = calloc(1, sizeof(*cursor) + nname)) != NULL) {
+        cursor->nname = nname;
+        memcpy(cursor->name, name, nname);
+        cursor->next = c->cursors;
+        c->cursors = cursor;
+        ++c->ncursors;
+    }
+
+    uint32_t ii = 0;
+    while (cursor != NULL && ii < cursor->nacked &&
+           cursor->acked[ii].vbucket != vbucket) {
+        ++ii;
+    }
+    if (cursor != NULL && ii == cursor->size) {
+        uint32_t size = cursor->size > 0 ? 2 * cursor->size : 16;
+        void *acked = realloc(cursor->acked, size * sizeof(*cursor->acked));
+        if (acked == NULL) {
+            cursor = NULL;
+        } else {
+            cursor->acked = acked;
+            cursor->size = size;
+        }
+    }
+    if (cursor != NULL) {
+        if (ii == cursor->nacked) {
+            cursor->acked[cursor->nacked++].vbucket = vbucket;
+        }
+        cursor->acked[ii].id = id;
+        ret = true;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+void checkpoint_stats(struct default_engine *engine,
+                      ADD_STAT add_stat, const void *cookie) {
+    struct checkpoints *c = &engine->checkpoints;
+    const char *prefix = "checkpoint";
+
+    add_statistics(cookie, add_stat, prefix, -1, "enabled", "%s",
+                   c->enabled ? "true" : "false");
+    if (!c->enabled) {
+        return;
+    }
+
+    uint32_t vbuckets = 0;
+    uint64_t checkpoints = 0;
+    uint64_t keys = 0;
+    uint64_t pending = 0;
+    uint64_t closed = 0;
+    uint64_t trimmed = 0;
+    uint64_t resets = 0;
+    for (uint32_t vb = 0; vb < NUM_VBUCKETS; ++vb) {
+        struct checkpoint_log *log = checkpoint_log(engine, (uint16_t)vb,
+                                                    false);
+        if (log == NULL) {
+            continue;
+        }
+        ++vbuckets;
+        pthread_mutex_lock(&log->lock);
+        for (struct checkpoint *cp = log->first; cp != NULL; cp = cp->next) {
+            ++checkpoints;
+            pending += cp->nkeys;
+        }
+        keys += log->keys;
+        closed += log->closed;
+        trimmed += log->trimmed;
+        resets += log->resets;
+        pthread_mutex_unlock(&log->lock);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    uint32_t ncursors = c->ncursors;
+    pthread_mutex_unlock(&c->lock);
+
+    add_statistics(cookie, add_stat, prefix, -1, "size", "%zu",
+                   engine->config.checkpoint_size);
+    add_statistics(cookie, add_stat, prefix, -1, "history", "%zu",
+                   engine->config.checkpoint_history);
+    add_statistics(cookie, add_stat, prefix, -1, "vbuckets", "%u", vbuckets);
+    add_statistics(cookie, add_stat, prefix, -1, "checkpoints", "%"PRIu64,
+                   checkpoints);
+    add_statistics(cookie, add_stat, prefix, -1, "keys", "%"PRIu64, pending);
+    add_statistics(cookie, add_stat, prefix, -1, "logged", "%"PRIu64, keys);
+    add_statistics(cookie, add_stat, prefix, -1, "closed", "%"PRIu64, closed);
+    add_statistics(cookie, add_stat, prefix, -1, "trimmed", "%"PRIu64,
+                   trimmed);
+    add_statistics(cookie, add_stat, prefix, -1, "resets", "%"PRIu64, resets);
+    add_statistics(cookie, add_stat, prefix, -1, "registered", "%u",
+                   ncursors);
+    add_statistics(cookie, add_stat, prefix, -1, "resumed", "%"PRIu64,
+                   c->resumed);
+    add_statistics(cookie, add_stat, prefix, -1, "backfills", "%"PRIu64,
+                   c->backfills);
+    add_statistics(cookie, add_stat, prefix, -1, "woken", "%"PRIu64,
+                   c->woken);
+}
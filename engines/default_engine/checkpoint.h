@@ -0,0 +1,223 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+/*
+ * The checkpoint log (checkpoint_size=N) lets a TAP client that comes
+ * back go on from where it was, instead of starting over with a full
+ * backfill. Every vbucket logs the keys of the items linked, unlinked or
+ * changed in place in it, cut in checkpoints of up to checkpoint_size
+ * keys. The open checkpoint is closed when it is full, or when a stream
+ * has sent everything before it, and the log keeps the last
+ * checkpoint_history closed ones.
+ *
+ * The ids of the checkpoints of a vbucket grow by one, starting from the
+ * time the log was created shifted left 24 bits, so the position of a
+ * client from before a restart is always older than anything we have.
+ * A reset (flush_all, which doesn't unlink the items one at a time, or
+ * running out of memory) drops all of the checkpoints and goes on from
+ * the next id, with the same effect.
+ *
+ * A checkpoint has just the keys: the stream sends the current value of
+ * each of them (or a deletion if it's gone), so a client that has had
+ * the checkpoints up to an id has the changes made before the next one
+ * was opened.
+ */
+
+/** A key changed in a vbucket */
+struct checkpoint_key {
+   struct checkpoint_key *next;
+   uint16_t nkey;
+   char key[];
+};
+
+struct checkpoint {
+   /** The next (newer) checkpoint of the vbucket */
+   struct checkpoint *next;
+   uint64_t id;
+   /** The log and every stream sending it hold a reference (atomic) */
+   uint32_t refcount;
+   uint32_t nkeys;
+   /** The keys in the order they changed */
+   struct checkpoint_key *keys;
+   struct checkpoint_key *last;
+};
+
+/**
+ * The log of a vbucket: first is the oldest checkpoint (closed unless
+ * it's the open one), and open is the last one
+ */
+struct checkpoint_log {
+   pthread_mutex_t lock;
+   struct checkpoint *first;
+   struct checkpoint *open;
+   uint32_t nclosed;
+   uint64_t keys;
+   uint64_t closed;
+   uint64_t trimmed;
+   uint64_t resets;
+};
+
+/** The last checkpoint of every vbucket a registered TAP client acked */
+struct checkpoint_cursor {
+   struct checkpoint_cursor *next;
+   struct {
+      uint16_t vbucket;
+      uint64_t id;
+   } *acked;
+   uint32_t nacked;
+   uint32_t size;
+   size_t nname;
+   char name[];
+};
+
+/** A stream waiting for something to send */
+struct checkpoint_waiter {
+   struct checkpoint_waiter *next;
+   const void *cookie;
+};
+
+struct checkpoints {
+   bool enabled;
+   /** The logs of the vbuckets (created when they're first needed) */
+   struct checkpoint_log **logs;
+
+   /** Protects the fields below and the creation of the logs */
+   pthread_mutex_t lock;
+   struct checkpoint_cursor *cursors;
+   uint32_t ncursors;
+   /**
+    * The streams that have sent everything, and the thread waking them
+    * up when a vbucket changes (waiting is read without the lock)
+    */
+   struct checkpoint_waiter *waiters;
+   volatile bool waiting;
+   bool changed;
+   pthread_cond_t cond;
+   pthread_t thread;
+   bool running;
+
+   /** Statistics (updated atomically) */
+   uint64_t resumed;
+   uint64_t backfills;
+   uint64_t woken;
+};
+
+/**
+ * Allocate the logs and start the thread waking the streams (if
+ * checkpoint_size is set)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE checkpoint_init(struct default_engine *engine);
+
+/**
+ * Stop the thread and free the logs and the cursors (the streams must
+ * be gone)
+ * @param engine handle to the storage engine
+ */
+void checkpoint_destroy(struct default_engine *engine);
+
+/**
+ * Log a change to a key. Called with the item lock for the key held.
+ * @param engine handle to the storage engine
+ * @param vbucket the vbucket of the item
+ * @param key the key
+ * @param nkey the length of the key
+ */
+void do_checkpoint_changed(struct default_engine *engine, uint16_t vbucket,
+                           const void *key, size_t nkey);
+
+/**
+ * Drop the checkpoints of a vbucket, so that every client backfills it
+ * @param engine handle to the storage engine
+ * @param vbucket the vbucket
+ */
+void checkpoint_reset(struct default_engine *engine, uint16_t vbucket);
+
+/**
+ * Drop the checkpoints of all of the vbuckets
+ * @param engine handle to the storage engine
+ */
+void checkpoint_reset_all(struct default_engine *engine);
+
+/**
+ * Check if a stream can go on from a checkpoint of a vbucket
+ * @param engine handle to the storage engine
+ * @param vbucket the vbucket
+ * @param after the last checkpoint the client has (0 for none). If we
+ *              don't have all of the ones after it, it's set to the
+ *              id before the open checkpoint (what the client has once
+ *              it's backfilled).
+ * @return true if the client can go on without a backfill
+ */
+bool checkpoint_resume(struct default_engine *engine, uint16_t vbucket,
+                       uint64_t *after);
+
+/**
+ * Get the checkpoint after the one a stream sent last. The open one is
+ * closed if it's next and has keys.
+ * @param engine handle to the storage engine
+ * @param vbucket the vbucket
+ * @param after the last checkpoint sent
+ * @param trimmed set if we no longer have it (see checkpoint_resume())
+ * @return the checkpoint with a reference, or NULL if there is none
+ */
+struct checkpoint *checkpoint_next(struct default_engine *engine,
+                                   uint16_t vbucket, uint64_t after,
+                                   bool *trimmed);
+
+/**
+ * Release a reference to a checkpoint
+ * @param cp the checkpoint
+ */
+void checkpoint_release(struct checkpoint *cp);
+
+/**
+ * Wake the connection (once) when a vbucket changes. We keep a reserve
+ * on the cookie until then.
+ * @param engine handle to the storage engine
+ * @param cookie the cookie of the connection
+ */
+void checkpoint_wait(struct default_engine *engine, const void *cookie);
+
+/**
+ * Forget about a connection waiting for a change (when it goes away)
+ * @param engine handle to the storage engine
+ * @param cookie the cookie of the connection
+ */
+void checkpoint_unwait(struct default_engine *engine, const void *cookie);
+
+/**
+ * Get the last checkpoint of a vbucket a registered client acked
+ * @param engine handle to the storage engine
+ * @param name the name of the client
+ * @param nname the length of the name
+ * @param vbucket the vbucket
+ * @return the checkpoint id, 0 if the client never acked one
+ */
+uint64_t checkpoint_acked(struct default_engine *engine, const void *name,
+                          size_t nname, uint16_t vbucket);
+
+/**
+ * A registered client acked a checkpoint of a vbucket
+ * @param engine handle to the storage engine
+ * @param name the name of the client
+ * @param nname the length of the name
+ * @param vbucket the vbucket
+ * @param id the checkpoint id
+ * @return false if we failed to remember it
+ */
+bool checkpoint_ack(struct default_engine *engine, const void *name,
+                    size_t nname, uint16_t vbucket, uint64_t id);
+
+/**
+ * Get the statistics of the checkpoint logs
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void checkpoint_stats(struct default_engine *engine,
+                      ADD_STAT add_stat, const void *cookie);
+
+#endif
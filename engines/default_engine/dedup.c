@@ -0,0 +1,310 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <assert.h>
+
+#include "default_engine.h"
+
+/*
+ * We hash the values in blocks of this size, so that the hash doesn't
+ * depend on where the pieces of a chunked value start
+ */
+#define DEDUP_HASH_BLOCK 4096
+
+/* The reference count of a blob is the one of an item */
+#define DEDUP_MAX_REFS USHRT_MAX
+
+/* A position in the pieces of a value */
+struct dedup_cursor {
+    const struct iovec *iov;
+    int niov;
+    int idx;
+    size_t offset;
+};
+
+static inline struct dedup_stripe *dedup_stripe(struct default_engine *engine,
+                                                uint32_t hash) {
+    return &engine->dedup.stripes[hash % DEDUP_STRIPES];
+}
+
+static inline item_ref *dedup_bucket(struct default_engine *engine,
+                                     uint32_t hash) {
+    return &engine->dedup.buckets[hash & engine->dedup.mask];
+}
+
+/*
+ * Get up to len bytes at the cursor, pointing into the piece if they are
+ * all in one and copying them to buf if they aren't
+ */
+static const char *dedup_next(struct dedup_cursor *c, char *buf,
+                              size_t len, size_t *n) {
+    while (c->idx < c->niov && c->offset == c->iov[c->idx].iov_len) {
+        ++c->idx;
+        c->offset = 0;
+    }
+    const struct iovec *v = &c->iov[c->idx];
+    if (v->iov_len - c->offset >= len) {
+        const char *ret = (const char*)v->iov_base + c->offset;
+        c->offset += len;
+        *n = len;
+        return ret;
+    }
+
+    *n = 0;
+    while (*n < len && c->idx < c->niov) {
+        size_t chunk = c->iov[c->idx].iov_len - c->offset;
+        if (chunk > len - *n) {
+            chunk = len - *n;
+        }
+        memcpy(buf + *n, (const char*)c->iov[c->idx].iov_base + c->offset,
+               chunk);
+        *n += chunk;
+        c->offset += chunk;
+        if (c->offset == c->iov[c->idx].iov_len) {
+            ++c->idx;
+            c->offset = 0;
+        }
+    }
+    return buf;
+}
+
+uint32_t dedup_hash(struct default_engine *engine, const hash_item *it) {
+    int niov = item_get_value(engine, it, NULL, 0);
+    struct iovec iov[niov];
+    char buf[DEDUP_HASH_BLOCK];
+    struct dedup_cursor c = { .iov = iov, .niov = niov };
+    uint32_t hash = 0;
+
+    item_get_value(engine, it, iov, niov);
+    for (size_t left = it->nbytes; left > 0;) {
+        size_t n;
+        const char *block = dedup_next(&c, buf, left < sizeof(buf) ?
+                                       left : sizeof(buf), &n);
+        hash = engine->server.core->hash(block, n, hash);
+        left -= n;
+    }
+    return hash;
+}
+
+/* Do two items have the same value? */
+static bool dedup_same_value(struct default_engine *engine,
+                             const hash_item *a, const hash_item *b) {
+    if (a->nbytes != b->nbytes) {
+        return false;
+    }
+
+    int na = item_get_value(engine, a, NULL, 0);
+    int nb = item_get_value(engine, b, NULL, 0);
+    struct iovec va[na], vb[nb];
+    item_get_value(engine, a, va, na);
+    item_get_value(engine, b, vb, nb);
+
+    int ia = 0, ib = 0;
+    size_t oa = 0, ob = 0;
+    for (size_t left = a->nbytes; left > 0;) {
+        if (oa == va[ia].iov_len) {
+            ++ia;
+            oa = 0;
+            continue;
+        }
+        if (ob == vb[ib].iov_len) {
+            ++ib;
+            ob = 0;
+            continue;
+        }
+        size_t n = va[ia].iov_len - oa;
+        if (n > vb[ib].iov_len - ob) {
+            n = vb[ib].iov_len - ob;
+        }
+        if (memcmp((char*)va[ia].iov_base + oa,
+                   (char*)vb[ib].iov_base + ob, n) != 0) {
+            return false;
+        }
+        oa += n;
+        ob += n;
+        left -= n;
+    }
+    return true;
+}
+
+/* Find the blob with the value of it. Called with the stripe lock held. */
+static hash_item *dedup_find(struct default_engine *engine,
+                             struct dedup_stripe *s,
+                             const hash_item *it, uint32_t hash) {
+    hash_item *blob = item_deref(engine, *dedup_bucket(engine, hash));
+    for (; blob != NULL; blob = item_deref(engine, blob->h_next)) {
+        if (blob->flags != hash || blob->nbytes != it->nbytes ||
+            blob->refcount == DEDUP_MAX_REFS) {
+            continue;
+        }
+        if (dedup_same_value(engine, blob, it)) {
+            return blob;
+        }
+        s->collisions++;
+    }
+    return NULL;
+}
+
+/* Take a reference to a blob for an item. Called with the stripe lock held. */
+static void dedup_ref(struct dedup_stripe *s, hash_item *blob) {
+    if (blob->refcount++ > 0) {
+        s->saved += blob->nbytes;
+    }
+}
+
+hash_item *dedup_get(struct default_engine *engine, const hash_item *it,
+                     uint32_t hash) {
+    struct dedup_stripe *s = dedup_stripe(engine, hash);
+
+    pthread_mutex_lock(&s->lock);
+    hash_item *blob = dedup_find(engine, s, it, hash);
+    if (blob != NULL) {
+        dedup_ref(s, blob);
+        s->hits++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return blob;
+}
+
+hash_item *dedup_add(struct default_engine *engine, hash_item *blob) {
+    uint32_t hash = blob->flags;
+    struct dedup_stripe *s = dedup_stripe(engine, hash);
+
+    assert(blob->refcount == 0);
+    pthread_mutex_lock(&s->lock);
+    hash_item *found = dedup_find(engine, s, blob, hash);
+    if (found != NULL) {
+        dedup_ref(s, found);
+        s->hits++;
+        blob = found;
+    } else {
+        item_ref *bucket = dedup_bucket(engine, hash);
+        blob->h_next = *bucket;
+        *bucket = item_ref_of(engine, blob);
+        dedup_ref(s, blob);
+        s->misses++;
+        s->blobs++;
+        s->bytes += blob->nbytes;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return blob;
+}
+
+bool dedup_release(struct default_engine *engine, hash_item *blob) {
+    uint32_t hash = blob->flags;
+    struct dedup_stripe *s = dedup_stripe(engine, hash);
+    bool last;
+
+    pthread_mutex_lock(&s->lock);
+    assert(blob->refcount > 0);
+    if ((last = --blob->refcount == 0)) {
+        item_ref *pos = dedup_bucket(engine, hash);
+        while (item_deref(engine, *pos) != blob) {
+            pos = &item_deref(engine, *pos)->h_next;
+        }
+        *pos = blob->h_next;
+        blob->h_next = 0;
+        s->blobs--;
+        s->bytes -= blob->nbytes;
+    } else {
+        s->saved -= blob->nbytes;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return last;
+}
+
+void dedup_copied(struct default_engine *engine, const hash_item *blob) {
+    struct dedup_stripe *s = dedup_stripe(engine, blob->flags);
+    pthread_mutex_lock(&s->lock);
+    s->copies++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+ENGINE_ERROR_CODE dedup_init(struct default_engine *engine) {
+    struct dedup_store *d = &engine->dedup;
+
+    /* The rebalancer can't move the blobs out of a page (they're unlinked) */
+    if (engine->config.dedup_min == 0 || engine->config.slab_reassign) {
+        return ENGINE_SUCCESS;
+    }
+
+    /* There can't be more blobs than values of dedup_min in the cache */
+    size_t nbuckets = DEDUP_STRIPES;
+    while (nbuckets < engine->config.maxbytes / engine->config.dedup_min &&
+           nbuckets < (1 << 24)) {
+        nbuckets <<= 1;
+    }
+    if ((d->buckets = calloc(nbuckets, sizeof(item_ref))) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    d->mask = (uint32_t)(nbuckets - 1);
+    for (int ii = 0; ii < DEDUP_STRIPES; ++ii) {
+        if (pthread_mutex_init(&d->stripes[ii].lock, NULL) != 0) {
+            abort();
+        }
+    }
+    d->enabled = true;
+    return ENGINE_SUCCESS;
+}
+
+void dedup_destroy(struct default_engine *engine) {
+    struct dedup_store *d = &engine->dedup;
+
+    if (!d->enabled) {
+        return;
+    }
+    for (int ii = 0; ii < DEDUP_STRIPES; ++ii) {
+        pthread_mutex_destroy(&d->stripes[ii].lock);
+    }
+    free(d->buckets);
+    d->buckets = NULL;
+    d->enabled = false;
+}
+
+void dedup_stats(struct default_engine *engine,
+                 ADD_STAT add_stat, const void *cookie) {
+    struct dedup_store *d = &engine->dedup;
+    const char *prefix = "dedup";
+    struct dedup_stripe total;
+
+    add_statistics(cookie, add_stat, prefix, -1, "enabled", "%s",
+                   d->enabled ? "true" : "false");
+    if (!d->enabled) {
+        return;
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (int ii = 0; ii < DEDUP_STRIPES; ++ii) {
+        struct dedup_stripe *s = &d->stripes[ii];
+        pthread_mutex_lock(&s->lock);
+        total.blobs += s->blobs;
+        total.bytes += s->bytes;
+        total.saved += s->saved;
+        total.hits += s->hits;
+        total.misses += s->misses;
+        total.collisions += s->collisions;
+        total.copies += s->copies;
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    add_statistics(cookie, add_stat, prefix, -1, "min", "%zu",
+                   engine->config.dedup_min);
+    add_statistics(cookie, add_stat, prefix, -1, "blobs", "%"PRIu64,
+                   total.blobs);
+    add_statistics(cookie, add_stat, prefix, -1, "bytes", "%"PRIu64,
+                   total.bytes);
+    add_statistics(cookie, add_stat, prefix, -1, "bytes_saved", "%"PRIu64,
+                   total.saved);
+    add_statistics(cookie, add_stat, prefix, -1, "hits", "%"PRIu64,
+                   total.hits);
+    add_statistics(cookie, add_stat, prefix, -1, "misses", "%"PRIu64,
+                   total.misses);
+    add_statistics(cookie, add_stat, prefix, -1, "collisions", "%"PRIu64,
+                   total.collisions);
+    add_statistics(cookie, add_stat, prefix, -1, "copies", "%"PRIu64,
+                   total.copies);
+}
@@ -0,0 +1,120 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+/*
+ * Value deduplication (dedup_min=N): store_item() hashes the values of N
+ * bytes or more, and the items storing the same value share one copy of
+ * it, a blob. A blob is an unlinked item without a key, allocated from
+ * the slabs like any other (so it counts against the cache size), with
+ * the hash of its value in its flags and the number of items sharing it
+ * in its reference count. That's an unsigned short, so a value stored
+ * more times than that gets another blob.
+ *
+ * An item sharing a blob has ITEM_DEDUP set and the item_ref of the blob
+ * where its value would be. Its nbytes is still the size of the value,
+ * and item_get_value() hands out the pieces of the blob, so that a get
+ * sends the shared copy without copying it. A blob is never written to:
+ * what modifies a value in place (an append into the slack, a range
+ * write) writes a private copy of a deduplicated one instead.
+ *
+ * The table finding the blobs by the hash of their value is split in
+ * stripes. The lock of a stripe protects its hash chains (through the
+ * h_next of the blobs), the reference counts of its blobs and its
+ * statistics.
+ */
+
+#define DEDUP_STRIPES 64
+
+struct dedup_stripe {
+   pthread_mutex_t lock;
+   /** The blobs and the bytes of their values */
+   uint64_t blobs;
+   uint64_t bytes;
+   /** The bytes the items sharing the blobs would take on their own */
+   uint64_t saved;
+   /** The stores that found their value, and the ones that didn't */
+   uint64_t hits;
+   uint64_t misses;
+   /** Other values with the same hash we compared against */
+   uint64_t collisions;
+   /** The shared values we copied to modify them */
+   uint64_t copies;
+};
+
+struct dedup_store {
+   bool enabled;
+   /** The hash chains (a power of two, and at least DEDUP_STRIPES) */
+   item_ref *buckets;
+   uint32_t mask;
+   struct dedup_stripe stripes[DEDUP_STRIPES];
+};
+
+/**
+ * Set up the table of the blobs (if dedup_min is set)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE dedup_init(struct default_engine *engine);
+
+/**
+ * Release the table of the blobs (the blobs go with the slabs)
+ * @param engine handle to the storage engine
+ */
+void dedup_destroy(struct default_engine *engine);
+
+/**
+ * Get the hash of the value of an item
+ * @param engine handle to the storage engine
+ * @param it the item
+ */
+uint32_t dedup_hash(struct default_engine *engine, const hash_item *it);
+
+/**
+ * Look for a blob with the same value as an item, and take a reference
+ * to it
+ * @param engine handle to the storage engine
+ * @param it the item
+ * @param hash the hash of its value
+ * @return the blob, or NULL if there is none
+ */
+hash_item *dedup_get(struct default_engine *engine, const hash_item *it,
+                     uint32_t hash);
+
+/**
+ * Add a new blob (with the hash of its value in its flags) to the table
+ * and take a reference to it. If someone added one with the same value
+ * meanwhile we take a reference to that one instead, and the caller
+ * frees its own.
+ * @param engine handle to the storage engine
+ * @param blob the blob (with a reference count of zero)
+ * @return the blob in the table
+ */
+hash_item *dedup_add(struct default_engine *engine, hash_item *blob);
+
+/**
+ * Drop a reference to a blob
+ * @param engine handle to the storage engine
+ * @param blob the blob
+ * @return true if it was the last one: the blob is out of the table, and
+ *         the caller frees it
+ */
+bool dedup_release(struct default_engine *engine, hash_item *blob);
+
+/**
+ * Count a copy of a shared value made to modify it
+ * @param engine handle to the storage engine
+ * @param blob the blob we copied
+ */
+void dedup_copied(struct default_engine *engine, const hash_item *blob);
+
+/**
+ * Get the statistics of the deduplication
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void dedup_stats(struct default_engine *engine,
+                 ADD_STAT add_stat, const void *cookie);
+
+#endif
@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <sys/time.h>
 
 #include "default_engine.h"
 #include "memcached/util.h"
@@ -43,6 +44,33 @@ static ENGINE_ERROR_CODE default_get(ENGINE_HANDLE* handle,
                                      const void* key,
                                      const int nkey,
                                      uint16_t vbucket);
+static ENGINE_ERROR_CODE default_get_multi(ENGINE_HANDLE* handle,
+                                           const void* cookie,
+                                           get_multi_key *keys,
+                                           int nkeys);
+static uint64_t default_get_lease(ENGINE_HANDLE* handle,
+                                  const void* cookie,
+                                  const void* key,
+                                  const int nkey);
+static ENGINE_ERROR_CODE default_item_allocate_multi(ENGINE_HANDLE* handle,
+                                                     const void* cookie,
+                                                     allocate_multi_item *items,
+                                                     int nitems);
+static ENGINE_ERROR_CODE default_store_multi(ENGINE_HANDLE* handle,
+                                             const void* cookie,
+                                             store_multi_item *items,
+                                             int nitems);
+static ENGINE_ERROR_CODE default_mutate_range(ENGINE_HANDLE* handle,
+                                              const void* cookie,
+                                              const void* key,
+                                              const int nkey,
+                                              uint64_t *cas,
+                                              uint64_t offset,
+                                              const void* data,
+                                              uint64_t len,
+                                              uint16_t vbucket);
+static void default_get_command_handlers(ENGINE_HANDLE* handle,
+                                         ENGINE_COMMAND_HANDLER handlers[0x100]);
 static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
                   const void *cookie,
                   const char *stat_key,
@@ -93,6 +121,73 @@ static ENGINE_ERROR_CODE default_tap_notify(ENGINE_HANDLE* handle,
                                             size_t ndata,
                                             uint16_t vbucket);
 
+static int vbucket_compare(const void *a, const void *b) {
+    return (int)*(const uint16_t*)a - (int)*(const uint16_t*)b;
+}
+
+/*
+ * Set up a checkpoint stream (TAP_CONNECT_CHECKPOINT) of the vbuckets
+ * in the bitmap. The last checkpoint the client has of a vbucket is
+ * the one in the connect message, or the one it acked last time if it's
+ * a registered client.
+ */
+static bool tap_checkpoint_setup(struct default_engine *engine,
+                                 const void *cookie, uint8_t *vbuckets,
+                                 const void *client, size_t nclient,
+                                 bool registered, const uint8_t *pairs,
+                                 uint16_t npairs) {
+    int count = 0;
+    for (uint32_t vb = 0; vb < NUM_VBUCKETS; ++vb) {
+        if (vbuckets[vb / 8] & (1 << (vb % 8))) {
+            ++count;
+        }
+    }
+
+    uint16_t *list = malloc(count * sizeof(*list));
+    uint64_t *positions = calloc(count, sizeof(*positions));
+    char *name = registered ? malloc(nclient) : NULL;
+    if (list == NULL || positions == NULL || (registered && name == NULL)) {
+        goto fail;
+    }
+
+    count = 0;
+    for (uint32_t vb = 0; vb < NUM_VBUCKETS; ++vb) {
+        if (vbuckets[vb / 8] & (1 << (vb % 8))) {
+            if (registered) {
+                positions[count] = checkpoint_acked(engine, client, nclient,
+                                                    (uint16_t)vb);
+            }
+            list[count++] = (uint16_t)vb;
+        }
+    }
+    if (registered) {
+        memcpy(name, client, nclient);
+    }
+
+    /* (vbucket, checkpoint id) in network byte order */
+    for (uint16_t ii = 0; ii < npairs; ++ii, pairs += 10) {
+        uint16_t vb = (pairs[0] << 8) | pairs[1];
+        uint64_t id;
+        memcpy(&id, pairs + 2, sizeof(id));
+        uint16_t *pos = bsearch(&vb, list, count, sizeof(*list),
+                                vbucket_compare);
+        if (pos != NULL) {
+            positions[pos - list] = memcached_ntohll(id);
+        }
+    }
+
+    if (initialize_item_tap_checkpoints(engine, cookie, vbuckets, list,
+                                        positions, count, name, nclient)) {
+        return true;
+    }
+
+fail:
+    free(list);
+    free(positions);
+    free(name);
+    return false;
+}
+
 static TAP_ITERATOR default_get_tap_iterator(ENGINE_HANDLE* handle,
                                              const void* cookie,
                                              const void* client,
@@ -111,16 +206,19 @@ union vbucket_info_adapter {
     struct vbucket_info v;
 };
 
-static void set_vbucket_state(struct default_engine *e,
-                              uint16_t vbid, vbucket_state_t to) {
+void set_vbucket_state(struct default_engine *e,
+                       uint16_t vbid, vbucket_state_t to) {
     union vbucket_info_adapter vi;
     vi.c = e->vbucket_infos[vbid];
     vi.v.state = to;
     e->vbucket_infos[vbid] = vi.c;
+    if (to != vbucket_state_dead) {
+        item_vbucket_purge_cancel(e, vbid);
+    }
 }
 
-static vbucket_state_t get_vbucket_state(struct default_engine *e,
-                                         uint16_t vbid) {
+vbucket_state_t get_vbucket_state(struct default_engine *e,
+                                  uint16_t vbid) {
     union vbucket_info_adapter vi;
     vi.c = e->vbucket_infos[vbid];
     return vi.v.state;
@@ -136,6 +234,7 @@ static bool handled_vbucket(struct default_engine *e, uint16_t vbid) {
 
 static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
                           const item* item, item_info *item_info);
+static const item_layout *default_get_item_layout(ENGINE_HANDLE* handle);
 
 static const char const * vbucket_state_name(vbucket_state_t s) {
     static const char const * vbucket_states[] = {
@@ -185,7 +284,14 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
          .tap_notify = default_tap_notify,
          .get_tap_iterator = default_get_tap_iterator,
          .item_set_cas = item_set_cas,
-         .get_item_info = get_item_info
+         .get_item_info = get_item_info,
+         .get_multi = default_get_multi,
+         .get_lease = default_get_lease,
+         .allocate_multi = default_item_allocate_multi,
+         .store_multi = default_store_multi,
+         .mutate_range = default_mutate_range,
+         .get_command_handlers = default_get_command_handlers,
+         .get_item_layout = default_get_item_layout
       },
       .server = *api,
       .get_server_api = get_server_api,
@@ -210,13 +316,48 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
          .factor = 1.25,
          .chunk_size = 48,
          .item_size_max= 1024 * 1024,
+         .hash_bulk_move = 1,
+         .lru_crawler_batch = 100,
+         .lru_crawler_sleep = 100,
+         .lru_crawler_interval = 60,
+         .slab_automove_interval = 10,
+         .tap_batch = 64,
+         .ext_size = 1024 * 1024 * 1024,
+         .ext_page_size = 1024 * 1024,
+         .ext_threads = 2,
+         .ext_item_min = 512,
+         .hot_cache_threshold = 32,
+         .hot_cache_item_max = 4096,
+         .checkpoint_history = 8,
+         .snapshot_threads = 4,
        },
       .scrubber = {
          .lock = PTHREAD_MUTEX_INITIALIZER,
       },
+      .purger = {
+         .lock = PTHREAD_MUTEX_INITIALIZER,
+      },
       .tap_connections = {
          .lock = PTHREAD_MUTEX_INITIALIZER,
-         .size = 10,
+         .takeover_lock = PTHREAD_MUTEX_INITIALIZER,
+      },
+      .compression = {
+         .lock = PTHREAD_MUTEX_INITIALIZER,
+      },
+      .ext = {
+         .lock = PTHREAD_MUTEX_INITIALIZER,
+      },
+      .hot = {
+         .lock = PTHREAD_MUTEX_INITIALIZER,
+      },
+      .leases = {
+         .lock = PTHREAD_MUTEX_INITIALIZER,
+      },
+      .checkpoints = {
+         .lock = PTHREAD_MUTEX_INITIALIZER,
+      },
+      .snapshots = {
+         .lock = PTHREAD_MUTEX_INITIALIZER,
       },
       .info.engine_info = {
            .description = "Default engine v0.1",
@@ -228,11 +369,6 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
    };
 
    *engine = default_engine;
-   engine->tap_connections.clients = calloc(default_engine.tap_connections.size, sizeof(void*));
-   if (engine->tap_connections.clients == NULL) {
-       free(engine);
-       return ENGINE_ENOMEM;
-   }
    *handle = (ENGINE_HANDLE*)&engine->engine;
    return ENGINE_SUCCESS;
 }
@@ -249,9 +385,17 @@ static const engine_info* default_get_info(ENGINE_HANDLE* handle) {
     return &get_handle(handle)->info.engine_info;
 }
 
+static uint64_t startup_time_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 static ENGINE_ERROR_CODE default_initialize(ENGINE_HANDLE* handle,
                                             const char* config_str) {
    struct default_engine* se = get_handle(handle);
+   uint64_t started = startup_time_usec();
+   uint64_t now;
 
    ENGINE_ERROR_CODE ret = initalize_configuration(se, config_str);
    if (ret != ENGINE_SUCCESS) {
@@ -263,19 +407,111 @@ static ENGINE_ERROR_CODE default_initialize(ENGINE_HANDLE* handle,
        se->info.engine_info.features[se->info.engine_info.num_features++].feature = ENGINE_FEATURE_CAS;
    }
 
+   /* Room for the biggest item with the biggest key (and some) */
+   se->stats.nsizes = (uint32_t)(se->config.item_size_max / 32 + 16);
+   se->stats.sizes = calloc(se->stats.nsizes, sizeof(*se->stats.sizes));
+   if (se->stats.sizes == NULL) {
+      return ENGINE_ENOMEM;
+   }
+
+   ret = item_locks_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   now = startup_time_usec();
    ret = assoc_init(se);
    if (ret != ENGINE_SUCCESS) {
       return ret;
    }
+   se->startup.hash_usec = startup_time_usec() - now;
 
+   now = startup_time_usec();
    ret = slabs_init(se, se->config.maxbytes, se->config.factor,
                     se->config.preallocate);
    if (ret != ENGINE_SUCCESS) {
       return ret;
    }
+   se->startup.slabs_usec = startup_time_usec() - now;
+
+   now = startup_time_usec();
+   slabs_prefault(se);
+   se->startup.prefault_usec = startup_time_usec() - now;
+
+   now = startup_time_usec();
+   ret = slabs_restore(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+   se->startup.restore_usec = startup_time_usec() - now;
+
+   item_compression_init(se);
+
+   ret = dedup_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = ext_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   now = startup_time_usec();
+   ret = snapshot_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+   se->startup.snapshot_usec = startup_time_usec() - now;
+
+   ret = hot_cache_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = lease_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = admission_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = namespace_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = checkpoint_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = item_lru_maintainer_start(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = item_ext_flusher_start(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = item_crawler_start(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = slabs_rebalancer_start(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
 
    se->server.callback->register_callback(handle, ON_DISCONNECT, default_handle_disconnect, handle);
 
+   se->startup.total_usec = startup_time_usec() - started;
    return ENGINE_SUCCESS;
 }
 
@@ -284,18 +520,40 @@ static void default_destroy(ENGINE_HANDLE* handle, const bool force) {
     struct default_engine* se = get_handle(handle);
 
     if (se->initialized) {
+        snapshot_destroy(se);
+        slabs_rebalancer_stop(se);
+        item_crawler_stop(se);
+        item_vbucket_purge_stop(se);
+        item_lru_maintainer_stop(se);
+        item_ext_flusher_stop(se);
+        /* Runs the reads still in the queue */
+        ext_destroy(se);
+        release_item_tap_walkers(se);
+        checkpoint_destroy(se);
+        hot_cache_destroy(se);
+        lease_destroy(se);
+        admission_destroy(se);
+        namespace_destroy(se);
+
         /* Destroy the association table */
         assoc_destroy(se);
 
         /* Destory the slabs cache */
         slabs_destroy(se);
+        free(se->config.memory_file);
+        free(se->config.snapshot_file);
+        free(se->config.ext_path);
+
+        item_compression_destroy(se);
+        dedup_destroy(se);
+        free(se->stats.sizes);
 
         /* Clean up the mutexes */
+        item_locks_destroy(se);
         pthread_mutex_destroy(&se->cache_lock);
         pthread_mutex_destroy(&se->stats.lock);
         pthread_mutex_destroy(&se->slabs.lock);
         se->initialized = false;
-        free(se->tap_connections.clients);
         free(se);
     }
 }
@@ -309,12 +567,7 @@ static ENGINE_ERROR_CODE default_item_allocate(ENGINE_HANDLE* handle,
                                                const int flags,
                                                const rel_time_t exptime) {
    struct default_engine* engine = get_handle(handle);
-   size_t ntotal = sizeof(hash_item) + nkey + nbytes;
-   if (engine->config.use_cas) {
-      ntotal += sizeof(uint64_t);
-   }
-   unsigned int id = slabs_clsid(engine, ntotal);
-   if (id == 0) {
+   if (!item_size_ok(engine, nkey, nbytes)) {
       return ENGINE_E2BIG;
    }
 
@@ -340,6 +593,9 @@ static ENGINE_ERROR_CODE default_item_delete(ENGINE_HANDLE* handle,
    struct default_engine* engine = get_handle(handle);
    VBUCKET_GUARD(engine, vbucket);
 
+   /* Whoever is about to put the old value back must not succeed */
+   lease_invalidate(engine, key, nkey);
+
    hash_item *it = item_get(engine, key, nkey);
    if (it == NULL) {
       return ENGINE_KEY_ENOENT;
@@ -358,7 +614,12 @@ static ENGINE_ERROR_CODE default_item_delete(ENGINE_HANDLE* handle,
 static void default_item_release(ENGINE_HANDLE* handle,
                                  const void *cookie,
                                  item* item) {
-   item_release(get_handle(handle), get_real_item(item));
+   hash_item *it = get_real_item(item);
+   if ((it->iflag & ITEM_HOTCOPY) != 0) {
+      hot_cache_release(it);
+   } else {
+      item_release(get_handle(handle), it);
+   }
 }
 
 static ENGINE_ERROR_CODE default_get(ENGINE_HANDLE* handle,
@@ -370,12 +631,81 @@ static ENGINE_ERROR_CODE default_get(ENGINE_HANDLE* handle,
    struct default_engine *engine = get_handle(handle);
    VBUCKET_GUARD(engine, vbucket);
 
-   *item = item_get(engine, key, nkey);
-   if (*item != NULL) {
-      return ENGINE_SUCCESS;
+   hash_item *it;
+   uint32_t hv = engine->server.core->hash(key, nkey, 0);
+   if (engine->admission.enabled) {
+      admission_record(engine, hv);
+   }
+   if (engine->hot.enabled) {
+      if ((it = hot_cache_get(engine, key, nkey, hv)) != NULL) {
+         *item = it;
+         return ENGINE_SUCCESS;
+      }
+      if ((it = item_get_hv(engine, key, nkey, hv)) != NULL) {
+         hot_cache_count(engine, it, hv);
+      }
    } else {
+      it = item_get_hv(engine, key, nkey, hv);
+   }
+   if (it == NULL && engine->leases.enabled) {
+      ENGINE_ERROR_CODE ret = item_lease_miss(engine, cookie, key, nkey, hv,
+                                              &it);
+      if (ret != ENGINE_SUCCESS) {
+         *item = NULL;
+         return ret;
+      }
+   }
+   if (it == NULL) {
+      *item = NULL;
       return ENGINE_KEY_ENOENT;
    }
+   if ((it->iflag & ITEM_EXTERNAL) != 0) {
+      *item = NULL;
+      return item_ext_get(engine, it, cookie);
+   }
+   if ((*item = item_decompress(engine, it, cookie)) == NULL) {
+      return ENGINE_ENOMEM;
+   }
+   return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE default_get_multi(ENGINE_HANDLE* handle,
+                                           const void* cookie,
+                                           get_multi_key *keys,
+                                           int nkeys) {
+   struct default_engine *engine = get_handle(handle);
+
+   for (int ii = 0; ii < nkeys; ++ii) {
+      keys[ii].item = NULL;
+      if (handled_vbucket(engine, keys[ii].vbucket)) {
+         keys[ii].status = ENGINE_SUCCESS;
+      } else {
+         keys[ii].status = ENGINE_NOT_MY_VBUCKET;
+      }
+   }
+
+   item_get_multi(engine, keys, nkeys);
+   for (int ii = 0; ii < nkeys; ++ii) {
+      if (keys[ii].status == ENGINE_SUCCESS &&
+          (get_real_item(keys[ii].item)->iflag & ITEM_EXTERNAL) != 0) {
+         /* The core fetches it with get() */
+         item_release(engine, keys[ii].item);
+         keys[ii].item = NULL;
+         keys[ii].status = ENGINE_EWOULDBLOCK;
+      } else if (keys[ii].status == ENGINE_SUCCESS &&
+          (keys[ii].item = item_decompress(engine, keys[ii].item,
+                                           cookie)) == NULL) {
+         keys[ii].status = ENGINE_ENOMEM;
+      }
+   }
+   return ENGINE_SUCCESS;
+}
+
+static uint64_t default_get_lease(ENGINE_HANDLE* handle,
+                                  const void* cookie,
+                                  const void* key,
+                                  const int nkey) {
+   return lease_get(get_handle(handle), cookie, key, nkey);
 }
 
 static void stats_vbucket(struct default_engine *e,
@@ -392,6 +722,30 @@ static void stats_vbucket(struct default_engine *e,
     }
 }
 
+static void stats_startup(struct default_engine *e,
+                          ADD_STAT add_stat,
+                          const void *cookie) {
+    char val[32];
+    int len;
+
+    len = sprintf(val, "%"PRIu64, e->startup.hash_usec);
+    add_stat("startup:hash_usec", 17, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, e->startup.slabs_usec);
+    add_stat("startup:slabs_usec", 18, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, e->startup.prefault_usec);
+    add_stat("startup:prefault_usec", 21, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, e->startup.restore_usec);
+    add_stat("startup:restore_usec", 20, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, e->startup.snapshot_usec);
+    add_stat("startup:snapshot_usec", 21, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, e->startup.total_usec);
+    add_stat("startup:total_usec", 18, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, e->startup.prefault_bytes);
+    add_stat("startup:prefault_bytes", 22, val, len, cookie);
+    len = sprintf(val, "%u", e->startup.prefault_threads);
+    add_stat("startup:prefault_threads", 24, val, len, cookie);
+}
+
 static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
                                            const void* cookie,
                                            const char* stat_key,
@@ -416,6 +770,10 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
       add_stat("bytes", 5, val, len, cookie);
       len = sprintf(val, "%"PRIu64, engine->stats.reclaimed);
       add_stat("reclaimed", 9, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->stats.append_slack);
+      add_stat("append_slack_bytes", 18, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->stats.append_in_place);
+      add_stat("append_in_place", 15, val, len, cookie);
       len = sprintf(val, "%"PRIu64, (uint64_t)engine->config.maxbytes);
       add_stat("engine_maxbytes", 15, val, len, cookie);
       pthread_mutex_unlock(&engine->stats.lock);
@@ -427,6 +785,42 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
       item_stats_sizes(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "vbucket", 7) == 0) {
       stats_vbucket(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "hash", 4) == 0) {
+      assoc_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "locks", 5) == 0) {
+      char val[128];
+      int len;
+
+      len = sprintf(val, "%zu", engine->config.lock_stripes);
+      add_stat("lock_stripes", 12, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->lock_stats.cache_lock_waits);
+      add_stat("cache_lock_waits", 16, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->lock_stats.item_lock_waits);
+      add_stat("item_lock_waits", 15, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->lock_stats.lru_lock_waits);
+      add_stat("lru_lock_waits", 14, val, len, cookie);
+   } else if (strncmp(stat_key, "crawler", 7) == 0) {
+      item_crawler_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "compression", 11) == 0) {
+      item_compression_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "dedup", 5) == 0) {
+      dedup_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "ext", 3) == 0) {
+      ext_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "hot", 3) == 0) {
+      hot_cache_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "lease", 5) == 0) {
+      lease_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "admission", 9) == 0) {
+      admission_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "namespace", 9) == 0) {
+      namespace_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "checkpoint", 10) == 0) {
+      checkpoint_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "snapshot", 8) == 0) {
+      snapshot_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "startup", 7) == 0) {
+      stats_startup(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "scrub", 5) == 0) {
       char val[128];
       int len;
@@ -451,6 +845,7 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
          add_stat("scrubber:cleaned", 16, val, len, cookie);
       }
       pthread_mutex_unlock(&engine->scrubber.lock);
+      item_vbucket_purge_stats(engine, add_stat, cookie);
    } else {
       ret = ENGINE_KEY_ENOENT;
    }
@@ -466,10 +861,65 @@ static ENGINE_ERROR_CODE default_store(ENGINE_HANDLE* handle,
                                        uint16_t vbucket) {
     struct default_engine *engine = get_handle(handle);
     VBUCKET_GUARD(engine, vbucket);
+    get_real_item(item)->vbucket = vbucket;
     return store_item(engine, get_real_item(item), cas, operation,
                       cookie);
 }
 
+static ENGINE_ERROR_CODE default_item_allocate_multi(ENGINE_HANDLE* handle,
+                                                     const void* cookie,
+                                                     allocate_multi_item *items,
+                                                     int nitems) {
+   struct default_engine *engine = get_handle(handle);
+
+   for (int ii = 0; ii < nitems; ++ii) {
+      items[ii].item = NULL;
+      if (item_size_ok(engine, items[ii].nkey, items[ii].nbytes)) {
+         items[ii].status = ENGINE_SUCCESS;
+      } else {
+         items[ii].status = ENGINE_E2BIG;
+      }
+   }
+
+   item_alloc_multi(engine, items, nitems, cookie);
+   return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE default_store_multi(ENGINE_HANDLE* handle,
+                                             const void* cookie,
+                                             store_multi_item *items,
+                                             int nitems) {
+   struct default_engine *engine = get_handle(handle);
+
+   for (int ii = 0; ii < nitems; ++ii) {
+      items[ii].cas = 0;
+      if (handled_vbucket(engine, items[ii].vbucket)) {
+         items[ii].status = ENGINE_SUCCESS;
+         get_real_item(items[ii].item)->vbucket = items[ii].vbucket;
+      } else {
+         items[ii].status = ENGINE_NOT_MY_VBUCKET;
+      }
+   }
+
+   item_store_multi(engine, items, nitems, cookie);
+   return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE default_mutate_range(ENGINE_HANDLE* handle,
+                                              const void* cookie,
+                                              const void* key,
+                                              const int nkey,
+                                              uint64_t *cas,
+                                              uint64_t offset,
+                                              const void* data,
+                                              uint64_t len,
+                                              uint16_t vbucket) {
+   struct default_engine *engine = get_handle(handle);
+   VBUCKET_GUARD(engine, vbucket);
+
+   return mutate_range(engine, cookie, key, nkey, cas, offset, data, len);
+}
+
 static ENGINE_ERROR_CODE default_arithmetic(ENGINE_HANDLE* handle,
                                             const void* cookie,
                                             const void* key,
@@ -487,12 +937,14 @@ static ENGINE_ERROR_CODE default_arithmetic(ENGINE_HANDLE* handle,
 
    return arithmetic(engine, cookie, key, nkey, increment,
                      create, delta, initial, engine->server.core->realtime(exptime), cas,
-                     result);
+                     result, vbucket);
 }
 
 static ENGINE_ERROR_CODE default_flush(ENGINE_HANDLE* handle,
                                        const void* cookie, time_t when) {
    item_flush_expired(get_handle(handle), when);
+   /* The items go without being unlinked one at a time */
+   checkpoint_reset_all(get_handle(handle));
 
    return ENGINE_SUCCESS;
 }
@@ -504,6 +956,7 @@ static void default_reset_stats(ENGINE_HANDLE* handle, const void *cookie) {
    pthread_mutex_lock(&engine->stats.lock);
    engine->stats.evictions = 0;
    engine->stats.reclaimed = 0;
+   engine->stats.append_in_place = 0;
    engine->stats.total_items = 0;
    pthread_mutex_unlock(&engine->stats.lock);
 }
@@ -531,6 +984,15 @@ static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
          { .key = "preallocate",
            .datatype = DT_BOOL,
            .value.dt_bool = &se->config.preallocate },
+         { .key = "slab_magazine_size",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.slab_magazine_size },
+         { .key = "memory_file",
+           .datatype = DT_STRING,
+           .value.dt_string = &se->config.memory_file },
+         { .key = "huge_pages",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.huge_pages },
          { .key = "factor",
            .datatype = DT_FLOAT,
            .value.dt_float = &se->config.factor },
@@ -546,6 +1008,120 @@ static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
          { .key = "vb0",
            .datatype = DT_BOOL,
            .value.dt_bool = &se->config.vb0 },
+         { .key = "lock_stripes",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.lock_stripes },
+         { .key = "hash_bulk_move",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.hash_bulk_move },
+         { .key = "hash_shrink_delay",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.hash_shrink_delay },
+         { .key = "bloom_filter",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.bloom_filter },
+         { .key = "segmented_lru",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.segmented_lru },
+         { .key = "lru_crawler",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.lru_crawler },
+         { .key = "lru_crawler_batch",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.lru_crawler_batch },
+         { .key = "lru_crawler_sleep",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.lru_crawler_sleep },
+         { .key = "lru_crawler_interval",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.lru_crawler_interval },
+         { .key = "slab_reassign",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.slab_reassign },
+         { .key = "slab_automove",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.slab_automove },
+         { .key = "slab_automove_interval",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.slab_automove_interval },
+         { .key = "slab_release",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.slab_release },
+         { .key = "shared_arena",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.shared_arena },
+         { .key = "arena_reserved",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.arena_reserved },
+         { .key = "tap_batch",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.tap_batch },
+         { .key = "slab_chunk_max",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.slab_chunk_max },
+         { .key = "compress_min",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.compress_min },
+         { .key = "dedup_min",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.dedup_min },
+         { .key = "ext_path",
+           .datatype = DT_STRING,
+           .value.dt_string = &se->config.ext_path },
+         { .key = "ext_size",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.ext_size },
+         { .key = "ext_page_size",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.ext_page_size },
+         { .key = "ext_threads",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.ext_threads },
+         { .key = "ext_item_min",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.ext_item_min },
+         { .key = "ext_item_age",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.ext_item_age },
+         { .key = "hot_cache",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.hot_cache },
+         { .key = "hot_cache_threshold",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.hot_cache_threshold },
+         { .key = "hot_cache_item_max",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.hot_cache_item_max },
+         { .key = "lease_timeout",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.lease_timeout },
+         { .key = "checkpoint_size",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.checkpoint_size },
+         { .key = "checkpoint_history",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.checkpoint_history },
+         { .key = "snapshot_file",
+           .datatype = DT_STRING,
+           .value.dt_string = &se->config.snapshot_file },
+         { .key = "snapshot_interval",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.snapshot_interval },
+         { .key = "snapshot_threads",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.snapshot_threads },
+         { .key = "prefault_threads",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.prefault_threads },
+         { .key = "append_slack",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.append_slack },
+         { .key = "admission_filter",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.admission_filter },
+         { .key = "namespaces",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.namespaces },
          { .key = "config_file",
            .datatype = DT_CONFIGFILE },
          { .key = NULL}
@@ -554,6 +1130,61 @@ static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
       ret = se->server.core->parse_config(cfg_str, items, stderr);
    }
 
+   /* We can't move pages around automatically without reassign, and
+    * the pages are given back to the shared arena (or to the system with
+    * slab_release) by the rebalancer */
+   if (se->config.slab_automove || se->config.shared_arena != 0 ||
+       se->config.slab_release) {
+       se->config.slab_reassign = true;
+   }
+
+   /* The values are split in at most ~512 chunks, so that the core can
+    * read and send them with a single iovec array */
+   if (se->config.slab_chunk_max != 0) {
+       size_t min = se->config.item_size_max / 512;
+       if (min < 16 * 1024) {
+           min = 16 * 1024;
+       }
+       if (se->config.slab_chunk_max < min) {
+           se->config.slab_chunk_max = min;
+       }
+       if (se->config.slab_chunk_max > se->config.item_size_max / 2) {
+           se->config.slab_chunk_max = se->config.item_size_max / 2;
+       }
+       se->config.slab_chunk_max -= se->config.slab_chunk_max % CHUNK_ALIGN_BYTES;
+   }
+
+   /* do_add_delta() can't look into a compressed value, so we don't
+    * compress the values that could hold a number */
+#ifdef HAVE_ZLIB_H
+   if (se->config.compress_min != 0 && se->config.compress_min < 128) {
+       se->config.compress_min = 128;
+   }
+#else
+   se->config.compress_min = 0;
+#endif
+   /* nor share them (it updates a counter in place) */
+   if (se->config.dedup_min != 0 && se->config.dedup_min < 128) {
+       se->config.dedup_min = 128;
+   }
+
+   /* The same goes for the values in the external store, and the
+    * records have to fit in a page */
+   if (se->config.ext_item_min < 128) {
+       se->config.ext_item_min = 128;
+   }
+   if (se->config.ext_page_size < 64 * 1024) {
+       se->config.ext_page_size = 64 * 1024;
+   }
+   if (se->config.ext_threads == 0) {
+       se->config.ext_threads = 1;
+   }
+
+   /* A key has to be hit at least twice to be worth a copy */
+   if (se->config.hot_cache_threshold < 2) {
+       se->config.hot_cache_threshold = 2;
+   }
+
    if (se->config.vb0) {
        set_vbucket_state(se, 0, vbucket_state_active);
    }
@@ -607,7 +1238,12 @@ static bool rm_vbucket(struct default_engine *e,
                        const void *cookie,
                        protocol_binary_request_header *req,
                        ADD_RESPONSE response) {
-    set_vbucket_state(e, ntohs(req->request.vbucket), vbucket_state_dead);
+    uint16_t vbucket = ntohs(req->request.vbucket);
+    set_vbucket_state(e, vbucket, vbucket_state_dead);
+    if (!e->config.ignore_vbucket) {
+        /* Nobody can get to its items anymore */
+        item_vbucket_purge(e, vbucket);
+    }
     return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
                     PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
 }
@@ -626,21 +1262,107 @@ static bool scrub_cmd(struct default_engine *e,
                     res, 0, cookie);
 }
 
+static bool snapshot_cmd(struct default_engine *e,
+                         const void *cookie,
+                         protocol_binary_request_header *request,
+                         ADD_RESPONSE response) {
+    protocol_binary_response_status res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    switch (snapshot_start(e)) {
+    case ENGINE_SUCCESS:
+        break;
+    case ENGINE_TMPFAIL:
+        res = PROTOCOL_BINARY_RESPONSE_EBUSY;
+        break;
+    default:
+        res = PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+    }
+
+    return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                    res, 0, cookie);
+}
+
+static bool ns_bump_cmd(struct default_engine *e,
+                        const void *cookie,
+                        const engine_command *cmd,
+                        ADD_RESPONSE response) {
+    protocol_binary_response_status res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    uint16_t generation = 0;
+    uint32_t body;
+
+    if (cmd->nkey == 0 || cmd->extlen != 0) {
+        res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+    } else {
+        switch (namespace_bump(e, cmd->key, cmd->nkey, &generation)) {
+        case ENGINE_SUCCESS:
+            break;
+        case ENGINE_ENOTSUP:
+            res = PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+            break;
+        case ENGINE_ENOMEM:
+            res = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+            break;
+        default:
+            res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+        }
+    }
+
+    if (res != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        res, 0, cookie);
+    }
+    body = htonl(generation);
+    return response(NULL, 0, NULL, 0, &body, sizeof(body),
+                    PROTOCOL_BINARY_RAW_BYTES, res, 0, cookie);
+}
+
+static bool slabs_reassign_cmd(struct default_engine *e,
+                               const void *cookie,
+                               protocol_binary_request_header *request,
+                               ADD_RESPONSE response) {
+    protocol_binary_response_status res;
+
+    if (request->request.extlen != 8 || request->request.keylen != 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    protocol_binary_request_slabs_reassign *req = (void*)request;
+    switch (slabs_reassign(e, ntohl(req->message.body.src),
+                           ntohl(req->message.body.dst))) {
+    case ENGINE_SUCCESS:
+        res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+        break;
+    case ENGINE_TMPFAIL:
+        res = PROTOCOL_BINARY_RESPONSE_EBUSY;
+        break;
+    case ENGINE_ENOTSUP:
+        res = PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+        break;
+    default:
+        res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+        break;
+    }
+
+    return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                    res, 0, cookie);
+}
+
 static bool touch(struct default_engine *e, const void *cookie,
-                  protocol_binary_request_header *request,
+                  const engine_command *cmd,
                   ADD_RESPONSE response) {
-    if (request->request.extlen != 4 || request->request.keylen == 0) {
+    protocol_binary_request_header *request = cmd->request;
+    if (cmd->extlen != 4 || cmd->nkey == 0) {
         return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
                         PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
     }
 
-    protocol_binary_request_touch *t = (void*)request;
-    void *key = t->bytes + sizeof(t->bytes);
-    uint32_t exptime = ntohl(t->message.body.expiration);
-    uint16_t nkey = ntohs(request->request.keylen);
+    uint32_t exptime;
+    memcpy(&exptime, cmd->ext, sizeof(exptime));
+    exptime = ntohl(exptime);
 
-    hash_item *item = touch_item(e, key, nkey,
-                                 e->server.core->realtime(exptime));
+    hash_item *item = touch_item_hv(e, cmd->key, cmd->nkey,
+                                    e->server.core->realtime(exptime),
+                                    cmd->hash);
     if (item == NULL) {
         if (request->request.opcode == PROTOCOL_BINARY_CMD_GATQ) {
             return true;
@@ -650,58 +1372,177 @@ static bool touch(struct default_engine *e, const void *cookie,
         }
     } else {
         bool ret;
+        if (request->request.opcode != PROTOCOL_BINARY_CMD_TOUCH &&
+            (item = item_ext_resolve(e, item, cookie)) == NULL) {
+            /* We lost the value */
+            if (request->request.opcode == PROTOCOL_BINARY_CMD_GATQ) {
+                return true;
+            }
+            return response(NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, cookie);
+        }
+        if (request->request.opcode != PROTOCOL_BINARY_CMD_TOUCH &&
+            (item = item_decompress(e, item, cookie)) == NULL) {
+            return response(NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
+        }
+
         if (request->request.opcode == PROTOCOL_BINARY_CMD_TOUCH) {
             ret = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
                            PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
-        } else {
+        } else if ((item->iflag & (ITEM_CHUNKED | ITEM_DEDUP)) == 0) {
             ret = response(NULL, 0, &item->flags, sizeof(item->flags),
                            item_get_data(item), item->nbytes,
                            PROTOCOL_BINARY_RAW_BYTES,
                            PROTOCOL_BINARY_RESPONSE_SUCCESS,
                            item_get_cas(item), cookie);
+        } else {
+            /* The response needs the value in one piece */
+            char *data = malloc(item->nbytes);
+            if (data == NULL) {
+                ret = response(NULL, 0, NULL, 0, NULL, 0,
+                               PROTOCOL_BINARY_RAW_BYTES,
+                               PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
+            } else {
+                item_value_read(e, item, 0, data, item->nbytes);
+                ret = response(NULL, 0, &item->flags, sizeof(item->flags),
+                               data, item->nbytes,
+                               PROTOCOL_BINARY_RAW_BYTES,
+                               PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                               item_get_cas(item), cookie);
+                free(data);
+            }
         }
         item_release(e, item);
         return ret;
     }
 }
 
+static ENGINE_ERROR_CODE sent_or_failed(bool sent) {
+    return sent ? ENGINE_SUCCESS : ENGINE_FAILED;
+}
+
+static ENGINE_ERROR_CODE scrub_command(ENGINE_HANDLE* handle,
+                                       const void* cookie,
+                                       const engine_command *cmd,
+                                       ADD_RESPONSE response) {
+    return sent_or_failed(scrub_cmd(get_handle(handle), cookie,
+                                    cmd->request, response));
+}
+
+static ENGINE_ERROR_CODE snapshot_command(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          const engine_command *cmd,
+                                          ADD_RESPONSE response) {
+    return sent_or_failed(snapshot_cmd(get_handle(handle), cookie,
+                                       cmd->request, response));
+}
+
+static ENGINE_ERROR_CODE ns_bump_command(ENGINE_HANDLE* handle,
+                                         const void* cookie,
+                                         const engine_command *cmd,
+                                         ADD_RESPONSE response) {
+    return sent_or_failed(ns_bump_cmd(get_handle(handle), cookie,
+                                      cmd, response));
+}
+
+static ENGINE_ERROR_CODE slabs_reassign_command(ENGINE_HANDLE* handle,
+                                                const void* cookie,
+                                                const engine_command *cmd,
+                                                ADD_RESPONSE response) {
+    return sent_or_failed(slabs_reassign_cmd(get_handle(handle), cookie,
+                                             cmd->request, response));
+}
+
+static ENGINE_ERROR_CODE rm_vbucket_command(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            const engine_command *cmd,
+                                            ADD_RESPONSE response) {
+    return sent_or_failed(rm_vbucket(get_handle(handle), cookie,
+                                     cmd->request, response));
+}
+
+static ENGINE_ERROR_CODE set_vbucket_command(ENGINE_HANDLE* handle,
+                                             const void* cookie,
+                                             const engine_command *cmd,
+                                             ADD_RESPONSE response) {
+    return sent_or_failed(set_vbucket(get_handle(handle), cookie,
+                                      (void*)cmd->request, response));
+}
+
+static ENGINE_ERROR_CODE get_vbucket_command(ENGINE_HANDLE* handle,
+                                             const void* cookie,
+                                             const engine_command *cmd,
+                                             ADD_RESPONSE response) {
+    return sent_or_failed(get_vbucket(get_handle(handle), cookie,
+                                      (void*)cmd->request, response));
+}
+
+static ENGINE_ERROR_CODE touch_command(ENGINE_HANDLE* handle,
+                                       const void* cookie,
+                                       const engine_command *cmd,
+                                       ADD_RESPONSE response) {
+    return sent_or_failed(touch(get_handle(handle), cookie, cmd, response));
+}
+
+static const ENGINE_COMMAND_HANDLER default_commands[0x100] = {
+    [PROTOCOL_BINARY_CMD_SCRUB] = scrub_command,
+    [PROTOCOL_BINARY_CMD_SLABS_REASSIGN] = slabs_reassign_command,
+    [PROTOCOL_BINARY_CMD_SNAPSHOT] = snapshot_command,
+    [PROTOCOL_BINARY_CMD_NS_BUMP] = ns_bump_command,
+    [PROTOCOL_BINARY_CMD_DEL_VBUCKET] = rm_vbucket_command,
+    [PROTOCOL_BINARY_CMD_SET_VBUCKET] = set_vbucket_command,
+    [PROTOCOL_BINARY_CMD_GET_VBUCKET] = get_vbucket_command,
+    [PROTOCOL_BINARY_CMD_TOUCH] = touch_command,
+    [PROTOCOL_BINARY_CMD_GAT] = touch_command,
+    [PROTOCOL_BINARY_CMD_GATQ] = touch_command
+};
+
+static void default_get_command_handlers(ENGINE_HANDLE* handle,
+                                         ENGINE_COMMAND_HANDLER handlers[0x100]) {
+    memcpy(handlers, default_commands, sizeof(default_commands));
+}
+
+/*
+ * The same commands for a core that doesn't use our table (it has to be
+ * taken apart here)
+ */
 static ENGINE_ERROR_CODE default_unknown_command(ENGINE_HANDLE* handle,
                                                  const void* cookie,
                                                  protocol_binary_request_header *request,
                                                  ADD_RESPONSE response)
 {
     struct default_engine* e = get_handle(handle);
-    bool sent;
-
-    switch(request->request.opcode) {
-    case PROTOCOL_BINARY_CMD_SCRUB:
-        sent = scrub_cmd(e, cookie, request, response);
-        break;
-    case PROTOCOL_BINARY_CMD_DEL_VBUCKET:
-        sent = rm_vbucket(e, cookie, request, response);
-        break;
-    case PROTOCOL_BINARY_CMD_SET_VBUCKET:
-        sent = set_vbucket(e, cookie, (void*)request, response);
-        break;
-    case PROTOCOL_BINARY_CMD_GET_VBUCKET:
-        sent = get_vbucket(e, cookie, (void*)request, response);
-        break;
-    case PROTOCOL_BINARY_CMD_TOUCH:
-    case PROTOCOL_BINARY_CMD_GAT:
-    case PROTOCOL_BINARY_CMD_GATQ:
-        sent = touch(e, cookie, request, response);
-        break;
-    default:
-        sent = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
-                        PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND, 0, cookie);
-        break;
+    ENGINE_COMMAND_HANDLER handler = default_commands[request->request.opcode];
+    uint16_t nkey = ntohs(request->request.keylen);
+    uint32_t bodylen = ntohl(request->request.bodylen);
+
+    if (handler == NULL || bodylen < (uint32_t)nkey + request->request.extlen) {
+        bool sent = response(NULL, 0, NULL, 0, NULL, 0,
+                             PROTOCOL_BINARY_RAW_BYTES,
+                             handler == NULL ?
+                             PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND :
+                             PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+        return sent_or_failed(sent);
     }
 
-    if (sent) {
-        return ENGINE_SUCCESS;
+    engine_command cmd = {
+        .request = request,
+        .ext = request->bytes + sizeof(request->bytes),
+        .extlen = request->request.extlen,
+        .nkey = nkey,
+        .nvalue = bodylen - nkey - request->request.extlen
+    };
+    cmd.key = (char*)cmd.ext + cmd.extlen;
+    cmd.value = (char*)cmd.key + cmd.nkey;
+    if (cmd.nkey == 0) {
+        cmd.key = NULL;
     } else {
-        return ENGINE_FAILED;
+        cmd.hash = e->server.core->hash(cmd.key, cmd.nkey, 0);
     }
+    return handler(handle, cookie, &cmd, response);
 }
 
 
@@ -746,7 +1587,9 @@ static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
                           const item* item, item_info *item_info)
 {
     hash_item* it = (hash_item*)item;
-    if (item_info->nvalue < 1) {
+    int nvalue = item_get_value(get_handle(handle), it, item_info->value,
+                                item_info->nvalue);
+    if (item_info->nvalue < nvalue) {
         return false;
     }
     item_info->cas = item_get_cas(it);
@@ -755,13 +1598,32 @@ static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
     item_info->flags = it->flags;
     item_info->clsid = it->slabs_clsid;
     item_info->nkey = it->nkey;
-    item_info->nvalue = 1;
+    item_info->nvalue = nvalue;
     item_info->key = item_get_key(it);
-    item_info->value[0].iov_base = item_get_data(it);
-    item_info->value[0].iov_len = it->nbytes;
     return true;
 }
 
+/*
+ * The same as get_item_info for the items the core can read by itself:
+ * only the chunked and the deduplicated ones have their value somewhere
+ * else
+ */
+static const item_layout default_item_layout = {
+    .header = sizeof(hash_item),
+    .exptime = offsetof(hash_item, exptime),
+    .nbytes = offsetof(hash_item, nbytes),
+    .flags = offsetof(hash_item, flags),
+    .nkey = offsetof(hash_item, nkey),
+    .iflag = offsetof(hash_item, iflag),
+    .clsid = offsetof(hash_item, slabs_clsid),
+    .iflag_cas = ITEM_WITH_CAS,
+    .iflag_indirect = ITEM_CHUNKED | ITEM_DEDUP
+};
+
+static const item_layout *default_get_item_layout(ENGINE_HANDLE* handle) {
+    return &default_item_layout;
+}
+
 static ENGINE_ERROR_CODE default_tap_notify(ENGINE_HANDLE* handle,
                                             const void *cookie,
                                             void *engine_specific,
@@ -785,8 +1647,8 @@ static ENGINE_ERROR_CODE default_tap_notify(ENGINE_HANDLE* handle,
 
     switch (tap_event) {
     case TAP_ACK:
-        /* We don't provide a tap stream, so we should never receive this */
-        abort();
+        /* The ends of the checkpoints we sent to a registered client */
+        return item_tap_ack(engine, cookie, tap_seqno, tap_flags);
 
     case TAP_FLUSH:
         return default_flush(handle, cookie, 0);
@@ -807,7 +1669,7 @@ static ENGINE_ERROR_CODE default_tap_notify(ENGINE_HANDLE* handle,
                 return ret;
             }
         }
-        memcpy(item_get_data(it), data, ndata);
+        item_value_write(engine, it, 0, data, ndata);
         engine->server.cookie->store_engine_specific(cookie, NULL);
         item_set_cas(handle, cookie, it, cas);
         ret = default_store(handle, cookie, it, &cas, OPERATION_SET, vbucket);
@@ -854,29 +1716,70 @@ static TAP_ITERATOR default_get_tap_iterator(ENGINE_HANDLE* handle,
                                              size_t nuserdata) {
     struct default_engine* engine = get_handle(handle);
 
-    if ((flags & TAP_CONNECT_FLAG_TAKEOVER_VBUCKETS)) { /* Not supported */
+    /* A takeover moves the vbuckets it lists */
+    bool takeover = (flags & TAP_CONNECT_FLAG_TAKEOVER_VBUCKETS) != 0;
+    if (takeover && ((flags & TAP_CONNECT_FLAG_LIST_VBUCKETS) == 0 ||
+                     engine->config.ignore_vbucket)) {
         return NULL;
     }
 
-    pthread_mutex_lock(&engine->tap_connections.lock);
-    int ii;
-    for (ii = 0; ii < engine->tap_connections.size; ++ii) {
-        if (engine->tap_connections.clients[ii] == NULL) {
-            engine->tap_connections.clients[ii] = cookie;
-            break;
+    /* A checkpoint stream goes on with the vbuckets it lists, and a
+     * registered client has a name we know it by */
+    bool checkpoint = (flags & TAP_CONNECT_CHECKPOINT) != 0;
+    bool registered = (flags & TAP_CONNECT_REGISTERED_CLIENT) != 0;
+    if ((checkpoint && (!engine->checkpoints.enabled || takeover ||
+                        (flags & TAP_CONNECT_FLAG_LIST_VBUCKETS) == 0)) ||
+        (registered && (!checkpoint || nclient == 0))) {
+        return NULL;
+    }
+
+    uint8_t *vbuckets = NULL;
+    const uint8_t *ptr = userdata;
+    size_t offset = (flags & TAP_CONNECT_FLAG_BACKFILL) ? 8 : 0;
+    if ((flags & TAP_CONNECT_FLAG_LIST_VBUCKETS)) {
+        /* The list follows the backfill date */
+        if (nuserdata < offset + 2) {
+            return NULL;
+        }
+        uint16_t num = (ptr[offset] << 8) | ptr[offset + 1];
+        offset += 2;
+        if (nuserdata < offset + 2 * (size_t)num) {
+            return NULL;
+        }
+        /* 0 means all of them */
+        if (num == 0 && (takeover || checkpoint)) {
+            return NULL;
+        }
+        if (num > 0) {
+            if ((vbuckets = calloc(1, NUM_VBUCKETS / 8)) == NULL) {
+                return NULL;
+            }
+            for (uint16_t ii = 0; ii < num; ++ii, offset += 2) {
+                uint16_t vb = (ptr[offset] << 8) | ptr[offset + 1];
+                vbuckets[vb / 8] |= 1 << (vb % 8);
+            }
         }
     }
-    pthread_mutex_unlock(&engine->tap_connections.lock);
-    if (ii == engine->tap_connections.size) {
-        // @todo allow more connections :)
-        return NULL;
+
+    if (checkpoint) {
+        /* And then the checkpoints the client has */
+        uint16_t npairs = 0;
+        if (nuserdata >= offset + 2) {
+            npairs = (ptr[offset] << 8) | ptr[offset + 1];
+            offset += 2;
+        }
+        if (nuserdata < offset + 10 * (size_t)npairs ||
+            !tap_checkpoint_setup(engine, cookie, vbuckets, client, nclient,
+                                  registered, ptr + offset, npairs)) {
+            free(vbuckets);
+            return NULL;
+        }
+        return item_tap_walker;
     }
 
-    if (!initialize_item_tap_walker(engine, cookie)) {
+    if (!initialize_item_tap_walker(engine, cookie, vbuckets, takeover)) {
         /* Failed to create */
-        pthread_mutex_lock(&engine->tap_connections.lock);
-        engine->tap_connections.clients[ii] = NULL;
-        pthread_mutex_unlock(&engine->tap_connections.lock);
+        free(vbuckets);
         return NULL;
     }
 
@@ -888,13 +1791,5 @@ static void default_handle_disconnect(const void *cookie,
                                       const void *event_data,
                                       const void *cb_data) {
     struct default_engine *engine = (struct default_engine*)cb_data;
-    pthread_mutex_lock(&engine->tap_connections.lock);
-    int ii;
-    for (ii = 0; ii < engine->tap_connections.size; ++ii) {
-        if (engine->tap_connections.clients[ii] == cookie) {
-            free(engine->server.cookie->get_engine_specific(cookie));
-            break;
-        }
-    }
-    pthread_mutex_unlock(&engine->tap_connections.lock);
+    release_item_tap_walker(engine, cookie);
 }
@@ -28,6 +28,36 @@
     harvesting it on a low memory condition. */
 #define TAIL_REPAIR_TIME (3 * 3600)
 
+/** The maximum number of item lock stripes. Each stripe must map onto a
+    fixed set of hash buckets in both the old and new table during an
+    expansion, so we can't have more stripes than the initial table has
+    buckets. */
+#define MAX_LOCK_STRIPES (1 << 16)
+
+#if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+#define ATOMIC_ADD(i, by) atomic_add_32_nv((volatile uint32_t*)(i), by)
+#define ATOMIC_ADD_64(i, by) atomic_add_64_nv((volatile uint64_t*)(i), by)
+#define ATOMIC_CAS(ptr, oldval, newval) \
+            ((oldval) == atomic_cas_32((volatile uint32_t*)(ptr), \
+                                       (oldval), (newval)))
+#define ATOMIC_CAS_8(ptr, oldval, newval) \
+            ((oldval) == atomic_cas_8((volatile uint8_t*)(ptr), \
+                                      (oldval), (newval)))
+#else
+#define ATOMIC_ADD(i, by) __sync_add_and_fetch(i, by)
+#define ATOMIC_ADD_64(i, by) __sync_add_and_fetch(i, by)
+#define ATOMIC_CAS(ptr, oldval, newval) \
+            __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define ATOMIC_CAS_8(ptr, oldval, newval) \
+            __sync_bool_compare_and_swap(ptr, oldval, newval)
+#endif
+#define ATOMIC_INCR(i) ATOMIC_ADD(i, 1)
+#define ATOMIC_DECR(i) ATOMIC_ADD(i, -1)
+
+/** The number of CAS values reserved from the global counter at a time */
+#define CAS_BLOCK_SIZE 256
+
 
 /* Forward decl */
 struct default_engine;
@@ -36,6 +66,14 @@ struct default_engine;
 #include "items.h"
 #include "assoc.h"
 #include "slabs.h"
+#include "extstore.h"
+#include "hotcache.h"
+#include "admission.h"
+#include "namespace.h"
+#include "lease.h"
+#include "checkpoint.h"
+#include "snapshot.h"
+#include "dedup.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -49,10 +87,75 @@ extern "C" {
 /* temp */
 #define ITEM_SLABBED (2<<8)
 
+/**
+ * Flag used by the segmented LRU. It is set when the item is hit, and
+ * cleared when the LRU maintainer moves the item.
+ */
+#define ITEM_ACTIVE (4<<8)
+
+/**
+ * The LRU segment the item is linked into (see enum lru_segment)
+ */
+#define ITEM_SEGMENT_SHIFT 11
+#define ITEM_SEGMENT_MASK (3<<ITEM_SEGMENT_SHIFT)
+
+/**
+ * With slab_chunk_max the values that don't fit in the largest slab
+ * class are stored in pieces (see item_get_value()). ITEM_CHUNKED is
+ * set in the header of such an item, and ITEM_CHUNK in the chunks
+ * holding the rest of its value.
+ */
+#define ITEM_CHUNKED (1<<13)
+#define ITEM_CHUNK (1<<14)
+
+/**
+ * The value of the item is compressed (see compress_min and
+ * item_decompress())
+ */
+#define ITEM_COMPRESSED (1<<15)
+
+/**
+ * The value of the item is in the external store (ext_path), and the
+ * value of the item in memory is its struct ext_loc. The core doesn't
+ * use the lower bits of the internal flags, so we can take one of them.
+ */
+#define ITEM_EXTERNAL (1<<1)
+
+/**
+ * ITEM_HOT is set on an item some thread keeps a copy of in its hot key
+ * cache (see hotcache.h), and ITEM_HOTCOPY on the copies.
+ */
+#define ITEM_HOT (1<<2)
+#define ITEM_HOTCOPY (1<<3)
+
+/**
+ * The item was allocated with room for appends (see append_slack), and
+ * the room left counts in the append_slack_bytes stat
+ */
+#define ITEM_SLACK (1<<4)
+
+/**
+ * The item is a counter: the number in its value is also stored in
+ * binary at the end of its slab chunk (see do_add_delta())
+ */
+#define ITEM_COUNTER (1<<5)
+
+/**
+ * The item shares its value with the other items storing the same one:
+ * where the value would be it has the item_ref of the blob holding it
+ * (see dedup_min and dedup.h)
+ */
+#define ITEM_DEDUP (1<<6)
+
 struct config {
    bool use_cas;
    size_t verbose;
    rel_time_t oldest_live;
+   /**
+    * The items linked before the last flush_all have an older CAS (0 if
+    * the flush was delayed, see item_flush_expired())
+    */
+   uint64_t oldest_cas;
    bool evict_to_free;
    size_t maxbytes;
    bool preallocate;
@@ -61,6 +164,47 @@ struct config {
    size_t item_size_max;
    bool ignore_vbucket;
    bool vb0;
+   size_t lock_stripes;
+   size_t hash_bulk_move;
+   size_t hash_shrink_delay;
+   bool bloom_filter;
+   bool segmented_lru;
+   bool lru_crawler;
+   size_t lru_crawler_batch;
+   size_t lru_crawler_sleep;
+   size_t lru_crawler_interval;
+   bool slab_reassign;
+   bool slab_automove;
+   size_t slab_automove_interval;
+   bool slab_release;
+   bool huge_pages;
+   size_t slab_magazine_size;
+   char *memory_file;
+   size_t shared_arena;
+   size_t arena_reserved;
+   size_t tap_batch;
+   size_t slab_chunk_max;
+   size_t compress_min;
+   size_t dedup_min;
+   char *ext_path;
+   size_t ext_size;
+   size_t ext_page_size;
+   size_t ext_threads;
+   size_t ext_item_min;
+   size_t ext_item_age;
+   size_t hot_cache;
+   size_t hot_cache_threshold;
+   size_t hot_cache_item_max;
+   size_t lease_timeout;
+   size_t checkpoint_size;
+   size_t checkpoint_history;
+   char *snapshot_file;
+   size_t snapshot_interval;
+   size_t snapshot_threads;
+   size_t append_slack;
+   bool admission_filter;
+   bool namespaces;
+   size_t prefault_threads;
 };
 
 MEMCACHED_PUBLIC_API
@@ -78,6 +222,60 @@ struct engine_stats {
    uint64_t curr_bytes;
    uint64_t curr_items;
    uint64_t total_items;
+   /* The room left for appends in the ITEM_SLACK items linked */
+   uint64_t append_slack;
+   /* The appends and prepends done in place */
+   uint64_t append_in_place;
+   /* The linked items by their total size, in 32 byte buckets */
+   unsigned int *sizes;
+   uint32_t nsizes;
+};
+
+/**
+ * How long the phases of default_initialize() took (see "stats startup")
+ */
+struct engine_startup {
+   uint64_t hash_usec;
+   /* Setting up the slab classes and allocating the arena */
+   uint64_t slabs_usec;
+   uint64_t prefault_usec;
+   /* Reattaching to a memory_file and loading a snapshot */
+   uint64_t restore_usec;
+   uint64_t snapshot_usec;
+   uint64_t total_usec;
+   /* What slabs_prefault() touched, and with how many threads */
+   uint64_t prefault_bytes;
+   unsigned int prefault_threads;
+};
+
+/**
+ * Lock contention counters. These are updated with atomic operations
+ * by whoever had to wait for a lock (the uncontended path doesn't touch
+ * them).
+ */
+struct lock_stats {
+   uint64_t cache_lock_waits;
+   uint64_t item_lock_waits;
+   uint64_t lru_lock_waits;
+};
+
+/**
+ * A range of CAS values reserved from the engine wide counter. The block
+ * is protected by the lock it is stored with.
+ */
+struct cas_block {
+   uint64_t next;
+   uint64_t end;
+};
+
+/**
+ * An item lock stripe (see item_lock() in items.c). We keep a block of
+ * CAS values with each lock so that stores in different stripes don't
+ * share a critical section (or a cache line) to get a new CAS value.
+ */
+struct item_lock {
+   pthread_mutex_t mutex;
+   struct cas_block cas;
 };
 
 struct engine_scrubber {
@@ -89,10 +287,78 @@ struct engine_scrubber {
    time_t stopped;
 };
 
+/**
+ * Statistics for the LRU crawler (per slab class)
+ */
+struct crawler_stats {
+   uint64_t visited;
+   uint64_t reclaimed;
+   uint64_t last_run_usec;
+};
+
+/**
+ * The LRU crawler walks the LRU lists in the background and reclaims
+ * the expired items (see item_crawler_start() in items.c)
+ */
+struct engine_crawler {
+   pthread_t thread;
+   volatile bool running;
+   /* Set by a flush_all to start the next crawl right away */
+   volatile bool kick;
+   hash_item *cursor;
+   uint64_t crawls;
+   struct crawler_stats stats[POWER_LARGEST];
+};
+
+/**
+ * The connections running a TAP backfill (see item_tap_walker() in
+ * items.c)
+ */
 struct tap_connections {
     pthread_mutex_t lock;
-    size_t size;
-    const void* *clients;
+    size_t count;
+    struct tap_client *clients;
+    /*
+     * The vbucket takeovers recording the changes to their vbuckets. This
+     * lock is taken with an item lock held (and the one above is held
+     * while we take item locks).
+     */
+    pthread_mutex_t takeover_lock;
+    volatile int takeovers;
+    struct tap_client *takeover_clients;
+};
+
+/**
+ * The value compression counters (per thread, see item_compress() in
+ * items.c). The slab classes are the ones of the compressed items.
+ */
+struct compression_counters {
+   uint64_t compressed;
+   uint64_t skipped;
+   uint64_t decompressed;
+   uint64_t failed;
+   uint64_t compress_samples;
+   uint64_t compress_ns;
+   uint64_t decompress_samples;
+   uint64_t decompress_ns;
+   struct {
+      uint64_t items;
+      uint64_t bytes_in;
+      uint64_t bytes_out;
+   } classes[POWER_LARGEST];
+};
+
+/**
+ * Transparent value compression (compress_min=N in the configuration).
+ * The lock protects the list of the per thread states and the totals
+ * of the threads that are gone.
+ */
+struct engine_compression {
+   pthread_mutex_t lock;
+   pthread_key_t key;
+   bool enabled;
+   struct compress_state *states;
+   struct compression_counters totals;
 };
 
 struct vbucket_info {
@@ -101,6 +367,27 @@ struct vbucket_info {
 
 #define NUM_VBUCKETS 65536
 
+void set_vbucket_state(struct default_engine *e, uint16_t vbid,
+                       vbucket_state_t to);
+vbucket_state_t get_vbucket_state(struct default_engine *e, uint16_t vbid);
+
+/**
+ * The items of the vbuckets removed with DEL_VBUCKET are reclaimed in the
+ * background (see item_vbucket_purge() in items.c). Every pass walks the
+ * hash table once for all of the vbuckets pending when it started.
+ */
+struct vbucket_purger {
+   pthread_mutex_t lock;
+   pthread_t thread;
+   /* The thread is there to join (it may be done) */
+   bool started;
+   bool running;
+   volatile bool stop;
+   uint8_t pending[NUM_VBUCKETS / 8];
+   uint64_t passes;
+   uint64_t reclaimed;
+};
+
 /**
  * Definition of the private instance data used by the default engine.
  *
@@ -121,15 +408,45 @@ struct default_engine {
    struct items items;
 
    /**
-    * The cache layer (item_* and assoc_*) is currently protected by
-    * this single mutex
+    * The cache layer (item_* and assoc_*) is protected by this single
+    * mutex unless lock striping is enabled (lock_stripes=N in the
+    * configuration). See item_lock() in items.c for the details.
     */
    pthread_mutex_t cache_lock;
 
+   /**
+    * The item lock stripes (NULL unless striping is enabled). Each
+    * stripe protects the hash chains for the buckets sharing the low
+    * bits of the hash value, and the reference counts of the items
+    * stored in them.
+    */
+   struct item_lock *item_locks;
+   uint32_t item_lock_mask;
+   struct lock_stats lock_stats;
+
+   /**
+    * The last CAS value reserved by a cas_block (updated atomically),
+    * and the block used when we run with the single cache_lock.
+    */
+   uint64_t cas_id;
+   struct cas_block cas_block;
+
    struct config config;
    struct engine_stats stats;
+   struct engine_startup startup;
    struct engine_scrubber scrubber;
+   struct vbucket_purger purger;
+   struct engine_crawler crawler;
    struct tap_connections tap_connections;
+   struct engine_compression compression;
+   struct dedup_store dedup;
+   struct ext_store ext;
+   struct hot_cache hot;
+   struct admission_filter admission;
+   struct namespaces namespaces;
+   struct lease_table leases;
+   struct checkpoints checkpoints;
+   struct snapshots snapshots;
 
    union {
        engine_info engine_info;
@@ -140,6 +457,40 @@ struct default_engine {
    char vbucket_infos[NUM_VBUCKETS];
 };
 
+/**
+ * Convert an item_ref (see items.h) to a pointer to the item
+ */
+static inline hash_item *item_deref(const struct default_engine *engine,
+                                    item_ref ref) {
+#ifdef COMPACT_ITEMS
+    if (ref == 0) {
+        return NULL;
+    }
+    return (hash_item*)((char*)engine->slabs.mem_base +
+                        (size_t)(ref - 1) * CHUNK_ALIGN_BYTES);
+#else
+    (void)engine;
+    return ref;
+#endif
+}
+
+/**
+ * Get the item_ref to use for an item
+ */
+static inline item_ref item_ref_of(const struct default_engine *engine,
+                                   const hash_item *it) {
+#ifdef COMPACT_ITEMS
+    if (it == NULL) {
+        return 0;
+    }
+    return (item_ref)(((const char*)it - (const char*)engine->slabs.mem_base) /
+                      CHUNK_ALIGN_BYTES + 1);
+#else
+    (void)engine;
+    return (item_ref)it;
+#endif
+}
+
 char* item_get_data(const hash_item* item);
 const void* item_get_key(const hash_item* item);
 void item_set_cas(ENGINE_HANDLE *handle, const void *cookie,
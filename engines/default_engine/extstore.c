@@ -0,0 +1,337 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "default_engine.h"
+
+static void ext_flush_page(struct default_engine *engine, struct ext_job *job);
+
+static void *ext_io_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct ext_store *ext = &engine->ext;
+
+    engine->server.core->place_background_thread();
+
+    pthread_mutex_lock(&ext->lock);
+    for (;;) {
+        while (ext->head == NULL && ext->running) {
+            pthread_cond_wait(&ext->cond, &ext->lock);
+        }
+        struct ext_job *job = ext->head;
+        if (job == NULL) {
+            break;
+        }
+        ext->head = job->next;
+        if (ext->head == NULL) {
+            ext->tail = NULL;
+        }
+        pthread_mutex_unlock(&ext->lock);
+        job->run(engine, job);
+        pthread_mutex_lock(&ext->lock);
+    }
+    pthread_mutex_unlock(&ext->lock);
+    return NULL;
+}
+
+static void ext_log(struct default_engine *engine, const char *msg) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+    logger->log(EXTENSION_LOG_WARNING, NULL, "%s \"%s\": %s\n", msg,
+                engine->config.ext_path, strerror(errno));
+}
+
+ENGINE_ERROR_CODE ext_init(struct default_engine *engine) {
+    struct ext_store *ext = &engine->ext;
+    size_t page_size = engine->config.ext_page_size;
+
+    if (engine->config.ext_path == NULL) {
+        return ENGINE_SUCCESS;
+    }
+
+    ext->page_size = page_size;
+    ext->npages = (uint32_t)(engine->config.ext_size / page_size);
+    if (ext->npages < 2) {
+        return ENGINE_EINVAL;
+    }
+
+    /* There is nothing for us in the file from an earlier run (only the
+     * headers in memory know where the records are) */
+    ext->fd = open(engine->config.ext_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (ext->fd == -1) {
+        ext_log(engine, "Failed to open the external store");
+        return ENGINE_FAILED;
+    }
+    if (ftruncate(ext->fd, (off_t)ext->npages * page_size) != 0) {
+        ext_log(engine, "Failed to size the external store");
+        close(ext->fd);
+        return ENGINE_FAILED;
+    }
+
+    if ((ext->versions = calloc(ext->npages, sizeof(uint32_t))) == NULL ||
+        (ext->wbuf = malloc(page_size)) == NULL ||
+        (ext->spare = malloc(page_size)) == NULL ||
+        (ext->threads = calloc(engine->config.ext_threads,
+                               sizeof(pthread_t))) == NULL) {
+        close(ext->fd);
+        free(ext->versions);
+        free(ext->wbuf);
+        free(ext->spare);
+        return ENGINE_ENOMEM;
+    }
+    ext->versions[0] = 1;
+    ext->flush.run = ext_flush_page;
+    if (pthread_cond_init(&ext->cond, NULL) != 0) {
+        abort();
+    }
+
+    ext->running = true;
+    for (size_t ii = 0; ii < engine->config.ext_threads; ++ii) {
+        if (pthread_create(&ext->threads[ii], NULL, ext_io_main, engine) != 0) {
+            break;
+        }
+        ++ext->nthreads;
+    }
+    ext->enabled = true;
+    if (ext->nthreads == 0) {
+        ext_destroy(engine);
+        return ENGINE_FAILED;
+    }
+    return ENGINE_SUCCESS;
+}
+
+void ext_destroy(struct default_engine *engine) {
+    struct ext_store *ext = &engine->ext;
+
+    if (!ext->enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&ext->lock);
+    ext->running = false;
+    pthread_cond_broadcast(&ext->cond);
+    pthread_mutex_unlock(&ext->lock);
+    for (size_t ii = 0; ii < ext->nthreads; ++ii) {
+        pthread_join(ext->threads[ii], NULL);
+    }
+
+    close(ext->fd);
+    free(ext->threads);
+    free(ext->versions);
+    free(ext->wbuf);
+    free(ext->fbuf);
+    free(ext->spare);
+    pthread_cond_destroy(&ext->cond);
+    ext->enabled = false;
+}
+
+static void do_ext_submit(struct ext_store *ext, struct ext_job *job) {
+    job->next = NULL;
+    if (ext->tail == NULL) {
+        ext->head = job;
+    } else {
+        ext->tail->next = job;
+    }
+    ext->tail = job;
+    pthread_cond_signal(&ext->cond);
+}
+
+void ext_submit(struct default_engine *engine, struct ext_job *job) {
+    pthread_mutex_lock(&engine->ext.lock);
+    do_ext_submit(&engine->ext, job);
+    pthread_mutex_unlock(&engine->ext.lock);
+}
+
+/* Write the page we sealed in ext_write() to the file */
+static void ext_flush_page(struct default_engine *engine, struct ext_job *job) {
+    struct ext_store *ext = &engine->ext;
+    off_t offset = (off_t)ext->fpage * ext->page_size;
+    size_t done = 0;
+    (void)job;
+
+    while (done < ext->page_size) {
+        ssize_t nw = pwrite(ext->fd, ext->fbuf + done, ext->page_size - done,
+                            offset + done);
+        if (nw <= 0) {
+            if (nw == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        done += nw;
+    }
+
+    pthread_mutex_lock(&ext->lock);
+    if (done == ext->page_size) {
+        ext->page_writes++;
+    } else {
+        /* The records in it are lost */
+        ext->write_errors++;
+        ext->versions[ext->fpage]++;
+    }
+    ext->spare = ext->fbuf;
+    ext->fbuf = NULL;
+    ext->flushing = false;
+    pthread_mutex_unlock(&ext->lock);
+}
+
+bool ext_write(struct default_engine *engine, const struct iovec *iov,
+               int niov, struct ext_loc *loc) {
+    struct ext_store *ext = &engine->ext;
+    size_t nbytes = 0;
+
+    for (int ii = 0; ii < niov; ++ii) {
+        nbytes += iov[ii].iov_len;
+    }
+    if (nbytes > ext->page_size) {
+        return false;
+    }
+
+    pthread_mutex_lock(&ext->lock);
+    if (ext->woffset + nbytes > ext->page_size) {
+        if (ext->flushing) {
+            ext->full++;
+            pthread_mutex_unlock(&ext->lock);
+            return false;
+        }
+
+        /* Seal the page and open the next one */
+        ext->flushing = true;
+        ext->fpage = ext->wpage;
+        ext->fbuf = ext->wbuf;
+        ext->wbuf = ext->spare;
+        ext->spare = NULL;
+        ext->wpage = (ext->wpage + 1) % ext->npages;
+        if (ext->wpage == 0) {
+            ext->wraps++;
+        }
+        ext->versions[ext->wpage]++;
+        ext->woffset = 0;
+        do_ext_submit(ext, &ext->flush);
+    }
+
+    loc->page = ext->wpage;
+    loc->version = ext->versions[ext->wpage];
+    loc->offset = (uint32_t)ext->woffset;
+    loc->nbytes = (uint32_t)nbytes;
+    for (int ii = 0; ii < niov; ++ii) {
+        memcpy(ext->wbuf + ext->woffset, iov[ii].iov_base, iov[ii].iov_len);
+        ext->woffset += iov[ii].iov_len;
+    }
+    ext->records_written++;
+    ext->bytes_written += nbytes;
+    pthread_mutex_unlock(&ext->lock);
+    return true;
+}
+
+/* Copy a record from a page in memory into iov */
+static void ext_copy(const char *page, const struct ext_loc *loc,
+                     const struct iovec *iov, int niov) {
+    const char *src = page + loc->offset;
+    for (int ii = 0; ii < niov; ++ii) {
+        memcpy(iov[ii].iov_base, src, iov[ii].iov_len);
+        src += iov[ii].iov_len;
+    }
+}
+
+bool ext_read(struct default_engine *engine, const struct ext_loc *loc,
+              const struct iovec *iov, int niov) {
+    struct ext_store *ext = &engine->ext;
+    bool ok = true;
+
+    if (loc->page >= ext->npages ||
+        loc->offset + (size_t)loc->nbytes > ext->page_size) {
+        return false;
+    }
+
+    pthread_mutex_lock(&ext->lock);
+    if (ext->versions[loc->page] != loc->version) {
+        ext->stale++;
+        pthread_mutex_unlock(&ext->lock);
+        return false;
+    }
+    if (loc->page == ext->wpage) {
+        ext_copy(ext->wbuf, loc, iov, niov);
+    } else if (ext->flushing && loc->page == ext->fpage) {
+        ext_copy(ext->fbuf, loc, iov, niov);
+    } else {
+        pthread_mutex_unlock(&ext->lock);
+
+        /* The page can't be written again before we bump its version,
+         * so the data is good if the version didn't change */
+        off_t offset = (off_t)loc->page * ext->page_size + loc->offset;
+        ssize_t nr;
+        do {
+            nr = preadv(ext->fd, iov, niov, offset);
+        } while (nr == -1 && errno == EINTR);
+
+        pthread_mutex_lock(&ext->lock);
+        if (nr != (ssize_t)loc->nbytes) {
+            ext->read_errors++;
+            ok = false;
+        } else if (ext->versions[loc->page] != loc->version) {
+            ext->stale++;
+            ok = false;
+        }
+    }
+    if (ok) {
+        ext->reads++;
+        ext->bytes_read += loc->nbytes;
+    }
+    pthread_mutex_unlock(&ext->lock);
+    return ok;
+}
+
+void ext_stats(struct default_engine *engine,
+               ADD_STAT add_stat, const void *cookie) {
+    struct ext_store *ext = &engine->ext;
+    const char *prefix = "ext";
+
+    add_statistics(cookie, add_stat, prefix, -1, "enabled", "%s",
+                   ext->enabled ? "true" : "false");
+    if (!ext->enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&ext->lock);
+    add_statistics(cookie, add_stat, prefix, -1, "page_size", "%zu",
+                   ext->page_size);
+    add_statistics(cookie, add_stat, prefix, -1, "pages", "%u",
+                   ext->npages);
+    add_statistics(cookie, add_stat, prefix, -1, "io_threads", "%zu",
+                   ext->nthreads);
+    add_statistics(cookie, add_stat, prefix, -1, "page_writes", "%"PRIu64,
+                   ext->page_writes);
+    add_statistics(cookie, add_stat, prefix, -1, "write_errors", "%"PRIu64,
+                   ext->write_errors);
+    add_statistics(cookie, add_stat, prefix, -1, "wraps", "%"PRIu64,
+                   ext->wraps);
+    add_statistics(cookie, add_stat, prefix, -1, "records_written",
+                   "%"PRIu64, ext->records_written);
+    add_statistics(cookie, add_stat, prefix, -1, "bytes_written",
+                   "%"PRIu64, ext->bytes_written);
+    add_statistics(cookie, add_stat, prefix, -1, "write_full", "%"PRIu64,
+                   ext->full);
+    add_statistics(cookie, add_stat, prefix, -1, "reads", "%"PRIu64,
+                   ext->reads);
+    add_statistics(cookie, add_stat, prefix, -1, "bytes_read", "%"PRIu64,
+                   ext->bytes_read);
+    add_statistics(cookie, add_stat, prefix, -1, "read_errors", "%"PRIu64,
+                   ext->read_errors);
+    add_statistics(cookie, add_stat, prefix, -1, "stale", "%"PRIu64,
+                   ext->stale);
+    add_statistics(cookie, add_stat, prefix, -1, "items_flushed", "%"PRIu64,
+                   ext->items_flushed);
+    add_statistics(cookie, add_stat, prefix, -1, "items_fetched", "%"PRIu64,
+                   ext->items_fetched);
+    add_statistics(cookie, add_stat, prefix, -1, "items_lost", "%"PRIu64,
+                   ext->items_lost);
+    pthread_mutex_unlock(&ext->lock);
+}
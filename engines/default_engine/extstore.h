@@ -0,0 +1,133 @@
+#ifndef EXTSTORE_H
+#define EXTSTORE_H
+
+#include <sys/uio.h>
+
+/*
+ * The external store is a log structured file (ext_path) split into
+ * pages of ext_page_size bytes. The records are appended to the page in
+ * memory, and the page is written to the file in one go (by one of the
+ * IO threads) once it is full. We wrap around to the start of the file
+ * when we reach the end of it, and every time we reopen a page we bump
+ * its version so that the records stored in it earlier become invalid.
+ */
+
+/** The location of a record in the external store */
+struct ext_loc {
+   uint32_t page;
+   uint32_t version;
+   uint32_t offset;
+   uint32_t nbytes;
+};
+
+/** A job for the IO threads */
+struct ext_job {
+   struct ext_job *next;
+   void (*run)(struct default_engine *engine, struct ext_job *job);
+};
+
+struct ext_store {
+   /** Set if the engine runs with an external store */
+   bool enabled;
+   int fd;
+   size_t page_size;
+   uint32_t npages;
+   /** The current version of every page */
+   uint32_t *versions;
+
+   /**
+    * The page we append to, the page we're writing to the file (if
+    * any) and its buffer, and a free buffer
+    */
+   uint32_t wpage;
+   size_t woffset;
+   char *wbuf;
+   bool flushing;
+   uint32_t fpage;
+   char *fbuf;
+   char *spare;
+   struct ext_job flush;
+
+   /** The IO threads and their queue */
+   pthread_t *threads;
+   size_t nthreads;
+   bool running;
+   struct ext_job *head;
+   struct ext_job *tail;
+   pthread_cond_t cond;
+
+   /** Protects everything above (but not the file descriptor) */
+   pthread_mutex_t lock;
+
+   /** Statistics (protected by the lock) */
+   uint64_t page_writes;
+   uint64_t write_errors;
+   uint64_t records_written;
+   uint64_t bytes_written;
+   uint64_t full;
+   uint64_t reads;
+   uint64_t bytes_read;
+   uint64_t read_errors;
+   uint64_t stale;
+   uint64_t wraps;
+   uint64_t items_flushed;
+   uint64_t items_fetched;
+   uint64_t items_lost;
+};
+
+/**
+ * Open the external store and start the IO threads (if ext_path is set)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE ext_init(struct default_engine *engine);
+
+/**
+ * Stop the IO threads (running the jobs left in the queue) and close
+ * the external store
+ * @param engine handle to the storage engine
+ */
+void ext_destroy(struct default_engine *engine);
+
+/**
+ * Append a record to the external store
+ * @param engine handle to the storage engine
+ * @param iov the pieces of the record
+ * @param niov the number of pieces
+ * @param loc where to store the location of the record
+ * @return false if there is no room for it right now (the page in
+ *         memory is full and we're still writing the previous one)
+ */
+bool ext_write(struct default_engine *engine, const struct iovec *iov,
+               int niov, struct ext_loc *loc);
+
+/**
+ * Read a record from the external store (from memory if it's in one of
+ * the pages we haven't written yet). This may block on the file.
+ * @param engine handle to the storage engine
+ * @param loc the location of the record
+ * @param iov where to store the record (loc->nbytes in total)
+ * @param niov the number of pieces
+ * @return false if the record was overwritten (or we failed to read it)
+ */
+bool ext_read(struct default_engine *engine, const struct ext_loc *loc,
+              const struct iovec *iov, int niov);
+
+/**
+ * Run a job on one of the IO threads
+ * @param engine handle to the storage engine
+ * @param job the job (owned by the caller)
+ */
+void ext_submit(struct default_engine *engine, struct ext_job *job);
+
+/**
+ * Get the statistics of the external store
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void ext_stats(struct default_engine *engine,
+               ADD_STAT add_stat, const void *cookie);
+
+#endif
@@ -0,0 +1,269 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "default_engine.h"
+
+/*
+ * We go back to the hash table for a copy this old, so that the LRU
+ * still sees the key as used
+ */
+#define HOT_REFRESH_INTERVAL 10
+
+/*
+ * A copy is shared by the cache of the thread and the connections that
+ * got it (which may release it from another thread)
+ */
+struct hot_copy {
+    uint64_t refcount;
+    hash_item item;
+};
+
+static inline struct hot_copy *hot_copy_of(hash_item *it) {
+    return (struct hot_copy *)((char *)it - offsetof(struct hot_copy, item));
+}
+
+void hot_cache_release(hash_item *it) {
+    struct hot_copy *copy = hot_copy_of(it);
+    if (ATOMIC_ADD_64(&copy->refcount, -1) == 0) {
+        free(copy);
+    }
+}
+
+static void hot_entry_drop(struct hot_entry *e) {
+    if (e->copy != NULL) {
+        hot_cache_release(e->copy);
+        e->copy = NULL;
+    }
+}
+
+static void hot_thread_free(struct hot_thread *t) {
+    for (size_t ii = 0; ii < t->engine->hot.nentries; ++ii) {
+        hot_entry_drop(&t->entries[ii]);
+    }
+    free(t->entries);
+    free(t);
+}
+
+/* The destructor of the thread specific data */
+static void hot_thread_exit(void *arg) {
+    struct hot_thread *t = arg;
+    struct hot_cache *hot = &t->engine->hot;
+
+    pthread_mutex_lock(&hot->lock);
+    struct hot_thread **pos = &hot->threads;
+    while (*pos != t) {
+        pos = &(*pos)->next;
+    }
+    *pos = t->next;
+    pthread_mutex_unlock(&hot->lock);
+    hot_thread_free(t);
+}
+
+ENGINE_ERROR_CODE hot_cache_init(struct default_engine *engine) {
+    struct hot_cache *hot = &engine->hot;
+
+    if (engine->config.hot_cache == 0) {
+        return ENGINE_SUCCESS;
+    }
+
+    hot->nentries = 1;
+    while (hot->nentries < engine->config.hot_cache) {
+        hot->nentries <<= 1;
+    }
+    if (pthread_key_create(&hot->key, hot_thread_exit) != 0) {
+        return ENGINE_FAILED;
+    }
+    hot->enabled = true;
+    return ENGINE_SUCCESS;
+}
+
+void hot_cache_destroy(struct default_engine *engine) {
+    struct hot_cache *hot = &engine->hot;
+
+    if (!hot->enabled) {
+        return;
+    }
+
+    /* The threads still running won't call the destructor anymore */
+    pthread_key_delete(hot->key);
+    pthread_mutex_lock(&hot->lock);
+    while (hot->threads != NULL) {
+        struct hot_thread *t = hot->threads;
+        hot->threads = t->next;
+        hot_thread_free(t);
+    }
+    pthread_mutex_unlock(&hot->lock);
+    hot->enabled = false;
+}
+
+static inline uint64_t hot_generation(struct hot_cache *hot) {
+    return *(volatile uint64_t *)&hot->generation;
+}
+
+/* Get the cache of the calling thread (with the current generation) */
+static struct hot_thread *hot_thread_get(struct default_engine *engine) {
+    struct hot_cache *hot = &engine->hot;
+    struct hot_thread *t = pthread_getspecific(hot->key);
+
+    if (t == NULL) {
+        if ((t = calloc(1, sizeof(*t))) == NULL ||
+            (t->entries = calloc(hot->nentries, sizeof(*t->entries))) == NULL) {
+            free(t);
+            return NULL;
+        }
+        t->engine = engine;
+        t->generation = hot_generation(hot);
+        if (pthread_setspecific(hot->key, t) != 0) {
+            free(t->entries);
+            free(t);
+            return NULL;
+        }
+        pthread_mutex_lock(&hot->lock);
+        t->next = hot->threads;
+        hot->threads = t;
+        pthread_mutex_unlock(&hot->lock);
+    }
+
+    uint64_t generation = hot_generation(hot);
+    if (t->generation != generation) {
+        /* Something hot was modified; we keep the hit counts so that
+         * the keys which are still read get copied again right away */
+        for (size_t ii = 0; ii < hot->nentries; ++ii) {
+            if (t->entries[ii].copy != NULL) {
+                hot_entry_drop(&t->entries[ii]);
+                t->drops++;
+            }
+        }
+        t->generation = generation;
+    }
+    return t;
+}
+
+hash_item *hot_cache_get(struct default_engine *engine,
+                         const void *key, size_t nkey, uint32_t hv) {
+    struct hot_thread *t = hot_thread_get(engine);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    struct hot_entry *e = &t->entries[hv & (engine->hot.nentries - 1)];
+    hash_item *it = e->copy;
+    if (it == NULL || e->hv != hv || it->nkey != nkey ||
+        memcmp(item_get_key(it), key, nkey) != 0) {
+        return NULL;
+    }
+
+    rel_time_t current_time = engine->server.core->get_current_time();
+    rel_time_t oldest_live = engine->config.oldest_live;
+    if ((it->exptime != 0 && it->exptime <= current_time) ||
+        (oldest_live != 0 && oldest_live <= current_time &&
+         e->filled <= oldest_live) ||
+        current_time - e->filled >= HOT_REFRESH_INTERVAL) {
+        hot_entry_drop(e);
+        return NULL;
+    }
+
+    ATOMIC_ADD_64(&hot_copy_of(it)->refcount, 1);
+    t->hits++;
+    return it;
+}
+
+void hot_cache_count(struct default_engine *engine, hash_item *it,
+                     uint32_t hv) {
+    struct hot_thread *t = hot_thread_get(engine);
+    if (t == NULL) {
+        return;
+    }
+
+    /* Every entry keeps the key with the most hits (roughly) */
+    struct hot_entry *e = &t->entries[hv & (engine->hot.nentries - 1)];
+    if (e->hv == hv && e->hits != 0) {
+        e->hits++;
+    } else if (e->hits > 1) {
+        e->hits--;
+        return;
+    } else {
+        hot_entry_drop(e);
+        e->hv = hv;
+        e->hits = 1;
+    }
+
+    if (e->copy != NULL || e->hits < engine->config.hot_cache_threshold ||
+        (it->iflag & (ITEM_CHUNKED | ITEM_COMPRESSED | ITEM_EXTERNAL |
+                      ITEM_DEDUP)) != 0 ||
+        it->nbytes > engine->config.hot_cache_item_max) {
+        return;
+    }
+
+    size_t ntotal = sizeof(hash_item) + it->nkey + it->nbytes;
+    if ((it->iflag & ITEM_WITH_CAS) != 0) {
+        ntotal += sizeof(uint64_t);
+    }
+    struct hot_copy *copy = malloc(offsetof(struct hot_copy, item) + ntotal);
+    if (copy == NULL) {
+        return;
+    }
+
+    /* The writers check ITEM_HOT with the item lock held */
+    bool linked;
+    item_lock(engine, hv);
+    if ((linked = (it->iflag & ITEM_LINKED) != 0)) {
+        it->iflag |= ITEM_HOT;
+        memcpy(&copy->item, it, ntotal);
+    }
+    item_unlock(engine, hv);
+    if (!linked) {
+        free(copy);
+        return;
+    }
+
+    copy->refcount = 1;
+    copy->item.iflag &= ~(ITEM_LINKED | ITEM_HOT);
+    copy->item.iflag |= ITEM_HOTCOPY;
+    e->copy = &copy->item;
+    e->filled = engine->server.core->get_current_time();
+    t->copies++;
+}
+
+void hot_cache_invalidate(struct default_engine *engine) {
+    if (engine->hot.enabled) {
+        ATOMIC_ADD_64(&engine->hot.generation, 1);
+    }
+}
+
+void hot_cache_stats(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie) {
+    struct hot_cache *hot = &engine->hot;
+    const char *prefix = "hot";
+    uint64_t hits = 0, copies = 0, drops = 0;
+    size_t nthreads = 0;
+
+    add_statistics(cookie, add_stat, prefix, -1, "enabled", "%s",
+                   hot->enabled ? "true" : "false");
+    if (!hot->enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&hot->lock);
+    for (struct hot_thread *t = hot->threads; t != NULL; t = t->next) {
+        hits += t->hits;
+        copies += t->copies;
+        drops += t->drops;
+        ++nthreads;
+    }
+    pthread_mutex_unlock(&hot->lock);
+
+    add_statistics(cookie, add_stat, prefix, -1, "entries", "%zu",
+                   hot->nentries);
+    add_statistics(cookie, add_stat, prefix, -1, "threads", "%zu", nthreads);
+    add_statistics(cookie, add_stat, prefix, -1, "generation", "%"PRIu64,
+                   hot_generation(hot));
+    add_statistics(cookie, add_stat, prefix, -1, "hits", "%"PRIu64, hits);
+    add_statistics(cookie, add_stat, prefix, -1, "copies", "%"PRIu64, copies);
+    add_statistics(cookie, add_stat, prefix, -1, "drops", "%"PRIu64, drops);
+}
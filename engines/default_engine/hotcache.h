@@ -0,0 +1,112 @@
+#ifndef HOTCACHE_H
+#define HOTCACHE_H
+
+/*
+ * The hot key cache (hot_cache=N) keeps a private, read only copy of the
+ * hottest items in every thread calling get(), so that a key which gets
+ * most of the traffic doesn't have every worker thread fighting over its
+ * item lock, reference count and LRU links.
+ *
+ * Every thread counts the hits on the (up to N) keys it sees most, and
+ * copies an item once it was hit hot_cache_threshold times. The shared
+ * item is flagged with ITEM_HOT, and whoever modifies an item with that
+ * flag (store, delete, touch, incr, eviction...) bumps the generation of
+ * the cache, which drops all of the copies of all of the threads. That
+ * is cheap as long as the hot keys are read mostly, which is what the
+ * cache is for.
+ */
+
+/** A key tracked by a thread */
+struct hot_entry {
+   uint32_t hv;
+   uint32_t hits;
+   /** When we made the copy */
+   rel_time_t filled;
+   hash_item *copy;
+};
+
+/** The cache of a thread */
+struct hot_thread {
+   struct default_engine *engine;
+   struct hot_thread *next;
+   /** The generation of the copies */
+   uint64_t generation;
+   struct hot_entry *entries;
+
+   /** Statistics (only updated by the thread) */
+   uint64_t hits;
+   uint64_t copies;
+   uint64_t drops;
+};
+
+struct hot_cache {
+   bool enabled;
+   pthread_key_t key;
+   /** The number of entries of every thread (a power of two) */
+   size_t nentries;
+   /** Bumped (atomically) whenever a hot item is modified */
+   uint64_t generation;
+
+   /** Protects the list of the threads */
+   pthread_mutex_t lock;
+   struct hot_thread *threads;
+};
+
+/**
+ * Set up the hot key cache (if hot_cache is set)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE hot_cache_init(struct default_engine *engine);
+
+/**
+ * Free the caches of all of the threads
+ * @param engine handle to the storage engine
+ */
+void hot_cache_destroy(struct default_engine *engine);
+
+/**
+ * Look for a key in the cache of the calling thread
+ * @param engine handle to the storage engine
+ * @param key the key
+ * @param nkey the length of the key
+ * @param hv the hash of the key
+ * @return a copy of the item (release it with hot_cache_release), or
+ *         NULL if we don't have one
+ */
+hash_item *hot_cache_get(struct default_engine *engine,
+                         const void *key, size_t nkey, uint32_t hv);
+
+/**
+ * Count a hit on an item we got from the hash table, and copy it into
+ * the cache of the calling thread if it's hot enough
+ * @param engine handle to the storage engine
+ * @param it the item (referenced by the caller)
+ * @param hv the hash of its key
+ */
+void hot_cache_count(struct default_engine *engine, hash_item *it,
+                     uint32_t hv);
+
+/**
+ * Release a copy returned by hot_cache_get (from any thread)
+ * @param it the copy
+ */
+void hot_cache_release(hash_item *it);
+
+/**
+ * Drop all of the copies (the next access of every thread does it)
+ * @param engine handle to the storage engine
+ */
+void hot_cache_invalidate(struct default_engine *engine);
+
+/**
+ * Get the statistics of the hot key cache
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void hot_cache_stats(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie);
+
+#endif
@@ -8,6 +8,13 @@
 #include <time.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
 
 #include "default_engine.h"
 
@@ -19,14 +26,23 @@ static hash_item *do_item_alloc(struct default_engine *engine,
                                 const int flags, const rel_time_t exptime,
                                 const int nbytes,
                                 const void *cookie);
-static hash_item *do_item_get(struct default_engine *engine,
-                              const char *key, const size_t nkey);
+static hash_item *do_item_get_hv(struct default_engine *engine,
+                                 const char *key, const size_t nkey,
+                                 uint32_t hv);
 static int do_item_link(struct default_engine *engine, hash_item *it);
+static int do_item_link_hv(struct default_engine *engine, hash_item *it,
+                           uint32_t hv);
 static void do_item_unlink(struct default_engine *engine, hash_item *it);
+static void do_item_unlink_internal(struct default_engine *engine,
+                                    hash_item *it, bool lru_locked);
+static void do_item_unlink_hv(struct default_engine *engine,
+                              hash_item *it, bool lru_locked, uint32_t hv);
 static void do_item_release(struct default_engine *engine, hash_item *it);
 static void do_item_update(struct default_engine *engine, hash_item *it);
 static int do_item_replace(struct default_engine *engine,
                             hash_item *it, hash_item *new_it);
+static int do_item_replace_hv(struct default_engine *engine,
+                              hash_item *it, hash_item *new_it, uint32_t hv);
 static void item_free(struct default_engine *engine, hash_item *it);
 
 /*
@@ -41,549 +57,2458 @@ static void item_free(struct default_engine *engine, hash_item *it);
  */
 static const int search_items = 50;
 
-void item_stats_reset(struct default_engine *engine) {
-    pthread_mutex_lock(&engine->cache_lock);
-    memset(engine->items.itemstats, 0, sizeof(engine->items.itemstats));
-    pthread_mutex_unlock(&engine->cache_lock);
-}
+/*
+ * The segmented LRU keeps at most this many percent of the items of a
+ * slab class in the hot and warm segments. The rest of the items are
+ * in the cold segment, which is where we look for victims.
+ */
+#define HOT_LRU_PCT 20
+#define WARM_LRU_PCT 40
 
+/*
+ * The admission filter puts at most this many percent of the items of a
+ * slab class on probation, and only while the class evicted an item in
+ * the last ADMISSION_WINDOW seconds.
+ */
+#define PROBATION_LRU_PCT 5
+#define ADMISSION_WINDOW 10
 
-/* warning: don't use these macros with a function, as it evals its arg twice */
-static inline size_t ITEM_ntotal(struct default_engine *engine,
-                                 const hash_item *item) {
-    size_t ret = sizeof(*item) + item->nkey + item->nbytes;
-    if (engine->config.use_cas) {
-        ret += sizeof(uint64_t);
-    }
+/*
+ * The LRU maintainer sleeps between the runs over the slab classes. We
+ * back off to the max sleep time if there is nothing to do.
+ */
+#define LRU_MAINTAINER_MIN_SLEEP 1000
+#define LRU_MAINTAINER_MAX_SLEEP 100000
 
-    return ret;
-}
+/* The number of keys item_get_multi hashes up front */
+#define ITEM_GET_MULTI_BATCH 64
 
-/* Get the next CAS id for a new item. */
-static uint64_t get_cas_id(void) {
-    static uint64_t cas_id = 0;
-    return ++cas_id;
+/* The number of items item_store_multi hashes (and compresses) up front */
+#define ITEM_STORE_MULTI_BATCH 32
+
+/*
+ * Locking
+ *
+ * Without lock striping everything in the cache layer (item_* and
+ * assoc_*) is protected by the cache_lock. With lock striping enabled
+ * the cache_lock is replaced by:
+ *
+ *   item_locks[hash & mask]  the hash chains, the reference counts and
+ *                            the contents of the items in the stripe
+ *   items.lru_locks[clsid]   the LRU list and the item stats of a class
+ *
+ * The locks must be acquired in the order: item lock(s), LRU lock,
+ * slabs.lock and stats.lock. The only time we need to go the other way
+ * is when we pick a victim from the tail of an LRU, and we use trylock
+ * for that (and just skip the item if its stripe is busy).
+ */
+static inline uint64_t lock_time_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-/* Enable this for reference-count debugging. */
-#if 0
-# define DEBUG_REFCNT(it,op) \
-                fprintf(stderr, "item %x refcnt(%c) %d %c%c%c\n", \
-                        it, op, it->refcount, \
-                        (it->it_flags & ITEM_LINKED) ? 'L' : ' ', \
-                        (it->it_flags & ITEM_SLABBED) ? 'S' : ' ')
-#else
-# define DEBUG_REFCNT(it,op) while(0)
-#endif
+static inline void lock_counted(pthread_mutex_t *mutex, uint64_t *waits,
+                                const char *name) {
+    if (pthread_mutex_trylock(mutex) != 0) {
+        ATOMIC_ADD_64(waits, 1);
+        if (MEMCACHED_LOCK_WAIT_ENABLED()) {
+            uint64_t start = lock_time_nsec();
+            pthread_mutex_lock(mutex);
+            MEMCACHED_LOCK_WAIT(name, mutex,
+                                (int64_t)(lock_time_nsec() - start));
+        } else {
+            pthread_mutex_lock(mutex);
+        }
+    }
+}
 
+static inline bool striped(struct default_engine *engine) {
+    return engine->item_locks != NULL;
+}
 
-/*@null@*/
-hash_item *do_item_alloc(struct default_engine *engine,
-                         const void *key,
-                         const size_t nkey,
-                         const int flags,
-                         const rel_time_t exptime,
-                         const int nbytes,
-                         const void *cookie) {
-    hash_item *it = NULL;
-    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
-    if (engine->config.use_cas) {
-        ntotal += sizeof(uint64_t);
+/*
+ * Called with the item lock held by whoever modifies an item, so that the
+ * threads drop the copies they may have of it (see hotcache.h)
+ */
+static inline void item_hot_modified(struct default_engine *engine,
+                                     hash_item *it) {
+    if ((it->iflag & ITEM_HOT) != 0) {
+        it->iflag &= ~ITEM_HOT;
+        hot_cache_invalidate(engine);
     }
+}
 
-    unsigned int id = slabs_clsid(engine, ntotal);
-    if (id == 0)
-        return 0;
+static void do_item_tap_changed(struct default_engine *engine,
+                                hash_item *it);
 
-    /* do a quick check if we have any expired items in the tail.. */
-    int tries = search_items;
-    hash_item *search;
-    rel_time_t oldest_live = engine->config.oldest_live;
-    rel_time_t current_time = engine->server.core->get_current_time();
+/*
+ * Called with the item lock held whenever an item is linked, unlinked or
+ * changed in place, so that a vbucket takeover sends the change (see
+ * item_tap_walker()) and the checkpoint log has it
+ */
+static inline void item_tap_changed(struct default_engine *engine,
+                                    hash_item *it) {
+    if (engine->checkpoints.enabled) {
+        do_checkpoint_changed(engine, it->vbucket, item_get_key(it),
+                              it->nkey);
+    }
+    if (engine->tap_connections.takeovers > 0) {
+        do_item_tap_changed(engine, it);
+    }
+}
 
-    for (search = engine->items.tails[id];
-         tries > 0 && search != NULL;
-         tries--, search=search->prev) {
-        if (search->refcount == 0 &&
-            ((search->time < oldest_live) || //dead by flush
-             (search->exptime != 0 && search->exptime < current_time))) {
-            it = search;
-            /* I don't want to actually free the object, just steal
-             * the item to avoid to grab the slab mutex twice ;-)
-             */
-            pthread_mutex_lock(&engine->stats.lock);
-            engine->stats.reclaimed++;
-            pthread_mutex_unlock(&engine->stats.lock);
-            engine->items.itemstats[id].reclaimed++;
-            it->refcount = 1;
-            slabs_adjust_mem_requested(engine, it->slabs_clsid, ITEM_ntotal(engine, it), ntotal);
-            do_item_unlink(engine, it);
-            /* Initialize the item block: */
-            it->slabs_clsid = 0;
-            it->refcount = 0;
-            break;
-        }
+static inline uint32_t item_hash(struct default_engine *engine,
+                                 const hash_item *it) {
+    return engine->server.core->hash(item_get_key(it), it->nkey, 0);
+}
+
+ENGINE_ERROR_CODE item_locks_init(struct default_engine *engine) {
+    size_t stripes = engine->config.lock_stripes;
+    if (stripes == 0) {
+        return ENGINE_SUCCESS;
     }
 
-    if (it == NULL && (it = slabs_alloc(engine, ntotal, id)) == NULL) {
-        /*
-        ** Could not find an expired item at the tail, and memory allocation
-        ** failed. Try to evict some items!
-        */
-        tries = search_items;
+    if (stripes > MAX_LOCK_STRIPES) {
+        stripes = MAX_LOCK_STRIPES;
+    }
 
-        /* If requested to not push old items out of cache when memory runs out,
-         * we're out of luck at this point...
-         */
+    size_t num = 1;
+    while (num < stripes) {
+        num <<= 1;
+    }
 
-        if (engine->config.evict_to_free == 0) {
-            engine->items.itemstats[id].outofmemory++;
-            return NULL;
-        }
+    engine->item_locks = calloc(num, sizeof(struct item_lock));
+    if (engine->item_locks == NULL) {
+        return ENGINE_ENOMEM;
+    }
 
-        /*
-         * try to get one off the right LRU
-         * don't necessariuly unlink the tail because it may be locked: refcount>0
-         * search up from tail an item with refcount==0 and unlink it; give up after search_items
-         * tries
-         */
+    for (size_t ii = 0; ii < num; ++ii) {
+        pthread_mutex_init(&engine->item_locks[ii].mutex, NULL);
+    }
+    for (int ii = 0; ii < POWER_LARGEST; ++ii) {
+        pthread_mutex_init(&engine->items.lru_locks[ii], NULL);
+    }
 
-        if (engine->items.tails[id] == 0) {
-            engine->items.itemstats[id].outofmemory++;
-            return NULL;
-        }
+    engine->item_lock_mask = (uint32_t)(num - 1);
+    engine->config.lock_stripes = num;
+    return ENGINE_SUCCESS;
+}
 
-        for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-            if (search->refcount == 0) {
-                if (search->exptime == 0 || search->exptime > current_time) {
-                    engine->items.itemstats[id].evicted++;
-                    engine->items.itemstats[id].evicted_time = current_time - search->time;
-                    if (search->exptime != 0) {
-                        engine->items.itemstats[id].evicted_nonzero++;
-                    }
-                    pthread_mutex_lock(&engine->stats.lock);
-                    engine->stats.evictions++;
-                    pthread_mutex_unlock(&engine->stats.lock);
-                    engine->server.stat->evicting(cookie,
-                                                  item_get_key(search),
-                                                  search->nkey);
-                } else {
-                    engine->items.itemstats[id].reclaimed++;
-                    pthread_mutex_lock(&engine->stats.lock);
-                    engine->stats.reclaimed++;
-                    pthread_mutex_unlock(&engine->stats.lock);
-                }
-                do_item_unlink(engine, search);
-                break;
-            }
+void item_locks_destroy(struct default_engine *engine) {
+    if (striped(engine)) {
+        for (uint32_t ii = 0; ii <= engine->item_lock_mask; ++ii) {
+            pthread_mutex_destroy(&engine->item_locks[ii].mutex);
         }
-        it = slabs_alloc(engine, ntotal, id);
-        if (it == 0) {
-            engine->items.itemstats[id].outofmemory++;
-            /* Last ditch effort. There is a very rare bug which causes
-             * refcount leaks. We've fixed most of them, but it still happens,
-             * and it may happen in the future.
-             * We can reasonably assume no item can stay locked for more than
-             * three hours, so if we find one in the tail which is that old,
-             * free it anyway.
-             */
-            tries = search_items;
-            for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-                if (search->refcount != 0 && search->time + TAIL_REPAIR_TIME < current_time) {
-                    engine->items.itemstats[id].tailrepairs++;
-                    search->refcount = 0;
-                    do_item_unlink(engine, search);
-                    break;
-                }
-            }
-            it = slabs_alloc(engine, ntotal, id);
-            if (it == 0) {
-                return NULL;
-            }
+        for (int ii = 0; ii < POWER_LARGEST; ++ii) {
+            pthread_mutex_destroy(&engine->items.lru_locks[ii]);
         }
+        free(engine->item_locks);
+        engine->item_locks = NULL;
     }
+}
 
-    assert(it->slabs_clsid == 0);
-
-    it->slabs_clsid = id;
+void item_lock(struct default_engine *engine, uint32_t hash) {
+    if (striped(engine)) {
+        lock_counted(&engine->item_locks[hash & engine->item_lock_mask].mutex,
+                     &engine->lock_stats.item_lock_waits, "item");
+    } else {
+        lock_counted(&engine->cache_lock, &engine->lock_stats.cache_lock_waits,
+                     "cache");
+    }
+}
 
-    assert(it != engine->items.heads[it->slabs_clsid]);
+void item_unlock(struct default_engine *engine, uint32_t hash) {
+    if (striped(engine)) {
+        pthread_mutex_unlock(&engine->item_locks[hash & engine->item_lock_mask].mutex);
+    } else {
+        pthread_mutex_unlock(&engine->cache_lock);
+    }
+}
 
-    it->next = it->prev = it->h_next = 0;
-    it->refcount = 1;     /* the caller will have a reference */
-    DEBUG_REFCNT(it, '*');
-    it->iflag = engine->config.use_cas ? ITEM_WITH_CAS : 0;
-    it->nkey = nkey;
-    it->nbytes = nbytes;
-    it->flags = flags;
-    memcpy((void*)item_get_key(it), key, nkey);
-    it->exptime = exptime;
-    return it;
+void item_lock_all(struct default_engine *engine) {
+    if (striped(engine)) {
+        for (uint32_t ii = 0; ii <= engine->item_lock_mask; ++ii) {
+            lock_counted(&engine->item_locks[ii].mutex,
+                         &engine->lock_stats.item_lock_waits, "item");
+        }
+    } else {
+        lock_counted(&engine->cache_lock, &engine->lock_stats.cache_lock_waits,
+                     "cache");
+    }
 }
 
-static void item_free(struct default_engine *engine, hash_item *it) {
-    size_t ntotal = ITEM_ntotal(engine, it);
-    unsigned int clsid;
-    assert((it->iflag & ITEM_LINKED) == 0);
-    assert(it != engine->items.heads[it->slabs_clsid]);
-    assert(it != engine->items.tails[it->slabs_clsid]);
-    assert(it->refcount == 0);
+void item_unlock_all(struct default_engine *engine) {
+    if (striped(engine)) {
+        for (uint32_t ii = 0; ii <= engine->item_lock_mask; ++ii) {
+            pthread_mutex_unlock(&engine->item_locks[ii].mutex);
+        }
+    } else {
+        pthread_mutex_unlock(&engine->cache_lock);
+    }
+}
 
-    /* so slab size changer can tell later if item is already free or not */
-    clsid = it->slabs_clsid;
-    it->slabs_clsid = 0;
-    it->iflag |= ITEM_SLABBED;
-    DEBUG_REFCNT(it, 'F');
-    slabs_free(engine, it, ntotal, clsid);
+/*
+ * Lock the LRU for a slab class. The caller must already hold an item
+ * lock (without striping that is the cache_lock, which also covers the
+ * LRU so there is nothing more to lock).
+ */
+static inline void lru_lock(struct default_engine *engine, unsigned int id) {
+    if (striped(engine)) {
+        lock_counted(&engine->items.lru_locks[id],
+                     &engine->lock_stats.lru_lock_waits, "lru");
+    }
 }
 
-static void item_link_q(struct default_engine *engine, hash_item *it) { /* item is the new head */
-    hash_item **head, **tail;
-    assert(it->slabs_clsid < POWER_LARGEST);
-    assert((it->iflag & ITEM_SLABBED) == 0);
+static inline void lru_unlock(struct default_engine *engine, unsigned int id) {
+    if (striped(engine)) {
+        pthread_mutex_unlock(&engine->items.lru_locks[id]);
+    }
+}
 
-    head = &engine->items.heads[it->slabs_clsid];
-    tail = &engine->items.tails[it->slabs_clsid];
-    assert(it != *head);
-    assert((*head && *tail) || (*head == 0 && *tail == 0));
-    it->prev = 0;
-    it->next = *head;
-    if (it->next) it->next->prev = it;
-    *head = it;
-    if (*tail == 0) *tail = it;
-    engine->items.sizes[it->slabs_clsid]++;
-    return;
+/*
+ * Lock the LRU for a slab class for someone walking the list without
+ * holding any item locks (the scrubber etc).
+ */
+static void lru_walk_lock(struct default_engine *engine, unsigned int id) {
+    if (striped(engine)) {
+        lru_lock(engine, id);
+    } else {
+        lock_counted(&engine->cache_lock, &engine->lock_stats.cache_lock_waits,
+                     "cache");
+    }
 }
 
-static void item_unlink_q(struct default_engine *engine, hash_item *it) {
-    hash_item **head, **tail;
-    assert(it->slabs_clsid < POWER_LARGEST);
-    head = &engine->items.heads[it->slabs_clsid];
-    tail = &engine->items.tails[it->slabs_clsid];
+static void lru_walk_unlock(struct default_engine *engine, unsigned int id) {
+    if (striped(engine)) {
+        lru_unlock(engine, id);
+    } else {
+        pthread_mutex_unlock(&engine->cache_lock);
+    }
+}
 
-    if (*head == it) {
-        assert(it->prev == 0);
-        *head = it->next;
+/*
+ * Try to lock an item found while walking an LRU (with the LRU lock
+ * held). Without striping the cache_lock is already held by the caller.
+ */
+static bool item_trylock_victim(struct default_engine *engine,
+                                const hash_item *it, uint32_t *hash) {
+    if (!striped(engine)) {
+        return true;
     }
-    if (*tail == it) {
-        assert(it->next == 0);
-        *tail = it->prev;
+    *hash = item_hash(engine, it);
+    return pthread_mutex_trylock(&engine->item_locks[*hash & engine->item_lock_mask].mutex) == 0;
+}
+
+static void item_unlock_victim(struct default_engine *engine, uint32_t hash) {
+    if (striped(engine)) {
+        pthread_mutex_unlock(&engine->item_locks[hash & engine->item_lock_mask].mutex);
     }
-    assert(it->next != it);
-    assert(it->prev != it);
+}
 
-    if (it->next) it->next->prev = it->prev;
-    if (it->prev) it->prev->next = it->next;
-    engine->items.sizes[it->slabs_clsid]--;
-    return;
+/*
+ * Operations that aren't tied to a key (like allocating a new item)
+ * only needs the cache_lock when we're not striping the locks.
+ */
+static void unstriped_lock(struct default_engine *engine) {
+    if (!striped(engine)) {
+        lock_counted(&engine->cache_lock, &engine->lock_stats.cache_lock_waits,
+                     "cache");
+    }
 }
 
-int do_item_link(struct default_engine *engine, hash_item *it) {
-    MEMCACHED_ITEM_LINK(item_get_key(it), it->nkey, it->nbytes);
-    assert((it->iflag & (ITEM_LINKED|ITEM_SLABBED)) == 0);
-    assert(it->nbytes < (1024 * 1024));  /* 1MB max size */
-    it->iflag |= ITEM_LINKED;
-    it->time = engine->server.core->get_current_time();
-    assoc_insert(engine, engine->server.core->hash(item_get_key(it),
-                                                        it->nkey, 0),
-                 it);
+static void unstriped_unlock(struct default_engine *engine) {
+    if (!striped(engine)) {
+        pthread_mutex_unlock(&engine->cache_lock);
+    }
+}
 
-    pthread_mutex_lock(&engine->stats.lock);
-    engine->stats.curr_bytes += ITEM_ntotal(engine, it);
-    engine->stats.curr_items += 1;
-    engine->stats.total_items += 1;
-    pthread_mutex_unlock(&engine->stats.lock);
+void item_stats_reset(struct default_engine *engine) {
+    item_lock_all(engine);
+    for (int ii = 0; ii < POWER_LARGEST; ++ii) {
+        lru_lock(engine, ii);
+        memset(&engine->items.itemstats[ii], 0, sizeof(itemstats_t));
+        lru_unlock(engine, ii);
+    }
+    item_unlock_all(engine);
+}
 
-    /* Allocate a new CAS ID on link. */
-    item_set_cas(NULL, NULL, it, get_cas_id());
 
-    item_link_q(engine, it);
+/* warning: don't use these macros with a function, as it evals its arg twice */
+static inline size_t ITEM_ntotal(struct default_engine *engine,
+                                 const hash_item *item) {
+    size_t ret = sizeof(*item) + item->nkey + item->nbytes;
+    if ((item->iflag & ITEM_DEDUP) != 0) {
+        /* It holds the item_ref of its blob, not the value */
+        ret = sizeof(*item) + item->nkey + sizeof(item_ref);
+    }
+    if (engine->config.use_cas) {
+        ret += sizeof(uint64_t);
+    }
 
-    return 1;
+    return ret;
 }
 
-void do_item_unlink(struct default_engine *engine, hash_item *it) {
-    MEMCACHED_ITEM_UNLINK(item_get_key(it), it->nkey, it->nbytes);
-    if ((it->iflag & ITEM_LINKED) != 0) {
-        it->iflag &= ~ITEM_LINKED;
-        pthread_mutex_lock(&engine->stats.lock);
-        engine->stats.curr_bytes -= ITEM_ntotal(engine, it);
-        engine->stats.curr_items -= 1;
-        pthread_mutex_unlock(&engine->stats.lock);
-        assoc_delete(engine, engine->server.core->hash(item_get_key(it),
-                                                            it->nkey, 0),
-                     item_get_key(it), it->nkey);
-        item_unlink_q(engine, it);
-        if (it->refcount == 0) {
-            item_free(engine, it);
-        }
-    }
-}
+/*
+ * The value of a chunked item is spread over the header (a chunk of the
+ * largest slab class) and up to count chunks. The table of the chunks is
+ * stored at the end of the header, so that item_get_data() still points
+ * to the first piece of the value:
+ *
+ *   hash_item | cas | key | nbytes of the value | chunks[count] | table
+ *
+ * A chunk is a hash_item (without a key) followed by nbytes of the value.
+ * It isn't linked anywhere, and h_next refers to the item it belongs to.
+ */
+struct item_chunks {
+    /** the number of chunks (the item_refs before the table) */
+    uint32_t count;
+    /** the bytes of the value stored in the header */
+    uint32_t nbytes;
+};
 
-void do_item_release(struct default_engine *engine, hash_item *it) {
-    MEMCACHED_ITEM_REMOVE(item_get_key(it), it->nkey, it->nbytes);
-    if (it->refcount != 0) {
-        it->refcount--;
-        DEBUG_REFCNT(it, '-');
-    }
-    if (it->refcount == 0 && (it->iflag & ITEM_LINKED) == 0) {
-        item_free(engine, it);
-    }
+static inline struct item_chunks *item_chunk_table(struct default_engine *engine,
+                                                   const hash_item *it) {
+    char *end = (char*)it + engine->slabs.slabclass[it->slabs_clsid].size;
+    return (struct item_chunks*)(end - sizeof(struct item_chunks));
 }
 
-void do_item_update(struct default_engine *engine, hash_item *it) {
-    rel_time_t current_time = engine->server.core->get_current_time();
-    MEMCACHED_ITEM_UPDATE(item_get_key(it), it->nkey, it->nbytes);
-    if (it->time < current_time - ITEM_UPDATE_INTERVAL) {
-        assert((it->iflag & ITEM_SLABBED) == 0);
+static inline item_ref *item_chunk_refs(struct item_chunks *table) {
+    return (item_ref*)table - table->count;
+}
 
-        if ((it->iflag & ITEM_LINKED) != 0) {
-            item_unlink_q(engine, it);
-            it->time = current_time;
-            item_link_q(engine, it);
-        }
+/* The size of the slab chunk holding an item */
+static inline size_t ITEM_nslab(struct default_engine *engine,
+                                const hash_item *item) {
+    if ((item->iflag & ITEM_CHUNKED) != 0) {
+        return engine->slabs.slabclass[item->slabs_clsid].size;
     }
+    return ITEM_ntotal(engine, item);
 }
 
-int do_item_replace(struct default_engine *engine,
-                    hash_item *it, hash_item *new_it) {
-    MEMCACHED_ITEM_REPLACE(item_get_key(it), it->nkey, it->nbytes,
-                           item_get_key(new_it), new_it->nkey, new_it->nbytes);
-    assert((it->iflag & ITEM_SLABBED) == 0);
-
-    do_item_unlink(engine, it);
-    return do_item_link(engine, new_it);
+/*
+ * The room left in the slab chunk of an item after its value (an append
+ * can use it, see append_slack)
+ */
+static inline size_t item_slack(struct default_engine *engine,
+                                const hash_item *item) {
+    if ((item->iflag & ITEM_CHUNKED) != 0) {
+        return 0;
+    }
+    return engine->slabs.slabclass[item->slabs_clsid].size -
+        ITEM_ntotal(engine, item);
 }
 
-/*@null@*/
-static char *do_item_cachedump(const unsigned int slabs_clsid,
-                               const unsigned int limit,
-                               unsigned int *bytes) {
-#ifdef FUTURE
-    unsigned int memlimit = 2 * 1024 * 1024;   /* 2MB max response size */
-    char *buffer;
-    unsigned int bufcurr;
-    hash_item *it;
-    unsigned int len;
-    unsigned int shown = 0;
-    char key_temp[KEY_MAX_LENGTH + 1];
-    char temp[512];
+/*
+ * Get the number of chunks we need for an item that doesn't fit in the
+ * largest slab class (and the bytes of the value to store in the header),
+ * or -1 if it is too big to be stored in pieces.
+ */
+static int item_chunk_layout(struct default_engine *engine,
+                             size_t nkey, size_t nbytes, size_t *hbytes) {
+    size_t csize = engine->slabs.slabclass[engine->slabs.power_largest].size;
+    size_t hsize = sizeof(hash_item) + nkey + sizeof(struct item_chunks);
+    if (engine->config.use_cas) {
+        hsize += sizeof(uint64_t);
+    }
 
-    it = engine->items.heads[slabs_clsid];
+    if (engine->config.slab_chunk_max == 0 || hsize >= csize ||
+        nbytes > engine->config.item_size_max) {
+        return -1;
+    }
 
-    buffer = malloc((size_t)memlimit);
-    if (buffer == 0) return NULL;
-    bufcurr = 0;
+    /* Every chunk adds csize - sizeof(hash_item) bytes, but takes an
+     * item_ref from the header */
+    size_t room = csize - hsize;
+    size_t step = csize - sizeof(hash_item) - sizeof(item_ref);
+    size_t count = nbytes > room ? (nbytes - room + step - 1) / step : 0;
+    if (count * sizeof(item_ref) > room) {
+        return -1;
+    }
 
+    *hbytes = room - count * sizeof(item_ref);
+    if (*hbytes > nbytes) {
+        *hbytes = nbytes;
+    }
+    return (int)count;
+}
 
-    while (it != NULL && (limit == 0 || shown < limit)) {
-        assert(it->nkey <= KEY_MAX_LENGTH);
-        /* Copy the key since it may not be null-terminated in the struct */
-        strncpy(key_temp, item_get_key(it), it->nkey);
-        key_temp[it->nkey] = 0x00; /* terminate */
-        len = snprintf(temp, sizeof(temp), "ITEM %s [%d b; %lu s]\r\n",
-                       key_temp, it->nbytes,
-                       (unsigned long)it->exptime + process_started);
-        if (bufcurr + len + 6 > memlimit)  /* 6 is END\r\n\0 */
-            break;
-        memcpy(buffer + bufcurr, temp, len);
-        bufcurr += len;
-        shown++;
-        it = it->next;
+bool item_size_ok(struct default_engine *engine, size_t nkey, size_t nbytes) {
+    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
+    size_t hbytes;
+    if (engine->config.use_cas) {
+        ntotal += sizeof(uint64_t);
     }
+    return slabs_clsid(engine, ntotal) != 0 ||
+        item_chunk_layout(engine, nkey, nbytes, &hbytes) >= 0;
+}
 
+/* Get the blob holding the value of an item with ITEM_DEDUP */
+static inline hash_item *item_dedup_blob(struct default_engine *engine,
+                                         const hash_item *it) {
+    item_ref ref;
+    memcpy(&ref, item_get_data(it), sizeof(ref));
+    return item_deref(engine, ref);
+}
 
-    memcpy(buffer + bufcurr, "END\r\n", 6);
-    bufcurr += 5;
+/* Get a piece of the value of an item (the header is piece 0) */
+static char *item_value_piece(struct default_engine *engine,
+                              const hash_item *it, uint32_t idx,
+                              size_t *len) {
+    if ((it->iflag & ITEM_DEDUP) != 0) {
+        it = item_dedup_blob(engine, it);
+    }
+    if ((it->iflag & ITEM_CHUNKED) == 0) {
+        *len = it->nbytes;
+        return item_get_data(it);
+    }
 
-    *bytes = bufcurr;
-    return buffer;
-#endif
-    (void)slabs_clsid;
-    (void)limit;
-    (void)bytes;
-    return NULL;
+    struct item_chunks *table = item_chunk_table(engine, it);
+    if (idx == 0) {
+        *len = table->nbytes;
+        return item_get_data(it);
+    }
+    hash_item *chunk = item_deref(engine, item_chunk_refs(table)[idx - 1]);
+    *len = chunk->nbytes;
+    return (char*)(chunk + 1);
 }
 
-static void do_item_stats(struct default_engine *engine,
-                          ADD_STAT add_stats, const void *c) {
-    int i;
-    rel_time_t current_time = engine->server.core->get_current_time();
-    for (i = 0; i < POWER_LARGEST; i++) {
-        if (engine->items.tails[i] != NULL) {
-            int search = search_items;
-            while (search > 0 &&
-                   engine->items.tails[i] != NULL &&
-                   ((engine->config.oldest_live != 0 && /* Item flushd */
-                     engine->config.oldest_live <= current_time &&
-                     engine->items.tails[i]->time <= engine->config.oldest_live) ||
-                    (engine->items.tails[i]->exptime != 0 && /* and not expired */
-                     engine->items.tails[i]->exptime < current_time))) {
-                --search;
-                if (engine->items.tails[i]->refcount == 0) {
-                    do_item_unlink(engine, engine->items.tails[i]);
-                } else {
-                    break;
-                }
-            }
-            if (engine->items.tails[i] == NULL) {
-                /* We removed all of the items in this slab class */
-                continue;
-            }
+static uint32_t item_value_npieces(struct default_engine *engine,
+                                   const hash_item *it) {
+    if ((it->iflag & ITEM_DEDUP) != 0) {
+        it = item_dedup_blob(engine, it);
+    }
+    if ((it->iflag & ITEM_CHUNKED) == 0) {
+        return 1;
+    }
+    return item_chunk_table(engine, it)->count + 1;
+}
 
-            const char *prefix = "items";
-            add_statistics(c, add_stats, prefix, i, "number", "%u",
-                           engine->items.sizes[i]);
-            add_statistics(c, add_stats, prefix, i, "age", "%u",
-                           engine->items.tails[i]->time);
-            add_statistics(c, add_stats, prefix, i, "evicted",
-                           "%u", engine->items.itemstats[i].evicted);
-            add_statistics(c, add_stats, prefix, i, "evicted_nonzero",
-                           "%u", engine->items.itemstats[i].evicted_nonzero);
-            add_statistics(c, add_stats, prefix, i, "evicted_time",
-                           "%u", engine->items.itemstats[i].evicted_time);
-            add_statistics(c, add_stats, prefix, i, "outofmemory",
-                           "%u", engine->items.itemstats[i].outofmemory);
-            add_statistics(c, add_stats, prefix, i, "tailrepairs",
-                           "%u", engine->items.itemstats[i].tailrepairs);;
-            add_statistics(c, add_stats, prefix, i, "reclaimed",
-                           "%u", engine->items.itemstats[i].reclaimed);;
+int item_get_value(struct default_engine *engine, const hash_item *it,
+                   struct iovec *iov, int niov) {
+    int npieces = (int)item_value_npieces(engine, it);
+    if (npieces <= niov) {
+        for (int ii = 0; ii < npieces; ++ii) {
+            size_t len;
+            iov[ii].iov_base = item_value_piece(engine, it, ii, &len);
+            iov[ii].iov_len = len;
         }
     }
+    return npieces;
 }
 
-/** dumps out a list of objects of each size, with granularity of 32 bytes */
-/*@null@*/
-static void do_item_stats_sizes(struct default_engine *engine,
-                                ADD_STAT add_stats, const void *c) {
-
-    /* max 1MB object, divided into 32 bytes size buckets */
-    const int num_buckets = 32768;
-    unsigned int *histogram = calloc(num_buckets, sizeof(int));
-
-    if (histogram != NULL) {
-        int i;
-
-        /* build the histogram */
-        for (i = 0; i < POWER_LARGEST; i++) {
-            hash_item *iter = engine->items.heads[i];
-            while (iter) {
-                int ntotal = ITEM_ntotal(engine, iter);
-                int bucket = ntotal / 32;
-                if ((ntotal % 32) != 0) bucket++;
-                if (bucket < num_buckets) histogram[bucket]++;
-                iter = iter->next;
-            }
+/*
+ * Copy between the value of an item and a buffer (to the item if write
+ * is set), starting at offset in the value
+ */
+static void item_value_copy(struct default_engine *engine, hash_item *it,
+                            size_t offset, char *buf, size_t len,
+                            bool write) {
+    /* The blob is shared */
+    assert(!write || (it->iflag & ITEM_DEDUP) == 0);
+    uint32_t npieces = item_value_npieces(engine, it);
+    for (uint32_t ii = 0; ii < npieces && len > 0; ++ii) {
+        size_t plen;
+        char *piece = item_value_piece(engine, it, ii, &plen);
+        if (offset >= plen) {
+            offset -= plen;
+            continue;
         }
-
-        /* write the buffer */
-        for (i = 0; i < num_buckets; i++) {
-            if (histogram[i] != 0) {
-                char key[8], val[32];
-                int klen, vlen;
-                klen = snprintf(key, sizeof(key), "%d", i * 32);
-                vlen = snprintf(val, sizeof(val), "%u", histogram[i]);
-                assert(klen < sizeof(key));
-                assert(vlen < sizeof(val));
-                add_stats(key, klen, val, vlen, c);
-            }
+        size_t n = plen - offset < len ? plen - offset : len;
+        if (write) {
+            memcpy(piece + offset, buf, n);
+        } else {
+            memcpy(buf, piece + offset, n);
         }
-        free(histogram);
+        buf += n;
+        len -= n;
+        offset = 0;
     }
+    assert(len == 0);
 }
 
-/** wrapper around assoc_find which does the lazy expiration logic */
-hash_item *do_item_get(struct default_engine *engine,
-                       const char *key, const size_t nkey) {
-    rel_time_t current_time = engine->server.core->get_current_time();
-    hash_item *it = assoc_find(engine, engine->server.core->hash(key,
-                                                                      nkey, 0),
-                               key, nkey);
-    int was_found = 0;
+void item_value_write(struct default_engine *engine, hash_item *it,
+                      size_t offset, const void *src, size_t len) {
+    item_value_copy(engine, it, offset, (char*)src, len, true);
+}
 
-    if (engine->config.verbose > 2) {
-        EXTENSION_LOGGER_DESCRIPTOR *logger;
-        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-        if (it == NULL) {
-            logger->log(EXTENSION_LOG_DEBUG, NULL,
-                        "> NOT FOUND %s", key);
-        } else {
-            logger->log(EXTENSION_LOG_DEBUG, NULL,
-                        "> FOUND KEY %s",
-                        (const char*)item_get_key(it));
-            was_found++;
-        }
+/* Copy the value of src to the value of dst (at offset) */
+static void item_copy_value(struct default_engine *engine, hash_item *dst,
+                            size_t offset, hash_item *src) {
+    uint32_t npieces = item_value_npieces(engine, src);
+    for (uint32_t ii = 0; ii < npieces; ++ii) {
+        size_t len;
+        char *piece = item_value_piece(engine, src, ii, &len);
+        item_value_copy(engine, dst, offset, piece, len, true);
+        offset += len;
     }
+}
 
-    if (it != NULL && engine->config.oldest_live != 0 &&
-        engine->config.oldest_live <= current_time &&
-        it->time <= engine->config.oldest_live) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
-        it = NULL;
+void item_value_read(struct default_engine *engine, hash_item *it,
+                     size_t offset, void *dst, size_t len) {
+    item_value_copy(engine, it, offset, dst, len, false);
+}
+
+/*
+ * Release the chunks of a chunked item (the header is left alone). The
+ * caller must hold the item lock (or own the item).
+ */
+static void item_free_chunks(struct default_engine *engine, hash_item *it) {
+    if ((it->iflag & ITEM_CHUNKED) == 0) {
+        return;
     }
 
-    if (it == NULL && was_found) {
-        EXTENSION_LOGGER_DESCRIPTOR *logger;
-        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-        logger->log(EXTENSION_LOG_DEBUG, NULL, " -nuked by flush");
-        was_found--;
+    struct item_chunks *table = item_chunk_table(engine, it);
+    item_ref *refs = item_chunk_refs(table);
+    for (uint32_t ii = 0; ii < table->count; ++ii) {
+        hash_item *chunk = item_deref(engine, refs[ii]);
+        if (chunk != NULL) {
+            unsigned int clsid = chunk->slabs_clsid;
+            /* so the slab rebalancer can tell it's free */
+            chunk->slabs_clsid = 0;
+            chunk->iflag = ITEM_SLABBED;
+            slabs_free(engine, chunk, sizeof(hash_item) + chunk->nbytes, clsid);
+        }
     }
+    table->count = 0;
+    table->nbytes = 0;
+}
 
-    if (it != NULL && it->exptime != 0 && it->exptime <= current_time) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
-        it = NULL;
+/*
+ * Release what the value of an item holds outside of its slab chunk: the
+ * chunks of a chunked item, or the reference to the blob of one with
+ * ITEM_DEDUP. The caller must hold the item lock (or own the item).
+ */
+static void item_free_value(struct default_engine *engine, hash_item *it) {
+    if ((it->iflag & ITEM_DEDUP) != 0) {
+        hash_item *blob = item_dedup_blob(engine, it);
+        it->iflag &= ~ITEM_DEDUP;
+        it->nbytes = sizeof(item_ref);
+        if (dedup_release(engine, blob)) {
+            item_free(engine, blob);
+        }
+        return;
     }
+    item_free_chunks(engine, it);
+}
 
-    if (it == NULL && was_found) {
-        EXTENSION_LOGGER_DESCRIPTOR *logger;
-        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-        logger->log(EXTENSION_LOG_DEBUG, NULL, " -nuked by expire");
-        was_found--;
+/*
+ * Get the next CAS id for a new item. The caller must hold the item lock
+ * for the hash value. The ids are handed out from a per stripe block, so
+ * they are unique but only roughly increasing across stripes.
+ */
+static uint64_t get_cas_id(struct default_engine *engine, uint32_t hash) {
+    struct cas_block *blk = &engine->cas_block;
+    if (striped(engine)) {
+        blk = &engine->item_locks[hash & engine->item_lock_mask].cas;
     }
 
-    if (it != NULL) {
-        it->refcount++;
-        DEBUG_REFCNT(it, '+');
-        do_item_update(engine, it);
+    if (blk->next == blk->end) {
+        blk->end = ATOMIC_ADD_64(&engine->cas_id, CAS_BLOCK_SIZE) + 1;
+        blk->next = blk->end - CAS_BLOCK_SIZE;
     }
 
-    return it;
+    return blk->next++;
 }
 
 /*
- * Stores an item in the cache according to the semantics of one of the set
- * commands. In threaded mode, this is protected by the cache lock.
- *
- * Returns the state of storage.
+ * Is the item dead because of a flush_all (or a bump of its namespace)?
+ * The items stored in the second of the flush are told apart by their
+ * CAS.
  */
-static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
-                                       hash_item *it, uint64_t *cas,
-                                       ENGINE_STORE_OPERATION operation,
-                                       const void *cookie) {
-    const char *key = item_get_key(it);
-    hash_item *old_it = do_item_get(engine, key, it->nkey);
-    ENGINE_ERROR_CODE stored = ENGINE_NOT_STORED;
+static inline bool item_is_flushed(struct default_engine *engine,
+                                   const hash_item *it,
+                                   rel_time_t current_time) {
+    rel_time_t oldest_live = engine->config.oldest_live;
+    uint64_t oldest_cas = engine->config.oldest_cas;
 
-    hash_item *new_it = NULL;
+    if (engine->namespaces.count != 0 &&
+        namespace_generation(engine, item_get_key(it), it->nkey) != it->nsgen) {
+        return true;
+    }
+    if (oldest_live == 0 || oldest_live > current_time) {
+        return false;
+    }
+    if (it->time <= oldest_live) {
+        return true;
+    }
+    if (oldest_cas != 0) {
+        uint64_t cas = item_get_cas(it);
+        return cas != 0 && cas < oldest_cas;
+    }
+    return false;
+}
 
-    if (old_it != NULL && operation == OPERATION_ADD) {
-        /* add only adds a nonexistent item, but promote to head of LRU */
-        do_item_update(engine, old_it);
-    } else if (!old_it && (operation == OPERATION_REPLACE
-        || operation == OPERATION_APPEND || operation == OPERATION_PREPEND))
-    {
-        /* replace only replaces an existing value; don't store */
-    } else if (operation == OPERATION_CAS) {
-        /* validate cas operation */
-        if(old_it == NULL) {
-            // LRU expired
-            stored = ENGINE_KEY_ENOENT;
+/* Enable this for reference-count debugging. */
+#if 0
+# define DEBUG_REFCNT(it,op) \
+                fprintf(stderr, "item %x refcnt(%c) %d %c%c%c\n", \
+                        it, op, it->refcount, \
+                        (it->it_flags & ITEM_LINKED) ? 'L' : ' ', \
+                        (it->it_flags & ITEM_SLABBED) ? 'S' : ' ')
+#else
+# define DEBUG_REFCNT(it,op) while(0)
+#endif
+
+
+static inline enum lru_segment item_segment(const hash_item *it) {
+    return (enum lru_segment)((it->iflag & ITEM_SEGMENT_MASK) >> ITEM_SEGMENT_SHIFT);
+}
+
+static inline void item_set_segment(hash_item *it, enum lru_segment seg) {
+    it->iflag = (it->iflag & ~ITEM_SEGMENT_MASK) | (seg << ITEM_SEGMENT_SHIFT);
+}
+
+static inline unsigned int lru_list(unsigned int clsid, enum lru_segment seg) {
+    return seg * POWER_LARGEST + clsid;
+}
+
+static inline unsigned int lru_clsid(unsigned int list) {
+    return list % POWER_LARGEST;
+}
+
+/* Get the LRU list the item is linked into */
+static inline unsigned int item_lru(const hash_item *it) {
+    return lru_list(it->slabs_clsid, item_segment(it));
+}
+
+/* The scrubber and the tap walker link "empty" items into the LRU */
+static inline bool item_is_cursor(const hash_item *it) {
+    return it->nkey == 0 && it->nbytes == 0;
+}
+
+static inline unsigned int lru_class_size(struct default_engine *engine,
+                                          unsigned int clsid) {
+    unsigned int total = 0;
+    for (int ii = 0; ii < LRU_SEGMENTS; ++ii) {
+        total += engine->items.sizes[lru_list(clsid, ii)];
+    }
+    return total;
+}
+
+/*
+ * The order we look for victims in. Without the segmented LRU all items
+ * are in the cold segment (or on probation).
+ */
+static const enum lru_segment victim_order[LRU_SEGMENTS] = {
+    LRU_PROBATION, LRU_COLD, LRU_WARM, LRU_HOT
+};
+
+/* The segments where a hit item waits for the LRU to move it out */
+static inline bool lru_tail_segment(enum lru_segment seg) {
+    return seg == LRU_COLD || seg == LRU_PROBATION;
+}
+
+/*
+ * Walk the tails of the segments of a slab class in victim order. Returns
+ * the item before search in its segment, or the tail of the next segment
+ * that isn't empty (start with search set to NULL and seg set to -1).
+ */
+static hash_item *victim_next(struct default_engine *engine, unsigned int id,
+                              hash_item *search, int *seg) {
+    if (search != NULL && search->prev != 0) {
+        return item_deref(engine, search->prev);
+    }
+
+    /* The segments we don't use are empty */
+    while (++*seg < LRU_SEGMENTS) {
+        hash_item *tail = engine->items.tails[lru_list(id, victim_order[*seg])];
+        if (tail != NULL) {
+            return tail;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Move an item to the head of another segment of its LRU (and clear the
+ * active flag). The caller holds the item lock and the LRU lock.
+ */
+static void lru_move(struct default_engine *engine, hash_item *it,
+                     enum lru_segment seg) {
+    MEMCACHED_ITEM_BUMP(item_get_key(it), it->nkey, it->slabs_clsid,
+                        item_segment(it), seg);
+    item_unlink_q(engine, it);
+    it->iflag &= ~ITEM_ACTIVE;
+    item_set_segment(it, seg);
+    item_link_q(engine, it);
+}
+
+/*
+ * Look at (up to tries) items at the tail of a segment and move them to
+ * the segment they belong in. Items that were hit go to the warm segment,
+ * and the rest go to the cold segment. We stop when the hot or warm
+ * segment is down to limit items. The caller holds the LRU lock.
+ * Returns the number of items moved.
+ */
+static int lru_juggle(struct default_engine *engine, unsigned int id,
+                      enum lru_segment seg, unsigned int limit, int tries) {
+    unsigned int lru = lru_list(id, seg);
+    hash_item *search, *prev;
+    uint32_t hv = 0;
+    int moved = 0;
+
+    for (search = engine->items.tails[lru];
+         tries > 0 && search != NULL;
+         tries--, search = prev) {
+        prev = item_deref(engine, search->prev);
+        if (!lru_tail_segment(seg) && engine->items.sizes[lru] <= limit) {
+            break;
+        }
+
+        bool active = (search->iflag & ITEM_ACTIVE) != 0;
+        if ((lru_tail_segment(seg) && !active) || item_is_cursor(search) ||
+            !item_trylock_victim(engine, search, &hv)) {
+            continue;
+        }
+
+        enum lru_segment to = active ? LRU_WARM : LRU_COLD;
+        if (to != seg) {
+            if (to == LRU_COLD) {
+                engine->items.itemstats[id].moves_to_cold++;
+            } else {
+                engine->items.itemstats[id].moves_to_warm++;
+            }
+        }
+        lru_move(engine, search, to);
+        item_unlock_victim(engine, hv);
+        ++moved;
+    }
+
+    return moved;
+}
+
+/*
+ * Trim the hot and warm segments of a slab class, and pull the items
+ * that were hit out of the tail of the cold segment. The caller holds
+ * the LRU lock.
+ */
+static int lru_maintain_class(struct default_engine *engine, unsigned int id) {
+    unsigned int total = lru_class_size(engine, id);
+    int moved;
+
+    moved = lru_juggle(engine, id, LRU_HOT, total * HOT_LRU_PCT / 100,
+                       search_items);
+    moved += lru_juggle(engine, id, LRU_WARM, total * WARM_LRU_PCT / 100,
+                        search_items);
+    moved += lru_juggle(engine, id, LRU_COLD, 0, search_items);
+    moved += lru_juggle(engine, id, LRU_PROBATION, 0, search_items);
+    return moved;
+}
+
+static void *lru_maintainer_main(void *arg) {
+    struct default_engine *engine = arg;
+    useconds_t sleep_time = LRU_MAINTAINER_MIN_SLEEP;
+
+    engine->server.core->place_background_thread();
+
+    while (engine->items.maintainer_running) {
+        int moved = 0;
+        for (int ii = POWER_SMALLEST; ii < POWER_LARGEST; ++ii) {
+            if (lru_class_size(engine, ii) == 0) {
+                continue;
+            }
+            lru_walk_lock(engine, ii);
+            moved += lru_maintain_class(engine, ii);
+            lru_walk_unlock(engine, ii);
+        }
+
+        if (moved > 0) {
+            sleep_time = LRU_MAINTAINER_MIN_SLEEP;
+        } else if (sleep_time < LRU_MAINTAINER_MAX_SLEEP) {
+            sleep_time *= 2;
+        }
+        usleep(sleep_time);
+    }
+
+    return NULL;
+}
+
+ENGINE_ERROR_CODE item_lru_maintainer_start(struct default_engine *engine) {
+    if (!engine->config.segmented_lru) {
+        return ENGINE_SUCCESS;
+    }
+
+    engine->items.maintainer_running = true;
+    if (pthread_create(&engine->items.maintainer, NULL,
+                       lru_maintainer_main, engine) != 0) {
+        engine->items.maintainer_running = false;
+        return ENGINE_FAILED;
+    }
+    return ENGINE_SUCCESS;
+}
+
+void item_lru_maintainer_stop(struct default_engine *engine) {
+    if (engine->items.maintainer_running) {
+        engine->items.maintainer_running = false;
+        pthread_join(engine->items.maintainer, NULL);
+    }
+}
+
+/*
+ * Get a chunk of ntotal bytes from the slab class id, reclaiming an
+ * expired item or evicting one from the class if we have to. The chunk
+ * is returned with its slab class set (and nothing else initialized).
+ */
+/*@null@*/
+static hash_item *do_item_alloc_slab(struct default_engine *engine,
+                                     size_t ntotal, unsigned int id,
+                                     const void *cookie) {
+    hash_item *it = NULL;
+
+    /* do a quick check if we have any expired items in the tail.. */
+    int tries = search_items;
+    int seg = -1;
+    hash_item *search, *prev;
+    uint32_t hv = 0;
+    rel_time_t current_time = engine->server.core->get_current_time();
+
+    lru_lock(engine, id);
+    if (engine->config.segmented_lru) {
+        /* Don't let the hot segment grow while the maintainer sleeps */
+        lru_juggle(engine, id, LRU_HOT,
+                   lru_class_size(engine, id) * HOT_LRU_PCT / 100, 2);
+    }
+
+    for (search = victim_next(engine, id, NULL, &seg);
+         tries > 0 && search != NULL;
+         tries--, search = victim_next(engine, id, search, &seg)) {
+        if (search->refcount == 0 &&
+            (item_is_flushed(engine, search, current_time) ||
+             (search->exptime != 0 && search->exptime < current_time)) &&
+            item_trylock_victim(engine, search, &hv)) {
+            if (search->refcount != 0) {
+                /* Someone grabbed it before we got the lock */
+                item_unlock_victim(engine, hv);
+                continue;
+            }
+            it = search;
+            /* I don't want to actually free the object, just steal
+             * the item to avoid to grab the slab mutex twice ;-)
+             */
+            pthread_mutex_lock(&engine->stats.lock);
+            engine->stats.reclaimed++;
+            pthread_mutex_unlock(&engine->stats.lock);
+            engine->items.itemstats[id].reclaimed++;
+            it->refcount = 1;
+            slabs_adjust_mem_requested(engine, it->slabs_clsid, ITEM_nslab(engine, it), ntotal);
+            do_item_unlink_internal(engine, it, true);
+            item_free_value(engine, it);
+            /* Initialize the item block: */
+            it->slabs_clsid = 0;
+            it->refcount = 0;
+            item_unlock_victim(engine, hv);
+            break;
+        }
+    }
+
+    if (it == NULL && (it = slabs_alloc(engine, ntotal, id)) == NULL) {
+        /*
+        ** Could not find an expired item at the tail, and memory allocation
+        ** failed. Try to evict some items!
+        */
+        tries = search_items;
+
+        /* If requested to not push old items out of cache when memory runs out,
+         * we're out of luck at this point...
+         */
+
+        if (engine->config.evict_to_free == 0) {
+            engine->items.itemstats[id].outofmemory++;
+            lru_unlock(engine, id);
+            return NULL;
+        }
+
+        /*
+         * try to get one off the right LRU
+         * don't necessariuly unlink the tail because it may be locked: refcount>0
+         * search up from tail an item with refcount==0 and unlink it; give up after search_items
+         * tries
+         */
+
+        if (lru_class_size(engine, id) == 0) {
+            engine->items.itemstats[id].outofmemory++;
+            lru_unlock(engine, id);
+            return NULL;
+        }
+
+        int promoted = 0;
+        seg = -1;
+        for (search = victim_next(engine, id, NULL, &seg);
+             tries > 0 && search != NULL; tries--, search = prev) {
+            /* We might move the item, so find the next one first */
+            prev = victim_next(engine, id, search, &seg);
+            if (search->refcount == 0 &&
+                item_trylock_victim(engine, search, &hv)) {
+                if (search->refcount != 0) {
+                    item_unlock_victim(engine, hv);
+                    continue;
+                }
+                if (lru_tail_segment(item_segment(search)) &&
+                    (search->iflag & ITEM_ACTIVE) != 0 &&
+                    promoted < search_items) {
+                    /* It was hit after it was moved to the cold segment,
+                     * so give it another chance (without using up a try) */
+                    lru_move(engine, search, LRU_WARM);
+                    engine->items.itemstats[id].moves_to_warm++;
+                    item_unlock_victim(engine, hv);
+                    ++promoted;
+                    ++tries;
+                    continue;
+                }
+                if (search->exptime == 0 || search->exptime > current_time) {
+                    engine->items.itemstats[id].evicted++;
+                    engine->items.itemstats[id].evicted_segment[item_segment(search)]++;
+                    engine->items.itemstats[id].evicted_time = current_time - search->time;
+                    engine->items.evicting[id] = current_time;
+                    MEMCACHED_ITEM_EVICT(item_get_key(search), search->nkey,
+                                         id, current_time - search->time);
+                    if (search->exptime != 0) {
+                        engine->items.itemstats[id].evicted_nonzero++;
+                    }
+                    pthread_mutex_lock(&engine->stats.lock);
+                    engine->stats.evictions++;
+                    pthread_mutex_unlock(&engine->stats.lock);
+                    if (cookie != NULL) {
+                        /* the ext flusher allocates without one */
+                        engine->server.stat->evicting(cookie,
+                                                      item_get_key(search),
+                                                      search->nkey);
+                    }
+                } else {
+                    engine->items.itemstats[id].reclaimed++;
+                    pthread_mutex_lock(&engine->stats.lock);
+                    engine->stats.reclaimed++;
+                    pthread_mutex_unlock(&engine->stats.lock);
+                }
+                do_item_unlink_internal(engine, search, true);
+                item_unlock_victim(engine, hv);
+                break;
+            }
+        }
+        it = slabs_alloc(engine, ntotal, id);
+        if (it == 0) {
+            engine->items.itemstats[id].outofmemory++;
+            /* Last ditch effort. There is a very rare bug which causes
+             * refcount leaks. We've fixed most of them, but it still happens,
+             * and it may happen in the future.
+             * We can reasonably assume no item can stay locked for more than
+             * three hours, so if we find one in the tail which is that old,
+             * free it anyway.
+             */
+            tries = search_items;
+            seg = -1;
+            for (search = victim_next(engine, id, NULL, &seg);
+                 tries > 0 && search != NULL;
+                 tries--, search = victim_next(engine, id, search, &seg)) {
+                if (search->refcount != 0 && !item_is_cursor(search) &&
+                    search->time + TAIL_REPAIR_TIME < current_time &&
+                    item_trylock_victim(engine, search, &hv)) {
+                    engine->items.itemstats[id].tailrepairs++;
+                    search->refcount = 0;
+                    do_item_unlink_internal(engine, search, true);
+                    item_unlock_victim(engine, hv);
+                    break;
+                }
+            }
+            it = slabs_alloc(engine, ntotal, id);
+            if (it == 0) {
+                lru_unlock(engine, id);
+                return NULL;
+            }
+        }
+    }
+
+    assert(it->slabs_clsid == 0);
+
+    it->slabs_clsid = id;
+
+    assert(it != engine->items.heads[item_lru(it)]);
+    lru_unlock(engine, id);
+
+    it->next = it->prev = it->h_next = 0;
+    return it;
+}
+
+static void item_init(struct default_engine *engine, hash_item *it,
+                      const void *key, const size_t nkey, const int flags,
+                      const rel_time_t exptime, const int nbytes) {
+    it->refcount = 1;     /* the caller will have a reference */
+    DEBUG_REFCNT(it, '*');
+    it->iflag = engine->config.use_cas ? ITEM_WITH_CAS : 0;
+    it->nkey = nkey;
+    it->nbytes = nbytes;
+    it->flags = flags;
+    it->vbucket = 0;
+    it->nsgen = 0;
+    memcpy((void*)item_get_key(it), key, nkey);
+    it->exptime = exptime;
+}
+
+/*
+ * Allocate an item that doesn't fit in the largest slab class: the
+ * header and the full chunks come from the largest class, and the tail
+ * of the value goes in the best fitting chunk.
+ */
+/*@null@*/
+static hash_item *do_item_alloc_chunked(struct default_engine *engine,
+                                        const void *key, const size_t nkey,
+                                        const int flags,
+                                        const rel_time_t exptime,
+                                        const int nbytes,
+                                        const void *cookie) {
+    size_t hbytes;
+    int count = item_chunk_layout(engine, nkey, nbytes, &hbytes);
+    if (count < 0) {
+        return NULL;
+    }
+
+    unsigned int largest = engine->slabs.power_largest;
+    size_t csize = engine->slabs.slabclass[largest].size;
+    hash_item *it = do_item_alloc_slab(engine, csize, largest, cookie);
+    if (it == NULL) {
+        return NULL;
+    }
+    item_init(engine, it, key, nkey, flags, exptime, nbytes);
+    it->iflag |= ITEM_CHUNKED;
+
+    struct item_chunks *table = item_chunk_table(engine, it);
+    table->count = (uint32_t)count;
+    table->nbytes = (uint32_t)hbytes;
+    item_ref *refs = item_chunk_refs(table);
+    memset(refs, 0, count * sizeof(item_ref));
+
+    size_t left = nbytes - hbytes;
+    for (int ii = 0; ii < count; ++ii) {
+        size_t len = csize - sizeof(hash_item);
+        unsigned int id = largest;
+        if (left < len) {
+            len = left;
+            id = slabs_clsid(engine, sizeof(hash_item) + len);
+        }
+
+        hash_item *chunk = do_item_alloc_slab(engine, sizeof(hash_item) + len,
+                                              id, cookie);
+        if (chunk == NULL && id != largest) {
+            chunk = do_item_alloc_slab(engine, sizeof(hash_item) + len,
+                                       largest, cookie);
+        }
+        if (chunk == NULL) {
+            /* item_free() releases the chunks we got */
+            it->refcount = 0;
+            item_free(engine, it);
+            return NULL;
+        }
+
+        chunk->h_next = item_ref_of(engine, it);
+        chunk->refcount = 0;
+        chunk->iflag = ITEM_CHUNK;
+        chunk->nkey = 0;
+        chunk->nbytes = (uint32_t)len;
+        chunk->flags = 0;
+        chunk->exptime = 0;
+        refs[ii] = item_ref_of(engine, chunk);
+        left -= len;
+    }
+
+    return it;
+}
+
+/*@null@*/
+hash_item *do_item_alloc(struct default_engine *engine,
+                         const void *key,
+                         const size_t nkey,
+                         const int flags,
+                         const rel_time_t exptime,
+                         const int nbytes,
+                         const void *cookie) {
+    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
+    if (engine->config.use_cas) {
+        ntotal += sizeof(uint64_t);
+    }
+
+    unsigned int id = slabs_clsid(engine, ntotal);
+    if (id == 0) {
+        return do_item_alloc_chunked(engine, key, nkey, flags, exptime,
+                                     nbytes, cookie);
+    }
+
+    hash_item *it = do_item_alloc_slab(engine, ntotal, id, cookie);
+    if (it != NULL) {
+        item_init(engine, it, key, nkey, flags, exptime, nbytes);
+    }
+    return it;
+}
+
+/*
+ * Count a linked item in (or take it out of) the histogram of "stats
+ * sizes". The caller holds the stats lock.
+ */
+static inline void item_sizes_update(struct default_engine *engine,
+                                     size_t ntotal, int delta) {
+    size_t bucket = (ntotal + 31) / 32;
+    if (bucket >= engine->stats.nsizes) {
+        bucket = engine->stats.nsizes - 1;
+    }
+    engine->stats.sizes[bucket] += delta;
+}
+
+/*
+ * Allocate the item holding the result of an append or prepend. With
+ * append_slack we ask for append_slack percent more than the value
+ * needs (as long as it still fits in a slab class), so that the next
+ * appends have room to go in place (see do_item_append_in_place()).
+ */
+static hash_item *do_item_alloc_slack(struct default_engine *engine,
+                                      const void *key, const size_t nkey,
+                                      const int flags,
+                                      const rel_time_t exptime,
+                                      const int nbytes,
+                                      const void *cookie) {
+    size_t slack = nbytes * engine->config.append_slack / 100;
+    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
+    if (engine->config.use_cas) {
+        ntotal += sizeof(uint64_t);
+    }
+
+    if (slack > 0 && slabs_clsid(engine, ntotal + slack) != 0) {
+        hash_item *it = do_item_alloc(engine, key, nkey, flags, exptime,
+                                      nbytes + (int)slack, cookie);
+        if (it != NULL) {
+            slabs_adjust_mem_requested(engine, it->slabs_clsid,
+                                       ntotal + slack, ntotal);
+            it->nbytes = nbytes;
+            it->iflag |= ITEM_SLACK;
+            return it;
+        }
+    }
+
+    return do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie);
+}
+
+/*
+ * Make the value of a linked item delta bytes longer, in its slab chunk
+ * (the caller checked that there is room). Called with the item lock
+ * held.
+ */
+static void do_item_grow_value(struct default_engine *engine,
+                               hash_item *it, size_t delta) {
+    size_t ntotal = ITEM_ntotal(engine, it);
+    it->nbytes += delta;
+    slabs_adjust_mem_requested(engine, it->slabs_clsid, ntotal,
+                               ntotal + delta);
+    pthread_mutex_lock(&engine->stats.lock);
+    engine->stats.curr_bytes += delta;
+    item_sizes_update(engine, ntotal, -1);
+    item_sizes_update(engine, ntotal + delta, 1);
+    if ((it->iflag & ITEM_SLACK) != 0) {
+        engine->stats.append_slack -= delta;
+    }
+    pthread_mutex_unlock(&engine->stats.lock);
+}
+
+/*
+ * Append (or prepend) the value of it to old_it without a new item, if
+ * the slab chunk of old_it has room for it and nobody else has a
+ * reference to it. Called with the item lock held.
+ *
+ * @return true if the value was added in place
+ */
+static bool do_item_append_in_place(struct default_engine *engine,
+                                    hash_item *old_it, hash_item *it,
+                                    ENGINE_STORE_OPERATION operation,
+                                    uint32_t hv) {
+    if (engine->config.append_slack == 0 || old_it->refcount != 1 ||
+        (old_it->iflag & (ITEM_CHUNKED | ITEM_COMPRESSED | ITEM_EXTERNAL |
+                          ITEM_COUNTER | ITEM_DEDUP)) != 0 ||
+        item_slack(engine, old_it) < it->nbytes) {
+        return false;
+    }
+
+    item_hot_modified(engine, old_it);
+    char *data = item_get_data(old_it);
+    if (operation == OPERATION_APPEND) {
+        item_value_read(engine, it, 0, data + old_it->nbytes, it->nbytes);
+    } else {
+        memmove(data + it->nbytes, data, old_it->nbytes);
+        item_value_read(engine, it, 0, data, it->nbytes);
+    }
+
+    do_item_grow_value(engine, old_it, it->nbytes);
+    pthread_mutex_lock(&engine->stats.lock);
+    engine->stats.append_in_place++;
+    pthread_mutex_unlock(&engine->stats.lock);
+
+    item_set_cas(NULL, NULL, old_it, get_cas_id(engine, hv));
+    item_tap_changed(engine, old_it);
+    return true;
+}
+
+static void item_free(struct default_engine *engine, hash_item *it) {
+    size_t ntotal = ITEM_nslab(engine, it);
+    unsigned int clsid;
+    assert((it->iflag & ITEM_LINKED) == 0);
+    assert(it != engine->items.heads[item_lru(it)]);
+    assert(it != engine->items.tails[item_lru(it)]);
+    assert(it->refcount == 0);
+
+    item_free_value(engine, it);
+
+    /* so slab size changer can tell later if item is already free or not */
+    clsid = it->slabs_clsid;
+    it->slabs_clsid = 0;
+    it->iflag |= ITEM_SLABBED;
+    DEBUG_REFCNT(it, 'F');
+    slabs_free(engine, it, ntotal, clsid);
+}
+
+static void item_link_q(struct default_engine *engine, hash_item *it) { /* item is the new head */
+    hash_item **head, **tail;
+    assert(it->slabs_clsid < POWER_LARGEST);
+    assert((it->iflag & ITEM_SLABBED) == 0);
+
+    head = &engine->items.heads[item_lru(it)];
+    tail = &engine->items.tails[item_lru(it)];
+    assert(it != *head);
+    assert((*head && *tail) || (*head == 0 && *tail == 0));
+    it->prev = 0;
+    it->next = item_ref_of(engine, *head);
+    if (*head) (*head)->prev = item_ref_of(engine, it);
+    *head = it;
+    if (*tail == 0) *tail = it;
+    engine->items.sizes[item_lru(it)]++;
+    return;
+}
+
+static void item_unlink_q(struct default_engine *engine, hash_item *it) {
+    hash_item **head, **tail;
+    assert(it->slabs_clsid < POWER_LARGEST);
+    head = &engine->items.heads[item_lru(it)];
+    tail = &engine->items.tails[item_lru(it)];
+
+    hash_item *next = item_deref(engine, it->next);
+    hash_item *prev = item_deref(engine, it->prev);
+
+    if (*head == it) {
+        assert(prev == 0);
+        *head = next;
+    }
+    if (*tail == it) {
+        assert(next == 0);
+        *tail = prev;
+    }
+    assert(next != it);
+    assert(prev != it);
+
+    if (next) next->prev = it->prev;
+    if (prev) prev->next = it->next;
+    engine->items.sizes[item_lru(it)]--;
+    return;
+}
+
+/*
+ * Pick the segment of an item being linked with the admission filter on
+ * (see admission.h): seg unless the class is evicting and the item
+ * wasn't used more than the next victim. The caller holds the item lock
+ * and the LRU lock.
+ */
+static enum lru_segment lru_admit(struct default_engine *engine,
+                                  hash_item *it, uint32_t hv,
+                                  enum lru_segment seg) {
+    unsigned int id = it->slabs_clsid;
+    rel_time_t current_time = engine->server.core->get_current_time();
+
+    admission_record(engine, hv);
+    if (engine->items.itemstats[id].evicted == 0 ||
+        engine->items.evicting[id] + ADMISSION_WINDOW < current_time) {
+        return seg;
+    }
+
+    int vseg = -1;
+    hash_item *victim = victim_next(engine, id, NULL, &vseg);
+    while (victim != NULL && item_is_cursor(victim)) {
+        victim = victim_next(engine, id, victim, &vseg);
+    }
+    if (victim == NULL) {
+        return seg;
+    }
+    if (admission_estimate(engine, hv) >
+        admission_estimate(engine, item_hash(engine, victim))) {
+        ATOMIC_ADD_64(&engine->admission.admitted, 1);
+        return seg;
+    }
+    ATOMIC_ADD_64(&engine->admission.rejected, 1);
+
+    /* Make room for it by moving the oldest item on probation on */
+    unsigned int lru = lru_list(id, LRU_PROBATION);
+    hash_item *tail = engine->items.tails[lru];
+    uint32_t thv = 0;
+    if (tail != NULL &&
+        engine->items.sizes[lru] >= lru_class_size(engine, id) * PROBATION_LRU_PCT / 100 &&
+        !item_is_cursor(tail) && item_trylock_victim(engine, tail, &thv)) {
+        lru_move(engine, tail, LRU_COLD);
+        item_unlock_victim(engine, thv);
+    }
+    return LRU_PROBATION;
+}
+
+int do_item_link(struct default_engine *engine, hash_item *it) {
+    return do_item_link_hv(engine, it, item_hash(engine, it));
+}
+
+/*
+ * Same as do_item_link(), for callers that already hashed the key of
+ * the item (hv).
+ */
+static int do_item_link_hv(struct default_engine *engine, hash_item *it,
+                           uint32_t hv) {
+    MEMCACHED_ITEM_LINK(item_get_key(it), it->nkey, it->nbytes);
+    assert((it->iflag & (ITEM_LINKED|ITEM_SLABBED)) == 0);
+    assert(it->nbytes <= engine->config.item_size_max);
+    it->iflag |= ITEM_LINKED;
+    it->iflag &= ~ITEM_ACTIVE;
+    item_set_segment(it, engine->config.segmented_lru ? LRU_HOT : LRU_COLD);
+    it->time = engine->server.core->get_current_time();
+    if (engine->namespaces.count != 0) {
+        it->nsgen = namespace_generation(engine, item_get_key(it), it->nkey);
+    }
+    assoc_insert(engine, hv, it);
+    do_lease_end(engine, item_get_key(it), it->nkey, hv, true);
+
+    size_t ntotal = ITEM_ntotal(engine, it);
+    pthread_mutex_lock(&engine->stats.lock);
+    engine->stats.curr_bytes += ntotal;
+    engine->stats.curr_items += 1;
+    item_sizes_update(engine, ntotal, 1);
+    if ((it->iflag & ITEM_SLACK) != 0) {
+        engine->stats.append_slack += item_slack(engine, it);
+    }
+    engine->stats.total_items += 1;
+    pthread_mutex_unlock(&engine->stats.lock);
+
+    /* Allocate a new CAS ID on link. */
+    item_set_cas(NULL, NULL, it, get_cas_id(engine, hv));
+
+    lru_lock(engine, it->slabs_clsid);
+    if (engine->admission.enabled) {
+        item_set_segment(it, lru_admit(engine, it, hv, item_segment(it)));
+    }
+    item_link_q(engine, it);
+    lru_unlock(engine, it->slabs_clsid);
+    item_tap_changed(engine, it);
+
+    return 1;
+}
+
+/*
+ * Unlink an item from the hash table and the LRU. The caller must hold
+ * the item lock for the item, and if lru_locked is set the caller
+ * already holds the LRU lock for the item's slab class.
+ */
+static void do_item_unlink_internal(struct default_engine *engine,
+                                    hash_item *it, bool lru_locked) {
+    if ((it->iflag & ITEM_LINKED) != 0) {
+        do_item_unlink_hv(engine, it, lru_locked, item_hash(engine, it));
+    }
+}
+
+/* Same as do_item_unlink_internal(), with the hash of the key (hv) */
+static void do_item_unlink_hv(struct default_engine *engine,
+                              hash_item *it, bool lru_locked, uint32_t hv) {
+    MEMCACHED_ITEM_UNLINK(item_get_key(it), it->nkey, it->nbytes);
+    if ((it->iflag & ITEM_LINKED) != 0) {
+        item_hot_modified(engine, it);
+        it->iflag &= ~ITEM_LINKED;
+        size_t ntotal = ITEM_ntotal(engine, it);
+        pthread_mutex_lock(&engine->stats.lock);
+        engine->stats.curr_bytes -= ntotal;
+        engine->stats.curr_items -= 1;
+        item_sizes_update(engine, ntotal, -1);
+        if ((it->iflag & ITEM_SLACK) != 0) {
+            engine->stats.append_slack -= item_slack(engine, it);
+        }
+        pthread_mutex_unlock(&engine->stats.lock);
+        assoc_delete(engine, hv, item_get_key(it), it->nkey);
+        if (!lru_locked) {
+            lru_lock(engine, it->slabs_clsid);
+        }
+        item_unlink_q(engine, it);
+        if (!lru_locked) {
+            lru_unlock(engine, it->slabs_clsid);
+        }
+        item_tap_changed(engine, it);
+        if (it->refcount == 0) {
+            item_free(engine, it);
+        }
+    }
+}
+
+void do_item_unlink(struct default_engine *engine, hash_item *it) {
+    do_item_unlink_internal(engine, it, false);
+}
+
+void do_item_release(struct default_engine *engine, hash_item *it) {
+    MEMCACHED_ITEM_REMOVE(item_get_key(it), it->nkey, it->nbytes);
+    if (it->refcount != 0) {
+        it->refcount--;
+        DEBUG_REFCNT(it, '-');
+    }
+    if (it->refcount == 0 && (it->iflag & ITEM_LINKED) == 0) {
+        item_free(engine, it);
+    }
+}
+
+void do_item_update(struct default_engine *engine, hash_item *it) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    MEMCACHED_ITEM_UPDATE(item_get_key(it), it->nkey, it->nbytes);
+    if (engine->config.segmented_lru) {
+        /* Just flag the item, the LRU maintainer will move it */
+        if ((it->iflag & ITEM_ACTIVE) == 0) {
+            it->iflag |= ITEM_ACTIVE;
+            it->time = current_time;
+        }
+    } else if (item_segment(it) == LRU_PROBATION) {
+        /* It was used again, so it's off probation */
+        if ((it->iflag & ITEM_LINKED) != 0) {
+            lru_lock(engine, it->slabs_clsid);
+            it->time = current_time;
+            lru_move(engine, it, LRU_COLD);
+            lru_unlock(engine, it->slabs_clsid);
+        }
+    } else if (it->time < current_time - ITEM_UPDATE_INTERVAL) {
+        assert((it->iflag & ITEM_SLABBED) == 0);
+
+        if ((it->iflag & ITEM_LINKED) != 0) {
+            MEMCACHED_ITEM_BUMP(item_get_key(it), it->nkey, it->slabs_clsid,
+                                item_segment(it), item_segment(it));
+            lru_lock(engine, it->slabs_clsid);
+            item_unlink_q(engine, it);
+            it->time = current_time;
+            item_link_q(engine, it);
+            lru_unlock(engine, it->slabs_clsid);
+        }
+    }
+}
+
+int do_item_replace(struct default_engine *engine,
+                    hash_item *it, hash_item *new_it) {
+    return do_item_replace_hv(engine, it, new_it, item_hash(engine, it));
+}
+
+/*
+ * Same as do_item_replace(), with the hash of the key (hv) both items
+ * share.
+ */
+static int do_item_replace_hv(struct default_engine *engine,
+                              hash_item *it, hash_item *new_it, uint32_t hv) {
+    MEMCACHED_ITEM_REPLACE(item_get_key(it), it->nkey, it->nbytes,
+                           item_get_key(new_it), new_it->nkey, new_it->nbytes);
+    assert((it->iflag & ITEM_SLABBED) == 0);
+
+    do_item_unlink_hv(engine, it, false, hv);
+    return do_item_link_hv(engine, new_it, hv);
+}
+
+/*@null@*/
+static char *do_item_cachedump(const unsigned int slabs_clsid,
+                               const unsigned int limit,
+                               unsigned int *bytes) {
+#ifdef FUTURE
+    unsigned int memlimit = 2 * 1024 * 1024;   /* 2MB max response size */
+    char *buffer;
+    unsigned int bufcurr;
+    hash_item *it;
+    unsigned int len;
+    unsigned int shown = 0;
+    char key_temp[KEY_MAX_LENGTH + 1];
+    char temp[512];
+
+    it = engine->items.heads[slabs_clsid];
+
+    buffer = malloc((size_t)memlimit);
+    if (buffer == 0) return NULL;
+    bufcurr = 0;
+
+
+    while (it != NULL && (limit == 0 || shown < limit)) {
+        assert(it->nkey <= KEY_MAX_LENGTH);
+        /* Copy the key since it may not be null-terminated in the struct */
+        strncpy(key_temp, item_get_key(it), it->nkey);
+        key_temp[it->nkey] = 0x00; /* terminate */
+        len = snprintf(temp, sizeof(temp), "ITEM %s [%d b; %lu s]\r\n",
+                       key_temp, it->nbytes,
+                       (unsigned long)it->exptime + process_started);
+        if (bufcurr + len + 6 > memlimit)  /* 6 is END\r\n\0 */
+            break;
+        memcpy(buffer + bufcurr, temp, len);
+        bufcurr += len;
+        shown++;
+        it = item_deref(engine, it->next);
+    }
+
+
+    memcpy(buffer + bufcurr, "END\r\n", 6);
+    bufcurr += 5;
+
+    *bytes = bufcurr;
+    return buffer;
+#endif
+    (void)slabs_clsid;
+    (void)limit;
+    (void)bytes;
+    return NULL;
+}
+
+static void do_item_stats(struct default_engine *engine,
+                          ADD_STAT add_stats, const void *c) {
+    int i;
+    rel_time_t current_time = engine->server.core->get_current_time();
+    for (i = 0; i < POWER_LARGEST; i++) {
+        hash_item *oldest = NULL;
+        lru_lock(engine, i);
+        for (int seg = 0; seg < LRU_SEGMENTS; ++seg) {
+            unsigned int lru = lru_list(i, seg);
+            int search = search_items;
+            while (search > 0 &&
+                   engine->items.tails[lru] != NULL &&
+                   (item_is_flushed(engine, engine->items.tails[lru],
+                                    current_time) ||
+                    (engine->items.tails[lru]->exptime != 0 && /* and not expired */
+                     engine->items.tails[lru]->exptime < current_time))) {
+                --search;
+                if (engine->items.tails[lru]->refcount == 0) {
+                    do_item_unlink_internal(engine, engine->items.tails[lru],
+                                            true);
+                } else {
+                    break;
+                }
+            }
+            if (engine->items.tails[lru] != NULL &&
+                (oldest == NULL || engine->items.tails[lru]->time < oldest->time)) {
+                oldest = engine->items.tails[lru];
+            }
+        }
+
+        if (oldest != NULL) {
+            const char *prefix = "items";
+            add_statistics(c, add_stats, prefix, i, "number", "%u",
+                           lru_class_size(engine, i));
+            add_statistics(c, add_stats, prefix, i, "age", "%u",
+                           oldest->time);
+            add_statistics(c, add_stats, prefix, i, "evicted",
+                           "%u", engine->items.itemstats[i].evicted);
+            add_statistics(c, add_stats, prefix, i, "evicted_nonzero",
+                           "%u", engine->items.itemstats[i].evicted_nonzero);
+            add_statistics(c, add_stats, prefix, i, "evicted_time",
+                           "%u", engine->items.itemstats[i].evicted_time);
+            add_statistics(c, add_stats, prefix, i, "outofmemory",
+                           "%u", engine->items.itemstats[i].outofmemory);
+            add_statistics(c, add_stats, prefix, i, "tailrepairs",
+                           "%u", engine->items.itemstats[i].tailrepairs);;
+            add_statistics(c, add_stats, prefix, i, "reclaimed",
+                           "%u", engine->items.itemstats[i].reclaimed);;
+            static const char * const names[LRU_SEGMENTS] = {
+                [LRU_HOT] = "hot",
+                [LRU_WARM] = "warm",
+                [LRU_COLD] = "cold",
+                [LRU_PROBATION] = "probation"
+            };
+            char key[32];
+            for (int seg = 0; seg < LRU_SEGMENTS; ++seg) {
+                if (seg == LRU_PROBATION ? !engine->admission.enabled :
+                    !engine->config.segmented_lru) {
+                    continue;
+                }
+                snprintf(key, sizeof(key), "number_%s", names[seg]);
+                add_statistics(c, add_stats, prefix, i, key, "%u",
+                               engine->items.sizes[lru_list(i, seg)]);
+                snprintf(key, sizeof(key), "evicted_%s", names[seg]);
+                add_statistics(c, add_stats, prefix, i, key, "%u",
+                               engine->items.itemstats[i].evicted_segment[seg]);
+            }
+            if (engine->config.segmented_lru) {
+                add_statistics(c, add_stats, prefix, i, "moves_to_cold",
+                               "%u", engine->items.itemstats[i].moves_to_cold);
+                add_statistics(c, add_stats, prefix, i, "moves_to_warm",
+                               "%u", engine->items.itemstats[i].moves_to_warm);
+            }
+        }
+        lru_unlock(engine, i);
+    }
+}
+
+/**
+ * Dumps out the number of linked items of each size, with a granularity
+ * of 32 bytes. The histogram is kept up to date when the items are
+ * linked and unlinked, so we don't have to look at the items.
+ */
+static void do_item_stats_sizes(struct default_engine *engine,
+                                ADD_STAT add_stats, const void *c) {
+    for (uint32_t i = 0; i < engine->stats.nsizes; i++) {
+        if (engine->stats.sizes[i] != 0) {
+            char key[16], val[32];
+            int klen, vlen;
+            klen = snprintf(key, sizeof(key), "%u", i * 32);
+            vlen = snprintf(val, sizeof(val), "%u", engine->stats.sizes[i]);
+            assert(klen < sizeof(key));
+            assert(vlen < sizeof(val));
+            add_stats(key, klen, val, vlen, c);
+        }
+    }
+}
+
+/** wrapper around assoc_find which does the lazy expiration logic */
+static hash_item *do_item_get_hv(struct default_engine *engine,
+                                 const char *key, const size_t nkey,
+                                 uint32_t hv) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    hash_item *it = assoc_find(engine, hv, key, nkey);
+    int was_found = 0;
+
+    if (engine->config.verbose > 2) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        if (it == NULL) {
+            logger->log(EXTENSION_LOG_DEBUG, NULL,
+                        "> NOT FOUND %s", key);
+        } else {
+            logger->log(EXTENSION_LOG_DEBUG, NULL,
+                        "> FOUND KEY %s",
+                        (const char*)item_get_key(it));
+            was_found++;
+        }
+    }
+
+    if (it != NULL && item_is_flushed(engine, it, current_time)) {
+        do_item_unlink(engine, it);           /* MTSAFE - item lock held */
+        it = NULL;
+    }
+
+    if (it == NULL && was_found) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_DEBUG, NULL, " -nuked by flush");
+        was_found--;
+    }
+
+    if (it != NULL && it->exptime != 0 && it->exptime <= current_time) {
+        do_item_unlink(engine, it);           /* MTSAFE - item lock held */
+        it = NULL;
+    }
+
+    if (it == NULL && was_found) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_DEBUG, NULL, " -nuked by expire");
+        was_found--;
+    }
+
+    if (it != NULL) {
+        it->refcount++;
+        DEBUG_REFCNT(it, '+');
+        do_item_update(engine, it);
+    }
+
+    return it;
+}
+
+/***************************** VALUE COMPRESSION *****************************/
+
+/*
+ * With compress_min=N store_item() deflates the values of N bytes or
+ * more (before it grabs the item lock), and stores the compressed copy
+ * if that gets it into a smaller slab class. The value of the copy is
+ * the size of the original value (in network byte order) followed by
+ * the zlib stream, like a compressed TAP mutation. The items are only
+ * inflated again when they leave the engine (see item_decompress()), so
+ * the LRU, the slab rebalancer and the restart code deal with them like
+ * any other item.
+ *
+ * Every thread has its own zlib streams, output buffer and counters.
+ * We time one in COMPRESS_SAMPLE_RATE operations.
+ */
+#define COMPRESS_SAMPLE_RATE 64
+
+struct compress_state {
+    struct compress_state *next;
+    struct default_engine *engine;
+#ifdef HAVE_ZLIB_H
+    z_stream deflate;
+    z_stream inflate;
+#endif
+    char *buf;
+    size_t size;
+    uint32_t tick;
+    struct compression_counters counters;
+};
+
+static uint64_t compress_time_nsec(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+#endif
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+}
+
+static void compression_counters_add(struct compression_counters *to,
+                                     const struct compression_counters *from) {
+    to->compressed += from->compressed;
+    to->skipped += from->skipped;
+    to->decompressed += from->decompressed;
+    to->failed += from->failed;
+    to->compress_samples += from->compress_samples;
+    to->compress_ns += from->compress_ns;
+    to->decompress_samples += from->decompress_samples;
+    to->decompress_ns += from->decompress_ns;
+    for (int ii = 0; ii < POWER_LARGEST; ++ii) {
+        to->classes[ii].items += from->classes[ii].items;
+        to->classes[ii].bytes_in += from->classes[ii].bytes_in;
+        to->classes[ii].bytes_out += from->classes[ii].bytes_out;
+    }
+}
+
+static void compress_state_free(struct compress_state *st) {
+#ifdef HAVE_ZLIB_H
+    deflateEnd(&st->deflate);
+    inflateEnd(&st->inflate);
+#endif
+    free(st->buf);
+    free(st);
+}
+
+/* Called when a thread terminates */
+static void compress_state_release(void *arg) {
+    struct compress_state *st = arg;
+    struct default_engine *engine = st->engine;
+
+    pthread_mutex_lock(&engine->compression.lock);
+    compression_counters_add(&engine->compression.totals, &st->counters);
+    struct compress_state **prev = &engine->compression.states;
+    while (*prev != st) {
+        prev = &(*prev)->next;
+    }
+    *prev = st->next;
+    pthread_mutex_unlock(&engine->compression.lock);
+    compress_state_free(st);
+}
+
+void item_compression_init(struct default_engine *engine) {
+    if (engine->config.compress_min != 0 &&
+        pthread_key_create(&engine->compression.key,
+                           compress_state_release) == 0) {
+        engine->compression.enabled = true;
+    }
+}
+
+void item_compression_destroy(struct default_engine *engine) {
+    if (engine->compression.enabled) {
+        pthread_key_delete(engine->compression.key);
+        while (engine->compression.states != NULL) {
+            struct compress_state *st = engine->compression.states;
+            engine->compression.states = st->next;
+            compress_state_free(st);
+        }
+        engine->compression.enabled = false;
+    }
+    pthread_mutex_destroy(&engine->compression.lock);
+}
+
+#ifdef HAVE_ZLIB_H
+static struct compress_state *compress_state_get(struct default_engine *engine) {
+    struct compress_state *st = pthread_getspecific(engine->compression.key);
+    if (st == NULL) {
+        if ((st = calloc(1, sizeof(*st))) == NULL) {
+            return NULL;
+        }
+        if (deflateInit(&st->deflate, Z_BEST_SPEED) != Z_OK) {
+            free(st);
+            return NULL;
+        }
+        if (inflateInit(&st->inflate) != Z_OK ||
+            pthread_setspecific(engine->compression.key, st) != 0) {
+            inflateEnd(&st->inflate);
+            deflateEnd(&st->deflate);
+            free(st);
+            return NULL;
+        }
+        st->engine = engine;
+        pthread_mutex_lock(&engine->compression.lock);
+        st->next = engine->compression.states;
+        engine->compression.states = st;
+        pthread_mutex_unlock(&engine->compression.lock);
+    }
+    return st;
+}
+
+/*
+ * Is it worth storing a value of nbytes instead of the value of it? We
+ * want a smaller slab class (or at least a few chunks less if they are
+ * both chunked).
+ */
+static bool compress_saves_memory(struct default_engine *engine,
+                                  const hash_item *it, size_t nbytes) {
+    size_t ntotal = ITEM_ntotal(engine, it);
+    unsigned int id = slabs_clsid(engine, ntotal);
+    unsigned int cid = slabs_clsid(engine, ntotal - it->nbytes + nbytes);
+    if (id == 0 && cid == 0) {
+        return nbytes <= it->nbytes - it->nbytes / 8;
+    }
+    return id != cid;
+}
+#endif
+
+/*
+ * Get a compressed copy of an item (with a reference), or NULL if we
+ * should store the item as it is
+ */
+static hash_item *item_compress(struct default_engine *engine,
+                                hash_item *it, const void *cookie) {
+#ifdef HAVE_ZLIB_H
+    if (!engine->compression.enabled ||
+        it->nbytes < engine->config.compress_min ||
+        (it->iflag & ITEM_COMPRESSED) != 0) {
+        return NULL;
+    }
+
+    struct compress_state *st = compress_state_get(engine);
+    if (st == NULL) {
+        return NULL;
+    }
+
+    z_stream *z = &st->deflate;
+    deflateReset(z);
+    size_t bound = sizeof(uint32_t) + deflateBound(z, it->nbytes);
+    if (bound > st->size) {
+        char *buf = realloc(st->buf, bound);
+        if (buf == NULL) {
+            return NULL;
+        }
+        st->buf = buf;
+        st->size = bound;
+    }
+
+    bool timed = st->tick++ % COMPRESS_SAMPLE_RATE == 0;
+    uint64_t start = timed ? compress_time_nsec() : 0;
+    z->next_out = (Bytef*)st->buf + sizeof(uint32_t);
+    z->avail_out = bound - sizeof(uint32_t);
+    uint32_t npieces = item_value_npieces(engine, it);
+    int rv = Z_OK;
+    for (uint32_t ii = 0; ii < npieces && rv == Z_OK; ++ii) {
+        bool last = ii == npieces - 1;
+        size_t len;
+        z->next_in = (Bytef*)item_value_piece(engine, it, ii, &len);
+        z->avail_in = len;
+        rv = deflate(z, last ? Z_FINISH : Z_NO_FLUSH);
+        if (rv == Z_BUF_ERROR && !last) {
+            /* an empty piece */
+            rv = Z_OK;
+        }
+    }
+    if (timed) {
+        st->counters.compress_samples++;
+        st->counters.compress_ns += compress_time_nsec() - start;
+    }
+
+    size_t nbytes = sizeof(uint32_t) + z->total_out;
+    if (rv != Z_STREAM_END || !compress_saves_memory(engine, it, nbytes)) {
+        st->counters.skipped++;
+        return NULL;
+    }
+
+    /* The copy isn't in the hash table yet (see item_alloc()) */
+    unstriped_lock(engine);
+    hash_item *cit = do_item_alloc(engine, item_get_key(it), it->nkey,
+                                   it->flags, it->exptime, nbytes, cookie);
+    unstriped_unlock(engine);
+    if (cit == NULL) {
+        /* Just store the original */
+        return NULL;
+    }
+
+    uint32_t size = htonl(it->nbytes);
+    memcpy(st->buf, &size, sizeof(size));
+    item_value_write(engine, cit, 0, st->buf, nbytes);
+    item_set_cas(NULL, NULL, cit, item_get_cas(it));
+    cit->iflag |= ITEM_COMPRESSED;
+    cit->vbucket = it->vbucket;
+
+    st->counters.compressed++;
+    st->counters.classes[cit->slabs_clsid].items++;
+    st->counters.classes[cit->slabs_clsid].bytes_in += it->nbytes;
+    st->counters.classes[cit->slabs_clsid].bytes_out += nbytes;
+    return cit;
+#else
+    return NULL;
+#endif
+}
+
+#ifdef HAVE_ZLIB_H
+/* Inflate the value of src into dst (an item of the original size) */
+static bool item_inflate_value(struct default_engine *engine,
+                               struct compress_state *st,
+                               const hash_item *src, hash_item *dst) {
+    z_stream *z = &st->inflate;
+    uint32_t nin = item_value_npieces(engine, src);
+    uint32_t nout = item_value_npieces(engine, dst);
+    uint32_t in = 0, out = 0;
+    size_t skip = sizeof(uint32_t);
+    int rv = Z_OK;
+
+    inflateReset(z);
+    z->avail_in = 0;
+    z->avail_out = 0;
+    while (rv == Z_OK) {
+        size_t len;
+        if (z->avail_in == 0 && in < nin) {
+            char *piece = item_value_piece(engine, src, in++, &len);
+            if (skip >= len) {
+                skip -= len;
+                continue;
+            }
+            z->next_in = (Bytef*)piece + skip;
+            z->avail_in = len - skip;
+            skip = 0;
+        }
+        if (z->avail_out == 0 && out < nout) {
+            z->next_out = (Bytef*)item_value_piece(engine, dst, out++, &len);
+            z->avail_out = len;
+            continue;
+        }
+        rv = inflate(z, Z_NO_FLUSH);
+    }
+    return rv == Z_STREAM_END && z->total_out == dst->nbytes;
+}
+#endif
+
+/*
+ * Get an unlinked copy of a compressed item with the original value
+ * (with a reference), or NULL if we failed. We hold the item lock if
+ * locked is set.
+ */
+static hash_item *do_item_decompress(struct default_engine *engine,
+                                     hash_item *it, const void *cookie,
+                                     bool locked) {
+#ifdef HAVE_ZLIB_H
+    struct compress_state *st = NULL;
+    uint32_t size;
+    hash_item *copy = NULL;
+
+    if (engine->compression.enabled) {
+        st = compress_state_get(engine);
+    }
+    if (st == NULL || it->nbytes < sizeof(size)) {
+        return NULL;
+    }
+
+    item_value_read(engine, it, 0, &size, sizeof(size));
+    size = ntohl(size);
+    if (item_size_ok(engine, it->nkey, size)) {
+        if (!locked) {
+            unstriped_lock(engine);
+        }
+        copy = do_item_alloc(engine, item_get_key(it), it->nkey,
+                             it->flags, it->exptime, size, cookie);
+        if (!locked) {
+            unstriped_unlock(engine);
+        }
+    }
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->vbucket = it->vbucket;
+
+    bool timed = st->tick++ % COMPRESS_SAMPLE_RATE == 0;
+    uint64_t start = timed ? compress_time_nsec() : 0;
+    if (!item_inflate_value(engine, st, it, copy)) {
+        st->counters.failed++;
+        if (locked) {
+            do_item_release(engine, copy);
+        } else {
+            item_release(engine, copy);
+        }
+        return NULL;
+    }
+    if (timed) {
+        st->counters.decompress_samples++;
+        st->counters.decompress_ns += compress_time_nsec() - start;
+    }
+    st->counters.decompressed++;
+    item_set_cas(NULL, NULL, copy, item_get_cas(it));
+    return copy;
+#else
+    return NULL;
+#endif
+}
+
+hash_item *item_decompress(struct default_engine *engine, hash_item *it,
+                           const void *cookie) {
+    if ((it->iflag & ITEM_COMPRESSED) == 0) {
+        return it;
+    }
+    hash_item *copy = do_item_decompress(engine, it, cookie, false);
+    item_release(engine, it);
+    return copy;
+}
+
+void item_compression_stats(struct default_engine *engine,
+                            ADD_STAT add_stat, const void *cookie) {
+    const char *prefix = "compression";
+    struct compression_counters *total = calloc(1, sizeof(*total));
+    if (total == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&engine->compression.lock);
+    compression_counters_add(total, &engine->compression.totals);
+    for (struct compress_state *st = engine->compression.states;
+         st != NULL; st = st->next) {
+        compression_counters_add(total, &st->counters);
+    }
+    pthread_mutex_unlock(&engine->compression.lock);
+
+    add_statistics(cookie, add_stat, prefix, -1, "enabled", "%s",
+                   engine->compression.enabled ? "true" : "false");
+    add_statistics(cookie, add_stat, prefix, -1, "min", "%zu",
+                   engine->config.compress_min);
+    add_statistics(cookie, add_stat, prefix, -1, "compressed", "%"PRIu64,
+                   total->compressed);
+    add_statistics(cookie, add_stat, prefix, -1, "skipped", "%"PRIu64,
+                   total->skipped);
+    add_statistics(cookie, add_stat, prefix, -1, "decompressed", "%"PRIu64,
+                   total->decompressed);
+    add_statistics(cookie, add_stat, prefix, -1, "failed", "%"PRIu64,
+                   total->failed);
+    if (total->compress_samples != 0) {
+        add_statistics(cookie, add_stat, prefix, -1, "compress_ns",
+                       "%"PRIu64,
+                       total->compress_ns / total->compress_samples);
+    }
+    if (total->decompress_samples != 0) {
+        add_statistics(cookie, add_stat, prefix, -1, "decompress_ns",
+                       "%"PRIu64,
+                       total->decompress_ns / total->decompress_samples);
+    }
+    for (int ii = 0; ii < POWER_LARGEST; ++ii) {
+        if (total->classes[ii].items != 0) {
+            add_statistics(cookie, add_stat, prefix, ii, "items",
+                           "%"PRIu64, total->classes[ii].items);
+            add_statistics(cookie, add_stat, prefix, ii, "bytes_in",
+                           "%"PRIu64, total->classes[ii].bytes_in);
+            add_statistics(cookie, add_stat, prefix, ii, "bytes_out",
+                           "%"PRIu64, total->classes[ii].bytes_out);
+            add_statistics(cookie, add_stat, prefix, ii, "ratio", "%.2f",
+                           (double)total->classes[ii].bytes_in /
+                           total->classes[ii].bytes_out);
+        }
+    }
+    free(total);
+}
+
+/**************************** VALUE DEDUPLICATION ****************************/
+
+/*
+ * Get an item sharing the value of it with the other items storing the
+ * same one (see dedup.h), or NULL if we store it as it is. Like the
+ * compressed copy, the item isn't in the hash table yet.
+ */
+static hash_item *item_dedup(struct default_engine *engine, hash_item *it,
+                             const void *cookie) {
+    if (!engine->dedup.enabled || it->nbytes < engine->config.dedup_min) {
+        return NULL;
+    }
+
+    uint32_t hash = dedup_hash(engine, it);
+    hash_item *blob = dedup_get(engine, it, hash);
+    if (blob == NULL) {
+        unstriped_lock(engine);
+        blob = do_item_alloc(engine, "", 0, (int)hash, 0, it->nbytes, cookie);
+        unstriped_unlock(engine);
+        if (blob == NULL) {
+            return NULL;
+        }
+        item_copy_value(engine, blob, 0, it);
+        /* The items sharing it hold its references */
+        blob->refcount = 0;
+        hash_item *shared = dedup_add(engine, blob);
+        if (shared != blob) {
+            item_free(engine, blob);
+            blob = shared;
+        }
+    }
+
+    unstriped_lock(engine);
+    hash_item *dit = do_item_alloc(engine, item_get_key(it), it->nkey,
+                                   it->flags, it->exptime, sizeof(item_ref),
+                                   cookie);
+    unstriped_unlock(engine);
+    if (dit == NULL) {
+        if (dedup_release(engine, blob)) {
+            item_free(engine, blob);
+        }
+        return NULL;
+    }
+
+    item_ref ref = item_ref_of(engine, blob);
+    memcpy(item_get_data(dit), &ref, sizeof(ref));
+    dit->iflag |= ITEM_DEDUP;
+    dit->nbytes = it->nbytes;
+    dit->vbucket = it->vbucket;
+    item_set_cas(NULL, NULL, dit, item_get_cas(it));
+    return dit;
+}
+
+/*
+ * Get the item to store in place of it: one sharing its value, or a
+ * compressed copy (a shared value isn't worth compressing), or NULL
+ */
+static hash_item *item_pack(struct default_engine *engine, hash_item *it,
+                            const void *cookie) {
+    hash_item *packed = item_dedup(engine, it, cookie);
+    if (packed == NULL) {
+        packed = item_compress(engine, it, cookie);
+    }
+    return packed;
+}
+
+/****************************** EXTERNAL STORE *******************************/
+
+/* The most items we move to the external store in one go */
+#define EXT_FLUSH_BATCH 64
+#define EXT_FLUSHER_BUSY_SLEEP 1000
+#define EXT_FLUSHER_IDLE_SLEEP 10000
+
+/* The value of an item we moved to the external store */
+struct item_ext_value {
+    struct ext_loc loc;
+    /* The internal flags of the original item (ITEM_COMPRESSED) */
+    uint16_t iflag;
+};
+
+/* A read from the external store for a client */
+struct item_ext_fetch {
+    struct ext_job job;
+    const void *cookie;
+    uint16_t nkey;
+    char key[];
+};
+
+/*
+ * Collect (and reference) up to max items at the tail of the cold segment
+ * of a slab class that we may move to the external store.
+ */
+static int item_ext_collect(struct default_engine *engine, unsigned int id,
+                            hash_item **items, int max) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    int count = 0;
+    uint32_t hv = 0;
+
+    lru_walk_lock(engine, id);
+    hash_item *search = engine->items.tails[lru_list(id, LRU_COLD)];
+    for (int tries = search_items * 4; search != NULL && tries > 0 &&
+             count < max; --tries, search = item_deref(engine, search->prev)) {
+        if (item_is_cursor(search) || search->refcount != 0 ||
+            (search->iflag & (ITEM_EXTERNAL | ITEM_DEDUP)) != 0 ||
+            search->nbytes < engine->config.ext_item_min ||
+            search->nkey + (size_t)search->nbytes > engine->ext.page_size ||
+            (search->exptime != 0 && search->exptime <= current_time) ||
+            search->time + engine->config.ext_item_age > current_time) {
+            continue;
+        }
+        if (!item_trylock_victim(engine, search, &hv)) {
+            continue;
+        }
+        search->refcount++;
+        DEBUG_REFCNT(search, '+');
+        items[count++] = search;
+        item_unlock_victim(engine, hv);
+    }
+    lru_walk_unlock(engine, id);
+    return count;
+}
+
+/*
+ * Write the key and the value of an item to the external store and
+ * replace it with a header holding the location of the record. Returns
+ * false if the external store is full right now.
+ */
+static bool item_ext_flush(struct default_engine *engine, hash_item *it) {
+    uint32_t npieces = item_value_npieces(engine, it);
+    struct iovec iov[npieces + 1];
+    struct item_ext_value value;
+
+    iov[0].iov_base = (void*)item_get_key(it);
+    iov[0].iov_len = it->nkey;
+    for (uint32_t ii = 0; ii < npieces; ++ii) {
+        size_t len;
+        iov[ii + 1].iov_base = item_value_piece(engine, it, ii, &len);
+        iov[ii + 1].iov_len = len;
+    }
+    if (!ext_write(engine, iov, (int)npieces + 1, &value.loc)) {
+        return false;
+    }
+    value.iflag = it->iflag & ITEM_COMPRESSED;
+
+    hash_item *hdr = item_alloc(engine, item_get_key(it), it->nkey,
+                                it->flags, it->exptime, sizeof(value), NULL);
+    if (hdr == NULL) {
+        /* We'll try again later (the record is just wasted space) */
+        return true;
+    }
+    memcpy(item_get_data(hdr), &value, sizeof(value));
+    hdr->iflag |= ITEM_EXTERNAL;
+    hdr->vbucket = it->vbucket;
+
+    uint32_t hv = item_hash(engine, it);
+    bool replaced = false;
+    item_lock(engine, hv);
+    if ((it->iflag & ITEM_LINKED) != 0) {
+        /* It may have been touched since we copied the exptime */
+        uint64_t cas = item_get_cas(it);
+        hdr->exptime = it->exptime;
+        do_item_replace(engine, it, hdr);
+        item_set_cas(NULL, NULL, hdr, cas);
+        replaced = true;
+    }
+    item_unlock(engine, hv);
+    item_release(engine, hdr);
+
+    if (replaced) {
+        pthread_mutex_lock(&engine->ext.lock);
+        engine->ext.items_flushed++;
+        pthread_mutex_unlock(&engine->ext.lock);
+    }
+    return true;
+}
+
+static void *item_ext_flusher_main(void *arg) {
+    struct default_engine *engine = arg;
+    hash_item *batch[EXT_FLUSH_BATCH];
+
+    engine->server.core->place_background_thread();
+
+    while (engine->items.ext_flusher_running) {
+        bool busy = false;
+        bool full = false;
+
+        for (int id = POWER_SMALLEST; id < POWER_LARGEST && !full; ++id) {
+            if (lru_class_size(engine, id) == 0 ||
+                !slabs_memory_low(engine, id)) {
+                continue;
+            }
+            int count = item_ext_collect(engine, id, batch, EXT_FLUSH_BATCH);
+            for (int ii = 0; ii < count; ++ii) {
+                if (!full && !item_ext_flush(engine, batch[ii])) {
+                    full = true;
+                }
+                item_release(engine, batch[ii]);
+            }
+            busy |= count > 0;
+        }
+
+        usleep(busy && !full ? EXT_FLUSHER_BUSY_SLEEP : EXT_FLUSHER_IDLE_SLEEP);
+    }
+
+    return NULL;
+}
+
+ENGINE_ERROR_CODE item_ext_flusher_start(struct default_engine *engine) {
+    if (!engine->ext.enabled) {
+        return ENGINE_SUCCESS;
+    }
+
+    engine->items.ext_flusher_running = true;
+    if (pthread_create(&engine->items.ext_flusher, NULL,
+                       item_ext_flusher_main, engine) != 0) {
+        engine->items.ext_flusher_running = false;
+        return ENGINE_FAILED;
+    }
+    return ENGINE_SUCCESS;
+}
+
+void item_ext_flusher_stop(struct default_engine *engine) {
+    if (engine->items.ext_flusher_running) {
+        engine->items.ext_flusher_running = false;
+        pthread_join(engine->items.ext_flusher, NULL);
+    }
+}
+
+/*
+ * Read the value of the item with the given key back from the external
+ * store and put the item back into the cache (unless someone replaced
+ * the header in the meantime). Returns ENGINE_SUCCESS if the caller should
+ * look the item up again.
+ */
+static ENGINE_ERROR_CODE item_ext_load(struct default_engine *engine,
+                                       const char *key, uint16_t nkey,
+                                       const void *cookie) {
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
+    struct item_ext_value value;
+
+    item_lock(engine, hv);
+    hash_item *hdr = do_item_get_hv(engine, key, nkey, hv);
+    item_unlock(engine, hv);
+    if (hdr == NULL) {
+        return ENGINE_KEY_ENOENT;
+    }
+    if ((hdr->iflag & ITEM_EXTERNAL) == 0) {
+        item_release(engine, hdr);
+        return ENGINE_SUCCESS;
+    }
+
+    memcpy(&value, item_get_data(hdr), sizeof(value));
+    hash_item *it = NULL;
+    if (value.loc.nbytes >= nkey &&
+        item_size_ok(engine, nkey, value.loc.nbytes - nkey)) {
+        it = item_alloc(engine, key, nkey, hdr->flags, hdr->exptime,
+                        value.loc.nbytes - nkey, cookie);
+    }
+    if (it == NULL) {
+        item_release(engine, hdr);
+        return ENGINE_ENOMEM;
+    }
+    it->vbucket = hdr->vbucket;
+
+    uint32_t npieces = item_value_npieces(engine, it);
+    struct iovec iov[npieces + 1];
+    char kbuf[nkey];
+    iov[0].iov_base = kbuf;
+    iov[0].iov_len = nkey;
+    for (uint32_t ii = 0; ii < npieces; ++ii) {
+        size_t len;
+        iov[ii + 1].iov_base = item_value_piece(engine, it, ii, &len);
+        iov[ii + 1].iov_len = len;
+    }
+    bool ok = ext_read(engine, &value.loc, iov, (int)npieces + 1) &&
+        memcmp(kbuf, key, nkey) == 0;
+    it->iflag |= value.iflag & ITEM_COMPRESSED;
+
+    bool linked = false;
+    item_lock(engine, hv);
+    if ((hdr->iflag & ITEM_LINKED) != 0) {
+        linked = true;
+        if (ok) {
+            uint64_t cas = item_get_cas(hdr);
+            it->exptime = hdr->exptime;
+            do_item_replace(engine, hdr, it);
+            item_set_cas(NULL, NULL, it, cas);
+        } else {
+            /* The record was overwritten */
+            do_item_unlink(engine, hdr);
+        }
+    }
+    item_unlock(engine, hv);
+    item_release(engine, it);
+    item_release(engine, hdr);
+
+    if (linked) {
+        pthread_mutex_lock(&engine->ext.lock);
+        if (ok) {
+            engine->ext.items_fetched++;
+        } else {
+            engine->ext.items_lost++;
+        }
+        pthread_mutex_unlock(&engine->ext.lock);
+    }
+    return ok ? ENGINE_SUCCESS : ENGINE_KEY_ENOENT;
+}
+
+static void item_ext_fetch_run(struct default_engine *engine,
+                               struct ext_job *job) {
+    struct item_ext_fetch *fetch = (struct item_ext_fetch*)job;
+    ENGINE_ERROR_CODE ret;
+
+    ret = item_ext_load(engine, fetch->key, fetch->nkey, fetch->cookie);
+    engine->server.cookie->notify_io_complete(fetch->cookie, ret);
+    engine->server.cookie->release(fetch->cookie);
+    free(fetch);
+}
+
+ENGINE_ERROR_CODE item_ext_get(struct default_engine *engine, hash_item *it,
+                               const void *cookie) {
+    struct item_ext_fetch *fetch = malloc(sizeof(*fetch) + it->nkey);
+    if (fetch == NULL) {
+        item_release(engine, it);
+        return ENGINE_ENOMEM;
+    }
+
+    fetch->job.run = item_ext_fetch_run;
+    fetch->cookie = cookie;
+    fetch->nkey = it->nkey;
+    memcpy(fetch->key, item_get_key(it), it->nkey);
+    item_release(engine, it);
+
+    engine->server.cookie->reserve(cookie);
+    ext_submit(engine, &fetch->job);
+    return ENGINE_EWOULDBLOCK;
+}
+
+hash_item *item_ext_resolve(struct default_engine *engine, hash_item *it,
+                            const void *cookie) {
+    if ((it->iflag & ITEM_EXTERNAL) == 0) {
+        return it;
+    }
+
+    uint16_t nkey = it->nkey;
+    char key[nkey];
+    memcpy(key, item_get_key(it), nkey);
+    item_release(engine, it);
+
+    if (item_ext_load(engine, key, nkey, cookie) != ENGINE_SUCCESS) {
+        return NULL;
+    }
+    it = item_get(engine, key, nkey);
+    if (it != NULL && (it->iflag & ITEM_EXTERNAL) != 0) {
+        /* Moved out again already */
+        item_release(engine, it);
+        it = NULL;
+    }
+    return it;
+}
+
+/*
+ * Stores an item in the cache according to the semantics of one of the set
+ * commands. In threaded mode, this is protected by the cache lock.
+ *
+ * Returns the state of storage.
+ */
+static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
+                                       hash_item *it, uint64_t *cas,
+                                       ENGINE_STORE_OPERATION operation,
+                                       const void *cookie, uint32_t hv) {
+    const char *key = item_get_key(it);
+    hash_item *old_it = do_item_get_hv(engine, key, it->nkey, hv);
+    ENGINE_ERROR_CODE stored = ENGINE_NOT_STORED;
+
+    hash_item *new_it = NULL;
+
+    if (old_it != NULL && operation == OPERATION_ADD) {
+        /* add only adds a nonexistent item, but promote to head of LRU */
+        do_item_update(engine, old_it);
+    } else if (!old_it && (operation == OPERATION_REPLACE
+        || operation == OPERATION_APPEND || operation == OPERATION_PREPEND))
+    {
+        /* replace only replaces an existing value; don't store */
+    } else if (operation == OPERATION_CAS) {
+        /* validate cas operation */
+        if(old_it == NULL) {
+            if (do_lease_valid(engine, key, it->nkey, hv, item_get_cas(it))) {
+                // the lease holder fills the key in
+                do_item_link_hv(engine, it, hv);
+                stored = ENGINE_SUCCESS;
+            } else {
+                // LRU expired
+                stored = ENGINE_KEY_ENOENT;
+            }
         }
         else if (item_get_cas(it) == item_get_cas(old_it)) {
             // cas validates
             // it and old_it may belong to different classes.
             // I'm updating the stats for the one that's getting pushed out
-            do_item_replace(engine, old_it, it);
+            do_item_replace_hv(engine, old_it, it, hv);
             stored = ENGINE_SUCCESS;
         } else {
             if (engine->config.verbose > 1) {
@@ -594,544 +2519,2055 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
                         item_get_cas(old_it),
                         item_get_cas(it));
             }
-            stored = ENGINE_KEY_EEXISTS;
+            stored = ENGINE_KEY_EEXISTS;
+        }
+    } else {
+        /*
+         * Append - combine new and old record into single one. Here it's
+         * atomic and thread-safe.
+         */
+        if (operation == OPERATION_APPEND || operation == OPERATION_PREPEND) {
+            /*
+             * Validate CAS
+             */
+            if (item_get_cas(it) != 0) {
+                // CAS much be equal
+                if (item_get_cas(it) != item_get_cas(old_it)) {
+                    stored = ENGINE_KEY_EEXISTS;
+                }
+            }
+
+            if (stored == ENGINE_NOT_STORED &&
+                do_item_append_in_place(engine, old_it, it, operation, hv)) {
+                stored = ENGINE_SUCCESS;
+                it = old_it;
+            }
+
+            if (stored == ENGINE_NOT_STORED) {
+                /* the combined value is stored uncompressed */
+                hash_item *old_value = old_it;
+                if ((old_it->iflag & ITEM_EXTERNAL) != 0) {
+                    /* moved out again after store_item() fetched it */
+                    old_value = NULL;
+                } else if ((old_it->iflag & ITEM_COMPRESSED) != 0) {
+                    old_value = do_item_decompress(engine, old_it, cookie,
+                                                   true);
+                }
+
+                /* we have it and old_it here - alloc memory to hold both */
+                if (old_value != NULL) {
+                    new_it = do_item_alloc_slack(engine, key, it->nkey,
+                                                 old_it->flags,
+                                                 old_it->exptime,
+                                                 it->nbytes + old_value->nbytes,
+                                                 cookie);
+                }
+
+                if (new_it == NULL) {
+                    /* SERVER_ERROR out of memory */
+                    if (old_value != NULL && old_value != old_it) {
+                        do_item_release(engine, old_value);
+                    }
+                    if (old_it != NULL) {
+                        do_item_release(engine, old_it);
+                    }
+
+                    return ENGINE_NOT_STORED;
+                }
+                new_it->vbucket = it->vbucket;
+                if ((old_it->iflag & ITEM_DEDUP) != 0) {
+                    dedup_copied(engine, item_dedup_blob(engine, old_it));
+                }
+
+                /* copy data from it and old_it to new_it */
+
+                if (operation == OPERATION_APPEND) {
+                    item_copy_value(engine, new_it, 0, old_value);
+                    item_copy_value(engine, new_it, old_value->nbytes, it);
+                } else {
+                    /* OPERATION_PREPEND */
+                    item_copy_value(engine, new_it, 0, it);
+                    item_copy_value(engine, new_it, it->nbytes, old_value);
+                }
+
+                if (old_value != old_it) {
+                    do_item_release(engine, old_value);
+                }
+                it = new_it;
+            }
+        }
+
+        if (stored == ENGINE_NOT_STORED) {
+            if (old_it != NULL) {
+                do_item_replace_hv(engine, old_it, it, hv);
+            } else {
+                do_item_link_hv(engine, it, hv);
+            }
+
+            *cas = item_get_cas(it);
+            stored = ENGINE_SUCCESS;
+        }
+    }
+
+    if (old_it != NULL) {
+        do_item_release(engine, old_it);         /* release our reference */
+    }
+
+    if (new_it != NULL) {
+        do_item_release(engine, new_it);
+    }
+
+    if (stored == ENGINE_SUCCESS) {
+        *cas = item_get_cas(it);
+    }
+
+    return stored;
+}
+
+
+/*
+ * A counter (ITEM_COUNTER) is an item incr and decr went through: it
+ * keeps the number in binary at the end of its slab chunk, next to the
+ * digits in the value, so that the next incr doesn't have to parse them.
+ * The chunk has room for the longest number, so the value grows in
+ * place. The digits are still what every reader of the value sees.
+ */
+#define COUNTER_DIGITS 20
+
+static inline uint64_t *item_counter(struct default_engine *engine,
+                                     const hash_item *it) {
+    char *end = (char*)it + engine->slabs.slabclass[it->slabs_clsid].size;
+    return (uint64_t*)(end - sizeof(uint64_t));
+}
+
+/* Does the slab chunk of the item have room for it to be a counter? */
+static inline bool item_counter_fits(struct default_engine *engine,
+                                     const hash_item *it) {
+    if ((it->iflag & ITEM_CHUNKED) != 0) {
+        return false;
+    }
+    size_t room = ITEM_ntotal(engine, it) - it->nbytes + COUNTER_DIGITS +
+        sizeof(uint64_t);
+    return room <= engine->slabs.slabclass[it->slabs_clsid].size;
+}
+
+/*
+ * Turn a linked item into a counter (the caller sets the number). The
+ * room of an ITEM_SLACK item is no longer for appends.
+ */
+static void do_item_make_counter(struct default_engine *engine,
+                                 hash_item *it) {
+    if ((it->iflag & ITEM_SLACK) != 0) {
+        pthread_mutex_lock(&engine->stats.lock);
+        engine->stats.append_slack -= item_slack(engine, it);
+        pthread_mutex_unlock(&engine->stats.lock);
+        it->iflag &= ~ITEM_SLACK;
+    }
+    it->iflag |= ITEM_COUNTER;
+}
+
+/*
+ * Allocate a counter with a value of nbytes digits (the caller sets the
+ * number if it has ITEM_COUNTER)
+ */
+static hash_item *do_item_alloc_counter(struct default_engine *engine,
+                                        const void *key, const size_t nkey,
+                                        const int flags,
+                                        const rel_time_t exptime,
+                                        const int nbytes,
+                                        const void *cookie) {
+    const int room = COUNTER_DIGITS + sizeof(uint64_t);
+    size_t ntotal = sizeof(hash_item) + nkey + room;
+    if (engine->config.use_cas) {
+        ntotal += sizeof(uint64_t);
+    }
+    if (slabs_clsid(engine, ntotal) == 0) {
+        return do_item_alloc(engine, key, nkey, flags, exptime, nbytes,
+                             cookie);
+    }
+
+    hash_item *it = do_item_alloc(engine, key, nkey, flags, exptime, room,
+                                  cookie);
+    if (it != NULL) {
+        slabs_adjust_mem_requested(engine, it->slabs_clsid, ntotal,
+                                   ntotal - room + nbytes);
+        it->nbytes = nbytes;
+        it->iflag |= ITEM_COUNTER;
+    }
+    return it;
+}
+
+/* Format a number (without the '\0'), and get its length */
+static int counter_format(uint64_t value, char *buf) {
+    char digits[COUNTER_DIGITS];
+    int len = 0;
+    do {
+        digits[COUNTER_DIGITS - ++len] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    memcpy(buf, digits + COUNTER_DIGITS - len, len);
+    return len;
+}
+
+/*
+ * adds a delta value to a numeric item.
+ *
+ * c     connection requesting the operation
+ * it    item to adjust
+ * incr  true to increment value, false to decrement
+ * delta amount to adjust value by
+ * buf   buffer for response string
+ *
+ * returns a response string to send back to the client.
+ */
+static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
+                                      hash_item *it, const bool incr,
+                                      const int64_t delta, uint64_t *rcas,
+                                      uint64_t *result, const void *cookie) {
+    uint64_t value;
+    char buf[COUNTER_DIGITS];
+    int res;
+
+    if ((it->iflag & ITEM_COUNTER) != 0) {
+        value = *item_counter(engine, it);
+    } else {
+        /* The compressed values are longer than any number (see
+         * compress_min), and so are the shared ones (dedup_min) and the
+         * ones in the external store (see ext_item_min) */
+        char str[80];
+        if (it->nbytes >= (sizeof(str) - 1) ||
+            (it->iflag & (ITEM_COMPRESSED | ITEM_EXTERNAL)) != 0) {
+            return ENGINE_EINVAL;
+        }
+
+        memcpy(str, item_get_data(it), it->nbytes);
+        str[it->nbytes] = '\0';
+
+        if (!safe_strtoull(str, &value)) {
+            return ENGINE_EINVAL;
+        }
+    }
+
+    if (incr) {
+        value += delta;
+    } else {
+        if(delta > value) {
+            value = 0;
+        } else {
+            value -= delta;
+        }
+    }
+
+    *result = value;
+    res = counter_format(value, buf);
+
+    if (it->refcount == 1 &&
+        (res <= it->nbytes || item_counter_fits(engine, it))) {
+        // we can do inline replacement
+        item_hot_modified(engine, it);
+        if (item_counter_fits(engine, it)) {
+            do_item_make_counter(engine, it);
+            *item_counter(engine, it) = value;
+        }
+        if (res > it->nbytes) {
+            do_item_grow_value(engine, it, res - it->nbytes);
+        }
+        memcpy(item_get_data(it), buf, res);
+        memset(item_get_data(it) + res, ' ', it->nbytes - res);
+        item_set_cas(NULL, NULL, it, get_cas_id(engine, item_hash(engine, it)));
+        item_tap_changed(engine, it);
+        *rcas = item_get_cas(it);
+    } else {
+        hash_item *new_it = do_item_alloc_counter(engine, item_get_key(it),
+                                                  it->nkey, it->flags,
+                                                  it->exptime, res,
+                                                  cookie);
+        if (new_it == NULL) {
+            do_item_unlink(engine, it);
+            return ENGINE_ENOMEM;
+        }
+        if ((new_it->iflag & ITEM_COUNTER) != 0) {
+            *item_counter(engine, new_it) = value;
+        }
+        memcpy(item_get_data(new_it), buf, res);
+        new_it->vbucket = it->vbucket;
+        do_item_replace(engine, it, new_it);
+        *rcas = item_get_cas(new_it);
+        do_item_release(engine, new_it);       /* release our reference */
+    }
+
+    return ENGINE_SUCCESS;
+}
+
+/********************************* ITEM ACCESS *******************************/
+
+/*
+ * Allocates a new item.
+ */
+hash_item *item_alloc(struct default_engine *engine,
+                      const void *key, size_t nkey, int flags,
+                      rel_time_t exptime, int nbytes, const void *cookie) {
+    hash_item *it;
+    /* The new item isn't in the hash table yet so we don't need an item
+     * lock (do_item_alloc locks the LRU it picks victims from) */
+    unstriped_lock(engine);
+    it = do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie);
+    unstriped_unlock(engine);
+    return it;
+}
+
+/*
+ * Allocate all of the items with their status set to ENGINE_SUCCESS
+ * while holding the lock item_alloc takes (if any) just once.
+ */
+void item_alloc_multi(struct default_engine *engine,
+                      allocate_multi_item *items, int nitems,
+                      const void *cookie) {
+    unstriped_lock(engine);
+    for (int ii = 0; ii < nitems; ++ii) {
+        if (items[ii].status != ENGINE_SUCCESS) {
+            continue;
+        }
+        rel_time_t exptime = engine->server.core->realtime(items[ii].exptime);
+        items[ii].item = do_item_alloc(engine, items[ii].key, items[ii].nkey,
+                                       items[ii].flags, exptime,
+                                       (int)items[ii].nbytes, cookie);
+        if (items[ii].item == NULL) {
+            items[ii].status = ENGINE_ENOMEM;
+        }
+    }
+    unstriped_unlock(engine);
+}
+
+/*
+ * Returns an item if it hasn't been marked as expired,
+ * lazy-expiring as needed.
+ */
+hash_item *item_get(struct default_engine *engine,
+                    const void *key, const size_t nkey) {
+    return item_get_hv(engine, key, nkey,
+                       engine->server.core->hash(key, nkey, 0));
+}
+
+hash_item *item_get_hv(struct default_engine *engine,
+                       const void *key, const size_t nkey, uint32_t hv) {
+    hash_item *it;
+    if (!assoc_maybe_present(engine, hv)) {
+        return NULL;
+    }
+    item_lock(engine, hv);
+    it = do_item_get_hv(engine, key, nkey, hv);
+    if (it == NULL) {
+        assoc_filter_missed(engine);
+    }
+    item_unlock(engine, hv);
+    return it;
+}
+
+ENGINE_ERROR_CODE item_lease_miss(struct default_engine *engine,
+                                  const void *cookie,
+                                  const void *key, const size_t nkey,
+                                  uint32_t hv, hash_item **it) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    item_lock(engine, hv);
+    if ((*it = do_item_get_hv(engine, key, nkey, hv)) == NULL &&
+        do_lease_miss(engine, cookie, key, nkey, hv) == ENGINE_EWOULDBLOCK) {
+        ret = ENGINE_EWOULDBLOCK;
+    }
+    item_unlock(engine, hv);
+    return ret;
+}
+
+/*
+ * Look up all of the keys in a batch with their status set to
+ * ENGINE_SUCCESS. The hash values are computed before we grab any locks,
+ * and the lock is only taken once for every run of keys living in the
+ * same stripe (without lock striping that is the whole batch). Once we
+ * hold the lock the lookups of the run are pipelined: we prefetch all of
+ * their buckets, then the first item of every chain, and only then walk
+ * the chains, so that the cache misses overlap instead of being taken
+ * one after the other. The keys the Bloom filter (if any) rules out
+ * don't need the lock at all.
+ */
+void item_get_multi(struct default_engine *engine,
+                    get_multi_key *keys, int nkeys) {
+    uint32_t hv[ITEM_GET_MULTI_BATCH];
+
+    while (nkeys > 0) {
+        int batch = nkeys < ITEM_GET_MULTI_BATCH ? nkeys : ITEM_GET_MULTI_BATCH;
+        for (int ii = 0; ii < batch; ++ii) {
+            hv[ii] = engine->server.core->hash(keys[ii].key, keys[ii].nkey, 0);
+            if (engine->admission.enabled) {
+                admission_record(engine, hv[ii]);
+            }
+            if (keys[ii].status == ENGINE_SUCCESS &&
+                !assoc_maybe_present(engine, hv[ii])) {
+                keys[ii].status = ENGINE_KEY_ENOENT;
+            }
+        }
+
+        int ii = 0;
+        while (ii < batch) {
+            int end = ii + 1;
+            if (striped(engine)) {
+                uint32_t stripe = hv[ii] & engine->item_lock_mask;
+                while (end < batch &&
+                       (hv[end] & engine->item_lock_mask) == stripe) {
+                    ++end;
+                }
+            } else {
+                end = batch;
+            }
+
+            /* The filter may have answered for the whole run */
+            int wanted = 0;
+            for (int jj = ii; jj < end; ++jj) {
+                wanted += keys[jj].status == ENGINE_SUCCESS;
+            }
+            if (wanted == 0) {
+                ii = end;
+                continue;
+            }
+
+            item_lock(engine, hv[ii]);
+            for (int jj = ii; jj < end; ++jj) {
+                if (keys[jj].status == ENGINE_SUCCESS) {
+                    assoc_prefetch(engine, hv[jj]);
+                }
+            }
+            if (wanted > 1) {
+                for (int jj = ii; jj < end; ++jj) {
+                    if (keys[jj].status == ENGINE_SUCCESS) {
+                        assoc_prefetch_item(engine, hv[jj]);
+                    }
+                }
+            }
+            for (int jj = ii; jj < end; ++jj) {
+                if (keys[jj].status != ENGINE_SUCCESS) {
+                    continue;
+                }
+                keys[jj].item = do_item_get_hv(engine, keys[jj].key,
+                                               keys[jj].nkey, hv[jj]);
+                if (keys[jj].item == NULL) {
+                    keys[jj].status = ENGINE_KEY_ENOENT;
+                    assoc_filter_missed(engine);
+                }
+            }
+            item_unlock(engine, hv[ii]);
+            ii = end;
+        }
+
+        keys += batch;
+        nkeys -= batch;
+    }
+}
+
+static inline bool store_combines(ENGINE_STORE_OPERATION operation) {
+    return operation == OPERATION_APPEND || operation == OPERATION_PREPEND;
+}
+
+static inline bool same_item_lock(struct default_engine *engine,
+                                  uint32_t hv1, uint32_t hv2) {
+    return !striped(engine) || ((hv1 ^ hv2) & engine->item_lock_mask) == 0;
+}
+
+/*
+ * Store all of the items with their status set to ENGINE_SUCCESS, in
+ * order. Like item_get_multi we hash (and pack) a batch of items
+ * before grabbing any locks, and then store every run of items living in
+ * the same stripe with the lock taken once. An append or prepend needs
+ * the old value in memory (see store_item()), so it is stored on its
+ * own and ends the run.
+ */
+void item_store_multi(struct default_engine *engine,
+                      store_multi_item *items, int nitems,
+                      const void *cookie) {
+    uint32_t hv[ITEM_STORE_MULTI_BATCH];
+    hash_item *compressed[ITEM_STORE_MULTI_BATCH];
+
+    while (nitems > 0) {
+        int batch = nitems < ITEM_STORE_MULTI_BATCH ? nitems : ITEM_STORE_MULTI_BATCH;
+        for (int ii = 0; ii < batch; ++ii) {
+            compressed[ii] = NULL;
+            if (items[ii].status == ENGINE_SUCCESS &&
+                !store_combines(items[ii].operation)) {
+                hv[ii] = item_hash(engine, items[ii].item);
+                compressed[ii] = item_pack(engine, items[ii].item, cookie);
+            }
+        }
+
+        int ii = 0;
+        while (ii < batch) {
+            if (items[ii].status != ENGINE_SUCCESS) {
+                ++ii;
+                continue;
+            }
+            if (store_combines(items[ii].operation)) {
+                items[ii].status = store_item(engine, items[ii].item,
+                                              &items[ii].cas,
+                                              items[ii].operation, cookie);
+                ++ii;
+                continue;
+            }
+
+            int end = ii + 1;
+            while (end < batch &&
+                   (items[end].status != ENGINE_SUCCESS ||
+                    (!store_combines(items[end].operation) &&
+                     same_item_lock(engine, hv[ii], hv[end])))) {
+                ++end;
+            }
+
+            item_lock(engine, hv[ii]);
+            for (int jj = ii; jj < end; ++jj) {
+                if (items[jj].status != ENGINE_SUCCESS) {
+                    continue;
+                }
+                hash_item *it = compressed[jj] != NULL ? compressed[jj] :
+                                                         items[jj].item;
+                items[jj].status = do_store_item(engine, it, &items[jj].cas,
+                                                 items[jj].operation, cookie,
+                                                 hv[jj]);
+            }
+            item_unlock(engine, hv[ii]);
+            ii = end;
+        }
+
+        for (ii = 0; ii < batch; ++ii) {
+            if (compressed[ii] != NULL) {
+                item_release(engine, compressed[ii]);
+            }
+        }
+
+        items += batch;
+        nitems -= batch;
+    }
+}
+
+/*
+ * Decrements the reference count on an item and adds it to the freelist if
+ * needed.
+ */
+void item_release(struct default_engine *engine, hash_item *item) {
+    uint32_t hv = item_hash(engine, item);
+    item_lock(engine, hv);
+    do_item_release(engine, item);
+    item_unlock(engine, hv);
+}
+
+/*
+ * Unlinks an item from the LRU and hashtable.
+ */
+void item_unlink(struct default_engine *engine, hash_item *item) {
+    uint32_t hv = item_hash(engine, item);
+    item_lock(engine, hv);
+    do_item_unlink(engine, item);
+    item_unlock(engine, hv);
+}
+
+static ENGINE_ERROR_CODE do_arithmetic(struct default_engine *engine,
+                                       const void* cookie,
+                                       const void* key,
+                                       const int nkey,
+                                       const bool increment,
+                                       const bool create,
+                                       const uint64_t delta,
+                                       const uint64_t initial,
+                                       const rel_time_t exptime,
+                                       uint64_t *cas,
+                                       uint64_t *result,
+                                       uint16_t vbucket,
+                                       uint32_t hv)
+{
+   hash_item *item = do_item_get_hv(engine, key, nkey, hv);
+   ENGINE_ERROR_CODE ret;
+
+   if (item == NULL) {
+      if (!create) {
+         return ENGINE_KEY_ENOENT;
+      } else {
+         char buffer[128];
+         int len = snprintf(buffer, sizeof(buffer), "%"PRIu64,
+                            (uint64_t)initial);
+
+         item = do_item_alloc(engine, key, nkey, 0, exptime, len, cookie);
+         if (item == NULL) {
+            return ENGINE_ENOMEM;
+         }
+         memcpy((void*)item_get_data(item), buffer, len);
+         item->vbucket = vbucket;
+         if ((ret = do_store_item(engine, item, cas, OPERATION_ADD,
+                                  cookie, hv)) == ENGINE_SUCCESS) {
+             *result = initial;
+             *cas = item_get_cas(item);
+         }
+         do_item_release(engine, item);
+      }
+   } else {
+      ret = do_add_delta(engine, item, increment, delta, cas, result, cookie);
+      do_item_release(engine, item);
+   }
+
+   return ret;
+}
+
+ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
+                             const void* cookie,
+                             const void* key,
+                             const int nkey,
+                             const bool increment,
+                             const bool create,
+                             const uint64_t delta,
+                             const uint64_t initial,
+                             const rel_time_t exptime,
+                             uint64_t *cas,
+                             uint64_t *result,
+                             uint16_t vbucket)
+{
+    ENGINE_ERROR_CODE ret;
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
+
+    item_lock(engine, hv);
+    ret = do_arithmetic(engine, cookie, key, nkey, increment,
+                        create, delta, initial, exptime, cas,
+                        result, vbucket, hv);
+    item_unlock(engine, hv);
+    return ret;
+}
+
+/*
+ * Overwrite a range of the value of an existing item. Nobody else can
+ * be using the item if we're to patch it in place; otherwise we patch a
+ * copy and replace the item with it (like do_add_delta).
+ */
+static ENGINE_ERROR_CODE do_mutate_range(struct default_engine *engine,
+                                         const void *cookie,
+                                         hash_item *it, uint64_t *cas,
+                                         uint64_t offset, const void *data,
+                                         uint64_t len, uint32_t hv) {
+    if ((it->iflag & ITEM_EXTERNAL) != 0) {
+        return ENGINE_ENOTSUP;
+    }
+    if (*cas != 0 && *cas != item_get_cas(it)) {
+        return ENGINE_KEY_EEXISTS;
+    }
+    if (offset > it->nbytes || len > it->nbytes - offset) {
+        return ENGINE_ERANGE;
+    }
+
+    if (it->refcount == 1 &&
+        (it->iflag & (ITEM_COMPRESSED | ITEM_DEDUP)) == 0) {
+        item_hot_modified(engine, it);
+        item_value_write(engine, it, offset, data, len);
+        item_set_cas(NULL, NULL, it, get_cas_id(engine, hv));
+        item_tap_changed(engine, it);
+        *cas = item_get_cas(it);
+        return ENGINE_SUCCESS;
+    }
+
+    hash_item *old_value = it;
+    if ((it->iflag & ITEM_COMPRESSED) != 0) {
+        old_value = do_item_decompress(engine, it, cookie, true);
+        if (old_value == NULL) {
+            return ENGINE_ENOMEM;
+        }
+    }
+
+    hash_item *new_it = do_item_alloc(engine, item_get_key(it), it->nkey,
+                                      it->flags, it->exptime,
+                                      old_value->nbytes, cookie);
+    if (new_it != NULL) {
+        item_copy_value(engine, new_it, 0, old_value);
+        item_value_write(engine, new_it, offset, data, len);
+        new_it->vbucket = it->vbucket;
+        if ((it->iflag & ITEM_DEDUP) != 0) {
+            dedup_copied(engine, item_dedup_blob(engine, it));
         }
+    }
+    if (old_value != it) {
+        do_item_release(engine, old_value);
+    }
+    if (new_it == NULL) {
+        return ENGINE_ENOMEM;
+    }
+
+    do_item_replace_hv(engine, it, new_it, hv);
+    *cas = item_get_cas(new_it);
+    do_item_release(engine, new_it);
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE mutate_range(struct default_engine *engine,
+                               const void *cookie,
+                               const void *key, const int nkey,
+                               uint64_t *cas, uint64_t offset,
+                               const void *data, uint64_t len) {
+    ENGINE_ERROR_CODE ret = ENGINE_KEY_ENOENT;
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
+
+    item_lock(engine, hv);
+    hash_item *it = do_item_get_hv(engine, key, nkey, hv);
+    if (it != NULL) {
+        ret = do_mutate_range(engine, cookie, it, cas, offset, data, len, hv);
+        do_item_release(engine, it);
+    }
+    item_unlock(engine, hv);
+    return ret;
+}
+
+/*
+ * Stores an item in the cache (high level, obeys set/add/replace semantics)
+ */
+ENGINE_ERROR_CODE store_item(struct default_engine *engine,
+                             hash_item *item, uint64_t *cas,
+                             ENGINE_STORE_OPERATION operation,
+                             const void *cookie) {
+    ENGINE_ERROR_CODE ret;
+    uint32_t hv = item_hash(engine, item);
+    hash_item *compressed = NULL;
+
+    /* The data of an append or prepend is combined with the old value */
+    if (operation != OPERATION_APPEND && operation != OPERATION_PREPEND) {
+        compressed = item_pack(engine, item, cookie);
+    } else if (engine->ext.enabled) {
+        /* which has to be in memory */
+        hash_item *old_it = item_get(engine, item_get_key(item), item->nkey);
+        if (old_it != NULL && (old_it->iflag & ITEM_EXTERNAL) != 0) {
+            return item_ext_get(engine, old_it, cookie);
+        }
+        if (old_it != NULL) {
+            item_release(engine, old_it);
+        }
+    }
+
+    item_lock(engine, hv);
+    ret = do_store_item(engine, compressed != NULL ? compressed : item,
+                        cas, operation, cookie, hv);
+    item_unlock(engine, hv);
+
+    if (compressed != NULL) {
+        item_release(engine, compressed);
+    }
+    return ret;
+}
+
+static hash_item *do_touch_item(struct default_engine *engine,
+                                     const void *key,
+                                     uint16_t nkey,
+                                     uint32_t exptime,
+                                     uint32_t hv)
+{
+   hash_item *item = do_item_get_hv(engine, key, nkey, hv);
+   if (item != NULL) {
+       item_hot_modified(engine, item);
+       item->exptime = exptime;
+       item_tap_changed(engine, item);
+   }
+   return item;
+}
+
+hash_item *touch_item(struct default_engine *engine,
+                           const void *key,
+                           uint16_t nkey,
+                           uint32_t exptime)
+{
+    return touch_item_hv(engine, key, nkey, exptime,
+                         engine->server.core->hash(key, nkey, 0));
+}
+
+hash_item *touch_item_hv(struct default_engine *engine,
+                         const void *key,
+                         uint16_t nkey,
+                         uint32_t exptime,
+                         uint32_t hv)
+{
+    hash_item *ret;
+
+    item_lock(engine, hv);
+    ret = do_touch_item(engine, key, nkey, exptime, hv);
+    item_unlock(engine, hv);
+    return ret;
+}
+
+/*
+ * Flushes expired items after a flush_all call
+ */
+void item_flush_expired(struct default_engine *engine, time_t when) {
+    int i;
+    hash_item *iter, *next;
+
+    item_lock_all(engine);
+    /* Drop the copies of the items we flush */
+    hot_cache_invalidate(engine);
+
+    if (when == 0) {
+        engine->config.oldest_live = engine->server.core->get_current_time() - 1;
     } else {
+        engine->config.oldest_live = engine->server.core->realtime(when) - 1;
+    }
+
+    engine->config.oldest_cas = 0;
+    if (when == 0 && engine->config.use_cas) {
         /*
-         * Append - combine new and old record into single one. Here it's
-         * atomic and thread-safe.
+         * Everything linked from now on gets a CAS from a new block, so
+         * we don't have to look at the items at all (item_is_flushed()
+         * sorts them out when we run into them).
          */
-        if (operation == OPERATION_APPEND || operation == OPERATION_PREPEND) {
+        if (striped(engine)) {
+            for (uint32_t ii = 0; ii <= engine->item_lock_mask; ++ii) {
+                engine->item_locks[ii].cas.next = engine->item_locks[ii].cas.end;
+            }
+        }
+        engine->cas_block.next = engine->cas_block.end;
+        engine->config.oldest_cas = engine->cas_id + 1;
+    } else if (engine->config.oldest_live != 0) {
+        for (i = 0; i < LRU_LISTS; i++) {
             /*
-             * Validate CAS
+             * Without a CAS we can't tell the items stored in the last
+             * second apart, so we unlink them here.
+             * The LRU is sorted in decreasing time order, and an item's
+             * timestamp is never newer than its last access time, so we
+             * only need to walk back until we hit an item older than the
+             * oldest_live time.
+             * The oldest_live checking will auto-expire the remaining items.
+             * The segments of the segmented LRU aren't sorted (the
+             * items are moved around by the maintainer), so we have to
+             * walk all of them.
              */
-            if (item_get_cas(it) != 0) {
-                // CAS much be equal
-                if (item_get_cas(it) != item_get_cas(old_it)) {
-                    stored = ENGINE_KEY_EEXISTS;
+            lru_lock(engine, lru_clsid(i));
+            for (iter = engine->items.heads[i]; iter != NULL; iter = next) {
+                next = item_deref(engine, iter->next);
+                if (iter->time >= engine->config.oldest_live) {
+                    if ((iter->iflag & ITEM_SLABBED) == 0 &&
+                        !item_is_cursor(iter)) {
+                        do_item_unlink_internal(engine, iter, true);
+                    }
+                } else if (!engine->config.segmented_lru) {
+                    /* We've hit the first old item. Continue to the next queue. */
+                    break;
                 }
             }
+            lru_unlock(engine, lru_clsid(i));
+        }
+    }
+    item_unlock_all(engine);
 
-            if (stored == ENGINE_NOT_STORED) {
-                /* we have it and old_it here - alloc memory to hold both */
-                new_it = do_item_alloc(engine, key, it->nkey,
-                                       old_it->flags,
-                                       old_it->exptime,
-                                       it->nbytes + old_it->nbytes,
-                                       cookie);
+    /* Let the crawler give the memory of the dead items back */
+    if (when == 0) {
+        engine->crawler.kick = true;
+    }
+}
 
-                if (new_it == NULL) {
-                    /* SERVER_ERROR out of memory */
-                    if (old_it != NULL) {
-                        do_item_release(engine, old_it);
-                    }
+/*
+ * Dumps part of the cache
+ */
+char *item_cachedump(struct default_engine *engine,
+                     unsigned int slabs_clsid,
+                     unsigned int limit,
+                     unsigned int *bytes) {
+    char *ret;
+
+    item_lock_all(engine);
+    ret = do_item_cachedump(slabs_clsid, limit, bytes);
+    item_unlock_all(engine);
+    return ret;
+}
+
+void item_stats(struct default_engine *engine,
+                   ADD_STAT add_stat, const void *cookie)
+{
+    item_lock_all(engine);
+    do_item_stats(engine, add_stat, cookie);
+    item_unlock_all(engine);
+}
+
+
+void item_stats_sizes(struct default_engine *engine,
+                      ADD_STAT add_stat, const void *cookie)
+{
+    pthread_mutex_lock(&engine->stats.lock);
+    do_item_stats_sizes(engine, add_stat, cookie);
+    pthread_mutex_unlock(&engine->stats.lock);
+}
+
+static void do_item_link_cursor(struct default_engine *engine,
+                                hash_item *cursor, int ii)
+{
+    cursor->slabs_clsid = (uint8_t)lru_clsid(ii);
+    item_set_segment(cursor, ii / POWER_LARGEST);
+    cursor->next = 0;
+    cursor->prev = item_ref_of(engine, engine->items.tails[ii]);
+    engine->items.tails[ii]->next = item_ref_of(engine, cursor);
+    engine->items.tails[ii] = cursor;
+    engine->items.sizes[ii]++;
+}
+
+typedef ENGINE_ERROR_CODE (*ITERFUNC)(struct default_engine *engine,
+                                      hash_item *item, void *cookie);
+
+static bool do_item_walk_cursor(struct default_engine *engine,
+                                hash_item *cursor,
+                                int steplength,
+                                ITERFUNC itemfunc,
+                                void* itemdata,
+                                ENGINE_ERROR_CODE *error)
+{
+    int ii = 0;
+    *error = ENGINE_SUCCESS;
+
+    while (cursor->prev != 0 && ii < steplength) {
+        ++ii;
+        /* Move cursor */
+        hash_item *ptr = item_deref(engine, cursor->prev);
+        item_unlink_q(engine, cursor);
+
+        bool done = false;
+        if (ptr == engine->items.heads[item_lru(cursor)]) {
+            done = true;
+            cursor->prev = 0;
+        } else {
+            cursor->next = item_ref_of(engine, ptr);
+            cursor->prev = ptr->prev;
+            item_deref(engine, cursor->prev)->next = item_ref_of(engine, cursor);
+            ptr->prev = item_ref_of(engine, cursor);
+        }
+
+        /* Ignore cursors */
+        if (item_is_cursor(ptr)) {
+            --ii;
+        } else {
+            *error = itemfunc(engine, ptr, itemdata);
+            if (*error != ENGINE_SUCCESS) {
+                return false;
+            }
+        }
+
+        if (done) {
+            return false;
+        }
+    }
+
+    return (cursor->prev != 0);
+}
+
+/*
+ * do_item_walk_cursor unlinks the cursor when it reaches the head of the
+ * list, but the cursor may still be linked if we stop walking early (or
+ * if the item in front of it was unlinked so that the cursor became the
+ * new head).
+ */
+static void do_item_unlink_cursor(struct default_engine *engine,
+                                  hash_item *cursor)
+{
+    if (cursor->prev != 0 ||
+        engine->items.heads[item_lru(cursor)] == cursor) {
+        item_unlink_q(engine, cursor);
+    }
+    cursor->next = cursor->prev = 0;
+}
+
+static ENGINE_ERROR_CODE item_scrub(struct default_engine *engine,
+                                    hash_item *item,
+                                    void *cookie) {
+    (void)cookie;
+    uint32_t hv = 0;
+    engine->scrubber.visited++;
+    rel_time_t current_time = engine->server.core->get_current_time();
+    if (item->refcount == 0 &&
+        (item_is_flushed(engine, item, current_time) ||
+         (item->exptime != 0 && item->exptime < current_time)) &&
+        item_trylock_victim(engine, item, &hv)) {
+        if (item->refcount == 0) {
+            do_item_unlink_internal(engine, item, true);
+            engine->scrubber.cleaned++;
+        }
+        item_unlock_victim(engine, hv);
+    }
+    return ENGINE_SUCCESS;
+}
+
+static void item_scrub_class(struct default_engine *engine,
+                             hash_item *cursor) {
+
+    ENGINE_ERROR_CODE ret;
+    bool more;
+    unsigned int id = cursor->slabs_clsid;
+    do {
+        lru_walk_lock(engine, id);
+        more = do_item_walk_cursor(engine, cursor, 200, item_scrub, NULL, &ret);
+        if (!more) {
+            do_item_unlink_cursor(engine, cursor);
+        }
+        lru_walk_unlock(engine, id);
+        if (ret != ENGINE_SUCCESS) {
+            break;
+        }
+    } while (more);
+}
+
+static void *item_scubber_main(void *arg)
+{
+    struct default_engine *engine = arg;
+    hash_item *cursor = slabs_cursor_alloc(engine);
+
+    engine->server.core->place_background_thread();
+
+    for (int ii = 0; ii < LRU_LISTS && cursor != NULL; ++ii) {
+        lru_walk_lock(engine, lru_clsid(ii));
+        bool skip = false;
+        if (engine->items.heads[ii] == NULL) {
+            skip = true;
+        } else {
+            // add the item at the tail
+            do_item_link_cursor(engine, cursor, ii);
+        }
+        lru_walk_unlock(engine, lru_clsid(ii));
+
+        if (!skip) {
+            item_scrub_class(engine, cursor);
+        }
+    }
+    slabs_cursor_free(engine, cursor);
+
+    pthread_mutex_lock(&engine->scrubber.lock);
+    engine->scrubber.stopped = time(NULL);
+    engine->scrubber.running = false;
+    pthread_mutex_unlock(&engine->scrubber.lock);
+
+    return NULL;
+}
+
+bool item_start_scrub(struct default_engine *engine)
+{
+    bool ret = false;
+    pthread_mutex_lock(&engine->scrubber.lock);
+    if (!engine->scrubber.running) {
+        engine->scrubber.started = time(NULL);
+        engine->scrubber.stopped = 0;
+        engine->scrubber.visited = 0;
+        engine->scrubber.cleaned = 0;
+        engine->scrubber.running = true;
+
+        pthread_t t;
+        pthread_attr_t attr;
+
+        if (pthread_attr_init(&attr) != 0 ||
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
+            pthread_create(&t, &attr, item_scubber_main, engine) != 0)
+        {
+            engine->scrubber.running = false;
+        } else {
+            ret = true;
+        }
+    }
+    pthread_mutex_unlock(&engine->scrubber.lock);
+
+    return ret;
+}
+
+static inline bool vbucket_purge_pending(struct default_engine *engine,
+                                         uint16_t vb) {
+    return (engine->purger.pending[vb / 8] & (1 << (vb % 8))) != 0;
+}
+
+/*
+ * We look at the pending vbuckets without the lock: an item is reclaimed
+ * if its vbucket is still pending when we get to it, so a vbucket that
+ * is brought back before we're done keeps what is left of it.
+ */
+static void item_purge_iterfunc(struct default_engine *engine,
+                                hash_item *it, void *cookie) {
+    uint64_t *reclaimed = cookie;
+    if (vbucket_purge_pending(engine, it->vbucket)) {
+        do_item_unlink(engine, it);
+        ++*reclaimed;
+    }
+}
+
+static bool vbuckets_pending(const uint8_t *pending) {
+    for (int ii = 0; ii < NUM_VBUCKETS / 8; ++ii) {
+        if (pending[ii] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *item_purger_main(void *arg)
+{
+    struct default_engine *engine = arg;
+    uint8_t pass[NUM_VBUCKETS / 8];
+
+    engine->server.core->place_background_thread();
+
+    pthread_mutex_lock(&engine->purger.lock);
+    while (!engine->purger.stop && vbuckets_pending(engine->purger.pending)) {
+        memcpy(pass, engine->purger.pending, sizeof(pass));
+        pthread_mutex_unlock(&engine->purger.lock);
+
+        /* An expansion moves the items of a small table between the
+         * slices, so a pass that saw one may have missed some */
+        bool expanding = engine->assoc.expanding;
+        uint64_t expansions = engine->assoc.expansions;
+        uint64_t reclaimed = 0;
+        for (uint32_t ii = 0; ii < ASSOC_SLICES && !engine->purger.stop; ++ii) {
+            item_lock(engine, ii);
+            assoc_walk_slice(engine, ii, item_purge_iterfunc, &reclaimed);
+            item_unlock(engine, ii);
+        }
+        bool complete = !engine->purger.stop && !expanding &&
+            !engine->assoc.expanding && expansions == engine->assoc.expansions;
+
+        pthread_mutex_lock(&engine->purger.lock);
+        engine->purger.reclaimed += reclaimed;
+        if (complete) {
+            engine->purger.passes++;
+            for (int ii = 0; ii < NUM_VBUCKETS / 8; ++ii) {
+                engine->purger.pending[ii] &= ~pass[ii];
+            }
+        }
+    }
+    engine->purger.running = false;
+    pthread_mutex_unlock(&engine->purger.lock);
+
+    return NULL;
+}
+
+void item_vbucket_purge(struct default_engine *engine, uint16_t vbucket)
+{
+    pthread_mutex_lock(&engine->purger.lock);
+    engine->purger.pending[vbucket / 8] |= 1 << (vbucket % 8);
+    if (!engine->purger.running && !engine->purger.stop) {
+        if (engine->purger.started) {
+            /* It's done (or just about) */
+            pthread_join(engine->purger.thread, NULL);
+            engine->purger.started = false;
+        }
+        engine->purger.running = true;
+        if (pthread_create(&engine->purger.thread, NULL,
+                           item_purger_main, engine) == 0) {
+            engine->purger.started = true;
+        } else {
+            /* We try again with the next vbucket we remove */
+            engine->purger.running = false;
+        }
+    }
+    pthread_mutex_unlock(&engine->purger.lock);
+}
+
+void item_vbucket_purge_cancel(struct default_engine *engine,
+                               uint16_t vbucket)
+{
+    pthread_mutex_lock(&engine->purger.lock);
+    engine->purger.pending[vbucket / 8] &= ~(1 << (vbucket % 8));
+    pthread_mutex_unlock(&engine->purger.lock);
+}
+
+void item_vbucket_purge_stop(struct default_engine *engine)
+{
+    pthread_mutex_lock(&engine->purger.lock);
+    engine->purger.stop = true;
+    bool started = engine->purger.started;
+    engine->purger.started = false;
+    pthread_mutex_unlock(&engine->purger.lock);
+    if (started) {
+        pthread_join(engine->purger.thread, NULL);
+    }
+}
+
+void item_vbucket_purge_stats(struct default_engine *engine,
+                              ADD_STAT add_stat, const void *cookie)
+{
+    const char *prefix = "vbucket_purge";
+    pthread_mutex_lock(&engine->purger.lock);
+    int pending = 0;
+    for (int ii = 0; ii < NUM_VBUCKETS; ++ii) {
+        if (vbucket_purge_pending(engine, (uint16_t)ii)) {
+            ++pending;
+        }
+    }
+    add_statistics(cookie, add_stat, prefix, -1, "status", "%s",
+                   engine->purger.running ? "running" : "stopped");
+    add_statistics(cookie, add_stat, prefix, -1, "pending", "%d", pending);
+    add_statistics(cookie, add_stat, prefix, -1, "passes", "%"PRIu64,
+                   engine->purger.passes);
+    add_statistics(cookie, add_stat, prefix, -1, "reclaimed", "%"PRIu64,
+                   engine->purger.reclaimed);
+    pthread_mutex_unlock(&engine->purger.lock);
+}
+
+static uint64_t crawler_time_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Sleep for (up to) usec, but wake up if someone stops the crawler */
+static void crawler_sleep(struct default_engine *engine, uint64_t usec) {
+    while (usec > 0 && engine->crawler.running) {
+        useconds_t t = usec > 10000 ? 10000 : (useconds_t)usec;
+        usleep(t);
+        usec -= t;
+    }
+}
+
+static ENGINE_ERROR_CODE item_crawl(struct default_engine *engine,
+                                    hash_item *item,
+                                    void *cookie) {
+    struct crawler_stats *stats = cookie;
+    uint32_t hv = 0;
+    rel_time_t current_time = engine->server.core->get_current_time();
+
+    stats->visited++;
+    if (item->refcount == 0 &&
+        (item_is_flushed(engine, item, current_time) ||
+         (item->exptime != 0 && item->exptime < current_time)) &&
+        item_trylock_victim(engine, item, &hv)) {
+        if (item->refcount == 0) {
+            do_item_unlink_internal(engine, item, true);
+            stats->reclaimed++;
+        }
+        item_unlock_victim(engine, hv);
+    }
+    return ENGINE_SUCCESS;
+}
+
+/*
+ * Walk one LRU list, lru_crawler_batch items at a time. We release the
+ * LRU lock and sleep for lru_crawler_sleep usec between the batches to
+ * limit the impact on the front end threads.
+ */
+static void item_crawl_list(struct default_engine *engine, unsigned int lru,
+                            hash_item *cursor) {
+    unsigned int id = lru_clsid(lru);
+    struct crawler_stats *stats = &engine->crawler.stats[id];
+    int batch = engine->config.lru_crawler_batch > 0 ?
+        (int)engine->config.lru_crawler_batch : 1;
+    ENGINE_ERROR_CODE ret;
+    bool more;
+
+    lru_walk_lock(engine, id);
+    more = engine->items.heads[lru] != NULL;
+    if (more) {
+        do_item_link_cursor(engine, cursor, lru);
+    }
+    lru_walk_unlock(engine, id);
+
+    while (more) {
+        lru_walk_lock(engine, id);
+        more = do_item_walk_cursor(engine, cursor, batch, item_crawl,
+                                   stats, &ret) && engine->crawler.running;
+        if (!more) {
+            do_item_unlink_cursor(engine, cursor);
+        }
+        lru_walk_unlock(engine, id);
+        if (more) {
+            crawler_sleep(engine, engine->config.lru_crawler_sleep);
+        }
+    }
+}
 
-                    return ENGINE_NOT_STORED;
-                }
+static void *item_crawler_main(void *arg)
+{
+    struct default_engine *engine = arg;
+    hash_item *cursor = engine->crawler.cursor;
 
-                /* copy data from it and old_it to new_it */
+    engine->server.core->place_background_thread();
 
-                if (operation == OPERATION_APPEND) {
-                    memcpy(item_get_data(new_it), item_get_data(old_it), old_it->nbytes);
-                    memcpy(item_get_data(new_it) + old_it->nbytes, item_get_data(it), it->nbytes);
-                } else {
-                    /* OPERATION_PREPEND */
-                    memcpy(item_get_data(new_it), item_get_data(it), it->nbytes);
-                    memcpy(item_get_data(new_it) + it->nbytes, item_get_data(old_it), old_it->nbytes);
-                }
+    while (engine->crawler.running) {
+        uint64_t elapsed[POWER_LARGEST] = { 0 };
+        for (int ii = 0; ii < LRU_LISTS && engine->crawler.running; ++ii) {
+            uint64_t start = crawler_time_usec();
+            item_crawl_list(engine, ii, cursor);
+            elapsed[lru_clsid(ii)] += crawler_time_usec() - start;
+        }
 
-                it = new_it;
+        if (engine->crawler.running) {
+            for (int ii = 0; ii < POWER_LARGEST; ++ii) {
+                engine->crawler.stats[ii].last_run_usec = elapsed[ii];
             }
+            engine->crawler.crawls++;
+            uint64_t usec = (uint64_t)engine->config.lru_crawler_interval * 1000000;
+            while (usec > 0 && engine->crawler.running && !engine->crawler.kick) {
+                uint64_t t = usec > 100000 ? 100000 : usec;
+                crawler_sleep(engine, t);
+                usec -= t;
+            }
+            engine->crawler.kick = false;
         }
+    }
 
-        if (stored == ENGINE_NOT_STORED) {
-            if (old_it != NULL) {
-                do_item_replace(engine, old_it, it);
-            } else {
-                do_item_link(engine, it);
-            }
+    return NULL;
+}
 
-            *cas = item_get_cas(it);
-            stored = ENGINE_SUCCESS;
-        }
+ENGINE_ERROR_CODE item_crawler_start(struct default_engine *engine) {
+    if (!engine->config.lru_crawler) {
+        return ENGINE_SUCCESS;
     }
 
-    if (old_it != NULL) {
-        do_item_release(engine, old_it);         /* release our reference */
+    if ((engine->crawler.cursor = slabs_cursor_alloc(engine)) == NULL) {
+        return ENGINE_ENOMEM;
     }
 
-    if (new_it != NULL) {
-        do_item_release(engine, new_it);
+    engine->crawler.running = true;
+    if (pthread_create(&engine->crawler.thread, NULL,
+                       item_crawler_main, engine) != 0) {
+        engine->crawler.running = false;
+        slabs_cursor_free(engine, engine->crawler.cursor);
+        engine->crawler.cursor = NULL;
+        return ENGINE_FAILED;
     }
+    return ENGINE_SUCCESS;
+}
 
-    if (stored == ENGINE_SUCCESS) {
-        *cas = item_get_cas(it);
+void item_crawler_stop(struct default_engine *engine) {
+    if (engine->crawler.running) {
+        engine->crawler.running = false;
+        pthread_join(engine->crawler.thread, NULL);
+        slabs_cursor_free(engine, engine->crawler.cursor);
+        engine->crawler.cursor = NULL;
     }
+}
 
-    return stored;
+void item_crawler_stats(struct default_engine *engine,
+                        ADD_STAT add_stat, const void *cookie) {
+    const char *prefix = "crawler";
+    add_statistics(cookie, add_stat, prefix, -1, "status", "%s",
+                   engine->crawler.running ? "running" : "stopped");
+    add_statistics(cookie, add_stat, prefix, -1, "crawls", "%"PRIu64,
+                   engine->crawler.crawls);
+    for (int ii = 0; ii < POWER_LARGEST; ++ii) {
+        struct crawler_stats *stats = &engine->crawler.stats[ii];
+        if (stats->visited != 0) {
+            add_statistics(cookie, add_stat, prefix, ii, "visited",
+                           "%"PRIu64, stats->visited);
+            add_statistics(cookie, add_stat, prefix, ii, "reclaimed",
+                           "%"PRIu64, stats->reclaimed);
+            add_statistics(cookie, add_stat, prefix, ii, "last_run_usec",
+                           "%"PRIu64, stats->last_run_usec);
+        }
+    }
 }
 
+static int item_time_compare(const void *a, const void *b) {
+    const hash_item *x = *(hash_item * const *)a;
+    const hash_item *y = *(hash_item * const *)b;
+    return (x->time > y->time) - (x->time < y->time);
+}
 
-/*
- * adds a delta value to a numeric item.
- *
- * c     connection requesting the operation
- * it    item to adjust
- * incr  true to increment value, false to decrement
- * delta amount to adjust value by
- * buf   buffer for response string
- *
- * returns a response string to send back to the client.
- */
-static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
-                                      hash_item *it, const bool incr,
-                                      const int64_t delta, uint64_t *rcas,
-                                      uint64_t *result, const void *cookie) {
-    const char *ptr;
-    uint64_t value;
-    char buf[80];
-    int res;
+uint64_t items_restore(struct default_engine *engine, hash_item **items,
+                       size_t nitems, time_t started) {
+    time_t now = engine->server.core->abstime(engine->server.core->get_current_time());
+    time_t base = engine->server.core->abstime(0);
+    uint64_t restored = 0;
+
+    /* Link the oldest items first so that they end up at the tail */
+    qsort(items, nitems, sizeof(hash_item*), item_time_compare);
+
+    item_lock_all(engine);
+    for (size_t ii = 0; ii < nitems; ++ii) {
+        hash_item *it = items[ii];
+        bool keep = it->nkey != 0;
+
+        it->iflag &= ~(ITEM_LINKED | ITEM_ACTIVE);
+        it->refcount = 0;
+        it->next = it->prev = it->h_next = 0;
+        /* The chunk is in use again (item_free() gives it back) */
+        slabs_adjust_mem_requested(engine, it->slabs_clsid, 0,
+                                   ITEM_nslab(engine, it));
+
+        if ((it->iflag & ITEM_CHUNKED) != 0) {
+            /* slabs_restore() already put the chunks on the freelist */
+            item_chunk_table(engine, it)->count = 0;
+            keep = false;
+        }
 
-    if (it->nbytes >= (sizeof(buf) - 1)) {
-        return ENGINE_EINVAL;
-    }
+        if ((it->iflag & ITEM_EXTERNAL) != 0) {
+            /* ext_init() starts with an empty external store */
+            keep = false;
+        }
 
-    ptr = item_get_data(it);
-    memcpy(buf, ptr, it->nbytes);
-    buf[it->nbytes] = '\0';
+        if ((it->iflag & ITEM_DEDUP) != 0) {
+            /* and dedup_init() with an empty table (the blobs don't have
+             * a key, so they go anyway) */
+            it->iflag &= ~ITEM_DEDUP;
+            it->nbytes = sizeof(item_ref);
+            keep = false;
+        }
 
-    if (!safe_strtoull(buf, &value)) {
-        return ENGINE_EINVAL;
-    }
+        if (keep && it->exptime != 0) {
+            time_t exptime = started + it->exptime;
+            if (exptime <= now) {
+                keep = false;
+            } else {
+                it->exptime = (rel_time_t)(exptime - base);
+            }
+        }
 
-    if (incr) {
-        value += delta;
-    } else {
-        if(delta > value) {
-            value = 0;
+        if (keep && assoc_find(engine, item_hash(engine, it), item_get_key(it),
+                               it->nkey) != NULL) {
+            keep = false;
+        }
+
+        if (keep) {
+            do_item_link(engine, it);
+            ++restored;
         } else {
-            value -= delta;
+            item_free(engine, it);
         }
     }
+    item_unlock_all(engine);
 
-    *result = value;
-    if ((res = snprintf(buf, sizeof(buf), "%" PRIu64, value)) == -1) {
-        return ENGINE_EINVAL;
+    return restored;
+}
+
+uint64_t items_load(struct default_engine *engine, const load_item *items,
+                    int nitems) {
+    hash_item **its = malloc(nitems * sizeof(hash_item*));
+    uint32_t *hv = malloc(nitems * sizeof(uint32_t));
+    uint64_t loaded = 0;
+    if (its == NULL || hv == NULL) {
+        free(its);
+        free(hv);
+        return 0;
     }
 
-    if (it->refcount == 1 && res <= it->nbytes) {
-        // we can do inline replacement
-        memcpy(item_get_data(it), buf, res);
-        memset(item_get_data(it) + res, ' ', it->nbytes - res);
-        item_set_cas(NULL, NULL, it, get_cas_id());
-        *rcas = item_get_cas(it);
-    } else {
-        hash_item *new_it = do_item_alloc(engine, item_get_key(it),
-                                          it->nkey, it->flags,
-                                          it->exptime, res,
-                                          cookie);
-        if (new_it == NULL) {
-            do_item_unlink(engine, it);
-            return ENGINE_ENOMEM;
+    /* The new items aren't in the hash table yet (see item_alloc()) */
+    unstriped_lock(engine);
+    for (int ii = 0; ii < nitems; ++ii) {
+        its[ii] = do_item_alloc(engine, items[ii].key, items[ii].nkey,
+                                (int)items[ii].flags, items[ii].exptime,
+                                (int)items[ii].nbytes, NULL);
+    }
+    unstriped_unlock(engine);
+
+    for (int ii = 0; ii < nitems; ++ii) {
+        if (its[ii] != NULL) {
+            item_value_write(engine, its[ii], 0, items[ii].value,
+                             items[ii].nbytes);
+            its[ii]->vbucket = items[ii].vbucket;
+            its[ii]->iflag |= items[ii].iflag & ITEM_COMPRESSED;
+            hv[ii] = item_hash(engine, its[ii]);
         }
-        memcpy(item_get_data(new_it), buf, res);
-        do_item_replace(engine, it, new_it);
-        *rcas = item_get_cas(new_it);
-        do_item_release(engine, new_it);       /* release our reference */
     }
 
-    return ENGINE_SUCCESS;
-}
+    /* The items of a snapshot come slice by slice, so the runs under
+     * the same item lock are long */
+    int ii = 0;
+    while (ii < nitems) {
+        if (its[ii] == NULL) {
+            ++ii;
+            continue;
+        }
+        int end = ii + 1;
+        while (end < nitems &&
+               (its[end] == NULL || same_item_lock(engine, hv[ii], hv[end]))) {
+            ++end;
+        }
 
-/********************************* ITEM ACCESS *******************************/
+        item_lock(engine, hv[ii]);
+        for (int jj = ii; jj < end; ++jj) {
+            hash_item *it = its[jj];
+            if (it == NULL) {
+                continue;
+            }
+            if (assoc_find(engine, hv[jj], item_get_key(it), it->nkey) == NULL) {
+                do_item_link_hv(engine, it, hv[jj]);
+                ++loaded;
+            }
+            do_item_release(engine, it);
+        }
+        item_unlock(engine, hv[ii]);
+        ii = end;
+    }
 
-/*
- * Allocates a new item.
- */
-hash_item *item_alloc(struct default_engine *engine,
-                      const void *key, size_t nkey, int flags,
-                      rel_time_t exptime, int nbytes, const void *cookie) {
-    hash_item *it;
-    pthread_mutex_lock(&engine->cache_lock);
-    it = do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
-    return it;
+    free(its);
+    free(hv);
+    return loaded;
 }
 
-/*
- * Returns an item if it hasn't been marked as expired,
- * lazy-expiring as needed.
- */
-hash_item *item_get(struct default_engine *engine,
-                    const void *key, const size_t nkey) {
-    hash_item *it;
-    pthread_mutex_lock(&engine->cache_lock);
-    it = do_item_get(engine, key, nkey);
-    pthread_mutex_unlock(&engine->cache_lock);
-    return it;
+struct item_walk_state {
+    ASSOC_WALKFUNC fn;
+    void *cookie;
+    rel_time_t current_time;
+};
+
+static void item_walk_iterfunc(struct default_engine *engine,
+                               hash_item *it, void *cookie) {
+    struct item_walk_state *st = cookie;
+    if (!item_is_flushed(engine, it, st->current_time) &&
+        (it->exptime == 0 || it->exptime > st->current_time)) {
+        st->fn(engine, it, st->cookie);
+    }
 }
 
-/*
- * Decrements the reference count on an item and adds it to the freelist if
- * needed.
- */
-void item_release(struct default_engine *engine, hash_item *item) {
-    pthread_mutex_lock(&engine->cache_lock);
-    do_item_release(engine, item);
-    pthread_mutex_unlock(&engine->cache_lock);
+void item_walk_slice(struct default_engine *engine, uint32_t slice,
+                     ASSOC_WALKFUNC fn, void *cookie) {
+    struct item_walk_state st = {
+        .fn = fn,
+        .cookie = cookie,
+        .current_time = engine->server.core->get_current_time()
+    };
+    item_lock(engine, slice);
+    assoc_walk_slice(engine, slice, item_walk_iterfunc, &st);
+    item_unlock(engine, slice);
 }
 
 /*
- * Unlinks an item from the LRU and hashtable.
+ * A chunk of a large item can only be given back by unlinking the item
+ * it belongs to. The caller holds the LRU walk lock for the slab class
+ * of the chunk, and we lock the LRU of the item if it's in another one.
  */
-void item_unlink(struct default_engine *engine, hash_item *item) {
-    pthread_mutex_lock(&engine->cache_lock);
-    do_item_unlink(engine, item);
-    pthread_mutex_unlock(&engine->cache_lock);
+static void item_drain_chunk(struct default_engine *engine, unsigned int id,
+                             hash_item *chunk, uint64_t *evicted) {
+    hash_item *it = item_deref(engine, chunk->h_next);
+    unsigned int largest = engine->slabs.power_largest;
+    uint32_t hv = 0;
+
+    if (!item_trylock_victim(engine, it, &hv)) {
+        return;
+    }
+    if (id != largest) {
+        lru_lock(engine, largest);
+    }
+    /* The item may have been released before we got the lock */
+    if (chunk->slabs_clsid == id && (chunk->iflag & ITEM_CHUNK) != 0 &&
+        item_deref(engine, chunk->h_next) == it &&
+        (it->iflag & (ITEM_LINKED | ITEM_CHUNKED)) == (ITEM_LINKED | ITEM_CHUNKED) &&
+        (!striped(engine) || item_hash(engine, it) == hv)) {
+        do_item_unlink_internal(engine, it, true);
+        ++*evicted;
+    }
+    if (id != largest) {
+        lru_unlock(engine, largest);
+    }
+    item_unlock_victim(engine, hv);
 }
 
-static ENGINE_ERROR_CODE do_arithmetic(struct default_engine *engine,
-                                       const void* cookie,
-                                       const void* key,
-                                       const int nkey,
-                                       const bool increment,
-                                       const bool create,
-                                       const uint64_t delta,
-                                       const uint64_t initial,
-                                       const rel_time_t exptime,
-                                       uint64_t *cas,
-                                       uint64_t *result)
-{
-   hash_item *item = do_item_get(engine, key, nkey);
-   ENGINE_ERROR_CODE ret;
+unsigned int item_drain_slab_page(struct default_engine *engine,
+                                  unsigned int id, char *page,
+                                  unsigned int size, unsigned int perslab,
+                                  uint64_t *evicted) {
+    unsigned int busy = 0;
+    uint32_t hv = 0;
+
+    lru_walk_lock(engine, id);
+    for (unsigned int ii = 0; ii < perslab; ++ii) {
+        hash_item *it = (hash_item*)(page + ii * size);
+        /* item_free() clears the slab class of the chunks it releases */
+        if (it->slabs_clsid == 0) {
+            continue;
+        }
 
-   if (item == NULL) {
-      if (!create) {
-         return ENGINE_KEY_ENOENT;
-      } else {
-         char buffer[128];
-         int len = snprintf(buffer, sizeof(buffer), "%"PRIu64,
-                            (uint64_t)initial);
+        if ((it->iflag & ITEM_CHUNK) != 0) {
+            item_drain_chunk(engine, id, it, evicted);
+        } else if ((it->iflag & ITEM_LINKED) != 0 &&
+                   item_trylock_victim(engine, it, &hv)) {
+            if ((it->iflag & ITEM_LINKED) != 0) {
+                do_item_unlink_internal(engine, it, true);
+                ++*evicted;
+            }
+            item_unlock_victim(engine, hv);
+        }
 
-         item = do_item_alloc(engine, key, nkey, 0, exptime, len, cookie);
-         if (item == NULL) {
-            return ENGINE_ENOMEM;
-         }
-         memcpy((void*)item_get_data(item), buffer, len);
-         if ((ret = do_store_item(engine, item, cas,
-                                  OPERATION_ADD, cookie)) == ENGINE_SUCCESS) {
-             *result = initial;
-             *cas = item_get_cas(item);
-         }
-         do_item_release(engine, item);
-      }
-   } else {
-      ret = do_add_delta(engine, item, increment, delta, cas, result, cookie);
-      do_item_release(engine, item);
-   }
+        if (it->slabs_clsid != 0) {
+            ++busy;
+        }
+    }
+    lru_walk_unlock(engine, id);
 
-   return ret;
+    return busy;
 }
 
-ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
-                             const void* cookie,
-                             const void* key,
-                             const int nkey,
-                             const bool increment,
-                             const bool create,
-                             const uint64_t delta,
-                             const uint64_t initial,
-                             const rel_time_t exptime,
-                             uint64_t *cas,
-                             uint64_t *result)
-{
-    ENGINE_ERROR_CODE ret;
+/*
+ * A vbucket takeover sends the backfill of its vbuckets while they are
+ * still active, and records the changes made to them in the meantime.
+ * When the backfill is done the vbuckets go pending (so the clients are
+ * told to go elsewhere), and we send the changes recorded until there
+ * are none left. Then each vbucket goes dead here and we tell the other
+ * end to make it active (TAP_VBUCKET_SET). If the connection goes away
+ * before that, the vbuckets that are still pending are active again.
+ */
+enum tap_phase {
+    TAP_PHASE_BACKFILL,
+    TAP_PHASE_DRAIN,
+    TAP_PHASE_SWITCH,
+    TAP_PHASE_DONE,
+    TAP_PHASE_CHECKPOINT
+};
 
-    pthread_mutex_lock(&engine->cache_lock);
-    ret = do_arithmetic(engine, cookie, key, nkey, increment,
-                        create, delta, initial, exptime, cas,
-                        result);
-    pthread_mutex_unlock(&engine->cache_lock);
-    return ret;
-}
+/** A checkpoint end sent to a registered client, waiting for the ack */
+struct tap_checkpoint_ack {
+    uint32_t seqno;
+    uint16_t vbucket;
+    uint64_t id;
+};
 
-/*
- * Stores an item in the cache (high level, obeys set/add/replace semantics)
+/**
+ * The TAP backfill state of a connection. The walker takes the items of
+ * the hash table a slice at a time (see assoc_walk_slice), holding just
+ * the item lock of the slice. It keeps a reference to every item in the
+ * batch, and hands them out one at a time without any lock.
  */
-ENGINE_ERROR_CODE store_item(struct default_engine *engine,
-                             hash_item *item, uint64_t *cas,
-                             ENGINE_STORE_OPERATION operation,
-                             const void *cookie) {
-    ENGINE_ERROR_CODE ret;
+struct tap_client {
+    const void *cookie;
+    /** The next slice of the hash table to walk */
+    uint32_t slice;
+    /** Bitmap of the vbuckets to send, or NULL */
+    uint8_t *vbuckets;
+    /** Set if we failed to grow the batch */
+    bool failed;
+    /** batch[next] .. batch[count - 1] are still to be sent */
+    int next;
+    int count;
+    int size;
+    hash_item **batch;
+    /** Linked in tap_connections */
+    struct tap_client *prev_client;
+    struct tap_client *next_client;
+
+    /** Set for a vbucket takeover */
+    bool takeover;
+    enum tap_phase phase;
+    /** The next vbucket to switch over */
+    uint32_t switch_vbucket;
+    /** The state we send with TAP_VBUCKET_SET (network byte order) */
+    uint32_t switch_state;
+    /**
+     * The items linked, unlinked or changed in the vbuckets since the
+     * backfill started (with a reference), protected by the takeover lock
+     */
+    hash_item **changes;
+    int nchanges;
+    int changes_size;
+    bool changes_failed;
+    /** Linked in tap_connections.takeover_clients while we record */
+    bool recording;
+    struct tap_client *next_takeover;
+
+    /**
+     * Set for a checkpoint stream, where vbuckets has the ones we have
+     * to backfill (see item_tap_checkpoint())
+     */
+    bool checkpoint;
+    /** The vbuckets of the stream, and the last checkpoint of each sent */
+    uint16_t *list;
+    uint64_t *positions;
+    int nlist;
+    /** The vbucket we look at next (index in list) */
+    int next_vbucket;
+    /** The checkpoint we're sending (with a reference), and of which one */
+    struct checkpoint *sending;
+    int sending_index;
+    bool sending_started;
+    struct checkpoint_key *sending_key;
+    /** The name of a registered client (NULL if it isn't one) */
+    char *name;
+    size_t nname;
+    /** The checkpoint ends it hasn't acked yet (in the order we sent them) */
+    struct tap_checkpoint_ack *acks;
+    int nacks;
+    int acks_size;
+    uint32_t seqno;
+};
 
-    pthread_mutex_lock(&engine->cache_lock);
-    ret = do_store_item(engine, item, cas, operation, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
-    return ret;
+static inline bool tap_client_vbucket(const struct tap_client *client,
+                                      uint16_t vb) {
+    return client->vbuckets == NULL ||
+        (client->vbuckets[vb / 8] & (1 << (vb % 8))) != 0;
 }
 
-static hash_item *do_touch_item(struct default_engine *engine,
-                                     const void *key,
-                                     uint16_t nkey,
-                                     uint32_t exptime)
-{
-   hash_item *item = do_item_get(engine, key, nkey);
-   if (item != NULL) {
-       item->exptime = exptime;
-   }
-   return item;
+static void do_item_tap_changed(struct default_engine *engine,
+                                hash_item *it) {
+    pthread_mutex_lock(&engine->tap_connections.takeover_lock);
+    for (struct tap_client *client = engine->tap_connections.takeover_clients;
+         client != NULL; client = client->next_takeover) {
+        if (!tap_client_vbucket(client, it->vbucket) ||
+            client->changes_failed) {
+            continue;
+        }
+        if (client->nchanges == client->changes_size ||
+            it->refcount == USHRT_MAX) {
+            int size = client->changes_size > 0 ? 2 * client->changes_size : 64;
+            hash_item **changes = NULL;
+            if (it->refcount != USHRT_MAX) {
+                changes = realloc(client->changes, size * sizeof(*changes));
+            }
+            if (changes == NULL) {
+                /* The takeover fails rather than lose the change */
+                client->changes_failed = true;
+                continue;
+            }
+            client->changes = changes;
+            client->changes_size = size;
+        }
+        ++it->refcount;
+        client->changes[client->nchanges++] = it;
+    }
+    pthread_mutex_unlock(&engine->tap_connections.takeover_lock);
 }
 
-hash_item *touch_item(struct default_engine *engine,
-                           const void *key,
-                           uint16_t nkey,
-                           uint32_t exptime)
-{
-    hash_item *ret;
-
-    pthread_mutex_lock(&engine->cache_lock);
-    ret = do_touch_item(engine, key, nkey, exptime);
-    pthread_mutex_unlock(&engine->cache_lock);
-    return ret;
+/* Called with the takeover lock held */
+static void do_item_tap_stop_recording(struct default_engine *engine,
+                                       struct tap_client *client) {
+    if (!client->recording) {
+        return;
+    }
+    struct tap_client **ptr = &engine->tap_connections.takeover_clients;
+    while (*ptr != client) {
+        ptr = &(*ptr)->next_takeover;
+    }
+    *ptr = client->next_takeover;
+    client->recording = false;
+    --engine->tap_connections.takeovers;
 }
 
-/*
- * Flushes expired items after a flush_all call
- */
-void item_flush_expired(struct default_engine *engine, time_t when) {
-    int i;
-    hash_item *iter, *next;
-
-    pthread_mutex_lock(&engine->cache_lock);
-
-    if (when == 0) {
-        engine->config.oldest_live = engine->server.core->get_current_time() - 1;
-    } else {
-        engine->config.oldest_live = engine->server.core->realtime(when) - 1;
+static void item_tap_iterfunc(struct default_engine *engine,
+                              hash_item *item, void *cookie) {
+    struct tap_client *client = cookie;
+    if (!tap_client_vbucket(client, item->vbucket) || client->failed) {
+        return;
     }
-
-    if (engine->config.oldest_live != 0) {
-        for (i = 0; i < POWER_LARGEST; i++) {
-            /*
-             * The LRU is sorted in decreasing time order, and an item's
-             * timestamp is never newer than its last access time, so we
-             * only need to walk back until we hit an item older than the
-             * oldest_live time.
-             * The oldest_live checking will auto-expire the remaining items.
-             */
-            for (iter = engine->items.heads[i]; iter != NULL; iter = next) {
-                if (iter->time >= engine->config.oldest_live) {
-                    next = iter->next;
-                    if ((iter->iflag & ITEM_SLABBED) == 0) {
-                        do_item_unlink(engine, iter);
-                    }
-                } else {
-                    /* We've hit the first old item. Continue to the next queue. */
-                    break;
-                }
-            }
+    if (client->count == client->size) {
+        /* We take all of the items of a slice in one go */
+        hash_item **batch = realloc(client->batch, 2 * client->size *
+                                    sizeof(*batch));
+        if (batch == NULL) {
+            client->failed = true;
+            return;
         }
+        client->batch = batch;
+        client->size *= 2;
     }
-    pthread_mutex_unlock(&engine->cache_lock);
+    ++item->refcount;
+    client->batch[client->count++] = item;
 }
 
 /*
- * Dumps part of the cache
+ * Refill the batch of the client with the items of the next slices, up
+ * to tap_batch items (and at least one slice) per refill.
+ *
+ * @return false if there is nothing left to send
  */
-char *item_cachedump(struct default_engine *engine,
-                     unsigned int slabs_clsid,
-                     unsigned int limit,
-                     unsigned int *bytes) {
-    char *ret;
-
-    pthread_mutex_lock(&engine->cache_lock);
-    ret = do_item_cachedump(slabs_clsid, limit, bytes);
-    pthread_mutex_unlock(&engine->cache_lock);
-    return ret;
-}
-
-void item_stats(struct default_engine *engine,
-                   ADD_STAT add_stat, const void *cookie)
-{
-    pthread_mutex_lock(&engine->cache_lock);
-    do_item_stats(engine, add_stat, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
+static bool item_tap_fill(struct default_engine *engine,
+                          struct tap_client *client) {
+    size_t want = engine->config.tap_batch > 0 ? engine->config.tap_batch : 1;
+    client->next = client->count = 0;
+    while (client->slice < ASSOC_SLICES && (size_t)client->count < want &&
+           !client->failed) {
+        item_lock(engine, client->slice);
+        assoc_walk_slice(engine, client->slice, item_tap_iterfunc, client);
+        item_unlock(engine, client->slice);
+        ++client->slice;
+    }
+    return client->count > 0 && !client->failed;
 }
 
-
-void item_stats_sizes(struct default_engine *engine,
-                      ADD_STAT add_stat, const void *cookie)
-{
-    pthread_mutex_lock(&engine->cache_lock);
-    do_item_stats_sizes(engine, add_stat, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
+/*
+ * Move the changes recorded for a takeover to the batch
+ *
+ * @return false if there were none (and then we stopped recording)
+ */
+static bool item_tap_drain(struct default_engine *engine,
+                           struct tap_client *client) {
+    client->next = client->count = 0;
+    pthread_mutex_lock(&engine->tap_connections.takeover_lock);
+    if (client->changes_failed) {
+        client->failed = true;
+    } else if (client->nchanges == 0) {
+        do_item_tap_stop_recording(engine, client);
+    } else {
+        hash_item **batch = client->batch;
+        int size = client->size;
+        client->batch = client->changes;
+        client->size = client->changes_size;
+        client->count = client->nchanges;
+        client->changes = batch;
+        client->changes_size = size;
+        client->nchanges = 0;
+    }
+    pthread_mutex_unlock(&engine->tap_connections.takeover_lock);
+    return client->count > 0;
 }
 
-static void do_item_link_cursor(struct default_engine *engine,
-                                hash_item *cursor, int ii)
-{
-    cursor->slabs_clsid = (uint8_t)ii;
-    cursor->next = NULL;
-    cursor->prev = engine->items.tails[ii];
-    engine->items.tails[ii]->next = cursor;
-    engine->items.tails[ii] = cursor;
-    engine->items.sizes[ii]++;
+/* Move the vbuckets of a takeover that are in the from state to another */
+static void item_tap_set_vbuckets(struct default_engine *engine,
+                                  struct tap_client *client,
+                                  vbucket_state_t from, vbucket_state_t to) {
+    for (uint32_t vb = 0; vb < NUM_VBUCKETS; ++vb) {
+        if (tap_client_vbucket(client, (uint16_t)vb) &&
+            get_vbucket_state(engine, (uint16_t)vb) == from) {
+            set_vbucket_state(engine, (uint16_t)vb, to);
+        }
+    }
 }
 
-typedef ENGINE_ERROR_CODE (*ITERFUNC)(struct default_engine *engine,
-                                      hash_item *item, void *cookie);
+/* The most checkpoint ends we wait for a registered client to ack */
+#define TAP_MAX_ACKS 4096
 
-static bool do_item_walk_cursor(struct default_engine *engine,
-                                hash_item *cursor,
-                                int steplength,
-                                ITERFUNC itemfunc,
-                                void* itemdata,
-                                ENGINE_ERROR_CODE *error)
-{
-    int ii = 0;
-    *error = ENGINE_SUCCESS;
+/*
+ * A checkpoint stream sends the checkpoints of its vbuckets after the
+ * last one the client has, taking the vbuckets in turns. Each of them
+ * goes as a TAP_CHECKPOINT_START, the current value of every key (or a
+ * deletion if it's gone) and a TAP_CHECKPOINT_END, with the checkpoint
+ * id as the value of both. A registered client is asked to ack the end,
+ * and that is where it goes on from when it connects again.
+ *
+ * The vbuckets we don't have all of the checkpoints for (from the start,
+ * or because the log was trimmed while the client fell behind) are
+ * backfilled first, and skipped until then. When everything is sent we
+ * wait for a vbucket to change (see checkpoint_wait()).
+ */
 
-    while (cursor->prev != NULL && ii < steplength) {
-        ++ii;
-        /* Move cursor */
-        hash_item *ptr = cursor->prev;
-        item_unlink_q(engine, cursor);
+/* The START and END of a checkpoint: no key, and the id (in network byte
+ * order) as the value */
+static hash_item *item_tap_marker(struct default_engine *engine,
+                                  uint64_t id, const void *cookie) {
+    hash_item *it = item_alloc(engine, "", 0, 0, 0, sizeof(id), cookie);
+    if (it != NULL) {
+        id = memcached_htonll(id);
+        item_value_write(engine, it, 0, &id, sizeof(id));
+    }
+    return it;
+}
 
-        bool done = false;
-        if (ptr == engine->items.heads[cursor->slabs_clsid]) {
-            done = true;
-            cursor->prev = NULL;
-        } else {
-            cursor->next = ptr;
-            cursor->prev = ptr->prev;
-            cursor->prev->next = cursor;
-            ptr->prev = cursor;
+/* Remember the end of a checkpoint a registered client is to ack */
+static bool item_tap_expect_ack(struct tap_client *client, uint16_t vb,
+                                uint64_t id) {
+    if (client->nacks == TAP_MAX_ACKS) {
+        /* It doesn't ack them (and will go on from further back) */
+        memmove(client->acks, client->acks + 1,
+                (TAP_MAX_ACKS - 1) * sizeof(*client->acks));
+        --client->nacks;
+    }
+    if (client->nacks == client->acks_size) {
+        int size = client->acks_size > 0 ? 2 * client->acks_size : 16;
+        struct tap_checkpoint_ack *acks = realloc(client->acks,
+                                                  size * sizeof(*acks));
+        if (acks == NULL) {
+            return false;
         }
+        client->acks = acks;
+        client->acks_size = size;
+    }
+    struct tap_checkpoint_ack *ack = &client->acks[client->nacks++];
+    ack->seqno = ++client->seqno;
+    ack->vbucket = vb;
+    ack->id = id;
+    return true;
+}
 
-        /* Ignore cursors */
-        if (ptr->nkey == 0 && ptr->nbytes == 0) {
-            --ii;
-        } else {
-            *error = itemfunc(engine, ptr, itemdata);
-            if (*error != ENGINE_SUCCESS) {
-                return false;
-            }
+/*
+ * Find the next vbucket with a checkpoint to send, and mark the ones
+ * that need a backfill
+ *
+ * @return false if there is none
+ */
+static bool item_tap_checkpoint_find(struct default_engine *engine,
+                                     struct tap_client *client,
+                                     bool *backfill) {
+    for (int ii = 0; ii < client->nlist; ++ii) {
+        int idx = client->next_vbucket;
+        client->next_vbucket = (idx + 1) % client->nlist;
+        uint16_t vb = client->list[idx];
+        if (tap_client_vbucket(client, vb)) {
+            *backfill = true;
+            continue;
         }
 
-        if (done) {
-            return false;
+        bool trimmed;
+        struct checkpoint *cp = checkpoint_next(engine, vb,
+                                                client->positions[idx],
+                                                &trimmed);
+        if (trimmed) {
+            checkpoint_resume(engine, vb, &client->positions[idx]);
+            client->vbuckets[vb / 8] |= 1 << (vb % 8);
+            *backfill = true;
+        } else if (cp != NULL) {
+            client->sending = cp;
+            client->sending_index = idx;
+            client->sending_started = false;
+            client->sending_key = cp->keys;
+            return true;
         }
     }
-
-    return (cursor->prev != NULL);
+    return false;
 }
 
-static ENGINE_ERROR_CODE item_scrub(struct default_engine *engine,
-                                    hash_item *item,
-                                    void *cookie) {
-    (void)cookie;
-    engine->scrubber.visited++;
-    rel_time_t current_time = engine->server.core->get_current_time();
-    if (item->refcount == 0 &&
-        (item->exptime != 0 && item->exptime < current_time)) {
-        do_item_unlink(engine, item);
-        engine->scrubber.cleaned++;
+/*
+ * The next event of a checkpoint stream
+ *
+ * @return TAP_MUTATION if we put an item in the batch, or the event to
+ *         send (the phase is TAP_PHASE_BACKFILL if we need one)
+ */
+static tap_event_t item_tap_checkpoint(struct default_engine *engine,
+                                       struct tap_client *client,
+                                       const void *cookie, item **itm,
+                                       uint16_t *flags, uint32_t *seqno,
+                                       uint16_t *vbucket) {
+    if (client->sending == NULL) {
+        bool backfill = false;
+        if (!item_tap_checkpoint_find(engine, client, &backfill)) {
+            if (backfill) {
+                client->phase = TAP_PHASE_BACKFILL;
+                client->slice = 0;
+                return TAP_PAUSE;
+            }
+            /* Look once more after we asked to be woken, or we could
+             * miss the change that happens in between */
+            checkpoint_wait(engine, cookie);
+            if (!item_tap_checkpoint_find(engine, client, &backfill)) {
+                return TAP_PAUSE;
+            }
+        }
     }
-    return ENGINE_SUCCESS;
-}
 
-static void item_scrub_class(struct default_engine *engine,
-                             hash_item *cursor) {
-
-    ENGINE_ERROR_CODE ret;
-    bool more;
-    do {
-        pthread_mutex_lock(&engine->cache_lock);
-        more = do_item_walk_cursor(engine, cursor, 200, item_scrub, NULL, &ret);
-        pthread_mutex_unlock(&engine->cache_lock);
-        if (ret != ENGINE_SUCCESS) {
-            break;
+    uint16_t vb = client->list[client->sending_index];
+    *vbucket = vb;
+    if (!client->sending_started) {
+        client->sending_started = true;
+        if ((*itm = item_tap_marker(engine, client->sending->id,
+                                    cookie)) == NULL) {
+            return TAP_DISCONNECT;
         }
-    } while (more);
-}
-
-static void *item_scubber_main(void *arg)
-{
-    struct default_engine *engine = arg;
-    hash_item cursor = { .refcount = 1 };
+        return TAP_CHECKPOINT_START;
+    }
 
-    for (int ii = 0; ii < POWER_LARGEST; ++ii) {
-        pthread_mutex_lock(&engine->cache_lock);
-        bool skip = false;
-        if (engine->items.heads[ii] == NULL) {
-            skip = true;
-        } else {
-            // add the item at the tail
-            do_item_link_cursor(engine, &cursor, ii);
+    while (client->sending_key != NULL) {
+        struct checkpoint_key *k = client->sending_key;
+        client->sending_key = k->next;
+        hash_item *it = item_get(engine, k->key, k->nkey);
+        if (it != NULL && it->vbucket != vb) {
+            item_release(engine, it);
+            it = NULL;
         }
-        pthread_mutex_unlock(&engine->cache_lock);
-
-        if (!skip) {
-            item_scrub_class(engine, &cursor);
+        if (it != NULL) {
+            client->batch[0] = it;
+            client->next = 0;
+            client->count = 1;
+            return TAP_MUTATION;
         }
+        if ((it = item_alloc(engine, k->key, k->nkey, 0, 0, 0,
+                             cookie)) == NULL) {
+            return TAP_DISCONNECT;
+        }
+        *flags = TAP_FLAG_NO_VALUE;
+        *itm = it;
+        return TAP_DELETION;
     }
 
-    pthread_mutex_lock(&engine->scrubber.lock);
-    engine->scrubber.stopped = time(NULL);
-    engine->scrubber.running = false;
-    pthread_mutex_unlock(&engine->scrubber.lock);
-
-    return NULL;
+    uint64_t id = client->sending->id;
+    checkpoint_release(client->sending);
+    client->sending = NULL;
+    client->positions[client->sending_index] = id;
+    if ((*itm = item_tap_marker(engine, id, cookie)) == NULL) {
+        return TAP_DISCONNECT;
+    }
+    if (client->name != NULL && item_tap_expect_ack(client, vb, id)) {
+        *flags = TAP_FLAG_ACK;
+        *seqno = client->seqno;
+    }
+    return TAP_CHECKPOINT_END;
 }
 
-bool item_start_scrub(struct default_engine *engine)
-{
-    bool ret = false;
-    pthread_mutex_lock(&engine->scrubber.lock);
-    if (!engine->scrubber.running) {
-        engine->scrubber.started = time(NULL);
-        engine->scrubber.stopped = 0;
-        engine->scrubber.visited = 0;
-        engine->scrubber.cleaned = 0;
-        engine->scrubber.running = true;
-
-        pthread_t t;
-        pthread_attr_t attr;
-
-        if (pthread_attr_init(&attr) != 0 ||
-            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
-            pthread_create(&t, &attr, item_scubber_main, engine) != 0)
-        {
-            engine->scrubber.running = false;
-        } else {
-            ret = true;
+/* The backfill and checkpoint phases of a checkpoint stream */
+static tap_event_t item_tap_checkpoint_next(struct default_engine *engine,
+                                            struct tap_client *client,
+                                            const void *cookie,
+                                            item **itm, uint16_t *flags,
+                                            uint32_t *seqno,
+                                            uint16_t *vbucket) {
+    for (;;) {
+        if (client->phase == TAP_PHASE_BACKFILL) {
+            if (item_tap_fill(engine, client)) {
+                return TAP_MUTATION;
+            }
+            if (client->failed) {
+                return TAP_DISCONNECT;
+            }
+            /* It has everything it had to backfill */
+            memset(client->vbuckets, 0, NUM_VBUCKETS / 8);
+            client->phase = TAP_PHASE_CHECKPOINT;
+        }
+        tap_event_t event = item_tap_checkpoint(engine, client, cookie, itm,
+                                                flags, seqno, vbucket);
+        if (client->phase != TAP_PHASE_BACKFILL) {
+            return event;
         }
     }
-    pthread_mutex_unlock(&engine->scrubber.lock);
-
-    return ret;
 }
 
-struct tap_client {
-    hash_item cursor;
-    hash_item *it;
-};
+/*
+ * Refill the batch of the client, and move a takeover on to the next
+ * phase when the one it is in has nothing left to send.
+ *
+ * @return TAP_MUTATION if there is a batch, or the event to send
+ */
+static tap_event_t item_tap_next(struct default_engine *engine,
+                                 struct tap_client *client,
+                                 const void *cookie, item **itm,
+                                 void **es, uint16_t *nes,
+                                 uint16_t *flags, uint32_t *seqno,
+                                 uint16_t *vbucket) {
+    if (client->checkpoint) {
+        return item_tap_checkpoint_next(engine, client, cookie, itm, flags,
+                                        seqno, vbucket);
+    }
 
-static ENGINE_ERROR_CODE item_tap_iterfunc(struct default_engine *engine,
-                                    hash_item *item,
-                                    void *cookie) {
-    struct tap_client *client = cookie;
-    client->it = item;
-    ++client->it->refcount;
-    return ENGINE_SUCCESS;
+    switch (client->phase) {
+    case TAP_PHASE_BACKFILL:
+        if (item_tap_fill(engine, client)) {
+            return TAP_MUTATION;
+        }
+        if (!client->takeover || client->failed) {
+            return TAP_DISCONNECT;
+        }
+        item_tap_set_vbuckets(engine, client, vbucket_state_active,
+                              vbucket_state_pending);
+        /* Wait for the stores that are running into the vbuckets (they
+         * hold an item lock) */
+        item_lock_all(engine);
+        item_unlock_all(engine);
+        client->phase = TAP_PHASE_DRAIN;
+        /* FALLTHROUGH */
+    case TAP_PHASE_DRAIN:
+        if (item_tap_drain(engine, client)) {
+            return TAP_MUTATION;
+        }
+        if (client->failed) {
+            return TAP_DISCONNECT;
+        }
+        client->phase = TAP_PHASE_SWITCH;
+        /* FALLTHROUGH */
+    case TAP_PHASE_SWITCH:
+        while (client->switch_vbucket < NUM_VBUCKETS) {
+            uint16_t vb = (uint16_t)client->switch_vbucket++;
+            if (tap_client_vbucket(client, vb)) {
+                set_vbucket_state(engine, vb, vbucket_state_dead);
+                item_vbucket_purge(engine, vb);
+                client->switch_state = htonl(vbucket_state_active);
+                *es = &client->switch_state;
+                *nes = sizeof(client->switch_state);
+                *vbucket = vb;
+                return TAP_VBUCKET_SET;
+            }
+        }
+        client->phase = TAP_PHASE_DONE;
+        /* FALLTHROUGH */
+    case TAP_PHASE_DONE:
+    case TAP_PHASE_CHECKPOINT:
+        break;
+    }
+    return TAP_DISCONNECT;
 }
 
-static tap_event_t do_item_tap_walker(struct default_engine *engine,
-                                         const void *cookie, item **itm,
-                                         void **es, uint16_t *nes, uint8_t *ttl,
-                                         uint16_t *flags, uint32_t *seqno,
-                                         uint16_t *vbucket)
+tap_event_t item_tap_walker(ENGINE_HANDLE* handle,
+                            const void *cookie, item **itm,
+                            void **es, uint16_t *nes, uint8_t *ttl,
+                            uint16_t *flags, uint32_t *seqno,
+                            uint16_t *vbucket)
 {
+    struct default_engine *engine = (struct default_engine*)handle;
     struct tap_client *client = engine->server.cookie->get_engine_specific(cookie);
     if (client == NULL) {
         return TAP_DISCONNECT;
@@ -1143,66 +4579,245 @@ static tap_event_t do_item_tap_walker(struct default_engine *engine,
     *seqno = 0;
     *flags = 0;
     *vbucket = 0;
-    client->it = NULL;
+    *itm = NULL;
 
-    ENGINE_ERROR_CODE r;
+    /* The reference we took in the walk goes with the item (we skip the
+     * ones we fail to read back or decompress) */
+    hash_item *it;
     do {
-        if (!do_item_walk_cursor(engine, &client->cursor, 1, item_tap_iterfunc, client, &r)) {
-            // find next slab class to look at..
-            bool linked = false;
-            for (int ii = client->cursor.slabs_clsid + 1; ii < POWER_LARGEST && !linked;  ++ii) {
-                if (engine->items.heads[ii] != NULL) {
-                    // add the item at the tail
-                    do_item_link_cursor(engine, &client->cursor, ii);
-                    linked = true;
-                }
-            }
-            if (!linked) {
-                break;
+        if (client->next == client->count) {
+            tap_event_t event = item_tap_next(engine, client, cookie, itm,
+                                              es, nes, flags, seqno,
+                                              vbucket);
+            if (event != TAP_MUTATION) {
+                return event;
             }
         }
-    } while (client->it == NULL);
-    *itm = client->it;
+        it = client->batch[client->next++];
+        if (client->takeover && (it->iflag & ITEM_LINKED) == 0) {
+            /* It's gone (the change that replaced it is further down the
+             * batch, or in the next one) */
+            *flags = TAP_FLAG_NO_VALUE;
+            *vbucket = it->vbucket;
+            *itm = it;
+            return TAP_DELETION;
+        }
+        it = item_ext_resolve(engine, it, cookie);
+        if (it != NULL) {
+            it = item_decompress(engine, it, cookie);
+        }
+    } while (it == NULL);
 
-    return (*itm == NULL) ? TAP_DISCONNECT : TAP_MUTATION;
+    *vbucket = it->vbucket;
+    *itm = it;
+    return TAP_MUTATION;
 }
 
-tap_event_t item_tap_walker(ENGINE_HANDLE* handle,
-                            const void *cookie, item **itm,
-                            void **es, uint16_t *nes, uint8_t *ttl,
-                            uint16_t *flags, uint32_t *seqno,
-                            uint16_t *vbucket)
-{
-    tap_event_t ret;
-    struct default_engine *engine = (struct default_engine*)handle;
-    pthread_mutex_lock(&engine->cache_lock);
-    ret = do_item_tap_walker(engine, cookie, itm, es, nes, ttl, flags, seqno, vbucket);
-    pthread_mutex_unlock(&engine->cache_lock);
+static struct tap_client *item_tap_client_create(struct default_engine *engine,
+                                                const void *cookie,
+                                                uint8_t *vbuckets) {
+    int size = engine->config.tap_batch > 0 ?
+        (int)engine->config.tap_batch : 1;
+    struct tap_client *client = calloc(1, sizeof(*client));
+    if (client == NULL) {
+        return NULL;
+    }
+    if ((client->batch = calloc(size, sizeof(hash_item*))) == NULL) {
+        free(client);
+        return NULL;
+    }
+    client->cookie = cookie;
+    client->vbuckets = vbuckets;
+    client->size = size;
+    return client;
+}
 
-    return ret;
+static void item_tap_client_add(struct default_engine *engine,
+                                struct tap_client *client) {
+    pthread_mutex_lock(&engine->tap_connections.lock);
+    client->next_client = engine->tap_connections.clients;
+    if (client->next_client != NULL) {
+        client->next_client->prev_client = client;
+    }
+    engine->tap_connections.clients = client;
+    ++engine->tap_connections.count;
+    pthread_mutex_unlock(&engine->tap_connections.lock);
+
+    engine->server.cookie->store_engine_specific(client->cookie, client);
 }
 
 bool initialize_item_tap_walker(struct default_engine *engine,
-                                const void* cookie)
+                                const void* cookie, uint8_t *vbuckets,
+                                bool takeover)
 {
-    struct tap_client *client = calloc(1, sizeof(*client));
+    struct tap_client *client = item_tap_client_create(engine, cookie,
+                                                       vbuckets);
     if (client == NULL) {
         return false;
     }
-    client->cursor.refcount = 1;
 
-    /* Link the cursor! */
-    bool linked = false;
-    for (int ii = 0; ii < POWER_LARGEST && !linked; ++ii) {
-        pthread_mutex_lock(&engine->cache_lock);
-        if (engine->items.heads[ii] != NULL) {
-            // add the item at the tail
-            do_item_link_cursor(engine, &client->cursor, ii);
-            linked = true;
+    if (takeover) {
+        /* Record the changes before we walk anything */
+        client->takeover = true;
+        pthread_mutex_lock(&engine->tap_connections.takeover_lock);
+        client->recording = true;
+        client->next_takeover = engine->tap_connections.takeover_clients;
+        engine->tap_connections.takeover_clients = client;
+        ++engine->tap_connections.takeovers;
+        pthread_mutex_unlock(&engine->tap_connections.takeover_lock);
+    }
+
+    item_tap_client_add(engine, client);
+    return true;
+}
+
+bool initialize_item_tap_checkpoints(struct default_engine *engine,
+                                     const void *cookie, uint8_t *vbuckets,
+                                     uint16_t *list, uint64_t *positions,
+                                     int count, char *name, size_t nname)
+{
+    struct tap_client *client = item_tap_client_create(engine, cookie,
+                                                       vbuckets);
+    if (client == NULL) {
+        return false;
+    }
+    client->checkpoint = true;
+    client->list = list;
+    client->positions = positions;
+    client->nlist = count;
+    client->name = name;
+    client->nname = nname;
+
+    /* From now on the bitmap has the ones to backfill */
+    memset(vbuckets, 0, NUM_VBUCKETS / 8);
+    client->phase = TAP_PHASE_CHECKPOINT;
+    for (int ii = 0; ii < count; ++ii) {
+        if (!checkpoint_resume(engine, list[ii], &positions[ii])) {
+            vbuckets[list[ii] / 8] |= 1 << (list[ii] % 8);
+            client->phase = TAP_PHASE_BACKFILL;
         }
-        pthread_mutex_unlock(&engine->cache_lock);
     }
 
-    engine->server.cookie->store_engine_specific(cookie, client);
+    item_tap_client_add(engine, client);
     return true;
 }
+
+/* Called with the tap_connections lock held */
+static void do_release_item_tap_walker(struct default_engine *engine,
+                                       struct tap_client *client)
+{
+    if (client->prev_client != NULL) {
+        client->prev_client->next_client = client->next_client;
+    } else {
+        engine->tap_connections.clients = client->next_client;
+    }
+    if (client->next_client != NULL) {
+        client->next_client->prev_client = client->prev_client;
+    }
+    --engine->tap_connections.count;
+
+    while (client->next < client->count) {
+        item_release(engine, client->batch[client->next++]);
+    }
+
+    if (client->takeover) {
+        pthread_mutex_lock(&engine->tap_connections.takeover_lock);
+        do_item_tap_stop_recording(engine, client);
+        pthread_mutex_unlock(&engine->tap_connections.takeover_lock);
+        for (int ii = 0; ii < client->nchanges; ++ii) {
+            item_release(engine, client->changes[ii]);
+        }
+        free(client->changes);
+        if (client->phase != TAP_PHASE_BACKFILL &&
+            client->phase != TAP_PHASE_DONE) {
+            /* We never told the other end to take them */
+            item_tap_set_vbuckets(engine, client, vbucket_state_pending,
+                                  vbucket_state_active);
+        }
+    }
+
+    if (client->checkpoint) {
+        if (client->sending != NULL) {
+            checkpoint_release(client->sending);
+        }
+        free(client->list);
+        free(client->positions);
+        free(client->name);
+        free(client->acks);
+    }
+
+    free(client->batch);
+    free(client->vbuckets);
+    free(client);
+}
+
+void release_item_tap_walker(struct default_engine *engine,
+                             const void *cookie)
+{
+    struct tap_client *client = engine->server.cookie->get_engine_specific(cookie);
+    if (client == NULL) {
+        return;
+    }
+
+    /* The engine specific of a TAP consumer is an item (see tap_notify),
+     * so make sure it's one of ours */
+    pthread_mutex_lock(&engine->tap_connections.lock);
+    struct tap_client *ptr = engine->tap_connections.clients;
+    while (ptr != NULL && ptr != client) {
+        ptr = ptr->next_client;
+    }
+    if (ptr != NULL) {
+        if (client->checkpoint) {
+            checkpoint_unwait(engine, cookie);
+        }
+        do_release_item_tap_walker(engine, client);
+        engine->server.cookie->store_engine_specific(cookie, NULL);
+    }
+    pthread_mutex_unlock(&engine->tap_connections.lock);
+}
+
+ENGINE_ERROR_CODE item_tap_ack(struct default_engine *engine,
+                               const void *cookie, uint32_t seqno,
+                               uint16_t status)
+{
+    struct tap_client *client = engine->server.cookie->get_engine_specific(cookie);
+    ENGINE_ERROR_CODE ret = ENGINE_DISCONNECT;
+    if (client == NULL) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&engine->tap_connections.lock);
+    struct tap_client *ptr = engine->tap_connections.clients;
+    while (ptr != NULL && ptr != client) {
+        ptr = ptr->next_client;
+    }
+    if (ptr != NULL && client->name != NULL) {
+        ret = ENGINE_SUCCESS;
+        int ii = 0;
+        while (ii < client->nacks && client->acks[ii].seqno != seqno) {
+            ++ii;
+        }
+        if (ii < client->nacks) {
+            struct tap_checkpoint_ack *ack = &client->acks[ii];
+            if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                checkpoint_ack(engine, client->name, client->nname,
+                               ack->vbucket, ack->id);
+            }
+            /* The ones before it aren't going to be acked */
+            client->nacks -= ii + 1;
+            memmove(client->acks, client->acks + ii + 1,
+                    client->nacks * sizeof(*client->acks));
+        }
+    }
+    pthread_mutex_unlock(&engine->tap_connections.lock);
+    return ret;
+}
+
+void release_item_tap_walkers(struct default_engine *engine)
+{
+    pthread_mutex_lock(&engine->tap_connections.lock);
+    while (engine->tap_connections.clients != NULL) {
+        do_release_item_tap_walker(engine, engine->tap_connections.clients);
+    }
+    pthread_mutex_unlock(&engine->tap_connections.lock);
+}
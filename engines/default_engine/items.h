@@ -5,10 +5,28 @@
  * You should not try to aquire any of the item locks before calling these
  * functions.
  */
+
+/*
+ * The items refer to each other (and the hash table to the items)
+ * through an item_ref. With COMPACT_ITEMS that is the offset of the item
+ * within the (preallocated) slab arena in CHUNK_ALIGN_BYTES units plus
+ * one, so that zero is NULL. That saves 12 bytes in every item header
+ * and halves the size of the hash table, but limits the cache to 32GB.
+ * Use item_deref() and item_ref_of() to convert between the two.
+ */
+#ifdef COMPACT_ITEMS
+#ifdef USE_SYSTEM_MALLOC
+#error "COMPACT_ITEMS needs the items to live in the slab arena"
+#endif
+typedef uint32_t item_ref;
+#else
+typedef struct _hash_item *item_ref;
+#endif
+
 typedef struct _hash_item {
-    struct _hash_item *next;
-    struct _hash_item *prev;
-    struct _hash_item *h_next; /* hash chain next */
+    item_ref next;
+    item_ref prev;
+    item_ref h_next; /* hash chain next */
     rel_time_t time;  /* least recent access */
     rel_time_t exptime; /**< When the item will expire (relative to process
                          * startup) */
@@ -19,9 +37,33 @@ typedef struct _hash_item {
                      * server, the upper 8 bits is reserved for engine
                      * implementation. */
     unsigned short refcount;
+    uint16_t vbucket; /**< The vbucket it was stored in */
     uint8_t slabs_clsid;/* which slab class we're in */
+    uint8_t hash_tag; /**< The top bits of the hash value of the key (see
+                       * assoc_find()) */
+    uint16_t nsgen; /**< The generation of the namespace of the key when
+                     * the item was linked (see namespace.h) */
 } hash_item;
 
+/*
+ * The segments of the LRU of a slab class. Unless the engine runs with
+ * the segmented LRU all of the items are in the cold segment (but for
+ * the ones the admission filter put on probation, see admission.h).
+ */
+enum lru_segment {
+    LRU_HOT = 0,
+    LRU_WARM,
+    LRU_COLD,
+    LRU_PROBATION,
+    LRU_SEGMENTS
+};
+
+/*
+ * The LRU lists are stored segment by segment, so the list for a slab
+ * class and segment is [segment * POWER_LARGEST + clsid]
+ */
+#define LRU_LISTS (POWER_LARGEST * LRU_SEGMENTS)
+
 typedef struct {
     unsigned int evicted;
     unsigned int evicted_nonzero;
@@ -29,15 +71,92 @@ typedef struct {
     unsigned int outofmemory;
     unsigned int tailrepairs;
     unsigned int reclaimed;
+    unsigned int evicted_segment[LRU_SEGMENTS];
+    unsigned int moves_to_cold;
+    unsigned int moves_to_warm;
 } itemstats_t;
 
 struct items {
-   hash_item *heads[POWER_LARGEST];
-   hash_item *tails[POWER_LARGEST];
+   hash_item *heads[LRU_LISTS];
+   hash_item *tails[LRU_LISTS];
    itemstats_t itemstats[POWER_LARGEST];
-   unsigned int sizes[POWER_LARGEST];
+   unsigned int sizes[LRU_LISTS];
+   /**
+    * Per slab class locks for the LRU lists and the item statistics.
+    * These are only used when lock striping is enabled; otherwise the
+    * cache_lock protects the lists.
+    */
+   pthread_mutex_t lru_locks[POWER_LARGEST];
+   /** When the slab class last evicted an item (under its LRU lock) */
+   rel_time_t evicting[POWER_LARGEST];
+
+   /* The thread moving items between the segments of the segmented LRU */
+   pthread_t maintainer;
+   volatile bool maintainer_running;
+
+   /* The thread moving cold items to the external store */
+   pthread_t ext_flusher;
+   volatile bool ext_flusher_running;
 };
 
+/**
+ * Initialize the item locks. Lock striping is enabled if the engine
+ * is configured with lock_stripes set to a nonzero value (rounded up to
+ * the next power of two).
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE item_locks_init(struct default_engine *engine);
+
+/**
+ * Release the resources allocated by item_locks_init
+ * @param engine handle to the storage engine
+ */
+void item_locks_destroy(struct default_engine *engine);
+
+/**
+ * Lock the stripe protecting the given hash value (or the cache_lock
+ * if striping is disabled)
+ * @param engine handle to the storage engine
+ * @param hash the hash value for the key
+ */
+void item_lock(struct default_engine *engine, uint32_t hash);
+
+/**
+ * Release the lock acquired by item_lock
+ * @param engine handle to the storage engine
+ * @param hash the hash value for the key
+ */
+void item_unlock(struct default_engine *engine, uint32_t hash);
+
+/**
+ * Lock the entire cache (all of the stripes, in order). This is used by
+ * the operations that need a consistent view of the hash table,
+ * like flush_all and the table switch during expansion.
+ * @param engine handle to the storage engine
+ */
+void item_lock_all(struct default_engine *engine);
+
+/**
+ * Release the locks acquired by item_lock_all
+ * @param engine handle to the storage engine
+ */
+void item_unlock_all(struct default_engine *engine);
+
+/**
+ * Start the thread moving items between the segments of the LRU (if the
+ * engine is configured with segmented_lru)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE item_lru_maintainer_start(struct default_engine *engine);
+
+/**
+ * Stop the LRU maintainer thread (and wait for it to terminate)
+ * @param engine handle to the storage engine
+ */
+void item_lru_maintainer_stop(struct default_engine *engine);
+
 
 /**
  * Allocate and initialize a new item structure
@@ -53,6 +172,134 @@ hash_item *item_alloc(struct default_engine *engine,
                       const void *key, size_t nkey, int flags,
                       rel_time_t exptime, int nbytes, const void *cookie);
 
+/**
+ * Allocate a number of items. Only the items with their status set to
+ * ENGINE_SUCCESS are allocated (the ones we can't allocate get it set to
+ * ENGINE_ENOMEM). The expiration times are the ones from the client.
+ * @param engine handle to the storage engine
+ * @param items the items to allocate
+ * @param nitems the number of elements in items
+ * @param cookie the cookie of the connection
+ */
+void item_alloc_multi(struct default_engine *engine,
+                      allocate_multi_item *items, int nitems,
+                      const void *cookie);
+
+/**
+ * Check if we can store an item of the given size (in a single slab
+ * chunk, or in pieces with slab_chunk_max)
+ * @param engine handle to the storage engine
+ * @param nkey the number of bytes in the key
+ * @param nbytes the number of bytes in the body for the item
+ */
+bool item_size_ok(struct default_engine *engine, size_t nkey, size_t nbytes);
+
+/**
+ * Get the pieces of the value of an item. A chunked item (see
+ * slab_chunk_max) has one piece per chunk, the rest only one.
+ * @param engine handle to the storage engine
+ * @param it the item
+ * @param iov where to store the pieces
+ * @param niov the number of elements in iov
+ * @return the number of pieces (iov isn't touched if niov is smaller)
+ */
+int item_get_value(struct default_engine *engine, const hash_item *it,
+                   struct iovec *iov, int niov);
+
+/**
+ * Copy len bytes from src into the value of an item, starting at offset
+ * @param engine handle to the storage engine
+ * @param it the item
+ * @param offset where to start in the value
+ * @param src the data to copy
+ * @param len the number of bytes to copy
+ */
+void item_value_write(struct default_engine *engine, hash_item *it,
+                      size_t offset, const void *src, size_t len);
+
+/**
+ * Copy len bytes of the value of an item (starting at offset) into dst
+ * @param engine handle to the storage engine
+ * @param it the item
+ * @param offset where to start in the value
+ * @param dst where to copy the data
+ * @param len the number of bytes to copy
+ */
+void item_value_read(struct default_engine *engine, hash_item *it,
+                     size_t offset, void *dst, size_t len);
+
+/**
+ * Set up the value compression (if compress_min is set)
+ * @param engine handle to the storage engine
+ */
+void item_compression_init(struct default_engine *engine);
+
+/**
+ * Release the resources allocated by item_compression_init
+ * @param engine handle to the storage engine
+ */
+void item_compression_destroy(struct default_engine *engine);
+
+/**
+ * Get an item we can hand out of the engine. If the value of the item
+ * is compressed we return an (unlinked) copy with the original value.
+ * The reference to the item passed in is released unless it's returned.
+ * @param engine handle to the storage engine
+ * @param it the item (with a reference)
+ * @param cookie cookie provided by the core to identify the client
+ * @return the item, or NULL if we failed to decompress it
+ */
+hash_item *item_decompress(struct default_engine *engine, hash_item *it,
+                           const void *cookie);
+
+/**
+ * Get the value compression statistics
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void item_compression_stats(struct default_engine *engine,
+                            ADD_STAT add_stat, const void *cookie);
+
+/**
+ * Start the thread moving cold items to the external store (if the
+ * engine is configured with ext_path)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE item_ext_flusher_start(struct default_engine *engine);
+
+/**
+ * Stop the external store flusher thread (and wait for it to terminate)
+ * @param engine handle to the storage engine
+ */
+void item_ext_flusher_stop(struct default_engine *engine);
+
+/**
+ * Start reading the value of an item we moved to the external store.
+ * The cookie is notified when the item is back in memory (so that the
+ * core may retry the operation). The reference to the item is released.
+ * @param engine handle to the storage engine
+ * @param it the item (with ITEM_EXTERNAL set)
+ * @param cookie cookie provided by the core to identify the client
+ * @return ENGINE_EWOULDBLOCK (or ENGINE_ENOMEM if we failed to start)
+ */
+ENGINE_ERROR_CODE item_ext_get(struct default_engine *engine, hash_item *it,
+                               const void *cookie);
+
+/**
+ * Get an item we can hand out of the engine, reading its value from the
+ * external store (and blocking on it) if we have to. The reference to
+ * the item passed in is released unless it's returned.
+ * @param engine handle to the storage engine
+ * @param it the item (with a reference)
+ * @param cookie cookie provided by the core to identify the client
+ * @return the item, or NULL if we lost its value
+ */
+hash_item *item_ext_resolve(struct default_engine *engine, hash_item *it,
+                            const void *cookie);
+
 /**
  * Get an item from the cache
  *
@@ -64,6 +311,49 @@ hash_item *item_alloc(struct default_engine *engine,
 hash_item *item_get(struct default_engine *engine,
                     const void *key, const size_t nkey);
 
+/**
+ * Same as item_get, for callers that already hashed the key
+ *
+ * @param engine handle to the storage engine
+ * @param key the key for the item to get
+ * @param nkey the number of bytes in the key
+ * @param hv the hash of the key
+ * @return pointer to the item if it exists or NULL otherwise
+ */
+hash_item *item_get_hv(struct default_engine *engine,
+                       const void *key, const size_t nkey, uint32_t hv);
+
+/**
+ * A get missed a key with leases enabled (see lease.h). The key is
+ * looked up again with the item lock held, and if it's still missing the
+ * caller either gets the lease on it or has to wait for it.
+ *
+ * @param engine handle to the storage engine
+ * @param cookie the cookie of the connection
+ * @param key the key for the item to get
+ * @param nkey the number of bytes in the key
+ * @param hv the hash of the key
+ * @param it where to store the item if someone stored it meanwhile
+ * @return ENGINE_SUCCESS (and *it is set to the item, or to NULL if the
+ *         caller now holds the lease), or ENGINE_EWOULDBLOCK
+ */
+ENGINE_ERROR_CODE item_lease_miss(struct default_engine *engine,
+                                  const void *cookie,
+                                  const void *key, const size_t nkey,
+                                  uint32_t hv, hash_item **it);
+
+/**
+ * Get a number of items from the cache. Only the keys with their status
+ * set to ENGINE_SUCCESS are looked up; the ones we don't find get their
+ * status set to ENGINE_KEY_ENOENT.
+ *
+ * @param engine handle to the storage engine
+ * @param keys the keys to look up
+ * @param nkeys the number of elements in keys
+ */
+void item_get_multi(struct default_engine *engine,
+                    get_multi_key *keys, int nkeys);
+
 /**
  * Reset the item statistics
  * @param engine handle to the storage engine
@@ -140,6 +430,15 @@ hash_item *touch_item(struct default_engine *engine,
                       uint16_t nkey,
                       uint32_t exptime);
 
+/**
+ * Same as touch_item, for callers that already hashed the key
+ */
+hash_item *touch_item_hv(struct default_engine *engine,
+                         const void *key,
+                         uint16_t nkey,
+                         uint32_t exptime,
+                         uint32_t hv);
+
 /**
  * Store an item in the cache
  * @param engine handle to the storage engine
@@ -157,6 +456,39 @@ ENGINE_ERROR_CODE store_item(struct default_engine *engine,
                              ENGINE_STORE_OPERATION operation,
                              const void *cookie);
 
+/**
+ * Store a number of items in the cache, in order. Only the items with
+ * their status set to ENGINE_SUCCESS are stored; the status is set to
+ * the result of the store (and the cas to the CAS of the item if it was
+ * stored).
+ * @param engine handle to the storage engine
+ * @param items the items to store
+ * @param nitems the number of elements in items
+ * @param cookie the cookie of the connection
+ */
+void item_store_multi(struct default_engine *engine,
+                      store_multi_item *items, int nitems,
+                      const void *cookie);
+
+/**
+ * Overwrite len bytes of the value of an item, starting at offset. The
+ * item is patched in place if nobody else holds a reference to it.
+ * @param engine handle to the storage engine
+ * @param cookie the cookie of the connection
+ * @param key the key of the item
+ * @param nkey the number of bytes in the key
+ * @param cas the CAS the item must have (0 for any), set to the new one
+ * @param offset where to start in the value
+ * @param data the bytes to write
+ * @param len the number of bytes to write
+ * @return ENGINE_SUCCESS, or ENGINE_ERANGE if the range isn't in the value
+ */
+ENGINE_ERROR_CODE mutate_range(struct default_engine *engine,
+                               const void *cookie,
+                               const void *key, const int nkey,
+                               uint64_t *cas, uint64_t offset,
+                               const void *data, uint64_t len);
+
 ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
                              const void* cookie,
                              const void* key,
@@ -167,7 +499,8 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
                              const uint64_t initial,
                              const rel_time_t exptime,
                              uint64_t *cas,
-                             uint64_t *result);
+                             uint64_t *result,
+                             uint16_t vbucket);
 
 
 /**
@@ -176,6 +509,135 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
  */
 bool item_start_scrub(struct default_engine *engine);
 
+/**
+ * Reclaim the items of a vbucket in the background (and start the
+ * thread doing it if it isn't running)
+ * @param engine handle to the storage engine
+ * @param vbucket the vbucket that was removed
+ */
+void item_vbucket_purge(struct default_engine *engine, uint16_t vbucket);
+
+/**
+ * Keep the items of a vbucket we haven't reclaimed yet (it's in use again)
+ * @param engine handle to the storage engine
+ * @param vbucket the vbucket
+ */
+void item_vbucket_purge_cancel(struct default_engine *engine,
+                               uint16_t vbucket);
+
+/**
+ * Stop reclaiming the items of the removed vbuckets (and wait for the
+ * thread to terminate)
+ * @param engine handle to the storage engine
+ */
+void item_vbucket_purge_stop(struct default_engine *engine);
+
+/**
+ * Get the statistics of the vbucket purger
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void item_vbucket_purge_stats(struct default_engine *engine,
+                              ADD_STAT add_stat, const void *cookie);
+
+/**
+ * Start the LRU crawler (if the engine is configured with lru_crawler)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE item_crawler_start(struct default_engine *engine);
+
+/**
+ * Stop the LRU crawler (and wait for it to terminate)
+ * @param engine handle to the storage engine
+ */
+void item_crawler_stop(struct default_engine *engine);
+
+/**
+ * Get the LRU crawler statistics
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void item_crawler_stats(struct default_engine *engine,
+                        ADD_STAT add_stat, const void *cookie);
+
+/**
+ * Unlink all of the items stored in a slab page, so that the slab
+ * rebalancer can give the page to another slab class. Items that are
+ * in use are unlinked, but their memory isn't released until the last
+ * reference is released.
+ * @param engine handle to the storage engine
+ * @param id the slab class of the page
+ * @param page the start of the page
+ * @param size the chunk size of the slab class
+ * @param perslab the number of chunks in the page
+ * @param evicted incremented by the number of items we unlinked
+ * @return the number of chunks in the page that are still in use
+ */
+unsigned int item_drain_slab_page(struct default_engine *engine,
+                                  unsigned int id, char *page,
+                                  unsigned int size, unsigned int perslab,
+                                  uint64_t *evicted);
+
+/**
+ * Link the items found in the memory of an earlier run. The items are
+ * relinked in the order they were last accessed, and expired items (and
+ * the ones we can't link) are released.
+ * @param engine handle to the storage engine
+ * @param items the items to restore (the array is sorted in place)
+ * @param nitems the number of items
+ * @param started the absolute time of relative time 0 for the items
+ * @return the number of items restored
+ */
+uint64_t items_restore(struct default_engine *engine, hash_item **items,
+                       size_t nitems, time_t started);
+
+/**
+ * An item read back from a snapshot (see snapshot.h)
+ */
+typedef struct {
+    const void *key;
+    const void *value;
+    uint32_t nbytes;
+    uint32_t flags;
+    rel_time_t exptime;
+    uint16_t nkey;
+    uint16_t vbucket;
+    /** ITEM_COMPRESSED if the value is compressed */
+    uint16_t iflag;
+} load_item;
+
+/**
+ * Link a batch of items read back from a snapshot. The keys we have
+ * already are left alone, and so are the items we can't allocate. The
+ * items are allocated with the lock item_alloc takes (if any) held just
+ * once, and every run of them in the same stripe is linked with the
+ * item lock taken once.
+ * @param engine handle to the storage engine
+ * @param items the items
+ * @param nitems the number of items
+ * @return the number of items linked
+ */
+uint64_t items_load(struct default_engine *engine, const load_item *items,
+                    int nitems);
+
+/**
+ * Call fn for every item of a slice (see assoc_walk_slice()) that hasn't
+ * expired or been flushed. We hold the item lock of the slice meanwhile.
+ * @param engine handle to the storage engine
+ * @param slice the slice
+ * @param fn the function to call
+ * @param cookie passed on to fn
+ */
+void item_walk_slice(struct default_engine *engine, uint32_t slice,
+                     void (*fn)(struct default_engine *engine,
+                                hash_item *it, void *cookie),
+                     void *cookie);
+
 /**
  * The tap walker to walk the hashtables
  */
@@ -185,8 +647,57 @@ tap_event_t item_tap_walker(ENGINE_HANDLE* handle,
                             uint16_t *flags, uint32_t *seqno,
                             uint16_t *vbucket);
 
+/**
+ * Start a backfill for a TAP connection
+ *
+ * @param vbuckets bitmap of the vbuckets to send (NULL for all of them),
+ *                 owned by the walker from now on
+ * @param takeover move the vbuckets to the other end when we're done
+ *                 (vbuckets can't be NULL)
+ */
 bool initialize_item_tap_walker(struct default_engine *engine,
-                                const void* cookie);
+                                const void* cookie, uint8_t *vbuckets,
+                                bool takeover);
+
+/**
+ * Start a checkpoint stream for a TAP connection (see checkpoint.h).
+ * Everything passed in is owned by the walker from now on.
+ *
+ * @param vbuckets a bitmap of NUM_VBUCKETS bits (we use it for the ones
+ *                 to backfill)
+ * @param list the vbuckets to send, in ascending order
+ * @param positions the last checkpoint the client has of each of them
+ * @param count the number of vbuckets in the list
+ * @param name the name of a registered client (NULL if it isn't one)
+ */
+bool initialize_item_tap_checkpoints(struct default_engine *engine,
+                                     const void *cookie, uint8_t *vbuckets,
+                                     uint16_t *list, uint64_t *positions,
+                                     int count, char *name, size_t nname);
+
+/**
+ * A TAP client acked a message we asked it to (the end of a checkpoint)
+ *
+ * @param seqno the sequence number of the message
+ * @param status the status of the ack
+ * @return ENGINE_DISCONNECT if the connection isn't one of our streams
+ */
+ENGINE_ERROR_CODE item_tap_ack(struct default_engine *engine,
+                               const void *cookie, uint32_t seqno,
+                               uint16_t status);
+
+/**
+ * Release the tap walker state for a connection (and unlink its cursor).
+ * It's a noop for connections that aren't TAP producers.
+ */
+void release_item_tap_walker(struct default_engine *engine,
+                             const void *cookie);
+
+/**
+ * Release the tap walker state of all of the connections (when the
+ * engine is destroyed; the cookies aren't touched)
+ */
+void release_item_tap_walkers(struct default_engine *engine);
 
 
 #endif
@@ -0,0 +1,334 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "default_engine.h"
+
+/* The smallest lease table we use (it's grown to the item lock stripes) */
+#define LEASE_MIN_BUCKETS 1024
+
+static inline struct lease **lease_bucket(struct default_engine *engine,
+                                          uint32_t hv) {
+    return &engine->leases.buckets[hv & engine->leases.mask];
+}
+
+static struct lease **lease_find(struct default_engine *engine,
+                                 const void *key, size_t nkey, uint32_t hv) {
+    struct lease **pos = lease_bucket(engine, hv);
+    while (*pos != NULL) {
+        struct lease *l = *pos;
+        if (l->hv == hv && l->nkey == nkey && memcmp(l->key, key, nkey) == 0) {
+            break;
+        }
+        pos = &l->next;
+    }
+    return pos;
+}
+
+/* Hand the waiters over to the lease thread (the caller may hold item
+ * locks, so we can't call back into the core from here) */
+static void lease_wake(struct lease_table *t, struct lease_waiter *waiters) {
+    if (waiters == NULL) {
+        return;
+    }
+    struct lease_waiter *last = waiters;
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    pthread_mutex_lock(&t->lock);
+    last->next = t->wakeups;
+    t->wakeups = waiters;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* Unlink and free a lease, and wake its waiters */
+static void lease_drop(struct default_engine *engine, struct lease **pos) {
+    struct lease *l = *pos;
+    *pos = l->next;
+    lease_wake(&engine->leases, l->waiters);
+    free(l);
+    ATOMIC_DECR(&engine->leases.active);
+}
+
+static void lease_grant(struct default_engine *engine, struct lease *l,
+                        const void *cookie) {
+    struct lease_table *t = &engine->leases;
+    l->token = ATOMIC_ADD_64(&t->tokens, 1);
+    l->holder = cookie;
+    l->expires = engine->server.core->get_current_time() +
+                 (rel_time_t)engine->config.lease_timeout;
+    ATOMIC_ADD_64(&t->granted, 1);
+}
+
+/* Drop the expired leases (all of them if force is set) */
+static void lease_sweep(struct default_engine *engine, bool force) {
+    struct lease_table *t = &engine->leases;
+    rel_time_t now = engine->server.core->get_current_time();
+
+    /* Every item lock covers whole buckets (mask >= item_lock_mask) */
+    for (uint32_t ii = 0; ii <= t->mask; ++ii) {
+        if (*(struct lease * volatile *)&t->buckets[ii] == NULL) {
+            continue;
+        }
+        item_lock(engine, ii);
+        struct lease **pos = &t->buckets[ii];
+        while (*pos != NULL) {
+            if (force || (*pos)->expires <= now) {
+                lease_drop(engine, pos);
+                ATOMIC_ADD_64(&t->expired, 1);
+            } else {
+                pos = &(*pos)->next;
+            }
+        }
+        item_unlock(engine, ii);
+    }
+}
+
+static void lease_notify(struct default_engine *engine,
+                         struct lease_waiter *waiters,
+                         ENGINE_ERROR_CODE status) {
+    while (waiters != NULL) {
+        struct lease_waiter *w = waiters;
+        waiters = w->next;
+        ATOMIC_ADD_64(&engine->leases.woken, 1);
+        engine->server.cookie->notify_io_complete(w->cookie, status);
+        engine->server.cookie->release(w->cookie);
+        free(w);
+    }
+}
+
+static void *lease_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct lease_table *t = &engine->leases;
+    rel_time_t swept = engine->server.core->get_current_time();
+
+    engine->server.core->place_background_thread();
+
+    pthread_mutex_lock(&t->lock);
+    while (t->running) {
+        if (t->wakeups != NULL) {
+            struct lease_waiter *waiters = t->wakeups;
+            t->wakeups = NULL;
+            pthread_mutex_unlock(&t->lock);
+            lease_notify(engine, waiters, ENGINE_SUCCESS);
+            pthread_mutex_lock(&t->lock);
+            continue;
+        }
+
+        if (*(volatile uint32_t *)&t->active == 0) {
+            pthread_cond_wait(&t->cond, &t->lock);
+            continue;
+        }
+
+        /* The leases time out in whole seconds */
+        rel_time_t now = engine->server.core->get_current_time();
+        if (now != swept) {
+            pthread_mutex_unlock(&t->lock);
+            lease_sweep(engine, false);
+            swept = now;
+            pthread_mutex_lock(&t->lock);
+            continue;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&t->cond, &t->lock, &ts);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    /* Nobody gets a value from us anymore */
+    lease_sweep(engine, true);
+    pthread_mutex_lock(&t->lock);
+    struct lease_waiter *waiters = t->wakeups;
+    t->wakeups = NULL;
+    pthread_mutex_unlock(&t->lock);
+    lease_notify(engine, waiters, ENGINE_DISCONNECT);
+    return NULL;
+}
+
+ENGINE_ERROR_CODE lease_init(struct default_engine *engine) {
+    struct lease_table *t = &engine->leases;
+
+    if (engine->config.lease_timeout == 0) {
+        return ENGINE_SUCCESS;
+    }
+
+    size_t nbuckets = LEASE_MIN_BUCKETS;
+    while (nbuckets < engine->config.lock_stripes) {
+        nbuckets <<= 1;
+    }
+    if ((t->buckets = calloc(nbuckets, sizeof(struct lease *))) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    t->mask = (uint32_t)(nbuckets - 1);
+    if (pthread_cond_init(&t->cond, NULL) != 0) {
+        abort();
+    }
+
+    t->running = true;
+    if (pthread_create(&t->thread, NULL, lease_main, engine) != 0) {
+        t->running = false;
+        pthread_cond_destroy(&t->cond);
+        free(t->buckets);
+        t->buckets = NULL;
+        return ENGINE_FAILED;
+    }
+    t->enabled = true;
+    return ENGINE_SUCCESS;
+}
+
+void lease_destroy(struct default_engine *engine) {
+    struct lease_table *t = &engine->leases;
+
+    if (!t->enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    t->running = false;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+
+    pthread_cond_destroy(&t->cond);
+    free(t->buckets);
+    t->buckets = NULL;
+    t->enabled = false;
+}
+
+ENGINE_ERROR_CODE do_lease_miss(struct default_engine *engine,
+                                const void *cookie, const void *key,
+                                size_t nkey, uint32_t hv) {
+    struct lease_table *t = &engine->leases;
+    struct lease **pos = lease_find(engine, key, nkey, hv);
+    struct lease *l = *pos;
+
+    if (l == NULL) {
+        /* If we can't keep track of the lease we let everyone through */
+        if ((l = malloc(sizeof(*l) + nkey)) == NULL) {
+            return ENGINE_KEY_ENOENT;
+        }
+        l->hv = hv;
+        l->waiters = NULL;
+        l->nkey = (uint16_t)nkey;
+        memcpy(l->key, key, nkey);
+        l->next = *lease_bucket(engine, hv);
+        *lease_bucket(engine, hv) = l;
+        if (ATOMIC_INCR(&t->active) == 1) {
+            /* The lease thread sleeps while there's nothing to time out */
+            pthread_mutex_lock(&t->lock);
+            pthread_cond_signal(&t->cond);
+            pthread_mutex_unlock(&t->lock);
+        }
+        lease_grant(engine, l, cookie);
+        return ENGINE_KEY_ENOENT;
+    }
+
+    if (l->holder == cookie) {
+        return ENGINE_KEY_ENOENT;
+    }
+
+    if (l->expires <= engine->server.core->get_current_time()) {
+        /* The holder gave up on us; the waiters wait for the new one */
+        ATOMIC_ADD_64(&t->expired, 1);
+        lease_grant(engine, l, cookie);
+        return ENGINE_KEY_ENOENT;
+    }
+
+    struct lease_waiter *w = malloc(sizeof(*w));
+    if (w == NULL) {
+        return ENGINE_KEY_ENOENT;
+    }
+    w->cookie = cookie;
+    w->next = l->waiters;
+    l->waiters = w;
+    engine->server.cookie->reserve(cookie);
+    ATOMIC_ADD_64(&t->waits, 1);
+    return ENGINE_EWOULDBLOCK;
+}
+
+void do_lease_end(struct default_engine *engine, const void *key,
+                  size_t nkey, uint32_t hv, bool filled) {
+    struct lease_table *t = &engine->leases;
+    if (!t->enabled || *(volatile uint32_t *)&t->active == 0) {
+        return;
+    }
+
+    struct lease **pos = lease_find(engine, key, nkey, hv);
+    if (*pos != NULL) {
+        lease_drop(engine, pos);
+        ATOMIC_ADD_64(filled ? &t->filled : &t->invalidated, 1);
+    }
+}
+
+void lease_invalidate(struct default_engine *engine, const void *key,
+                      size_t nkey) {
+    if (!engine->leases.enabled ||
+        *(volatile uint32_t *)&engine->leases.active == 0) {
+        return;
+    }
+
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
+    item_lock(engine, hv);
+    do_lease_end(engine, key, nkey, hv, false);
+    item_unlock(engine, hv);
+}
+
+bool do_lease_valid(struct default_engine *engine, const void *key,
+                    size_t nkey, uint32_t hv, uint64_t token) {
+    if (!engine->leases.enabled || token == 0) {
+        return false;
+    }
+    struct lease *l = *lease_find(engine, key, nkey, hv);
+    return l != NULL && l->token == token &&
+           l->expires > engine->server.core->get_current_time();
+}
+
+uint64_t lease_get(struct default_engine *engine, const void *cookie,
+                   const void *key, size_t nkey) {
+    if (!engine->leases.enabled) {
+        return 0;
+    }
+
+    uint64_t token = 0;
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
+    item_lock(engine, hv);
+    struct lease *l = *lease_find(engine, key, nkey, hv);
+    if (l != NULL && l->holder == cookie) {
+        token = l->token;
+    }
+    item_unlock(engine, hv);
+    return token;
+}
+
+void lease_stats(struct default_engine *engine,
+                 ADD_STAT add_stat, const void *cookie) {
+    struct lease_table *t = &engine->leases;
+    const char *prefix = "lease";
+
+    add_statistics(cookie, add_stat, prefix, -1, "enabled", "%s",
+                   t->enabled ? "true" : "false");
+    if (!t->enabled) {
+        return;
+    }
+
+    add_statistics(cookie, add_stat, prefix, -1, "timeout", "%zu",
+                   engine->config.lease_timeout);
+    add_statistics(cookie, add_stat, prefix, -1, "active", "%u",
+                   *(volatile uint32_t *)&t->active);
+    add_statistics(cookie, add_stat, prefix, -1, "granted", "%"PRIu64,
+                   t->granted);
+    add_statistics(cookie, add_stat, prefix, -1, "waits", "%"PRIu64, t->waits);
+    add_statistics(cookie, add_stat, prefix, -1, "woken", "%"PRIu64, t->woken);
+    add_statistics(cookie, add_stat, prefix, -1, "filled", "%"PRIu64,
+                   t->filled);
+    add_statistics(cookie, add_stat, prefix, -1, "invalidated", "%"PRIu64,
+                   t->invalidated);
+    add_statistics(cookie, add_stat, prefix, -1, "expired", "%"PRIu64,
+                   t->expired);
+}
@@ -0,0 +1,147 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+/*
+ * Leases (lease_timeout=N) protect the backend from the storm of misses
+ * we get when a popular key expires or is evicted. The first get to miss
+ * a key is handed a lease on it (the engine returns the token through
+ * get_lease(), and the core sends it as the CAS of the miss), and the
+ * gets of the same key that miss until the key is stored again are
+ * parked with ENGINE_EWOULDBLOCK instead of going to the backend too.
+ *
+ * The lease ends when the key is linked again (by any store), deleted,
+ * or when it times out after lease_timeout seconds, and the connections
+ * parked on it are then woken (by the lease thread) to retry their get.
+ * A store with OPERATION_CAS using the token of the lease succeeds on a
+ * missing key as long as the lease is still valid, so that the holder
+ * doesn't put back a value a delete just invalidated.
+ *
+ * The leases are kept in a hash table of their own, where every bucket
+ * is protected by the item lock of its keys.
+ */
+
+/** A connection waiting for a lease to end */
+struct lease_waiter {
+   struct lease_waiter *next;
+   const void *cookie;
+};
+
+struct lease {
+   struct lease *next;
+   uint32_t hv;
+   uint64_t token;
+   rel_time_t expires;
+   /** The cookie of the connection holding the lease */
+   const void *holder;
+   struct lease_waiter *waiters;
+   uint16_t nkey;
+   char key[];
+};
+
+struct lease_table {
+   bool enabled;
+   struct lease **buckets;
+   /** The number of buckets - 1 (never less than the item lock mask) */
+   uint32_t mask;
+   /** The last token handed out, and the number of leases (atomic) */
+   uint64_t tokens;
+   uint32_t active;
+
+   /** The thread waking the waiters and timing out the leases */
+   pthread_t thread;
+   bool running;
+   struct lease_waiter *wakeups;
+   pthread_cond_t cond;
+   /** Protects the three fields above */
+   pthread_mutex_t lock;
+
+   /** Statistics (updated atomically) */
+   uint64_t granted;
+   uint64_t waits;
+   uint64_t woken;
+   uint64_t filled;
+   uint64_t invalidated;
+   uint64_t expired;
+};
+
+/**
+ * Set up the lease table and start the lease thread (if lease_timeout
+ * is set)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE lease_init(struct default_engine *engine);
+
+/**
+ * Stop the lease thread and drop all of the leases; the connections
+ * still waiting are disconnected
+ * @param engine handle to the storage engine
+ */
+void lease_destroy(struct default_engine *engine);
+
+/**
+ * A get missed the key. Called with the item lock for the key held.
+ * @param engine handle to the storage engine
+ * @param cookie the cookie of the connection
+ * @param key the key
+ * @param nkey the length of the key
+ * @param hv the hash of the key
+ * @return ENGINE_KEY_ENOENT if the connection holds the lease (or we
+ *         couldn't create one), ENGINE_EWOULDBLOCK if it has to wait
+ *         for someone else
+ */
+ENGINE_ERROR_CODE do_lease_miss(struct default_engine *engine,
+                                const void *cookie, const void *key,
+                                size_t nkey, uint32_t hv);
+
+/**
+ * End the lease on a key (if any) and wake its waiters. Called with the
+ * item lock for the key held.
+ * @param engine handle to the storage engine
+ * @param key the key
+ * @param nkey the length of the key
+ * @param hv the hash of the key
+ * @param filled true if the key was stored, false if it was deleted
+ */
+void do_lease_end(struct default_engine *engine, const void *key,
+                  size_t nkey, uint32_t hv, bool filled);
+
+/**
+ * Invalidate the lease on a key (if any) because the key was deleted
+ * @param engine handle to the storage engine
+ * @param key the key
+ * @param nkey the length of the key
+ */
+void lease_invalidate(struct default_engine *engine, const void *key,
+                      size_t nkey);
+
+/**
+ * Check if the lease on a key has the given token. Called with the item
+ * lock for the key held.
+ * @return true if it's a valid lease
+ */
+bool do_lease_valid(struct default_engine *engine, const void *key,
+                    size_t nkey, uint32_t hv, uint64_t token);
+
+/**
+ * Get the token of the lease a connection holds on a key
+ * @param engine handle to the storage engine
+ * @param cookie the cookie of the connection
+ * @param key the key
+ * @param nkey the length of the key
+ * @return the token, or 0 if the connection doesn't hold the lease
+ */
+uint64_t lease_get(struct default_engine *engine, const void *cookie,
+                   const void *key, size_t nkey);
+
+/**
+ * Get the statistics of the leases
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void lease_stats(struct default_engine *engine,
+                 ADD_STAT add_stat, const void *cookie);
+
+#endif
@@ -0,0 +1,162 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "default_engine.h"
+
+/* The number of chains of the table (a power of two) */
+#define NAMESPACE_BUCKETS 4096
+
+struct ns_entry {
+    struct ns_entry *next;
+    uint32_t hash;
+    uint16_t generation;
+    uint16_t nprefix;
+    char prefix[];
+};
+
+static struct ns_entry *namespace_find(struct namespaces *ns,
+                                       uint32_t hash,
+                                       const char *prefix, size_t nprefix) {
+    struct ns_entry *entry;
+    entry = ((struct ns_entry * volatile *)ns->buckets)[hash & (NAMESPACE_BUCKETS - 1)];
+    while (entry != NULL) {
+        if (entry->hash == hash && entry->nprefix == nprefix &&
+            memcmp(entry->prefix, prefix, nprefix) == 0) {
+            return entry;
+        }
+        entry = ((volatile struct ns_entry *)entry)->next;
+    }
+    return NULL;
+}
+
+ENGINE_ERROR_CODE namespace_init(struct default_engine *engine) {
+    struct namespaces *ns = &engine->namespaces;
+
+    if (!engine->config.namespaces) {
+        return ENGINE_SUCCESS;
+    }
+
+    ns->delimiter = ':';
+    if (engine->server.core->get_config != NULL) {
+        char *delimiter = NULL;
+        struct config_item items[] = {
+            { .key = "stat_key_prefix",
+              .datatype = DT_STRING,
+              .value.dt_string = &delimiter },
+            { .key = NULL }
+        };
+        if (engine->server.core->get_config(items) &&
+            delimiter != NULL && delimiter[0] != '\0') {
+            ns->delimiter = delimiter[0];
+        }
+        free(delimiter);
+    }
+
+    ns->buckets = calloc(NAMESPACE_BUCKETS, sizeof(*ns->buckets));
+    if (ns->buckets == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    pthread_mutex_init(&ns->lock, NULL);
+    ns->enabled = true;
+    return ENGINE_SUCCESS;
+}
+
+void namespace_destroy(struct default_engine *engine) {
+    struct namespaces *ns = &engine->namespaces;
+
+    if (!ns->enabled) {
+        return;
+    }
+    for (int ii = 0; ii < NAMESPACE_BUCKETS; ++ii) {
+        struct ns_entry *entry = ns->buckets[ii];
+        while (entry != NULL) {
+            struct ns_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(ns->buckets);
+    ns->buckets = NULL;
+    pthread_mutex_destroy(&ns->lock);
+    ns->enabled = false;
+}
+
+uint16_t namespace_generation(struct default_engine *engine,
+                              const void *key, size_t nkey) {
+    struct namespaces *ns = &engine->namespaces;
+    const char *end = memchr(key, ns->delimiter, nkey);
+    if (end == NULL) {
+        return 0;
+    }
+
+    size_t nprefix = end - (const char*)key;
+    uint32_t hash = engine->server.core->hash(key, nprefix, 0);
+    struct ns_entry *entry = namespace_find(ns, hash, key, nprefix);
+    return entry == NULL ? 0 : ((volatile struct ns_entry *)entry)->generation;
+}
+
+ENGINE_ERROR_CODE namespace_bump(struct default_engine *engine,
+                                 const void *prefix, size_t nprefix,
+                                 uint16_t *generation) {
+    struct namespaces *ns = &engine->namespaces;
+
+    if (!ns->enabled) {
+        return ENGINE_ENOTSUP;
+    }
+    if (nprefix == 0 || nprefix > UINT16_MAX ||
+        memchr(prefix, ns->delimiter, nprefix) != NULL) {
+        return ENGINE_EINVAL;
+    }
+
+    uint32_t hash = engine->server.core->hash(prefix, nprefix, 0);
+    pthread_mutex_lock(&ns->lock);
+    struct ns_entry *entry = namespace_find(ns, hash, prefix, nprefix);
+    if (entry == NULL) {
+        if ((entry = malloc(sizeof(*entry) + nprefix)) == NULL) {
+            pthread_mutex_unlock(&ns->lock);
+            return ENGINE_ENOMEM;
+        }
+        entry->hash = hash;
+        entry->generation = 0;
+        entry->nprefix = (uint16_t)nprefix;
+        memcpy(entry->prefix, prefix, nprefix);
+        struct ns_entry **bucket = &ns->buckets[hash & (NAMESPACE_BUCKETS - 1)];
+        entry->next = *bucket;
+        /* The readers don't take the lock: the entry has to be complete
+         * before they can see it */
+        __sync_synchronize();
+        *bucket = entry;
+        ++ns->count;
+    }
+
+    uint16_t next = (uint16_t)(entry->generation + 1);
+    if (next == 0) {
+        next = 1;
+    }
+    ((volatile struct ns_entry *)entry)->generation = next;
+    pthread_mutex_unlock(&ns->lock);
+
+    ATOMIC_ADD_64(&ns->bumps, 1);
+    *generation = next;
+    return ENGINE_SUCCESS;
+}
+
+void namespace_stats(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie) {
+    struct namespaces *ns = &engine->namespaces;
+    const char *prefix = "namespace";
+
+    add_statistics(cookie, add_stat, prefix, -1, "enabled", "%s",
+                   ns->enabled ? "true" : "false");
+    if (!ns->enabled) {
+        return;
+    }
+
+    add_statistics(cookie, add_stat, prefix, -1, "count", "%u", ns->count);
+    add_statistics(cookie, add_stat, prefix, -1, "bumps", "%"PRIu64,
+                   ns->bumps);
+}
@@ -0,0 +1,86 @@
+#ifndef NAMESPACE_H
+#define NAMESPACE_H
+
+/*
+ * Namespaces (namespaces=true) let a client drop all of the keys with a
+ * given prefix at once. The prefix of a key is what comes before the
+ * first prefix delimiter of the core (stat_key_prefix, ':' by default).
+ * A namespace is registered the first time it's bumped (with
+ * PROTOCOL_BINARY_CMD_NS_BUMP), and every item linked in a registered
+ * namespace is stamped with its generation (hash_item.nsgen). Bumping the
+ * generation makes all of the older items of the namespace dead at once:
+ * like the flushed items they are dropped when a get runs into them, and
+ * reclaimed by the crawler and the allocator. The generations are 16
+ * bits (and never 0), so an item would come back to life after 65535
+ * bumps of its namespace if nothing ran into it meanwhile.
+ *
+ * The namespaces are never removed: the readers walk the chains without
+ * a lock, and the bumps are serialized by the lock of the table.
+ */
+
+struct ns_entry;
+
+struct namespaces {
+   bool enabled;
+   /** The character ending the prefix of a key */
+   char delimiter;
+   /** The hash table of the namespaces (namespace.c) */
+   struct ns_entry **buckets;
+   /** Protects the changes of the table */
+   pthread_mutex_t lock;
+   /** The number of namespaces we have */
+   uint32_t count;
+
+   /** Statistics (updated atomically) */
+   uint64_t bumps;
+};
+
+/**
+ * Set up the table of the namespaces (if namespaces is set)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE namespace_init(struct default_engine *engine);
+
+/**
+ * Free the namespaces
+ * @param engine handle to the storage engine
+ */
+void namespace_destroy(struct default_engine *engine);
+
+/**
+ * Get the generation of the namespace of a key
+ * @param engine handle to the storage engine
+ * @param key the key
+ * @param nkey the length of the key
+ * @return the generation, 0 if the key isn't in a namespace
+ */
+uint16_t namespace_generation(struct default_engine *engine,
+                              const void *key, size_t nkey);
+
+/**
+ * Bump the generation of a namespace (it's registered if we didn't have
+ * it), which makes all of the items it has dead
+ * @param engine handle to the storage engine
+ * @param prefix the prefix of the keys of the namespace (without the
+ *               delimiter)
+ * @param nprefix the length of the prefix
+ * @param generation where to store the new generation
+ * @return ENGINE_SUCCESS, ENGINE_ENOTSUP if the namespaces aren't
+ *         enabled or ENGINE_ENOMEM
+ */
+ENGINE_ERROR_CODE namespace_bump(struct default_engine *engine,
+                                 const void *prefix, size_t nprefix,
+                                 uint16_t *generation);
+
+/**
+ * Get the statistics of the namespaces
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void namespace_stats(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie);
+
+#endif
@@ -18,6 +18,12 @@
 #include <pthread.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/file.h>
+#endif
 
 #include "default_engine.h"
 
@@ -26,6 +32,9 @@
  */
 static int do_slabs_newslab(struct default_engine *engine, const unsigned int id);
 static void *memory_allocate(struct default_engine *engine, size_t size);
+static void slabs_magazines_init(struct default_engine *engine);
+static int grow_slab_list(struct default_engine *engine, const unsigned int id);
+static bool do_slabs_push_slot(slabclass_t *p, void *ptr);
 
 #ifndef DONT_PREALLOC_SLABS
 /* Preallocate as many slab pages as possible (called from slabs_init)
@@ -76,6 +85,585 @@ static void *my_allocate(struct default_engine *e, size_t size) {
     return ptr;
 }
 
+/* Give a page from my_allocate back to the system */
+static void my_release(struct default_engine *e, void *ptr) {
+    for (size_t ii = 0; ii < e->slabs.allocs.next; ++ii) {
+        if (e->slabs.allocs.ptrs[ii] == ptr) {
+            e->slabs.allocs.ptrs[ii] = e->slabs.allocs.ptrs[--e->slabs.allocs.next];
+            free(ptr);
+            return;
+        }
+    }
+    assert(false);
+}
+
+/*
+ * The memory budget shared by the engines configured with shared_arena.
+ * All of the buckets of bucket_engine load the same copy of this module,
+ * so it's a single budget for the whole process. The first engine to
+ * join it sets its size. Every engine is charged for the larger of its
+ * reservation (arena_reserved) and the slab pages it allocated, so its
+ * reservation is always there for it.
+ *
+ * cache_size is then a soft maximum: an engine above it only takes a
+ * page if it leaves SHARED_ARENA_PRESSURE() of the budget for the
+ * others, and when they run the arena below that, the slab rebalancer
+ * of the engines above it gives pages back (see slabs_shared_victim()).
+ */
+static struct {
+    pthread_mutex_t lock;
+    size_t limit;
+    size_t committed;
+    int engines;
+} shared_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#define SHARED_ARENA_PRESSURE(limit) ((limit) / 8)
+
+/* How much more an engine is charged when going from malloced to
+ * malloced + len */
+static size_t slabs_shared_delta(struct default_engine *e, size_t malloced,
+                                 size_t len) {
+    size_t reserved = e->slabs.shared.reserved;
+    size_t before = malloced > reserved ? malloced : reserved;
+    size_t after = malloced + len > reserved ? malloced + len : reserved;
+    return after - before;
+}
+
+static ENGINE_ERROR_CODE slabs_shared_join(struct default_engine *e) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    logger = (void*)e->server.extension->get_extension(EXTENSION_LOGGER);
+
+    /* The pages have to be allocated one by one to be given back */
+#ifdef COMPACT_ITEMS
+    bool compact = true;
+#else
+    bool compact = false;
+#endif
+    if (compact || e->config.preallocate || e->config.huge_pages ||
+        e->config.memory_file != NULL) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "shared_arena can't be used with preallocate, "
+                    "huge_pages, memory_file or compact items\n");
+        return ENGINE_EINVAL;
+    }
+
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    pthread_mutex_lock(&shared_arena.lock);
+    if (shared_arena.engines == 0) {
+        shared_arena.limit = e->config.shared_arena;
+    }
+    if (shared_arena.committed + e->config.arena_reserved > shared_arena.limit) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Can't reserve %zu bytes in the shared arena\n",
+                    e->config.arena_reserved);
+        ret = ENGINE_ENOMEM;
+    } else {
+        shared_arena.committed += e->config.arena_reserved;
+        shared_arena.engines++;
+        e->slabs.shared.enabled = true;
+        e->slabs.shared.reserved = e->config.arena_reserved;
+    }
+    pthread_mutex_unlock(&shared_arena.lock);
+    return ret;
+}
+
+static void slabs_shared_leave(struct default_engine *e) {
+    if (e->slabs.shared.enabled) {
+        size_t charged = e->slabs.mem_malloced;
+        if (charged < e->slabs.shared.reserved) {
+            charged = e->slabs.shared.reserved;
+        }
+        pthread_mutex_lock(&shared_arena.lock);
+        shared_arena.committed -= charged;
+        shared_arena.engines--;
+        pthread_mutex_unlock(&shared_arena.lock);
+        e->slabs.shared.enabled = false;
+    }
+}
+
+/* Charge a new page of len bytes (with the slabs lock held) */
+static bool slabs_shared_charge(struct default_engine *e, size_t len) {
+    size_t delta = slabs_shared_delta(e, e->slabs.mem_malloced, len);
+    bool ok;
+
+    pthread_mutex_lock(&shared_arena.lock);
+    size_t avail = shared_arena.limit - shared_arena.committed;
+    ok = delta <= avail;
+    if (ok && e->slabs.mem_limit != 0 &&
+        e->slabs.mem_malloced + len > e->slabs.mem_limit) {
+        ok = avail - delta >= SHARED_ARENA_PRESSURE(shared_arena.limit);
+    }
+    if (ok) {
+        shared_arena.committed += delta;
+    }
+    pthread_mutex_unlock(&shared_arena.lock);
+
+    if (!ok) {
+        e->slabs.shared.denied++;
+    }
+    return ok;
+}
+
+/* Undo slabs_shared_charge (with the slabs lock held) */
+static void slabs_shared_uncharge(struct default_engine *e, size_t len) {
+    size_t delta = slabs_shared_delta(e, e->slabs.mem_malloced, len);
+    pthread_mutex_lock(&shared_arena.lock);
+    shared_arena.committed -= delta;
+    pthread_mutex_unlock(&shared_arena.lock);
+}
+
+#ifdef COMPACT_ITEMS
+/* The number of cursors we reserve in the arena */
+#define SLAB_CURSORS 1024
+#endif
+
+/* The size of a (transparent) huge page on x86-64 */
+#define SLAB_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Map the arena in regions of (at least) this size */
+#define SLAB_REGION_SIZE (64 * 1024 * 1024)
+
+/*
+ * Map a new region for the slab arena. We try to get explicit huge pages
+ * (MAP_HUGETLB) first, and fall back to asking for transparent huge pages
+ */
+static void *slabs_map_region(struct default_engine *e, size_t size) {
+#ifdef HAVE_SYS_MMAN_H
+    void *ptr = MAP_FAILED;
+
+    if (e->slabs.arena.next == e->slabs.arena.size) {
+        size_t n = e->slabs.arena.size + 64;
+        void *p = realloc(e->slabs.arena.regions, n * sizeof(struct slab_region));
+        if (p == NULL) {
+            return NULL;
+        }
+        e->slabs.arena.regions = p;
+        e->slabs.arena.size = n;
+    }
+
+    size = (size + SLAB_HUGE_PAGE_SIZE - 1) & ~((size_t)SLAB_HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+        e->slabs.arena.hugetlb++;
+    }
+#endif
+    if (ptr == MAP_FAILED) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (madvise(ptr, size, MADV_HUGEPAGE) == 0) {
+            e->slabs.arena.thp++;
+        }
+#endif
+    }
+
+    e->slabs.arena.regions[e->slabs.arena.next].base = ptr;
+    e->slabs.arena.regions[e->slabs.arena.next].size = size;
+    e->slabs.arena.next++;
+    e->slabs.arena.mapped += size;
+    return ptr;
+#else
+    (void)e;
+    (void)size;
+    return NULL;
+#endif
+}
+
+/* Carve a slab page out of the arena (mapping a new region if needed) */
+static void *slabs_arena_allocate(struct default_engine *e, size_t size) {
+    if (size > e->slabs.arena.avail) {
+        size_t region = SLAB_REGION_SIZE;
+        if (e->slabs.mem_limit != 0 && e->slabs.mem_limit < region) {
+            region = e->slabs.mem_limit;
+        }
+        if (region < size) {
+            region = size;
+        }
+        /* The rest of the current region is wasted */
+        if ((e->slabs.arena.current = slabs_map_region(e, region)) == NULL) {
+            e->slabs.arena.avail = 0;
+            return NULL;
+        }
+        e->slabs.arena.avail = e->slabs.arena.regions[e->slabs.arena.next - 1].size;
+    }
+
+    void *ret = e->slabs.arena.current;
+    if (size % CHUNK_ALIGN_BYTES) {
+        size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+    }
+    if (size > e->slabs.arena.avail) {
+        size = e->slabs.arena.avail;
+    }
+    e->slabs.arena.current += size;
+    e->slabs.arena.avail -= size;
+    return ret;
+}
+
+/*
+ * With memory_file the metadata we need to reattach to the arena is
+ * written to <memory_file>.meta on a clean shutdown. It is removed
+ * when we attach, so that we start from scratch after a crash.
+ */
+#define SLABS_RESTART_MAGIC 0x4d43524553544152ULL
+#define SLABS_RESTART_VERSION 2
+
+struct slabs_restart_meta {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t item_header;
+    uint64_t arena_size;
+    uint64_t mem_limit;
+    uint64_t item_size_max;
+    uint64_t chunk_size;
+    uint64_t slab_chunk_max;
+    double factor;
+    uint32_t use_cas;
+    uint32_t slab_reassign;
+    int64_t started;
+    uint64_t mem_used;
+    uint64_t mem_malloced;
+    uint32_t npages;
+    uint32_t pad;
+};
+
+struct slabs_restart_page {
+    uint32_t clsid;
+    uint32_t pad;
+    uint64_t offset;
+};
+
+static void slabs_restart_meta_init(struct default_engine *engine,
+                                    struct slabs_restart_meta *meta) {
+    memset(meta, 0, sizeof(*meta));
+    meta->magic = SLABS_RESTART_MAGIC;
+    meta->version = SLABS_RESTART_VERSION;
+    meta->item_header = sizeof(hash_item);
+    meta->arena_size = engine->slabs.restart.size;
+    meta->mem_limit = engine->slabs.mem_limit;
+    meta->item_size_max = engine->config.item_size_max;
+    meta->chunk_size = engine->config.chunk_size;
+    meta->slab_chunk_max = engine->config.slab_chunk_max;
+    meta->factor = engine->config.factor;
+    meta->use_cas = engine->config.use_cas;
+    meta->slab_reassign = engine->config.slab_reassign;
+}
+
+static char *slabs_restart_meta_path(struct default_engine *engine) {
+    size_t len = strlen(engine->config.memory_file) + sizeof(".meta");
+    char *path = malloc(len);
+    if (path != NULL) {
+        snprintf(path, len, "%s.meta", engine->config.memory_file);
+    }
+    return path;
+}
+
+static size_t slabs_page_size(struct default_engine *engine, unsigned int id) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    return engine->config.slab_reassign ?
+        engine->config.item_size_max : p->size * p->perslab;
+}
+
+static ENGINE_ERROR_CODE slabs_map_file(struct default_engine *engine,
+                                        size_t size) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+#ifdef HAVE_SYS_MMAN_H
+    const char *path = engine->config.memory_file;
+    int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to open memory file %s: %s\n",
+                    path, strerror(errno));
+        return ENGINE_FAILED;
+    }
+
+    /* Two instances can't share the memory */
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Memory file %s is in use: %s\n", path, strerror(errno));
+        close(fd);
+        return ENGINE_FAILED;
+    }
+
+    void *ptr = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (ptr == MAP_FAILED) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to map memory file %s: %s\n",
+                    path, strerror(errno));
+        close(fd);
+        return ENGINE_FAILED;
+    }
+
+    engine->slabs.restart.fd = fd;
+    engine->slabs.restart.base = ptr;
+    engine->slabs.restart.size = size;
+    engine->slabs.mem_base = ptr;
+    engine->slabs.mem_current = ptr;
+    engine->slabs.mem_avail = size;
+    return ENGINE_SUCCESS;
+#else
+    logger->log(EXTENSION_LOG_WARNING, NULL,
+                "memory_file is not supported on this platform\n");
+    return ENGINE_ENOTSUP;
+#endif
+}
+
+/*
+ * Try to reattach to the slab pages of an earlier run. We rebuild the
+ * slab lists here; the items and the freelists are rebuilt by
+ * slabs_restore() once the rest of the engine is initialized.
+ */
+static void slabs_attach(struct default_engine *engine) {
+    struct slabs_restart_meta meta, expected;
+    struct slabs_restart_page *pages = NULL;
+    char *path = slabs_restart_meta_path(engine);
+    FILE *fp = path ? fopen(path, "rb") : NULL;
+    bool ok = false;
+
+    if (fp == NULL) {
+        free(path);
+        return;
+    }
+    /* A crash after this point must not make us use the memory again */
+    unlink(path);
+    free(path);
+
+    slabs_restart_meta_init(engine, &expected);
+    if (fread(&meta, sizeof(meta), 1, fp) == 1 &&
+        meta.magic == expected.magic &&
+        meta.version == expected.version &&
+        meta.item_header == expected.item_header &&
+        meta.arena_size == expected.arena_size &&
+        meta.mem_limit == expected.mem_limit &&
+        meta.item_size_max == expected.item_size_max &&
+        meta.chunk_size == expected.chunk_size &&
+        meta.slab_chunk_max == expected.slab_chunk_max &&
+        meta.factor == expected.factor &&
+        meta.use_cas == expected.use_cas &&
+        meta.slab_reassign == expected.slab_reassign &&
+        meta.mem_used <= meta.arena_size &&
+        (char*)engine->slabs.mem_current <=
+        (char*)engine->slabs.mem_base + meta.mem_used &&
+        (pages = calloc(meta.npages + 1, sizeof(*pages))) != NULL &&
+        fread(pages, sizeof(*pages), meta.npages, fp) == meta.npages) {
+        ok = true;
+        for (uint32_t ii = 0; ii < meta.npages && ok; ++ii) {
+            unsigned int id = pages[ii].clsid;
+            ok = id >= POWER_SMALLEST && id <= (unsigned int)engine->slabs.power_largest &&
+                pages[ii].offset + slabs_page_size(engine, id) <= meta.mem_used &&
+                pages[ii].offset % CHUNK_ALIGN_BYTES == 0;
+        }
+    }
+    fclose(fp);
+
+    for (uint32_t ii = 0; ok && ii < meta.npages; ++ii) {
+        unsigned int id = pages[ii].clsid;
+        slabclass_t *p = &engine->slabs.slabclass[id];
+        if (grow_slab_list(engine, id) == 0) {
+            ok = false;
+            break;
+        }
+        p->slab_list[p->slabs++] = (char*)engine->slabs.mem_base + pages[ii].offset;
+    }
+    free(pages);
+
+    if (!ok) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Ignoring the contents of %s (incompatible or corrupt)\n",
+                    engine->config.memory_file);
+        for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+            engine->slabs.slabclass[ii].slabs = 0;
+        }
+        return;
+    }
+
+    engine->slabs.mem_current = (char*)engine->slabs.mem_base + meta.mem_used;
+    engine->slabs.mem_avail = meta.arena_size - meta.mem_used;
+    engine->slabs.mem_malloced = meta.mem_malloced;
+    engine->slabs.restart.started = (time_t)meta.started;
+    engine->slabs.restart.attached = true;
+}
+
+/* Write the metadata needed to reattach to the arena (at shutdown) */
+static void slabs_save(struct default_engine *engine) {
+    struct slabs_restart_meta meta;
+    char *path = slabs_restart_meta_path(engine);
+    char *tmp = path ? malloc(strlen(path) + sizeof(".tmp")) : NULL;
+    FILE *fp = NULL;
+    bool ok = false;
+
+    if (tmp != NULL) {
+        sprintf(tmp, "%s.tmp", path);
+        fp = fopen(tmp, "wb");
+    }
+
+    if (fp != NULL) {
+        slabs_restart_meta_init(engine, &meta);
+        meta.started = engine->server.core->abstime(0);
+        meta.mem_used = (char*)engine->slabs.mem_current - (char*)engine->slabs.mem_base;
+        meta.mem_malloced = engine->slabs.mem_malloced;
+        for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+            meta.npages += engine->slabs.slabclass[ii].slabs;
+        }
+
+        ok = fwrite(&meta, sizeof(meta), 1, fp) == 1;
+        for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest && ok; ++ii) {
+            slabclass_t *p = &engine->slabs.slabclass[ii];
+            for (unsigned int jj = 0; jj < p->slabs && ok; ++jj) {
+                struct slabs_restart_page page = {
+                    .clsid = ii,
+                    .offset = (char*)p->slab_list[jj] - (char*)engine->slabs.mem_base
+                };
+                ok = fwrite(&page, sizeof(page), 1, fp) == 1;
+            }
+        }
+        /* Make sure the arena hits the disk before the metadata */
+#ifdef HAVE_SYS_MMAN_H
+        ok = ok && msync(engine->slabs.restart.base,
+                         engine->slabs.restart.size, MS_SYNC) == 0;
+#endif
+        ok = (fclose(fp) == 0) && ok;
+        ok = ok && rename(tmp, path) == 0;
+        if (!ok) {
+            unlink(tmp);
+        }
+    }
+
+    if (!ok) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to save the metadata for %s\n",
+                    engine->config.memory_file);
+    }
+    free(tmp);
+    free(path);
+}
+
+ENGINE_ERROR_CODE slabs_restore(struct default_engine *engine) {
+    if (!engine->slabs.restart.attached) {
+        return ENGINE_SUCCESS;
+    }
+
+    size_t nchunks = 0;
+    for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        slabclass_t *p = &engine->slabs.slabclass[ii];
+        nchunks += (size_t)p->slabs * p->perslab;
+    }
+
+    hash_item **items = malloc((nchunks + 1) * sizeof(hash_item*));
+    if (items == NULL) {
+        return ENGINE_ENOMEM;
+    }
+
+    /* The chunks that don't hold a linked item go on the freelist */
+    size_t nitems = 0;
+    pthread_mutex_lock(&engine->slabs.lock);
+    for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        slabclass_t *p = &engine->slabs.slabclass[ii];
+        for (unsigned int jj = 0; jj < p->slabs; ++jj) {
+            for (unsigned int kk = 0; kk < p->perslab; ++kk) {
+                hash_item *it = (hash_item*)((char*)p->slab_list[jj] + kk * p->size);
+                if (it->slabs_clsid == ii && (it->iflag & ITEM_LINKED) != 0 &&
+                    (it->iflag & ITEM_SLABBED) == 0) {
+                    items[nitems++] = it;
+                } else {
+                    it->slabs_clsid = 0;
+                    do_slabs_push_slot(p, it);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+
+    engine->slabs.restart.restored = items_restore(engine, items, nitems,
+                                                   engine->slabs.restart.started);
+    free(items);
+    return ENGINE_SUCCESS;
+}
+
+/*
+ * Allocate the memory for a preallocated cache. With COMPACT_ITEMS all of
+ * the items (and the cursors) must live in the arena, so we always
+ * preallocate, and make room for the first page of every slab class
+ * (which do_slabs_newslab() hands out even if we're above the limit).
+ */
+static ENGINE_ERROR_CODE slabs_init_arena(struct default_engine *engine,
+                                          bool preallocate) {
+    size_t arena = engine->slabs.mem_limit;
+
+#ifdef COMPACT_ITEMS
+    size_t stride = sizeof(hash_item);
+    if (stride % CHUNK_ALIGN_BYTES) {
+        stride += CHUNK_ALIGN_BYTES - (stride % CHUNK_ALIGN_BYTES);
+    }
+    arena += engine->slabs.power_largest * engine->config.item_size_max +
+        stride * SLAB_CURSORS;
+
+    /* The items refer to each other by their offset in the arena */
+    if (arena > (size_t)UINT32_MAX * CHUNK_ALIGN_BYTES) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "The cache can't be larger than %zu bytes with compact items\n",
+                    (size_t)UINT32_MAX * CHUNK_ALIGN_BYTES);
+        return ENGINE_EINVAL;
+    }
+    preallocate = true;
+#endif
+
+    if (engine->config.memory_file != NULL) {
+        ENGINE_ERROR_CODE ret = slabs_map_file(engine, arena);
+        if (ret != ENGINE_SUCCESS) {
+            return ret;
+        }
+    } else if (preallocate) {
+        /* Allocate everything in a big chunk with malloc (or mmap) */
+        if (engine->config.huge_pages) {
+            engine->slabs.mem_base = slabs_map_region(engine, arena);
+        }
+        if (engine->slabs.mem_base == NULL) {
+            engine->slabs.mem_base = my_allocate(engine, arena);
+        }
+        if (engine->slabs.mem_base != NULL) {
+            engine->slabs.mem_current = engine->slabs.mem_base;
+            engine->slabs.mem_avail = arena;
+        } else {
+            return ENGINE_ENOMEM;
+        }
+    }
+
+#ifdef COMPACT_ITEMS
+    /* Carve out the cursors before the slab pages */
+    char *cursors = memory_allocate(engine, stride * SLAB_CURSORS);
+    if (cursors == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    for (int ii = SLAB_CURSORS - 1; ii >= 0; --ii) {
+        hash_item *cursor = (hash_item*)(cursors + ii * stride);
+        memset(cursor, 0, sizeof(*cursor));
+        cursor->h_next = engine->slabs.cursors;
+        engine->slabs.cursors = item_ref_of(engine, cursor);
+    }
+#endif
+
+    if (engine->config.memory_file != NULL) {
+        slabs_attach(engine);
+    }
+
+    return ENGINE_SUCCESS;
+}
+
 /**
  * Determines the chunk sizes and initializes the slab class descriptors
  * accordingly.
@@ -86,23 +674,23 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
                              const bool prealloc) {
     int i = POWER_SMALLEST - 1;
     unsigned int size = sizeof(hash_item) + engine->config.chunk_size;
+    /* With slab_chunk_max the larger items are stored in pieces (see
+     * do_item_alloc_chunked()), but the pages are still item_size_max */
+    size_t chunk_max = engine->config.slab_chunk_max != 0 ?
+        engine->config.slab_chunk_max : engine->config.item_size_max;
 
     engine->slabs.mem_limit = limit;
 
-    if (prealloc) {
-        /* Allocate everything in a big chunk with malloc */
-        engine->slabs.mem_base = my_allocate(engine, engine->slabs.mem_limit);
-        if (engine->slabs.mem_base != NULL) {
-            engine->slabs.mem_current = engine->slabs.mem_base;
-            engine->slabs.mem_avail = engine->slabs.mem_limit;
-        } else {
-            return ENGINE_ENOMEM;
+    if (engine->config.shared_arena != 0) {
+        ENGINE_ERROR_CODE ret = slabs_shared_join(engine);
+        if (ret != ENGINE_SUCCESS) {
+            return ret;
         }
     }
 
     memset(engine->slabs.slabclass, 0, sizeof(engine->slabs.slabclass));
 
-    while (++i < POWER_LARGEST && size <= engine->config.item_size_max / factor) {
+    while (++i < POWER_LARGEST && size <= chunk_max / factor) {
         /* Make sure items are always n-byte aligned */
         if (size % CHUNK_ALIGN_BYTES)
             size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
@@ -121,8 +709,9 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
     }
 
     engine->slabs.power_largest = i;
-    engine->slabs.slabclass[engine->slabs.power_largest].size = engine->config.item_size_max;
-    engine->slabs.slabclass[engine->slabs.power_largest].perslab = 1;
+    engine->slabs.slabclass[engine->slabs.power_largest].size = chunk_max;
+    engine->slabs.slabclass[engine->slabs.power_largest].perslab =
+        engine->config.item_size_max / chunk_max;
     if (engine->config.verbose > 1) {
         EXTENSION_LOGGER_DESCRIPTOR *logger;
         logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
@@ -132,6 +721,13 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
                     engine->slabs.slabclass[i].perslab);
     }
 
+    ENGINE_ERROR_CODE ret = slabs_init_arena(engine, prealloc);
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+
+    slabs_magazines_init(engine);
+
     /* for the test suite:  faking of how much we've already malloc'd */
     {
         char *t_initial_malloc = getenv("T_MEMD_INITIAL_MALLOC");
@@ -154,6 +750,73 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
     return ENGINE_SUCCESS;
 }
 
+/* The part of the arena one prefault thread takes */
+struct slabs_prefault_range {
+    char *start;
+    char *end;
+    size_t pagesize;
+};
+
+static void *slabs_prefault_main(void *arg) {
+    struct slabs_prefault_range *r = arg;
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_POPULATE_WRITE)
+    /* The kernel can do it without a fault per page (Linux 5.14) */
+    char *page = (char*)((uintptr_t)r->start & ~(uintptr_t)(r->pagesize - 1));
+    if (madvise(page, r->end - page, MADV_POPULATE_WRITE) == 0) {
+        return NULL;
+    }
+#endif
+    /* Nothing lives in there yet, so we may write to every page */
+    char *ptr = r->start;
+    while (ptr < r->end) {
+        *(volatile char*)ptr = 0;
+        ptr = (char*)(((uintptr_t)ptr + r->pagesize) & ~(uintptr_t)(r->pagesize - 1));
+    }
+    return NULL;
+}
+
+void slabs_prefault(struct default_engine *engine) {
+    size_t nthreads = engine->config.prefault_threads;
+    /* A memory_file may have the items of the last run */
+    if (nthreads == 0 || engine->slabs.mem_base == NULL ||
+        engine->config.memory_file != NULL || engine->slabs.mem_avail == 0) {
+        return;
+    }
+
+    char *start = engine->slabs.mem_current;
+    size_t size = engine->slabs.mem_avail;
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t share = (size / nthreads + pagesize - 1) & ~(pagesize - 1);
+    if (share < pagesize) {
+        share = pagesize;
+    }
+
+    struct slabs_prefault_range ranges[nthreads];
+    pthread_t threads[nthreads];
+    size_t started = 0;
+    for (size_t ii = 0; ii < nthreads && ii * share < size; ++ii) {
+        ranges[ii].start = start + ii * share;
+        ranges[ii].end = ii * share + share < size ? start + ii * share + share :
+            start + size;
+        ranges[ii].pagesize = pagesize;
+        if (pthread_create(&threads[ii], NULL, slabs_prefault_main,
+                           &ranges[ii]) != 0) {
+            /* We'll do that part ourselves */
+            slabs_prefault_main(&ranges[ii]);
+            threads[ii] = pthread_self();
+        }
+        started = ii + 1;
+    }
+    for (size_t ii = 0; ii < started; ++ii) {
+        if (!pthread_equal(threads[ii], pthread_self())) {
+            pthread_join(threads[ii], NULL);
+        }
+    }
+
+    engine->startup.prefault_bytes = size;
+    engine->startup.prefault_threads = (unsigned int)started;
+}
+
 #ifndef DONT_PREALLOC_SLABS
 static void slabs_preallocate (const unsigned int maxslabs) {
     int i;
@@ -186,15 +849,38 @@ static int grow_slab_list (struct default_engine *engine, const unsigned int id)
     return 1;
 }
 
+/* Take a page given back by do_slabs_release_free_pages() (if we have one) */
+static void *do_slabs_reuse_page(struct default_engine *engine) {
+    if (engine->slabs.release.count == 0) {
+        return NULL;
+    }
+    engine->slabs.release.reused++;
+    return engine->slabs.release.pages[--engine->slabs.release.count];
+}
+
 static int do_slabs_newslab(struct default_engine *engine, const unsigned int id) {
     slabclass_t *p = &engine->slabs.slabclass[id];
-    int len = p->size * p->perslab;
+    /* The slab rebalancer needs all of the pages to be of the same size */
+    int len = engine->config.slab_reassign ?
+        (int)engine->config.item_size_max : (int)(p->size * p->perslab);
     char *ptr;
 
-    if ((engine->slabs.mem_limit && engine->slabs.mem_malloced + len > engine->slabs.mem_limit && p->slabs > 0) ||
-        (grow_slab_list(engine, id) == 0) ||
-        ((ptr = memory_allocate(engine, (size_t)len)) == 0)) {
+    if (engine->slabs.shared.enabled) {
+        if (!slabs_shared_charge(engine, len)) {
+            MEMCACHED_SLABS_SLABCLASS_ALLOCATE_FAILED(id);
+            return 0;
+        }
+    } else if (engine->slabs.mem_limit && engine->slabs.mem_malloced + len > engine->slabs.mem_limit && p->slabs > 0) {
+        MEMCACHED_SLABS_SLABCLASS_ALLOCATE_FAILED(id);
+        return 0;
+    }
 
+    if ((grow_slab_list(engine, id) == 0) ||
+        ((ptr = do_slabs_reuse_page(engine)) == NULL &&
+         (ptr = memory_allocate(engine, (size_t)len)) == 0)) {
+        if (engine->slabs.shared.enabled) {
+            slabs_shared_uncharge(engine, len);
+        }
         MEMCACHED_SLABS_SLABCLASS_ALLOCATE_FAILED(id);
         return 0;
     }
@@ -210,6 +896,34 @@ static int do_slabs_newslab(struct default_engine *engine, const unsigned int id
     return 1;
 }
 
+/* Grab a free chunk from a slab class (without the accounting) */
+static void *do_slabs_alloc_chunk(struct default_engine *engine, slabclass_t *p,
+                                  unsigned int id) {
+    void *ret;
+
+    /* fail unless we have space at the end of a recently allocated page,
+       we have something on our freelist, or we could allocate a new page */
+    if (! (p->end_page_ptr != 0 || p->sl_curr != 0 ||
+           do_slabs_newslab(engine, id) != 0)) {
+        /* We don't have more memory available */
+        ret = NULL;
+    } else if (p->sl_curr != 0) {
+        /* return off our freelist */
+        ret = p->slots[--p->sl_curr];
+    } else {
+        /* if we recently allocated a whole page, return from that */
+        assert(p->end_page_ptr != NULL);
+        ret = p->end_page_ptr;
+        if (--p->end_page_free != 0) {
+            p->end_page_ptr = ((caddr_t)p->end_page_ptr) + p->size;
+        } else {
+            p->end_page_ptr = 0;
+        }
+    }
+
+    return ret;
+}
+
 /*@null@*/
 static void *do_slabs_alloc(struct default_engine *engine, const size_t size, unsigned int id) {
     slabclass_t *p;
@@ -233,26 +947,7 @@ static void *do_slabs_alloc(struct default_engine *engine, const size_t size, un
     return ret;
 #endif
 
-    /* fail unless we have space at the end of a recently allocated page,
-       we have something on our freelist, or we could allocate a new page */
-    if (! (p->end_page_ptr != 0 || p->sl_curr != 0 ||
-           do_slabs_newslab(engine, id) != 0)) {
-        /* We don't have more memory available */
-        ret = NULL;
-    } else if (p->sl_curr != 0) {
-        /* return off our freelist */
-        ret = p->slots[--p->sl_curr];
-    } else {
-        /* if we recently allocated a whole page, return from that */
-        assert(p->end_page_ptr != NULL);
-        ret = p->end_page_ptr;
-        if (--p->end_page_free != 0) {
-            p->end_page_ptr = ((caddr_t)p->end_page_ptr) + p->size;
-        } else {
-            p->end_page_ptr = 0;
-        }
-    }
-
+    ret = do_slabs_alloc_chunk(engine, p, id);
     if (ret) {
         p->requested += size;
         MEMCACHED_SLABS_ALLOCATE(size, id, p->size, ret);
@@ -263,10 +958,33 @@ static void *do_slabs_alloc(struct default_engine *engine, const size_t size, un
     return ret;
 }
 
-static void do_slabs_free(struct default_engine *engine, void *ptr, const size_t size, unsigned int id) {
-    slabclass_t *p;
+/* Is ptr within the page the slab rebalancer is moving away? */
+static bool in_dying_page(const slabclass_t *p, const void *ptr) {
+    if (p->killing == 0) {
+        return false;
+    }
+    const char *page = p->slab_list[p->killing - 1];
+    return (const char*)ptr >= page &&
+        (const char*)ptr < page + p->size * p->perslab;
+}
 
-    if (id < POWER_SMALLEST || id > engine->slabs.power_largest)
+static bool do_slabs_push_slot(slabclass_t *p, void *ptr) {
+    if (p->sl_curr == p->sl_total) { /* need more space on the free list */
+        int new_size = (p->sl_total != 0) ? p->sl_total * 2 : 16;  /* 16 is arbitrary */
+        void **new_slots = realloc(p->slots, new_size * sizeof(void *));
+        if (new_slots == 0)
+            return false;
+        p->slots = new_slots;
+        p->sl_total = new_size;
+    }
+    p->slots[p->sl_curr++] = ptr;
+    return true;
+}
+
+static void do_slabs_free(struct default_engine *engine, void *ptr, const size_t size, unsigned int id) {
+    slabclass_t *p;
+
+    if (id < POWER_SMALLEST || id > engine->slabs.power_largest)
         return;
 
     MEMCACHED_SLABS_FREE(size, id, ptr);
@@ -278,15 +996,10 @@ static void do_slabs_free(struct default_engine *engine, void *ptr, const size_t
     return;
 #endif
 
-    if (p->sl_curr == p->sl_total) { /* need more space on the free list */
-        int new_size = (p->sl_total != 0) ? p->sl_total * 2 : 16;  /* 16 is arbitrary */
-        void **new_slots = realloc(p->slots, new_size * sizeof(void *));
-        if (new_slots == 0)
-            return;
-        p->slots = new_slots;
-        p->sl_total = new_size;
+    /* Chunks in a page being moved don't go back on the freelist */
+    if (!in_dying_page(p, ptr) && !do_slabs_push_slot(p, ptr)) {
+        return;
     }
-    p->slots[p->sl_curr++] = ptr;
     p->requested -= size;
     return;
 }
@@ -333,9 +1046,21 @@ static void do_slabs_stats(struct default_engine *engine, ADD_STAT add_stats, co
     for(i = POWER_SMALLEST; i <= engine->slabs.power_largest; i++) {
         slabclass_t *p = &engine->slabs.slabclass[i];
         if (p->slabs != 0) {
-            uint32_t perslab, slabs;
+            uint32_t perslab, slabs, cached = 0;
+            size_t requested = p->requested;
             slabs = p->slabs;
             perslab = p->perslab;
+            for (struct slab_magazine *m = engine->slabs.magazines.all;
+                 m != NULL; m = m->next) {
+                cached += m->count[i];
+                requested += m->requested[i];
+            }
+
+            /* What the items in the chunks in use don't fill */
+            uint32_t used = slabs * perslab - p->sl_curr - p->end_page_free -
+                            cached;
+            size_t chunk_bytes = (size_t)used * p->size;
+            size_t slack = chunk_bytes > requested ? chunk_bytes - requested : 0;
 
             add_statistics(cookie, add_stats, NULL, i, "chunk_size", "%u",
                            p->size);
@@ -346,13 +1071,21 @@ static void do_slabs_stats(struct default_engine *engine, ADD_STAT add_stats, co
             add_statistics(cookie, add_stats, NULL, i, "total_chunks", "%u",
                            slabs * perslab);
             add_statistics(cookie, add_stats, NULL, i, "used_chunks", "%u",
-                           slabs*perslab - p->sl_curr - p->end_page_free);
+                           used);
             add_statistics(cookie, add_stats, NULL, i, "free_chunks", "%u",
                            p->sl_curr);
             add_statistics(cookie, add_stats, NULL, i, "free_chunks_end", "%u",
                            p->end_page_free);
+            if (engine->slabs.magazines.enabled) {
+                add_statistics(cookie, add_stats, NULL, i, "magazine_chunks",
+                               "%u", cached);
+            }
             add_statistics(cookie, add_stats, NULL, i, "mem_requested", "%zu",
-                           p->requested);
+                           requested);
+            add_statistics(cookie, add_stats, NULL, i, "mem_slack", "%zu",
+                           slack);
+            add_statistics(cookie, add_stats, NULL, i, "fragmentation", "%.2f",
+                           chunk_bytes ? (double)slack / chunk_bytes : 0.0);
 #ifdef FUTURE
             add_statistics(cookie, add_stats, NULL, i, "get_hits", "%"PRIu64,
                            thread_stats.slab_stats[i].get_hits);
@@ -374,6 +1107,101 @@ static void do_slabs_stats(struct default_engine *engine, ADD_STAT add_stats, co
     add_statistics(cookie, add_stats, NULL, -1, "active_slabs", "%d", total);
     add_statistics(cookie, add_stats, NULL, -1, "total_malloced", "%zu",
                    engine->slabs.mem_malloced);
+
+    if (engine->slabs.shared.enabled) {
+        const char *prefix = "shared_arena";
+        size_t limit, committed;
+        pthread_mutex_lock(&shared_arena.lock);
+        limit = shared_arena.limit;
+        committed = shared_arena.committed;
+        pthread_mutex_unlock(&shared_arena.lock);
+        add_statistics(cookie, add_stats, prefix, -1, "limit", "%zu", limit);
+        add_statistics(cookie, add_stats, prefix, -1, "committed", "%zu",
+                       committed);
+        add_statistics(cookie, add_stats, prefix, -1, "reserved", "%zu",
+                       engine->slabs.shared.reserved);
+        add_statistics(cookie, add_stats, prefix, -1, "released", "%"PRIu64,
+                       engine->slabs.shared.released);
+        add_statistics(cookie, add_stats, prefix, -1, "denied", "%"PRIu64,
+                       engine->slabs.shared.denied);
+    }
+
+    if (engine->slabs.magazines.enabled) {
+        const char *prefix = "magazine";
+        uint64_t hits = engine->slabs.magazines.hits;
+        uint64_t misses = engine->slabs.magazines.misses;
+        uint64_t refills = engine->slabs.magazines.refills;
+        uint64_t flushes = engine->slabs.magazines.flushes;
+        unsigned int count = 0;
+        for (struct slab_magazine *m = engine->slabs.magazines.all;
+             m != NULL; m = m->next) {
+            hits += m->hits;
+            misses += m->misses;
+            refills += m->refills;
+            flushes += m->flushes;
+            ++count;
+        }
+        add_statistics(cookie, add_stats, prefix, -1, "threads", "%u", count);
+        add_statistics(cookie, add_stats, prefix, -1, "hits", "%"PRIu64, hits);
+        add_statistics(cookie, add_stats, prefix, -1, "misses", "%"PRIu64,
+                       misses);
+        add_statistics(cookie, add_stats, prefix, -1, "refills", "%"PRIu64,
+                       refills);
+        add_statistics(cookie, add_stats, prefix, -1, "flushes", "%"PRIu64,
+                       flushes);
+    }
+
+    if (engine->config.memory_file != NULL) {
+        const char *prefix = "restart";
+        add_statistics(cookie, add_stats, prefix, -1, "attached", "%s",
+                       engine->slabs.restart.attached ? "yes" : "no");
+        add_statistics(cookie, add_stats, prefix, -1, "restored", "%"PRIu64,
+                       engine->slabs.restart.restored);
+    }
+
+    if (engine->config.huge_pages) {
+        const char *prefix = "arena";
+        add_statistics(cookie, add_stats, prefix, -1, "regions", "%zu",
+                       engine->slabs.arena.next);
+        add_statistics(cookie, add_stats, prefix, -1, "mapped", "%zu",
+                       engine->slabs.arena.mapped);
+        add_statistics(cookie, add_stats, prefix, -1, "hugetlb_regions", "%u",
+                       engine->slabs.arena.hugetlb);
+        add_statistics(cookie, add_stats, prefix, -1, "thp_regions", "%u",
+                       engine->slabs.arena.thp);
+    }
+
+    if (engine->config.slab_reassign) {
+        const char *prefix = "rebalance";
+        add_statistics(cookie, add_stats, prefix, -1, "moving", "%s",
+                       engine->slabs.rebalance.src != 0 ? "yes" : "no");
+        add_statistics(cookie, add_stats, prefix, -1, "moves", "%"PRIu64,
+                       engine->slabs.rebalance.moves);
+        add_statistics(cookie, add_stats, prefix, -1, "evicted", "%"PRIu64,
+                       engine->slabs.rebalance.evicted);
+        add_statistics(cookie, add_stats, prefix, -1, "busy_loops", "%"PRIu64,
+                       engine->slabs.rebalance.busy_loops);
+        if (engine->slabs.rebalance.moves != 0) {
+            add_statistics(cookie, add_stats, prefix, -1, "last_src", "%u",
+                           engine->slabs.rebalance.last_src);
+            add_statistics(cookie, add_stats, prefix, -1, "last_dst", "%u",
+                           engine->slabs.rebalance.last_dst);
+            add_statistics(cookie, add_stats, prefix, -1, "last_evicted",
+                           "%"PRIu64, engine->slabs.rebalance.last_evicted);
+            add_statistics(cookie, add_stats, prefix, -1, "last_usec",
+                           "%"PRIu64, engine->slabs.rebalance.last_usec);
+        }
+    }
+
+    if (engine->config.slab_release) {
+        const char *prefix = "release";
+        add_statistics(cookie, add_stats, prefix, -1, "released", "%"PRIu64,
+                       engine->slabs.release.released);
+        add_statistics(cookie, add_stats, prefix, -1, "reused", "%"PRIu64,
+                       engine->slabs.release.reused);
+        add_statistics(cookie, add_stats, prefix, -1, "free_pages", "%u",
+                       engine->slabs.release.count);
+    }
 }
 
 static void *memory_allocate(struct default_engine *engine, size_t size) {
@@ -381,7 +1209,13 @@ static void *memory_allocate(struct default_engine *engine, size_t size) {
 
     if (engine->slabs.mem_base == NULL) {
         /* We are not using a preallocated large memory chunk */
-        ret = my_allocate(engine, size);
+        ret = NULL;
+        if (engine->config.huge_pages) {
+            ret = slabs_arena_allocate(engine, size);
+        }
+        if (ret == NULL) {
+            ret = my_allocate(engine, size);
+        }
     } else {
         ret = engine->slabs.mem_current;
 
@@ -405,8 +1239,215 @@ static void *memory_allocate(struct default_engine *engine, size_t size) {
     return ret;
 }
 
+hash_item *slabs_cursor_alloc(struct default_engine *engine) {
+    hash_item *cursor;
+#ifdef COMPACT_ITEMS
+    pthread_mutex_lock(&engine->slabs.lock);
+    cursor = item_deref(engine, engine->slabs.cursors);
+    if (cursor != NULL) {
+        engine->slabs.cursors = cursor->h_next;
+        memset(cursor, 0, sizeof(*cursor));
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+#else
+    cursor = calloc(1, sizeof(*cursor));
+#endif
+    if (cursor != NULL) {
+        cursor->refcount = 1;
+    }
+    return cursor;
+}
+
+void slabs_cursor_free(struct default_engine *engine, hash_item *cursor) {
+    if (cursor == NULL) {
+        return;
+    }
+#ifdef COMPACT_ITEMS
+    pthread_mutex_lock(&engine->slabs.lock);
+    cursor->h_next = engine->slabs.cursors;
+    engine->slabs.cursors = item_ref_of(engine, cursor);
+    pthread_mutex_unlock(&engine->slabs.lock);
+#else
+    free(cursor);
+#endif
+}
+
+/*
+ * The magazines only cache the chunks of the smaller slab classes, so we
+ * don't keep lots of memory in the threads for the large items.
+ */
+#define SLAB_MAGAZINE_BYTES (64 * 1024)
+
+static void slab_magazine_release(void *arg);
+
+static void slabs_magazines_init(struct default_engine *engine) {
+    size_t size = engine->config.slab_magazine_size;
+
+#ifdef USE_SYSTEM_MALLOC
+    size = 0;
+#endif
+    /* The rebalancer can't find the chunks cached in the threads */
+    if (size < 2 || engine->config.slab_reassign ||
+        pthread_key_create(&engine->slabs.magazines.key,
+                           slab_magazine_release) != 0) {
+        return;
+    }
+
+    for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        size_t capacity = SLAB_MAGAZINE_BYTES / engine->slabs.slabclass[ii].size;
+        if (capacity > size) {
+            capacity = size;
+        }
+        engine->slabs.magazines.capacity[ii] = capacity < 2 ? 0 : capacity;
+    }
+    engine->slabs.magazines.enabled = true;
+}
+
+static struct slab_magazine *slab_magazine_get(struct default_engine *engine) {
+    struct slab_magazine *m;
+
+    if (!engine->slabs.magazines.enabled) {
+        return NULL;
+    }
+
+    m = pthread_getspecific(engine->slabs.magazines.key);
+    if (m == NULL) {
+        size_t nchunks = (engine->slabs.power_largest + 1) *
+            engine->config.slab_magazine_size;
+        if ((m = calloc(1, sizeof(*m))) == NULL ||
+            (m->chunks = calloc(nchunks, sizeof(void*))) == NULL ||
+            pthread_setspecific(engine->slabs.magazines.key, m) != 0) {
+            if (m != NULL) {
+                free(m->chunks);
+                free(m);
+            }
+            return NULL;
+        }
+        m->engine = engine;
+        pthread_mutex_lock(&engine->slabs.lock);
+        m->next = engine->slabs.magazines.all;
+        engine->slabs.magazines.all = m;
+        pthread_mutex_unlock(&engine->slabs.lock);
+    }
+    return m;
+}
+
+static inline void **slab_magazine_chunks(struct default_engine *engine,
+                                          struct slab_magazine *m,
+                                          unsigned int id) {
+    return m->chunks + id * engine->config.slab_magazine_size;
+}
+
+/* Move chunks from the magazine back to the slab class (with the lock) */
+static void do_slab_magazine_flush(struct default_engine *engine,
+                                   struct slab_magazine *m,
+                                   unsigned int id, unsigned int nchunks) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    void **chunks = slab_magazine_chunks(engine, m, id);
+
+    while (nchunks-- > 0 && m->count[id] > 0) {
+        if (!do_slabs_push_slot(p, chunks[m->count[id] - 1])) {
+            break;
+        }
+        --m->count[id];
+    }
+}
+
+/* Called when a thread terminates */
+static void slab_magazine_release(void *arg) {
+    struct slab_magazine *m = arg;
+    struct default_engine *engine = m->engine;
+
+    pthread_mutex_lock(&engine->slabs.lock);
+    for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        do_slab_magazine_flush(engine, m, ii, m->count[ii]);
+        engine->slabs.slabclass[ii].requested += m->requested[ii];
+    }
+    engine->slabs.magazines.hits += m->hits;
+    engine->slabs.magazines.misses += m->misses;
+    engine->slabs.magazines.refills += m->refills;
+    engine->slabs.magazines.flushes += m->flushes;
+
+    struct slab_magazine **prev = &engine->slabs.magazines.all;
+    while (*prev != m) {
+        prev = &(*prev)->next;
+    }
+    *prev = m->next;
+    pthread_mutex_unlock(&engine->slabs.lock);
+
+    free(m->chunks);
+    free(m);
+}
+
+static void *slab_magazine_alloc(struct default_engine *engine,
+                                 struct slab_magazine *m,
+                                 size_t size, unsigned int id) {
+    void **chunks = slab_magazine_chunks(engine, m, id);
+
+    if (m->count[id] != 0) {
+        m->hits++;
+    } else {
+        /* Refill half of the magazine, but don't grab a new page for
+         * anything but the chunk we need right now */
+        slabclass_t *p = &engine->slabs.slabclass[id];
+        unsigned int batch = engine->slabs.magazines.capacity[id] / 2;
+        void *ptr;
+
+        m->misses++;
+        pthread_mutex_lock(&engine->slabs.lock);
+        if ((ptr = do_slabs_alloc_chunk(engine, p, id)) != NULL) {
+            chunks[m->count[id]++] = ptr;
+            while (m->count[id] < batch &&
+                   (p->sl_curr != 0 || p->end_page_ptr != NULL)) {
+                chunks[m->count[id]++] = do_slabs_alloc_chunk(engine, p, id);
+            }
+            m->refills++;
+        }
+        pthread_mutex_unlock(&engine->slabs.lock);
+
+        if (ptr == NULL) {
+            MEMCACHED_SLABS_ALLOCATE_FAILED(size, id);
+            return NULL;
+        }
+    }
+
+    void *ret = chunks[--m->count[id]];
+    m->requested[id] += size;
+    MEMCACHED_SLABS_ALLOCATE(size, id, engine->slabs.slabclass[id].size, ret);
+    return ret;
+}
+
+static void slab_magazine_free(struct default_engine *engine,
+                               struct slab_magazine *m,
+                               void *ptr, size_t size, unsigned int id) {
+    MEMCACHED_SLABS_FREE(size, id, ptr);
+    if (m->count[id] == engine->slabs.magazines.capacity[id]) {
+        pthread_mutex_lock(&engine->slabs.lock);
+        do_slab_magazine_flush(engine, m, id, m->count[id] / 2);
+        pthread_mutex_unlock(&engine->slabs.lock);
+        m->flushes++;
+    }
+
+    if (m->count[id] < engine->slabs.magazines.capacity[id]) {
+        slab_magazine_chunks(engine, m, id)[m->count[id]++] = ptr;
+        m->requested[id] -= size;
+    } else {
+        /* We failed to flush the magazine */
+        pthread_mutex_lock(&engine->slabs.lock);
+        do_slabs_free(engine, ptr, size, id);
+        pthread_mutex_unlock(&engine->slabs.lock);
+    }
+}
+
 void *slabs_alloc(struct default_engine *engine, size_t size, unsigned int id) {
     void *ret;
+    struct slab_magazine *m;
+
+    if (id >= POWER_SMALLEST && id <= engine->slabs.power_largest &&
+        engine->slabs.magazines.capacity[id] != 0 &&
+        (m = slab_magazine_get(engine)) != NULL) {
+        return slab_magazine_alloc(engine, m, size, id);
+    }
 
     pthread_mutex_lock(&engine->slabs.lock);
     ret = do_slabs_alloc(engine, size, id);
@@ -415,6 +1456,15 @@ void *slabs_alloc(struct default_engine *engine, size_t size, unsigned int id) {
 }
 
 void slabs_free(struct default_engine *engine, void *ptr, size_t size, unsigned int id) {
+    struct slab_magazine *m;
+
+    if (id >= POWER_SMALLEST && id <= engine->slabs.power_largest &&
+        engine->slabs.magazines.capacity[id] != 0 &&
+        (m = slab_magazine_get(engine)) != NULL) {
+        slab_magazine_free(engine, m, ptr, size, id);
+        return;
+    }
+
     pthread_mutex_lock(&engine->slabs.lock);
     do_slabs_free(engine, ptr, size, id);
     pthread_mutex_unlock(&engine->slabs.lock);
@@ -443,14 +1493,562 @@ void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id,
     pthread_mutex_unlock(&engine->slabs.lock);
 }
 
+bool slabs_memory_low(struct default_engine *engine, unsigned int id) {
+    bool low = false;
+
+    pthread_mutex_lock(&engine->slabs.lock);
+    if (id >= POWER_SMALLEST && id <= engine->slabs.power_largest &&
+        engine->slabs.mem_limit != 0) {
+        slabclass_t *p = &engine->slabs.slabclass[id];
+        size_t limit = engine->slabs.mem_limit;
+        low = engine->slabs.mem_malloced + limit / 8 >= limit &&
+              p->sl_curr + p->end_page_free < p->perslab;
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+    return low;
+}
+
+/*
+ * The slab rebalancer. A page is moved from one slab class to another in
+ * three steps:
+ *  1. With the slabs lock held we mark the page as dying and remove its
+ *     free chunks from the freelist, so no one may allocate from it.
+ *  2. Without the slabs lock we unlink all of the items in the page
+ *     (see item_drain_slab_page()) until all of them are released.
+ *  3. With the slabs lock held we remove the page from the source class
+ *     and hand it over to the destination class.
+ */
+
+/* Sleep this many usec before we look at the busy items again */
+#define SLAB_MOVE_BUSY_SLEEP 1000
+
+/* The number of windows automove wants to see before it moves a page */
+#define SLAB_AUTOMOVE_WINDOWS 3
+
+static uint64_t rebalance_time_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static bool do_slabs_reassign_ok(struct default_engine *engine,
+                                 unsigned int src, unsigned int dst) {
+    return src != dst &&
+        src >= POWER_SMALLEST && src <= (unsigned int)engine->slabs.power_largest &&
+        dst >= POWER_SMALLEST && dst <= (unsigned int)engine->slabs.power_largest &&
+        engine->slabs.slabclass[src].slabs > 1;
+}
+
+/* Give a page to a slab class (with the slabs lock held) */
+static void do_slabs_add_page(struct default_engine *engine,
+                              unsigned int id, char *page) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+
+    memset(page, 0, engine->config.item_size_max);
+    if (grow_slab_list(engine, id) == 0) {
+        /* We can't track the page, but we may still use its chunks */
+        for (unsigned int ii = 0; ii < p->perslab; ++ii) {
+            if (!do_slabs_push_slot(p, page + ii * p->size)) {
+                break;
+            }
+        }
+        return;
+    }
+
+    p->slab_list[p->slabs++] = page;
+    if (p->end_page_ptr == NULL) {
+        p->end_page_ptr = page;
+        p->end_page_free = p->perslab;
+    } else {
+        for (unsigned int ii = 0; ii < p->perslab; ++ii) {
+            if (!do_slabs_push_slot(p, page + ii * p->size)) {
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Pick the slab class to give a page back to the shared arena from, if
+ * the arena is short of memory and we're above our soft maximum (the
+ * class with the most free chunks, like automove)
+ */
+static unsigned int slabs_shared_victim(struct default_engine *engine) {
+    bool pressure;
+    pthread_mutex_lock(&shared_arena.lock);
+    pressure = shared_arena.limit - shared_arena.committed <
+        SHARED_ARENA_PRESSURE(shared_arena.limit);
+    pthread_mutex_unlock(&shared_arena.lock);
+    if (!pressure) {
+        return 0;
+    }
+
+    unsigned int victim = 0;
+    unsigned int most_free = 0;
+    pthread_mutex_lock(&engine->slabs.lock);
+    size_t page = engine->config.item_size_max;
+    if (engine->slabs.mem_malloced >= engine->slabs.mem_limit + page &&
+        engine->slabs.mem_malloced >= engine->slabs.shared.reserved + page) {
+        for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+            slabclass_t *p = &engine->slabs.slabclass[ii];
+            unsigned int nfree = p->sl_curr + p->end_page_free;
+            if (p->slabs > 1 && (victim == 0 || nfree > most_free)) {
+                victim = ii;
+                most_free = nfree;
+            }
+        }
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+    return victim;
+}
+
+/* Give a drained page back to the shared arena (with the slabs lock held) */
+static void do_slabs_release_page(struct default_engine *engine, char *page) {
+    size_t len = engine->config.item_size_max;
+    engine->slabs.mem_malloced -= len;
+    slabs_shared_uncharge(engine, len);
+    my_release(engine, page);
+    engine->slabs.shared.released++;
+}
+
+/* Give the memory of a page back to the system (but keep the mapping) */
+static void slabs_discard_memory(void *ptr, size_t len) {
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_DONTNEED)
+    uintptr_t pagesize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)ptr + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t end = ((uintptr_t)ptr + len) & ~(pagesize - 1);
+    if (end > start) {
+        /* The chunks are free, so it doesn't matter if this fails */
+        (void)madvise((void*)start, end - start, MADV_DONTNEED);
+    }
+#else
+    (void)ptr;
+    (void)len;
+#endif
+}
+
+static int page_compare(const void *a, const void *b) {
+    const char *pa = *(char * const *)a;
+    const char *pb = *(char * const *)b;
+    return pa < pb ? -1 : pa > pb;
+}
+
+/* The index of the page ptr is in (in pages sorted by address), or -1 */
+static int slabs_page_index(char **pages, unsigned int npages, size_t len,
+                            const void *ptr) {
+    unsigned int lo = 0;
+    unsigned int hi = npages;
+    while (hi - lo > 1) {
+        unsigned int mid = (lo + hi) / 2;
+        if (pages[mid] <= (const char*)ptr) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if (npages == 0 || (const char*)ptr < pages[lo] ||
+        (const char*)ptr >= pages[lo] + len) {
+        return -1;
+    }
+    return (int)lo;
+}
+
+/*
+ * Take the pages of a slab class that have nothing but free chunks (on
+ * the freelist or at the end of the last page) away from it, and give
+ * them back (with the slabs lock held). We keep a page in every class.
+ * The magazines are disabled with slab_reassign, so every free chunk is
+ * on the freelist. Returns the number of pages released.
+ */
+static unsigned int do_slabs_release_free_pages(struct default_engine *engine,
+                                                unsigned int id) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    size_t len = engine->config.item_size_max;
+    unsigned int npages = p->slabs;
+
+    if (npages < 2 || p->killing != 0 ||
+        p->sl_curr + p->end_page_free < 2 * p->perslab) {
+        return 0;
+    }
+
+    char **pages = malloc(npages * sizeof(char*));
+    unsigned int *nfree = calloc(npages, sizeof(unsigned int));
+    if (pages == NULL || nfree == NULL) {
+        free(pages);
+        free(nfree);
+        return 0;
+    }
+    memcpy(pages, p->slab_list, npages * sizeof(char*));
+    qsort(pages, npages, sizeof(char*), page_compare);
+
+    for (unsigned int ii = 0; ii < p->sl_curr; ++ii) {
+        int idx = slabs_page_index(pages, npages, len, p->slots[ii]);
+        if (idx >= 0) {
+            nfree[idx]++;
+        }
+    }
+    if (p->end_page_ptr != NULL) {
+        int idx = slabs_page_index(pages, npages, len, p->end_page_ptr);
+        if (idx >= 0) {
+            nfree[idx] += p->end_page_free;
+        }
+    }
+
+    /* nfree[] is 1 for the pages we release from now on */
+    unsigned int nrelease = 0;
+    for (unsigned int ii = 0; ii < npages; ++ii) {
+        nfree[ii] = nrelease + 1 < npages && nfree[ii] == p->perslab;
+        nrelease += nfree[ii];
+    }
+
+    struct slabs *s = &engine->slabs;
+    if (nrelease != 0 && !s->shared.enabled &&
+        s->release.count + nrelease > s->release.size) {
+        unsigned int size = s->release.count + nrelease + 16;
+        void **ptrs = realloc(s->release.pages, size * sizeof(void*));
+        if (ptrs == NULL) {
+            nrelease = 0;
+        } else {
+            s->release.pages = ptrs;
+            s->release.size = size;
+        }
+    }
+    if (nrelease == 0) {
+        free(pages);
+        free(nfree);
+        return 0;
+    }
+
+    unsigned int kept = 0;
+    for (unsigned int ii = 0; ii < p->sl_curr; ++ii) {
+        int idx = slabs_page_index(pages, npages, len, p->slots[ii]);
+        if (idx < 0 || !nfree[idx]) {
+            p->slots[kept++] = p->slots[ii];
+        }
+    }
+    p->sl_curr = kept;
+    if (p->end_page_ptr != NULL &&
+        nfree[slabs_page_index(pages, npages, len, p->end_page_ptr)]) {
+        p->end_page_ptr = NULL;
+        p->end_page_free = 0;
+    }
+
+    kept = 0;
+    for (unsigned int ii = 0; ii < npages; ++ii) {
+        char *page = p->slab_list[ii];
+        if (!nfree[slabs_page_index(pages, npages, len, page)]) {
+            p->slab_list[kept++] = page;
+        } else if (s->shared.enabled) {
+            do_slabs_release_page(engine, page);
+        } else {
+            slabs_discard_memory(page, len);
+            s->release.pages[s->release.count++] = page;
+            s->mem_malloced -= len;
+        }
+    }
+    p->slabs = kept;
+    s->release.released += nrelease;
+
+    free(pages);
+    free(nfree);
+    return nrelease;
+}
+
+/* Release the free pages of all of the slab classes (see slab_release) */
+static void slabs_release_free_pages(struct default_engine *engine) {
+    for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        pthread_mutex_lock(&engine->slabs.lock);
+        do_slabs_release_free_pages(engine, ii);
+        pthread_mutex_unlock(&engine->slabs.lock);
+    }
+}
+
+/* Move a page from src to dst, or to the shared arena if dst is 0 */
+static void slabs_move_page(struct default_engine *engine,
+                            unsigned int src, unsigned int dst) {
+    slabclass_t *s = &engine->slabs.slabclass[src];
+    uint64_t start = rebalance_time_usec();
+    uint64_t evicted = 0;
+    unsigned int busy;
+    char *page, *end;
+
+    pthread_mutex_lock(&engine->slabs.lock);
+    if (dst == 0 ? engine->slabs.slabclass[src].slabs < 2 :
+        !do_slabs_reassign_ok(engine, src, dst)) {
+        pthread_mutex_unlock(&engine->slabs.lock);
+        return;
+    }
+
+    s->killing = 1;
+    page = s->slab_list[0];
+    end = page + s->size * s->perslab;
+
+    unsigned int kept = 0;
+    for (unsigned int ii = 0; ii < s->sl_curr; ++ii) {
+        if (!in_dying_page(s, s->slots[ii])) {
+            s->slots[kept++] = s->slots[ii];
+        }
+    }
+    s->sl_curr = kept;
+    if ((char*)s->end_page_ptr >= page && (char*)s->end_page_ptr < end) {
+        s->end_page_ptr = NULL;
+        s->end_page_free = 0;
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+
+    while ((busy = item_drain_slab_page(engine, src, page, s->size,
+                                        s->perslab, &evicted)) != 0) {
+        if (!engine->slabs.rebalance.running) {
+            /* We're shutting down, and the memory is released anyway */
+            return;
+        }
+        pthread_mutex_lock(&engine->slabs.lock);
+        engine->slabs.rebalance.busy_loops++;
+        pthread_mutex_unlock(&engine->slabs.lock);
+        usleep(SLAB_MOVE_BUSY_SLEEP);
+    }
+
+    pthread_mutex_lock(&engine->slabs.lock);
+    s->slab_list[0] = s->slab_list[--s->slabs];
+    s->killing = 0;
+    if (dst == 0) {
+        do_slabs_release_page(engine, page);
+        pthread_mutex_unlock(&engine->slabs.lock);
+        return;
+    }
+    do_slabs_add_page(engine, dst, page);
+
+    engine->slabs.rebalance.moves++;
+    engine->slabs.rebalance.evicted += evicted;
+    engine->slabs.rebalance.last_src = src;
+    engine->slabs.rebalance.last_dst = dst;
+    engine->slabs.rebalance.last_evicted = evicted;
+    engine->slabs.rebalance.last_usec = rebalance_time_usec() - start;
+    pthread_mutex_unlock(&engine->slabs.lock);
+}
+
+/*
+ * Look at the evictions since the last window. We move a page to the class
+ * that has had the most evictions for SLAB_AUTOMOVE_WINDOWS windows in a
+ * row, from the class with the most free chunks among the ones without
+ * evictions in the same period.
+ */
+static bool slabs_automove_decide(struct default_engine *engine,
+                                  unsigned int *src, unsigned int *dst) {
+    unsigned int highest = 0;
+    unsigned int highest_delta = 0;
+    unsigned int evicted[MAX_NUMBER_OF_SLAB_CLASSES];
+
+    /* The eviction counters belong to the LRU locks, so don't take the
+     * slabs lock before we've read them (we may see stale values) */
+    for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        evicted[ii] = engine->items.itemstats[ii].evicted;
+    }
+
+    for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        unsigned int delta = evicted[ii] - engine->slabs.rebalance.evicted_old[ii];
+        engine->slabs.rebalance.evicted_old[ii] = evicted[ii];
+        if (delta == 0) {
+            engine->slabs.rebalance.zero_windows[ii]++;
+        } else {
+            engine->slabs.rebalance.zero_windows[ii] = 0;
+            if (delta > highest_delta) {
+                highest_delta = delta;
+                highest = ii;
+            }
+        }
+    }
+
+    if (highest != 0 && highest == engine->slabs.rebalance.last_highest) {
+        engine->slabs.rebalance.highest_windows++;
+    } else {
+        engine->slabs.rebalance.highest_windows = highest != 0 ? 1 : 0;
+    }
+    engine->slabs.rebalance.last_highest = highest;
+
+    if (engine->slabs.rebalance.highest_windows < SLAB_AUTOMOVE_WINDOWS) {
+        return false;
+    }
+
+    unsigned int victim = 0;
+    unsigned int most_free = 0;
+    pthread_mutex_lock(&engine->slabs.lock);
+    for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        slabclass_t *p = &engine->slabs.slabclass[ii];
+        unsigned int nfree = p->sl_curr + p->end_page_free;
+        if (ii != (int)highest && p->slabs > 1 &&
+            engine->slabs.rebalance.zero_windows[ii] >= SLAB_AUTOMOVE_WINDOWS &&
+            (victim == 0 || nfree > most_free)) {
+            victim = ii;
+            most_free = nfree;
+        }
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+
+    if (victim == 0) {
+        return false;
+    }
+
+    *src = victim;
+    *dst = highest;
+    engine->slabs.rebalance.highest_windows = 0;
+    return true;
+}
+
+static void *slabs_rebalancer_main(void *arg) {
+    struct default_engine *engine = arg;
+    uint64_t interval = (uint64_t)engine->config.slab_automove_interval * 1000000;
+    uint64_t next_check = rebalance_time_usec() + interval;
+    uint64_t next_release = next_check;
+    /* The pages of the memory file have to stay where they are */
+    bool release = engine->config.slab_release &&
+        engine->config.memory_file == NULL;
+
+    engine->server.core->place_background_thread();
+
+    while (engine->slabs.rebalance.running) {
+        unsigned int src, dst;
+
+        pthread_mutex_lock(&engine->slabs.lock);
+        src = engine->slabs.rebalance.src;
+        dst = engine->slabs.rebalance.dst;
+        pthread_mutex_unlock(&engine->slabs.lock);
+
+        if (src == 0 && engine->config.slab_automove &&
+            rebalance_time_usec() >= next_check) {
+            next_check = rebalance_time_usec() + interval;
+            if (slabs_automove_decide(engine, &src, &dst)) {
+                pthread_mutex_lock(&engine->slabs.lock);
+                if (engine->slabs.rebalance.src == 0) {
+                    engine->slabs.rebalance.src = src;
+                    engine->slabs.rebalance.dst = dst;
+                } else {
+                    src = 0;
+                }
+                pthread_mutex_unlock(&engine->slabs.lock);
+            } else {
+                src = 0;
+            }
+        }
+
+        if (src == 0 && engine->slabs.shared.enabled) {
+            /* Nobody may ask the rebalancer for a move while it's
+             * giving a page back */
+            src = slabs_shared_victim(engine);
+            dst = 0;
+            if (src != 0) {
+                pthread_mutex_lock(&engine->slabs.lock);
+                if (engine->slabs.rebalance.src == 0) {
+                    engine->slabs.rebalance.src = src;
+                    engine->slabs.rebalance.dst = dst;
+                } else {
+                    src = 0;
+                }
+                pthread_mutex_unlock(&engine->slabs.lock);
+            }
+        }
+
+        if (src == 0 && release && rebalance_time_usec() >= next_release) {
+            next_release = rebalance_time_usec() + interval;
+            slabs_release_free_pages(engine);
+        }
+
+        if (src != 0) {
+            slabs_move_page(engine, src, dst);
+            pthread_mutex_lock(&engine->slabs.lock);
+            engine->slabs.rebalance.src = 0;
+            engine->slabs.rebalance.dst = 0;
+            pthread_mutex_unlock(&engine->slabs.lock);
+        } else {
+            usleep(10000);
+        }
+    }
+
+    return NULL;
+}
+
+ENGINE_ERROR_CODE slabs_rebalancer_start(struct default_engine *engine) {
+    if (!engine->config.slab_reassign) {
+        return ENGINE_SUCCESS;
+    }
+
+    engine->slabs.rebalance.running = true;
+    if (pthread_create(&engine->slabs.rebalance.thread, NULL,
+                       slabs_rebalancer_main, engine) != 0) {
+        engine->slabs.rebalance.running = false;
+        return ENGINE_FAILED;
+    }
+    return ENGINE_SUCCESS;
+}
+
+void slabs_rebalancer_stop(struct default_engine *engine) {
+    if (engine->slabs.rebalance.running) {
+        engine->slabs.rebalance.running = false;
+        pthread_join(engine->slabs.rebalance.thread, NULL);
+    }
+}
+
+ENGINE_ERROR_CODE slabs_reassign(struct default_engine *engine,
+                                 unsigned int src, unsigned int dst) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    if (!engine->config.slab_reassign || !engine->slabs.rebalance.running) {
+        return ENGINE_ENOTSUP;
+    }
+
+    pthread_mutex_lock(&engine->slabs.lock);
+    if (engine->slabs.rebalance.src != 0) {
+        ret = ENGINE_TMPFAIL;
+    } else if (!do_slabs_reassign_ok(engine, src, dst)) {
+        ret = ENGINE_EINVAL;
+    } else {
+        engine->slabs.rebalance.src = src;
+        engine->slabs.rebalance.dst = dst;
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+
+    return ret;
+}
+
 void slabs_destroy(struct default_engine *e)
 {
+    if (e->slabs.restart.base != NULL) {
+        slabs_save(e);
+#ifdef HAVE_SYS_MMAN_H
+        munmap(e->slabs.restart.base, e->slabs.restart.size);
+#endif
+        close(e->slabs.restart.fd);
+        e->slabs.restart.base = NULL;
+    }
+
+    /* The chunks live in the backing store, so just drop the magazines */
+    if (e->slabs.magazines.enabled) {
+        pthread_key_delete(e->slabs.magazines.key);
+        while (e->slabs.magazines.all != NULL) {
+            struct slab_magazine *m = e->slabs.magazines.all;
+            e->slabs.magazines.all = m->next;
+            free(m->chunks);
+            free(m);
+        }
+        e->slabs.magazines.enabled = false;
+    }
+
+    slabs_shared_leave(e);
+
     /* Release the allocated backing store */
     for (size_t ii = 0; ii < e->slabs.allocs.next; ++ii) {
         free(e->slabs.allocs.ptrs[ii]);
     }
     free(e->slabs.allocs.ptrs);
 
+#ifdef HAVE_SYS_MMAN_H
+    for (size_t ii = 0; ii < e->slabs.arena.next; ++ii) {
+        munmap(e->slabs.arena.regions[ii].base, e->slabs.arena.regions[ii].size);
+    }
+#endif
+    free(e->slabs.arena.regions);
+    free(e->slabs.release.pages);
+
     /* Release the freelists */
     for (int ii = POWER_SMALLEST; ii <= e->slabs.power_largest; ii++) {
         slabclass_t *p = &e->slabs.slabclass[ii];
@@ -28,6 +28,32 @@ typedef struct {
     size_t requested; /* The number of requested bytes */
 } slabclass_t;
 
+/* A region of memory mapped for the slab pages (see huge_pages) */
+struct slab_region {
+    void *base;
+    size_t size;
+};
+
+/**
+ * A per thread cache of free chunks for each slab class, so that we
+ * don't have to grab the slabs lock for every allocation. Only the
+ * owning thread touches the chunks; the counters are read (without
+ * locking) when we generate the stats.
+ */
+struct slab_magazine {
+    struct default_engine *engine;
+    struct slab_magazine *next;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refills;
+    uint64_t flushes;
+    /* The bytes requested through this magazine (may be negative) */
+    int64_t requested[MAX_NUMBER_OF_SLAB_CLASSES];
+    unsigned int count[MAX_NUMBER_OF_SLAB_CLASSES];
+    /* slab_magazine_size chunks per slab class */
+    void **chunks;
+};
+
 struct slabs {
    slabclass_t slabclass[MAX_NUMBER_OF_SLAB_CLASSES];
    size_t mem_limit;
@@ -44,10 +70,116 @@ struct slabs {
       size_t size;
    } allocs;
 
+   /**
+    * With huge_pages the slab pages are carved out of large mmap'd
+    * regions backed by huge pages (if available) instead of malloc.
+    */
+   struct {
+      struct slab_region *regions;
+      size_t next;
+      size_t size;
+      char *current;
+      size_t avail;
+      size_t mapped;
+      unsigned int hugetlb;
+      unsigned int thp;
+   } arena;
+
    /**
     * Access to the slab allocator is protected by this lock
     */
    pthread_mutex_t lock;
+
+   /**
+    * With memory_file the arena is a shared mapping of the file, so that
+    * the items survive a restart (see slabs_restore())
+    */
+   struct {
+      int fd;
+      void *base;
+      size_t size;
+      /* We reattached to the memory of an earlier run */
+      bool attached;
+      time_t started;
+      uint64_t restored;
+   } restart;
+
+   /**
+    * The free cursors (see slabs_cursor_alloc()) linked through h_next
+    */
+   item_ref cursors;
+
+   /**
+    * The per thread magazines (see slab_magazine_size). The list of
+    * magazines and the counters of the released ones are protected by
+    * the lock above.
+    */
+   struct {
+      bool enabled;
+      pthread_key_t key;
+      /* The number of chunks to cache for each slab class (0 if none) */
+      unsigned int capacity[MAX_NUMBER_OF_SLAB_CLASSES];
+      struct slab_magazine *all;
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t refills;
+      uint64_t flushes;
+   } magazines;
+
+   /**
+    * With shared_arena the slab pages are charged to a budget shared by
+    * all of the engines in the process (see slabs_shared_charge()).
+    * Protected by the lock above.
+    */
+   struct {
+      bool enabled;
+      size_t reserved;
+      /* Pages given back to the arena, and pages we didn't get */
+      uint64_t released;
+      uint64_t denied;
+   } shared;
+
+   /**
+    * The slab rebalancer moves pages between the slab classes (see
+    * slabs_reassign()). The request and the statistics are protected
+    * by the lock above.
+    */
+   struct {
+      pthread_t thread;
+      volatile bool running;
+      /* The pending request (0 if none) */
+      unsigned int src;
+      unsigned int dst;
+      /* Automove state (only used by the rebalancer thread) */
+      unsigned int evicted_old[MAX_NUMBER_OF_SLAB_CLASSES];
+      unsigned int zero_windows[MAX_NUMBER_OF_SLAB_CLASSES];
+      unsigned int last_highest;
+      unsigned int highest_windows;
+      /* Statistics */
+      uint64_t moves;
+      uint64_t evicted;
+      uint64_t busy_loops;
+      unsigned int last_src;
+      unsigned int last_dst;
+      uint64_t last_usec;
+      uint64_t last_evicted;
+   } rebalance;
+
+   /**
+    * With slab_release the rebalancer takes the pages that have nothing
+    * but free chunks away from their slab class (see
+    * do_slabs_release_free_pages()). The memory is given back to the
+    * system (madvise), and the pages are reused before we allocate new
+    * ones. With shared_arena they are given back to the arena instead.
+    * Protected by the lock above.
+    */
+   struct {
+      void **pages;
+      unsigned int count;
+      unsigned int size;
+      uint64_t released;
+      uint64_t reused;
+   } release;
 };
 
 
@@ -82,9 +214,59 @@ void slabs_free(struct default_engine *engine, void *ptr, size_t size, unsigned
 /** Adjust the stats for memory requested */
 void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id, size_t old, size_t ntotal);
 
+/**
+ * Are we running out of memory in the given slab class (close to the
+ * memory limit with less than a slab page worth of free chunks left)?
+ */
+bool slabs_memory_low(struct default_engine *engine, unsigned int id);
+
 /** Fill buffer with stats */ /*@null@*/
 void slabs_stats(struct default_engine *engine, ADD_STAT add_stats, const void *c);
 
+/**
+ * Rebuild the slab classes and the cache from the memory of an earlier
+ * run (if we reattached to a memory_file at startup)
+ */
+ENGINE_ERROR_CODE slabs_restore(struct default_engine *engine);
+
+/**
+ * Take the page faults of the rest of the preallocated arena now rather
+ * than on the request path, with prefault_threads threads (if the engine
+ * is configured with them)
+ */
+void slabs_prefault(struct default_engine *engine);
+
+/**
+ * Start the slab rebalancer (if the engine is configured with
+ * slab_reassign or slab_automove)
+ */
+ENGINE_ERROR_CODE slabs_rebalancer_start(struct default_engine *engine);
+
+/** Stop the slab rebalancer and wait for it to terminate */
+void slabs_rebalancer_stop(struct default_engine *engine);
+
+/**
+ * Ask the slab rebalancer to move a page from the slab class src to dst.
+ * The page is moved in the background.
+ * @return ENGINE_SUCCESS if the request was accepted, ENGINE_TMPFAIL if
+ *         we're already moving a page, ENGINE_EINVAL for bad classes (or
+ *         if src doesn't have a page to spare) and
+ *         ENGINE_ENOTSUP if the engine isn't configured with slab_reassign
+ */
+ENGINE_ERROR_CODE slabs_reassign(struct default_engine *engine,
+                                 unsigned int src, unsigned int dst);
+
+/**
+ * Allocate an "empty" item to use as a cursor in the LRU lists. The
+ * cursors live in the slab arena (outside of the slab pages) so that
+ * the items may refer to them.
+ * @return the cursor (with a reference) or NULL if we're out of cursors
+ */
+hash_item *slabs_cursor_alloc(struct default_engine *engine);
+
+/** Release a cursor (it must not be linked into an LRU) */
+void slabs_cursor_free(struct default_engine *engine, hash_item *cursor);
+
 void add_statistics(const void *cookie, ADD_STAT add_stats,
                     const char *prefix, int num, const char *key,
                     const char *fmt, ...);
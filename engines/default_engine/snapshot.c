@@ -0,0 +1,614 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "default_engine.h"
+
+/* We start a new block once one has this many bytes of items */
+#define SNAPSHOT_BLOCK_SIZE (1024 * 1024)
+
+/* nbytes, flags, exptime, nkey, vbucket and the record flags */
+#define SNAPSHOT_RECORD_SIZE 17
+
+#define SNAPSHOT_VERSION 1
+
+/* CRC-32C (Castagnoli), a byte at a time */
+static uint32_t snapshot_crc_table[256];
+static pthread_once_t snapshot_crc_once = PTHREAD_ONCE_INIT;
+
+static void snapshot_crc_init(void) {
+    for (uint32_t ii = 0; ii < 256; ++ii) {
+        uint32_t crc = ii;
+        for (int jj = 0; jj < 8; ++jj) {
+            crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        }
+        snapshot_crc_table[ii] = crc;
+    }
+}
+
+static uint32_t snapshot_crc(const void *data, size_t len) {
+    const uint8_t *ptr = data;
+    uint32_t crc = 0xffffffff;
+    pthread_once(&snapshot_crc_once, snapshot_crc_init);
+    while (len-- > 0) {
+        crc = snapshot_crc_table[(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint64_t snapshot_time_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static char *snapshot_put16(char *ptr, uint16_t val) {
+    val = htons(val);
+    memcpy(ptr, &val, sizeof(val));
+    return ptr + sizeof(val);
+}
+
+static char *snapshot_put32(char *ptr, uint32_t val) {
+    val = htonl(val);
+    memcpy(ptr, &val, sizeof(val));
+    return ptr + sizeof(val);
+}
+
+static const char *snapshot_get16(const char *ptr, uint16_t *val) {
+    memcpy(val, ptr, sizeof(*val));
+    *val = ntohs(*val);
+    return ptr + sizeof(*val);
+}
+
+static const char *snapshot_get32(const char *ptr, uint32_t *val) {
+    memcpy(val, ptr, sizeof(*val));
+    *val = ntohl(*val);
+    return ptr + sizeof(*val);
+}
+
+static bool snapshot_write_all(int fd, const void *data, size_t len) {
+    const char *ptr = data;
+    while (len > 0) {
+        ssize_t nw = write(fd, ptr, len);
+        if (nw == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += nw;
+        len -= (size_t)nw;
+    }
+    return true;
+}
+
+static void snapshot_log(struct default_engine *engine,
+                         EXTENSION_LOG_LEVEL severity, const char *fmt, ...) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+    char buffer[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    va_end(ap);
+    logger->log(severity, NULL, "%s", buffer);
+}
+
+/*
+ * The block being written: the header goes at the start of the buffer
+ * once we have all of the items.
+ */
+struct snapshot_writer {
+    int fd;
+    char *buf;
+    size_t size;
+    size_t used;
+    uint32_t nitems;
+    uint32_t nblocks;
+    uint64_t total;
+    uint64_t bytes;
+    uint64_t skipped;
+    bool failed;
+};
+
+/* Called with the item lock of the slice held */
+static void snapshot_iterfunc(struct default_engine *engine,
+                              hash_item *it, void *cookie) {
+    struct snapshot_writer *w = cookie;
+    if (w->failed) {
+        return;
+    }
+    if ((it->iflag & ITEM_EXTERNAL) != 0) {
+        /* We'd have to read the value from the disk */
+        ++w->skipped;
+        return;
+    }
+
+    size_t need = SNAPSHOT_RECORD_SIZE + it->nkey + it->nbytes;
+    if (w->used + need > w->size) {
+        size_t size = w->size;
+        while (w->used + need > size) {
+            size *= 2;
+        }
+        char *buf = realloc(w->buf, size);
+        if (buf == NULL) {
+            w->failed = true;
+            return;
+        }
+        w->buf = buf;
+        w->size = size;
+    }
+
+    uint32_t exptime = 0;
+    if (it->exptime != 0) {
+        exptime = (uint32_t)engine->server.core->abstime(it->exptime);
+    }
+    char *ptr = w->buf + w->used;
+    ptr = snapshot_put32(ptr, it->nbytes);
+    ptr = snapshot_put32(ptr, it->flags);
+    ptr = snapshot_put32(ptr, exptime);
+    ptr = snapshot_put16(ptr, it->nkey);
+    ptr = snapshot_put16(ptr, it->vbucket);
+    *ptr++ = (it->iflag & ITEM_COMPRESSED) != 0 ? SNAPSHOT_COMPRESSED : 0;
+    memcpy(ptr, item_get_key(it), it->nkey);
+    item_value_read(engine, it, 0, ptr + it->nkey, it->nbytes);
+    w->used += need;
+    ++w->nitems;
+}
+
+static void snapshot_flush_block(struct snapshot_writer *w) {
+    if (w->nitems == 0 || w->failed) {
+        return;
+    }
+
+    size_t length = w->used - sizeof(struct snapshot_block);
+    struct snapshot_block block = {
+        .magic = htonl(SNAPSHOT_BLOCK_MAGIC),
+        .nitems = htonl(w->nitems),
+        .length = htonl((uint32_t)length),
+        .crc = htonl(snapshot_crc(w->buf + sizeof(block), length))
+    };
+    memcpy(w->buf, &block, sizeof(block));
+    if (!snapshot_write_all(w->fd, w->buf, w->used)) {
+        w->failed = true;
+        return;
+    }
+    w->bytes += w->used;
+    w->total += w->nitems;
+    ++w->nblocks;
+    w->used = sizeof(block);
+    w->nitems = 0;
+}
+
+static bool snapshot_write(struct default_engine *engine) {
+    struct snapshots *s = &engine->snapshots;
+    const char *path = engine->config.snapshot_file;
+    char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+    struct snapshot_writer w = {
+        .fd = -1,
+        .size = 2 * SNAPSHOT_BLOCK_SIZE,
+        .used = sizeof(struct snapshot_block)
+    };
+    uint64_t start = snapshot_time_usec();
+    bool ok = false;
+
+    if (tmp != NULL && (w.buf = malloc(w.size)) != NULL) {
+        sprintf(tmp, "%s.tmp", path);
+        w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    }
+
+    if (w.fd != -1) {
+        /* The real header goes in when we're done */
+        struct snapshot_header header;
+        memset(&header, 0, sizeof(header));
+        w.failed = !snapshot_write_all(w.fd, &header, sizeof(header));
+
+        for (uint32_t slice = 0; slice < ASSOC_SLICES && !w.failed; ++slice) {
+            if (!*(volatile bool *)&s->running) {
+                w.failed = true;
+                break;
+            }
+            item_walk_slice(engine, slice, snapshot_iterfunc, &w);
+            if (w.used >= SNAPSHOT_BLOCK_SIZE) {
+                snapshot_flush_block(&w);
+            }
+        }
+        snapshot_flush_block(&w);
+
+        if (!w.failed) {
+            memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+            header.version = htonl(SNAPSHOT_VERSION);
+            header.nblocks = htonl(w.nblocks);
+            header.created = memcached_htonll((uint64_t)time(NULL));
+            header.nitems = memcached_htonll(w.total);
+            ok = pwrite(w.fd, &header, sizeof(header), 0) == sizeof(header);
+            ok = ok && fsync(w.fd) == 0;
+        }
+        ok = (close(w.fd) == 0) && ok;
+        ok = ok && rename(tmp, path) == 0;
+        if (!ok) {
+            unlink(tmp);
+        }
+    }
+    free(w.buf);
+    free(tmp);
+
+    pthread_mutex_lock(&s->lock);
+    if (ok) {
+        s->written++;
+        s->last = time(NULL);
+        s->last_items = w.total;
+        s->last_bytes = w.bytes + sizeof(struct snapshot_header);
+        s->last_usec = snapshot_time_usec() - start;
+        s->skipped += w.skipped;
+    } else {
+        s->failed++;
+    }
+    bool stopping = !s->running;
+    pthread_mutex_unlock(&s->lock);
+
+    if (!ok && !stopping) {
+        snapshot_log(engine, EXTENSION_LOG_WARNING,
+                     "Failed to write the snapshot %s\n", path);
+    }
+    return ok;
+}
+
+static void *snapshot_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct snapshots *s = &engine->snapshots;
+    time_t interval = (time_t)engine->config.snapshot_interval;
+    time_t next = interval != 0 ? time(NULL) + interval : 0;
+
+    engine->server.core->place_background_thread();
+
+    pthread_mutex_lock(&s->lock);
+    while (s->running) {
+        if (s->requested || (next != 0 && time(NULL) >= next)) {
+            s->requested = s->writing = true;
+            pthread_mutex_unlock(&s->lock);
+            snapshot_write(engine);
+            pthread_mutex_lock(&s->lock);
+            s->requested = s->writing = false;
+            if (interval != 0) {
+                next = time(NULL) + interval;
+            }
+            continue;
+        }
+
+        if (next == 0) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        } else {
+            struct timespec ts = { .tv_sec = next };
+            pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* The blocks of the snapshot we load, handed out to the loader threads */
+struct snapshot_loader {
+    struct default_engine *engine;
+    const char **blocks;
+    uint32_t nblocks;
+    uint32_t next;
+};
+
+static void snapshot_load_block(struct snapshot_loader *l, const char *block,
+                                load_item **items, uint32_t *size) {
+    struct default_engine *engine = l->engine;
+    struct snapshots *s = &engine->snapshots;
+    struct snapshot_block header;
+    memcpy(&header, block, sizeof(header));
+    uint32_t nitems = ntohl(header.nitems);
+    uint32_t length = ntohl(header.length);
+    const char *ptr = block + sizeof(header);
+    const char *end = ptr + length;
+
+    if (snapshot_crc(ptr, length) != ntohl(header.crc)) {
+        ATOMIC_ADD_64(&s->bad_blocks, 1);
+        return;
+    }
+    if (nitems > *size) {
+        load_item *p = realloc(*items, nitems * sizeof(load_item));
+        if (p == NULL) {
+            ATOMIC_ADD_64(&s->load_skipped, nitems);
+            return;
+        }
+        *items = p;
+        *size = nitems;
+    }
+
+    time_t now = engine->server.core->abstime(engine->server.core->get_current_time());
+    time_t base = engine->server.core->abstime(0);
+    uint64_t skipped = 0;
+    int n = 0;
+    for (uint32_t ii = 0; ii < nitems; ++ii) {
+        uint32_t nbytes, flags, exptime;
+        uint16_t nkey, vbucket;
+        if (end - ptr < SNAPSHOT_RECORD_SIZE) {
+            break;
+        }
+        ptr = snapshot_get32(ptr, &nbytes);
+        ptr = snapshot_get32(ptr, &flags);
+        ptr = snapshot_get32(ptr, &exptime);
+        ptr = snapshot_get16(ptr, &nkey);
+        ptr = snapshot_get16(ptr, &vbucket);
+        uint8_t rflags = (uint8_t)*ptr++;
+        if ((size_t)(end - ptr) < (size_t)nkey + nbytes) {
+            break;
+        }
+        const char *key = ptr;
+        ptr += nkey + nbytes;
+
+        bool keep = nkey != 0 && item_size_ok(engine, nkey, nbytes) &&
+            (exptime == 0 || (time_t)exptime > now);
+#ifndef HAVE_ZLIB_H
+        /* We can't inflate it */
+        keep = keep && (rflags & SNAPSHOT_COMPRESSED) == 0;
+#endif
+        if (!keep) {
+            ++skipped;
+            continue;
+        }
+        (*items)[n++] = (load_item) {
+            .key = key,
+            .value = key + nkey,
+            .nbytes = nbytes,
+            .flags = flags,
+            .exptime = exptime == 0 ? 0 : (rel_time_t)((time_t)exptime - base),
+            .nkey = nkey,
+            .vbucket = vbucket,
+            .iflag = (rflags & SNAPSHOT_COMPRESSED) != 0 ? ITEM_COMPRESSED : 0
+        };
+    }
+
+    uint64_t loaded = n > 0 ? items_load(engine, *items, n) : 0;
+    ATOMIC_ADD_64(&s->loaded, loaded);
+    ATOMIC_ADD_64(&s->load_skipped, skipped + (uint64_t)n - loaded);
+}
+
+static void *snapshot_loader_main(void *arg) {
+    struct snapshot_loader *l = arg;
+    load_item *items = NULL;
+    uint32_t size = 0;
+    uint32_t ii;
+    while ((ii = ATOMIC_INCR(&l->next) - 1) < l->nblocks) {
+        snapshot_load_block(l, l->blocks[ii], &items, &size);
+    }
+    free(items);
+    return NULL;
+}
+
+/* Map (or read) the whole file */
+static char *snapshot_map(int fd, size_t size) {
+#ifdef HAVE_SYS_MMAN_H
+    void *ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+#else
+    char *ptr = malloc(size);
+    size_t offset = 0;
+    while (ptr != NULL && offset < size) {
+        ssize_t nr = read(fd, ptr + offset, size - offset);
+        if (nr <= 0 && !(nr == -1 && errno == EINTR)) {
+            free(ptr);
+            ptr = NULL;
+        } else if (nr > 0) {
+            offset += (size_t)nr;
+        }
+    }
+    return ptr;
+#endif
+}
+
+static void snapshot_unmap(char *ptr, size_t size) {
+#ifdef HAVE_SYS_MMAN_H
+    munmap(ptr, size);
+#else
+    (void)size;
+    free(ptr);
+#endif
+}
+
+static void snapshot_load(struct default_engine *engine) {
+    struct snapshots *s = &engine->snapshots;
+    const char *path = engine->config.snapshot_file;
+    uint64_t start = snapshot_time_usec();
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            snapshot_log(engine, EXTENSION_LOG_WARNING,
+                         "Failed to open the snapshot %s: %s\n",
+                         path, strerror(errno));
+        }
+        return;
+    }
+
+    struct stat st;
+    char *base = NULL;
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct snapshot_header)) {
+        size = (size_t)st.st_size;
+        base = snapshot_map(fd, size);
+    }
+    close(fd);
+
+    struct snapshot_header header;
+    if (base != NULL) {
+        memcpy(&header, base, sizeof(header));
+    }
+    if (base == NULL ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        ntohl(header.version) != SNAPSHOT_VERSION) {
+        snapshot_log(engine, EXTENSION_LOG_WARNING,
+                     "%s is not a snapshot we can load\n", path);
+        if (base != NULL) {
+            snapshot_unmap(base, size);
+        }
+        return;
+    }
+
+    /* Find the blocks (the threads check them) */
+    struct snapshot_loader l = { .engine = engine };
+    uint32_t nblocks = ntohl(header.nblocks);
+    if ((l.blocks = malloc((nblocks + 1) * sizeof(char*))) == NULL) {
+        snapshot_unmap(base, size);
+        return;
+    }
+    size_t offset = sizeof(header);
+    while (l.nblocks < nblocks &&
+           size - offset >= sizeof(struct snapshot_block)) {
+        struct snapshot_block block;
+        memcpy(&block, base + offset, sizeof(block));
+        size_t length = ntohl(block.length);
+        if (ntohl(block.magic) != SNAPSHOT_BLOCK_MAGIC ||
+            size - offset - sizeof(block) < length) {
+            break;
+        }
+        l.blocks[l.nblocks++] = base + offset;
+        offset += sizeof(block) + length;
+    }
+    if (l.nblocks != nblocks) {
+        s->bad_blocks += nblocks - l.nblocks;
+        snapshot_log(engine, EXTENSION_LOG_WARNING,
+                     "The snapshot %s is truncated\n", path);
+    }
+
+    size_t nthreads = engine->config.snapshot_threads;
+    if (nthreads > l.nblocks) {
+        nthreads = l.nblocks;
+    }
+    pthread_t *threads = nthreads > 1 ? calloc(nthreads, sizeof(pthread_t)) : NULL;
+    size_t started = 0;
+    while (threads != NULL && started < nthreads &&
+           pthread_create(&threads[started], NULL, snapshot_loader_main, &l) == 0) {
+        ++started;
+    }
+    /* We help out (or do it all if we couldn't start the threads) */
+    snapshot_loader_main(&l);
+    for (size_t ii = 0; ii < started; ++ii) {
+        pthread_join(threads[ii], NULL);
+    }
+    free(threads);
+    free(l.blocks);
+    snapshot_unmap(base, size);
+
+    s->load_usec = snapshot_time_usec() - start;
+    snapshot_log(engine, EXTENSION_LOG_INFO,
+                 "Loaded %"PRIu64" items from the snapshot %s in %"PRIu64" ms\n",
+                 s->loaded, path, s->load_usec / 1000);
+}
+
+ENGINE_ERROR_CODE snapshot_init(struct default_engine *engine) {
+    struct snapshots *s = &engine->snapshots;
+
+    if (engine->config.snapshot_file == NULL) {
+        return ENGINE_SUCCESS;
+    }
+
+    snapshot_load(engine);
+
+    if (pthread_cond_init(&s->cond, NULL) != 0) {
+        abort();
+    }
+    s->running = true;
+    if (pthread_create(&s->thread, NULL, snapshot_main, engine) != 0) {
+        s->running = false;
+        pthread_cond_destroy(&s->cond);
+        return ENGINE_FAILED;
+    }
+    s->enabled = true;
+    return ENGINE_SUCCESS;
+}
+
+void snapshot_destroy(struct default_engine *engine) {
+    struct snapshots *s = &engine->snapshots;
+
+    if (!s->enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->running = false;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    pthread_cond_destroy(&s->cond);
+    s->enabled = false;
+}
+
+ENGINE_ERROR_CODE snapshot_start(struct default_engine *engine) {
+    struct snapshots *s = &engine->snapshots;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    if (!s->enabled) {
+        return ENGINE_ENOTSUP;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (s->requested) {
+        ret = ENGINE_TMPFAIL;
+    } else {
+        s->requested = true;
+        pthread_cond_signal(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+void snapshot_stats(struct default_engine *engine,
+                    ADD_STAT add_stat, const void *cookie) {
+    struct snapshots *s = &engine->snapshots;
+    const char *prefix = "snapshot";
+
+    add_statistics(cookie, add_stat, prefix, -1, "enabled", "%s",
+                   s->enabled ? "true" : "false");
+    if (!s->enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    add_statistics(cookie, add_stat, prefix, -1, "status", "%s",
+                   s->writing ? "writing" : "idle");
+    add_statistics(cookie, add_stat, prefix, -1, "interval", "%zu",
+                   engine->config.snapshot_interval);
+    add_statistics(cookie, add_stat, prefix, -1, "written", "%"PRIu64,
+                   s->written);
+    add_statistics(cookie, add_stat, prefix, -1, "failed", "%"PRIu64,
+                   s->failed);
+    add_statistics(cookie, add_stat, prefix, -1, "last", "%"PRIu64,
+                   (uint64_t)s->last);
+    add_statistics(cookie, add_stat, prefix, -1, "last_items", "%"PRIu64,
+                   s->last_items);
+    add_statistics(cookie, add_stat, prefix, -1, "last_bytes", "%"PRIu64,
+                   s->last_bytes);
+    add_statistics(cookie, add_stat, prefix, -1, "last_usec", "%"PRIu64,
+                   s->last_usec);
+    add_statistics(cookie, add_stat, prefix, -1, "skipped", "%"PRIu64,
+                   s->skipped);
+    pthread_mutex_unlock(&s->lock);
+
+    add_statistics(cookie, add_stat, prefix, -1, "loaded", "%"PRIu64,
+                   s->loaded);
+    add_statistics(cookie, add_stat, prefix, -1, "load_skipped", "%"PRIu64,
+                   s->load_skipped);
+    add_statistics(cookie, add_stat, prefix, -1, "bad_blocks", "%"PRIu64,
+                   s->bad_blocks);
+    add_statistics(cookie, add_stat, prefix, -1, "load_usec", "%"PRIu64,
+                   s->load_usec);
+}
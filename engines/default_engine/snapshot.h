@@ -0,0 +1,113 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * A snapshot (snapshot_file=path) is a copy of the items in a file we
+ * can load into another engine, on this box or any other: unlike the
+ * memory file it doesn't depend on the layout of the slabs or on the
+ * byte order of the host. We write it in the background every
+ * snapshot_interval seconds (and when we get PROTOCOL_BINARY_CMD_SNAPSHOT)
+ * walking the hash table slice by slice with the item lock of one slice
+ * held at a time, so the traffic goes on while we write. We load it when
+ * the engine starts, with snapshot_threads threads.
+ *
+ * The file is a struct snapshot_header followed by the blocks, each a
+ * struct snapshot_block and the items of one or more slices:
+ *
+ *    uint32_t nbytes, flags, exptime (absolute, 0 if it never expires)
+ *    uint16_t nkey, vbucket
+ *    uint8_t  SNAPSHOT_COMPRESSED if the value is compressed (0 if not)
+ *    the key and the value
+ *
+ * All of the numbers are in network byte order. Every block has the
+ * CRC-32C of its items, and a block that doesn't match is skipped (we go
+ * on with the others). The header is written last, and we write to
+ * path.tmp and rename it when we're done: a snapshot that is there is
+ * complete.
+ */
+
+#define SNAPSHOT_MAGIC "mcsnap01"
+
+struct snapshot_header {
+   char magic[8];
+   uint32_t version;
+   uint32_t nblocks;
+   /** When we wrote it (seconds since the epoch) */
+   uint64_t created;
+   uint64_t nitems;
+};
+
+#define SNAPSHOT_BLOCK_MAGIC 0x534e4150
+
+struct snapshot_block {
+   uint32_t magic;
+   uint32_t nitems;
+   /** The number of bytes of items after the header */
+   uint32_t length;
+   uint32_t crc;
+};
+
+/** The record flag of a compressed value (see ITEM_COMPRESSED) */
+#define SNAPSHOT_COMPRESSED 0x01
+
+struct snapshots {
+   bool enabled;
+   /** Protects the fields below */
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   pthread_t thread;
+   bool running;
+   /** Someone asked for a snapshot, or one is being written */
+   bool requested;
+   bool writing;
+
+   /** Statistics of the snapshots we wrote */
+   uint64_t written;
+   uint64_t failed;
+   time_t last;
+   uint64_t last_items;
+   uint64_t last_bytes;
+   uint64_t last_usec;
+   /** The items we didn't write (their value is in the external store) */
+   uint64_t skipped;
+
+   /** Statistics of the snapshot we loaded (updated atomically) */
+   uint64_t loaded;
+   uint64_t load_skipped;
+   uint64_t bad_blocks;
+   uint64_t load_usec;
+};
+
+/**
+ * Load the snapshot (if there is one) and start the thread writing them
+ * (if snapshot_file is set)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE snapshot_init(struct default_engine *engine);
+
+/**
+ * Stop the thread (a snapshot being written is given up)
+ * @param engine handle to the storage engine
+ */
+void snapshot_destroy(struct default_engine *engine);
+
+/**
+ * Write a snapshot now (in the background)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS, ENGINE_TMPFAIL if one is being written already,
+ *         or ENGINE_ENOTSUP if we don't have a snapshot_file
+ */
+ENGINE_ERROR_CODE snapshot_start(struct default_engine *engine);
+
+/**
+ * Get the statistics of the snapshots
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void snapshot_stats(struct default_engine *engine,
+                    ADD_STAT add_stat, const void *cookie);
+
+#endif
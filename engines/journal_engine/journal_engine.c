@@ -0,0 +1,778 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <ctype.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+
+#include <memcached/engine.h>
+#include <memcached/util.h>
+#include <memcached/config_parser.h>
+#include "journal_engine.h"
+
+/* The engines may return the value of an item in several pieces */
+typedef union {
+    item_info info;
+    char bytes[sizeof(item_info) + ((IOV_MAX - 1) * sizeof(struct iovec))];
+} item_info_holder;
+
+MEMCACHED_PUBLIC_API
+ENGINE_ERROR_CODE create_instance(uint64_t interface,
+                                  GET_SERVER_API get_server_api,
+                                  ENGINE_HANDLE **handle);
+
+static inline struct journal_engine *get_handle(ENGINE_HANDLE *handle) {
+    return (struct journal_engine*)handle;
+}
+
+static void journal_engine_log(struct journal_engine *je,
+                               EXTENSION_LOG_LEVEL severity,
+                               const char *msg, const char *arg) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    logger = (void*)je->server.extension->get_extension(EXTENSION_LOGGER);
+    logger->log(severity, NULL, msg, arg);
+}
+
+static const engine_info* journal_get_info(ENGINE_HANDLE* handle) {
+    return &get_handle(handle)->info.engine_info;
+}
+
+/*
+ * Split the configuration into our keys and the ones of the inner engine
+ * (the entries are copied as they are, escapes and all)
+ */
+static bool journal_split_config(const char *cfg, char *ours, char *inner) {
+    static const char *keys[] = {
+        "engine", "journal_file", "journal_interval",
+        "journal_replay_threads", "journal_compact_size",
+        "journal_compact_ratio", NULL
+    };
+
+    *ours = *inner = '\0';
+    while (*cfg != '\0') {
+        const char *end = cfg;
+        while (*end != '\0' && *end != ';') {
+            if (*end == '\\' && end[1] != '\0') {
+                ++end;
+            }
+            ++end;
+        }
+
+        const char *key = cfg;
+        while (key < end && isspace((unsigned char)*key)) {
+            ++key;
+        }
+        const char *eq = memchr(key, '=', end - key);
+        size_t nkey = (eq != NULL ? eq : end) - key;
+        while (nkey > 0 && isspace((unsigned char)key[nkey - 1])) {
+            --nkey;
+        }
+
+        char *dst = inner;
+        for (int ii = 0; keys[ii] != NULL; ++ii) {
+            if (strlen(keys[ii]) == nkey && memcmp(keys[ii], key, nkey) == 0) {
+                dst = ours;
+                break;
+            }
+        }
+        if (end > cfg) {
+            dst += strlen(dst);
+            memcpy(dst, cfg, end - cfg);
+            dst[end - cfg] = ';';
+            dst[end - cfg + 1] = '\0';
+        }
+        cfg = *end == ';' ? end + 1 : end;
+    }
+    return true;
+}
+
+/*
+ * The inner engine is default_engine from the directory we were loaded
+ * from, unless we're told otherwise
+ */
+static char *journal_inner_path(struct journal_engine *je) {
+    if (je->config.engine != NULL) {
+        return strdup(je->config.engine);
+    }
+
+    Dl_info info;
+    union {
+        CREATE_INSTANCE create;
+        void *voidptr;
+    } self = { .create = create_instance };
+    if (dladdr(self.voidptr, &info) == 0 || info.dli_fname == NULL) {
+        return strdup("default_engine.so");
+    }
+    const char *slash = strrchr(info.dli_fname, '/');
+    size_t ndir = slash == NULL ? 0 : (size_t)(slash - info.dli_fname) + 1;
+    size_t len = ndir + sizeof("default_engine.so");
+    char *path = malloc(len);
+    if (path != NULL) {
+        memcpy(path, info.dli_fname, ndir);
+        strcpy(path + ndir, "default_engine.so");
+    }
+    return path;
+}
+
+static bool journal_load_inner(struct journal_engine *je) {
+    char *path = journal_inner_path(je);
+    if (path == NULL) {
+        return false;
+    }
+
+    union {
+        CREATE_INSTANCE create;
+        void *voidptr;
+    } my_create = { .create = NULL };
+
+    je->dlhandle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (je->dlhandle == NULL) {
+        const char *msg = dlerror();
+        journal_engine_log(je, EXTENSION_LOG_WARNING,
+                           "Failed to open the engine of the journal: %s\n",
+                           msg ? msg : path);
+        free(path);
+        return false;
+    }
+    free(path);
+
+    if ((my_create.voidptr = dlsym(je->dlhandle, "create_instance")) == NULL) {
+        journal_engine_log(je, EXTENSION_LOG_WARNING,
+                           "Could not find create_instance: %s\n", dlerror());
+        return false;
+    }
+    if (my_create.create(1, je->get_server_api, &je->inner.v0) != ENGINE_SUCCESS ||
+        je->inner.v0 == NULL || je->inner.v1->interface.interface != 1) {
+        journal_engine_log(je, EXTENSION_LOG_WARNING,
+                           "%s\n", "Failed to create the engine of the journal");
+        je->inner.v0 = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void journal_handle_disconnect(const void *cookie,
+                                      ENGINE_EVENT_TYPE type,
+                                      const void *event_data,
+                                      const void *cb_data) {
+    struct journal_engine *je = (struct journal_engine*)cb_data;
+    struct journal_waiter *w = je->server.cookie->get_engine_specific(cookie);
+    (void)type;
+    (void)event_data;
+
+    /* The client went away between the commit and coming back for the
+     * result (while it waits, it's reserved) */
+    if (w != NULL && w->magic == JOURNAL_WAITER_MAGIC) {
+        je->server.cookie->store_engine_specific(cookie, NULL);
+        free(w);
+    }
+}
+
+static ENGINE_ERROR_CODE journal_initialize(ENGINE_HANDLE* handle,
+                                            const char* config_str) {
+    struct journal_engine *je = get_handle(handle);
+    ENGINE_ERROR_CODE ret;
+
+    if (config_str == NULL) {
+        config_str = "";
+    }
+    size_t len = strlen(config_str) + 2;
+    char *ours = malloc(len);
+    char *inner = malloc(len);
+    if (ours == NULL || inner == NULL) {
+        free(ours);
+        free(inner);
+        return ENGINE_ENOMEM;
+    }
+    journal_split_config(config_str, ours, inner);
+
+    struct config_item items[] = {
+        { .key = "engine",
+          .datatype = DT_STRING,
+          .value.dt_string = &je->config.engine },
+        { .key = "journal_file",
+          .datatype = DT_STRING,
+          .value.dt_string = &je->config.file },
+        { .key = "journal_interval",
+          .datatype = DT_SIZE,
+          .value.dt_size = &je->config.interval },
+        { .key = "journal_replay_threads",
+          .datatype = DT_SIZE,
+          .value.dt_size = &je->config.replay_threads },
+        { .key = "journal_compact_size",
+          .datatype = DT_SIZE,
+          .value.dt_size = &je->config.compact_size },
+        { .key = "journal_compact_ratio",
+          .datatype = DT_FLOAT,
+          .value.dt_float = &je->config.compact_ratio },
+        { .key = NULL}
+    };
+    int rv = je->server.core->parse_config(ours, items, stderr);
+    free(ours);
+    if (rv != 0 || je->config.file == NULL) {
+        if (je->config.file == NULL) {
+            journal_engine_log(je, EXTENSION_LOG_WARNING,
+                               "%s\n", "The journal engine needs a journal_file");
+        }
+        free(inner);
+        return ENGINE_EINVAL;
+    }
+    if (je->config.replay_threads == 0) {
+        je->config.replay_threads = 1;
+    } else if (je->config.replay_threads > 64) {
+        je->config.replay_threads = 64;
+    }
+
+    if (!journal_load_inner(je)) {
+        free(inner);
+        return ENGINE_FAILED;
+    }
+    ret = je->inner.v1->initialize(je->inner.v0, inner);
+    free(inner);
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+
+    /* What the inner engine has, and durability */
+    const engine_info *info = je->inner.v1->get_info(je->inner.v0);
+    uint32_t nfeatures = 0;
+    for (uint32_t ii = 0; ii < info->num_features &&
+             nfeatures < LAST_REGISTERED_ENGINE_FEATURE; ++ii) {
+        if (info->features[ii].feature != ENGINE_FEATURE_PERSISTENT_STORAGE) {
+            je->info.engine_info.features[nfeatures++] = info->features[ii];
+        }
+    }
+    je->info.engine_info.features[nfeatures].feature = ENGINE_FEATURE_PERSISTENT_STORAGE;
+    je->info.engine_info.features[nfeatures++].description = NULL;
+    je->info.engine_info.num_features = nfeatures;
+
+    /* We can't log what goes around store() and friends */
+    je->engine.allocate_multi = NULL;
+    je->engine.store_multi = NULL;
+    je->engine.mutate_range = NULL;
+    if (je->inner.v1->get_multi == NULL) {
+        je->engine.get_multi = NULL;
+    }
+    if (je->inner.v1->get_lease == NULL) {
+        je->engine.get_lease = NULL;
+    }
+    if (je->inner.v1->get_item_layout == NULL) {
+        je->engine.get_item_layout = NULL;
+    }
+    if (je->inner.v1->get_stats_struct == NULL) {
+        je->engine.get_stats_struct = NULL;
+    }
+    if (je->inner.v1->aggregate_stats == NULL) {
+        je->engine.aggregate_stats = NULL;
+    }
+    if (je->inner.v1->unknown_command == NULL) {
+        je->engine.unknown_command = NULL;
+    }
+    if (je->inner.v1->tap_notify == NULL) {
+        je->engine.tap_notify = NULL;
+    }
+    if (je->inner.v1->get_tap_iterator == NULL) {
+        je->engine.get_tap_iterator = NULL;
+    }
+    if (je->inner.v1->errinfo == NULL) {
+        je->engine.errinfo = NULL;
+    }
+
+    ret = journal_open(je);
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+
+    je->server.callback->register_callback(handle, ON_DISCONNECT,
+                                           journal_handle_disconnect, je);
+    return ENGINE_SUCCESS;
+}
+
+static void journal_destroy(ENGINE_HANDLE* handle, const bool force) {
+    struct journal_engine *je = get_handle(handle);
+
+    journal_close(je);
+    if (je->inner.v0 != NULL) {
+        je->inner.v1->destroy(je->inner.v0, force);
+    }
+    /* The inner engine may still have cookies reserved, so we don't
+     * unload it (see bucket_engine) */
+    for (int ii = 0; ii < JOURNAL_STRIPES; ++ii) {
+        pthread_mutex_destroy(&je->stripes[ii]);
+    }
+    pthread_mutex_destroy(&je->journal.lock);
+    free(je->config.engine);
+    free(je->config.file);
+    free(je);
+}
+
+static pthread_mutex_t *journal_stripe(struct journal_engine *je,
+                                       const void *key, size_t nkey) {
+    return &je->stripes[journal_hash(key, nkey) % JOURNAL_STRIPES];
+}
+
+/*
+ * The result of the change we made the last time the core called us
+ * for this cookie, once it's committed (the caller frees it)
+ * @param waiting set if it isn't committed yet
+ */
+static struct journal_waiter *journal_finished(struct journal_engine *je,
+                                               const void *cookie,
+                                               bool *waiting) {
+    *waiting = false;
+    if (cookie == NULL) {
+        return NULL;
+    }
+    struct journal_waiter *w = je->server.cookie->get_engine_specific(cookie);
+    if (w == NULL || w->magic != JOURNAL_WAITER_MAGIC) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&je->journal.lock);
+    *waiting = !w->done;
+    pthread_mutex_unlock(&je->journal.lock);
+    if (*waiting) {
+        return NULL;
+    }
+    je->server.cookie->store_engine_specific(cookie, NULL);
+    return w;
+}
+
+/*
+ * Log the change we made and have the client wait for the commit
+ * @return ENGINE_EWOULDBLOCK, or the result if we didn't have to wait
+ */
+static ENGINE_ERROR_CODE journal_commit(struct journal_engine *je,
+                                        const void *cookie,
+                                        struct journal_record *record,
+                                        const void *key,
+                                        const struct iovec *value, int nvalue,
+                                        ENGINE_ERROR_CODE status,
+                                        uint64_t cas, uint64_t result) {
+    struct journal_waiter *w = NULL;
+    if (cookie != NULL && (w = calloc(1, sizeof(*w))) != NULL) {
+        w->magic = JOURNAL_WAITER_MAGIC;
+        w->cookie = cookie;
+        w->status = status;
+        w->cas = cas;
+        w->result = result;
+        je->server.cookie->store_engine_specific(cookie, w);
+        je->server.cookie->reserve(cookie);
+    }
+
+    ENGINE_ERROR_CODE ret = journal_append(je, record, key, value, nvalue, w);
+    if (w != NULL && ret == ENGINE_SUCCESS) {
+        return ENGINE_EWOULDBLOCK;
+    }
+    if (w != NULL) {
+        je->server.cookie->store_engine_specific(cookie, NULL);
+        je->server.cookie->release(cookie);
+        free(w);
+    }
+    return ret == ENGINE_SUCCESS ? status : ret;
+}
+
+/*
+ * Log the value the inner engine has for the key now (the result of an
+ * append, prepend or incr/decr)
+ */
+static ENGINE_ERROR_CODE journal_commit_current(struct journal_engine *je,
+                                                const void *cookie,
+                                                const void *key, size_t nkey,
+                                                uint16_t vbucket,
+                                                ENGINE_ERROR_CODE status,
+                                                uint64_t cas, uint64_t result) {
+    item *it = NULL;
+    struct journal_record r = {
+        .op = JOURNAL_DELETE, .nkey = (uint16_t)nkey, .vbucket = vbucket
+    };
+
+    /* Without a cookie, so a value we'd have to wait for isn't fetched
+     * for the client */
+    if (je->inner.v1->get(je->inner.v0, NULL, &it, key,
+                          (int)nkey, vbucket) != ENGINE_SUCCESS) {
+        /* It's gone already */
+        return journal_commit(je, cookie, &r, key, NULL, 0, status, cas, result);
+    }
+
+    item_info_holder info = { .info.nvalue = IOV_MAX };
+    ENGINE_ERROR_CODE ret;
+    if (je->inner.v1->get_item_info(je->inner.v0, NULL, it, &info.info)) {
+        r.op = JOURNAL_SET;
+        r.flags = info.info.flags;
+        r.exptime = info.info.exptime == 0 ? 0 :
+            (uint32_t)je->server.core->abstime(info.info.exptime);
+        ret = journal_commit(je, cookie, &r, key, info.info.value,
+                             info.info.nvalue, status, cas, result);
+    } else {
+        ret = ENGINE_FAILED;
+    }
+    je->inner.v1->release(je->inner.v0, NULL, it);
+    return ret;
+}
+
+static ENGINE_ERROR_CODE journal_item_allocate(ENGINE_HANDLE* handle,
+                                               const void* cookie,
+                                               item **item,
+                                               const void* key,
+                                               const size_t nkey,
+                                               const size_t nbytes,
+                                               const int flags,
+                                               const rel_time_t exptime) {
+    struct journal_engine *je = get_handle(handle);
+    return je->inner.v1->allocate(je->inner.v0, cookie, item, key, nkey,
+                                  nbytes, flags, exptime);
+}
+
+static ENGINE_ERROR_CODE journal_item_delete(ENGINE_HANDLE* handle,
+                                             const void* cookie,
+                                             const void* key,
+                                             const size_t nkey,
+                                             uint64_t* cas,
+                                             uint16_t vbucket) {
+    struct journal_engine *je = get_handle(handle);
+    bool waiting;
+    struct journal_waiter *w = journal_finished(je, cookie, &waiting);
+    if (waiting) {
+        return ENGINE_EWOULDBLOCK;
+    }
+    if (w != NULL) {
+        ENGINE_ERROR_CODE ret = w->status;
+        *cas = w->cas;
+        free(w);
+        return ret;
+    }
+
+    pthread_mutex_t *stripe = journal_stripe(je, key, nkey);
+    pthread_mutex_lock(stripe);
+    ENGINE_ERROR_CODE ret = je->inner.v1->remove(je->inner.v0, cookie, key,
+                                                 nkey, cas, vbucket);
+    if (ret == ENGINE_SUCCESS) {
+        struct journal_record r = {
+            .op = JOURNAL_DELETE, .nkey = (uint16_t)nkey, .vbucket = vbucket
+        };
+        ret = journal_commit(je, cookie, &r, key, NULL, 0, ret, *cas, 0);
+    }
+    pthread_mutex_unlock(stripe);
+    return ret;
+}
+
+static void journal_item_release(ENGINE_HANDLE* handle,
+                                 const void *cookie,
+                                 item* item) {
+    struct journal_engine *je = get_handle(handle);
+    je->inner.v1->release(je->inner.v0, cookie, item);
+}
+
+static ENGINE_ERROR_CODE journal_get(ENGINE_HANDLE* handle,
+                                     const void* cookie,
+                                     item** item,
+                                     const void* key,
+                                     const int nkey,
+                                     uint16_t vbucket) {
+    struct journal_engine *je = get_handle(handle);
+    return je->inner.v1->get(je->inner.v0, cookie, item, key, nkey, vbucket);
+}
+
+static ENGINE_ERROR_CODE journal_get_multi(ENGINE_HANDLE* handle,
+                                           const void* cookie,
+                                           get_multi_key *keys,
+                                           int nkeys) {
+    struct journal_engine *je = get_handle(handle);
+    return je->inner.v1->get_multi(je->inner.v0, cookie, keys, nkeys);
+}
+
+static uint64_t journal_get_lease(ENGINE_HANDLE* handle,
+                                  const void* cookie,
+                                  const void* key,
+                                  const int nkey) {
+    struct journal_engine *je = get_handle(handle);
+    return je->inner.v1->get_lease(je->inner.v0, cookie, key, nkey);
+}
+
+static ENGINE_ERROR_CODE journal_store(ENGINE_HANDLE* handle,
+                                       const void *cookie,
+                                       item* item,
+                                       uint64_t *cas,
+                                       ENGINE_STORE_OPERATION operation,
+                                       uint16_t vbucket) {
+    struct journal_engine *je = get_handle(handle);
+    bool waiting;
+    struct journal_waiter *w = journal_finished(je, cookie, &waiting);
+    if (waiting) {
+        return ENGINE_EWOULDBLOCK;
+    }
+    if (w != NULL) {
+        ENGINE_ERROR_CODE ret = w->status;
+        *cas = w->cas;
+        free(w);
+        return ret;
+    }
+
+    item_info_holder info = { .info.nvalue = IOV_MAX };
+    if (!je->inner.v1->get_item_info(je->inner.v0, cookie, item, &info.info)) {
+        return ENGINE_FAILED;
+    }
+
+    pthread_mutex_t *stripe = journal_stripe(je, info.info.key, info.info.nkey);
+    pthread_mutex_lock(stripe);
+    ENGINE_ERROR_CODE ret = je->inner.v1->store(je->inner.v0, cookie, item,
+                                                cas, operation, vbucket);
+    if (ret == ENGINE_SUCCESS) {
+        if (operation == OPERATION_APPEND || operation == OPERATION_PREPEND) {
+            ret = journal_commit_current(je, cookie, info.info.key,
+                                         info.info.nkey, vbucket,
+                                         ret, *cas, 0);
+        } else {
+            struct journal_record r = {
+                .op = JOURNAL_SET,
+                .nkey = info.info.nkey,
+                .vbucket = vbucket,
+                .flags = info.info.flags,
+                .exptime = info.info.exptime == 0 ? 0 :
+                    (uint32_t)je->server.core->abstime(info.info.exptime)
+            };
+            ret = journal_commit(je, cookie, &r, info.info.key,
+                                 info.info.value, info.info.nvalue,
+                                 ret, *cas, 0);
+        }
+    }
+    pthread_mutex_unlock(stripe);
+    return ret;
+}
+
+static ENGINE_ERROR_CODE journal_arithmetic(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            const void* key,
+                                            const int nkey,
+                                            const bool increment,
+                                            const bool create,
+                                            const uint64_t delta,
+                                            const uint64_t initial,
+                                            const rel_time_t exptime,
+                                            uint64_t *cas,
+                                            uint64_t *result,
+                                            uint16_t vbucket) {
+    struct journal_engine *je = get_handle(handle);
+    bool waiting;
+    struct journal_waiter *w = journal_finished(je, cookie, &waiting);
+    if (waiting) {
+        return ENGINE_EWOULDBLOCK;
+    }
+    if (w != NULL) {
+        ENGINE_ERROR_CODE ret = w->status;
+        *cas = w->cas;
+        *result = w->result;
+        free(w);
+        return ret;
+    }
+
+    pthread_mutex_t *stripe = journal_stripe(je, key, nkey);
+    pthread_mutex_lock(stripe);
+    ENGINE_ERROR_CODE ret;
+    ret = je->inner.v1->arithmetic(je->inner.v0, cookie, key, nkey, increment,
+                                   create, delta, initial, exptime, cas,
+                                   result, vbucket);
+    if (ret == ENGINE_SUCCESS) {
+        ret = journal_commit_current(je, cookie, key, nkey, vbucket,
+                                     ret, *cas, *result);
+    }
+    pthread_mutex_unlock(stripe);
+    return ret;
+}
+
+static ENGINE_ERROR_CODE journal_flush(ENGINE_HANDLE* handle,
+                                       const void* cookie, time_t when) {
+    struct journal_engine *je = get_handle(handle);
+    bool waiting;
+    struct journal_waiter *w = journal_finished(je, cookie, &waiting);
+    if (waiting) {
+        return ENGINE_EWOULDBLOCK;
+    }
+    if (w != NULL) {
+        ENGINE_ERROR_CODE ret = w->status;
+        free(w);
+        return ret;
+    }
+
+    for (int ii = 0; ii < JOURNAL_STRIPES; ++ii) {
+        pthread_mutex_lock(&je->stripes[ii]);
+    }
+    ENGINE_ERROR_CODE ret = je->inner.v1->flush(je->inner.v0, cookie, when);
+    if (ret == ENGINE_SUCCESS) {
+        struct journal_record r = {
+            .op = JOURNAL_FLUSH,
+            .exptime = when == 0 ? 0 :
+                (uint32_t)je->server.core->abstime(je->server.core->realtime(when))
+        };
+        ret = journal_commit(je, cookie, &r, NULL, NULL, 0, ret, 0, 0);
+    }
+    for (int ii = JOURNAL_STRIPES - 1; ii >= 0; --ii) {
+        pthread_mutex_unlock(&je->stripes[ii]);
+    }
+    return ret;
+}
+
+static ENGINE_ERROR_CODE journal_get_stats(ENGINE_HANDLE* handle,
+                                           const void* cookie,
+                                           const char* stat_key,
+                                           int nkey,
+                                           ADD_STAT add_stat) {
+    struct journal_engine *je = get_handle(handle);
+    if (stat_key != NULL && nkey == 7 && strncmp(stat_key, "journal", 7) == 0) {
+        journal_stats(je, add_stat, cookie);
+        return ENGINE_SUCCESS;
+    }
+    return je->inner.v1->get_stats(je->inner.v0, cookie, stat_key, nkey,
+                                   add_stat);
+}
+
+static void journal_reset_stats(ENGINE_HANDLE* handle, const void *cookie) {
+    struct journal_engine *je = get_handle(handle);
+    je->inner.v1->reset_stats(je->inner.v0, cookie);
+}
+
+static void *journal_get_stats_struct(ENGINE_HANDLE* handle,
+                                      const void* cookie) {
+    struct journal_engine *je = get_handle(handle);
+    return je->inner.v1->get_stats_struct(je->inner.v0, cookie);
+}
+
+static ENGINE_ERROR_CODE journal_aggregate_stats(ENGINE_HANDLE* handle,
+                                                 const void* cookie,
+                                                 void (*callback)(void*, void*),
+                                                 void *vptr) {
+    struct journal_engine *je = get_handle(handle);
+    return je->inner.v1->aggregate_stats(je->inner.v0, cookie, callback, vptr);
+}
+
+static ENGINE_ERROR_CODE journal_unknown_command(ENGINE_HANDLE* handle,
+                                                 const void* cookie,
+                                                 protocol_binary_request_header *request,
+                                                 ADD_RESPONSE response) {
+    struct journal_engine *je = get_handle(handle);
+    return je->inner.v1->unknown_command(je->inner.v0, cookie, request,
+                                         response);
+}
+
+static ENGINE_ERROR_CODE journal_tap_notify(ENGINE_HANDLE* handle,
+                                            const void *cookie,
+                                            void *engine_specific,
+                                            uint16_t nengine,
+                                            uint8_t ttl,
+                                            uint16_t tap_flags,
+                                            tap_event_t tap_event,
+                                            uint32_t tap_seqno,
+                                            const void *key,
+                                            size_t nkey,
+                                            uint32_t flags,
+                                            uint32_t exptime,
+                                            uint64_t cas,
+                                            const void *data,
+                                            size_t ndata,
+                                            uint16_t vbucket) {
+    struct journal_engine *je = get_handle(handle);
+    return je->inner.v1->tap_notify(je->inner.v0, cookie, engine_specific,
+                                    nengine, ttl, tap_flags, tap_event,
+                                    tap_seqno, key, nkey, flags, exptime,
+                                    cas, data, ndata, vbucket);
+}
+
+static TAP_ITERATOR journal_get_tap_iterator(ENGINE_HANDLE* handle,
+                                             const void* cookie,
+                                             const void* client,
+                                             size_t nclient,
+                                             uint32_t flags,
+                                             const void* userdata,
+                                             size_t nuserdata) {
+    struct journal_engine *je = get_handle(handle);
+    return je->inner.v1->get_tap_iterator(je->inner.v0, cookie, client,
+                                          nclient, flags, userdata,
+                                          nuserdata);
+}
+
+static void journal_item_set_cas(ENGINE_HANDLE *handle, const void *cookie,
+                                 item *item, uint64_t cas) {
+    struct journal_engine *je = get_handle(handle);
+    je->inner.v1->item_set_cas(je->inner.v0, cookie, item, cas);
+}
+
+static bool journal_get_item_info(ENGINE_HANDLE *handle,
+                                  const void *cookie,
+                                  const item* item,
+                                  item_info *item_info) {
+    struct journal_engine *je = get_handle(handle);
+    return je->inner.v1->get_item_info(je->inner.v0, cookie, item, item_info);
+}
+
+static size_t journal_errinfo(ENGINE_HANDLE *handle, const void* cookie,
+                              char *buffer, size_t buffsz) {
+    struct journal_engine *je = get_handle(handle);
+    return je->inner.v1->errinfo(je->inner.v0, cookie, buffer, buffsz);
+}
+
+static const item_layout *journal_get_item_layout(ENGINE_HANDLE* handle) {
+    struct journal_engine *je = get_handle(handle);
+    return je->inner.v1->get_item_layout(je->inner.v0);
+}
+
+ENGINE_ERROR_CODE create_instance(uint64_t interface,
+                                  GET_SERVER_API get_server_api,
+                                  ENGINE_HANDLE **handle) {
+    SERVER_HANDLE_V1 *api = get_server_api();
+    if (interface != 1 || api == NULL) {
+        return ENGINE_ENOTSUP;
+    }
+
+    struct journal_engine *je = calloc(1, sizeof(*je));
+    if (je == NULL) {
+        return ENGINE_ENOMEM;
+    }
+
+    je->engine = (ENGINE_HANDLE_V1) {
+        .interface = {
+            .interface = 1
+        },
+        .get_info = journal_get_info,
+        .initialize = journal_initialize,
+        .destroy = journal_destroy,
+        .allocate = journal_item_allocate,
+        .remove = journal_item_delete,
+        .release = journal_item_release,
+        .get = journal_get,
+        .get_stats = journal_get_stats,
+        .reset_stats = journal_reset_stats,
+        .get_stats_struct = journal_get_stats_struct,
+        .aggregate_stats = journal_aggregate_stats,
+        .store = journal_store,
+        .arithmetic = journal_arithmetic,
+        .flush = journal_flush,
+        .unknown_command = journal_unknown_command,
+        .tap_notify = journal_tap_notify,
+        .get_tap_iterator = journal_get_tap_iterator,
+        .item_set_cas = journal_item_set_cas,
+        .get_item_info = journal_get_item_info,
+        .errinfo = journal_errinfo,
+        .get_multi = journal_get_multi,
+        .get_lease = journal_get_lease,
+        .get_item_layout = journal_get_item_layout
+    };
+    je->server = *api;
+    je->get_server_api = get_server_api;
+    je->config.interval = 2;
+    je->config.replay_threads = 4;
+    je->config.compact_size = 64 * 1024 * 1024;
+    je->config.compact_ratio = 2.0;
+    je->journal.fd = -1;
+    je->info.engine_info.description = "Journal engine v0.1";
+    for (int ii = 0; ii < JOURNAL_STRIPES; ++ii) {
+        pthread_mutex_init(&je->stripes[ii], NULL);
+    }
+    pthread_mutex_init(&je->journal.lock, NULL);
+
+    *handle = (ENGINE_HANDLE*)&je->engine;
+    return ENGINE_SUCCESS;
+}
@@ -0,0 +1,229 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef JOURNAL_ENGINE_H
+#define JOURNAL_ENGINE_H 1
+
+#include "config.h"
+#include <pthread.h>
+#include <memcached/engine.h>
+
+/*
+ * The journal engine keeps its items in another engine (default_engine
+ * unless engine=path says otherwise, loaded from the directory we were
+ * loaded from) and makes them durable: every change that engine makes
+ * for us is appended to a log (journal_file=path) and we replay the log
+ * when we start.
+ *
+ * A store, delete, incr/decr or flush goes to the inner engine first
+ * (with the lock of the key's stripe held, so the records of a key are in
+ * the log in the order the changes were made) and its record is added to
+ * the buffer of the log. The call then returns ENGINE_EWOULDBLOCK, and
+ * the thread of the log writes the buffer every journal_interval
+ * milliseconds, fsyncs it once for all of the records in it (the group
+ * commit) and wakes up the clients through notify_io_complete. When the
+ * core calls us again we hand it the result we kept in the engine
+ * specific of the cookie. A client that never blocks (no cookie) waits
+ * for the commit in the call.
+ *
+ * The log is a sequence of records:
+ *
+ *    struct journal_record, the key and the value
+ *
+ * with the numbers in network byte order (the flags are kept the way the
+ * engine has them). The CRC-32C covers everything after the crc field,
+ * and the replay stops at the first record that doesn't match: that is
+ * where the write we crashed in was torn, and we truncate the log there.
+ * The value of an incr/decr, append or prepend is logged as a set of the
+ * value it ended up with; the expiry time is absolute.
+ *
+ * Once the log has journal_compact_size bytes (and journal_compact_ratio
+ * times the bytes of the last compaction) we start a new log and the
+ * compactor thread merges the old one into path.base, keeping only the
+ * last record of every key and dropping the deleted and expired ones:
+ *
+ *    path.base    what the logs we compacted left
+ *    path.old     the log being compacted (if we crashed doing it)
+ *    path         the log we append to
+ *
+ * We replay them in that order. The records of a file are replayed by
+ * journal_replay_threads threads, each taking the keys that hash to it,
+ * and a flush is a barrier: everyone is done with the records before
+ * it before anyone gets to the records after it.
+ *
+ * Not in the log: touch (the items get the expiry time they were stored
+ * with back), the namespace generations of default_engine, and what we
+ * get through TAP.
+ */
+
+#define JOURNAL_SET 1
+#define JOURNAL_DELETE 2
+#define JOURNAL_FLUSH 3
+
+struct journal_record {
+    uint32_t crc;
+    uint8_t op;
+    uint8_t reserved;
+    uint16_t nkey;
+    uint16_t vbucket;
+    uint16_t reserved2;
+    uint32_t flags;
+    /** When the item expires (seconds since the epoch, 0 if it never
+     * does), or when the flush takes effect */
+    uint32_t exptime;
+    uint32_t nbytes;
+};
+
+/** The stripes of locks ordering the changes of a key */
+#define JOURNAL_STRIPES 64
+
+/**
+ * What a client waiting for the commit of its change gets back (in the
+ * engine specific of the cookie)
+ */
+struct journal_waiter {
+    uint32_t magic;
+    const void *cookie;
+    /** The commit we wait for (the end of our record in the log) */
+    uint64_t lsn;
+    /** The result of the change and the one of the commit */
+    ENGINE_ERROR_CODE status;
+    uint64_t cas;
+    /** The result of an incr/decr */
+    uint64_t result;
+    bool done;
+    struct journal_waiter *next;
+};
+
+#define JOURNAL_WAITER_MAGIC 0x4a524e4c
+
+struct journal {
+    /** Protects the fields below */
+    pthread_mutex_t lock;
+    /** Signals the writer (something to write) */
+    pthread_cond_t cond;
+    /** Signals the clients without a cookie (a commit) */
+    pthread_cond_t committed;
+    /** Signals the compactor (a log to merge) */
+    pthread_cond_t compact_cond;
+    pthread_t writer;
+    pthread_t compactor;
+    bool running;
+
+    char *path;
+    int fd;
+    /** The bytes in the log (buffered or not) and the ones we fsynced */
+    uint64_t lsn;
+    uint64_t durable;
+    /** The records waiting for the writer */
+    char *buffer;
+    size_t nbuffer;
+    size_t buffersize;
+    /** The clients waiting for a commit, oldest first */
+    struct journal_waiter *waiters;
+    struct journal_waiter **waiters_tail;
+    /** Set once a write or an fsync failed: we don't take changes after it */
+    int error;
+
+    /** The compactor has a log to merge (it is path.old) */
+    bool compact;
+    bool compacting;
+    /** The bytes in path.base after the last compaction */
+    uint64_t base;
+    /** Where the log we append to starts in lsn */
+    uint64_t start;
+
+    /** Statistics */
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t commits;
+    uint64_t committed_ops;
+    uint64_t max_batch;
+    uint64_t failed;
+    uint64_t compactions;
+    uint64_t compact_kept;
+    uint64_t compact_dropped;
+    uint64_t replayed;
+    uint64_t replay_failed;
+    uint64_t replay_torn;
+    uint64_t replay_usec;
+};
+
+struct journal_engine {
+    ENGINE_HANDLE_V1 engine;
+    SERVER_HANDLE_V1 server;
+    GET_SERVER_API get_server_api;
+
+    /** The engine we keep the items in */
+    union {
+        ENGINE_HANDLE *v0;
+        ENGINE_HANDLE_V1 *v1;
+    } inner;
+    void *dlhandle;
+
+    struct {
+        char *engine;
+        char *file;
+        size_t interval;
+        size_t replay_threads;
+        size_t compact_size;
+        float compact_ratio;
+    } config;
+
+    pthread_mutex_t stripes[JOURNAL_STRIPES];
+    struct journal journal;
+
+    union {
+        engine_info engine_info;
+        char buffer[sizeof(engine_info) +
+                    (sizeof(feature_info) * LAST_REGISTERED_ENGINE_FEATURE)];
+    } info;
+};
+
+/**
+ * Replay the logs into the inner engine, open the log and start the
+ * writer and the compactor
+ * @param je the journal engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE journal_open(struct journal_engine *je);
+
+/**
+ * Commit what is buffered, stop the threads and close the log
+ * @param je the journal engine
+ */
+void journal_close(struct journal_engine *je);
+
+/**
+ * Add a record to the log: the value is taken from the iovecs (nbytes
+ * in all)
+ * @param je the journal engine
+ * @param record the header (in host byte order, crc and nbytes are
+ *               filled in)
+ * @param key the key of the record
+ * @param value the value of the record
+ * @param nvalue the number of elements in value
+ * @param waiter the client to wake up once the record is committed
+ *               (NULL to wait for it here)
+ * @return ENGINE_SUCCESS, or ENGINE_FAILED if we can't log it
+ */
+ENGINE_ERROR_CODE journal_append(struct journal_engine *je,
+                                 struct journal_record *record,
+                                 const void *key,
+                                 const struct iovec *value, int nvalue,
+                                 struct journal_waiter *waiter);
+
+/**
+ * Get the statistics of the log
+ * @param je the journal engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void journal_stats(struct journal_engine *je,
+                   ADD_STAT add_stat, const void *cookie);
+
+/**
+ * The hash we pick the stripe of a key (and its replay thread) with
+ */
+uint32_t journal_hash(const void *key, size_t nkey);
+
+#endif
@@ -0,0 +1,944 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "journal_engine.h"
+
+#define ATOMIC_ADD_64(ptr, val) __sync_add_and_fetch(ptr, val)
+
+/* The engines may return the value of an item in several pieces */
+typedef union {
+    item_info info;
+    char bytes[sizeof(item_info) + ((IOV_MAX - 1) * sizeof(struct iovec))];
+} item_info_holder;
+
+/* We don't bother starting the replay threads for fewer records */
+#define JOURNAL_REPLAY_MIN 1024
+
+/* The buffer the compactor writes through */
+#define JOURNAL_WRITE_BUFFER (1024 * 1024)
+
+/* CRC-32C (Castagnoli), a byte at a time */
+static uint32_t journal_crc_table[256];
+static pthread_once_t journal_crc_once = PTHREAD_ONCE_INIT;
+
+static void journal_crc_init(void) {
+    for (uint32_t ii = 0; ii < 256; ++ii) {
+        uint32_t crc = ii;
+        for (int jj = 0; jj < 8; ++jj) {
+            crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        }
+        journal_crc_table[ii] = crc;
+    }
+}
+
+static uint32_t journal_crc(const void *data, size_t len) {
+    const uint8_t *ptr = data;
+    uint32_t crc = 0xffffffff;
+    pthread_once(&journal_crc_once, journal_crc_init);
+    while (len-- > 0) {
+        crc = journal_crc_table[(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t journal_hash(const void *key, size_t nkey) {
+    /* FNV-1a */
+    const uint8_t *ptr = key;
+    uint32_t hash = 2166136261U;
+    while (nkey-- > 0) {
+        hash = (hash ^ *ptr++) * 16777619U;
+    }
+    return hash;
+}
+
+static uint64_t journal_time_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static time_t journal_now(struct journal_engine *je) {
+    return je->server.core->abstime(je->server.core->get_current_time());
+}
+
+static void journal_log(struct journal_engine *je,
+                        EXTENSION_LOG_LEVEL severity, const char *fmt, ...) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    logger = (void*)je->server.extension->get_extension(EXTENSION_LOGGER);
+    char buffer[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    va_end(ap);
+    logger->log(severity, NULL, "%s", buffer);
+}
+
+static bool journal_write_all(int fd, const void *data, size_t len) {
+    const char *ptr = data;
+    while (len > 0) {
+        ssize_t nw = write(fd, ptr, len);
+        if (nw == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += nw;
+        len -= (size_t)nw;
+    }
+    return true;
+}
+
+/* Make a rename (or a new file) in the directory of path durable */
+static bool journal_sync_dir(const char *path) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else if ((size_t)(slash - path) < sizeof(dir)) {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    } else {
+        return false;
+    }
+
+    int fd = open(dir, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+static char *journal_map(int fd, size_t size) {
+#ifdef HAVE_SYS_MMAN_H
+    void *ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+#else
+    char *ptr = malloc(size);
+    size_t offset = 0;
+    while (ptr != NULL && offset < size) {
+        ssize_t nr = read(fd, ptr + offset, size - offset);
+        if (nr <= 0 && !(nr == -1 && errno == EINTR)) {
+            free(ptr);
+            ptr = NULL;
+        } else if (nr > 0) {
+            offset += (size_t)nr;
+        }
+    }
+    return ptr;
+#endif
+}
+
+static void journal_unmap(char *ptr, size_t size) {
+#ifdef HAVE_SYS_MMAN_H
+    munmap(ptr, size);
+#else
+    (void)size;
+    free(ptr);
+#endif
+}
+
+/*
+ * A log file mapped into memory
+ */
+struct journal_file {
+    char *map;
+    size_t size;
+    /** The bytes up to the first record that is torn (or bad) */
+    size_t valid;
+    /** The number of records in them */
+    size_t nrecords;
+};
+
+/*
+ * Decode the header of a record we checked already
+ * @return the size of the record
+ */
+static size_t journal_record_decode(const char *ptr, struct journal_record *r) {
+    memcpy(r, ptr, sizeof(*r));
+    r->crc = ntohl(r->crc);
+    r->nkey = ntohs(r->nkey);
+    r->vbucket = ntohs(r->vbucket);
+    r->exptime = ntohl(r->exptime);
+    r->nbytes = ntohl(r->nbytes);
+    return sizeof(*r) + r->nkey + (size_t)r->nbytes;
+}
+
+/*
+ * Decode and check the record at ptr
+ * @return the size of the record, or 0 if it's torn or bad
+ */
+static size_t journal_record_get(const char *ptr, size_t avail,
+                                 struct journal_record *r) {
+    if (avail < sizeof(*r)) {
+        return 0;
+    }
+    size_t size = journal_record_decode(ptr, r);
+    if (size > avail || r->op < JOURNAL_SET || r->op > JOURNAL_FLUSH ||
+        journal_crc(ptr + sizeof(r->crc), size - sizeof(r->crc)) != r->crc) {
+        return 0;
+    }
+    return size;
+}
+
+static const char *journal_record_key(const char *ptr) {
+    return ptr + sizeof(struct journal_record);
+}
+
+/*
+ * Map a log and find where its good records end
+ * @return false if it's not there (or we can't read it)
+ */
+static bool journal_file_open(struct journal_engine *je, const char *path,
+                              struct journal_file *f) {
+    memset(f, 0, sizeof(*f));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            journal_log(je, EXTENSION_LOG_WARNING,
+                        "Failed to open the journal %s: %s\n",
+                        path, strerror(errno));
+        }
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        f->size = (size_t)st.st_size;
+        f->map = journal_map(fd, f->size);
+    }
+    close(fd);
+    if (f->size != 0 && f->map == NULL) {
+        journal_log(je, EXTENSION_LOG_WARNING,
+                    "Failed to read the journal %s\n", path);
+        return false;
+    }
+
+    struct journal_record r;
+    size_t size;
+    while ((size = journal_record_get(f->map + f->valid,
+                                      f->size - f->valid, &r)) != 0) {
+        f->valid += size;
+        f->nrecords++;
+    }
+    return true;
+}
+
+static void journal_file_close(struct journal_file *f) {
+    if (f->map != NULL) {
+        journal_unmap(f->map, f->size);
+    }
+    memset(f, 0, sizeof(*f));
+}
+
+/*
+ * The records of a file between two flushes, replayed by all of the
+ * threads (each doing the keys hashing to it)
+ */
+struct journal_replay {
+    struct journal_engine *je;
+    const char *start;
+    const char *end;
+    uint32_t nthreads;
+    uint32_t next;
+};
+
+static void journal_replay_set(struct journal_engine *je,
+                               const struct journal_record *r,
+                               const char *key, time_t now) {
+    ENGINE_HANDLE_V1 *v1 = je->inner.v1;
+    ENGINE_HANDLE *v0 = je->inner.v0;
+    uint64_t cas = 0;
+
+    if (r->exptime != 0 && r->exptime <= now) {
+        /* It's gone (and so is whatever was there before it) */
+        v1->remove(v0, NULL, key, r->nkey, &cas, r->vbucket);
+        return;
+    }
+
+    item *it = NULL;
+    if (v1->allocate(v0, NULL, &it, key, r->nkey, r->nbytes, (int)r->flags,
+                     je->server.core->realtime(r->exptime)) != ENGINE_SUCCESS) {
+        ATOMIC_ADD_64(&je->journal.replay_failed, 1);
+        return;
+    }
+
+    item_info_holder info = { .info.nvalue = IOV_MAX };
+    if (!v1->get_item_info(v0, NULL, it, &info.info)) {
+        v1->release(v0, NULL, it);
+        ATOMIC_ADD_64(&je->journal.replay_failed, 1);
+        return;
+    }
+    const char *value = key + r->nkey;
+    for (int ii = 0; ii < info.info.nvalue; ++ii) {
+        memcpy(info.info.value[ii].iov_base, value, info.info.value[ii].iov_len);
+        value += info.info.value[ii].iov_len;
+    }
+
+    if (v1->store(v0, NULL, it, &cas, OPERATION_SET,
+                  r->vbucket) == ENGINE_SUCCESS) {
+        ATOMIC_ADD_64(&je->journal.replayed, 1);
+    } else {
+        ATOMIC_ADD_64(&je->journal.replay_failed, 1);
+    }
+    v1->release(v0, NULL, it);
+}
+
+static void *journal_replay_main(void *arg) {
+    struct journal_replay *rp = arg;
+    struct journal_engine *je = rp->je;
+    uint32_t id = __sync_fetch_and_add(&rp->next, 1);
+    time_t now = journal_now(je);
+
+    if (id >= rp->nthreads) {
+        /* The thread we started for it came too late */
+        return NULL;
+    }
+
+    const char *ptr = rp->start;
+    struct journal_record r;
+    size_t size;
+    while (ptr < rp->end) {
+        size = journal_record_decode(ptr, &r);
+        const char *key = journal_record_key(ptr);
+        if (rp->nthreads == 1 || journal_hash(key, r.nkey) % rp->nthreads == id) {
+            if (r.op == JOURNAL_SET) {
+                journal_replay_set(je, &r, key, now);
+            } else {
+                uint64_t cas = 0;
+                je->inner.v1->remove(je->inner.v0, NULL, key, r.nkey,
+                                     &cas, r.vbucket);
+                ATOMIC_ADD_64(&je->journal.replayed, 1);
+            }
+        }
+        ptr += size;
+    }
+    return NULL;
+}
+
+static void journal_replay_segment(struct journal_engine *je,
+                                   const char *start, const char *end,
+                                   size_t nrecords) {
+    struct journal_replay rp = {
+        .je = je, .start = start, .end = end, .nthreads = 1
+    };
+
+    size_t nthreads = je->config.replay_threads;
+    if (nthreads <= 1 || nrecords < JOURNAL_REPLAY_MIN) {
+        journal_replay_main(&rp);
+        return;
+    }
+
+    pthread_t threads[nthreads - 1];
+    size_t started = 0;
+    rp.nthreads = (uint32_t)nthreads;
+    while (started < nthreads - 1 &&
+           pthread_create(&threads[started], NULL,
+                          journal_replay_main, &rp) == 0) {
+        ++started;
+    }
+    /* We take the shares nobody took (all of them if we couldn't start
+     * the threads) */
+    do {
+        journal_replay_main(&rp);
+    } while (__sync_add_and_fetch(&rp.next, 0) < rp.nthreads);
+    for (size_t ii = 0; ii < started; ++ii) {
+        pthread_join(threads[ii], NULL);
+    }
+}
+
+static void journal_replay_file(struct journal_engine *je,
+                                const struct journal_file *f) {
+    const char *ptr = f->map;
+    const char *end = f->map + f->valid;
+    const char *start = ptr;
+    size_t nrecords = 0;
+    struct journal_record r;
+    size_t size;
+
+    while (ptr < end) {
+        size = journal_record_decode(ptr, &r);
+        if (r.op == JOURNAL_FLUSH) {
+            journal_replay_segment(je, start, ptr, nrecords);
+            time_t when = r.exptime;
+            if (when <= journal_now(je)) {
+                when = 0;
+            }
+            je->inner.v1->flush(je->inner.v0, NULL, when);
+            je->journal.replayed++;
+            start = ptr + size;
+            nrecords = 0;
+        } else {
+            ++nrecords;
+        }
+        ptr += size;
+    }
+    journal_replay_segment(je, start, end, nrecords);
+}
+
+static char *journal_path(const char *path, const char *suffix) {
+    size_t len = strlen(path) + strlen(suffix) + 1;
+    char *ret = malloc(len);
+    if (ret != NULL) {
+        snprintf(ret, len, "%s%s", path, suffix);
+    }
+    return ret;
+}
+
+/*
+ * Merge path.base and path.old into a new path.base
+ */
+static bool journal_compact(struct journal_engine *je) {
+    struct journal *j = &je->journal;
+    char *base = journal_path(j->path, ".base");
+    char *old = journal_path(j->path, ".old");
+    char *tmp = journal_path(j->path, ".base.tmp");
+    struct journal_file files[2];
+    const char **recs = NULL;
+    int32_t *table = NULL;
+    int fd = -1;
+    char *buffer = NULL;
+    bool ok = false;
+
+    memset(files, 0, sizeof(files));
+    if (base == NULL || old == NULL || tmp == NULL ||
+        !journal_file_open(je, old, &files[1])) {
+        goto done;
+    }
+    journal_file_open(je, base, &files[0]);
+
+    size_t nrecords = files[0].nrecords + files[1].nrecords;
+    size_t tablesize = 1024;
+    while (tablesize < nrecords * 2) {
+        tablesize *= 2;
+    }
+    if ((recs = calloc(nrecords + 1, sizeof(*recs))) == NULL ||
+        (table = malloc(tablesize * sizeof(*table))) == NULL ||
+        (buffer = malloc(JOURNAL_WRITE_BUFFER)) == NULL) {
+        goto done;
+    }
+    memset(table, 0xff, tablesize * sizeof(*table));
+
+    /* Keep the last record of every key (and the flushes that haven't
+     * taken effect yet) */
+    time_t now = journal_now(je);
+    size_t n = 0;
+    for (int ii = 0; ii < 2; ++ii) {
+        const char *ptr = files[ii].map;
+        const char *end = ptr + files[ii].valid;
+        struct journal_record r;
+        size_t size;
+        while (ptr < end) {
+            size = journal_record_decode(ptr, &r);
+            if (r.op == JOURNAL_FLUSH) {
+                if (r.exptime <= now) {
+                    memset(recs, 0, n * sizeof(*recs));
+                    memset(table, 0xff, tablesize * sizeof(*table));
+                    ptr += size;
+                    continue;
+                }
+                recs[n++] = ptr;
+                ptr += size;
+                continue;
+            }
+
+            const char *key = journal_record_key(ptr);
+            size_t pos = journal_hash(key, r.nkey) & (tablesize - 1);
+            while (table[pos] != -1) {
+                struct journal_record o;
+                const char *other = recs[table[pos]];
+                if (other != NULL) {
+                    journal_record_decode(other, &o);
+                    if (o.nkey == r.nkey &&
+                        memcmp(journal_record_key(other), key, r.nkey) == 0) {
+                        recs[table[pos]] = NULL;
+                        break;
+                    }
+                }
+                pos = (pos + 1) & (tablesize - 1);
+            }
+            table[pos] = (int32_t)n;
+            recs[n++] = ptr;
+            ptr += size;
+        }
+    }
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        journal_log(je, EXTENSION_LOG_WARNING,
+                    "Failed to create %s: %s\n", tmp, strerror(errno));
+        goto done;
+    }
+
+    uint64_t written = 0, kept = 0;
+    size_t nbuffer = 0;
+    ok = true;
+    for (size_t ii = 0; ii < n && ok; ++ii) {
+        struct journal_record r;
+        size_t size;
+        if (recs[ii] == NULL) {
+            continue;
+        }
+        size = journal_record_decode(recs[ii], &r);
+        if (r.op == JOURNAL_DELETE ||
+            (r.op == JOURNAL_SET && r.exptime != 0 && r.exptime <= now)) {
+            continue;
+        }
+        if (nbuffer + size > JOURNAL_WRITE_BUFFER) {
+            ok = journal_write_all(fd, buffer, nbuffer);
+            nbuffer = 0;
+        }
+        if (size > JOURNAL_WRITE_BUFFER) {
+            ok = ok && journal_write_all(fd, recs[ii], size);
+        } else {
+            memcpy(buffer + nbuffer, recs[ii], size);
+            nbuffer += size;
+        }
+        written += size;
+        ++kept;
+        if ((kept % 1024) == 0 && !j->running) {
+            /* We're shutting down: path.old is merged the next time */
+            ok = false;
+        }
+    }
+    ok = ok && journal_write_all(fd, buffer, nbuffer) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    fd = -1;
+    if (ok && rename(tmp, base) == 0 && journal_sync_dir(base) &&
+        unlink(old) == 0) {
+        journal_sync_dir(old);
+        pthread_mutex_lock(&j->lock);
+        j->base = written;
+        j->compactions++;
+        j->compact_kept += kept;
+        j->compact_dropped += nrecords - kept;
+        pthread_mutex_unlock(&j->lock);
+        journal_log(je, EXTENSION_LOG_INFO,
+                    "Compacted %zu records of the journal %s into %"PRIu64"\n",
+                    nrecords, j->path, kept);
+    } else {
+        ok = false;
+        unlink(tmp);
+    }
+
+done:
+    if (fd != -1) {
+        close(fd);
+        unlink(tmp);
+    }
+    journal_file_close(&files[0]);
+    journal_file_close(&files[1]);
+    free(buffer);
+    free(table);
+    free(recs);
+    free(tmp);
+    free(old);
+    free(base);
+    return ok;
+}
+
+static void *journal_compactor_main(void *arg) {
+    struct journal_engine *je = arg;
+    struct journal *j = &je->journal;
+
+    je->server.core->place_background_thread();
+
+    pthread_mutex_lock(&j->lock);
+    while (j->running) {
+        if (!j->compact) {
+            pthread_cond_wait(&j->compact_cond, &j->lock);
+            continue;
+        }
+        j->compacting = true;
+        pthread_mutex_unlock(&j->lock);
+        bool ok = journal_compact(je);
+        pthread_mutex_lock(&j->lock);
+        j->compacting = false;
+        if (ok) {
+            j->compact = false;
+        } else if (j->running) {
+            /* Try again in a bit */
+            struct timespec ts = { .tv_sec = time(NULL) + 10 };
+            pthread_cond_timedwait(&j->compact_cond, &j->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+/*
+ * Start a new log once this one is big enough, and have it compacted.
+ * Called by the writer with the lock held.
+ */
+static void journal_maybe_rotate(struct journal_engine *je) {
+    struct journal *j = &je->journal;
+    uint64_t size = j->durable - j->start;
+
+    if (j->compact || j->compacting || size < je->config.compact_size ||
+        size < (uint64_t)(je->config.compact_ratio * j->base)) {
+        return;
+    }
+
+    char *old = journal_path(j->path, ".old");
+    if (old == NULL) {
+        return;
+    }
+    if (rename(j->path, old) == 0) {
+        int fd = open(j->path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+        if (fd != -1 && journal_sync_dir(j->path)) {
+            close(j->fd);
+            j->fd = fd;
+            j->start = j->durable;
+            j->compact = true;
+            pthread_cond_signal(&j->compact_cond);
+        } else {
+            /* Carry on with the one we had */
+            if (fd != -1) {
+                close(fd);
+            }
+            rename(old, j->path);
+        }
+    }
+    free(old);
+}
+
+static void *journal_writer_main(void *arg) {
+    struct journal_engine *je = arg;
+    struct journal *j = &je->journal;
+    char *spare = NULL;
+    size_t sparesize = 0;
+
+    je->server.core->place_background_thread();
+
+    pthread_mutex_lock(&j->lock);
+    while (j->running || j->nbuffer != 0) {
+        if (j->nbuffer == 0) {
+            pthread_cond_wait(&j->cond, &j->lock);
+            continue;
+        }
+
+        /* Give the others a moment to add their records to the batch */
+        if (j->running && je->config.interval != 0) {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            uint64_t usec = (uint64_t)tv.tv_usec + je->config.interval * 1000;
+            struct timespec ts = {
+                .tv_sec = tv.tv_sec + (time_t)(usec / 1000000),
+                .tv_nsec = (long)(usec % 1000000) * 1000
+            };
+            while (j->running &&
+                   pthread_cond_timedwait(&j->cond, &j->lock, &ts) != ETIMEDOUT) {
+                /* someone added a record, or we're shutting down */
+            }
+        }
+
+        char *buffer = j->buffer;
+        size_t nbuffer = j->nbuffer;
+        size_t buffersize = j->buffersize;
+        j->buffer = spare;
+        j->buffersize = sparesize;
+        j->nbuffer = 0;
+        uint64_t lsn = j->lsn;
+        struct journal_waiter *waiters = j->waiters;
+        j->waiters = NULL;
+        j->waiters_tail = &j->waiters;
+        int fd = j->fd;
+        pthread_mutex_unlock(&j->lock);
+
+        bool ok = journal_write_all(fd, buffer, nbuffer) && fsync(fd) == 0;
+        int error = errno;
+        spare = buffer;
+        sparesize = buffersize;
+
+        pthread_mutex_lock(&j->lock);
+        if (ok) {
+            j->durable = lsn;
+            j->commits++;
+            journal_maybe_rotate(je);
+        } else if (j->error == 0) {
+            j->error = error;
+            journal_log(je, EXTENSION_LOG_WARNING,
+                        "Failed to write the journal %s: %s\n",
+                        j->path, strerror(error));
+        }
+        pthread_cond_broadcast(&j->committed);
+
+        uint64_t batch = 0;
+        while (waiters != NULL) {
+            struct journal_waiter *w = waiters;
+            const void *cookie = w->cookie;
+            waiters = w->next;
+            ++batch;
+            if (ok) {
+                w->done = true;
+            }
+            pthread_mutex_unlock(&j->lock);
+            if (ok) {
+                je->server.cookie->notify_io_complete(cookie, ENGINE_SUCCESS);
+            } else {
+                /* The core doesn't come back for a failure */
+                je->server.cookie->store_engine_specific(cookie, NULL);
+                free(w);
+                je->server.cookie->notify_io_complete(cookie, ENGINE_FAILED);
+            }
+            je->server.cookie->release(cookie);
+            pthread_mutex_lock(&j->lock);
+        }
+        if (ok) {
+            j->committed_ops += batch;
+        } else {
+            j->failed += batch;
+        }
+        if (batch > j->max_batch) {
+            j->max_batch = batch;
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+    free(spare);
+    return NULL;
+}
+
+ENGINE_ERROR_CODE journal_append(struct journal_engine *je,
+                                 struct journal_record *record,
+                                 const void *key,
+                                 const struct iovec *value, int nvalue,
+                                 struct journal_waiter *waiter) {
+    struct journal *j = &je->journal;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    size_t nbytes = 0;
+    for (int ii = 0; ii < nvalue; ++ii) {
+        nbytes += value[ii].iov_len;
+    }
+    size_t size = sizeof(*record) + record->nkey + nbytes;
+
+    pthread_mutex_lock(&j->lock);
+    if (j->error != 0) {
+        j->failed++;
+        pthread_mutex_unlock(&j->lock);
+        return ENGINE_FAILED;
+    }
+    if (j->nbuffer + size > j->buffersize) {
+        size_t buffersize = j->buffersize ? j->buffersize : 64 * 1024;
+        while (buffersize < j->nbuffer + size) {
+            buffersize *= 2;
+        }
+        char *buffer = realloc(j->buffer, buffersize);
+        if (buffer == NULL) {
+            j->failed++;
+            pthread_mutex_unlock(&j->lock);
+            return ENGINE_ENOMEM;
+        }
+        j->buffer = buffer;
+        j->buffersize = buffersize;
+    }
+
+    char *ptr = j->buffer + j->nbuffer;
+    struct journal_record r = {
+        .op = record->op,
+        .nkey = htons(record->nkey),
+        .vbucket = htons(record->vbucket),
+        .flags = record->flags,
+        .exptime = htonl(record->exptime),
+        .nbytes = htonl((uint32_t)nbytes)
+    };
+    memcpy(ptr, &r, sizeof(r));
+    memcpy(ptr + sizeof(r), key, record->nkey);
+    char *dst = ptr + sizeof(r) + record->nkey;
+    for (int ii = 0; ii < nvalue; ++ii) {
+        memcpy(dst, value[ii].iov_base, value[ii].iov_len);
+        dst += value[ii].iov_len;
+    }
+    r.crc = htonl(journal_crc(ptr + sizeof(r.crc), size - sizeof(r.crc)));
+    memcpy(ptr, &r.crc, sizeof(r.crc));
+
+    j->nbuffer += size;
+    j->lsn += size;
+    j->records++;
+    j->bytes += size;
+    pthread_cond_broadcast(&j->cond);
+
+    if (waiter != NULL) {
+        waiter->lsn = j->lsn;
+        waiter->next = NULL;
+        *j->waiters_tail = waiter;
+        j->waiters_tail = &waiter->next;
+    } else {
+        uint64_t lsn = j->lsn;
+        while (j->durable < lsn && j->error == 0) {
+            pthread_cond_wait(&j->committed, &j->lock);
+        }
+        if (j->durable < lsn) {
+            j->failed++;
+            ret = ENGINE_FAILED;
+        } else {
+            j->committed_ops++;
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+    return ret;
+}
+
+ENGINE_ERROR_CODE journal_open(struct journal_engine *je) {
+    struct journal *j = &je->journal;
+    uint64_t start = journal_time_usec();
+    struct journal_file f;
+
+    if ((j->path = strdup(je->config.file)) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+
+    const char *suffixes[] = { ".base", ".old", "" };
+    for (int ii = 0; ii < 3; ++ii) {
+        char *path = journal_path(j->path, suffixes[ii]);
+        if (path == NULL) {
+            return ENGINE_ENOMEM;
+        }
+        if (journal_file_open(je, path, &f)) {
+            if (f.valid != f.size) {
+                j->replay_torn++;
+                journal_log(je, EXTENSION_LOG_WARNING,
+                            "The journal %s is torn after %zu bytes\n",
+                            path, f.valid);
+            }
+            journal_replay_file(je, &f);
+            if (ii == 0) {
+                j->base = f.valid;
+            } else if (ii == 1) {
+                /* We crashed merging it: do it again */
+                j->compact = true;
+            } else {
+                j->start = j->lsn = j->durable = f.valid;
+                if (f.valid != f.size && truncate(path, (off_t)f.valid) != 0) {
+                    journal_log(je, EXTENSION_LOG_WARNING,
+                                "Failed to truncate the journal %s: %s\n",
+                                path, strerror(errno));
+                }
+            }
+            journal_file_close(&f);
+        }
+        free(path);
+    }
+    j->replay_usec = journal_time_usec() - start;
+    journal_log(je, EXTENSION_LOG_INFO,
+                "Replayed %"PRIu64" records of the journal %s in %"PRIu64" ms\n",
+                j->replayed, j->path, j->replay_usec / 1000);
+
+    j->fd = open(j->path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+    if (j->fd == -1) {
+        journal_log(je, EXTENSION_LOG_WARNING,
+                    "Failed to open the journal %s: %s\n",
+                    j->path, strerror(errno));
+        return ENGINE_FAILED;
+    }
+
+    j->waiters_tail = &j->waiters;
+    if (pthread_cond_init(&j->cond, NULL) != 0 ||
+        pthread_cond_init(&j->committed, NULL) != 0 ||
+        pthread_cond_init(&j->compact_cond, NULL) != 0) {
+        abort();
+    }
+    j->running = true;
+    if (pthread_create(&j->writer, NULL, journal_writer_main, je) != 0) {
+        j->running = false;
+        pthread_cond_destroy(&j->cond);
+        pthread_cond_destroy(&j->committed);
+        pthread_cond_destroy(&j->compact_cond);
+        return ENGINE_FAILED;
+    }
+    if (pthread_create(&j->compactor, NULL, journal_compactor_main, je) != 0) {
+        pthread_mutex_lock(&j->lock);
+        j->running = false;
+        pthread_cond_broadcast(&j->cond);
+        pthread_mutex_unlock(&j->lock);
+        pthread_join(j->writer, NULL);
+        pthread_cond_destroy(&j->cond);
+        pthread_cond_destroy(&j->committed);
+        pthread_cond_destroy(&j->compact_cond);
+        return ENGINE_FAILED;
+    }
+    return ENGINE_SUCCESS;
+}
+
+void journal_close(struct journal_engine *je) {
+    struct journal *j = &je->journal;
+
+    if (j->running) {
+        pthread_mutex_lock(&j->lock);
+        j->running = false;
+        pthread_cond_broadcast(&j->cond);
+        pthread_cond_signal(&j->compact_cond);
+        pthread_mutex_unlock(&j->lock);
+        pthread_join(j->writer, NULL);
+        pthread_join(j->compactor, NULL);
+        pthread_cond_destroy(&j->cond);
+        pthread_cond_destroy(&j->committed);
+        pthread_cond_destroy(&j->compact_cond);
+    }
+    if (j->fd != -1) {
+        close(j->fd);
+        j->fd = -1;
+    }
+    free(j->buffer);
+    j->buffer = NULL;
+    free(j->path);
+    j->path = NULL;
+}
+
+void journal_stats(struct journal_engine *je,
+                   ADD_STAT add_stat, const void *cookie) {
+    struct journal *j = &je->journal;
+    char val[128];
+    int vlen;
+
+#define JOURNAL_STAT(name, fmt, value)                                  \
+    do {                                                                \
+        vlen = snprintf(val, sizeof(val), fmt, value);                  \
+        add_stat("journal:" name, (uint16_t)strlen("journal:" name),    \
+                 val, (uint32_t)vlen, cookie);                          \
+    } while (0)
+
+    pthread_mutex_lock(&j->lock);
+    JOURNAL_STAT("file", "%s", j->path ? j->path : "");
+    JOURNAL_STAT("interval", "%zu", je->config.interval);
+    JOURNAL_STAT("records", "%"PRIu64, j->records);
+    JOURNAL_STAT("bytes", "%"PRIu64, j->bytes);
+    JOURNAL_STAT("size", "%"PRIu64, j->lsn - j->start);
+    JOURNAL_STAT("base_size", "%"PRIu64, j->base);
+    JOURNAL_STAT("commits", "%"PRIu64, j->commits);
+    JOURNAL_STAT("committed_ops", "%"PRIu64, j->committed_ops);
+    JOURNAL_STAT("max_batch", "%"PRIu64, j->max_batch);
+    JOURNAL_STAT("failed", "%"PRIu64, j->failed);
+    JOURNAL_STAT("error", "%s", j->error ? strerror(j->error) : "none");
+    JOURNAL_STAT("compacting", "%s", j->compact ? "true" : "false");
+    JOURNAL_STAT("compactions", "%"PRIu64, j->compactions);
+    JOURNAL_STAT("compact_kept", "%"PRIu64, j->compact_kept);
+    JOURNAL_STAT("compact_dropped", "%"PRIu64, j->compact_dropped);
+    JOURNAL_STAT("replayed", "%"PRIu64, j->replayed);
+    JOURNAL_STAT("replay_failed", "%"PRIu64, j->replay_failed);
+    JOURNAL_STAT("replay_torn", "%"PRIu64, j->replay_torn);
+    JOURNAL_STAT("replay_usec", "%"PRIu64, j->replay_usec);
+    pthread_mutex_unlock(&j->lock);
+
+#undef JOURNAL_STAT
+}
@@ -1,12 +1,25 @@
 /* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * With tap_items=<n> the mock engine is a TAP producer for benchmarks
+ * (see "make tap_bench" and mcbasher -R): every TAP connection gets a
+ * stream of n mutations (keys tap_bench:0 and up) with values of
+ * tap_value_size bytes, the first 8 of them the time (CLOCK_MONOTONIC, in
+ * ns) the mutation was created so that the consumer can tell how far
+ * behind it is. With tap_ack=<n> every n-th mutation asks for an ack and
+ * the stream is paused until it comes back. The connection is closed
+ * after the last mutation.
+ */
 #undef NDEBUG
 #include "config.h"
 #include "tap_mock_engine.h"
 
 #include <pthread.h>
 #include <cassert>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <sys/time.h>
 #include <map>
 #include <string>
 
@@ -162,6 +175,10 @@ public:
         // ignored
     }
 
+    char *getData(void) {
+        return data;
+    }
+
     bool toItemInfo(item_info *info) const {
         info->cas = cas;
         info->exptime = exptime;
@@ -373,11 +390,17 @@ public:
                   uint32_t flags,
                   const void* userdata,
                   size_t nuserdat) :
-        cookie(c), disconnect(false), blocked(false), reserved(false)
+        cookie(c), disconnect(false), blocked(false), reserved(false),
+        sent(0), awaitingAck(false), ackSeqno(0)
     {
 
     }
 
+    // The benchmark stream (see tap_items)
+    uint64_t sent;
+    bool awaitingAck;
+    uint32_t ackSeqno;
+
     void setBlocked(bool value) {
         blocked = value;
     }
@@ -565,7 +588,9 @@ private:
 
 class MockEngine {
 public:
-    MockEngine(SERVER_HANDLE_V1 *api) : sapi(api), running(false) {
+    MockEngine(SERVER_HANDLE_V1 *api) : sapi(api), running(false),
+                                        benchItems(0), benchValueSize(64),
+                                        benchAck(0) {
         memset(&info, 0, sizeof(info));
         info.description = "TAP mock engine v0.1";
     }
@@ -582,7 +607,29 @@ public:
         return &info;
     }
 
-    ENGINE_ERROR_CODE initialize(ENGINE_HANDLE* handle, const char* ) {
+    ENGINE_ERROR_CODE initialize(ENGINE_HANDLE* handle, const char* cfg) {
+        if (cfg != NULL) {
+            struct config_item items[4];
+            memset(items, 0, sizeof(items));
+            items[0].key = "tap_items";
+            items[0].datatype = DT_SIZE;
+            items[0].value.dt_size = &benchItems;
+            items[1].key = "tap_value_size";
+            items[1].datatype = DT_SIZE;
+            items[1].value.dt_size = &benchValueSize;
+            items[2].key = "tap_ack";
+            items[2].datatype = DT_SIZE;
+            items[2].value.dt_size = &benchAck;
+            items[3].key = NULL;
+            if (sapi->core->parse_config(cfg, items, stderr) != 0) {
+                return ENGINE_FAILED;
+            }
+            // Room for the timestamp
+            if (benchValueSize < sizeof(uint64_t)) {
+                benchValueSize = sizeof(uint64_t);
+            }
+        }
+
         void *cookie = reinterpret_cast<void*>(this);
         sapi->callback->register_callback(handle, ON_DISCONNECT,
                                           ::handle_disconnect, cookie);
@@ -741,8 +788,16 @@ public:
                                 size_t ndata,
                                 uint16_t vbucket)
     {
-        abort();
-        return ENGINE_ENOTSUP;
+        if (tap_event != TAP_ACK || benchItems == 0) {
+            abort();
+        }
+
+        TapConnection *connection = tapconnmap.get(cookie);
+        if (connection->awaitingAck && tap_seqno == connection->ackSeqno) {
+            connection->awaitingAck = false;
+        }
+        tapconnmap.release(connection);
+        return ENGINE_SUCCESS;
     }
 
     TAP_ITERATOR getTapIterator(const void* cookie,
@@ -773,6 +828,12 @@ public:
         *seqno = 0;
         *flags = 0;
 
+        if (benchItems != 0) {
+            ret = benchWalker(connection, itm, flags, seqno);
+            tapconnmap.release(connection);
+            return ret;
+        }
+
         long r = random() % 4;
         if (r < 1) {
             ret = TAP_NOOP;
@@ -802,6 +863,51 @@ public:
     }
 
 protected:
+    static uint64_t benchNow(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+        struct timespec ts;
+        if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+            return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+#endif
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+    }
+
+    // The next message of a benchmark stream. While we wait for an ack
+    // we pause; the ack puts the connection back in the ship log state
+    // so we're called again without a notification.
+    tap_event_t benchWalker(TapConnection *connection, item **itm,
+                            uint16_t *flags, uint32_t *seqno)
+    {
+        if (connection->awaitingAck) {
+            return TAP_PAUSE;
+        }
+        if (connection->sent == benchItems) {
+            return TAP_DISCONNECT;
+        }
+
+        char key[32];
+        uint64_t n = connection->sent++;
+        int nkey = snprintf(key, sizeof(key), "tap_bench:%llu",
+                            (unsigned long long)n);
+        Item *it = new Item(key, nkey, benchValueSize, 0, 0);
+        memset(it->getData(), 'x', benchValueSize);
+        uint64_t now = benchNow();
+        memcpy(it->getData(), &now, sizeof(now));
+
+        *seqno = (uint32_t)n;
+        if (benchAck != 0 &&
+            ((n + 1) % benchAck == 0 || n + 1 == benchItems)) {
+            *flags = TAP_FLAG_ACK;
+            connection->awaitingAck = true;
+            connection->ackSeqno = *seqno;
+        }
+        *itm = reinterpret_cast<item*>(it);
+        return TAP_MUTATION;
+    }
+
     ENGINE_ERROR_CODE dispatchNotification(const void *cookie) {
         NotificationData *nd = new NotificationData(cookie, sapi);
         if (pthread_create(NULL, NULL, dispatch_notification,
@@ -820,11 +926,17 @@ private:
     TapConnMap tapconnmap;
     volatile bool running;
     pthread_t io_thread;
+    // The benchmark streams (see tap_items)
+    size_t benchItems;
+    size_t benchValueSize;
+    size_t benchAck;
 };
 
 
 struct EngineGlue {
     EngineGlue(SERVER_HANDLE_V1 *api): me(api) {
+        // The optional members we don't implement have to be NULL
+        memset(&interface, 0, sizeof(interface));
         interface.interface.interface = 1;
         interface.get_info = get_info;
         interface.initialize = initialize;
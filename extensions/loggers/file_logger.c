@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <pthread.h>
+#include <inttypes.h>
 #include <sys/time.h>
 
 #ifdef WIN32_H
@@ -58,20 +59,39 @@ static EXTENSION_LOG_LEVEL output_level = EXTENSION_LOG_WARNING;
 static size_t cyclesz = 100 * 1024 * 1024;
 
 /*
- * We're using two buffers for logging. We'll be inserting data into one,
- * while we're working on writing the other one to disk. Given that the disk
- * is way slower than our CPU, we might end up in a situation that we'll be
- * blocking the frontend threads if you're logging too much.
+ * The frontend threads put the log entries in a lock free ring, which the
+ * logger thread drains into a buffer of its own before it writes it to
+ * disk. Every entry is a 32 bit length followed by the message, padded to
+ * 8 bytes so that the length never wraps around the end of the ring. A
+ * thread reserves room for an entry by moving head forward, copies the
+ * message in and publishes the entry by storing its length. The logger
+ * thread consumes the published entries in order from tail, and zeroes
+ * them before it gives the room back.
  */
-static struct logbuffer {
-    /* Pointer to beginning of the datasegment of this buffer */
+static struct logring {
     char *data;
-    /* The current offset of the buffer */
-    size_t offset;
-} buffers[2];
+    /* The size of the ring (a power of two) */
+    uint64_t size;
+    /* The number of bytes reserved by the frontend threads */
+    uint64_t head;
+    /* The number of bytes consumed by the logger thread */
+    uint64_t tail;
+} ring;
 
-/* The index in the buffers where we're currently inserting more data */
-static int currbuffer;
+/* The buffer the logger thread writes to disk from */
+static char *iobuffer;
+
+/* What the frontend threads do when the ring is full: drop the entry (and
+ * count it), or wait for the logger thread to make room (which may stall
+ * the event loop behind a slow disk). This may be tuned by the "overflow"
+ * configuration parameter */
+static bool block_on_overflow = false;
+
+/* The number of entries dropped because the ring was full */
+static uint64_t dropped;
+
+/* The number of frontend threads waiting for room in the ring */
+static int space_waiters;
 
 /* If we should try to pretty-print the severity or not */
 static bool prettyprint = false;
@@ -79,28 +99,26 @@ static bool prettyprint = false;
 /* If we should try to write the logs compressed or not */
 static bool compress_files = false;
 
-/* The size of the buffers (this may be tuned by the buffersize configuration
- * parameter */
+/* The size of the ring (this may be tuned by the buffersize configuration
+ * parameter, and is rounded up to a power of two) */
 static size_t buffersz = 2048 * 1024;
 
 /* The sleeptime between each forced flush of the buffer */
 static size_t sleeptime = 60;
 
-/* To avoid race condition we're protecting our shared resources with a
- * single mutex. */
+/* The mutex is only used to put the logger thread to sleep and wake it up
+ * again (and the frontend threads waiting for room with overflow=block);
+ * adding an entry to the ring doesn't need it. */
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/* The thread performing the disk IO will be waiting for the input buffers
- * to be filled by sleeping on the following condition variable. The
- * frontend threads will notify the condition variable when the buffer is
- * > 75% full
+/* The thread performing the disk IO will be waiting for the ring to be
+ * filled by sleeping on the following condition variable. The frontend
+ * threads will notify the condition variable when the ring gets > 75% full
  */
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 
-/* In the "worst case scenarios" we're logging so much that the disk thread
- * can't keep up with the the frontend threads. In these rare situations
- * the frontend threads will block and wait for the flusher to free up log
- * space
+/* With overflow=block the frontend threads wait here for the logger thread
+ * to free up log space
  */
 static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
 
@@ -169,27 +187,125 @@ struct io_ops zlib_ops ={
 };
 static const char *extension = "txt";
 
+#define RING_HDR sizeof(uint32_t)
+
+static inline uint64_t ring_entry_size(size_t len) {
+    return (RING_HDR + len + 7) & ~(uint64_t)7;
+}
+
+static inline uint64_t ring_threshold(void) {
+    return ring.size / 4 * 3;
+}
+
+/* Copy to / from the ring at pos, wrapping around the end */
+static void ring_copy_in(uint64_t pos, const char *src, size_t len) {
+    size_t offset = (size_t)(pos & (ring.size - 1));
+    size_t first = ring.size - offset < len ? ring.size - offset : len;
+    memcpy(ring.data + offset, src, first);
+    memcpy(ring.data, src + first, len - first);
+}
+
+static void ring_copy_out(uint64_t pos, char *dst, size_t len) {
+    size_t offset = (size_t)(pos & (ring.size - 1));
+    size_t first = ring.size - offset < len ? ring.size - offset : len;
+    memcpy(dst, ring.data + offset, first);
+    memcpy(dst + first, ring.data, len - first);
+}
+
+static void ring_clear(uint64_t pos, size_t len) {
+    size_t offset = (size_t)(pos & (ring.size - 1));
+    size_t first = ring.size - offset < len ? ring.size - offset : len;
+    memset(ring.data + offset, 0, first);
+    memset(ring.data, 0, len - first);
+}
+
+/**
+ * Reserve room for an entry
+ * @param need the size of the entry
+ * @param pos where to store the position of the entry
+ * @param tail where to store the tail we saw
+ * @return false if the ring is full
+ */
+static bool ring_reserve(uint64_t need, uint64_t *pos, uint64_t *tail) {
+    uint64_t head = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+    do {
+        /* Pairs with the release in ring_drain (the room is zeroed) */
+        *tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+        if (head + need - *tail > ring.size) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&ring.head, &head, head + need,
+                                          true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    *pos = head;
+    return true;
+}
+
 static void add_log_entry(const char *msg, size_t size)
 {
-    pthread_mutex_lock(&mutex);
-    /* wait until there is room in the current buffer */
-    while ((buffers[currbuffer].offset + size) >= buffersz) {
+    uint64_t need = ring_entry_size(size);
+    uint64_t pos, tail;
+
+    if (!ring_reserve(need, &pos, &tail)) {
+        if (!block_on_overflow) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        pthread_mutex_lock(&mutex);
         fprintf(stderr, "WARNING: waiting for log space to be available\n");
-        pthread_cond_wait(&space_cond, &mutex);
+        ++space_waiters;
+        pthread_cond_signal(&cond);
+        while (!ring_reserve(need, &pos, &tail)) {
+            pthread_cond_wait(&space_cond, &mutex);
+        }
+        --space_waiters;
+        pthread_mutex_unlock(&mutex);
     }
 
-    /* We could have performed the memcpy outside the locked region,
-     * but then we would need to handle the situation where we're
-     * flipping the ownership of the buffer (otherwise we could be
-     * writing rubbish to the file) */
-    memcpy(buffers[currbuffer].data + buffers[currbuffer].offset,
-           msg, size);
-    buffers[currbuffer].offset += size;
-    if (buffers[currbuffer].offset > (buffersz * 0.75)) {
+    ring_copy_in(pos + RING_HDR, msg, size);
+    __atomic_store_n((uint32_t *)(ring.data + (pos & (ring.size - 1))),
+                     (uint32_t)size, __ATOMIC_RELEASE);
+
+    uint64_t threshold = ring_threshold();
+    if (pos - tail < threshold && pos + need - tail >= threshold) {
         /* we're getting full.. time get the logger to start doing stuff! */
+        pthread_mutex_lock(&mutex);
         pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
     }
-    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Move the published entries from the ring into iobuffer (called by the
+ * logger thread)
+ * @return the number of bytes put in iobuffer
+ */
+static size_t ring_drain(void) {
+    uint64_t tail = ring.tail;
+    uint64_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+    size_t nbytes = 0;
+
+    while (tail < head) {
+        uint32_t *hdr = (uint32_t *)(ring.data + (tail & (ring.size - 1)));
+        uint32_t len = __atomic_load_n(hdr, __ATOMIC_ACQUIRE);
+        if (len == 0) {
+            /* Reserved, but the message isn't there yet */
+            break;
+        }
+        uint64_t need = ring_entry_size(len);
+        ring_copy_out(tail + RING_HDR, iobuffer + nbytes, len);
+        nbytes += len;
+        ring_clear(tail, (size_t)need);
+        tail += need;
+    }
+
+    __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+    return nbytes;
+}
+
+static inline uint64_t ring_used(void) {
+    return __atomic_load_n(&ring.head, __ATOMIC_RELAXED) - ring.tail;
 }
 
 static const char *severity2string(EXTENSION_LOG_LEVEL sev) {
@@ -207,6 +323,50 @@ static const char *severity2string(EXTENSION_LOG_LEVEL sev) {
     }
 }
 
+/* Format the timestamp and severity every log entry starts with */
+static int format_prefix(char *buffer, size_t avail,
+                         EXTENSION_LOG_LEVEL severity)
+{
+    int prefixlen = 0;
+
+    struct timeval now;
+    if (gettimeofday(&now, NULL) == 0) {
+        struct tm tval;
+        time_t nsec = (time_t)now.tv_sec;
+        localtime_r(&nsec, &tval);
+        char str[40];
+        if (asctime_r(&tval, str) == NULL) {
+            prefixlen = snprintf(buffer, avail, "%u.%06u",
+                                 (unsigned int)now.tv_sec,
+                                 (unsigned int)now.tv_usec);
+        } else {
+            const char *tz;
+#ifdef HAVE_TM_ZONE
+            tz = tval.tm_zone;
+#else
+            tz = tzname[tval.tm_isdst ? 1 : 0];
+#endif
+            /* trim off ' YYYY\n' */
+            str[strlen(str) - 6] = '\0';
+            prefixlen = snprintf(buffer, avail, "%s.%06u %s",
+                                 str, (unsigned int)now.tv_usec,
+                                 tz);
+        }
+    } else {
+        fprintf(stderr, "gettimeofday failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (prettyprint) {
+        prefixlen += snprintf(buffer+prefixlen, avail-prefixlen,
+                              " %s: ", severity2string(severity));
+    } else {
+        prefixlen += snprintf(buffer+prefixlen, avail-prefixlen,
+                              " %u: ", (unsigned int)severity);
+    }
+    return prefixlen;
+}
+
 static void logger_log(EXTENSION_LOG_LEVEL severity,
                        const void* client_cookie,
                        const char *fmt, ...)
@@ -220,44 +380,11 @@ static void logger_log(EXTENSION_LOG_LEVEL severity,
          */
         char buffer[2048];
         size_t avail = sizeof(buffer) - 1;
-        int prefixlen = 0;
-
-        struct timeval now;
-        if (gettimeofday(&now, NULL) == 0) {
-            struct tm tval;
-            time_t nsec = (time_t)now.tv_sec;
-            localtime_r(&nsec, &tval);
-            char str[40];
-            if (asctime_r(&tval, str) == NULL) {
-                prefixlen = snprintf(buffer, avail, "%u.%06u",
-                                     (unsigned int)now.tv_sec,
-                                     (unsigned int)now.tv_usec);
-            } else {
-                const char *tz;
-#ifdef HAVE_TM_ZONE
-                tz = tval.tm_zone;
-#else
-                tz = tzname[tval.tm_isdst ? 1 : 0];
-#endif
-                /* trim off ' YYYY\n' */
-                str[strlen(str) - 6] = '\0';
-                prefixlen = snprintf(buffer, avail, "%s.%06u %s",
-                                     str, (unsigned int)now.tv_usec,
-                                     tz);
-            }
-        } else {
-            fprintf(stderr, "gettimeofday failed: %s\n", strerror(errno));
+        int prefixlen = format_prefix(buffer, avail, severity);
+        if (prefixlen < 0) {
             return;
         }
 
-        if (prettyprint) {
-            prefixlen += snprintf(buffer+prefixlen, avail-prefixlen,
-                                  " %s: ", severity2string(severity));
-        } else {
-            prefixlen += snprintf(buffer+prefixlen, avail-prefixlen,
-                                  " %u: ", (unsigned int)severity);
-        }
-
         avail -= prefixlen;
         va_list ap;
         va_start(ap, fmt);
@@ -309,23 +436,45 @@ static HANDLE reopen_logfile(HANDLE old, const char *fnm) {
     return open_logfile(fnm);
 }
 
-static size_t flush_pending_io(HANDLE file, struct logbuffer *lb) {
-    size_t ret = 0;
-    if (lb->offset > 0) {
-        char *ptr = lb->data;
-        size_t towrite = ret = lb->offset;
-
-        while (towrite > 0) {
-            int nw = iops.write(file, ptr, towrite);
-            if (nw > 0) {
-                ptr += nw;
-                towrite -= nw;
-            }
+static size_t flush_pending_io(HANDLE file, const char *ptr, size_t nbytes) {
+    size_t towrite = nbytes;
+    while (towrite > 0) {
+        int nw = iops.write(file, ptr, towrite);
+        if (nw > 0) {
+            ptr += nw;
+            towrite -= nw;
         }
-        lb->offset = 0;
+    }
+    if (nbytes > 0) {
         iops.flush(file, Z_PARTIAL_FLUSH);
     }
+    return nbytes;
+}
 
+/* Empty the ring into the file, and note the entries we had to drop */
+static size_t flush_ring(HANDLE file, uint64_t *reported) {
+    size_t ret = 0;
+    size_t nbytes;
+    while ((nbytes = ring_drain()) > 0) {
+        if (file) {
+            ret += flush_pending_io(file, iobuffer, nbytes);
+        }
+    }
+
+    uint64_t count = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    if (count != *reported && file) {
+        char buffer[256];
+        int len = format_prefix(buffer, sizeof(buffer),
+                                EXTENSION_LOG_WARNING);
+        if (len >= 0) {
+            len += snprintf(buffer + len, sizeof(buffer) - len,
+                            "Dropped %"PRIu64" log entries (%"PRIu64
+                            " in total) because the log buffer was full\n",
+                            count - *reported, count);
+            ret += flush_pending_io(file, buffer, len);
+        }
+        *reported = count;
+    }
     return ret;
 }
 
@@ -335,52 +484,44 @@ static pthread_t tid;
 static void *logger_thead_main(void* arg)
 {
     size_t currsize = 0;
+    uint64_t reported = 0;
     HANDLE fp = open_logfile(arg);
-    unsigned int next = time(NULL);
+
+    sapi->core->place_background_thread();
 
     pthread_mutex_lock(&mutex);
     while (run) {
-        struct timeval tp;
-        gettimeofday(&tp, NULL);
+        /* Perform file IO without the lock */
+        pthread_mutex_unlock(&mutex);
+        currsize += flush_ring(fp, &reported);
+        if (currsize > cyclesz) {
+            fp = reopen_logfile(fp, arg);
+            currsize = 0;
+        }
+        pthread_mutex_lock(&mutex);
 
-        while (tp.tv_sec >= next  ||
-               buffers[currbuffer].offset > (buffersz * 0.75)) {
-            next = tp.tv_sec + 1;
-            int this  = currbuffer;
-            currbuffer = (currbuffer == 0) ? 1 : 0;
+        if (space_waiters > 0) {
             /* Let people who is blocked for space continue */
             pthread_cond_broadcast(&space_cond);
-
-            /* Perform file IO without the lock */
-            pthread_mutex_unlock(&mutex);
-
-            currsize += flush_pending_io(fp, buffers + this);
-            if (currsize > cyclesz) {
-                fp = reopen_logfile(fp, arg);
-                currsize = 0;
-            }
-            pthread_mutex_lock(&mutex);
+            continue;
+        }
+        if (ring_used() >= ring_threshold()) {
+            continue;
         }
 
+        struct timeval tp;
         gettimeofday(&tp, NULL);
-        next = tp.tv_sec + (unsigned int)sleeptime;
-        struct timespec ts = { .tv_sec = next };
+        struct timespec ts = { .tv_sec = tp.tv_sec + (time_t)sleeptime };
         pthread_cond_timedwait(&cond, &mutex, &ts);
     }
+    pthread_mutex_unlock(&mutex);
 
-    if (fp) {
-        while (buffers[currbuffer].offset) {
-            int this  = currbuffer;
-            currbuffer = (currbuffer == 0) ? 1 : 0;
-            flush_pending_io(fp, buffers + this);
-        }
-        close_logfile(fp);
-    }
+    flush_ring(fp, &reported);
+    close_logfile(fp);
 
-    pthread_mutex_unlock(&mutex);
     free(arg);
-    free(buffers[0].data);
-    free(buffers[1].data);
+    free(ring.data);
+    free(iobuffer);
     return NULL;
 }
 
@@ -426,6 +567,7 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
 
     if (config != NULL) {
         char *loglevel = NULL;
+        char *overflow = NULL;
         struct config_item items[] = {
             { .key = "filename",
               .datatype = DT_STRING,
@@ -448,6 +590,9 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
             { .key = "compress",
               .datatype = DT_BOOL,
               .value.dt_bool = &compress_files },
+            { .key = "overflow",
+              .datatype = DT_STRING,
+              .value.dt_string = &overflow },
             { .key = NULL}
         };
 
@@ -476,28 +621,47 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
             }
         }
         free(loglevel);
+
+        if (overflow != NULL) {
+            if (strcasecmp("drop", overflow) == 0) {
+                block_on_overflow = false;
+            } else if (strcasecmp("block", overflow) == 0) {
+                block_on_overflow = true;
+            } else {
+                fprintf(stderr, "Unknown overflow policy: %s. Use drop/block\n",
+                        overflow);
+                free(overflow);
+                return EXTENSION_FATAL;
+            }
+            free(overflow);
+        }
     }
 
     if (fname == NULL) {
         fname = strdup("memcached");
     }
 
-    buffers[0].data = malloc(buffersz);
-    buffers[1].data = malloc(buffersz);
+    /* Room for a couple of the biggest entries at least */
+    ring.size = 4096;
+    while (ring.size < buffersz) {
+        ring.size <<= 1;
+    }
+    ring.data = calloc(1, ring.size);
+    iobuffer = malloc(ring.size);
 
-    if (buffers[0].data == NULL || buffers[1].data == NULL || fname == NULL) {
+    if (ring.data == NULL || iobuffer == NULL || fname == NULL) {
         fprintf(stderr, "Failed to allocate memory for the logger\n");
         free(fname);
-        free(buffers[0].data);
-        free(buffers[1].data);
+        free(ring.data);
+        free(iobuffer);
         return EXTENSION_FATAL;
     }
 
     if (pthread_create(&tid, NULL, logger_thead_main, fname) < 0) {
         fprintf(stderr, "Failed to initialize the logger\n");
         free(fname);
-        free(buffers[0].data);
-        free(buffers[1].data);
+        free(ring.data);
+        free(iobuffer);
         return EXTENSION_FATAL;
     }
     atexit(exit_handler);
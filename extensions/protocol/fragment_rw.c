@@ -101,6 +101,24 @@ static ENGINE_ERROR_CODE handle_fragment_rw(EXTENSION_BINARY_PROTOCOL_DESCRIPTOR
     item *item = NULL;
     uint8_t *data = key + nkey;
 
+    if (request->request.opcode == write_command && v1->mutate_range != NULL) {
+        /* Let the engine patch the item instead of copying all of it */
+        ENGINE_ERROR_CODE r = v1->mutate_range(handle, cookie, key, nkey,
+                                               &cas, offset, data, len,
+                                               vbucket);
+        if (r == ENGINE_SUCCESS) {
+            if (!response(NULL, 0, NULL, 0, NULL, 0,
+                          PROTOCOL_BINARY_RAW_BYTES,
+                          PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                          cas, cookie)) {
+                return ENGINE_DISCONNECT;
+            }
+            return ENGINE_SUCCESS;
+        } else if (r != ENGINE_ENOTSUP) {
+            return r;
+        }
+    }
+
     ENGINE_ERROR_CODE r = v1->get(handle, cookie, &item, key, nkey, vbucket);
     if (r == ENGINE_SUCCESS) {
         item_info item_info = { .nvalue = 1 };
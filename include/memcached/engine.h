@@ -178,6 +178,65 @@ extern "C" {
         feature_info features[1];
     } engine_info;
 
+    /**
+     * One of the keys looked up by get_multi
+     */
+    typedef struct {
+        const void *key; /**< IN: the key to look up */
+        uint16_t nkey; /**< IN: the length of the key */
+        uint16_t vbucket; /**< IN: the virtual bucket id */
+        ENGINE_ERROR_CODE status; /**< OUT: the result of the lookup */
+        item *item; /**< OUT: the item (if status is ENGINE_SUCCESS) */
+    } get_multi_key;
+
+    /**
+     * One of the items allocated by allocate_multi
+     */
+    typedef struct {
+        const void *key; /**< IN: the key of the item */
+        uint16_t nkey; /**< IN: the length of the key */
+        size_t nbytes; /**< IN: the length of the value */
+        int flags; /**< IN: the flags of the item */
+        rel_time_t exptime; /**< IN: the expiration time of the item */
+        ENGINE_ERROR_CODE status; /**< OUT: the result of the allocation */
+        item *item; /**< OUT: the item (if status is ENGINE_SUCCESS) */
+    } allocate_multi_item;
+
+    /**
+     * One of the items stored by store_multi
+     */
+    typedef struct {
+        item *item; /**< IN: the item to store */
+        ENGINE_STORE_OPERATION operation; /**< IN: how to store it */
+        uint16_t vbucket; /**< IN: the virtual bucket id */
+        ENGINE_ERROR_CODE status; /**< OUT: the result of the store */
+        uint64_t cas; /**< OUT: the CAS of the item (if it was stored) */
+    } store_multi_item;
+
+    /**
+     * An engine specific command, taken apart by the core
+     */
+    typedef struct {
+        /** the whole packet (header, extras, key and value) */
+        protocol_binary_request_header *request;
+        const void *ext; /**< the extras */
+        uint8_t extlen; /**< the length of the extras */
+        const void *key; /**< the key (NULL if there isn't one) */
+        uint16_t nkey; /**< the length of the key */
+        uint32_t hash; /**< the hash of the key (server core hash, 0) */
+        const void *value; /**< the rest of the body */
+        uint32_t nvalue; /**< the length of the rest of the body */
+    } engine_command;
+
+    /**
+     * The handler for one opcode in the table filled by
+     * get_command_handlers.
+     */
+    typedef ENGINE_ERROR_CODE (*ENGINE_COMMAND_HANDLER)(ENGINE_HANDLE *handle,
+                                                        const void *cookie,
+                                                        const engine_command *cmd,
+                                                        ADD_RESPONSE response);
+
     /**
      * Definition of the first version of the engine interface
      */
@@ -530,7 +589,164 @@ extern "C" {
         size_t (*errinfo)(ENGINE_HANDLE *handle, const void* cookie,
                           char *buffer, size_t buffsz);
 
+        /**
+         * Retrieve a number of items in one call (optional).
+         *
+         * This is the same as calling get once for every key, but it
+         * allows the engine to share the cost of the lookups (locking,
+         * hashing etc) over all of the keys. The result of each lookup is
+         * stored in its status (and item) field; each item returned must
+         * be released the same way as an item returned from get. The
+         * engine may not return ENGINE_EWOULDBLOCK for the individual
+         * keys (the core will retry those through get). Set this member
+         * to NULL if you don't support it.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param keys the keys to look up
+         * @param nkeys the number of elements in keys
+         *
+         * @return ENGINE_SUCCESS if the keys were looked up
+         */
+        ENGINE_ERROR_CODE (*get_multi)(ENGINE_HANDLE* handle,
+                                       const void* cookie,
+                                       get_multi_key *keys,
+                                       int nkeys);
+
+        /**
+         * Get the lease token for a key get just missed (optional).
+         *
+         * An engine protecting its backend from a storm of misses may
+         * give the first connection missing a key a lease on it, and
+         * make the others wait (ENGINE_EWOULDBLOCK) until the key is
+         * stored. The core sends the token with the miss (as its CAS),
+         * and a store with that CAS fills the key in while the lease
+         * is valid. Set this member to NULL if you don't support it.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param key the key get returned ENGINE_KEY_ENOENT for
+         * @param nkey the length of the key
+         *
+         * @return the token, or 0 if the connection holds no lease
+         */
+        uint64_t (*get_lease)(ENGINE_HANDLE* handle,
+                              const void* cookie,
+                              const void* key,
+                              const int nkey);
+
+        /**
+         * Allocate a number of items in one call (optional).
+         *
+         * This is the same as calling allocate once for every item, but
+         * it allows the engine to share the cost of the allocations
+         * (locking etc) over all of them. The result of each allocation
+         * is stored in its status (and item) field. The engine may not
+         * return ENGINE_EWOULDBLOCK for the individual items. Set this
+         * member to NULL (together with store_multi) if you don't
+         * support it.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param items the items to allocate
+         * @param nitems the number of elements in items
+         *
+         * @return ENGINE_SUCCESS if the items were allocated
+         */
+        ENGINE_ERROR_CODE (*allocate_multi)(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            allocate_multi_item *items,
+                                            int nitems);
+
+        /**
+         * Store a number of items in one call (optional).
+         *
+         * This is the same as calling store once for every item (in the
+         * order of the array), but it allows the engine to take its
+         * locks once for a run of items. The result of each store is put
+         * in its status (and cas) field; the items still have to be
+         * released by the caller. The core only uses it for runs of
+         * quiet stores, and the engine may not return ENGINE_EWOULDBLOCK
+         * for the individual items. Set this member to NULL (together
+         * with allocate_multi) if you don't support it.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param items the items to store
+         * @param nitems the number of elements in items
+         *
+         * @return ENGINE_SUCCESS if the items were stored
+         */
+        ENGINE_ERROR_CODE (*store_multi)(ENGINE_HANDLE* handle,
+                                         const void* cookie,
+                                         store_multi_item *items,
+                                         int nitems);
+
+        /**
+         * Overwrite a range of the value of an item (optional).
+         *
+         * This is the same as getting the item, allocating a new one,
+         * copying the value over with the range replaced and storing it
+         * with the CAS of the old one, but the engine may patch the item
+         * in place when nobody else is using it. Set this member to NULL
+         * if you don't support it.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param key the key of the item
+         * @param nkey the length of the key
+         * @param cas the CAS the item must have (0 for any); set to the
+         *            CAS of the item once it's updated
+         * @param offset where the range starts in the value
+         * @param data the new content of the range
+         * @param len the length of the range
+         * @param vbucket the vbucket of the item
+         *
+         * @return ENGINE_SUCCESS if the item was updated, ENGINE_ERANGE
+         *         if the range isn't in the value, ENGINE_ENOTSUP if the
+         *         caller should fall back to the store for this item
+         */
+        ENGINE_ERROR_CODE (*mutate_range)(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          const void* key,
+                                          const int nkey,
+                                          uint64_t *cas,
+                                          uint64_t offset,
+                                          const void* data,
+                                          uint64_t len,
+                                          uint16_t vbucket);
+
+        /**
+         * Get the handlers for the engine specific commands (optional).
+         *
+         * The core calls this once after initialize, and sends the
+         * commands the engine put a handler in the table for straight to
+         * it, with the key taken out of the packet and hashed. The other
+         * opcodes (and every opcode if this member is NULL) still go to
+         * unknown_command.
+         *
+         * @param handle the engine handle
+         * @param handlers the table to fill in, indexed by opcode (all
+         *                 NULL on entry)
+         */
+        void (*get_command_handlers)(ENGINE_HANDLE* handle,
+                                     ENGINE_COMMAND_HANDLER handlers[0x100]);
 
+        /**
+         * Get the layout of the items of the engine (optional).
+         *
+         * The core calls this once after initialize, and reads the
+         * metadata, the key and the value of the items the engine gives
+         * it through the layout instead of calling get_item_info (unless
+         * the item has one of the iflag_indirect bits set). The layout
+         * must stay valid as long as the engine is running. Set this
+         * member to NULL (or return NULL) if the items don't have a fixed
+         * layout.
+         *
+         * @param handle the engine handle
+         * @return the layout of the items, or NULL
+         */
+        const item_layout *(*get_item_layout)(ENGINE_HANDLE* handle);
 
     } ENGINE_HANDLE_V1;
 
@@ -170,7 +170,17 @@ extern "C"
         /* Scrub the data */
         PROTOCOL_BINARY_CMD_SCRUB = 0xf0,
         /* Refresh the ISASL data */
-        PROTOCOL_BINARY_CMD_ISASL_REFRESH = 0xf1
+        PROTOCOL_BINARY_CMD_ISASL_REFRESH = 0xf1,
+        /* Move a slab page from one slab class to another */
+        PROTOCOL_BINARY_CMD_SLABS_REASSIGN = 0xf2,
+        /* Push the changes of a stats group at a fixed interval */
+        PROTOCOL_BINARY_CMD_STATS_SUBSCRIBE = 0xf3,
+        /* Write a snapshot of the data in the background */
+        PROTOCOL_BINARY_CMD_SNAPSHOT = 0xf4,
+        /* Drop all of the keys of a namespace (bump its generation) */
+        PROTOCOL_BINARY_CMD_NS_BUMP = 0xf5,
+        /* Change the number of worker threads serving the connections */
+        PROTOCOL_BINARY_CMD_THREADS = 0xf6
     } protocol_binary_command;
 
     /**
@@ -459,6 +469,85 @@ extern "C"
      */
     typedef protocol_binary_response_no_extras protocol_binary_response_touch;
 
+    /**
+     * Definition of the packet used by the slabs reassign command. The
+     * extras contain the source and the destination slab class.
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint32_t src;
+                uint32_t dst;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 8];
+    } protocol_binary_request_slabs_reassign;
+
+    /**
+     * Definition of the packet returned from the slabs reassign command
+     */
+    typedef protocol_binary_response_no_extras protocol_binary_response_slabs_reassign;
+
+    /**
+     * Definition of the packet used by the stats subscribe command. The key
+     * names the stats group (like the key of STAT does), and the extras
+     * contain the number of milliseconds between two pushes. An interval of
+     * 0 cancels the subscription of the connection.
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint32_t interval;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 4];
+    } protocol_binary_request_stats_subscribe;
+
+    /**
+     * The response to the stats subscribe command is the first push, and
+     * the server sends another one (with the opaque of the request) every
+     * interval. The body of a push lists the stats that changed since the
+     * previous push, as entries made of a uint16_t id and a uint8_t type
+     * followed by:
+     *
+     *   DEFINE: uint16_t nname, uint16_t nvalue, the name and the value.
+     *           The first time a stat is pushed; it assigns the id (again,
+     *           if the server starts over).
+     *   DELTA:  uint64_t delta. The value is a number, and the new one is
+     *           the previous one plus delta (modulo 2^64).
+     *   VALUE:  uint16_t nvalue and the new value.
+     *
+     * All of the numbers are in network byte order.
+     */
+    typedef enum {
+        PROTOCOL_BINARY_STATS_DEFINE = 0x00,
+        PROTOCOL_BINARY_STATS_DELTA = 0x01,
+        PROTOCOL_BINARY_STATS_VALUE = 0x02
+    } protocol_binary_stats_entry_type;
+
+    typedef protocol_binary_response_no_extras protocol_binary_response_stats_subscribe;
+
+    /**
+     * Definition of the packet used by the threads command. The extras
+     * contain the number of worker threads the new connections go to (at
+     * most the -t of the server); the connections of the others move to
+     * them at their next request. 0 goes back to all of the threads (and
+     * to scaling them on their load if the server was started that way).
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint32_t threads;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 4];
+    } protocol_binary_request_threads;
+
+    typedef protocol_binary_response_no_extras protocol_binary_response_threads;
+
     /**
      * Definition of the packet used by the GAT(Q) command.
      */
@@ -605,6 +694,23 @@ extern "C"
                  */
 #define TAP_CONNECT_TAP_FIX_FLAG_BYTEORDER 0x100
 
+                /**
+                 * The consumer wants the producer to limit what it may
+                 * send before it's acked. The last 8 bytes of the body
+                 * are two 32 bit words in network byte order: the maximum
+                 * number of messages and of bytes waiting for an ack (0
+                 * for the server's limit). The consumer must ack every
+                 * message with the TAP_FLAG_ACK flag, in order.
+                 */
+#define TAP_CONNECT_FLOW_CONTROL 0x200
+
+                /**
+                 * The consumer wants the values of the mutations to be
+                 * compressed. The producer may then send them with the
+                 * TAP_FLAG_COMPRESSED flag.
+                 */
+#define TAP_CONNECT_COMPRESSION 0x400
+
             } body;
         } message;
         uint8_t bytes[sizeof(protocol_binary_request_header) + 4];
@@ -633,6 +739,12 @@ extern "C"
                      * The flags are in network byte order
                      */
 #define TAP_FLAG_NETWORK_BYTE_ORDER 0x04
+                    /**
+                     * The value is compressed: a 32 bit word in network
+                     * byte order with the size of the value, followed by
+                     * the value as a zlib stream
+                     */
+#define TAP_FLAG_COMPRESSED 0x08
 
                     uint16_t flags;
                     uint8_t  ttl;
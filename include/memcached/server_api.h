@@ -16,6 +16,13 @@ extern "C" {
          */
         rel_time_t (*get_current_time)(void);
 
+        /**
+         * The current time in milliseconds since the server started
+         * (get_current_time() is this divided by 1000, give or take the
+         * clock tick of the server).
+         */
+        uint64_t (*get_current_time_msec)(void);
+
         /**
          * Get the relative time for the given time_t value.
          */
@@ -59,6 +66,14 @@ extern "C" {
          */
         bool (*get_config)(struct config_item items[]);
 
+        /**
+         * Move the calling thread (a background thread of the engine or
+         * the extension) to where the server keeps its own background
+         * threads: the CPUs it was told to use that don't run a worker
+         * thread. Nothing changes if the threads aren't pinned.
+         */
+        void (*place_background_thread)(void);
+
     } SERVER_CORE_API;
 
     typedef struct {
@@ -80,6 +95,37 @@ extern "C" {
     /**
      * Commands to operate on a specific cookie.
      */
+    /**
+     * A timer of a connection (see SERVER_COOKIE_API add_timer())
+     */
+    typedef struct server_timer server_timer_t;
+
+    /**
+     * Called when a timer fires, on the thread serving the connection
+     * @param cookie the cookie the timer was added for
+     * @param cb_data the data given to add_timer()
+     */
+    typedef void (*TIMER_CALLBACK)(const void *cookie, void *cb_data);
+
+    /**
+     * The task pools of the server (see SERVER_COOKIE_API submit_task())
+     */
+    typedef enum {
+        /** For tasks that block on a disk or on the network */
+        TASK_POOL_IO,
+        /** For tasks that keep a CPU busy (compression, rebuilding an index) */
+        TASK_POOL_CPU,
+        TASK_POOL_COUNT
+    } task_pool_t;
+
+    /**
+     * A task run by a thread of a task pool
+     * @param cookie the cookie the task was submitted for
+     * @param arg the argument given to submit_task()
+     * @return the status the connection is notified with
+     */
+    typedef ENGINE_ERROR_CODE (*TASK_FUNC)(const void *cookie, void *arg);
+
     typedef struct {
         /**
          * Retrieve socket file descriptor of the session for the given cookie.
@@ -145,6 +191,54 @@ extern "C" {
          */
         ENGINE_ERROR_CODE (*release)(const void *cookie);
 
+        /**
+         * Schedule a callback on the thread serving the connection, for
+         * lease timeouts, retrying an operation that returned
+         * ENGINE_EWOULDBLOCK later on and the like. The timers of a
+         * thread are kept in a timer wheel, so they're cheap to add and
+         * cancel, and fire to the millisecond (give or take how busy the
+         * thread is). The connection isn't released (or moved to another
+         * thread) while it has timers.
+         *
+         * This and cancel_timer() must be called on the thread serving
+         * the connection: from a call into the engine for the cookie or
+         * from a timer callback.
+         *
+         * @param cookie cookie representing the connection
+         * @param msec milliseconds from now (0 for as soon as possible)
+         * @param cb the callback
+         * @param cb_data passed to the callback
+         * @return the timer (freed by the server once it fires or is
+         *         cancelled), or NULL if we can't add one
+         */
+        server_timer_t *(*add_timer)(const void *cookie, uint32_t msec,
+                                     TIMER_CALLBACK cb, void *cb_data);
+
+        /**
+         * Cancel a timer that hasn't fired yet
+         * @param timer the timer returned by add_timer()
+         */
+        void (*cancel_timer)(server_timer_t *timer);
+
+        /**
+         * Run a task that would block the worker thread on a thread of
+         * one of the server's task pools, and notify_io_complete() the
+         * connection with what it returns. The pools have a fixed number
+         * of threads (and a bound on the tasks queued), so an engine
+         * doesn't have to run threads of its own for this.
+         *
+         * @param cookie cookie representing the connection
+         * @param pool the pool to run the task on
+         * @param fn the task
+         * @param arg passed to the task
+         * @return ENGINE_EWOULDBLOCK if the task is queued (return it to
+         *         the core), ENGINE_TMPFAIL if the pool is full,
+         *         ENGINE_ENOTSUP if the pool has no threads or
+         *         ENGINE_ENOMEM
+         */
+        ENGINE_ERROR_CODE (*submit_task)(const void *cookie, task_pool_t pool,
+                                         TASK_FUNC fn, void *arg);
+
 
     } SERVER_COOKIE_API;
 
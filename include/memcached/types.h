@@ -80,6 +80,28 @@ extern "C" {
         struct iovec value[1];
     } item_info;
 
+    /**
+     * Where an engine keeping its items in one piece of memory stores the
+     * fields of item_info, so the core may read them straight out of the
+     * item instead of calling get_item_info (see get_item_layout). The
+     * offsets are counted from the start of the item. The cas (if the
+     * item has one) is a uint64_t at header, and the key follows it (or
+     * starts at header), with the value right after the key.
+     */
+    typedef struct {
+        uint16_t header;   /**< Where the cas or the key starts */
+        uint16_t exptime;  /**< rel_time_t */
+        uint16_t nbytes;   /**< uint32_t */
+        uint16_t flags;    /**< uint32_t (in network byte order) */
+        uint16_t nkey;     /**< uint16_t */
+        uint16_t iflag;    /**< uint16_t: the engine's flags of the item */
+        uint16_t clsid;    /**< uint8_t */
+        uint16_t iflag_cas; /**< The bits of iflag telling the item has a cas */
+        /** The bits of iflag telling the key or the value isn't laid out
+         * as above: the core calls get_item_info for those items */
+        uint16_t iflag_indirect;
+    } item_layout;
+
     typedef struct {
         const char *username;
         const char *config;
@@ -0,0 +1,367 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Drive an engine directly (without the network layer) from a number of
+ * threads, so that the locking and allocation of the engine can be
+ * measured on their own (see engine_bench.h).
+ */
+#include "config.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <memcached/config_parser.h>
+#include <mock_server.h>
+#include "engine_bench.h"
+#include "timings.h"
+
+/* The engine calls we time (the slots in struct thread_timings) */
+enum bench_call {
+    CALL_ALLOCATE,
+    CALL_STORE,
+    CALL_GET,
+    CALL_RELEASE,
+    CALL_REMOVE,
+    CALL_ARITHMETIC,
+    CALL_COUNT
+};
+
+static const char * const call_names[CALL_COUNT] = {
+    "allocate", "store", "get", "release", "remove", "arithmetic"
+};
+
+enum bench_op {
+    OP_GET,
+    OP_SET,
+    OP_ADD,
+    OP_DELETE,
+    OP_INCR,
+    OP_COUNT
+};
+
+struct bench_config {
+    size_t threads;
+    size_t keys;
+    size_t value_size;
+    size_t value_max;
+    size_t weight[OP_COUNT];
+    size_t ops;
+    size_t duration;
+    bool preload;
+};
+
+struct bench_thread {
+    pthread_t tid;
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *h1;
+    const struct bench_config *config;
+    const void *cookie;
+    uint64_t rnd;
+    struct thread_timings timings;
+    uint64_t ops;
+    uint64_t misses;
+    uint64_t failures;
+};
+
+static volatile bool bench_stop;
+
+/* xorshift64* */
+static uint64_t bench_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static size_t bench_key(char *buf, size_t bufsz, uint64_t key) {
+    return snprintf(buf, bufsz, "engine_bench_%llu", (unsigned long long)key);
+}
+
+/* Time one engine call */
+#define BENCH_CALL(t, call, expr) do {                                  \
+        uint64_t start__ = timings_now();                               \
+        ret = (expr);                                                   \
+        timings_record(&(t)->timings, (call), timings_now() - start__, 0); \
+    } while (0)
+
+static ENGINE_ERROR_CODE bench_store(struct bench_thread *t, const char *key,
+                                     size_t nkey, ENGINE_STORE_OPERATION op) {
+    const struct bench_config *config = t->config;
+    size_t nbytes = config->value_size;
+    if (config->value_max > config->value_size) {
+        nbytes += bench_random(&t->rnd) %
+                  (config->value_max - config->value_size + 1);
+    }
+
+    item *it = NULL;
+    ENGINE_ERROR_CODE ret;
+    BENCH_CALL(t, CALL_ALLOCATE,
+               t->h1->allocate(t->h, t->cookie, &it, key, nkey, nbytes, 0, 0));
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+
+    item_info info = { .nvalue = 1 };
+    if (t->h1->get_item_info(t->h, t->cookie, it, &info) && info.nvalue == 1) {
+        memset(info.value[0].iov_base, 'x', info.value[0].iov_len);
+    }
+
+    uint64_t cas = 0;
+    BENCH_CALL(t, CALL_STORE,
+               t->h1->store(t->h, t->cookie, it, &cas, op, 0));
+    ENGINE_ERROR_CODE stored = ret;
+    uint64_t start = timings_now();
+    t->h1->release(t->h, t->cookie, it);
+    timings_record(&t->timings, CALL_RELEASE, timings_now() - start, 0);
+    return stored;
+}
+
+static void bench_op(struct bench_thread *t, enum bench_op op) {
+    char key[64];
+    size_t nkey = bench_key(key, sizeof(key),
+                            bench_random(&t->rnd) % t->config->keys);
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    switch (op) {
+    case OP_GET: {
+        item *it = NULL;
+        BENCH_CALL(t, CALL_GET,
+                   t->h1->get(t->h, t->cookie, &it, key, (int)nkey, 0));
+        if (ret == ENGINE_SUCCESS) {
+            uint64_t start = timings_now();
+            t->h1->release(t->h, t->cookie, it);
+            timings_record(&t->timings, CALL_RELEASE,
+                           timings_now() - start, 0);
+        } else if (ret == ENGINE_KEY_ENOENT) {
+            ++t->misses;
+            ret = ENGINE_SUCCESS;
+        }
+        break;
+    }
+    case OP_SET:
+        ret = bench_store(t, key, nkey, OPERATION_SET);
+        break;
+    case OP_ADD:
+        if ((ret = bench_store(t, key, nkey, OPERATION_ADD)) == ENGINE_NOT_STORED) {
+            ++t->misses;
+            ret = ENGINE_SUCCESS;
+        }
+        break;
+    case OP_DELETE: {
+        uint64_t cas = 0;
+        BENCH_CALL(t, CALL_REMOVE,
+                   t->h1->remove(t->h, t->cookie, key, nkey, &cas, 0));
+        if (ret == ENGINE_KEY_ENOENT) {
+            ++t->misses;
+            ret = ENGINE_SUCCESS;
+        }
+        break;
+    }
+    case OP_INCR: {
+        uint64_t cas, result;
+        BENCH_CALL(t, CALL_ARITHMETIC,
+                   t->h1->arithmetic(t->h, t->cookie, key, (int)nkey, true,
+                                     true, 1, 0, 0, &cas, &result, 0));
+        if (ret == ENGINE_EINVAL) {
+            /* The key holds a value which isn't a number */
+            ++t->misses;
+            ret = ENGINE_SUCCESS;
+        }
+        break;
+    }
+    default:
+        abort();
+    }
+
+    if (ret != ENGINE_SUCCESS) {
+        ++t->failures;
+    }
+}
+
+static void *bench_thread_main(void *arg) {
+    struct bench_thread *t = arg;
+    const struct bench_config *config = t->config;
+    size_t total = 0;
+    for (int ii = 0; ii < OP_COUNT; ++ii) {
+        total += config->weight[ii];
+    }
+
+    while (!bench_stop && (config->duration != 0 || t->ops < config->ops)) {
+        size_t pick = bench_random(&t->rnd) % total;
+        int op = 0;
+        while (pick >= config->weight[op]) {
+            pick -= config->weight[op];
+            ++op;
+        }
+        bench_op(t, op);
+        ++t->ops;
+    }
+    return NULL;
+}
+
+/*
+ * A client of the engine. Engines like bucket_engine set up their state
+ * for a connection when it's announced, so we do that like the core.
+ */
+static const void *bench_cookie_create(void) {
+    const void *cookie = create_mock_cookie();
+    get_mock_server_api()->callback->perform_callbacks(ON_CONNECT, NULL,
+                                                       cookie);
+    return cookie;
+}
+
+static void bench_cookie_destroy(const void *cookie) {
+    get_mock_server_api()->callback->perform_callbacks(ON_DISCONNECT, NULL,
+                                                       cookie);
+    destroy_mock_cookie(cookie);
+}
+
+static bool bench_preload(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                          const struct bench_config *config) {
+    struct bench_thread t = {
+        .h = h, .h1 = h1, .config = config, .cookie = bench_cookie_create(),
+        .rnd = 1
+    };
+    bool ret = true;
+    for (size_t ii = 0; ii < config->keys && ret; ++ii) {
+        char key[64];
+        size_t nkey = bench_key(key, sizeof(key), ii);
+        if (bench_store(&t, key, nkey, OPERATION_SET) != ENGINE_SUCCESS) {
+            fprintf(stderr, "Failed to preload key %zu\n", ii);
+            ret = false;
+        }
+    }
+    timings_destroy(&t.timings);
+    bench_cookie_destroy(t.cookie);
+    return ret;
+}
+
+int run_engine_benchmark(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                         const char *spec) {
+    struct bench_config config = {
+        .threads = 4,
+        .keys = 100000,
+        .value_size = 100,
+        .weight = { [OP_GET] = 90, [OP_SET] = 10 },
+        .ops = 1000000,
+        .preload = true
+    };
+    struct config_item items[] = {
+        { .key = "threads", .datatype = DT_SIZE,
+          .value.dt_size = &config.threads },
+        { .key = "keys", .datatype = DT_SIZE, .value.dt_size = &config.keys },
+        { .key = "value_size", .datatype = DT_SIZE,
+          .value.dt_size = &config.value_size },
+        { .key = "value_max", .datatype = DT_SIZE,
+          .value.dt_size = &config.value_max },
+        { .key = "get", .datatype = DT_SIZE,
+          .value.dt_size = &config.weight[OP_GET] },
+        { .key = "set", .datatype = DT_SIZE,
+          .value.dt_size = &config.weight[OP_SET] },
+        { .key = "add", .datatype = DT_SIZE,
+          .value.dt_size = &config.weight[OP_ADD] },
+        { .key = "delete", .datatype = DT_SIZE,
+          .value.dt_size = &config.weight[OP_DELETE] },
+        { .key = "incr", .datatype = DT_SIZE,
+          .value.dt_size = &config.weight[OP_INCR] },
+        { .key = "ops", .datatype = DT_SIZE, .value.dt_size = &config.ops },
+        { .key = "duration", .datatype = DT_SIZE,
+          .value.dt_size = &config.duration },
+        { .key = "preload", .datatype = DT_BOOL,
+          .value.dt_bool = &config.preload },
+        { .key = NULL }
+    };
+
+    if (spec != NULL && parse_config(spec, items, stderr) != 0) {
+        fprintf(stderr, "Invalid benchmark \"%s\"\n", spec);
+        return 1;
+    }
+    if (config.value_max < config.value_size) {
+        config.value_max = config.value_size;
+    }
+    size_t total = 0;
+    for (int ii = 0; ii < OP_COUNT; ++ii) {
+        total += config.weight[ii];
+    }
+    if (config.threads == 0 || config.keys == 0 || total == 0) {
+        fprintf(stderr, "The benchmark needs threads, keys and operations\n");
+        return 1;
+    }
+
+    if (config.preload && !bench_preload(h, h1, &config)) {
+        return 1;
+    }
+
+    struct bench_thread *threads = calloc(config.threads, sizeof(*threads));
+    if (threads == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+    bench_stop = false;
+    uint64_t start = timings_now();
+    for (size_t ii = 0; ii < config.threads; ++ii) {
+        threads[ii].h = h;
+        threads[ii].h1 = h1;
+        threads[ii].config = &config;
+        threads[ii].cookie = bench_cookie_create();
+        threads[ii].rnd = start * 31 + ii + 1;
+        if (pthread_create(&threads[ii].tid, NULL, bench_thread_main,
+                           &threads[ii]) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            abort();
+        }
+    }
+    if (config.duration != 0) {
+        sleep((unsigned int)config.duration);
+        bench_stop = true;
+    }
+
+    struct timing_histogram calls[CALL_COUNT];
+    uint64_t ops = 0, misses = 0, failures = 0;
+    memset(calls, 0, sizeof(calls));
+    for (size_t ii = 0; ii < config.threads; ++ii) {
+        pthread_join(threads[ii].tid, NULL);
+    }
+    double seconds = (timings_now() - start) / 1e9;
+    for (size_t ii = 0; ii < config.threads; ++ii) {
+        for (int call = 0; call < CALL_COUNT; ++call) {
+            timings_aggregate(&threads[ii].timings, call, &calls[call]);
+        }
+        ops += threads[ii].ops;
+        misses += threads[ii].misses;
+        failures += threads[ii].failures;
+        timings_destroy(&threads[ii].timings);
+        bench_cookie_destroy(threads[ii].cookie);
+    }
+    free(threads);
+
+    printf("%zu threads, %zu keys, values %zu-%zu bytes, "
+           "get=%zu;set=%zu;add=%zu;delete=%zu;incr=%zu\n",
+           config.threads, config.keys, config.value_size, config.value_max,
+           config.weight[OP_GET], config.weight[OP_SET], config.weight[OP_ADD],
+           config.weight[OP_DELETE], config.weight[OP_INCR]);
+    printf("%.2f s, %llu ops, %.0f ops/s, %llu misses, %llu failures\n",
+           seconds, (unsigned long long)ops, ops / seconds,
+           (unsigned long long)misses, (unsigned long long)failures);
+    printf("%-10s %12s %12s %10s %10s %10s %10s\n", "call", "count",
+           "calls/s", "p50 ns", "p99 ns", "p999 ns", "max ns");
+    for (int call = 0; call < CALL_COUNT; ++call) {
+        uint64_t count = 0;
+        for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+            count += calls[call].server[ii];
+        }
+        if (count == 0) {
+            continue;
+        }
+        printf("%-10s %12llu %12.0f %10llu %10llu %10llu %10llu\n",
+               call_names[call], (unsigned long long)count, count / seconds,
+               (unsigned long long)timings_percentile(calls[call].server, 0.5),
+               (unsigned long long)timings_percentile(calls[call].server, 0.99),
+               (unsigned long long)timings_percentile(calls[call].server, 0.999),
+               (unsigned long long)timings_percentile(calls[call].server, 1.0));
+    }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,31 @@
+#ifndef ENGINE_BENCH_H
+#define ENGINE_BENCH_H
+
+#include <memcached/engine.h>
+
+/**
+ * Run a workload against an engine from a number of threads, and print the
+ * throughput and the latency percentiles of every engine call it made.
+ * The workload is described like an engine configuration:
+ *
+ *   threads=N         the number of threads (4)
+ *   keys=N            the number of distinct keys (100000)
+ *   value_size=N      the smallest value (100)
+ *   value_max=N       the biggest value (value_size)
+ *   get=N;set=N;add=N;delete=N;incr=N
+ *                     the weights of the operations (get=90;set=10). A get
+ *                     is a get and a release, a set / add an allocate, a
+ *                     store and a release, an incr an arithmetic call.
+ *   ops=N             the number of operations of every thread (1000000)
+ *   duration=N        run for N seconds instead
+ *   preload=BOOL      store all of the keys first (true)
+ *
+ * @param h the engine (as the mock server sees it)
+ * @param h1 the engine's v1 interface
+ * @param spec the workload
+ * @return 0 on success, 1 if the workload is invalid or the engine failed
+ */
+int run_engine_benchmark(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                         const char *spec);
+
+#endif
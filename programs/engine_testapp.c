@@ -14,11 +14,14 @@
 #include <memcached/engine_testapp.h>
 #include <memcached/extension_loggers.h>
 #include <mock_server.h>
+#include "engine_bench.h"
 
 struct mock_engine {
     ENGINE_HANDLE_V1 me;
     ENGINE_HANDLE_V1 *the_engine;
     TAP_ITERATOR iterator;
+    /* The engine's own command handlers (we hand out mock_command) */
+    ENGINE_COMMAND_HANDLER commands[0x100];
 };
 
 static bool color_enabled;
@@ -344,6 +347,57 @@ static ENGINE_ERROR_CODE mock_unknown_command(ENGINE_HANDLE* handle,
     return ret;
 }
 
+static ENGINE_ERROR_CODE mock_command(ENGINE_HANDLE* handle,
+                                      const void* cookie,
+                                      const engine_command *cmd,
+                                      ADD_RESPONSE response)
+{
+    struct mock_engine *me = get_handle(handle);
+    struct mock_connstruct *c = (void*)cookie;
+    if (c == NULL) {
+        c = (void*)create_mock_cookie();
+    }
+
+    ENGINE_COMMAND_HANDLER handler = me->commands[cmd->request->request.opcode];
+    c->nblocks = 0;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    pthread_mutex_lock(&c->mutex);
+    while (ret == ENGINE_SUCCESS &&
+           (ret = handler((ENGINE_HANDLE*)me->the_engine, c, cmd,
+                          response)) == ENGINE_EWOULDBLOCK &&
+           c->handle_ewouldblock)
+    {
+        ++c->nblocks;
+        pthread_cond_wait(&c->cond, &c->mutex);
+        ret = c->status;
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    if (c != cookie) {
+        destroy_mock_cookie(c);
+    }
+
+    return ret;
+}
+
+static void mock_get_command_handlers(ENGINE_HANDLE* handle,
+                                      ENGINE_COMMAND_HANDLER handlers[0x100])
+{
+    struct mock_engine *me = get_handle(handle);
+    memset(me->commands, 0, sizeof(me->commands));
+    me->the_engine->get_command_handlers((ENGINE_HANDLE*)me->the_engine,
+                                         me->commands);
+    for (int ii = 0; ii < 0x100; ++ii) {
+        handlers[ii] = me->commands[ii] != NULL ? mock_command : NULL;
+    }
+}
+
+static const item_layout *mock_get_item_layout(ENGINE_HANDLE* handle)
+{
+    struct mock_engine *me = get_handle(handle);
+    return me->the_engine->get_item_layout((ENGINE_HANDLE*)me->the_engine);
+}
+
 static void mock_item_set_cas(ENGINE_HANDLE *handle, const void *cookie,
                               item* item, uint64_t val)
 {
@@ -462,6 +516,100 @@ static size_t mock_errinfo(ENGINE_HANDLE *handle, const void* cookie,
                                    buffer, buffsz);
 }
 
+static ENGINE_ERROR_CODE mock_get_multi(ENGINE_HANDLE* handle,
+                                        const void* cookie,
+                                        get_multi_key *keys,
+                                        int nkeys) {
+    struct mock_engine *me = get_handle(handle);
+    struct mock_connstruct *c = (void*)cookie;
+    if (c == NULL) {
+        c = (void*)create_mock_cookie();
+    }
+
+    ENGINE_ERROR_CODE ret;
+    ret = me->the_engine->get_multi((ENGINE_HANDLE*)me->the_engine, c,
+                                    keys, nkeys);
+
+    if (c != cookie) {
+        destroy_mock_cookie(c);
+    }
+    return ret;
+}
+
+static uint64_t mock_get_lease(ENGINE_HANDLE* handle,
+                               const void* cookie,
+                               const void* key,
+                               const int nkey) {
+    struct mock_engine *me = get_handle(handle);
+    return me->the_engine->get_lease((ENGINE_HANDLE*)me->the_engine, cookie,
+                                     key, nkey);
+}
+
+static ENGINE_ERROR_CODE mock_allocate_multi(ENGINE_HANDLE* handle,
+                                             const void* cookie,
+                                             allocate_multi_item *items,
+                                             int nitems) {
+    struct mock_engine *me = get_handle(handle);
+    struct mock_connstruct *c = (void*)cookie;
+    if (c == NULL) {
+        c = (void*)create_mock_cookie();
+    }
+
+    ENGINE_ERROR_CODE ret;
+    ret = me->the_engine->allocate_multi((ENGINE_HANDLE*)me->the_engine, c,
+                                         items, nitems);
+
+    if (c != cookie) {
+        destroy_mock_cookie(c);
+    }
+    return ret;
+}
+
+static ENGINE_ERROR_CODE mock_store_multi(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          store_multi_item *items,
+                                          int nitems) {
+    struct mock_engine *me = get_handle(handle);
+    struct mock_connstruct *c = (void*)cookie;
+    if (c == NULL) {
+        c = (void*)create_mock_cookie();
+    }
+
+    ENGINE_ERROR_CODE ret;
+    ret = me->the_engine->store_multi((ENGINE_HANDLE*)me->the_engine, c,
+                                      items, nitems);
+
+    if (c != cookie) {
+        destroy_mock_cookie(c);
+    }
+    return ret;
+}
+
+static ENGINE_ERROR_CODE mock_mutate_range(ENGINE_HANDLE* handle,
+                                           const void* cookie,
+                                           const void* key,
+                                           const int nkey,
+                                           uint64_t *cas,
+                                           uint64_t offset,
+                                           const void* data,
+                                           uint64_t len,
+                                           uint16_t vbucket) {
+    struct mock_engine *me = get_handle(handle);
+    struct mock_connstruct *c = (void*)cookie;
+    if (c == NULL) {
+        c = (void*)create_mock_cookie();
+    }
+
+    ENGINE_ERROR_CODE ret;
+    ret = me->the_engine->mutate_range((ENGINE_HANDLE*)me->the_engine, c,
+                                       key, nkey, cas, offset, data, len,
+                                       vbucket);
+
+    if (c != cookie) {
+        destroy_mock_cookie(c);
+    }
+    return ret;
+}
 
 struct mock_engine default_mock_engine = {
     .me = {
@@ -487,7 +635,14 @@ struct mock_engine default_mock_engine = {
         .get_tap_iterator = mock_get_tap_iterator,
         .item_set_cas = mock_item_set_cas,
         .get_item_info = mock_get_item_info,
-        .errinfo = mock_errinfo
+        .errinfo = mock_errinfo,
+        .get_multi = mock_get_multi,
+        .get_lease = mock_get_lease,
+        .allocate_multi = mock_allocate_multi,
+        .store_multi = mock_store_multi,
+        .mutate_range = mock_mutate_range,
+        .get_command_handlers = mock_get_command_handlers,
+        .get_item_layout = mock_get_item_layout
     }
 };
 struct mock_engine mock_engine;
@@ -500,6 +655,8 @@ static void usage(void) {
     printf("\n");
     printf("engine_testapp -E <path_to_engine_lib> -T <path_to_testlib>\n");
     printf("               [-e <engine_config>] [-h]\n");
+    printf("engine_testapp -E <path_to_engine_lib> -B <workload>\n");
+    printf("               [-e <engine_config>]\n");
     printf("\n");
     printf("-E <path_to_engine_lib>      Path to the engine library file. The\n");
     printf("                             engine library file is a library file\n");
@@ -512,6 +669,13 @@ static void usage(void) {
     printf("                             .dll) that contains the set of tests\n");
     printf("                             to be executed.\n");
     printf("\n");
+    printf("-B <workload>                Benchmark the engine instead of running\n");
+    printf("                             tests. The workload is a list of\n");
+    printf("                             key=value pairs like the engine\n");
+    printf("                             config, for example\n");
+    printf("                             \"threads=8;get=80;set=20;duration=10\"\n");
+    printf("                             (see programs/engine_bench.h).\n");
+    printf("\n");
     printf("-t <timeout>                 Maximum time to run a test.\n");
     printf("-e <engine_config>           Engine configuration string passed to\n");
     printf("                             the engine.\n");
@@ -633,6 +797,27 @@ static ENGINE_HANDLE_V1 *start_your_engines(const char *engine, const char* cfg,
     if (mock_engine.the_engine->errinfo == NULL) {
         mock_engine.me.errinfo = NULL;
     }
+    if (mock_engine.the_engine->get_multi == NULL) {
+        mock_engine.me.get_multi = NULL;
+    }
+    if (mock_engine.the_engine->get_lease == NULL) {
+        mock_engine.me.get_lease = NULL;
+    }
+    if (mock_engine.the_engine->allocate_multi == NULL) {
+        mock_engine.me.allocate_multi = NULL;
+    }
+    if (mock_engine.the_engine->store_multi == NULL) {
+        mock_engine.me.store_multi = NULL;
+    }
+    if (mock_engine.the_engine->mutate_range == NULL) {
+        mock_engine.me.mutate_range = NULL;
+    }
+    if (mock_engine.the_engine->get_command_handlers == NULL) {
+        mock_engine.me.get_command_handlers = NULL;
+    }
+    if (mock_engine.the_engine->get_item_layout == NULL) {
+        mock_engine.me.get_item_layout = NULL;
+    }
 
     return &mock_engine.me;
 }
@@ -765,6 +950,7 @@ int main(int argc, char **argv) {
     const char *engine_args = NULL;
     const char *test_suite = NULL;
     const char *test_case = NULL;
+    const char *benchmark = NULL;
     engine_test_t *testcases = NULL;
     logger_descriptor = get_null_logger();
 
@@ -797,6 +983,7 @@ int main(int argc, char **argv) {
     /* process arguments */
     while (-1 != (c = getopt(argc, argv,
           "h"  /* usage */
+          "B:" /* Benchmark */
           "E:" /* Engine to load */
           "e:" /* Engine options */
           "T:" /* Library with tests to load */
@@ -809,6 +996,9 @@ int main(int argc, char **argv) {
           "Z"  /* Terminate on first error */
         ))) {
         switch (c) {
+        case 'B':
+            benchmark = optarg;
+            break;
         case 'E':
             engine = optarg;
             break;
@@ -854,6 +1044,15 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    if (benchmark != NULL) {
+        if (start_your_engines(engine, engine_args, true) == NULL) {
+            return 1;
+        }
+        exitcode = run_engine_benchmark(handle, handle_v1, benchmark);
+        destroy_engine(false);
+        return exitcode;
+    }
+
     if (test_suite == NULL) {
         fprintf(stderr, "You must provide a path to the testsuite library.\n");
         return 1;
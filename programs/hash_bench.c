@@ -0,0 +1,94 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Microbenchmark for the key hash functions the daemon may use (-H), on
+ * keys of the lengths memcached usually sees:
+ *
+ *   ./hash_bench [nkeys] [rounds]
+ *
+ * Besides the time per key it prints the longest chain we get when the
+ * keys are put in a table of nkeys buckets (like assoc does), so that a
+ * faster hash with a bad distribution stands out.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "hash.h"
+
+static const size_t key_lengths[] = { 8, 16, 24, 32, 48, 64, 128, 250 };
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void run(const char *name, hash_func func, char **keys, size_t nkey,
+                int n, int rounds) {
+    uint32_t sum = 0;
+    double start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < n; i++) {
+            sum += func(keys[i], nkey, 0);
+        }
+    }
+    double ns = (now() - start) * 1e9 / ((double)n * rounds);
+
+    /* The number of buckets assoc would use for n keys */
+    uint32_t mask = 1;
+    while (mask < (uint32_t)n) {
+        mask <<= 1;
+    }
+    mask -= 1;
+    unsigned int *chains = calloc(mask + 1, sizeof(unsigned int));
+    unsigned int longest = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned int len = ++chains[func(keys[i], nkey, 0) & mask];
+        if (len > longest) {
+            longest = len;
+        }
+    }
+    free(chains);
+
+    printf("%-8s %4zu bytes %8.1f ns/key %6.2f GB/s  longest chain %u"
+           "  (%08x)\n", name, nkey, ns, nkey / ns, longest, sum);
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    if (n < 1 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [nkeys] [rounds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char **keys = malloc(n * sizeof(char *));
+    srandom(42);
+    for (size_t ll = 0; ll < sizeof(key_lengths) / sizeof(key_lengths[0]); ++ll) {
+        size_t nkey = key_lengths[ll];
+        /* Unique keys with a common prefix, like "user:kfqz...0001e240" */
+        for (int i = 0; i < n; i++) {
+            char id[16];
+            size_t nid = snprintf(id, sizeof(id), "%08x", i);
+            keys[i] = malloc(nkey + 1);
+            for (size_t jj = 0; jj < nkey - nid; jj++) {
+                keys[i][jj] = 'a' + (random() % 26);
+            }
+            if (nkey - nid > 5) {
+                memcpy(keys[i], "user:", 5);
+            }
+            memcpy(keys[i] + nkey - nid, id, nid + 1);
+        }
+
+        run("jenkins", jenkins_hash, keys, nkey, n, rounds);
+        run("murmur3", murmur3_hash, keys, nkey, n, rounds);
+
+        for (int i = 0; i < n; i++) {
+            free(keys[i]);
+        }
+    }
+    free(keys);
+    return EXIT_SUCCESS;
+}
@@ -4,6 +4,18 @@
 // the correctness of the response it gets, because it's inteded to be used
 // with different mock engines and all we care about is if we're able to
 // run the commands or not.
+//
+// With -B it is a load generator instead: the connections are spread over
+// a number of threads which send gets and sets of keys picked from a
+// uniform or zipfian distribution, parse the responses and report the
+// throughput and the latency percentiles of every command. With a target
+// rate (-q) the requests are sent on a schedule (open loop) and their
+// latency is measured from the time they should have been sent, so that
+// a slow server can't hide behind a full pipeline.
+//
+// With -R it consumes TAP streams instead and reports how fast the
+// mutations come in, how far behind the producer they are and how long
+// the acks take to get the stream going again (see tapBench()).
 
 #include "config.h"
 
@@ -22,6 +34,15 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <cerrno>
+#include <csignal>
+#include <cmath>
+#include <ctime>
+#include <deque>
+#include <vector>
+
+extern "C" {
+#include "timings.h"
+}
 
 
 using namespace std;
@@ -406,6 +427,827 @@ Connection *createGetSetConnection(const char *host, const char *port)
 }
 
 
+/*
+ * The benchmark mode (-B)
+ */
+
+struct BenchConfig {
+    BenchConfig() :
+        threads(4), connections(16), keys(100000), zipf(0),
+        minValue(100), maxValue(100), getRatio(90), depth(1), qps(0),
+        duration(10), load(false), flowControl(false), windowMsgs(0),
+        windowBytes(0)
+    {
+    }
+
+    string host;
+    string port;
+    int threads;
+    int connections;
+    uint64_t keys;
+    /** The zipfian constant (0 picks the keys uniformly) */
+    double zipf;
+    size_t minValue;
+    size_t maxValue;
+    /** The percentage of the requests which are gets */
+    int getRatio;
+    /** The number of requests a connection may have outstanding */
+    int depth;
+    /** The target rate of all of the connections (0 is as fast as we can) */
+    uint64_t qps;
+    int duration;
+    /** Store all of the keys before we start */
+    bool load;
+    /** Ask for TAP flow control with this window (-R) */
+    bool flowControl;
+    uint32_t windowMsgs;
+    uint32_t windowBytes;
+};
+
+static volatile bool benchStop = false;
+
+/** xorshift64* (one per thread) */
+class Random {
+public:
+    Random(uint64_t seed) : state(seed != 0 ? seed : 0x9e3779b97f4a7c15ULL) {
+    }
+
+    uint64_t next(void) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ULL;
+    }
+
+    /** A double in [0, 1) */
+    double nextDouble(void) {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    uint64_t nextRange(uint64_t lo, uint64_t hi) {
+        return lo + (hi > lo ? next() % (hi - lo + 1) : 0);
+    }
+
+private:
+    uint64_t state;
+};
+
+/**
+ * Picks the key numbers. The zipfian distribution is the one from "Quickly
+ * Generating Billion-Record Synthetic Databases" (Gray et al), like YCSB
+ * uses: key 0 is the most popular, then key 1 and so on.
+ */
+class KeyChooser {
+public:
+    KeyChooser(uint64_t n, double theta) : items(n), theta(theta) {
+        if (theta > 0) {
+            double zeta2 = zeta(2, theta);
+            zetan = zeta(n, theta);
+            alpha = 1.0 / (1.0 - theta);
+            eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+        }
+    }
+
+    uint64_t next(Random &rnd) const {
+        if (theta <= 0) {
+            return rnd.next() % items;
+        }
+        double u = rnd.nextDouble();
+        double uz = u * zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + pow(0.5, theta)) {
+            return 1 % items;
+        }
+        uint64_t ret = (uint64_t)(items * pow(eta * u - eta + 1, alpha));
+        return ret < items ? ret : items - 1;
+    }
+
+private:
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t ii = 0; ii < n; ++ii) {
+            sum += 1 / pow(ii + 1.0, theta);
+        }
+        return sum;
+    }
+
+    uint64_t items;
+    double theta;
+    double zetan;
+    double alpha;
+    double eta;
+};
+
+static int connectTo(const string &host, const string &port)
+{
+    struct addrinfo *ai = NULL;
+    struct addrinfo hints;
+    int sock = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &ai) != 0) {
+        return -1;
+    }
+
+    for (struct addrinfo *e = ai; e != NULL && sock == -1; e = e->ai_next) {
+        if ((sock = socket(e->ai_family, e->ai_socktype,
+                           e->ai_protocol)) != -1 &&
+            ::connect(sock, e->ai_addr, e->ai_addrlen) == -1) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(ai);
+    return sock;
+}
+
+static size_t keyName(char *buf, size_t bufsz, uint64_t key)
+{
+    return snprintf(buf, bufsz, "mcbasher:%llu", (unsigned long long)key);
+}
+
+static void encodeRequest(vector<char> &out, uint8_t opcode, uint32_t opaque,
+                          const char *key, size_t nkey,
+                          const char *value, size_t nvalue)
+{
+    protocol_binary_request_set req;
+    uint8_t extlen = value != NULL ? 8 : 0;
+    memset(req.bytes, 0, sizeof(req.bytes));
+    req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    req.message.header.request.opcode = opcode;
+    req.message.header.request.keylen = htons((uint16_t)nkey);
+    req.message.header.request.extlen = extlen;
+    req.message.header.request.bodylen = htonl((uint32_t)(extlen + nkey + nvalue));
+    req.message.header.request.opaque = opaque;
+
+    out.insert(out.end(), req.bytes,
+               req.bytes + sizeof(req.message.header) + extlen);
+    out.insert(out.end(), key, key + nkey);
+    if (value != NULL) {
+        out.insert(out.end(), value, value + nvalue);
+    }
+}
+
+class BenchThread;
+
+class BenchConnection {
+public:
+    BenchConnection(BenchThread &t, int s, uint64_t first) :
+        thread(t), sock(s), sent(0), nextSend(first), opaque(0)
+    {
+    }
+
+    ~BenchConnection() {
+        close(sock);
+    }
+
+    /** Queue the requests which are due, and return when the next one is */
+    uint64_t issue(uint64_t now);
+    bool wantsWrite(void) const {
+        return sent < output.size();
+    }
+    bool doSend(void);
+    bool doRecv(void);
+
+    int getSocket(void) const {
+        return sock;
+    }
+
+private:
+    struct Request {
+        uint64_t start;
+        uint32_t opaque;
+        uint8_t opcode;
+    };
+
+    BenchThread &thread;
+    int sock;
+    vector<char> output;
+    size_t sent;
+    vector<char> input;
+    deque<Request> pending;
+    uint64_t nextSend;
+    uint32_t opaque;
+};
+
+class BenchThread {
+public:
+    BenchThread(const BenchConfig &c, const KeyChooser &k,
+                const char *v, uint64_t seed) :
+        config(c), keys(k), value(v), rnd(seed), gets(0), hits(0),
+        misses(0), sets(0), errors(0)
+    {
+        memset(&timings, 0, sizeof(timings));
+        interval = config.qps == 0 ? 0 :
+            (uint64_t)(1e9 * config.connections / config.qps);
+    }
+
+    ~BenchThread() {
+        for (size_t ii = 0; ii < conns.size(); ++ii) {
+            delete conns[ii];
+        }
+        timings_destroy(&timings);
+    }
+
+    void add(int sock, uint64_t first) {
+        conns.push_back(new BenchConnection(*this, sock, first));
+    }
+
+    void main(void) {
+        vector<struct pollfd> fds(conns.size());
+        while (!benchStop) {
+            uint64_t now = timings_now();
+            uint64_t wakeup = now + 100000000ULL;
+            for (size_t ii = 0; ii < conns.size(); ++ii) {
+                uint64_t next = conns[ii]->issue(now);
+                if (next < wakeup) {
+                    wakeup = next;
+                }
+                fds[ii].fd = conns[ii]->getSocket();
+                fds[ii].events = POLLIN;
+                if (conns[ii]->wantsWrite()) {
+                    fds[ii].events |= POLLOUT;
+                }
+                fds[ii].revents = 0;
+            }
+
+            int timeout = wakeup > now ? (int)((wakeup - now) / 1000000) : 0;
+            if (poll(&fds[0], fds.size(), timeout) == -1 && errno != EINTR) {
+                perror("poll");
+                abort();
+            }
+            for (size_t ii = 0; ii < conns.size(); ++ii) {
+                if (((fds[ii].revents & POLLOUT) && !conns[ii]->doSend()) ||
+                    ((fds[ii].revents & (POLLIN | POLLERR | POLLHUP)) &&
+                     !conns[ii]->doRecv())) {
+                    fprintf(stderr, "Lost the connection to the server\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
+
+    const BenchConfig &config;
+    const KeyChooser &keys;
+    const char *value;
+    Random rnd;
+    uint64_t interval;
+    struct thread_timings timings;
+    uint64_t gets;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t sets;
+    uint64_t errors;
+
+private:
+    vector<BenchConnection*> conns;
+};
+
+uint64_t BenchConnection::issue(uint64_t now)
+{
+    while (pending.size() < (size_t)thread.config.depth) {
+        Request r;
+        if (thread.interval != 0) {
+            if (nextSend > now) {
+                break;
+            }
+            // The requests we couldn't send on time count from when
+            // they should have been sent
+            r.start = nextSend;
+            nextSend += thread.interval;
+        } else {
+            r.start = now;
+        }
+
+        char key[64];
+        size_t nkey = keyName(key, sizeof(key),
+                              thread.keys.next(thread.rnd));
+        r.opaque = opaque++;
+        if (thread.rnd.next() % 100 < (uint64_t)thread.config.getRatio) {
+            r.opcode = PROTOCOL_BINARY_CMD_GET;
+            encodeRequest(output, r.opcode, r.opaque, key, nkey, NULL, 0);
+        } else {
+            r.opcode = PROTOCOL_BINARY_CMD_SET;
+            size_t nvalue = thread.rnd.nextRange(thread.config.minValue,
+                                                 thread.config.maxValue);
+            encodeRequest(output, r.opcode, r.opaque, key, nkey,
+                          thread.value, nvalue);
+        }
+        pending.push_back(r);
+    }
+
+    if (thread.interval == 0 || pending.size() >= (size_t)thread.config.depth) {
+        return ~(uint64_t)0;
+    }
+    return nextSend;
+}
+
+bool BenchConnection::doSend(void)
+{
+    while (sent < output.size()) {
+        ssize_t nw = send(sock, &output[sent], output.size() - sent, 0);
+        if (nw == -1) {
+            return errno == EWOULDBLOCK || errno == EINTR;
+        }
+        sent += nw;
+    }
+    output.clear();
+    sent = 0;
+    return true;
+}
+
+bool BenchConnection::doRecv(void)
+{
+    char buffer[16384];
+    ssize_t nr;
+    while ((nr = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+        input.insert(input.end(), buffer, buffer + nr);
+    }
+    if (nr == 0 || (errno != EWOULDBLOCK && errno != EINTR)) {
+        return false;
+    }
+
+    uint64_t now = timings_now();
+    size_t offset = 0;
+    protocol_binary_response_header res;
+    while (input.size() - offset >= sizeof(res.bytes)) {
+        memcpy(res.bytes, &input[offset], sizeof(res.bytes));
+        size_t size = sizeof(res.bytes) + ntohl(res.response.bodylen);
+        if (input.size() - offset < size) {
+            break;
+        }
+        offset += size;
+        if (res.response.magic != PROTOCOL_BINARY_RES || pending.empty() ||
+            res.response.opaque != pending.front().opaque) {
+            fprintf(stderr, "Unexpected response from the server\n");
+            exit(EXIT_FAILURE);
+        }
+
+        Request r = pending.front();
+        pending.pop_front();
+        timings_record(&thread.timings, r.opcode, now - r.start, 0);
+        uint16_t status = ntohs(res.response.status);
+        if (r.opcode == PROTOCOL_BINARY_CMD_GET) {
+            ++thread.gets;
+            if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                ++thread.hits;
+            } else if (status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT) {
+                ++thread.misses;
+            } else {
+                ++thread.errors;
+            }
+        } else {
+            ++thread.sets;
+            if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                ++thread.errors;
+            }
+        }
+    }
+    input.erase(input.begin(), input.begin() + offset);
+    return true;
+}
+
+extern "C" {
+    void *bench_thread_main(void *arg) {
+        BenchThread *t = reinterpret_cast<BenchThread*>(arg);
+        t->main();
+        return arg;
+    }
+}
+
+/* Store every key (with SETQ) so that the gets hit from the start */
+static void benchLoad(const BenchConfig &config, const char *value)
+{
+    int sock = connectTo(config.host, config.port);
+    if (sock == -1) {
+        fprintf(stderr, "Failed to connect to %s:%s\n",
+                config.host.c_str(), config.port.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    Random rnd(1);
+    vector<char> out;
+    for (uint64_t ii = 0; ii < config.keys; ++ii) {
+        char key[64];
+        size_t nkey = keyName(key, sizeof(key), ii);
+        size_t nvalue = rnd.nextRange(config.minValue, config.maxValue);
+        encodeRequest(out, PROTOCOL_BINARY_CMD_SETQ, 0, key, nkey,
+                      value, nvalue);
+        if (out.size() >= 256 * 1024 || ii + 1 == config.keys) {
+            encodeRequest(out, PROTOCOL_BINARY_CMD_NOOP, 0, NULL, 0, NULL, 0);
+            for (size_t sent = 0; sent < out.size(); ) {
+                ssize_t nw = send(sock, &out[sent], out.size() - sent, 0);
+                if (nw <= 0) {
+                    fprintf(stderr, "Failed to load the keys\n");
+                    exit(EXIT_FAILURE);
+                }
+                sent += nw;
+            }
+            out.clear();
+
+            // Skip the failed SETQs until we get to the NOOP
+            protocol_binary_response_header res;
+            do {
+                char body[1024];
+                if (recv(sock, res.bytes, sizeof(res.bytes), MSG_WAITALL) !=
+                    (ssize_t)sizeof(res.bytes)) {
+                    fprintf(stderr, "Failed to load the keys\n");
+                    exit(EXIT_FAILURE);
+                }
+                for (uint32_t left = ntohl(res.response.bodylen); left > 0; ) {
+                    ssize_t nr = recv(sock, body,
+                                      left < sizeof(body) ? left : sizeof(body), 0);
+                    if (nr <= 0) {
+                        fprintf(stderr, "Failed to load the keys\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    left -= (uint32_t)nr;
+                }
+            } while (res.response.opcode != PROTOCOL_BINARY_CMD_NOOP);
+        }
+    }
+    close(sock);
+}
+
+static void benchReport(const char *name, const struct timing_histogram &h,
+                        double seconds)
+{
+    uint64_t count = 0;
+    for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+        count += h.server[ii];
+    }
+    if (count == 0) {
+        return;
+    }
+    printf("%-6s %12llu %12.0f %10.1f %10.1f %10.1f %10.1f\n", name,
+           (unsigned long long)count, count / seconds,
+           timings_percentile(h.server, 0.5) / 1000.0,
+           timings_percentile(h.server, 0.99) / 1000.0,
+           timings_percentile(h.server, 0.999) / 1000.0,
+           timings_percentile(h.server, 1.0) / 1000.0);
+}
+
+static int bench(const BenchConfig &config)
+{
+    if (config.threads < 1 || config.connections < config.threads ||
+        config.keys == 0 || config.depth < 1 ||
+        config.minValue > config.maxValue || config.maxValue > 1024 * 1024 ||
+        config.getRatio < 0 || config.getRatio > 100 ||
+        config.zipf < 0 || config.zipf >= 1 || config.duration < 1) {
+        fprintf(stderr, "Invalid benchmark parameters\n");
+        return 1;
+    }
+
+    char *value = new char[config.maxValue + 1];
+    memset(value, 'x', config.maxValue + 1);
+    KeyChooser keys(config.keys, config.zipf);
+    if (config.load) {
+        benchLoad(config, value);
+    }
+
+    vector<BenchThread*> threads;
+    for (int ii = 0; ii < config.threads; ++ii) {
+        threads.push_back(new BenchThread(config, keys, value,
+                                          (uint64_t)time(NULL) * 31 + ii));
+    }
+    uint64_t start = timings_now();
+    for (int ii = 0; ii < config.connections; ++ii) {
+        int sock = connectTo(config.host, config.port);
+        if (sock == -1) {
+            fprintf(stderr, "Failed to connect to %s:%s\n",
+                    config.host.c_str(), config.port.c_str());
+            return 1;
+        }
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        int flag = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&flag, sizeof(flag));
+        // Spread the first request of the connections over an interval
+        uint64_t first = start;
+        if (config.qps != 0) {
+            first += (uint64_t)(1e9 * ii / config.qps);
+        }
+        threads[ii % config.threads]->add(sock, first);
+    }
+
+    vector<pthread_t> tids(config.threads);
+    start = timings_now();
+    for (int ii = 0; ii < config.threads; ++ii) {
+        assert(pthread_create(&tids[ii], NULL, bench_thread_main,
+                              threads[ii]) == 0);
+    }
+    sleep(config.duration);
+    benchStop = true;
+    for (int ii = 0; ii < config.threads; ++ii) {
+        assert(pthread_join(tids[ii], NULL) == 0);
+    }
+    double seconds = (timings_now() - start) / 1e9;
+
+    struct timing_histogram get, set;
+    uint64_t gets = 0, hits = 0, misses = 0, sets = 0, errors = 0;
+    memset(&get, 0, sizeof(get));
+    memset(&set, 0, sizeof(set));
+    for (int ii = 0; ii < config.threads; ++ii) {
+        BenchThread *t = threads[ii];
+        timings_aggregate(&t->timings, PROTOCOL_BINARY_CMD_GET, &get);
+        timings_aggregate(&t->timings, PROTOCOL_BINARY_CMD_SET, &set);
+        gets += t->gets;
+        hits += t->hits;
+        misses += t->misses;
+        sets += t->sets;
+        errors += t->errors;
+        delete t;
+    }
+    delete []value;
+
+    printf("%d threads, %d connections, depth %d, %llu keys (%s), "
+           "values %zu-%zu bytes, %d%% gets, ", config.threads,
+           config.connections, config.depth,
+           (unsigned long long)config.keys,
+           config.zipf > 0 ? "zipfian" : "uniform",
+           config.minValue, config.maxValue, config.getRatio);
+    if (config.qps != 0) {
+        printf("target %llu ops/s\n", (unsigned long long)config.qps);
+    } else {
+        printf("closed loop\n");
+    }
+    printf("%.2f s, %.0f ops/s, %llu gets (%llu hits, %llu misses), "
+           "%llu sets, %llu errors\n", seconds, (gets + sets) / seconds,
+           (unsigned long long)gets, (unsigned long long)hits,
+           (unsigned long long)misses, (unsigned long long)sets,
+           (unsigned long long)errors);
+    printf("%-6s %12s %12s %10s %10s %10s %10s\n", "op", "count", "ops/s",
+           "p50 us", "p99 us", "p999 us", "max us");
+    benchReport("get", get, seconds);
+    benchReport("set", set, seconds);
+    return 0;
+}
+
+/*
+ * The TAP benchmark mode (-R): every connection asks for a TAP stream and
+ * we count the mutations until the producer closes the streams (or we
+ * run out of time). Meant to run against the tap_mock_engine with
+ * tap_items set, which puts the time a mutation was created (on the
+ * monotonic clock, so the producer has to run on this host) in the first
+ * 8 bytes of its value. From that we get the lag of the mutations, and
+ * the round trip of an ack: from sending it until the first mutation
+ * the producer created after the ack got to it. With -w the daemon's
+ * flow control keeps a window of messages waiting for our acks instead.
+ */
+
+class TapStream {
+public:
+    TapStream(int s) : sock(s), sent(0), ackSent(0), done(false) {
+    }
+
+    ~TapStream() {
+        close(sock);
+    }
+
+    int sock;
+    vector<char> input;
+    vector<char> output;
+    size_t sent;
+    /** When we sent the last ack nothing came back for (0 if none) */
+    uint64_t ackSent;
+    bool done;
+};
+
+struct TapBenchResult {
+    TapBenchResult() : mutations(0), bytes(0), acks(0), others(0) {
+        memset(&lag, 0, sizeof(lag));
+        memset(&ackRtt, 0, sizeof(ackRtt));
+    }
+
+    ~TapBenchResult() {
+        timings_destroy(&lag);
+        timings_destroy(&ackRtt);
+    }
+
+    uint64_t mutations;
+    uint64_t bytes;
+    uint64_t acks;
+    uint64_t others;
+    struct thread_timings lag;
+    struct thread_timings ackRtt;
+};
+
+static bool tapSend(TapStream &s)
+{
+    while (s.sent < s.output.size()) {
+        ssize_t nw = send(s.sock, &s.output[s.sent], s.output.size() - s.sent, 0);
+        if (nw == -1) {
+            if (errno == EPIPE || errno == ECONNRESET) {
+                // The producer closed the stream before it got the acks
+                // of the last messages
+                s.done = true;
+                return true;
+            }
+            return errno == EWOULDBLOCK || errno == EINTR;
+        }
+        s.sent += nw;
+    }
+    s.output.clear();
+    s.sent = 0;
+    return true;
+}
+
+static void tapParse(TapStream &s, TapBenchResult &r)
+{
+    uint64_t now = timings_now();
+    size_t offset = 0;
+    protocol_binary_request_tap_mutation req;
+    while (s.input.size() - offset >= sizeof(req.message.header)) {
+        memcpy(req.bytes, &s.input[offset], sizeof(req.message.header));
+        uint32_t bodylen = ntohl(req.message.header.request.bodylen);
+        size_t size = sizeof(req.message.header) + bodylen;
+        if (s.input.size() - offset < size) {
+            break;
+        }
+        const char *packet = &s.input[offset];
+        offset += size;
+
+        uint8_t opcode = req.message.header.request.opcode;
+        if (req.message.header.request.magic != PROTOCOL_BINARY_REQ) {
+            // The response to the connect (if anything went wrong)
+            ++r.others;
+            continue;
+        }
+        if (opcode != PROTOCOL_BINARY_CMD_TAP_MUTATION ||
+            size < sizeof(req.bytes)) {
+            ++r.others;
+            continue;
+        }
+
+        memcpy(req.bytes, packet, sizeof(req.bytes));
+        size_t skip = sizeof(req.bytes) +
+            ntohs(req.message.body.tap.enginespecific_length) +
+            ntohs(req.message.header.request.keylen);
+        uint64_t created;
+        if (size >= skip + sizeof(created)) {
+            memcpy(&created, packet + skip, sizeof(created));
+            if (created <= now) {
+                timings_record(&r.lag, opcode, now - created, 0);
+            }
+            if (s.ackSent != 0 && created >= s.ackSent) {
+                timings_record(&r.ackRtt, opcode, now - s.ackSent, 0);
+                s.ackSent = 0;
+            }
+        }
+        ++r.mutations;
+        r.bytes += size;
+
+        if (ntohs(req.message.body.tap.flags) & TAP_FLAG_ACK) {
+            protocol_binary_response_header res;
+            memset(res.bytes, 0, sizeof(res.bytes));
+            res.response.magic = PROTOCOL_BINARY_RES;
+            res.response.opcode = opcode;
+            res.response.opaque = req.message.header.request.opaque;
+            s.output.insert(s.output.end(), res.bytes,
+                            res.bytes + sizeof(res.bytes));
+            s.ackSent = now;
+            ++r.acks;
+        }
+    }
+    s.input.erase(s.input.begin(), s.input.begin() + offset);
+}
+
+static bool tapRecv(TapStream &s, TapBenchResult &r)
+{
+    char buffer[65536];
+    ssize_t nr;
+    while ((nr = recv(s.sock, buffer, sizeof(buffer), 0)) > 0) {
+        s.input.insert(s.input.end(), buffer, buffer + nr);
+        if (s.input.size() >= 1024 * 1024) {
+            tapParse(s, r);
+        }
+    }
+    tapParse(s, r);
+    if (nr == 0 || errno == ECONNRESET) {
+        // The reset is for the acks we sent after the last message
+        s.done = true;
+        return true;
+    }
+    return errno == EWOULDBLOCK || errno == EINTR;
+}
+
+static int tapBench(const BenchConfig &config)
+{
+    if (config.connections < 1 || config.duration < 1) {
+        fprintf(stderr, "Invalid benchmark parameters\n");
+        return 1;
+    }
+
+    protocol_binary_request_tap_connect req;
+    memset(req.bytes, 0, sizeof(req.bytes));
+    req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    req.message.header.request.opcode = PROTOCOL_BINARY_CMD_TAP_CONNECT;
+    req.message.header.request.extlen = 4;
+    uint32_t flags = TAP_CONNECT_SUPPORT_ACK;
+    uint32_t window[2] = { htonl(config.windowMsgs), htonl(config.windowBytes) };
+    uint32_t bodylen = 4;
+    if (config.flowControl) {
+        flags |= TAP_CONNECT_FLOW_CONTROL;
+        bodylen += sizeof(window);
+    }
+    req.message.header.request.bodylen = htonl(bodylen);
+    req.message.body.flags = htonl(flags);
+
+    // We find out about the end of a stream from the errors of our acks
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<TapStream*> streams;
+    for (int ii = 0; ii < config.connections; ++ii) {
+        int sock = connectTo(config.host, config.port);
+        if (sock == -1) {
+            fprintf(stderr, "Failed to connect to %s:%s\n",
+                    config.host.c_str(), config.port.c_str());
+            return 1;
+        }
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        int flag = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&flag, sizeof(flag));
+        TapStream *s = new TapStream(sock);
+        s->output.insert(s->output.end(), req.bytes,
+                         req.bytes + sizeof(req.bytes));
+        if (config.flowControl) {
+            const char *w = reinterpret_cast<const char*>(window);
+            s->output.insert(s->output.end(), w, w + sizeof(window));
+        }
+        streams.push_back(s);
+    }
+
+    TapBenchResult r;
+    uint64_t start = timings_now();
+    uint64_t deadline = start + config.duration * 1000000000ULL;
+    size_t open = streams.size();
+    vector<struct pollfd> fds(streams.size());
+    while (open > 0 && timings_now() < deadline) {
+        for (size_t ii = 0; ii < streams.size(); ++ii) {
+            fds[ii].fd = streams[ii]->done ? -1 : streams[ii]->sock;
+            fds[ii].events = POLLIN;
+            if (!streams[ii]->output.empty()) {
+                fds[ii].events |= POLLOUT;
+            }
+            fds[ii].revents = 0;
+        }
+        if (poll(&fds[0], fds.size(), 100) == -1 && errno != EINTR) {
+            perror("poll");
+            abort();
+        }
+        for (size_t ii = 0; ii < streams.size(); ++ii) {
+            TapStream &s = *streams[ii];
+            if (s.done) {
+                continue;
+            }
+            if (((fds[ii].revents & (POLLIN | POLLERR | POLLHUP)) &&
+                 !tapRecv(s, r)) ||
+                (!s.done && !s.output.empty() && !tapSend(s))) {
+                fprintf(stderr, "Lost the connection to the server\n");
+                exit(EXIT_FAILURE);
+            }
+            if (s.done) {
+                --open;
+            }
+        }
+    }
+    double seconds = (timings_now() - start) / 1e9;
+
+    for (size_t ii = 0; ii < streams.size(); ++ii) {
+        delete streams[ii];
+    }
+
+    printf("%d streams, ", config.connections);
+    if (config.flowControl) {
+        printf("flow control window %u messages, %u bytes\n",
+               config.windowMsgs, config.windowBytes);
+    } else {
+        printf("no flow control\n");
+    }
+    printf("%.2f s, %llu mutations, %.0f mutations/s, %.1f MB/s, "
+           "%llu acks, %llu other messages%s\n", seconds,
+           (unsigned long long)r.mutations, r.mutations / seconds,
+           r.bytes / seconds / (1024 * 1024),
+           (unsigned long long)r.acks, (unsigned long long)r.others,
+           open > 0 ? ", timed out" : "");
+    printf("%-6s %12s %12s %10s %10s %10s %10s\n", "", "count", "per sec",
+           "p50 us", "p99 us", "p999 us", "max us");
+
+    struct timing_histogram lag, ackRtt;
+    memset(&lag, 0, sizeof(lag));
+    memset(&ackRtt, 0, sizeof(ackRtt));
+    timings_aggregate(&r.lag, PROTOCOL_BINARY_CMD_TAP_MUTATION, &lag);
+    timings_aggregate(&r.ackRtt, PROTOCOL_BINARY_CMD_TAP_MUTATION, &ackRtt);
+    benchReport("lag", lag, seconds);
+    benchReport("ack", ackRtt, seconds);
+    return open > 0 ? 1 : 0;
+}
+
 /**
  * Program entry point. Connect to a memcached server and use the binary
  * protocol to retrieve a given set of stats.
@@ -420,12 +1262,15 @@ int main(int argc, char **argv)
     const char *port = "11211";
     const char *host = NULL;
     int connections = 10;
+    bool benchmark = false;
+    bool tapBenchmark = false;
+    BenchConfig config;
     char *ptr;
 
     /* Initialize the socket subsystem */
     initialize_sockets();
 
-    while ((cmd = getopt(argc, argv, "h:p:c:")) != EOF) {
+    while ((cmd = getopt(argc, argv, "h:p:c:Bt:k:z:v:g:d:q:T:lRw:")) != EOF) {
         switch (cmd) {
         case 'h' :
             host = optarg;
@@ -441,9 +1286,57 @@ int main(int argc, char **argv)
         case 'c' :
             connections = atoi(optarg);
             break;
+        case 'B' :
+            benchmark = true;
+            break;
+        case 't' :
+            config.threads = atoi(optarg);
+            break;
+        case 'k' :
+            config.keys = strtoull(optarg, NULL, 10);
+            break;
+        case 'z' :
+            config.zipf = atof(optarg);
+            break;
+        case 'v' :
+            config.minValue = config.maxValue = strtoul(optarg, &ptr, 10);
+            if (*ptr == ':') {
+                config.maxValue = strtoul(ptr + 1, NULL, 10);
+            }
+            break;
+        case 'g' :
+            config.getRatio = atoi(optarg);
+            break;
+        case 'd' :
+            config.depth = atoi(optarg);
+            break;
+        case 'q' :
+            config.qps = strtoull(optarg, NULL, 10);
+            break;
+        case 'T' :
+            config.duration = atoi(optarg);
+            break;
+        case 'l' :
+            config.load = true;
+            break;
+        case 'R' :
+            tapBenchmark = true;
+            break;
+        case 'w' :
+            config.flowControl = true;
+            config.windowMsgs = (uint32_t)strtoul(optarg, &ptr, 10);
+            if (*ptr == ':') {
+                config.windowBytes = (uint32_t)strtoul(ptr + 1, NULL, 10);
+            }
+            break;
         default:
             fprintf(stderr,
-                    "Usage mcbasher [-h host[:port]] [-p port] [-c connections]*\n");
+                    "Usage mcbasher [-h host[:port]] [-p port] [-c connections]*\n"
+                    "               [-B [-t threads] [-k keys] [-z zipf constant]\n"
+                    "                   [-v size[:max size]] [-g get percentage]\n"
+                    "                   [-d pipeline depth] [-q ops/s]\n"
+                    "                   [-T seconds] [-l]]\n"
+                    "               [-R [-w messages[:bytes]] [-T seconds]]\n");
             return 1;
         }
     }
@@ -452,6 +1345,20 @@ int main(int argc, char **argv)
         host = "localhost";
     }
 
+    if (tapBenchmark) {
+        config.host = host;
+        config.port = port;
+        config.connections = connections;
+        return tapBench(config);
+    }
+
+    if (benchmark) {
+        config.host = host;
+        config.port = port;
+        config.connections = connections;
+        return bench(config);
+    }
+
     list<Connection*> conns;
     for (int ii = 0; ii < connections; ++ii) {
         Connection *c;
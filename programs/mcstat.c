@@ -236,6 +236,143 @@ static void request_stat(int sock, const char *key)
     } while (response.message.header.response.keylen != 0);
 }
 
+/**
+ * The stats of a subscription, by id
+ */
+struct stream_stat {
+    char *name;
+    char *value;
+};
+
+static uint16_t read_uint16(const char *ptr) {
+    uint16_t val;
+    memcpy(&val, ptr, sizeof(val));
+    return ntohs(val);
+}
+
+static uint64_t read_uint64(const char *ptr) {
+    uint32_t val[2];
+    memcpy(val, ptr, sizeof(val));
+    return ((uint64_t)ntohl(val[0]) << 32) | ntohl(val[1]);
+}
+
+static char *copy_value(const char *val, size_t len) {
+    char *ret = malloc(len + 1);
+    if (ret == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    memcpy(ret, val, len);
+    ret[len] = '\0';
+    return ret;
+}
+
+/**
+ * Subscribe to a stats group, and print the stats that changed every time
+ * the server pushes them (followed by END)
+ * @param sock socket connected to the server
+ * @param key the stats group (NULL == the general stats)
+ * @param interval the number of milliseconds between the pushes
+ * @param count the number of pushes to print (0 == until we're killed)
+ */
+static void stream_stats(int sock, const char *key, uint32_t interval,
+                         int count)
+{
+    struct stream_stat *stats = NULL;
+    uint32_t nstats = 0;
+    uint32_t buffsize = 0;
+    char *buffer = NULL;
+    uint16_t keylen = 0;
+    if (key != NULL) {
+        keylen = (uint16_t)strlen(key);
+    }
+
+    protocol_binary_request_stats_subscribe request = {
+        .message.header.request = {
+            .magic = PROTOCOL_BINARY_REQ,
+            .opcode = PROTOCOL_BINARY_CMD_STATS_SUBSCRIBE,
+            .keylen = htons(keylen),
+            .extlen = 4,
+            .bodylen = htonl(4 + keylen)
+        },
+        .message.body.interval = htonl(interval)
+    };
+
+    retry_send(sock, &request, sizeof(request.bytes));
+    if (keylen > 0) {
+        retry_send(sock, key, keylen);
+    }
+
+    for (int pushes = 0; count == 0 || pushes < count; ++pushes) {
+        protocol_binary_response_no_extras response;
+        retry_recv(sock, &response, sizeof(response.bytes));
+        uint32_t vallen = ntohl(response.message.header.response.bodylen);
+        if (vallen > buffsize) {
+            if ((buffer = realloc(buffer, vallen)) == NULL) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(1);
+            }
+            buffsize = vallen;
+        }
+        retry_recv(sock, buffer, vallen);
+
+        uint16_t status = ntohs(response.message.header.response.status);
+        if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            fprintf(stderr, "Failed to subscribe to the stats: %u\n", status);
+            exit(1);
+        }
+
+        const char *ptr = buffer;
+        const char *end = buffer + vallen;
+        while (ptr + 3 <= end) {
+            uint16_t id = read_uint16(ptr);
+            uint8_t type = (uint8_t)ptr[2];
+            ptr += 3;
+
+            if (id >= nstats) {
+                stats = realloc(stats, (id + 1) * sizeof(*stats));
+                if (stats == NULL) {
+                    fprintf(stderr, "Failed to allocate memory\n");
+                    exit(1);
+                }
+                memset(stats + nstats, 0, (id + 1 - nstats) * sizeof(*stats));
+                nstats = id + 1;
+            }
+            struct stream_stat *stat = &stats[id];
+
+            if (type == PROTOCOL_BINARY_STATS_DEFINE) {
+                uint16_t nname = read_uint16(ptr);
+                uint16_t nvalue = read_uint16(ptr + 2);
+                free(stat->name);
+                free(stat->value);
+                stat->name = copy_value(ptr + 4, nname);
+                stat->value = copy_value(ptr + 4 + nname, nvalue);
+                ptr += 4 + nname + nvalue;
+            } else if (type == PROTOCOL_BINARY_STATS_DELTA && stat->value) {
+                char val[24];
+                uint64_t v = strtoull(stat->value, NULL, 10);
+                snprintf(val, sizeof(val), "%llu",
+                         (unsigned long long)(v + read_uint64(ptr)));
+                free(stat->value);
+                stat->value = copy_value(val, strlen(val));
+                ptr += 8;
+            } else if (type == PROTOCOL_BINARY_STATS_VALUE && stat->value) {
+                uint16_t nvalue = read_uint16(ptr);
+                free(stat->value);
+                stat->value = copy_value(ptr + 2, nvalue);
+                ptr += 2 + nvalue;
+            } else {
+                fprintf(stderr, "Invalid stats push from the server\n");
+                exit(1);
+            }
+            print(stat->name, (int)strlen(stat->name),
+                  stat->value, (int)strlen(stat->value));
+        }
+        fputs("END\n", stdout);
+        fflush(stdout);
+    }
+}
+
 /**
  * Program entry point. Connect to a memcached server and use the binary
  * protocol to retrieve a given set of stats.
@@ -252,12 +389,14 @@ int main(int argc, char **argv)
     const char *host = NULL;
     const char *user = NULL;
     const char *pass = NULL;
+    uint32_t interval = 0;
+    int count = 0;
     char *ptr;
 
     /* Initialize the socket subsystem */
     initialize_sockets();
 
-    while ((cmd = getopt(argc, argv, "h:p:u:P:")) != EOF) {
+    while ((cmd = getopt(argc, argv, "h:p:u:P:s:n:")) != EOF) {
         switch (cmd) {
         case 'h' :
             host = optarg;
@@ -276,9 +415,19 @@ int main(int argc, char **argv)
         case 'P':
             pass = optarg;
             break;
+        case 's':
+            interval = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
         default:
             fprintf(stderr,
-                    "Usage mcstat [-h host[:port]] [-p port] [-u user] [-p pass] [statkey]*\n");
+                    "Usage mcstat [-h host[:port]] [-p port] [-u user] [-p pass] [statkey]*\n"
+                    "       mcstat [-h host[:port]] [-p port] [-u user] [-p pass] -s ms [-n count] [statkey]\n"
+                    "\n"
+                    "  -s ms     have the server push the stats that change every ms milliseconds\n"
+                    "  -n count  stop after count pushes\n");
             return 1;
         }
     }
@@ -302,7 +451,14 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    if (optind == argc) {
+    if (interval != 0) {
+        if (argc - optind > 1) {
+            fprintf(stderr, "Only one stats group can be streamed\n");
+            close(sock);
+            return 1;
+        }
+        stream_stats(sock, optind == argc ? NULL : argv[optind], interval, count);
+    } else if (optind == argc) {
         request_stat(sock, NULL);
     } else {
         for (int ii = optind; ii < argc; ++ii) {
@@ -74,8 +74,19 @@ static const char *mock_get_server_version() {
 }
 
 static uint32_t mock_hash( const void *key, size_t length, const uint32_t initval) {
-    //this is a very stupid hash indeed
-    return 1;
+    /* Bob Jenkins' one-at-a-time hash. We need the keys to spread out
+       over the buckets (and lock stripes) to exercise the engines */
+    const unsigned char *ptr = key;
+    uint32_t hash = initval;
+    for (size_t ii = 0; ii < length; ++ii) {
+        hash += ptr[ii];
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+    return hash;
 }
 
 /* time-sensitive callers can call it by hand with this, outside the
@@ -87,6 +98,13 @@ static rel_time_t mock_get_current_time(void) {
     return current_time;
 }
 
+static uint64_t mock_get_current_time_msec(void) {
+    struct timeval timer;
+    gettimeofday(&timer, NULL);
+    return (uint64_t)(timer.tv_sec - process_started + time_travel_offset) * 1000 +
+        timer.tv_usec / 1000;
+}
+
 static rel_time_t mock_realtime(const time_t exptime) {
     /* no. of seconds in 30 days - largest possible delta exptime */
 
@@ -289,6 +307,32 @@ static void mock_get_detailed_stats(char* buffer, int size) {
     (void) size;
 }
 
+static void mock_place_background_thread(void) {
+}
+
+/* The mock server has no event loop to run the timers on */
+static server_timer_t *mock_add_timer(const void *cookie, uint32_t msec,
+                                      TIMER_CALLBACK cb, void *cb_data) {
+    (void)cookie;
+    (void)msec;
+    (void)cb;
+    (void)cb_data;
+    return NULL;
+}
+
+static void mock_cancel_timer(server_timer_t *timer) {
+    (void)timer;
+}
+
+static ENGINE_ERROR_CODE mock_submit_task(const void *cookie, task_pool_t pool,
+                                          TASK_FUNC fn, void *arg) {
+    (void)cookie;
+    (void)pool;
+    (void)fn;
+    (void)arg;
+    return ENGINE_ENOTSUP;
+}
+
 SERVER_HANDLE_V1 *get_mock_server_api(void)
 {
     static SERVER_CORE_API core_api = {
@@ -296,8 +340,10 @@ SERVER_HANDLE_V1 *get_mock_server_api(void)
         .hash = mock_hash,
         .realtime = mock_realtime,
         .get_current_time = mock_get_current_time,
+        .get_current_time_msec = mock_get_current_time_msec,
         .abstime = mock_abstime,
-        .parse_config = mock_parse_config
+        .parse_config = mock_parse_config,
+        .place_background_thread = mock_place_background_thread
     };
 
     static SERVER_COOKIE_API server_cookie_api = {
@@ -307,7 +353,10 @@ SERVER_HANDLE_V1 *get_mock_server_api(void)
         .get_socket_fd = mock_get_socket_fd,
         .notify_io_complete = mock_notify_io_complete,
         .reserve = mock_cookie_reserve,
-        .release = mock_cookie_release
+        .release = mock_cookie_release,
+        .add_timer = mock_add_timer,
+        .cancel_timer = mock_cancel_timer,
+        .submit_task = mock_submit_task
     };
 
     static SERVER_STAT_API server_stat_api = {
@@ -2,6 +2,7 @@
 #include <stdio.h>
 
 #include "memcached.h"
+#include "default_engine.h"
 
 static void display(const char *name, size_t size) {
     printf("%s\t%d\n", name, (int)size);
@@ -10,14 +11,18 @@ static void display(const char *name, size_t size) {
 int main(int argc, char **argv) {
 
     display("Slab Stats", sizeof(struct slab_stats));
-    display("Thread stats",
-            sizeof(struct thread_stats)
-            - (200 * sizeof(struct slab_stats)));
+    display("Thread stats", sizeof(struct thread_stats));
     display("Global stats", sizeof(struct stats));
     display("Settings", sizeof(struct settings));
     display("Libevent thread",
             sizeof(LIBEVENT_THREAD));
     display("Connection", sizeof(conn));
+#ifdef COMPACT_ITEMS
+    display("Item header (compact)", sizeof(hash_item));
+#else
+    display("Item header", sizeof(hash_item));
+#endif
+    display("Item reference", sizeof(item_ref));
 
     printf("----------------------------------------\n");
 
@@ -2,6 +2,7 @@
 #include "config.h"
 #undef NDEBUG
 #include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
@@ -19,13 +20,24 @@
 #include <netinet/in.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <limits.h>
 
 #include "cache.h"
+#include "heap_profile.h"
+#include "taskpool.h"
+#include "timer_wheel.h"
 #include <memcached/util.h>
 #include <memcached/protocol_binary.h>
 #include <memcached/config_parser.h>
 #include "extensions/protocol/fragment_rw.h"
 
+#ifdef HAVE_TLS
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#endif
+
 /* Set the read/write commands differently than the default values
  * so that we can verify that the override works
  */
@@ -40,6 +52,12 @@ static pid_t server_pid;
 static in_port_t port;
 static int sock;
 static bool allow_closed_read = false;
+/* The TLS port of the last server we started (if it has one) */
+static in_port_t tls_port;
+#ifdef HAVE_TLS
+/* safe_send() and safe_recv() go through it when it's set */
+static SSL *tls;
+#endif
 
 static enum test_return cache_create_test(void)
 {
@@ -156,6 +174,123 @@ static enum test_return test_issue_161(void)
     return ret;
 }
 
+/*
+ * Drive the heap profile hooks by hand (nobody installs them in here), with
+ * addresses that are never allocated
+ */
+static enum test_return test_heap_profile(void)
+{
+    static char mem[3];
+    struct heap_owner_stats owners[HEAP_NOWNERS];
+
+    assert(heap_profile_init(1024));
+    enum heap_owner owner = heap_profile_set_owner(HEAP_CONNECTION);
+    heap_profile_new_hook(&mem[0], 512);
+    heap_profile_new_hook(&mem[1], 512);
+    heap_profile_set_owner(HEAP_TAP);
+    heap_profile_new_hook(&mem[2], 4096);
+    heap_profile_set_owner(owner);
+
+    heap_profile_stats(owners);
+    assert(owners[HEAP_CONNECTION].live_samples == 1);
+    assert(owners[HEAP_CONNECTION].live_bytes == 1024);
+    assert(owners[HEAP_TAP].live_samples == 1);
+    assert(owners[HEAP_TAP].live_bytes == 4096);
+    assert(owners[HEAP_ENGINE].alloc_bytes == 0);
+
+    int len;
+    char *dump = heap_profile_dump(&len);
+    assert(dump != NULL);
+    assert(len == strlen(dump));
+    assert(strncmp(dump, "heap profile: 5120 bytes in 2 samples, "
+                   "1 sample every 1024 bytes\r\n", 66) == 0);
+    char *tap = strstr(dump, "4096 bytes in 1 samples (tap)\r\n");
+    char *conn = strstr(dump, "1024 bytes in 1 samples (connection)\r\n");
+    assert(tap != NULL && conn != NULL && tap < conn);
+    assert(strcmp(dump + len - 5, "END\r\n") == 0);
+    free(dump);
+
+    /* Only the sampled ones count */
+    heap_profile_delete_hook(&mem[0]);
+    heap_profile_delete_hook(&mem[1]);
+    heap_profile_delete_hook(&mem[2]);
+    heap_profile_stats(owners);
+    assert(owners[HEAP_CONNECTION].live_samples == 0);
+    assert(owners[HEAP_CONNECTION].live_bytes == 0);
+    assert(owners[HEAP_CONNECTION].alloc_bytes == 1024);
+    assert(owners[HEAP_TAP].live_bytes == 0);
+    assert(owners[HEAP_TAP].alloc_bytes == 4096);
+
+    return TEST_PASS;
+}
+
+static int constructed;
+
+static int cache_counting_constructor(void *buffer, void *notused1,
+                                      int notused2) {
+    ++constructed;
+    return 0;
+}
+
+#define MAGAZINE_OBJECTS 100
+
+static void *cache_free_objects(void *arg) {
+    void **args = arg;
+    cache_t *cache = args[0];
+    void **ptr = args[1];
+    for (int ii = 0; ii < MAGAZINE_OBJECTS; ++ii) {
+        cache_free(cache, ptr[ii]);
+    }
+    return NULL;
+}
+
+/*
+ * The objects freed go through the magazine to the depot and back, and
+ * the ones freed by a thread are back in the depot when it exits
+ */
+static enum test_return cache_magazine_test(void)
+{
+#ifndef HAVE_UMEM_H
+    cache_t *cache = cache_create("test", sizeof(uint64_t), sizeof(uint64_t),
+                                  cache_counting_constructor, NULL);
+    void *ptr[MAGAZINE_OBJECTS];
+    assert(cache != NULL);
+    constructed = 0;
+
+    for (int round = 0; round < 3; ++round) {
+        for (int ii = 0; ii < MAGAZINE_OBJECTS; ++ii) {
+            ptr[ii] = cache_alloc(cache);
+            assert(ptr[ii] != NULL);
+        }
+        assert(constructed == MAGAZINE_OBJECTS);
+        if (round < 2) {
+            for (int ii = 0; ii < MAGAZINE_OBJECTS; ++ii) {
+                cache_free(cache, ptr[ii]);
+            }
+        }
+    }
+
+    pthread_t tid;
+    void *args[] = { cache, ptr };
+    assert(pthread_create(&tid, NULL, cache_free_objects, args) == 0);
+    assert(pthread_join(tid, NULL) == 0);
+
+    for (int ii = 0; ii < MAGAZINE_OBJECTS; ++ii) {
+        ptr[ii] = cache_alloc(cache);
+    }
+    assert(constructed == MAGAZINE_OBJECTS);
+    for (int ii = 0; ii < MAGAZINE_OBJECTS; ++ii) {
+        cache_free(cache, ptr[ii]);
+    }
+    cache_destroy(cache);
+    return TEST_PASS;
+#else
+    return TEST_SKIP;
+#endif
+}
+
+#undef MAGAZINE_OBJECTS
+
 static enum test_return cache_redzone_test(void)
 {
 #ifndef HAVE_UMEM_H
@@ -191,6 +326,152 @@ static enum test_return cache_redzone_test(void)
 #endif
 }
 
+struct wheel_timer {
+    struct timer_entry entry;
+    uint64_t fired;
+};
+
+static void wheel_timer_fire(struct timer_entry *entry, void *arg) {
+    struct timer_wheel *w = arg;
+    ((struct wheel_timer *)entry)->fired = w->now;
+}
+
+/*
+ * The timers fire on their tick whatever the level they started in, also
+ * when the wheel is run in the jumps timer_wheel_next() gives us
+ */
+static enum test_return timer_wheel_test(void)
+{
+    static const uint64_t delays[] = {
+        0, 1, 2, 63, 64, 65, 100, 4095, 4096, 4097, 70000, 262144,
+        300000, 1ULL << 24, (1ULL << 24) + 12345, 20000000
+    };
+    const int ntimers = sizeof(delays) / sizeof(delays[0]);
+    struct wheel_timer timers[sizeof(delays) / sizeof(delays[0])];
+    struct wheel_timer cancelled;
+    struct timer_wheel w;
+    const uint64_t start = 1000003;
+
+    timer_wheel_init(&w, start);
+    assert(timer_wheel_next(&w) == UINT64_MAX);
+
+    memset(timers, 0, sizeof(timers));
+    for (int ii = 0; ii < ntimers; ++ii) {
+        timer_wheel_add(&w, &timers[ii].entry, start + delays[ii]);
+    }
+    memset(&cancelled, 0, sizeof(cancelled));
+    timer_wheel_add(&w, &cancelled.entry, start + 5000);
+    assert(w.count == ntimers + 1);
+    assert(timer_wheel_cancel(&w, &cancelled.entry));
+    assert(!timer_wheel_cancel(&w, &cancelled.entry));
+
+    uint32_t fired = 0;
+    while (w.count > 0) {
+        uint64_t next = timer_wheel_next(&w);
+        assert(next > 0 && next <= TIMER_WHEEL_SLOTS);
+        fired += timer_wheel_advance(&w, w.now + next, wheel_timer_fire, &w);
+    }
+    assert(fired == ntimers);
+    assert(cancelled.fired == 0);
+    for (int ii = 0; ii < ntimers; ++ii) {
+        uint64_t expect = start + (delays[ii] == 0 ? 1 : delays[ii]);
+        assert(timers[ii].fired == expect);
+        assert(!timers[ii].entry.armed);
+    }
+
+    /* A big step fires everything on the way, on the tick it was due */
+    timer_wheel_add(&w, &timers[0].entry, w.now + 10);
+    timer_wheel_add(&w, &timers[1].entry, w.now + 10000);
+    uint64_t base = w.now;
+    assert(timer_wheel_advance(&w, w.now + 20000, wheel_timer_fire, &w) == 2);
+    assert(timers[0].fired == base + 10);
+    assert(timers[1].fired == base + 10000);
+    assert(w.now == base + 20000);
+
+    return TEST_PASS;
+}
+
+static volatile int tasks_done;
+static volatile int tasks_failed;
+static volatile bool task_blocked;
+
+static void task_done(const void *cookie, ENGINE_ERROR_CODE status) {
+    if (status != (ENGINE_ERROR_CODE)(intptr_t)cookie) {
+        __sync_add_and_fetch(&tasks_failed, 1);
+    }
+    __sync_add_and_fetch(&tasks_done, 1);
+}
+
+static ENGINE_ERROR_CODE task_run(const void *cookie, void *arg) {
+    while (arg != NULL && task_blocked) {
+        usleep(1000);
+    }
+    return (ENGINE_ERROR_CODE)(intptr_t)cookie;
+}
+
+static void *task_submitter(void *arg) {
+    struct taskpool *pool = arg;
+    for (int ii = 0; ii < 250; ++ii) {
+        const void *cookie = (void *)(intptr_t)(ii % 2 ? ENGINE_SUCCESS :
+                                                ENGINE_KEY_ENOENT);
+        while (taskpool_submit(pool, cookie, task_run, NULL) ==
+               ENGINE_TMPFAIL) {
+            usleep(100);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Every task runs (from the queues of the submitters) and completes with
+ * its status, and the pool refuses what it can't take
+ */
+static enum test_return taskpool_test(void)
+{
+    struct taskpool pool;
+    struct taskpool_stats ts;
+
+    assert(taskpool_init(&pool, "test", 0, 16, task_done, NULL));
+    assert(taskpool_submit(&pool, NULL, task_run, NULL) == ENGINE_ENOTSUP);
+    taskpool_destroy(&pool);
+
+    tasks_done = tasks_failed = 0;
+    assert(taskpool_init(&pool, "test", 3, 16, task_done, NULL));
+    pthread_t tids[4];
+    for (int ii = 0; ii < 4; ++ii) {
+        assert(pthread_create(&tids[ii], NULL, task_submitter, &pool) == 0);
+    }
+    for (int ii = 0; ii < 4; ++ii) {
+        assert(pthread_join(tids[ii], NULL) == 0);
+    }
+    taskpool_destroy(&pool);
+    assert(tasks_done == 1000);
+    assert(tasks_failed == 0);
+    taskpool_get_stats(&pool, &ts);
+    assert(ts.submitted == 1000 && ts.completed == 1000 && ts.queued == 0);
+    assert(ts.max_queued <= 16);
+
+    /* One running and two queued fill it up */
+    tasks_done = 0;
+    task_blocked = true;
+    assert(taskpool_init(&pool, "test", 1, 2, task_done, NULL));
+    assert(taskpool_submit(&pool, NULL, task_run, &pool) == ENGINE_EWOULDBLOCK);
+    do {
+        usleep(1000);
+        taskpool_get_stats(&pool, &ts);
+    } while (ts.queued != 0);
+    assert(taskpool_submit(&pool, NULL, task_run, NULL) == ENGINE_EWOULDBLOCK);
+    assert(taskpool_submit(&pool, NULL, task_run, NULL) == ENGINE_EWOULDBLOCK);
+    assert(taskpool_submit(&pool, NULL, task_run, NULL) == ENGINE_TMPFAIL);
+    task_blocked = false;
+    taskpool_destroy(&pool);
+    taskpool_get_stats(&pool, &ts);
+    assert(tasks_done == 3);
+    assert(ts.completed == 3 && ts.rejected == 1);
+
+    return TEST_PASS;
+}
+
 static enum test_return test_safe_strtoul(void) {
     uint32_t val;
     assert(safe_strtoul("123", &val));
@@ -331,7 +612,8 @@ static char *get_module(const char *module) {
  *               as a daemon process
  * @return the pid of the memcached server
  */
-static pid_t start_server(in_port_t *port_out, bool daemon, int timeout) {
+static pid_t start_server(in_port_t *port_out, bool daemon, int timeout,
+                          const char *extra_arg) {
     char environment[80];
     snprintf(environment, sizeof(environment),
              "MEMCACHED_PORT_FILENAME=/tmp/ports.%lu", (long)getpid());
@@ -362,6 +644,11 @@ static pid_t start_server(in_port_t *port_out, bool daemon, int timeout) {
     system(coreadm);
 #endif
 
+    if (daemon) {
+        /* Don't pick up the pid of a previous server */
+        remove(pid_file);
+    }
+
     pid_t pid = fork();
     assert(pid != -1);
 
@@ -399,6 +686,15 @@ static pid_t start_server(in_port_t *port_out, bool daemon, int timeout) {
             argv[arg++] = "-P";
             argv[arg++] = pid_file;
         }
+        if (extra_arg != NULL) {
+            /* It may be several, separated by spaces */
+            char *args = strdup(extra_arg);
+            char *b;
+            for (char *p = strtok_r(args, " ", &b); p != NULL;
+                 p = strtok_r(NULL, " ", &b)) {
+                argv[arg++] = p;
+            }
+        }
 #ifdef MESSAGE_DEBUG
          argv[arg++] = "-vvv";
 #endif
@@ -425,28 +721,37 @@ static pid_t start_server(in_port_t *port_out, bool daemon, int timeout) {
             int32_t val;
             assert(safe_strtol(buffer + 10, &val));
             *port_out = (in_port_t)val;
+        } else if (strncmp(buffer, "TLS INET: ", 10) == 0) {
+            int32_t val;
+            assert(safe_strtol(buffer + 10, &val));
+            tls_port = (in_port_t)val;
         }
     }
     fclose(fp);
     assert(remove(filename) == 0);
 
     if (daemon) {
-        /* loop and wait for the pid file.. There is a potential race
-         * condition that the server just created the file but isn't
-         * finished writing the content, but I'll take the chance....
+        /* loop and wait for the pid file (and for the server to finish
+         * writing its content)
          */
-        while (access(pid_file, F_OK) == -1) {
-            usleep(10);
-        }
+        while (true) {
+            while (access(pid_file, F_OK) == -1) {
+                usleep(10);
+            }
 
-        fp = fopen(pid_file, "r");
-        if (fp == NULL) {
-            fprintf(stderr, "Failed to open pid file: %s\n",
-                    strerror(errno));
-            assert(false);
+            fp = fopen(pid_file, "r");
+            if (fp == NULL) {
+                fprintf(stderr, "Failed to open pid file: %s\n",
+                        strerror(errno));
+                assert(false);
+            }
+            char *line = fgets(buffer, sizeof(buffer), fp);
+            fclose(fp);
+            if (line != NULL && strchr(buffer, '\n') != NULL) {
+                break;
+            }
+            usleep(10);
         }
-        assert(fgets(buffer, sizeof(buffer), fp) != NULL);
-        fclose(fp);
 
         int32_t val;
         assert(safe_strtol(buffer, &val));
@@ -458,7 +763,7 @@ static pid_t start_server(in_port_t *port_out, bool daemon, int timeout) {
 
 static enum test_return test_issue_44(void) {
     in_port_t port;
-    pid_t pid = start_server(&port, true, 15);
+    pid_t pid = start_server(&port, true, 15, NULL);
     assert(kill(pid, SIGHUP) == 0);
     sleep(1);
     assert(kill(pid, SIGTERM) == 0);
@@ -752,7 +1057,7 @@ static enum test_return test_config_parser(void) {
 }
 
 static enum test_return start_memcached_server(void) {
-    server_pid = start_server(&port, false, 600);
+    server_pid = start_server(&port, false, 600, NULL);
     sock = connect_server("127.0.0.1", port, false);
 
     return TEST_PASS;
@@ -791,7 +1096,14 @@ static void safe_send(const void* buf, size_t len, bool hickup)
             }
         }
 
-        ssize_t nw = send(sock, ptr + offset, num_bytes, 0);
+        ssize_t nw;
+#ifdef HAVE_TLS
+        if (tls != NULL) {
+            nw = SSL_write(tls, ptr + offset, num_bytes);
+            assert(nw > 0);
+        } else
+#endif
+        nw = send(sock, ptr + offset, num_bytes, 0);
         if (nw == -1) {
             if (errno != EINTR) {
                 fprintf(stderr, "Failed to write: %s\n", strerror(errno));
@@ -812,7 +1124,14 @@ static bool safe_recv(void *buf, size_t len) {
     }
     off_t offset = 0;
     do {
-        ssize_t nr = recv(sock, ((char*)buf) + offset, len - offset, 0);
+        ssize_t nr;
+#ifdef HAVE_TLS
+        if (tls != NULL) {
+            nr = SSL_read(tls, ((char*)buf) + offset, len - offset);
+            assert(nr > 0);
+        } else
+#endif
+        nr = recv(sock, ((char*)buf) + offset, len - offset, 0);
         if (nr == -1) {
             if (errno != EINTR) {
                 fprintf(stderr, "Failed to read: %s\n", strerror(errno));
@@ -1471,6 +1790,184 @@ static enum test_return test_binary_getkq(void) {
     return test_binary_getq_impl("test_binary_getkq", PROTOCOL_BINARY_CMD_GETKQ);
 }
 
+/*
+ * A long run of quiet gets (with every other key missing) in a single
+ * write, so that the server may look them all up in one batch.
+ */
+static enum test_return test_binary_getkq_pipeline(void) {
+    const int nkeys = 100;
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } temp, receive;
+    char send[8192];
+    char key[64];
+    size_t len = 0;
+
+    for (int ii = 0; ii < nkeys; ii += 2) {
+        snprintf(key, sizeof(key), "test_binary_getkq_pipeline_%d", ii);
+        size_t l = storage_command(temp.bytes, sizeof(temp.bytes),
+                                   PROTOCOL_BINARY_CMD_SET,
+                                   key, strlen(key), key, strlen(key), 0, 0);
+        safe_send(temp.bytes, l, false);
+        safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+        validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_SET,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    }
+
+    for (int ii = 0; ii < nkeys; ++ii) {
+        snprintf(key, sizeof(key), "test_binary_getkq_pipeline_%d", ii);
+        size_t l = raw_command(temp.bytes, sizeof(temp.bytes),
+                               PROTOCOL_BINARY_CMD_GETKQ,
+                               key, strlen(key), NULL, 0);
+        assert(len + l < sizeof(send));
+        memcpy(send + len, temp.bytes, l);
+        len += l;
+    }
+    len += raw_command(send + len, sizeof(send) - len,
+                       PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    safe_send(send, len, false);
+
+    for (int ii = 0; ii < nkeys; ii += 2) {
+        snprintf(key, sizeof(key), "test_binary_getkq_pipeline_%d", ii);
+        size_t nkey = strlen(key);
+        safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+        validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_GETKQ,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        assert(receive.response.message.header.response.keylen == nkey);
+        assert(receive.response.message.header.response.bodylen == 4 + 2 * nkey);
+        const char *body = receive.bytes + sizeof(receive.response) + 4;
+        assert(memcmp(body, key, nkey) == 0);
+        assert(memcmp(body + nkey, key, nkey) == 0);
+    }
+
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    return TEST_PASS;
+}
+
+/*
+ * A pipeline mixing hits, misses (with an error message in the body) and
+ * arithmetic, so that the server may send the responses in one go. Make
+ * sure they all come back intact and in order.
+ */
+static enum test_return test_binary_pipeline_responses(void) {
+    const char *key = "test_binary_pipeline_responses";
+    const char *counter = "test_binary_pipeline_responses_counter";
+    const char *missing = "test_binary_pipeline_responses_missing";
+    const int count = 100;
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        protocol_binary_response_incr incr;
+        char bytes[1024];
+    } temp, receive;
+    char *send = malloc(count * 256);
+    assert(send != NULL);
+    size_t len = storage_command(temp.bytes, sizeof(temp.bytes),
+                                 PROTOCOL_BINARY_CMD_SET,
+                                 key, strlen(key), key, strlen(key), 0, 0);
+    safe_send(temp.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    len = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        len += raw_command(send + len, 256, PROTOCOL_BINARY_CMD_GETK,
+                           key, strlen(key), NULL, 0);
+        len += raw_command(send + len, 256, PROTOCOL_BINARY_CMD_GET,
+                           missing, strlen(missing), NULL, 0);
+        len += arithmetic_command(send + len, 256,
+                                  PROTOCOL_BINARY_CMD_INCREMENT,
+                                  counter, strlen(counter), 1, 0, 0);
+    }
+    safe_send(send, len, false);
+    free(send);
+
+    for (int ii = 0; ii < count; ++ii) {
+        size_t nkey = strlen(key);
+        safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+        validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_GETK,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        assert(receive.response.message.header.response.bodylen == 4 + 2 * nkey);
+        const char *body = receive.bytes + sizeof(receive.response) + 4;
+        assert(memcmp(body, key, nkey) == 0);
+        assert(memcmp(body + nkey, key, nkey) == 0);
+
+        safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+        validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_GET,
+                                 PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+        assert(receive.response.message.header.response.bodylen == 9);
+        assert(memcmp(receive.bytes + sizeof(receive.response),
+                      "Not found", 9) == 0);
+
+        safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+        validate_response_header(&receive.response,
+                                 PROTOCOL_BINARY_CMD_INCREMENT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        assert(memcached_ntohll(receive.incr.message.body.value) == ii);
+    }
+
+    return TEST_PASS;
+}
+
+/*
+ * A pipeline of quiet stores the server may store in batches. Only the
+ * failed ADDQ of every round should be answered, and all of the values
+ * must be there afterwards.
+ */
+static enum test_return test_binary_setq_pipeline(void) {
+    const int count = 100;
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } receive;
+    char *send = malloc(count * 3 * 256);
+    char keys[100][64];
+    assert(send != NULL);
+
+    size_t len = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        snprintf(keys[ii], sizeof(keys[ii]), "test_binary_setq_pipeline_%d", ii);
+        size_t nkey = strlen(keys[ii]);
+        len += storage_command(send + len, 256, PROTOCOL_BINARY_CMD_SETQ,
+                               keys[ii], nkey, keys[ii], nkey, 0, 0);
+        len += storage_command(send + len, 256, PROTOCOL_BINARY_CMD_ADDQ,
+                               keys[ii], nkey, "x", 1, 0, 0);
+        len += storage_command(send + len, 256, PROTOCOL_BINARY_CMD_REPLACEQ,
+                               keys[ii], nkey, keys[ii], nkey, 0, 0);
+    }
+    safe_send(send, len, false);
+    free(send);
+
+    for (int ii = 0; ii < count; ++ii) {
+        safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+        validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_ADDQ,
+                                 PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
+    }
+    test_binary_noop();
+
+    for (int ii = 0; ii < count; ++ii) {
+        size_t nkey = strlen(keys[ii]);
+        len = raw_command(receive.bytes, sizeof(receive.bytes),
+                          PROTOCOL_BINARY_CMD_GET, keys[ii], nkey, NULL, 0);
+        safe_send(receive.bytes, len, false);
+        safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+        validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_GET,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        assert(receive.response.message.header.response.bodylen == 4 + nkey);
+        assert(memcmp(receive.bytes + sizeof(receive.response) + 4,
+                      keys[ii], nkey) == 0);
+    }
+
+    return TEST_PASS;
+}
+
 static enum test_return test_binary_incr_impl(const char* key, uint8_t cmd) {
     union {
         protocol_binary_request_no_extras request;
@@ -1837,60 +2334,238 @@ static enum test_return test_binary_stat(void) {
     return TEST_PASS;
 }
 
-static enum test_return test_binary_scrub(void) {
+/*
+ * Look up one of the stats in a group (NULL for the general stats)
+ *
+ * @return false if the group doesn't have it
+ */
+static bool get_group_stat_str(const char *group, const char *name,
+                               char *val, size_t valsz) {
     union {
         protocol_binary_request_no_extras request;
         protocol_binary_response_no_extras response;
         char bytes[1024];
     } buffer;
+    bool ret = false;
 
     size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
-                             PROTOCOL_BINARY_CMD_SCRUB,
-                             NULL, 0, NULL, 0);
-
+                             PROTOCOL_BINARY_CMD_STAT,
+                             group, group ? strlen(group) : 0, NULL, 0);
     safe_send(buffer.bytes, len, false);
-    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
-    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_SCRUB,
-                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    do {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        uint16_t keylen = buffer.response.message.header.response.keylen;
+        uint32_t vallen = buffer.response.message.header.response.bodylen - keylen;
+        const char *key = buffer.bytes + sizeof(buffer.response);
+        if (keylen == strlen(name) && memcmp(key, name, keylen) == 0) {
+            assert(vallen < valsz);
+            memcpy(val, key + keylen, vallen);
+            val[vallen] = '\0';
+            ret = true;
+        }
+    } while (buffer.response.message.header.response.keylen != 0);
+
+    return ret;
+}
+
+/* Look up one of the numbers in a stats group (NULL for the general stats) */
+static long long get_group_stat(const char *group, const char *name) {
+    char val[32];
+    if (!get_group_stat_str(group, name, val, sizeof(val))) {
+        return -1;
+    }
+    return atoll(val);
+}
+
+static long long get_stat(const char *name) {
+    return get_group_stat(NULL, name);
+}
+
+static enum test_return test_binary_stat_timings(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } send, receive;
+
+    size_t len = raw_command(send.bytes, sizeof(send.bytes),
+                             PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    for (int ii = 0; ii < 10; ++ii) {
+        safe_send(send.bytes, len, false);
+        safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+        validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_NOOP,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    }
+
+    assert(get_group_stat("timings", "noop:count") >= 10);
+    long long p50 = get_group_stat("timings", "noop:p50");
+    long long p99 = get_group_stat("timings", "noop:p99");
+    assert(p50 > 0 && p99 >= p50);
+    assert(get_group_stat("timings", "noop:blocked:count") == 0);
+    /* Opcodes we never saw aren't listed */
+    assert(get_group_stat("timings", "0xfe:count") == -1);
 
     return TEST_PASS;
 }
 
+static enum test_return test_binary_stat_states(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } send, receive;
 
-volatile bool hickup_thread_running;
+    assert(get_group_stat("states", "conn_new_cmd:calls") == -1);
+    get_group_stat("states on", "");
 
-static void *binary_hickup_recv_verification_thread(void *arg) {
-    protocol_binary_response_no_extras *response = malloc(65*1024);
-    if (response != NULL) {
-        while (safe_recv_packet(response, 65*1024)) {
-            /* Just validate the packet format */
-            validate_response_header(response,
-                                     response->message.header.response.opcode,
-                                     response->message.header.response.status);
+    size_t len = raw_command(send.bytes, sizeof(send.bytes),
+                             PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    for (int ii = 0; ii < 10; ++ii) {
+        safe_send(send.bytes, len, false);
+        safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+        validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_NOOP,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    }
+    assert(get_stat("pid") > 0);
+
+    assert(get_group_stat("states", "conn_parse_cmd:calls") >= 10);
+    assert(get_group_stat("states", "conn_parse_cmd:cycles") > 0);
+    assert(get_group_stat("states", "engine_get_stats:calls") >= 1);
+    assert(get_group_stat("states", "cycles_per_usec") > 0);
+
+    /* A connection going away in the middle of it */
+    int saved = sock;
+    sock = connect_server("127.0.0.1", port, false);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    close(sock);
+    sock = saved;
+    long long closed = -1;
+    for (int ii = 0; ii < 1000 && closed <= 0; ++ii) {
+        if ((closed = get_group_stat("states", "conn_closing:calls")) <= 0) {
+            usleep(1000);
         }
-        free(response);
     }
-    hickup_thread_running = false;
-    allow_closed_read = false;
-    return NULL;
+    assert(closed > 0);
+
+    /* Nothing is counted while it's off */
+    get_group_stat("states off", "");
+    long long calls = get_group_stat("states", "conn_parse_cmd:calls");
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    assert(get_group_stat("states", "conn_parse_cmd:calls") == calls);
+
+    return TEST_PASS;
 }
 
-static enum test_return test_binary_pipeline_hickup_chunk(void *buffer, size_t buffersize) {
-    off_t offset = 0;
-    char *key[256];
-    uint64_t value = 0xfeedfacedeadbeef;
+/* Idle connections give their buffers back to the pools */
+static enum test_return test_binary_idle_buffers(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } send, receive;
+    int socks[8];
+    int saved = sock;
 
-    while (hickup_thread_running &&
-           offset + sizeof(protocol_binary_request_no_extras) < buffersize) {
-        union {
-            protocol_binary_request_no_extras request;
-            char bytes[65 * 1024];
-        } command;
-        uint8_t cmd = (uint8_t)(rand() & 0xff);
-        size_t len;
-        size_t keylen = (rand() % 250) + 1;
+    long long pinned = get_stat("conn_buffers_pinned");
+    assert(pinned > 0);
+    assert(get_stat("conn_buffers_pooled") >= 0);
 
-        switch (cmd) {
+    size_t len = raw_command(send.bytes, sizeof(send.bytes),
+                             PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    for (int ii = 0; ii < 8; ++ii) {
+        socks[ii] = connect_server("127.0.0.1", port, false);
+        assert(socks[ii] != -1);
+        sock = socks[ii];
+        safe_send(send.bytes, len, false);
+        safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+        validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_NOOP,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    }
+    sock = saved;
+
+    /* They let go of the buffers right after sending the response */
+    long long now;
+    for (int ii = 0; ii < 1000; ++ii) {
+        if ((now = get_stat("conn_buffers_pinned")) <= pinned) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(now <= pinned);
+    assert(get_stat("conn_buffers_pooled") > 0);
+
+    /* ... and take them again for the next request */
+    for (int ii = 0; ii < 8; ++ii) {
+        sock = socks[ii];
+        safe_send(send.bytes, len, false);
+        safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+        validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_NOOP,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        close(socks[ii]);
+    }
+    sock = saved;
+
+    return TEST_PASS;
+}
+
+static enum test_return test_binary_scrub(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_SCRUB,
+                             NULL, 0, NULL, 0);
+
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_SCRUB,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    return TEST_PASS;
+}
+
+
+volatile bool hickup_thread_running;
+
+static void *binary_hickup_recv_verification_thread(void *arg) {
+    protocol_binary_response_no_extras *response = malloc(65*1024);
+    if (response != NULL) {
+        while (safe_recv_packet(response, 65*1024)) {
+            /* Just validate the packet format */
+            validate_response_header(response,
+                                     response->message.header.response.opcode,
+                                     response->message.header.response.status);
+        }
+        free(response);
+    }
+    hickup_thread_running = false;
+    allow_closed_read = false;
+    return NULL;
+}
+
+static enum test_return test_binary_pipeline_hickup_chunk(void *buffer, size_t buffersize) {
+    off_t offset = 0;
+    char *key[256];
+    uint64_t value = 0xfeedfacedeadbeef;
+
+    while (hickup_thread_running &&
+           offset + sizeof(protocol_binary_request_no_extras) < buffersize) {
+        union {
+            protocol_binary_request_no_extras request;
+            char bytes[65 * 1024];
+        } command;
+        uint8_t cmd = (uint8_t)(rand() & 0xff);
+        size_t len;
+        size_t keylen = (rand() % 250) + 1;
+
+        switch (cmd) {
         case PROTOCOL_BINARY_CMD_ADD:
         case PROTOCOL_BINARY_CMD_ADDQ:
         case PROTOCOL_BINARY_CMD_REPLACE:
@@ -1999,6 +2674,83 @@ static enum test_return test_binary_pipeline_hickup(void)
     return TEST_PASS;
 }
 
+/* Send an ASCII command and check that we get exactly what we expect */
+static void ascii_command(const char *cmd, const char *expect) {
+    char buffer[1024];
+    size_t len = strlen(expect);
+    assert(len < sizeof(buffer));
+    safe_send(cmd, strlen(cmd), false);
+    safe_recv(buffer, len);
+    buffer[len] = '\0';
+    if (strcmp(buffer, expect) != 0) {
+        fprintf(stderr, "%s: expected \"%s\", got \"%s\"\n", cmd, expect,
+                buffer);
+        abort();
+    }
+}
+
+static enum test_return test_ascii(void) {
+    int saved = sock;
+
+    /* The first byte decides, so this one talks ASCII */
+    sock = connect_server("127.0.0.1", port, false);
+    assert(sock != -1);
+
+    ascii_command("version\r\n", "VERSION ");
+    char c;
+    do {
+        safe_recv(&c, 1);
+    } while (c != '\n');
+
+    ascii_command("set ascii_a 5 0 3\r\nabc\r\n", "STORED\r\n");
+    ascii_command("add ascii_a 0 0 1\r\nx\r\n", "NOT_STORED\r\n");
+    ascii_command("replace ascii_b 0 0 1\r\nx\r\n", "NOT_STORED\r\n");
+    ascii_command("set ascii_b 0 0 2 noreply\r\n10\r\n", "");
+    ascii_command("get ascii_a ascii_c ascii_b\r\n",
+                  "VALUE ascii_a 5 3\r\nabc\r\n"
+                  "VALUE ascii_b 0 2\r\n10\r\nEND\r\n");
+    ascii_command("incr ascii_b 5\r\n", "15\r\n");
+    ascii_command("decr ascii_b 20\r\n", "0\r\n");
+    ascii_command("incr ascii_a 1\r\n",
+                  "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n");
+    ascii_command("touch ascii_a 100\r\n", "TOUCHED\r\n");
+    ascii_command("touch ascii_c 100\r\n", "NOT_FOUND\r\n");
+    ascii_command("cas ascii_a 0 0 1 1\r\nx\r\n", "EXISTS\r\n");
+    ascii_command("delete ascii_a\r\n", "DELETED\r\n");
+    ascii_command("delete ascii_a\r\n", "NOT_FOUND\r\n");
+    ascii_command("set ascii_a 0 0 1\r\nabc",
+                  "CLIENT_ERROR bad data chunk\r\n");
+    ascii_command("bogus\r\n", "ERROR\r\n");
+    ascii_command("get ascii_a\r\n", "END\r\n");
+
+    close(sock);
+    sock = saved;
+    return TEST_PASS;
+}
+
+#ifdef TCP_CORK
+/* The responses to a pipeline are written with the socket corked */
+static enum test_return test_tcp_cork(void) {
+    int saved = sock;
+    long long corked = get_stat("tcp_corked");
+    long long sendmsgs = get_stat("sendmsgs");
+
+    sock = connect_server("127.0.0.1", port, false);
+    assert(sock != -1);
+    ascii_command("set tcp_cork 0 0 5\r\nhello\r\n", "STORED\r\n");
+    ascii_command("get tcp_cork\r\nget tcp_cork\r\nget tcp_cork\r\n",
+                  "VALUE tcp_cork 0 5\r\nhello\r\nEND\r\n"
+                  "VALUE tcp_cork 0 5\r\nhello\r\nEND\r\n"
+                  "VALUE tcp_cork 0 5\r\nhello\r\nEND\r\n");
+    close(sock);
+    sock = saved;
+
+    assert(get_stat("tcp_corked") > corked);
+    assert(get_stat("sendmsgs") >= sendmsgs + 4);
+    return TEST_PASS;
+}
+#endif
+
 static enum test_return test_binary_verbosity(void) {
     union {
         protocol_binary_request_verbosity request;
@@ -2063,6 +2815,189 @@ static enum test_return store_object(char *key, char *value) {
     return TEST_PASS;
 }
 
+/*
+ * Apply a stats push to the value of one of the stats (id is 0xffff until
+ * the stat is defined)
+ */
+static void apply_stats_push(const char *body, uint32_t len, const char *name,
+                             uint16_t *id, uint64_t *value) {
+    const char *end = body + len;
+    while (body < end) {
+        uint16_t sid;
+        memcpy(&sid, body, sizeof(sid));
+        sid = ntohs(sid);
+        uint8_t type = (uint8_t)body[2];
+        body += 3;
+        if (type == PROTOCOL_BINARY_STATS_DEFINE) {
+            uint16_t nname, nvalue;
+            memcpy(&nname, body, sizeof(nname));
+            memcpy(&nvalue, body + 2, sizeof(nvalue));
+            nname = ntohs(nname);
+            nvalue = ntohs(nvalue);
+            if (nname == strlen(name) && memcmp(body + 4, name, nname) == 0) {
+                char val[32];
+                assert(nvalue < sizeof(val));
+                memcpy(val, body + 4 + nname, nvalue);
+                val[nvalue] = '\0';
+                *id = sid;
+                *value = strtoull(val, NULL, 10);
+            }
+            body += 4 + nname + nvalue;
+        } else if (type == PROTOCOL_BINARY_STATS_DELTA) {
+            uint64_t delta;
+            memcpy(&delta, body, sizeof(delta));
+            if (sid == *id) {
+                *value += memcached_ntohll(delta);
+            }
+            body += sizeof(delta);
+        } else {
+            uint16_t nvalue;
+            assert(type == PROTOCOL_BINARY_STATS_VALUE);
+            assert(sid != *id);
+            memcpy(&nvalue, body, sizeof(nvalue));
+            body += 2 + ntohs(nvalue);
+        }
+    }
+    assert(body == end);
+}
+
+static enum test_return test_binary_stat_clients(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } send, receive;
+
+    long long before = get_group_stat("clients", "peer:127.0.0.1:ops");
+    size_t len = raw_command(send.bytes, sizeof(send.bytes),
+                             PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    for (int ii = 0; ii < 10; ++ii) {
+        safe_send(send.bytes, len, false);
+        safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+        validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_NOOP,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    }
+
+    /* The stats request we just sent is in there too */
+    assert(get_group_stat("clients", "peer:127.0.0.1:ops") >= before + 11);
+    assert(get_group_stat("clients", "peer:127.0.0.1:bytes_read") >= 11 * len);
+    assert(get_group_stat("clients", "peer:127.0.0.1:bytes_written") > 0);
+    assert(get_group_stat("clients", "peer:127.0.0.1:ops_error") == 0);
+    return TEST_PASS;
+}
+
+/*
+ * The prefixes the worker thread counted show up in "stats detail dump"
+ */
+static enum test_return test_binary_stat_detail(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } send, receive;
+    char dump[1024];
+
+    get_group_stat_str("detail on", "", dump, sizeof(dump));
+    store_object("detailtest:a", "value");
+    size_t len = raw_command(send.bytes, sizeof(send.bytes),
+                             PROTOCOL_BINARY_CMD_GET,
+                             "detailtest:b", strlen("detailtest:b"), NULL, 0);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    len = raw_command(send.bytes, sizeof(send.bytes),
+                      PROTOCOL_BINARY_CMD_DELETE,
+                      "detailtest:a", strlen("detailtest:a"), NULL, 0);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_DELETE,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    get_group_stat_str("detail off", "", dump, sizeof(dump));
+
+    assert(get_group_stat_str("detail dump", "detailed", dump, sizeof(dump)));
+    assert(strstr(dump, "PREFIX detailtest get 2 hit 1 set 1 del 1\r\n") != NULL);
+    assert(strcmp(dump + strlen(dump) - 5, "END\r\n") == 0);
+
+    return TEST_PASS;
+}
+
+static enum test_return test_binary_stats_subscribe(void) {
+    union {
+        protocol_binary_request_stats_subscribe request;
+        protocol_binary_response_no_extras response;
+        char bytes[64 * 1024];
+    } buffer;
+    uint16_t id = 0xffff;
+    uint64_t cmd_set = 0;
+    int saved = sock;
+
+    sock = connect_server("127.0.0.1", port, false);
+    assert(sock != -1);
+
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_STATS_SUBSCRIBE,
+                             NULL, 0, NULL, 0);
+    buffer.request.message.header.request.extlen = 4;
+    buffer.request.message.header.request.bodylen = htonl(4);
+    buffer.request.message.body.interval = htonl(10);
+    safe_send(buffer.bytes, len + 4, false);
+
+    /* The response has all of them */
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response,
+                             PROTOCOL_BINARY_CMD_STATS_SUBSCRIBE,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    apply_stats_push(buffer.bytes + sizeof(buffer.response),
+                     buffer.response.message.header.response.bodylen,
+                     "cmd_set", &id, &cmd_set);
+    assert(id != 0xffff);
+    uint64_t expected = cmd_set + 1;
+    int subscribed = sock;
+
+    sock = saved;
+    store_object("subscribed", "value");
+    sock = subscribed;
+
+    /* The next pushes send the set as a delta */
+    for (int ii = 0; ii < 1000 && cmd_set != expected; ++ii) {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response,
+                                 PROTOCOL_BINARY_CMD_STATS_SUBSCRIBE,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        apply_stats_push(buffer.bytes + sizeof(buffer.response),
+                         buffer.response.message.header.response.bodylen,
+                         "cmd_set", &id, &cmd_set);
+    }
+    assert(cmd_set == expected);
+
+    /* Cancel it, and make sure the pushes stop */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_STATS_SUBSCRIBE, NULL, 0, NULL, 0);
+    buffer.request.message.header.request.extlen = 4;
+    buffer.request.message.header.request.bodylen = htonl(4);
+    buffer.request.message.body.interval = 0;
+    safe_send(buffer.bytes, len + 4, false);
+    for (int ii = 0; ii < 2; ++ii) {
+        if (ii == 1) {
+            usleep(50000);
+        }
+        len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                          PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+        safe_send(buffer.bytes, len, false);
+        do {
+            safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+            assert(ii == 0 || buffer.response.message.header.response.opcode ==
+                   PROTOCOL_BINARY_CMD_NOOP);
+        } while (buffer.response.message.header.response.opcode !=
+                 PROTOCOL_BINARY_CMD_NOOP);
+    }
+
+    close(sock);
+    sock = saved;
+    return TEST_PASS;
+}
+
 static enum test_return test_binary_read(void) {
     union {
         protocol_binary_request_read request;
@@ -2208,12 +3143,947 @@ static enum test_return test_binary_bad_tap_ttl(void) {
     return TEST_PASS;
 }
 
+/* The value of the "stats tapstreams" stat ending with suffix */
+static long long get_tap_stream_stat(const char *suffix) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    long long ret = -1;
+
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_STAT,
+                             "tapstreams", 10, NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    do {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        uint16_t keylen = buffer.response.message.header.response.keylen;
+        uint32_t vallen = buffer.response.message.header.response.bodylen - keylen;
+        const char *key = buffer.bytes + sizeof(buffer.response);
+        if (keylen > strlen(suffix) &&
+            memcmp(key + keylen - strlen(suffix), suffix, strlen(suffix)) == 0) {
+            char val[32];
+            assert(vallen < sizeof(val));
+            memcpy(val, key + keylen, vallen);
+            val[vallen] = '\0';
+            ret = atoll(val);
+        }
+    } while (buffer.response.message.header.response.keylen != 0);
+
+    return ret;
+}
+
+static enum test_return test_binary_tap_flow_control(void) {
+    union {
+        protocol_binary_request_tap_connect request;
+        protocol_binary_request_tap_mutation mutation;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    int saved = sock;
+
+    for (int ii = 0; ii < 20; ++ii) {
+        char key[32];
+        snprintf(key, sizeof(key), "tap_flow_%d", ii);
+        size_t len = storage_command(buffer.bytes, sizeof(buffer.bytes),
+                                     PROTOCOL_BINARY_CMD_SET,
+                                     key, strlen(key), "value", 5, 0, 0);
+        safe_send(buffer.bytes, len, false);
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_SET,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    }
+
+    /* At most 4 messages waiting for an ack */
+    uint32_t window[2] = { htonl(4), htonl(0) };
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_TAP_CONNECT,
+                             NULL, 0, NULL, 0);
+    buffer.request.message.header.request.extlen = 4;
+    buffer.request.message.header.request.bodylen = htonl(4 + sizeof(window));
+    buffer.request.message.body.flags = htonl(TAP_CONNECT_FLOW_CONTROL);
+    memcpy(buffer.bytes + len + 4, window, sizeof(window));
+    len += 4 + sizeof(window);
+
+    sock = connect_server("127.0.0.1", port, false);
+    assert(sock != -1);
+    int tapsock = sock;
+    safe_send(buffer.bytes, len, false);
+
+    uint32_t opaque = 0;
+    for (int ii = 0; ii < 4; ++ii) {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        assert(buffer.mutation.message.header.request.magic == PROTOCOL_BINARY_REQ);
+        assert(buffer.mutation.message.header.request.opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION);
+        assert(ntohs(buffer.mutation.message.body.tap.flags) & TAP_FLAG_ACK);
+        if (ii == 0) {
+            opaque = buffer.mutation.message.header.request.opaque;
+        }
+    }
+
+    /* Nothing more until we ack something */
+    usleep(100000);
+    assert(recv(tapsock, buffer.bytes, sizeof(buffer.bytes), MSG_DONTWAIT) == -1);
+    assert(errno == EAGAIN || errno == EWOULDBLOCK);
+
+    sock = saved;
+    assert(get_tap_stream_stat(":window_msgs") == 4);
+    assert(get_tap_stream_stat(":window_max_msgs") == 4);
+    assert(get_tap_stream_stat(":window_full") == 1);
+    assert(get_tap_stream_stat(":sent_msgs") == 4);
+
+    sock = tapsock;
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_TAP_MUTATION, NULL, 0, NULL, 0);
+    buffer.response.message.header.response.magic = PROTOCOL_BINARY_RES;
+    buffer.response.message.header.response.opaque = opaque;
+    safe_send(buffer.bytes, len, false);
+
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    assert(buffer.mutation.message.header.request.opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION);
+
+    sock = saved;
+    assert(get_tap_stream_stat(":acks") == 1);
+    assert(get_tap_stream_stat(":sent_msgs") == 5);
+    assert(get_tap_stream_stat(":window_msgs") == 4);
+
+    close(tapsock);
+    return TEST_PASS;
+}
+
+static enum test_return test_binary_tap_compression(void) {
+    union {
+        protocol_binary_request_tap_connect request;
+        protocol_binary_request_tap_mutation mutation;
+        protocol_binary_response_no_extras response;
+        protocol_binary_response_get get;
+        char bytes[4096];
+    } buffer;
+    char value[2000];
+    int saved = sock;
+
+    memset(value, 'z', sizeof(value));
+    size_t len = storage_command(buffer.bytes, sizeof(buffer.bytes),
+                                 PROTOCOL_BINARY_CMD_SET,
+                                 "tap_zlib", 8, value, sizeof(value), 0, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /*
+     * The stream ends (and its stats are gone) once it sent everything,
+     * so keep it going one message at a time
+     */
+    uint32_t window[2] = { htonl(1), htonl(0) };
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_TAP_CONNECT, NULL, 0, NULL, 0);
+    buffer.request.message.header.request.extlen = 4;
+    buffer.request.message.header.request.bodylen = htonl(4 + sizeof(window));
+    buffer.request.message.body.flags = htonl(TAP_CONNECT_COMPRESSION |
+                                              TAP_CONNECT_FLOW_CONTROL);
+    memcpy(buffer.bytes + len + 4, window, sizeof(window));
+    len += 4 + sizeof(window);
+
+    sock = connect_server("127.0.0.1", port, false);
+    assert(sock != -1);
+    int tapsock = sock;
+    safe_send(buffer.bytes, len, false);
+
+    /* Skip the other items in the cache (they're too small) */
+    const char *key;
+    for (;;) {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        assert(buffer.mutation.message.header.request.magic == PROTOCOL_BINARY_REQ);
+        key = buffer.bytes + sizeof(buffer.mutation.bytes) +
+            ntohs(buffer.mutation.message.body.tap.enginespecific_length);
+        if (buffer.mutation.message.header.request.opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION &&
+            buffer.response.message.header.response.keylen == 8 &&
+            memcmp(key, "tap_zlib", 8) == 0) {
+            break;
+        }
+
+        char ack[64];
+        protocol_binary_response_no_extras *rsp = (void*)ack;
+        len = raw_command(ack, sizeof(ack),
+                          PROTOCOL_BINARY_CMD_TAP_MUTATION, NULL, 0, NULL, 0);
+        rsp->message.header.response.magic = PROTOCOL_BINARY_RES;
+        rsp->message.header.response.opaque =
+            buffer.mutation.message.header.request.opaque;
+        safe_send(ack, len, false);
+    }
+
+    uint32_t bodylen = buffer.response.message.header.response.bodylen;
+    uint16_t tap_flags = ntohs(buffer.mutation.message.body.tap.flags);
+    assert(tap_flags & TAP_FLAG_COMPRESSED);
+    assert(bodylen < 16 + 8 + sizeof(value) / 10);
+
+    sock = saved;
+    assert(get_tap_stream_stat(":compress_msgs") == 1);
+    assert(get_tap_stream_stat(":compress_bytes") == sizeof(value));
+    close(tapsock);
+
+    /* Send it back to the server as a consumer would */
+    len = raw_command(buffer.bytes + 2048, 2048,
+                      PROTOCOL_BINARY_CMD_DELETE, "tap_zlib", 8, NULL, 0);
+    safe_send(buffer.bytes + 2048, len, false);
+    safe_recv_packet(buffer.bytes + 2048, 2048);
+    validate_response_header((void*)(buffer.bytes + 2048),
+                             PROTOCOL_BINARY_CMD_DELETE,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    buffer.response.message.header.response.keylen = htons(8);
+    buffer.response.message.header.response.bodylen = htonl(bodylen);
+    buffer.mutation.message.body.tap.flags = htons(tap_flags | TAP_FLAG_ACK);
+    buffer.mutation.message.header.request.opaque = 0xdeadbeef;
+    safe_send(buffer.bytes, sizeof(protocol_binary_request_header) + bodylen,
+              false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response,
+                             PROTOCOL_BINARY_CMD_TAP_MUTATION,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_GET, "tap_zlib", 8, NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(buffer.response.message.header.response.bodylen == 4 + sizeof(value));
+    assert(memcmp(buffer.bytes + sizeof(buffer.get.bytes), value,
+                  sizeof(value)) == 0);
+
+    assert(get_tap_stream_stat(":inflate_msgs") == 1);
+    assert(get_tap_stream_stat(":inflate_bytes") == sizeof(value));
+    return TEST_PASS;
+}
+
 typedef enum test_return (*TEST_FUNC)(void);
 struct testcase {
     const char *description;
     TEST_FUNC function;
 };
 
+/* Sum up the thread_<n>:conn_count values from "stats threads" */
+static int get_thread_conn_counts(int *min, int *max) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    static const char suffix[] = ":conn_count";
+    int nthreads = 0;
+    int total = 0;
+
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_STAT,
+                             "threads", 7, NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    *min = INT_MAX;
+    *max = 0;
+    do {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        uint16_t keylen = buffer.response.message.header.response.keylen;
+        uint32_t vallen = buffer.response.message.header.response.bodylen - keylen;
+        const char *key = buffer.bytes + sizeof(buffer.response);
+        if (keylen > sizeof(suffix) - 1 &&
+            memcmp(key + keylen - (sizeof(suffix) - 1), suffix,
+                   sizeof(suffix) - 1) == 0) {
+            char val[32];
+            assert(vallen < sizeof(val));
+            memcpy(val, key + keylen, vallen);
+            val[vallen] = '\0';
+            int count = atoi(val);
+            total += count;
+            *min = count < *min ? count : *min;
+            *max = count > *max ? count : *max;
+            ++nthreads;
+        }
+    } while (buffer.response.message.header.response.keylen != 0);
+
+    assert(nthreads == 4);
+    return total;
+}
+
+/*
+ * With -j conns the new connections go to the worker with the fewest
+ * connections, and the per thread accounting follows the connections
+ */
+static enum test_return test_conn_placement(void) {
+    in_port_t placement_port;
+    pid_t pid = start_server(&placement_port, false, 15, "-jconns");
+    int socks[8];
+    int saved = sock;
+    int min, max;
+
+    sock = connect_server("127.0.0.1", placement_port, false);
+    for (int ii = 0; ii < 8; ++ii) {
+        socks[ii] = connect_server("127.0.0.1", placement_port, false);
+        assert(socks[ii] != -1);
+    }
+
+    /* The connections are handed to the workers asynchronously */
+    int total;
+    for (int ii = 0; ii < 1000; ++ii) {
+        if ((total = get_thread_conn_counts(&min, &max)) == 9) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(total == 9);
+    assert(max - min <= 1);
+
+    for (int ii = 0; ii < 8; ++ii) {
+        close(socks[ii]);
+    }
+    for (int ii = 0; ii < 1000; ++ii) {
+        if ((total = get_thread_conn_counts(&min, &max)) == 1) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(total == 1);
+
+    close(sock);
+    sock = saved;
+    assert(kill(pid, SIGTERM) == 0);
+    return TEST_PASS;
+}
+
+static void set_threads(uint32_t nthr, uint16_t status) {
+    union {
+        protocol_binary_request_threads request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_THREADS, NULL, 0, NULL, 0);
+    buffer.request.message.header.request.extlen = 4;
+    buffer.request.message.header.request.bodylen = htonl(4);
+    buffer.request.message.body.threads = htonl(nthr);
+    safe_send(buffer.bytes, len + 4, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_THREADS,
+                             status);
+}
+
+/*
+ * The threads command parks the worker threads past the number it gets:
+ * the new connections go to the others, and the connections the parked
+ * ones had move over once they're done with their next request
+ */
+static enum test_return test_thread_scaling(void) {
+    in_port_t scaling_port;
+    pid_t pid = start_server(&scaling_port, false, 15, NULL);
+    int socks[8];
+    int saved = sock;
+    int min, max;
+
+    sock = connect_server("127.0.0.1", scaling_port, false);
+    for (int ii = 0; ii < 8; ++ii) {
+        socks[ii] = connect_server("127.0.0.1", scaling_port, false);
+        assert(socks[ii] != -1);
+    }
+    int control = sock;
+    for (int ii = 0; ii < 1000 && get_thread_conn_counts(&min, &max) != 9; ++ii) {
+        usleep(1000);
+    }
+    assert(get_thread_conn_counts(&min, &max) == 9);
+    assert(get_group_stat("threads", "active") == 4);
+
+    set_threads(1, PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(get_stat("threads_active") == 1);
+    for (int ii = 0; ii < 8; ++ii) {
+        sock = socks[ii];
+        assert(test_binary_noop() == TEST_PASS);
+    }
+    sock = control;
+    for (int ii = 0; ii < 1000 &&
+             get_group_stat("threads", "thread_0:conn_count") != 9; ++ii) {
+        usleep(1000);
+    }
+    assert(get_group_stat("threads", "thread_0:conn_count") == 9);
+
+    /* The new ones too */
+    int extra = connect_server("127.0.0.1", scaling_port, false);
+    for (int ii = 0; ii < 1000 &&
+             get_group_stat("threads", "thread_0:conn_count") != 10; ++ii) {
+        usleep(1000);
+    }
+    assert(get_group_stat("threads", "thread_0:conn_count") == 10);
+    close(extra);
+
+    set_threads(5, PROTOCOL_BINARY_RESPONSE_EINVAL);
+    set_threads(0, PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(get_stat("threads_active") == 4);
+    assert(get_group_stat("settings", "num_threads_min") == 0);
+
+    for (int ii = 0; ii < 8; ++ii) {
+        close(socks[ii]);
+    }
+    close(sock);
+    sock = saved;
+    assert(kill(pid, SIGTERM) == 0);
+    return TEST_PASS;
+}
+
+/*
+ * With -N the connections are accepted by the worker threads on their
+ * own listening sockets (all bound to the same port)
+ */
+static enum test_return test_reuseport(void) {
+    in_port_t reuse_port;
+    pid_t pid = start_server(&reuse_port, false, 15, "-N");
+    int socks[16];
+    int saved = sock;
+
+    for (int ii = 0; ii < 16; ++ii) {
+        socks[ii] = connect_server("127.0.0.1", reuse_port, false);
+        assert(socks[ii] != -1);
+    }
+    for (int ii = 0; ii < 16; ++ii) {
+        sock = socks[ii];
+        assert(test_binary_noop() == TEST_PASS);
+        close(sock);
+    }
+    sock = saved;
+
+    assert(kill(pid, SIGTERM) == 0);
+    return TEST_PASS;
+}
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+/*
+ * With -Y the workers are pinned to the listed CPUs in turn (here all to
+ * the first one we may use)
+ */
+static enum test_return test_cpu_affinity(void) {
+    cpu_set_t set;
+    int cpu = 0;
+    assert(sched_getaffinity(0, sizeof(set), &set) == 0);
+    while (!CPU_ISSET(cpu, &set)) {
+        ++cpu;
+    }
+    char arg[64];
+    snprintf(arg, sizeof(arg), "-Y%d -N", cpu);
+
+    in_port_t affinity_port;
+    pid_t pid = start_server(&affinity_port, false, 15, arg);
+    int saved = sock;
+    sock = connect_server("127.0.0.1", affinity_port, false);
+    assert(sock != -1);
+    assert(test_binary_noop() == TEST_PASS);
+
+    char val[64];
+    assert(get_group_stat_str("settings", "cpu_affinity", val, sizeof(val)));
+    assert(atoi(val) == cpu);
+    assert(get_group_stat("threads", "thread_0:cpu") == cpu);
+    assert(get_group_stat("threads", "thread_1:cpu") == cpu);
+
+    close(sock);
+    sock = saved;
+    assert(kill(pid, SIGTERM) == 0);
+    return TEST_PASS;
+}
+#endif
+
+static enum test_return test_io_uring(void) {
+    in_port_t ring_port;
+    pid_t pid = start_server(&ring_port, false, 15, "-Wio_uring");
+    int saved = sock;
+
+    /* Falls back to libevent where io_uring isn't available */
+    sock = connect_server("127.0.0.1", ring_port, false);
+    assert(sock != -1);
+    assert(test_binary_noop() == TEST_PASS);
+    assert(test_binary_set() == TEST_PASS);
+    assert(test_binary_get() == TEST_PASS);
+    assert(test_binary_getq() == TEST_PASS);
+    assert(test_binary_append() == TEST_PASS);
+    assert(test_binary_incr() == TEST_PASS);
+    assert(test_binary_stat() == TEST_PASS);
+    close(sock);
+    sock = saved;
+
+    assert(kill(pid, SIGTERM) == 0);
+    return TEST_PASS;
+}
+
+static enum test_return test_zerocopy(void) {
+    in_port_t zc_port;
+    pid_t pid = start_server(&zc_port, false, 15, "-Z1k");
+    int saved = sock;
+    const size_t vlen = 256 * 1024;
+    const char *key = "test_zerocopy";
+    size_t bufsz = vlen + 1024;
+    char *value = malloc(vlen);
+    char *buffer = malloc(bufsz);
+    assert(value != NULL && buffer != NULL);
+    for (size_t ii = 0; ii < vlen; ++ii) {
+        value[ii] = (char)('a' + ii % 26);
+    }
+
+    sock = connect_server("127.0.0.1", zc_port, false);
+    assert(sock != -1);
+
+    size_t len = storage_command(buffer, bufsz, PROTOCOL_BINARY_CMD_SET,
+                                 key, strlen(key), value, vlen, 0, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /* Overwrite the value while the previous response may be in flight */
+    for (int ii = 0; ii < 10; ++ii) {
+        len = raw_command(buffer, bufsz, PROTOCOL_BINARY_CMD_GET,
+                          key, strlen(key), NULL, 0);
+        safe_send(buffer, len, false);
+        safe_recv_packet(buffer, bufsz);
+        protocol_binary_response_get *rsp = (void*)buffer;
+        validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_GET,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        assert(rsp->message.header.response.bodylen == vlen + 4);
+        assert(memcmp(buffer + sizeof(rsp->bytes), value, vlen) == 0);
+
+        len = storage_command(buffer, bufsz, PROTOCOL_BINARY_CMD_SET,
+                              key, strlen(key), value, vlen, 0, 0);
+        safe_send(buffer, len, false);
+        safe_recv_packet(buffer, bufsz);
+        validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_SET,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    }
+
+    close(sock);
+    sock = saved;
+    free(buffer);
+    free(value);
+
+    assert(kill(pid, SIGTERM) == 0);
+    return TEST_PASS;
+}
+
+static enum test_return test_slowlog(void) {
+    in_port_t slowlog_port;
+    pid_t pid = start_server(&slowlog_port, false, 15, "-y1");
+    int saved = sock;
+    const char *key = "test_slowlog";
+    char value[100];
+    char buffer[1024];
+    char val[64];
+    memset(value, 'x', sizeof(value));
+
+    sock = connect_server("127.0.0.1", slowlog_port, false);
+    assert(sock != -1);
+
+    size_t len = storage_command(buffer, sizeof(buffer), PROTOCOL_BINARY_CMD_SET,
+                                 key, strlen(key), value, sizeof(value), 0, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, sizeof(buffer));
+    validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    len = raw_command(buffer, sizeof(buffer), PROTOCOL_BINARY_CMD_GET,
+                      key, strlen(key), NULL, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, sizeof(buffer));
+    validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /* Every request is sampled: the set is 0 and the get 1 */
+    assert(get_group_stat("slowlog", "sample") == 1);
+    assert(get_group_stat("slowlog", "recorded") >= 2);
+    assert(get_group_stat_str("slowlog", "0:opcode", val, sizeof(val)));
+    assert(strcmp(val, "set") == 0);
+    assert(get_group_stat("slowlog", "0:value_size") == sizeof(value));
+    assert(get_group_stat_str("slowlog", "1:opcode", val, sizeof(val)));
+    assert(strcmp(val, "get") == 0);
+    assert(get_group_stat_str("slowlog", "1:key", val, sizeof(val)));
+    assert(strcmp(val, key) == 0);
+    assert(get_group_stat("slowlog", "1:key_len") == strlen(key));
+    assert(get_group_stat("slowlog", "1:value_size") == sizeof(value));
+    assert(get_group_stat_str("slowlog", "1:kind", val, sizeof(val)));
+    assert(strcmp(val, "sample") == 0);
+    assert(get_group_stat("slowlog", "1:read_usec") >= 0);
+
+    close(sock);
+    sock = saved;
+
+    assert(kill(pid, SIGTERM) == 0);
+    return TEST_PASS;
+}
+
+/*
+ * With -o3,1 a connection hibernates after a second without a request,
+ * wakes up with the next one and is closed after three idle seconds
+ */
+static enum test_return test_idle_timeout(void) {
+    in_port_t idle_port;
+    pid_t pid = start_server(&idle_port, false, 15, "-o3,1");
+    int saved = sock;
+    char byte;
+
+    int idle = connect_server("127.0.0.1", idle_port, false);
+    assert(idle != -1);
+    sock = idle;
+    assert(test_binary_noop() == TEST_PASS);
+    assert(get_group_stat("settings", "idle_timeout") == 3);
+    assert(get_group_stat("settings", "hibernate_timeout") == 1);
+
+    sleep(2);
+    assert(get_stat("conn_hibernations") >= 1);
+    assert(test_binary_noop() == TEST_PASS);
+    assert(get_stat("conn_wakeups") >= 1);
+
+    /* Nothing from us for long enough to get closed */
+    sleep(5);
+    assert(read(idle, &byte, 1) <= 0);
+    close(idle);
+
+    sock = connect_server("127.0.0.1", idle_port, false);
+    assert(sock != -1);
+    assert(get_stat("idle_kicks") >= 1);
+    close(sock);
+    sock = saved;
+
+    assert(kill(pid, SIGTERM) == 0);
+    return TEST_PASS;
+}
+
+#ifdef HAVE_TLS
+/*
+ * Write a self-signed certificate and its key to a PEM file
+ */
+static void write_tls_cert(const char *fname) {
+    EVP_PKEY *pkey = NULL;
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    assert(pctx != NULL);
+    assert(EVP_PKEY_keygen_init(pctx) == 1);
+    assert(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx,
+                                                  NID_X9_62_prime256v1) == 1);
+    assert(EVP_PKEY_keygen(pctx, &pkey) == 1);
+    EVP_PKEY_CTX_free(pctx);
+
+    X509 *x509 = X509_new();
+    assert(x509 != NULL);
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+    X509_set_pubkey(x509, pkey);
+    X509_NAME *name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(x509, name);
+    assert(X509_sign(x509, pkey, EVP_sha256()) > 0);
+
+    FILE *fp = fopen(fname, "w");
+    assert(fp != NULL);
+    assert(PEM_write_X509(fp, x509) == 1);
+    assert(PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0, NULL, NULL) == 1);
+    fclose(fp);
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+}
+
+static enum test_return test_tls(void) {
+    const char *fname = "testapp_tls.pem";
+    write_tls_cert(fname);
+
+    in_port_t plain_port;
+    tls_port = 0;
+    pid_t pid = start_server(&plain_port, false, 15, "-T-1 -Ktestapp_tls.pem");
+    assert(tls_port != 0);
+    int saved = sock;
+    const size_t vlen = 100 * 1024;
+    const char *key = "test_tls";
+    size_t bufsz = vlen + 1024;
+    char *value = malloc(vlen);
+    char *buffer = malloc(bufsz);
+    assert(value != NULL && buffer != NULL);
+    for (size_t ii = 0; ii < vlen; ++ii) {
+        value[ii] = (char)('a' + ii % 23);
+    }
+
+    sock = connect_server("127.0.0.1", tls_port, false);
+    assert(sock != -1);
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    assert(ctx != NULL);
+    tls = SSL_new(ctx);
+    assert(tls != NULL);
+    SSL_set_fd(tls, sock);
+    assert(SSL_connect(tls) == 1);
+
+    /* Big enough for the response to take several records */
+    size_t len = storage_command(buffer, bufsz, PROTOCOL_BINARY_CMD_SET,
+                                 key, strlen(key), value, vlen, 0, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    len = raw_command(buffer, bufsz, PROTOCOL_BINARY_CMD_GET,
+                      key, strlen(key), NULL, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    protocol_binary_response_no_extras *response = (void*)buffer;
+    validate_response_header(response, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(response->message.header.response.bodylen == vlen + 4);
+    assert(memcmp(buffer + sizeof(*response) + 4, value, vlen) == 0);
+
+    assert(get_stat("tls_handshakes") == 1);
+    assert(get_stat("tls_handshake_errors") == 0);
+    assert(get_stat("tls_offloaded") >= 0);
+
+    SSL_free(tls);
+    tls = NULL;
+    SSL_CTX_free(ctx);
+    close(sock);
+
+    /* The plain port is still plain */
+    sock = connect_server("127.0.0.1", plain_port, false);
+    assert(sock != -1);
+    assert(get_stat("tls_handshakes") == 1);
+    close(sock);
+    sock = saved;
+
+    free(buffer);
+    free(value);
+    remove(fname);
+    assert(kill(pid, SIGTERM) == 0);
+    return TEST_PASS;
+}
+#endif
+
+static void sasl_auth(const char *user, const char *password, uint16_t status) {
+    char buffer[512];
+    char data[256];
+    size_t ulen = strlen(user);
+    size_t plen = strlen(password);
+    /* PLAIN: [authzid] \0 username \0 password */
+    data[0] = '\0';
+    memcpy(data + 1, user, ulen);
+    data[ulen + 1] = '\0';
+    memcpy(data + ulen + 2, password, plen);
+
+    size_t len = raw_command(buffer, sizeof(buffer),
+                             PROTOCOL_BINARY_CMD_SASL_AUTH, "PLAIN", 5,
+                             data, ulen + plen + 2);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, sizeof(buffer));
+    validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_SASL_AUTH,
+                             status);
+}
+
+static void isasl_refresh(void) {
+    char buffer[512];
+    size_t len = raw_command(buffer, sizeof(buffer),
+                             PROTOCOL_BINARY_CMD_ISASL_REFRESH,
+                             NULL, 0, NULL, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, sizeof(buffer));
+    validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_ISASL_REFRESH,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+}
+
+static enum test_return test_isasl(void) {
+    const char *fname = "testapp_isasl.pw";
+    FILE *fp = fopen(fname, "w");
+    assert(fp != NULL);
+    fprintf(fp, "alice secret\n");
+    fclose(fp);
+
+    assert(setenv("ISASL_PWFILE", fname, 1) == 0);
+    in_port_t port;
+    pid_t pid = start_server(&port, false, 15, NULL);
+    unsetenv("ISASL_PWFILE");
+    int saved = sock;
+    sock = connect_server("127.0.0.1", port, false);
+    assert(sock != -1);
+
+    sasl_auth("alice", "secret", PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    sasl_auth("alice", "secreT", PROTOCOL_BINARY_RESPONSE_AUTH_ERROR);
+    sasl_auth("alice", "secre", PROTOCOL_BINARY_RESPONSE_AUTH_ERROR);
+    sasl_auth("bob", "secret", PROTOCOL_BINARY_RESPONSE_AUTH_ERROR);
+    assert(get_stat("auth_cmds") == 4);
+    assert(get_stat("auth_errors") == 3);
+    assert(get_stat("auth_ns") > 0);
+    assert(get_stat("auth_users") == 1);
+    assert(get_stat("auth_reloads") == 1);
+
+    /* The file didn't change, so there's nothing to load */
+    isasl_refresh();
+    assert(get_stat("auth_refreshes") == 1);
+    assert(get_stat("auth_reloads") == 1);
+
+    fp = fopen(fname, "w");
+    assert(fp != NULL);
+    fprintf(fp, "alice other\nbob secret\n");
+    fclose(fp);
+    isasl_refresh();
+    assert(get_stat("auth_refreshes") == 2);
+    assert(get_stat("auth_reloads") == 2);
+    assert(get_stat("auth_users") == 2);
+    sasl_auth("alice", "secret", PROTOCOL_BINARY_RESPONSE_AUTH_ERROR);
+    sasl_auth("alice", "other", PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    sasl_auth("bob", "secret", PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    close(sock);
+    sock = saved;
+    remove(fname);
+    assert(kill(pid, SIGTERM) == 0);
+    return TEST_PASS;
+}
+
+static void bulk_pipeline(const char *prefix) {
+    char *send = malloc(20 * 256);
+    assert(send != NULL);
+    size_t len = 0;
+    for (int ii = 0; ii < 20; ++ii) {
+        char key[64];
+        snprintf(key, sizeof(key), "%s_%d", prefix, ii);
+        len += storage_command(send + len, 256, PROTOCOL_BINARY_CMD_SETQ,
+                               key, strlen(key), key, strlen(key), 0, 0);
+    }
+    safe_send(send, len, false);
+    free(send);
+    test_binary_noop();
+}
+
+/*
+ * The connections of a -G user yield once they have used up their -g
+ * budget, the others only after -R requests
+ */
+static enum test_return test_bulk(void) {
+    const char *fname = "testapp_bulk.pw";
+    FILE *fp = fopen(fname, "w");
+    assert(fp != NULL);
+    fprintf(fp, "loader secret\n");
+    fclose(fp);
+
+    assert(setenv("ISASL_PWFILE", fname, 1) == 0);
+    in_port_t port;
+    pid_t pid = start_server(&port, false, 15, "-Gloader -g1");
+    unsetenv("ISASL_PWFILE");
+    int saved = sock;
+    int plain = connect_server("127.0.0.1", port, false);
+    assert(plain != -1);
+    int bulk = connect_server("127.0.0.1", port, false);
+    assert(bulk != -1);
+
+    sock = plain;
+    bulk_pipeline("test_bulk_plain");
+    assert(get_stat("bulk_yields") == 0);
+
+    sock = bulk;
+    sasl_auth("loader", "secret", PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    bulk_pipeline("test_bulk_loader");
+
+    sock = plain;
+    assert(get_stat("bulk_yields") > 0);
+    assert(get_stat("conn_yields") >= get_stat("bulk_yields"));
+
+    close(bulk);
+    close(plain);
+    sock = saved;
+    remove(fname);
+    assert(kill(pid, SIGTERM) == 0);
+    return TEST_PASS;
+}
+
+static enum test_return test_binary_large_item(void) {
+    in_port_t large_port;
+    pid_t pid = start_server(&large_port, false, 15, "-eslab_chunk_max=16384");
+    int saved = sock;
+    const size_t vlen = 300 * 1024;
+    const char *key = "test_large_item";
+    size_t bufsz = 2 * vlen + 1024;
+    char *value = malloc(vlen);
+    char *buffer = malloc(bufsz);
+    assert(value != NULL && buffer != NULL);
+    for (size_t ii = 0; ii < vlen; ++ii) {
+        value[ii] = (char)('a' + ii % 23);
+    }
+
+    sock = connect_server("127.0.0.1", large_port, false);
+    assert(sock != -1);
+
+    /* The value is read into (and sent from) the chunks of the item */
+    size_t len = storage_command(buffer, bufsz, PROTOCOL_BINARY_CMD_SET,
+                                 key, strlen(key), value, vlen, 0, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    len = raw_command(buffer, bufsz, PROTOCOL_BINARY_CMD_APPEND,
+                      key, strlen(key), value, vlen);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_APPEND,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    len = raw_command(buffer, bufsz, PROTOCOL_BINARY_CMD_GET,
+                      key, strlen(key), NULL, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    protocol_binary_response_get *rsp = (void*)buffer;
+    validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(rsp->message.header.response.bodylen == 2 * vlen + 4);
+    assert(memcmp(buffer + sizeof(rsp->bytes), value, vlen) == 0);
+    assert(memcmp(buffer + sizeof(rsp->bytes) + vlen, value, vlen) == 0);
+
+    /*
+     * A run of them sent at once: the end of each value is read together
+     * with the start of the next request
+     */
+    const int nitems = 8;
+    char *run = malloc(nitems * (vlen + 128) + 128);
+    assert(run != NULL);
+    len = 0;
+    for (int ii = 0; ii < nitems; ++ii) {
+        char k[32];
+        snprintf(k, sizeof(k), "%s_%d", key, ii);
+        len += storage_command(run + len, vlen + 128, PROTOCOL_BINARY_CMD_SETQ,
+                               k, strlen(k), value + ii, vlen - ii * 1000,
+                               0, 0);
+    }
+    len += raw_command(run + len, 128, PROTOCOL_BINARY_CMD_NOOP,
+                       NULL, 0, NULL, 0);
+    safe_send(run, len, false);
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    free(run);
+
+    for (int ii = 0; ii < nitems; ++ii) {
+        char k[32];
+        snprintf(k, sizeof(k), "%s_%d", key, ii);
+        len = raw_command(buffer, bufsz, PROTOCOL_BINARY_CMD_GET,
+                          k, strlen(k), NULL, 0);
+        safe_send(buffer, len, false);
+        safe_recv_packet(buffer, bufsz);
+        validate_response_header((void*)buffer, PROTOCOL_BINARY_CMD_GET,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        assert(rsp->message.header.response.bodylen == vlen - ii * 1000 + 4);
+        assert(memcmp(buffer + sizeof(rsp->bytes), value + ii,
+                      vlen - ii * 1000) == 0);
+    }
+
+    close(sock);
+    sock = saved;
+    free(buffer);
+    free(value);
+
+    assert(kill(pid, SIGTERM) == 0);
+    return TEST_PASS;
+}
+
 struct testcase testcases[] = {
     { "cache_create", cache_create_test },
     { "cache_constructor", cache_constructor_test },
@@ -2221,13 +4091,33 @@ struct testcase testcases[] = {
     { "cache_destructor", cache_destructor_test },
     { "cache_reuse", cache_reuse_test },
     { "cache_redzone", cache_redzone_test },
+    { "cache_magazine", cache_magazine_test },
+    { "timer_wheel", timer_wheel_test },
+    { "taskpool", taskpool_test },
     { "issue_161", test_issue_161 },
+    { "heap_profile", test_heap_profile },
     { "strtof", test_safe_strtof },
     { "strtol", test_safe_strtol },
     { "strtoll", test_safe_strtoll },
     { "strtoul", test_safe_strtoul },
     { "strtoull", test_safe_strtoull },
     { "issue_44", test_issue_44 },
+    { "reuseport", test_reuseport },
+    { "conn_placement", test_conn_placement },
+    { "thread_scaling", test_thread_scaling },
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    { "cpu_affinity", test_cpu_affinity },
+#endif
+    { "io_uring", test_io_uring },
+    { "zerocopy", test_zerocopy },
+    { "slowlog", test_slowlog },
+    { "idle_timeout", test_idle_timeout },
+#ifdef HAVE_TLS
+    { "tls", test_tls },
+#endif
+    { "isasl", test_isasl },
+    { "bulk", test_bulk },
+    { "binary_large_item", test_binary_large_item },
     { "vperror", test_vperror },
     { "config_parser", test_config_parser },
     /* The following tests all run towards the same server */
@@ -2249,6 +4139,9 @@ struct testcase testcases[] = {
     { "binary_getq", test_binary_getq },
     { "binary_getk", test_binary_getk },
     { "binary_getkq", test_binary_getkq },
+    { "binary_getkq_pipeline", test_binary_getkq_pipeline },
+    { "binary_pipeline_responses", test_binary_pipeline_responses },
+    { "binary_setq_pipeline", test_binary_setq_pipeline },
     { "binary_incr", test_binary_incr },
     { "binary_incrq", test_binary_incrq },
     { "binary_decr", test_binary_decr },
@@ -2266,11 +4159,23 @@ struct testcase testcases[] = {
     { "binary_prepend", test_binary_prepend },
     { "binary_prependq", test_binary_prependq },
     { "binary_stat", test_binary_stat },
+    { "binary_idle_buffers", test_binary_idle_buffers },
+    { "binary_stat_timings", test_binary_stat_timings },
+    { "binary_stat_states", test_binary_stat_states },
+    { "binary_stat_clients", test_binary_stat_clients },
+    { "binary_stat_detail", test_binary_stat_detail },
+    { "binary_stats_subscribe", test_binary_stats_subscribe },
     { "binary_scrub", test_binary_scrub },
     { "binary_verbosity", test_binary_verbosity },
     { "binary_read", test_binary_read },
     { "binary_write", test_binary_write },
     { "binary_bad_tap_ttl", test_binary_bad_tap_ttl },
+    { "binary_tap_flow_control", test_binary_tap_flow_control },
+    { "binary_tap_compression", test_binary_tap_compression },
+    { "ascii", test_ascii },
+#ifdef TCP_CORK
+    { "tcp_cork", test_tcp_cork },
+#endif
     { "binary_pipeline_hickup", test_binary_pipeline_hickup },
     { "stop_server", stop_memcached_server },
     { NULL, NULL }
@@ -6,6 +6,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "basic_engine_testsuite.h"
 
 struct test_harness test_harness;
@@ -200,6 +202,97 @@ static enum test_result prepend_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static uint64_t append_slack_bytes;
+static uint64_t append_in_place;
+static void append_stats_handler(const char *key, const uint16_t klen,
+                                 const char *val, const uint32_t vlen,
+                                 const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 18 && memcmp(key, "append_slack_bytes", klen) == 0) {
+        append_slack_bytes = strtoull(buffer, NULL, 10);
+    } else if (klen == 15 && memcmp(key, "append_in_place", klen) == 0) {
+        append_in_place = strtoull(buffer, NULL, 10);
+    }
+}
+
+static void append_value(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                         const char *key, const char *value,
+                         ENGINE_STORE_OPERATION operation, uint64_t *cas) {
+    item *it;
+    item_info info = { .nvalue = 1 };
+    assert(h1->allocate(h, NULL, &it, key, strlen(key), strlen(value),
+                        0, 0) == ENGINE_SUCCESS);
+    assert(h1->get_item_info(h, NULL, it, &info) == true);
+    memcpy(info.value[0].iov_base, value, strlen(value));
+    assert(h1->store(h, NULL, it, cas, operation, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+}
+
+static bool value_equals(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                         item *it, const char *value, uint64_t cas) {
+    item_info info = { .nvalue = 1 };
+    assert(h1->get_item_info(h, NULL, it, &info) == true);
+    return info.cas == cas && info.nvalue == 1 &&
+        info.value[0].iov_len == strlen(value) &&
+        memcmp(info.value[0].iov_base, value, strlen(value)) == 0;
+}
+
+/*
+ * With append_slack the appends and prepends go in place once the item
+ * has room for them, unless someone else has a reference to it
+ */
+static enum test_result append_slack_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *key = "append_slack_test";
+    char expected[256] = "x";
+    uint64_t cas = 0, prev;
+    item *it;
+
+    append_value(h, h1, key, "x", OPERATION_SET, &cas);
+    for (int ii = 0; ii < 100; ++ii) {
+        prev = cas;
+        if (ii % 10 == 9) {
+            memmove(expected + 1, expected, strlen(expected) + 1);
+            expected[0] = 'p';
+            append_value(h, h1, key, "p", OPERATION_PREPEND, &cas);
+        } else {
+            strcat(expected, "ab");
+            append_value(h, h1, key, "ab", OPERATION_APPEND, &cas);
+        }
+        assert(cas != prev);
+        assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+        assert(value_equals(h, h1, it, expected, cas));
+        h1->release(h, NULL, it);
+    }
+
+    append_in_place = append_slack_bytes = 0;
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         append_stats_handler) == ENGINE_SUCCESS);
+    assert(append_in_place > 50);
+    assert(append_slack_bytes > 0);
+
+    /* A reader keeps the value it got */
+    char old[256];
+    strcpy(old, expected);
+    prev = cas;
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+    strcat(expected, "ab");
+    append_value(h, h1, key, "ab", OPERATION_APPEND, &cas);
+    assert(value_equals(h, h1, it, old, prev));
+    h1->release(h, NULL, it);
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+    assert(value_equals(h, h1, it, expected, cas));
+    h1->release(h, NULL, it);
+
+    cas = 0;
+    assert(h1->remove(h, NULL, key, strlen(key), &cas, 0) == ENGINE_SUCCESS);
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         append_stats_handler) == ENGINE_SUCCESS);
+    assert(append_slack_bytes == 0);
+    return SUCCESS;
+}
+
 /*
  * Make sure when we can successfully store an item after it has been allocated
  * and that the cas for the stored item has been generated.
@@ -232,6 +325,128 @@ static enum test_result get_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+/*
+ * Look up a batch of keys (bigger than what the engine hashes up front)
+ * where every other key is missing.
+ */
+static enum test_result get_multi_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nkeys = 150;
+    char keys[150][32];
+    get_multi_key req[150];
+
+    assert(h1->get_multi != NULL);
+    for (int ii = 0; ii < nkeys; ++ii) {
+        snprintf(keys[ii], sizeof(keys[ii]), "get_multi_key_%d", ii);
+        if (ii % 2 == 0) {
+            item *it = NULL;
+            uint64_t cas = 0;
+            assert(h1->allocate(h, NULL, &it, keys[ii], strlen(keys[ii]),
+                                1, 0, 0) == ENGINE_SUCCESS);
+            assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        }
+        req[ii].key = keys[ii];
+        req[ii].nkey = (uint16_t)strlen(keys[ii]);
+        req[ii].vbucket = 0;
+    }
+
+    assert(h1->get_multi(h, NULL, req, nkeys) == ENGINE_SUCCESS);
+    for (int ii = 0; ii < nkeys; ++ii) {
+        if (ii % 2 == 0) {
+            item_info info = { .nvalue = 1 };
+            assert(req[ii].status == ENGINE_SUCCESS);
+            assert(h1->get_item_info(h, NULL, req[ii].item, &info));
+            assert(info.nkey == req[ii].nkey);
+            assert(memcmp(info.key, keys[ii], info.nkey) == 0);
+            h1->release(h, NULL, req[ii].item);
+        } else {
+            assert(req[ii].status == ENGINE_KEY_ENOENT);
+            assert(req[ii].item == NULL);
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Allocate and store a batch of items (bigger than what the engine
+ * stores under one lock) with a mix of operations, one of them too big.
+ */
+static enum test_result store_multi_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nkeys = 100;
+    char keys[100][32];
+    allocate_multi_item alloc[100];
+    store_multi_item store[100];
+    static const ENGINE_STORE_OPERATION ops[] = {
+        OPERATION_SET, OPERATION_ADD, OPERATION_ADD, OPERATION_APPEND
+    };
+
+    assert(h1->allocate_multi != NULL && h1->store_multi != NULL);
+    for (int ii = 0; ii < nkeys; ++ii) {
+        snprintf(keys[ii], sizeof(keys[ii]), "store_multi_key_%d", ii);
+        if (ii % 4 == 1 || ii % 4 == 3) {
+            item *it = NULL;
+            uint64_t cas = 0;
+            assert(h1->allocate(h, NULL, &it, keys[ii], strlen(keys[ii]),
+                                1, 0, 0) == ENGINE_SUCCESS);
+            item_info info = { .nvalue = 1 };
+            assert(h1->get_item_info(h, NULL, it, &info));
+            memcpy(info.value[0].iov_base, "a", 1);
+            assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        }
+        alloc[ii].key = keys[ii];
+        alloc[ii].nkey = (uint16_t)strlen(keys[ii]);
+        alloc[ii].nbytes = ii == 50 ? 2 * 1024 * 1024 : 1;
+        alloc[ii].flags = ii;
+        alloc[ii].exptime = 0;
+    }
+
+    assert(h1->allocate_multi(h, NULL, alloc, nkeys) == ENGINE_SUCCESS);
+    int nstore = 0;
+    for (int ii = 0; ii < nkeys; ++ii) {
+        if (ii == 50) {
+            assert(alloc[ii].status == ENGINE_E2BIG);
+            continue;
+        }
+        assert(alloc[ii].status == ENGINE_SUCCESS);
+        item_info info = { .nvalue = 1 };
+        assert(h1->get_item_info(h, NULL, alloc[ii].item, &info));
+        memcpy(info.value[0].iov_base, "b", 1);
+        store[nstore].item = alloc[ii].item;
+        store[nstore].operation = ops[ii % 4];
+        store[nstore].vbucket = 0;
+        ++nstore;
+    }
+
+    assert(h1->store_multi(h, NULL, store, nstore) == ENGINE_SUCCESS);
+    for (int ii = 0, jj = 0; ii < nkeys; ++ii) {
+        const char *expected = "b";
+        if (ii == 50) {
+            continue;
+        }
+        if (ii % 4 == 1) {
+            assert(store[jj].status == ENGINE_NOT_STORED);
+            expected = "a";
+        } else {
+            assert(store[jj].status == ENGINE_SUCCESS);
+            assert(store[jj].cas != 0);
+            if (ii % 4 == 3) {
+                expected = "ab";
+            }
+        }
+        h1->release(h, NULL, store[jj++].item);
+
+        item *it = NULL;
+        item_info info = { .nvalue = 1 };
+        assert(h1->get(h, NULL, &it, keys[ii], strlen(keys[ii]), 0) == ENGINE_SUCCESS);
+        assert(h1->get_item_info(h, NULL, it, &info));
+        assert(info.nbytes == strlen(expected));
+        assert(memcmp(info.value[0].iov_base, expected, info.nbytes) == 0);
+        h1->release(h, NULL, it);
+    }
+    return SUCCESS;
+}
+
 static enum test_result expiry_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *test_item = NULL;
     item *test_item_get = NULL;
@@ -354,6 +569,251 @@ static enum test_result mt_incr_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static void *mt_store_test_main(void *arg) {
+    ENGINE_HANDLE *h = arg;
+    ENGINE_HANDLE_V1 *h1 = arg;
+
+    for (int ii = 0; ii < 2000; ++ii) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "mt_store_key_%d", ii % 97);
+        item *it;
+        uint64_t cas = 0;
+        assert(h1->allocate(h, NULL, &it, key, keylen, 32, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        assert(cas != 0);
+        h1->release(h, NULL, it);
+
+        item *check;
+        if (h1->get(h, NULL, &check, key, keylen, 0) == ENGINE_SUCCESS) {
+            h1->release(h, NULL, check);
+        }
+
+        if ((ii % 7) == 0) {
+            cas = 0;
+            ENGINE_ERROR_CODE ret = h1->remove(h, NULL, key, keylen, &cas, 0);
+            assert(ret == ENGINE_SUCCESS || ret == ENGINE_KEY_ENOENT);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Hammer the engine with concurrent store/get/remove operations on a
+ * small set of keys (so that the threads collide)
+ */
+static enum test_result mt_store_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    pthread_t tid[max_threads];
+
+    if (max_threads < 2) {
+        return SKIPPED;
+    }
+
+    for (int ii = 0; ii < max_threads; ++ii) {
+        assert(pthread_create(&tid[ii], NULL, mt_store_test_main, h) == 0);
+    }
+
+    for (int ii = 0; ii < max_threads; ++ii) {
+        void *ret;
+        assert(pthread_join(tid[ii], &ret) == 0);
+        assert(ret == NULL);
+    }
+
+    return SUCCESS;
+}
+
+struct expand_thread_args {
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *h1;
+    int id;
+};
+
+static void *mt_expand_test_main(void *arg) {
+    struct expand_thread_args *args = arg;
+    ENGINE_HANDLE *h = args->h;
+    ENGINE_HANDLE_V1 *h1 = args->h1;
+
+    for (int ii = 0; ii < 30000; ++ii) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "expand_%d_%d",
+                                 args->id, ii);
+        item *it;
+        uint64_t cas = 0;
+        assert(h1->allocate(h, NULL, &it, key, keylen, 8, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    return NULL;
+}
+
+static int hash_power_level;
+static bool hash_is_moving;
+static void hash_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 16 && memcmp(key, "hash_power_level", klen) == 0) {
+        hash_power_level = atoi(buffer);
+        hash_is_moving = false;
+    } else if ((klen == 17 && memcmp(key, "hash_is_expanding", klen) == 0) ||
+               (klen == 17 && memcmp(key, "hash_is_shrinking", klen) == 0)) {
+        hash_is_moving |= strcmp(buffer, "true") == 0;
+    }
+}
+
+/* Wait for the hash table to get to the given size */
+static void wait_for_hash_power(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                int power) {
+    for (int ii = 0; ii < 1000; ++ii) {
+        assert(h1->get_stats(h, NULL, "hash", 4,
+                             hash_stats_handler) == ENGINE_SUCCESS);
+        if (hash_power_level == power && !hash_is_moving) {
+            return;
+        }
+        usleep(10000);
+    }
+    assert(hash_power_level == power && !hash_is_moving);
+}
+
+/*
+ * Store enough items from multiple threads to make the hash table grow
+ * while it is being used, and verify that we can find all of them
+ */
+static enum test_result mt_expand_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    struct expand_thread_args args[4];
+    pthread_t tid[4];
+
+    for (int ii = 0; ii < 4; ++ii) {
+        args[ii].h = h;
+        args[ii].h1 = h1;
+        args[ii].id = ii;
+        assert(pthread_create(&tid[ii], NULL, mt_expand_test_main, &args[ii]) == 0);
+    }
+
+    for (int ii = 0; ii < 4; ++ii) {
+        void *ret;
+        assert(pthread_join(tid[ii], &ret) == 0);
+        assert(ret == NULL);
+    }
+
+    for (int ii = 0; ii < 4; ++ii) {
+        for (int jj = 0; jj < 30000; ++jj) {
+            char key[32];
+            size_t keylen = snprintf(key, sizeof(key), "expand_%d_%d", ii, jj);
+            item *it;
+            assert(h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        }
+    }
+
+    /* The expansion runs in the background, so it may not be done yet */
+    assert(h1->get_stats(h, NULL, "hash", 4,
+                         hash_stats_handler) == ENGINE_SUCCESS);
+    assert(hash_power_level > 16);
+
+    return SUCCESS;
+}
+
+static void shrink_set(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, int id) {
+    char key[32];
+    size_t keylen = snprintf(key, sizeof(key), "shrink_%d", id);
+    item *it;
+    uint64_t cas = 0;
+    assert(h1->allocate(h, NULL, &it, key, keylen, 8, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+}
+
+/*
+ * Once most of the items are gone for hash_shrink_delay the table
+ * shrinks back to its initial size, and we still find the items left
+ */
+static enum test_result hash_shrink_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 110000;
+    char key[32];
+    item *it;
+
+    for (int ii = 0; ii < nitems; ++ii) {
+        shrink_set(h, h1, ii);
+    }
+    wait_for_hash_power(h, h1, 17);
+
+    for (int ii = 1000; ii < nitems; ++ii) {
+        size_t keylen = snprintf(key, sizeof(key), "shrink_%d", ii);
+        uint64_t cas = 0;
+        assert(h1->remove(h, NULL, key, keylen, &cas, 0) == ENGINE_SUCCESS);
+    }
+    test_harness.time_travel(2);
+    /* The items coming and going check how long the load was low */
+    shrink_set(h, h1, nitems);
+    wait_for_hash_power(h, h1, 16);
+
+    for (int ii = 0; ii < 1000; ++ii) {
+        size_t keylen = snprintf(key, sizeof(key), "shrink_%d", ii);
+        assert(h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    return SUCCESS;
+}
+
+static uint64_t filter_negatives, filter_false_positives;
+static void filter_stats_handler(const char *key, const uint16_t klen,
+                                 const char *val, const uint32_t vlen,
+                                 const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 21 && memcmp(key, "hash_filter_negatives", klen) == 0) {
+        filter_negatives = strtoull(buffer, NULL, 10);
+    } else if (klen == 27 &&
+               memcmp(key, "hash_filter_false_positives", klen) == 0) {
+        filter_false_positives = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * The Bloom filter should answer (almost) all of the gets for the keys we
+ * don't have, and never hide a key we do have
+ */
+static enum test_result bloom_filter_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    uint64_t cas = 0;
+    char key[32];
+    size_t keylen;
+
+    for (int ii = 0; ii < 1000; ++ii) {
+        keylen = snprintf(key, sizeof(key), "filter_test_%d", ii);
+        assert(h1->allocate(h, NULL, &it, key, keylen, 8, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    for (int ii = 0; ii < 1000; ii += 2) {
+        keylen = snprintf(key, sizeof(key), "filter_test_%d", ii);
+        cas = 0;
+        assert(h1->remove(h, NULL, key, keylen, &cas, 0) == ENGINE_SUCCESS);
+    }
+
+    for (int ii = 0; ii < 2000; ++ii) {
+        keylen = snprintf(key, sizeof(key), "filter_test_%d", ii);
+        ENGINE_ERROR_CODE ret = h1->get(h, NULL, &it, key, keylen, 0);
+        if (ii < 1000 && ii % 2 == 1) {
+            assert(ret == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        } else {
+            assert(ret == ENGINE_KEY_ENOENT);
+        }
+    }
+
+    assert(h1->get_stats(h, NULL, "hash", 4,
+                         filter_stats_handler) == ENGINE_SUCCESS);
+    assert(filter_negatives + filter_false_positives == 1500);
+    assert(filter_negatives > 1400);
+    return SUCCESS;
+}
+
 /*
  * Make sure we can arithmetic operations to set the initial value of a key and
  * to then later decrement that value
@@ -374,6 +834,72 @@ static enum test_result decr_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+/*
+ * A counter grows in place as it gets more digits, and a reader keeps
+ * the value it got
+ */
+static enum test_result counter_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *key = "counter_test_key";
+    const struct {
+        bool incr;
+        uint64_t delta;
+        const char *value;
+    } steps[] = {
+        { true, 1, "9" },
+        { true, 1, "10" },
+        { true, 89, "99" },
+        { true, 1, "100" },
+        { false, 91, "9  " },
+        { true, UINT64_MAX - 9, "18446744073709551615" },
+        { true, 1, "0                   " },
+        { true, 12345, "12345               " }
+    };
+    uint64_t cas = 0, res = 0;
+    item *it, *first = NULL;
+
+    assert(h1->arithmetic(h, NULL, key, strlen(key), true, true, 0, 8,
+                          0, &cas, &res, 0) == ENGINE_SUCCESS);
+    assert(res == 8);
+    for (int ii = 0; ii < sizeof(steps) / sizeof(steps[0]); ++ii) {
+        uint64_t prev = cas;
+        assert(h1->arithmetic(h, NULL, key, strlen(key), steps[ii].incr,
+                              false, steps[ii].delta, 0, 0, &cas, &res,
+                              0) == ENGINE_SUCCESS);
+        assert(res == strtoull(steps[ii].value, NULL, 10));
+        assert(cas != prev);
+        assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+        assert(value_equals(h, h1, it, steps[ii].value, cas));
+        /* It's a counter once it outgrows the item it started in, and
+         * it stays where it is from then on */
+        if (ii == 1) {
+            first = it;
+        }
+        assert(ii < 1 || it == first);
+        h1->release(h, NULL, it);
+    }
+
+    /* Someone sending it keeps the old digits */
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+    uint64_t prev = cas;
+    assert(h1->arithmetic(h, NULL, key, strlen(key), true, false, 1, 0,
+                          0, &cas, &res, 0) == ENGINE_SUCCESS);
+    assert(res == 12346);
+    assert(value_equals(h, h1, it, "12345               ", prev));
+    h1->release(h, NULL, it);
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+    assert(it != first);
+    assert(value_equals(h, h1, it, "12346", cas));
+    h1->release(h, NULL, it);
+
+    /* And the new item is a counter too */
+    assert(h1->arithmetic(h, NULL, key, strlen(key), true, false, 99999,
+                          0, 0, &cas, &res, 0) == ENGINE_SUCCESS);
+    assert(h1->get(h, NULL, &first, key, strlen(key), 0) == ENGINE_SUCCESS);
+    assert(value_equals(h, h1, first, "112345", cas));
+    h1->release(h, NULL, first);
+    return SUCCESS;
+}
+
 /*
  * Make sure we can successfully perform a flush operation and that any item
  * stored before the flush can not be retrieved
@@ -390,6 +916,13 @@ static enum test_result flush_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     assert(h1->get(h, NULL, &check_item, key, strlen(key), 0) ==  ENGINE_KEY_ENOENT);
     assert(check_item == NULL);
     h1->release(h, NULL, test_item);
+
+    /* The items stored right after the flush (in the same second) live */
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    assert(h1->get(h, NULL, &check_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, check_item);
     return SUCCESS;
 }
 
@@ -433,78 +966,1010 @@ static enum test_result item_set_cas_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
     return SUCCESS;
 }
 
-uint32_t evictions;
-static void eviction_stats_handler(const char *key, const uint16_t klen,
-                                   const char *val, const uint32_t vlen,
-                                   const void *cookie) {
-    if (memcmp(key, "evictions", klen) == 0) {
-        char buffer[vlen + 1];
-        memcpy(buffer, val, vlen);
-        buffer[vlen] = '\0';
-        evictions = atoi(buffer);
-    }
-}
-
-static enum test_result lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+/*
+ * Read an item through the layout the engine publishes, and check it
+ * says the same as get_item_info
+ */
+static enum test_result item_layout_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *test_item = NULL;
-    const char *hot_key = "hot_key";
+    char *key = "item_layout_test_key";
     uint64_t cas = 0;
-    assert(h1->allocate(h, NULL, &test_item,
-                        hot_key, strlen(hot_key), 4096, 0, 0) == ENGINE_SUCCESS);
-    assert(h1->store(h, NULL, test_item,
-                     &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
-    h1->release(h, NULL, test_item);
+    item_info ii = { .nvalue = 1 };
+    assert(h1->get_item_layout != NULL);
+    const item_layout *l = h1->get_item_layout(h);
+    assert(l != NULL);
 
-    int ii;
-    for (ii = 0; ii < 250; ++ii) {
-        assert(h1->get(h, NULL, &test_item,
-                       hot_key, strlen(hot_key), 0) ==  ENGINE_SUCCESS);
-        h1->release(h, NULL, test_item);
-        char key[1024];
-        size_t keylen = snprintf(key, sizeof(key), "lru_test_key_%08d", ii);
-        assert(h1->allocate(h, NULL, &test_item,
-                            key, keylen, 4096, 0, 0) == ENGINE_SUCCESS);
-        assert(h1->store(h, NULL, test_item,
-                         &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
-        h1->release(h, NULL, test_item);
-        assert(h1->get_stats(h, NULL, NULL, 0,
-                             eviction_stats_handler) == ENGINE_SUCCESS);
-        if (evictions == 2) {
-            break;
-        }
-    }
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 5,
+                        htonl(0xcafe), 10) == ENGINE_SUCCESS);
+    assert(h1->get_item_info(h, NULL, test_item, &ii) == true);
+    memcpy(ii.value[0].iov_base, "value", 5);
+    assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+    assert(h1->get_item_info(h, NULL, test_item, &ii) == true);
 
-    assert(ii < 250);
-    for (int jj = 0; jj <= ii; ++jj) {
-        char key[1024];
-        size_t keylen = snprintf(key, sizeof(key), "lru_test_key_%08d", jj);
-        if (jj == 0 || jj == 1) {
-            assert(h1->get(h, NULL, &test_item,
-                           key, keylen, 0) == ENGINE_KEY_ENOENT);
-        } else {
-            assert(h1->get(h, NULL, &test_item,
-                           key, keylen, 0) == ENGINE_SUCCESS);
-            assert(test_item != NULL);
-            h1->release(h, NULL, test_item);
-        }
+    const char *p = test_item;
+    uint16_t iflag, nkey;
+    uint32_t nbytes, flags;
+    rel_time_t exptime;
+    memcpy(&iflag, p + l->iflag, sizeof(iflag));
+    memcpy(&nkey, p + l->nkey, sizeof(nkey));
+    memcpy(&nbytes, p + l->nbytes, sizeof(nbytes));
+    memcpy(&flags, p + l->flags, sizeof(flags));
+    memcpy(&exptime, p + l->exptime, sizeof(exptime));
+    assert((iflag & l->iflag_indirect) == 0);
+    assert(nkey == ii.nkey && nbytes == ii.nbytes);
+    assert(flags == ii.flags && exptime == ii.exptime);
+    assert(*(const uint8_t*)(p + l->clsid) == ii.clsid);
+
+    const char *k = p + l->header;
+    if (iflag & l->iflag_cas) {
+        uint64_t icas;
+        memcpy(&icas, k, sizeof(icas));
+        assert(icas == cas);
+        k += sizeof(icas);
+    } else {
+        assert(ii.cas == 0);
     }
+    assert(k == ii.key && memcmp(k, key, nkey) == 0);
+    assert(k + nkey == ii.value[0].iov_base);
+    assert(memcmp(k + nkey, "value", 5) == 0);
+    h1->release(h, NULL, test_item);
     return SUCCESS;
 }
 
-static enum test_result get_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    return PENDING;
-}
+/*
+ * Overwrite a range of a value in place, and in a copy while somebody
+ * still holds the item
+ */
+static enum test_result mutate_range_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    const char *key = "mutate_range_test_key";
+    uint64_t cas = 0;
+    item_info info = { .nvalue = 1 };
 
-static enum test_result reset_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    return PENDING;
+    assert(h1->mutate_range != NULL);
+    assert(h1->allocate(h, NULL, &it, key, strlen(key), 10, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->get_item_info(h, NULL, it, &info));
+    memcpy(info.value[0].iov_base, "0123456789", 10);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    uint64_t stored = cas;
+    assert(h1->mutate_range(h, NULL, key, strlen(key), &cas, 2, "ab", 2,
+                            0) == ENGINE_SUCCESS);
+    assert(cas != stored);
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+    assert(h1->get_item_info(h, NULL, it, &info));
+    assert(info.cas == cas);
+    assert(memcmp(info.value[0].iov_base, "01ab456789", 10) == 0);
+
+    /* We hold it, so the engine has to patch a copy */
+    uint64_t held = cas;
+    assert(h1->mutate_range(h, NULL, key, strlen(key), &cas, 0, "xy", 2,
+                            0) == ENGINE_SUCCESS);
+    assert(cas != held);
+    assert(memcmp(info.value[0].iov_base, "01ab456789", 10) == 0);
+    h1->release(h, NULL, it);
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+    assert(h1->get_item_info(h, NULL, it, &info));
+    assert(info.cas == cas);
+    assert(memcmp(info.value[0].iov_base, "xyab456789", 10) == 0);
+    h1->release(h, NULL, it);
+
+    assert(h1->mutate_range(h, NULL, key, strlen(key), &held, 0, "zz", 2,
+                            0) == ENGINE_KEY_EEXISTS);
+    uint64_t any = 0;
+    assert(h1->mutate_range(h, NULL, key, strlen(key), &any, 8, "zzz", 3,
+                            0) == ENGINE_ERANGE);
+    assert(h1->mutate_range(h, NULL, "no_such_key", 11, &any, 0, "z", 1,
+                            0) == ENGINE_KEY_ENOENT);
+    return SUCCESS;
 }
 
-static enum test_result get_stats_struct_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    return PENDING;
+/* The value of an item in (up to 128) pieces */
+typedef union {
+    item_info info;
+    char bytes[sizeof(item_info) + 127 * sizeof(struct iovec)];
+} large_item_info;
+
+static void large_value_fill(item_info *info, size_t offset) {
+    for (int ii = 0; ii < info->nvalue; ++ii) {
+        char *ptr = info->value[ii].iov_base;
+        for (size_t jj = 0; jj < info->value[ii].iov_len; ++jj) {
+            ptr[jj] = (char)('a' + (offset++ % 23));
+        }
+    }
 }
 
-static enum test_result aggregate_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    return PENDING;
+static bool large_value_check(item_info *info, size_t offset) {
+    size_t total = 0;
+    for (int ii = 0; ii < info->nvalue; ++ii) {
+        const char *ptr = info->value[ii].iov_base;
+        for (size_t jj = 0; jj < info->value[ii].iov_len; ++jj) {
+            if (ptr[jj] != (char)('a' + (offset++ % 23))) {
+                return false;
+            }
+        }
+        total += info->value[ii].iov_len;
+    }
+    return total == info->nbytes;
+}
+
+/*
+ * With slab_chunk_max the items that don't fit in the largest slab class
+ * are stored in pieces
+ */
+static enum test_result large_item_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    const char *key = "large_item_test";
+    const size_t nbytes = 300000;
+    uint64_t cas = 0;
+    large_item_info info = { .info = { .nvalue = 1 } };
+
+    assert(h1->allocate(h, NULL, &it, key, strlen(key), 2 * 1024 * 1024,
+                        0, 0) == ENGINE_E2BIG);
+    assert(h1->allocate(h, NULL, &it, key, strlen(key), nbytes,
+                        0, 0) == ENGINE_SUCCESS);
+    /* The value doesn't fit in a single iovec */
+    assert(h1->get_item_info(h, NULL, it, &info.info) == false);
+    info.info.nvalue = 128;
+    assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+    assert(info.info.nvalue > nbytes / 16384);
+    assert(info.info.nbytes == nbytes);
+    large_value_fill(&info.info, 0);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 128;
+    assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+    assert(large_value_check(&info.info, 0));
+    h1->release(h, NULL, it);
+
+    /* Append some more (so that it spans a chunk boundary) */
+    assert(h1->allocate(h, NULL, &it, key, strlen(key), 20000,
+                        0, 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 128;
+    assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+    large_value_fill(&info.info, nbytes);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_APPEND, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 128;
+    assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+    assert(info.info.nbytes == nbytes + 20000);
+    assert(large_value_check(&info.info, 0));
+    h1->release(h, NULL, it);
+
+    /* Store a lot more than fits in the cache, so that we evict them */
+    char buf[32];
+    for (int ii = 0; ii < 400; ++ii) {
+        size_t nkey = snprintf(buf, sizeof(buf), "large_item_%d", ii);
+        assert(h1->allocate(h, NULL, &it, buf, nkey, nbytes + ii,
+                            0, 0) == ENGINE_SUCCESS);
+        info.info.nvalue = 128;
+        assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+        large_value_fill(&info.info, ii);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_KEY_ENOENT);
+    assert(h1->get(h, NULL, &it, buf, strlen(buf), 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 128;
+    assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+    assert(info.info.nbytes == nbytes + 399);
+    assert(large_value_check(&info.info, 399));
+    h1->release(h, NULL, it);
+
+    return SUCCESS;
+}
+
+static uint64_t compressed_items;
+static void compression_stats_handler(const char *key, const uint16_t klen,
+                                      const char *val, const uint32_t vlen,
+                                      const void *cookie) {
+    static const char name[] = "compression:compressed";
+    if (klen == sizeof(name) - 1 && memcmp(key, name, klen) == 0) {
+        char buffer[vlen + 1];
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        compressed_items = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * With compress_min the large values are stored compressed, but we
+ * should never see that from the outside
+ */
+static enum test_result compression_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    const char *key = "compression_test";
+    const size_t sizes[] = { 4000, 300000 };
+    uint64_t cas = 0, res = 0;
+    large_item_info info = { .info = { .nvalue = 128 } };
+
+    for (int ii = 0; ii < 2; ++ii) {
+        assert(h1->allocate(h, NULL, &it, key, strlen(key), sizes[ii],
+                            0, 0) == ENGINE_SUCCESS);
+        info.info.nvalue = 128;
+        assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+        large_value_fill(&info.info, 0);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+
+        compressed_items = 0;
+        assert(h1->get_stats(h, NULL, "compression", 11,
+                             compression_stats_handler) == ENGINE_SUCCESS);
+        assert(compressed_items == ii + 1);
+
+        assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+        info.info.nvalue = 128;
+        assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+        assert(info.info.cas == cas);
+        assert(info.info.nbytes == sizes[ii]);
+        assert(large_value_check(&info.info, 0));
+        h1->release(h, NULL, it);
+    }
+
+    /* The old value is decompressed for an append */
+    assert(h1->allocate(h, NULL, &it, key, strlen(key), 100,
+                        0, 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 128;
+    assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+    large_value_fill(&info.info, sizes[1]);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_APPEND, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 128;
+    assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+    assert(info.info.nbytes == sizes[1] + 100);
+    assert(large_value_check(&info.info, 0));
+    h1->release(h, NULL, it);
+
+    /* A compressed value can't be a number */
+    assert(h1->allocate(h, NULL, &it, key, strlen(key), 200,
+                        0, 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+    memset(info.info.value[0].iov_base, '0', 200);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    assert(h1->arithmetic(h, NULL, key, strlen(key), true, false, 1, 0,
+                          0, &cas, &res, 0) == ENGINE_EINVAL);
+    return SUCCESS;
+}
+
+static uint64_t dedup_hits, dedup_saved, dedup_blobs, dedup_copies;
+static void dedup_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 10 && memcmp(key, "dedup:hits", klen) == 0) {
+        dedup_hits = strtoull(buffer, NULL, 10);
+    } else if (klen == 17 && memcmp(key, "dedup:bytes_saved", klen) == 0) {
+        dedup_saved = strtoull(buffer, NULL, 10);
+    } else if (klen == 11 && memcmp(key, "dedup:blobs", klen) == 0) {
+        dedup_blobs = strtoull(buffer, NULL, 10);
+    } else if (klen == 12 && memcmp(key, "dedup:copies", klen) == 0) {
+        dedup_copies = strtoull(buffer, NULL, 10);
+    }
+}
+
+static void dedup_get_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    dedup_hits = dedup_saved = dedup_blobs = dedup_copies = 0;
+    assert(h1->get_stats(h, NULL, "dedup", 5,
+                         dedup_stats_handler) == ENGINE_SUCCESS);
+}
+
+/*
+ * With dedup_min the items storing the same large value share one copy
+ * of it, and modifying one of them leaves the others alone
+ */
+static enum test_result dedup_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    char key[32];
+    size_t keylen;
+    const size_t sizes[] = { 4000, 300000 };
+    const int ncopies = 3;
+    uint64_t cas[2][3], any = 0;
+    large_item_info info = { .info = { .nvalue = 128 } };
+
+    for (int ii = 0; ii < 2; ++ii) {
+        for (int jj = 0; jj < ncopies; ++jj) {
+            keylen = snprintf(key, sizeof(key), "dedup_test_%d_%d", ii, jj);
+            assert(h1->allocate(h, NULL, &it, key, keylen, sizes[ii],
+                                0, 0) == ENGINE_SUCCESS);
+            info.info.nvalue = 128;
+            assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+            large_value_fill(&info.info, 0);
+            assert(h1->store(h, NULL, it, &cas[ii][jj], OPERATION_SET,
+                             0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        }
+    }
+
+    dedup_get_stats(h, h1);
+    assert(dedup_blobs == 2);
+    assert(dedup_hits == 2 * (ncopies - 1));
+    assert(dedup_saved == (ncopies - 1) * (sizes[0] + sizes[1]));
+
+    for (int ii = 0; ii < 2; ++ii) {
+        for (int jj = 0; jj < ncopies; ++jj) {
+            keylen = snprintf(key, sizeof(key), "dedup_test_%d_%d", ii, jj);
+            assert(h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS);
+            info.info.nvalue = 128;
+            assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+            assert(info.info.cas == cas[ii][jj]);
+            assert(info.info.nbytes == sizes[ii]);
+            assert(large_value_check(&info.info, 0));
+            h1->release(h, NULL, it);
+        }
+    }
+
+    /* An append and a range write get their own copy */
+    assert(h1->allocate(h, NULL, &it, "dedup_test_1_0", 14, 100,
+                        0, 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 128;
+    assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+    large_value_fill(&info.info, sizes[1]);
+    assert(h1->store(h, NULL, it, &any, OPERATION_APPEND, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    any = 0;
+    assert(h1->mutate_range(h, NULL, "dedup_test_0_0", 14, &any, 0, "zz", 2,
+                            0) == ENGINE_SUCCESS);
+
+    dedup_get_stats(h, h1);
+    assert(dedup_copies == 2);
+    assert(dedup_saved == (ncopies - 2) * (sizes[0] + sizes[1]));
+
+    assert(h1->get(h, NULL, &it, "dedup_test_1_0", 14, 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 128;
+    assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+    assert(info.info.nbytes == sizes[1] + 100);
+    assert(large_value_check(&info.info, 0));
+    h1->release(h, NULL, it);
+    assert(h1->get(h, NULL, &it, "dedup_test_0_0", 14, 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 128;
+    assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+    assert(memcmp(info.info.value[0].iov_base, "zzcdef", 6) == 0);
+    h1->release(h, NULL, it);
+    for (int ii = 0; ii < 2; ++ii) {
+        keylen = snprintf(key, sizeof(key), "dedup_test_%d_1", ii);
+        assert(h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS);
+        info.info.nvalue = 128;
+        assert(h1->get_item_info(h, NULL, it, &info.info) == true);
+        assert(info.info.nbytes == sizes[ii]);
+        assert(large_value_check(&info.info, 0));
+        h1->release(h, NULL, it);
+    }
+
+    /* The blobs go with the last items sharing them */
+    for (int ii = 0; ii < 2; ++ii) {
+        for (int jj = 0; jj < ncopies; ++jj) {
+            keylen = snprintf(key, sizeof(key), "dedup_test_%d_%d", ii, jj);
+            any = 0;
+            assert(h1->remove(h, NULL, key, keylen, &any, 0) == ENGINE_SUCCESS);
+        }
+    }
+    dedup_get_stats(h, h1);
+    assert(dedup_blobs == 0);
+    assert(dedup_saved == 0);
+    return SUCCESS;
+}
+
+uint64_t ext_records, ext_fetched;
+static void ext_stats_handler(const char *key, const uint16_t klen,
+                              const char *val, const uint32_t vlen,
+                              const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 19 && memcmp(key, "ext:records_written", klen) == 0) {
+        ext_records = strtoull(buffer, NULL, 10);
+    } else if (klen == 17 && memcmp(key, "ext:items_fetched", klen) == 0) {
+        ext_fetched = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * With ext_path the cold items are moved to a file instead of being
+ * evicted, and read back from it on a get
+ */
+static enum test_result ext_store_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    char path[64], cfg[192], key[32];
+    item *it = NULL;
+    uint64_t cas = 0;
+    size_t keylen;
+    const int nitems = 4000;
+    const size_t nbytes = 2000;
+    int found = 0;
+
+    snprintf(path, sizeof(path), "/tmp/ext_test.%lu", (unsigned long)getpid());
+    snprintf(cfg, sizeof(cfg), "ext_path=%s;cache_size=4194304;"
+             "item_size_max=65536;ext_size=67108864;ext_page_size=262144",
+             path);
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, cfg, true, false);
+
+    for (int ii = 0; ii < nitems; ++ii) {
+        keylen = snprintf(key, sizeof(key), "ext_test_%d", ii);
+        assert(h1->allocate(h, NULL, &it, key, keylen, nbytes, 0,
+                            0) == ENGINE_SUCCESS);
+        item_info info = { .nvalue = 1 };
+        assert(h1->get_item_info(h, NULL, it, &info) == true);
+        large_value_fill(&info, ii);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+        /* give the flusher a chance to keep up */
+        usleep(250);
+    }
+
+    ext_records = 0;
+    assert(h1->get_stats(h, NULL, "ext", 3,
+                         ext_stats_handler) == ENGINE_SUCCESS);
+    assert(ext_records > 0);
+
+    /* Far more than the cache holds (about 1800 of them) */
+    for (int ii = 0; ii < nitems; ++ii) {
+        keylen = snprintf(key, sizeof(key), "ext_test_%d", ii);
+        if (h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS) {
+            item_info info = { .nvalue = 1 };
+            assert(h1->get_item_info(h, NULL, it, &info) == true);
+            assert(info.nbytes == nbytes);
+            assert(large_value_check(&info, ii));
+            h1->release(h, NULL, it);
+            ++found;
+        }
+        /* the items we read back push the others out again */
+        usleep(250);
+    }
+    assert(found > nitems / 2);
+
+    ext_fetched = 0;
+    assert(h1->get_stats(h, NULL, "ext", 3,
+                         ext_stats_handler) == ENGINE_SUCCESS);
+    assert(ext_fetched > 0);
+
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, "", true, false);
+    unlink(path);
+    return SUCCESS;
+}
+
+uint32_t evictions;
+static uint64_t hot_hits, hot_copies;
+static void hot_stats_handler(const char *key, const uint16_t klen,
+                              const char *val, const uint32_t vlen,
+                              const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 8 && memcmp(key, "hot:hits", klen) == 0) {
+        hot_hits = strtoull(buffer, NULL, 10);
+    } else if (klen == 10 && memcmp(key, "hot:copies", klen) == 0) {
+        hot_copies = strtoull(buffer, NULL, 10);
+    }
+}
+
+static void hot_store(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                      const char *key, const char *value) {
+    item *it = NULL;
+    uint64_t cas = 0;
+    assert(h1->allocate(h, NULL, &it, key, strlen(key), strlen(value),
+                        0, 0) == ENGINE_SUCCESS);
+    item_info info = { .nvalue = 1 };
+    assert(h1->get_item_info(h, NULL, it, &info) == true);
+    memcpy(info.value[0].iov_base, value, strlen(value));
+    assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+}
+
+/* Get key a few times, and check that we get value every time */
+static void hot_check(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                      const char *key, const char *value) {
+    for (int ii = 0; ii < 8; ++ii) {
+        item *it = NULL;
+        assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+        item_info info = { .nvalue = 1 };
+        assert(h1->get_item_info(h, NULL, it, &info) == true);
+        assert(info.nbytes == strlen(value));
+        assert(memcmp(info.value[0].iov_base, value, info.nbytes) == 0);
+        h1->release(h, NULL, it);
+    }
+}
+
+/*
+ * The hot keys are served from a copy, which has to go away as soon as
+ * the item is modified in any way
+ */
+static enum test_result hot_cache_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *key = "hot_cache_test_key";
+    uint64_t cas = 0, res = 0;
+    item *it = NULL;
+    /* for the flush at the end (see flush_test) */
+    test_harness.time_travel(3);
+
+    hot_store(h, h1, key, "first");
+    hot_check(h, h1, key, "first");
+    assert(h1->get_stats(h, NULL, "hot", 3,
+                         hot_stats_handler) == ENGINE_SUCCESS);
+    assert(hot_copies == 1);
+    assert(hot_hits > 0);
+
+    /* A copy outlives its removal from the cache */
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+    hot_store(h, h1, key, "second");
+    hot_check(h, h1, key, "second");
+    item_info info = { .nvalue = 1 };
+    assert(h1->get_item_info(h, NULL, it, &info) == true);
+    assert(memcmp(info.value[0].iov_base, "first", 5) == 0);
+    h1->release(h, NULL, it);
+
+    /* Modified in place */
+    hot_store(h, h1, key, "10");
+    hot_check(h, h1, key, "10");
+    assert(h1->arithmetic(h, NULL, key, strlen(key), true, false, 1, 0,
+                          0, &cas, &res, 0) == ENGINE_SUCCESS);
+    assert(res == 11);
+    hot_check(h, h1, key, "11");
+
+    cas = 0;
+    assert(h1->remove(h, NULL, key, strlen(key), &cas, 0) == ENGINE_SUCCESS);
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_KEY_ENOENT);
+
+    hot_store(h, h1, key, "third");
+    hot_check(h, h1, key, "third");
+    assert(h1->flush(h, NULL, 0) == ENGINE_SUCCESS);
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_KEY_ENOENT);
+
+    assert(h1->get_stats(h, NULL, "hot", 3,
+                         hot_stats_handler) == ENGINE_SUCCESS);
+    assert(hot_copies >= 4);
+    return SUCCESS;
+}
+
+static uint64_t lease_waits, lease_woken;
+static void lease_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 11 && memcmp(key, "lease:waits", klen) == 0) {
+        lease_waits = strtoull(buffer, NULL, 10);
+    } else if (klen == 11 && memcmp(key, "lease:woken", klen) == 0) {
+        lease_woken = strtoull(buffer, NULL, 10);
+    }
+}
+
+static ENGINE_ERROR_CODE lease_fill(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                    const void *cookie, const char *key,
+                                    uint64_t token) {
+    item *it = NULL;
+    uint64_t cas = 0;
+    assert(h1->allocate(h, cookie, &it, key, strlen(key), 5,
+                        0, 0) == ENGINE_SUCCESS);
+    item_info info = { .nvalue = 1 };
+    assert(h1->get_item_info(h, cookie, it, &info) == true);
+    memcpy(info.value[0].iov_base, "fresh", 5);
+    h1->item_set_cas(h, cookie, it, token);
+    ENGINE_ERROR_CODE ret = h1->store(h, cookie, it, &cas, OPERATION_CAS, 0);
+    h1->release(h, cookie, it);
+    return ret;
+}
+
+/*
+ * Only the first get to miss a key should go to the backend; the others
+ * wait until it stores the key (or the lease times out)
+ */
+static enum test_result lease_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *key = "lease_test_key";
+    const void *holder = test_harness.create_cookie();
+    const void *waiter = test_harness.create_cookie();
+    item *it = NULL;
+    uint64_t cas = 0;
+
+    assert(h1->get_lease != NULL);
+    assert(h1->get(h, holder, &it, key, strlen(key), 0) == ENGINE_KEY_ENOENT);
+    uint64_t token = h1->get_lease(h, holder, key, strlen(key));
+    assert(token != 0);
+    assert(h1->get_lease(h, waiter, key, strlen(key)) == 0);
+    /* The holder may retry */
+    assert(h1->get(h, holder, &it, key, strlen(key), 0) == ENGINE_KEY_ENOENT);
+
+    test_harness.set_ewouldblock_handling(waiter, false);
+    assert(h1->get(h, waiter, &it, key, strlen(key), 0) == ENGINE_EWOULDBLOCK);
+    test_harness.lock_cookie(waiter);
+    assert(lease_fill(h, h1, holder, key, token) == ENGINE_SUCCESS);
+    test_harness.waitfor_cookie(waiter);
+    test_harness.unlock_cookie(waiter);
+    assert(h1->get(h, waiter, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+    item_info info = { .nvalue = 1 };
+    assert(h1->get_item_info(h, waiter, it, &info) == true);
+    assert(info.nbytes == 5);
+    assert(memcmp(info.value[0].iov_base, "fresh", 5) == 0);
+    h1->release(h, waiter, it);
+
+    /* A delete invalidates the lease of whoever is refreshing the key */
+    assert(h1->remove(h, NULL, key, strlen(key), &cas, 0) == ENGINE_SUCCESS);
+    assert(h1->get(h, holder, &it, key, strlen(key), 0) == ENGINE_KEY_ENOENT);
+    token = h1->get_lease(h, holder, key, strlen(key));
+    assert(token != 0);
+    cas = 0;
+    assert(h1->remove(h, NULL, key, strlen(key), &cas, 0) == ENGINE_KEY_ENOENT);
+    assert(lease_fill(h, h1, holder, key, token) == ENGINE_KEY_ENOENT);
+
+    /* A holder that never comes back loses the lease */
+    assert(h1->get(h, holder, &it, key, strlen(key), 0) == ENGINE_KEY_ENOENT);
+    assert(h1->get(h, waiter, &it, key, strlen(key), 0) == ENGINE_EWOULDBLOCK);
+    test_harness.lock_cookie(waiter);
+    test_harness.time_travel(3);
+    test_harness.waitfor_cookie(waiter);
+    test_harness.unlock_cookie(waiter);
+    assert(h1->get(h, waiter, &it, key, strlen(key), 0) == ENGINE_KEY_ENOENT);
+    assert(h1->get_lease(h, waiter, key, strlen(key)) != 0);
+    assert(h1->get_lease(h, holder, key, strlen(key)) == 0);
+
+    assert(h1->get_stats(h, NULL, "lease", 5,
+                         lease_stats_handler) == ENGINE_SUCCESS);
+    assert(lease_waits == 2);
+    assert(lease_woken == 2);
+
+    test_harness.destroy_cookie(holder);
+    test_harness.destroy_cookie(waiter);
+    return SUCCESS;
+}
+
+static void eviction_stats_handler(const char *key, const uint16_t klen,
+                                   const char *val, const uint32_t vlen,
+                                   const void *cookie) {
+    if (memcmp(key, "evictions", klen) == 0) {
+        char buffer[vlen + 1];
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        evictions = atoi(buffer);
+    }
+}
+
+static enum test_result lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    const char *hot_key = "hot_key";
+    uint64_t cas = 0;
+    assert(h1->allocate(h, NULL, &test_item,
+                        hot_key, strlen(hot_key), 4096, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, test_item,
+                     &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    int ii;
+    for (ii = 0; ii < 250; ++ii) {
+        assert(h1->get(h, NULL, &test_item,
+                       hot_key, strlen(hot_key), 0) ==  ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        char key[1024];
+        size_t keylen = snprintf(key, sizeof(key), "lru_test_key_%08d", ii);
+        assert(h1->allocate(h, NULL, &test_item,
+                            key, keylen, 4096, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        assert(h1->get_stats(h, NULL, NULL, 0,
+                             eviction_stats_handler) == ENGINE_SUCCESS);
+        if (evictions == 2) {
+            break;
+        }
+    }
+
+    assert(ii < 250);
+    for (int jj = 0; jj <= ii; ++jj) {
+        char key[1024];
+        size_t keylen = snprintf(key, sizeof(key), "lru_test_key_%08d", jj);
+        if (jj == 0 || jj == 1) {
+            assert(h1->get(h, NULL, &test_item,
+                           key, keylen, 0) == ENGINE_KEY_ENOENT);
+        } else {
+            assert(h1->get(h, NULL, &test_item,
+                           key, keylen, 0) == ENGINE_SUCCESS);
+            assert(test_item != NULL);
+            h1->release(h, NULL, test_item);
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * With the segmented LRU an item that is hit should survive while we push
+ * a lot of other items through the cache (the plain LRU only bumps an
+ * item once a minute, so it would be evicted)
+ */
+static enum test_result segmented_lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    const char *hot_key = "hot_key";
+    uint64_t cas = 0;
+    assert(h1->allocate(h, NULL, &test_item,
+                        hot_key, strlen(hot_key), 4096, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, test_item,
+                     &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    evictions = 0;
+    for (int ii = 0; ii < 1000 && evictions < 100; ++ii) {
+        assert(h1->get(h, NULL, &test_item,
+                       hot_key, strlen(hot_key), 0) ==  ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        char key[1024];
+        size_t keylen = snprintf(key, sizeof(key), "slru_test_key_%08d", ii);
+        assert(h1->allocate(h, NULL, &test_item,
+                            key, keylen, 4096, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        assert(h1->get_stats(h, NULL, NULL, 0,
+                             eviction_stats_handler) == ENGINE_SUCCESS);
+    }
+
+    assert(evictions >= 100);
+    assert(h1->get(h, NULL, &test_item,
+                   hot_key, strlen(hot_key), 0) ==  ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
+}
+
+static uint64_t admission_rejected;
+static void admission_stats_handler(const char *key, const uint16_t klen,
+                                    const char *val, const uint32_t vlen,
+                                    const void *cookie) {
+    if (klen == 18 && memcmp(key, "admission:rejected", klen) == 0) {
+        char buffer[vlen + 1];
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        admission_rejected = strtoull(buffer, NULL, 10);
+    }
+}
+
+static void admission_set(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                          const char *key) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    assert(h1->allocate(h, NULL, &test_item,
+                        key, strlen(key), 4096, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, test_item,
+                     &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+}
+
+/*
+ * With the admission filter a scan of keys that are set once shouldn't
+ * push out the keys we read (even with the plain LRU)
+ */
+static enum test_result admission_filter_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    char key[64];
+
+    /* Fill the slab class up until it evicts */
+    evictions = 0;
+    for (int ii = 0; ii < 1000 && evictions == 0; ++ii) {
+        snprintf(key, sizeof(key), "admission_fill_%08d", ii);
+        admission_set(h, h1, key);
+        assert(h1->get_stats(h, NULL, NULL, 0,
+                             eviction_stats_handler) == ENGINE_SUCCESS);
+    }
+    assert(evictions > 0);
+
+    for (int ii = 0; ii < 10; ++ii) {
+        snprintf(key, sizeof(key), "admission_hot_%d", ii);
+        admission_set(h, h1, key);
+        for (int jj = 0; jj < 4; ++jj) {
+            assert(h1->get(h, NULL, &test_item,
+                           key, strlen(key), 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, test_item);
+        }
+    }
+
+    uint64_t before = evictions;
+    for (int ii = 0; ii < 1000 && evictions < before + 500; ++ii) {
+        snprintf(key, sizeof(key), "admission_scan_%08d", ii);
+        admission_set(h, h1, key);
+        assert(h1->get_stats(h, NULL, NULL, 0,
+                             eviction_stats_handler) == ENGINE_SUCCESS);
+    }
+    assert(evictions >= before + 500);
+
+    for (int ii = 0; ii < 10; ++ii) {
+        snprintf(key, sizeof(key), "admission_hot_%d", ii);
+        assert(h1->get(h, NULL, &test_item,
+                       key, strlen(key), 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    assert(h1->get_stats(h, NULL, "admission", 9,
+                         admission_stats_handler) == ENGINE_SUCCESS);
+    assert(admission_rejected >= 400);
+    return SUCCESS;
+}
+
+static uint64_t crawler_reclaimed;
+static void crawler_stats_handler(const char *key, const uint16_t klen,
+                                  const char *val, const uint32_t vlen,
+                                  const void *cookie) {
+    static const char suffix[] = ":reclaimed";
+    const size_t slen = sizeof(suffix) - 1;
+    if (klen > slen && memcmp(key + klen - slen, suffix, slen) == 0) {
+        char buffer[vlen + 1];
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        crawler_reclaimed += strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * The LRU crawler should reclaim expired items without anyone looking
+ * them up (and leave the live ones alone)
+ */
+static enum test_result lru_crawler_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[32];
+    size_t keylen;
+
+    for (int ii = 0; ii < 100; ++ii) {
+        keylen = snprintf(key, sizeof(key), "crawler_test_%d", ii);
+        assert(h1->allocate(h, NULL, &test_item, key, keylen, 10, 0,
+                            ii % 2 ? 10 : 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    test_harness.time_travel(11);
+
+    for (int ii = 0; ii < 500; ++ii) {
+        crawler_reclaimed = 0;
+        assert(h1->get_stats(h, NULL, "crawler", 7,
+                             crawler_stats_handler) == ENGINE_SUCCESS);
+        if (crawler_reclaimed == 50) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(crawler_reclaimed == 50);
+
+    for (int ii = 0; ii < 100; ii += 2) {
+        keylen = snprintf(key, sizeof(key), "crawler_test_%d", ii);
+        assert(h1->get(h, NULL, &test_item, key, keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    return SUCCESS;
+}
+
+/*
+ * A flush_all doesn't touch the items, but it wakes up the crawler to
+ * reclaim them
+ */
+static enum test_result lru_crawler_flush_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[32];
+    size_t keylen;
+
+    test_harness.time_travel(3);
+    for (int ii = 0; ii < 100; ++ii) {
+        keylen = snprintf(key, sizeof(key), "crawler_test_%d", ii);
+        assert(h1->allocate(h, NULL, &test_item, key, keylen, 10, 0,
+                            0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    assert(h1->flush(h, NULL, 0) == ENGINE_SUCCESS);
+
+    for (int ii = 0; ii < 500; ++ii) {
+        crawler_reclaimed = 0;
+        assert(h1->get_stats(h, NULL, "crawler", 7,
+                             crawler_stats_handler) == ENGINE_SUCCESS);
+        if (crawler_reclaimed == 100) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(crawler_reclaimed == 100);
+    return SUCCESS;
+}
+
+static enum test_result get_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return PENDING;
+}
+
+static enum test_result reset_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return PENDING;
+}
+
+static enum test_result get_stats_struct_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return PENDING;
+}
+
+static enum test_result aggregate_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return PENDING;
+}
+
+static unsigned int sizes_items, sizes_buckets;
+static void sizes_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    sizes_items += atoi(buffer);
+    sizes_buckets++;
+}
+
+static int fragmentation_classes;
+static uint64_t slack_bytes;
+static void slack_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen > 13 && memcmp(key + klen - 13, "fragmentation", 13) == 0) {
+        double fragmentation = atof(buffer);
+        assert(fragmentation >= 0.0 && fragmentation < 1.0);
+        fragmentation_classes++;
+    } else if (klen > 9 && memcmp(key + klen - 9, "mem_slack", 9) == 0) {
+        slack_bytes += strtoull(buffer, NULL, 10);
+    }
+}
+
+static void stats_sizes(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    sizes_items = sizes_buckets = 0;
+    assert(h1->get_stats(h, NULL, "sizes", 5,
+                         sizes_stats_handler) == ENGINE_SUCCESS);
+}
+
+/*
+ * Verify that "stats sizes" follows the items as they are linked and
+ * unlinked, and that the slab classes report what the items don't fill
+ */
+static enum test_result stats_sizes_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    for (int ii = 0; ii < 100; ++ii) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "sizes_%03d", ii);
+        item *it;
+        uint64_t cas;
+        assert(h1->allocate(h, NULL, &it, key, keylen,
+                            ii < 50 ? 10 : 1000, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    stats_sizes(h, h1);
+    assert(sizes_items == 100);
+    assert(sizes_buckets == 2);
+
+    for (int ii = 0; ii < 50; ++ii) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "sizes_%03d", ii);
+        uint64_t cas = 0;
+        assert(h1->remove(h, NULL, key, keylen, &cas, 0) == ENGINE_SUCCESS);
+    }
+    stats_sizes(h, h1);
+    assert(sizes_items == 50);
+    assert(sizes_buckets == 1);
+
+    /* Replacing an item moves it to the bucket of the new size */
+    item *it;
+    uint64_t cas;
+    assert(h1->allocate(h, NULL, &it, "sizes_099", 9, 10, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    stats_sizes(h, h1);
+    assert(sizes_items == 50);
+    assert(sizes_buckets == 2);
+
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         slack_stats_handler) == ENGINE_SUCCESS);
+    assert(fragmentation_classes >= 2);
+    assert(slack_bytes > 0);
+
+    return SUCCESS;
 }
 
 static protocol_binary_response_header *last_response;
@@ -542,23 +2007,304 @@ static bool response_handler(const void *key, uint16_t keylen,
     ptr += keylen;
     memcpy(ptr, body, bodylen);
 
-    return true;
+    return true;
+}
+
+/*
+ * The engine gives the core its handlers for the commands it implements
+ * (the ones unknown_command does), and they work on the command as taken
+ * apart by the core
+ */
+static enum test_result command_handlers_test(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    ENGINE_COMMAND_HANDLER handlers[0x100] = { NULL };
+    assert(h1->get_command_handlers != NULL);
+    h1->get_command_handlers(h, handlers);
+    assert(handlers[PROTOCOL_BINARY_CMD_TOUCH] != NULL);
+    assert(handlers[PROTOCOL_BINARY_CMD_GAT] != NULL);
+    assert(handlers[PROTOCOL_BINARY_CMD_GATQ] != NULL);
+    assert(handlers[PROTOCOL_BINARY_CMD_SCRUB] != NULL);
+    assert(handlers[PROTOCOL_BINARY_CMD_GET] == NULL);
+    assert(handlers[PROTOCOL_BINARY_CMD_SET] == NULL);
+
+    protocol_binary_request_no_extras scrub = {
+        .message.header.request = {
+            .magic = PROTOCOL_BINARY_REQ,
+            .opcode = PROTOCOL_BINARY_CMD_SCRUB
+        }
+    };
+    engine_command cmd = {
+        .request = &scrub.message.header,
+        .ext = scrub.bytes + sizeof(scrub.bytes),
+        .value = scrub.bytes + sizeof(scrub.bytes)
+    };
+    assert(handlers[PROTOCOL_BINARY_CMD_SCRUB](h, NULL, &cmd,
+                                               response_handler) == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    release_last_response();
+
+    /* A touch without a key */
+    protocol_binary_request_touch touch = {
+        .message.header.request = {
+            .magic = PROTOCOL_BINARY_REQ,
+            .opcode = PROTOCOL_BINARY_CMD_TOUCH,
+            .extlen = 4,
+            .bodylen = htonl(4)
+        },
+        .message.body.expiration = htonl(10)
+    };
+    cmd.request = &touch.message.header;
+    cmd.ext = &touch.message.body;
+    cmd.extlen = 4;
+    cmd.value = touch.bytes + sizeof(touch.bytes);
+    assert(handlers[PROTOCOL_BINARY_CMD_TOUCH](h, NULL, &cmd,
+                                               response_handler) == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    return SUCCESS;
+}
+
+static void ns_bump(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                    const char *prefix, uint16_t status) {
+    ENGINE_COMMAND_HANDLER handlers[0x100] = { NULL };
+    h1->get_command_handlers(h, handlers);
+    assert(handlers[PROTOCOL_BINARY_CMD_NS_BUMP] != NULL);
+
+    protocol_binary_request_no_extras bump = {
+        .message.header.request = {
+            .magic = PROTOCOL_BINARY_REQ,
+            .opcode = PROTOCOL_BINARY_CMD_NS_BUMP,
+            .keylen = htons(strlen(prefix)),
+            .bodylen = htonl(strlen(prefix))
+        }
+    };
+    engine_command cmd = {
+        .request = &bump.message.header,
+        .ext = bump.bytes + sizeof(bump.bytes),
+        .key = prefix,
+        .nkey = strlen(prefix),
+        .value = prefix + strlen(prefix)
+    };
+    assert(handlers[PROTOCOL_BINARY_CMD_NS_BUMP](h, NULL, &cmd,
+                                                 response_handler) == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == status);
+    release_last_response();
+}
+
+/*
+ * Bumping a namespace drops the keys it has (and only those), and the
+ * keys stored after the bump are there
+ */
+static enum test_result namespace_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    static const char *keys[] = { "ns1:a", "ns1:b", "ns2:a", "ns1" };
+    item *test_item = NULL;
+
+    for (int ii = 0; ii < 4; ++ii) {
+        admission_set(h, h1, keys[ii]);
+    }
+    /* The first bump registers the namespace */
+    ns_bump(h, h1, "ns1", PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(h1->get(h, NULL, &test_item, "ns1:a", 5, 0) == ENGINE_KEY_ENOENT);
+    assert(h1->get(h, NULL, &test_item, "ns1:b", 5, 0) == ENGINE_KEY_ENOENT);
+    for (int ii = 2; ii < 4; ++ii) {
+        assert(h1->get(h, NULL, &test_item, keys[ii],
+                       strlen(keys[ii]), 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    admission_set(h, h1, "ns1:a");
+    assert(h1->get(h, NULL, &test_item, "ns1:a", 5, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    ns_bump(h, h1, "ns1", PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(h1->get(h, NULL, &test_item, "ns1:a", 5, 0) == ENGINE_KEY_ENOENT);
+
+    /* A prefix can't have the delimiter in it */
+    ns_bump(h, h1, "ns1:a", PROTOCOL_BINARY_RESPONSE_EINVAL);
+    return SUCCESS;
+}
+
+static enum test_result touch_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    union request {
+        protocol_binary_request_touch touch;
+        char buffer[512];
+    };
+
+    void *key = "get_test_key";
+    size_t keylen = strlen(key);
+    union request r = {
+        .touch = {
+            .message = {
+                .header.request = {
+                    .magic = PROTOCOL_BINARY_REQ,
+                    .opcode = PROTOCOL_BINARY_CMD_TOUCH,
+                    .keylen = htons((uint16_t)keylen),
+                    .extlen = 4,
+                    .datatype = PROTOCOL_BINARY_RAW_BYTES,
+                    .vbucket = 0,
+                    .bodylen = htonl(keylen + 4),
+                    .opaque = 0xdeadbeef,
+                    .cas = 0
+                },
+                .body = {
+                    .expiration = htonl(10)
+                }
+            }
+        }
+    };
+
+    memcpy(r.buffer + sizeof(r.touch.bytes), key, keylen);
+    ENGINE_ERROR_CODE ret;
+    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
+    assert(ret == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    assert(last_response->response.keylen == 0);
+    assert(last_response->response.extlen == 0);
+    assert(last_response->response.bodylen == 0);
+    release_last_response();
+
+    // store and get a key
+    assert(get_test(h, h1) == SUCCESS);
+
+    // Set expiry time to 10 secs..
+    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
+    assert(ret == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(last_response->response.keylen == 0);
+    assert(last_response->response.extlen == 0);
+    assert(last_response->response.bodylen == 0);
+    release_last_response();
+
+    // time-travel 11 secs..
+    test_harness.time_travel(11);
+
+    // The item should have expired now...
+    item *item = NULL;
+    assert(h1->get(h, NULL, &item, key, keylen, 0) == ENGINE_KEY_ENOENT);
+
+    // Verify that it doesn't accept bogus packets. extlen is mandatory
+    r.touch.message.header.request.extlen = 0;
+    r.touch.message.header.request.bodylen = htonl(keylen);
+    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
+    assert(ret == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    // key is mandatory!
+    r.touch.message.header.request.extlen = 4;
+    r.touch.message.header.request.keylen = 0;
+    r.touch.message.header.request.bodylen = htonl(4);
+    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
+    assert(ret == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    return SUCCESS;
+}
+
+static enum test_result gat_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    union request {
+        protocol_binary_request_gat gat;
+        char buffer[512];
+    };
+
+    void *key = "get_test_key";
+    size_t keylen = strlen(key);
+    union request r = {
+        .gat = {
+            .message = {
+                .header.request = {
+                    .magic = PROTOCOL_BINARY_REQ,
+                    .opcode = PROTOCOL_BINARY_CMD_GAT,
+                    .keylen = htons((uint16_t)keylen),
+                    .extlen = 4,
+                    .datatype = PROTOCOL_BINARY_RAW_BYTES,
+                    .vbucket = 0,
+                    .bodylen = htonl(keylen + 4),
+                    .opaque = 0xdeadbeef,
+                    .cas = 0
+                },
+                .body = {
+                    .expiration = htonl(10)
+                }
+            }
+        }
+    };
+
+    memcpy(r.buffer + sizeof(r.gat.bytes), key, keylen);
+    ENGINE_ERROR_CODE ret;
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    assert(ret == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    assert(last_response->response.keylen == 0);
+    assert(last_response->response.extlen == 0);
+    assert(last_response->response.bodylen == 0);
+    release_last_response();
+
+    // store and get a key
+    assert(get_test(h, h1) == SUCCESS);
+
+    // Set expiry time to 10 secs..
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    assert(ret == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(last_response->response.keylen == 0);
+    assert(last_response->response.extlen == 4);
+    assert(ntohl(last_response->response.bodylen) == 5); // get_test sets 1 byte datalen
+    release_last_response();
+
+    // time-travel 11 secs..
+    test_harness.time_travel(11);
+
+    // The item should have expired now...
+    item *item = NULL;
+    assert(h1->get(h, NULL, &item, key, keylen, 0) == ENGINE_KEY_ENOENT);
+
+    // Verify that it doesn't accept bogus packets. extlen is mandatory
+    r.gat.message.header.request.extlen = 0;
+    r.gat.message.header.request.bodylen = htonl(keylen);
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    assert(ret == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    // key is mandatory!
+    r.gat.message.header.request.extlen = 4;
+    r.gat.message.header.request.keylen = 0;
+    r.gat.message.header.request.bodylen = htonl(4);
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    assert(ret == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    return SUCCESS;
 }
 
-static enum test_result touch_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+static enum test_result gatq_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     union request {
-        protocol_binary_request_touch touch;
+        protocol_binary_request_gat gat;
         char buffer[512];
     };
 
     void *key = "get_test_key";
     size_t keylen = strlen(key);
     union request r = {
-        .touch = {
+        .gat = {
             .message = {
                 .header.request = {
                     .magic = PROTOCOL_BINARY_REQ,
-                    .opcode = PROTOCOL_BINARY_CMD_TOUCH,
+                    .opcode = PROTOCOL_BINARY_CMD_GATQ,
                     .keylen = htons((uint16_t)keylen),
                     .extlen = 4,
                     .datatype = PROTOCOL_BINARY_RAW_BYTES,
@@ -574,217 +2320,1239 @@ static enum test_result touch_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
         }
     };
 
-    memcpy(r.buffer + sizeof(r.touch.bytes), key, keylen);
+    memcpy(r.buffer + sizeof(r.gat.bytes), key, keylen);
     ENGINE_ERROR_CODE ret;
-    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    assert(ret == ENGINE_SUCCESS);
+
+    // GATQ is quiet and should not produce any result
+    assert(last_response == NULL);
+
+    // store and get a key
+    assert(get_test(h, h1) == SUCCESS);
+
+    // Set expiry time to 10 secs..
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
     assert(ret == ENGINE_SUCCESS);
     assert(last_response != NULL);
-    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
     assert(last_response->response.keylen == 0);
-    assert(last_response->response.extlen == 0);
-    assert(last_response->response.bodylen == 0);
+    assert(last_response->response.extlen == 4);
+    assert(ntohl(last_response->response.bodylen) == 5); // get_test sets 1 byte datalen
     release_last_response();
 
-    // store and get a key
-    assert(get_test(h, h1) == SUCCESS);
+    // time-travel 11 secs..
+    test_harness.time_travel(11);
+
+    // The item should have expired now...
+    item *item = NULL;
+    assert(h1->get(h, NULL, &item, key, keylen, 0) == ENGINE_KEY_ENOENT);
+
+    // Verify that it doesn't accept bogus packets. extlen is mandatory
+    r.gat.message.header.request.extlen = 0;
+    r.gat.message.header.request.bodylen = htonl(keylen);
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    assert(ret == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    // key is mandatory!
+    r.gat.message.header.request.extlen = 4;
+    r.gat.message.header.request.keylen = 0;
+    r.gat.message.header.request.bodylen = htonl(4);
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    assert(ret == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    return SUCCESS;
+}
+
+static unsigned int slab_pages[64];
+static uint64_t rebalance_moves;
+static uint64_t total_malloced;
+static uint64_t shared_arena_denied;
+static uint64_t pages_released, pages_reused;
+static void slabs_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char k[klen + 1], v[vlen + 1];
+    memcpy(k, key, klen);
+    k[klen] = '\0';
+    memcpy(v, val, vlen);
+    v[vlen] = '\0';
+
+    unsigned int id;
+    char name[32];
+    if (strcmp(k, "rebalance:moves") == 0) {
+        rebalance_moves = strtoull(v, NULL, 10);
+    } else if (strcmp(k, "total_malloced") == 0) {
+        total_malloced = strtoull(v, NULL, 10);
+    } else if (strcmp(k, "shared_arena:denied") == 0) {
+        shared_arena_denied = strtoull(v, NULL, 10);
+    } else if (strcmp(k, "release:released") == 0) {
+        pages_released = strtoull(v, NULL, 10);
+    } else if (strcmp(k, "release:reused") == 0) {
+        pages_reused = strtoull(v, NULL, 10);
+    } else if (sscanf(k, "%u:%31s", &id, name) == 2 && id < 64 &&
+               strcmp(name, "total_pages") == 0) {
+        slab_pages[id] = strtoul(v, NULL, 10);
+    }
+}
+
+static void get_slabs_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    memset(slab_pages, 0, sizeof(slab_pages));
+    rebalance_moves = 0;
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         slabs_stats_handler) == ENGINE_SUCCESS);
+}
+
+static uint16_t reassign_slab_page(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                               uint32_t src, uint32_t dst) {
+    protocol_binary_request_slabs_reassign r = {
+        .message = {
+            .header.request = {
+                .magic = PROTOCOL_BINARY_REQ,
+                .opcode = PROTOCOL_BINARY_CMD_SLABS_REASSIGN,
+                .extlen = 8,
+                .datatype = PROTOCOL_BINARY_RAW_BYTES,
+                .bodylen = htonl(8)
+            },
+            .body = {
+                .src = htonl(src),
+                .dst = htonl(dst)
+            }
+        }
+    };
+
+    assert(h1->unknown_command(h, NULL, &r.message.header,
+                               response_handler) == ENGINE_SUCCESS);
+    uint16_t status = ntohs(last_response->response.status);
+    release_last_response();
+    return status;
+}
+
+/*
+ * Fill a slab class with a few pages, and move one of them over to
+ * another slab class
+ */
+static enum test_result slabs_reassign_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[32];
+    size_t keylen;
+    unsigned int src = 0;
+
+    for (int ii = 0; ii < 40000; ++ii) {
+        keylen = snprintf(key, sizeof(key), "reassign_test_%d", ii);
+        assert(h1->allocate(h, NULL, &test_item, key, keylen, 10, 0,
+                            0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    get_slabs_stats(h, h1);
+    for (unsigned int ii = 0; ii < 63; ++ii) {
+        if (slab_pages[ii] > 1) {
+            src = ii;
+        }
+    }
+    assert(src != 0);
+    unsigned int pages = slab_pages[src];
+    unsigned int dst = src + 1;
+    while (slab_pages[dst] != 0) {
+        ++dst;
+    }
+
+    assert(reassign_slab_page(h, h1, src, src) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    assert(reassign_slab_page(h, h1, 0, dst) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    assert(reassign_slab_page(h, h1, src, dst) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    for (int ii = 0; ii < 500; ++ii) {
+        get_slabs_stats(h, h1);
+        if (rebalance_moves == 1) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(rebalance_moves == 1);
+    assert(slab_pages[src] == pages - 1);
+    assert(slab_pages[dst] == 1);
+
+    /* The items stored in the page are gone, but the rest are still there */
+    int found = 0;
+    for (int ii = 0; ii < 40000; ++ii) {
+        keylen = snprintf(key, sizeof(key), "reassign_test_%d", ii);
+        if (h1->get(h, NULL, &test_item, key, keylen, 0) == ENGINE_SUCCESS) {
+            h1->release(h, NULL, test_item);
+            ++found;
+        }
+    }
+    assert(found > 0 && found < 40000);
+    return SUCCESS;
+}
+
+static uint64_t magazine_hits;
+static uint64_t mem_requested;
+static void magazine_stats_handler(const char *key, const uint16_t klen,
+                                   const char *val, const uint32_t vlen,
+                                   const void *cookie) {
+    static const char suffix[] = ":mem_requested";
+    const size_t slen = sizeof(suffix) - 1;
+    char v[vlen + 1];
+    memcpy(v, val, vlen);
+    v[vlen] = '\0';
+
+    if (klen == 13 && memcmp(key, "magazine:hits", 13) == 0) {
+        magazine_hits = strtoull(v, NULL, 10);
+    } else if (klen > slen && memcmp(key + klen - slen, suffix, slen) == 0) {
+        mem_requested += strtoull(v, NULL, 10);
+    }
+}
+
+/*
+ * Allocations should be served from the thread's magazine, and the
+ * memory accounting must be the same as without the magazines
+ */
+static enum test_result slab_magazine_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[32];
+    size_t keylen;
+
+    for (int ii = 0; ii < 1000; ++ii) {
+        keylen = snprintf(key, sizeof(key), "magazine_test_%d", ii);
+        assert(h1->allocate(h, NULL, &test_item, key, keylen, 10, 0,
+                            0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    magazine_hits = mem_requested = 0;
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         magazine_stats_handler) == ENGINE_SUCCESS);
+    assert(magazine_hits > 0);
+    assert(mem_requested > 0);
+
+    for (int ii = 0; ii < 1000; ++ii) {
+        keylen = snprintf(key, sizeof(key), "magazine_test_%d", ii);
+        cas = 0;
+        assert(h1->remove(h, NULL, key, keylen, &cas, 0) == ENGINE_SUCCESS);
+    }
+
+    magazine_hits = mem_requested = 0;
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         magazine_stats_handler) == ENGINE_SUCCESS);
+    assert(mem_requested == 0);
+    return SUCCESS;
+}
+
+static enum test_result slabs_reassign_disabled_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    assert(reassign_slab_page(h, h1, 1, 2) == PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
+    return SUCCESS;
+}
+
+static bool restart_attached;
+static uint64_t restart_restored;
+static void restart_stats_handler(const char *key, const uint16_t klen,
+                                  const char *val, const uint32_t vlen,
+                                  const void *cookie) {
+    char v[vlen + 1];
+    memcpy(v, val, vlen);
+    v[vlen] = '\0';
+
+    if (klen == 16 && memcmp(key, "restart:attached", 16) == 0) {
+        restart_attached = strcmp(v, "yes") == 0;
+    } else if (klen == 16 && memcmp(key, "restart:restored", 16) == 0) {
+        restart_restored = strtoull(v, NULL, 10);
+    }
+}
+
+static void release_set(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, int id) {
+    char key[32];
+    size_t keylen = snprintf(key, sizeof(key), "release_%d", id);
+    item *it;
+    uint64_t cas = 0;
+    assert(h1->allocate(h, NULL, &it, key, keylen, 4000, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+}
+
+/*
+ * With slab_release the pages left with nothing but free chunks once we
+ * deleted most of the items are given back (and reused when we need
+ * pages again)
+ */
+static enum test_result slab_release_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 4000;
+    char key[32];
+    item *it;
+
+    for (int ii = 0; ii < nitems; ++ii) {
+        release_set(h, h1, ii);
+    }
+    get_slabs_stats(h, h1);
+    uint64_t malloced = total_malloced;
+
+    for (int ii = 10; ii < nitems; ++ii) {
+        size_t keylen = snprintf(key, sizeof(key), "release_%d", ii);
+        uint64_t cas = 0;
+        assert(h1->remove(h, NULL, key, keylen, &cas, 0) == ENGINE_SUCCESS);
+    }
+    for (int ii = 0; ii < 1000 && pages_released < 8; ++ii) {
+        usleep(10000);
+        get_slabs_stats(h, h1);
+    }
+    assert(pages_released >= 8);
+    assert(total_malloced < malloced);
+
+    for (int ii = 0; ii < 10; ++ii) {
+        size_t keylen = snprintf(key, sizeof(key), "release_%d", ii);
+        assert(h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    for (int ii = 10; ii < nitems; ++ii) {
+        release_set(h, h1, ii);
+    }
+    get_slabs_stats(h, h1);
+    assert(pages_reused > 0);
+    return SUCCESS;
+}
+
+#ifndef COMPACT_ITEMS
+/*
+ * An engine in an 8MB shared arena with a soft maximum of 4MB may grow
+ * past it, but not into the last MB of the arena
+ */
+static enum test_result shared_arena_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[32];
+    size_t keylen;
+    const uint64_t mb = 1024 * 1024;
+
+    for (int ii = 0; ii < 100000; ++ii) {
+        keylen = snprintf(key, sizeof(key), "shared_arena_%d", ii);
+        assert(h1->allocate(h, NULL, &test_item, key, keylen, 100, 0,
+                            0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    get_slabs_stats(h, h1);
+    assert(total_malloced > 4 * mb);
+    assert(total_malloced <= 7 * mb);
+    assert(shared_arena_denied > 0);
+    return SUCCESS;
+}
+#endif
+
+static int drain_tap_iterator(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                              const void *cookie, TAP_ITERATOR ti,
+                              int part, int nparts) {
+    int found = 0;
+    tap_event_t e;
+    do {
+        item *it;
+        void *engine_specific;
+        uint16_t nengine_specific;
+        uint8_t ttl;
+        uint16_t flags;
+        uint32_t seqno;
+        uint16_t vbucket;
+        e = ti(h, cookie, &it, &engine_specific, &nengine_specific, &ttl,
+               &flags, &seqno, &vbucket);
+        if (e == TAP_MUTATION) {
+            assert(nparts == 0 || vbucket % nparts == part);
+            h1->release(h, cookie, it);
+            ++found;
+        }
+    } while (e != TAP_DISCONNECT);
+    return found;
+}
+
+/*
+ * Split a backfill in parts (by listing vbuckets), and make sure that
+ * we can have more TAP connections than we used to (10). The items are
+ * sent with the vbucket they were stored in.
+ */
+static enum test_result tap_backfill_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[32];
+    size_t keylen;
+    const int nkeys = 1000;
+    const int nparts = 4;
+    const void *cookies[16];
+    TAP_ITERATOR iters[16];
+
+    for (int ii = 0; ii < nkeys; ++ii) {
+        keylen = snprintf(key, sizeof(key), "tap_backfill_%d", ii);
+        assert(h1->allocate(h, NULL, &test_item, key, keylen, 10, 0,
+                            0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, ii) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    /* part n gets the vbuckets where vb % nparts == n */
+    size_t nlist = 2 + 2 * (65536 / nparts);
+    uint8_t *list = malloc(nlist);
+    assert(list != NULL);
+    for (int ii = 0; ii < 16; ++ii) {
+        cookies[ii] = test_harness.create_cookie();
+        if (ii < nparts) {
+            list[0] = (65536 / nparts) >> 8;
+            list[1] = (65536 / nparts) & 0xff;
+            for (int vb = ii, jj = 2; vb < 65536; vb += nparts, jj += 2) {
+                list[jj] = vb >> 8;
+                list[jj + 1] = vb & 0xff;
+            }
+            iters[ii] = h1->get_tap_iterator(h, cookies[ii], NULL, 0,
+                                             TAP_CONNECT_FLAG_LIST_VBUCKETS,
+                                             list, nlist);
+        } else {
+            iters[ii] = h1->get_tap_iterator(h, cookies[ii], NULL, 0,
+                                             0, NULL, 0);
+        }
+        assert(iters[ii] != NULL);
+    }
+    free(list);
+
+    int found = 0;
+    for (int ii = 0; ii < nparts; ++ii) {
+        int part = drain_tap_iterator(h, h1, cookies[ii], iters[ii],
+                                      ii, nparts);
+        assert(part == nkeys / nparts);
+        found += part;
+    }
+    assert(found == nkeys);
+
+    for (int ii = nparts; ii < 16; ++ii) {
+        assert(drain_tap_iterator(h, h1, cookies[ii], iters[ii],
+                                  0, 0) == nkeys);
+    }
+
+    /* The walkers are released with the engine */
+    return SUCCESS;
+}
+
+static ENGINE_ERROR_CODE vbucket_command(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1,
+                                         uint8_t opcode, uint16_t vbucket,
+                                         vbucket_state_t state) {
+    ENGINE_COMMAND_HANDLER handlers[0x100] = { NULL };
+    h1->get_command_handlers(h, handlers);
+    protocol_binary_request_set_vbucket req = {
+        .message.header.request = {
+            .magic = PROTOCOL_BINARY_REQ,
+            .opcode = opcode,
+            .vbucket = htons(vbucket)
+        },
+        .message.body.state = htonl(state)
+    };
+    engine_command cmd = {
+        .request = &req.message.header,
+        .ext = &req.message.body,
+        .value = &req.message.body
+    };
+    if (opcode == PROTOCOL_BINARY_CMD_SET_VBUCKET) {
+        req.message.header.request.bodylen = htonl(sizeof(state));
+        cmd.nvalue = sizeof(state);
+    }
+    assert(handlers[opcode] != NULL);
+    assert(handlers[opcode](h, NULL, &cmd, response_handler) == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    uint16_t status = ntohs(last_response->response.status);
+    release_last_response();
+    return status == PROTOCOL_BINARY_RESPONSE_SUCCESS ?
+        ENGINE_SUCCESS : ENGINE_FAILED;
+}
+
+static void takeover_store(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                           const char *key, uint16_t vbucket,
+                           ENGINE_ERROR_CODE expect) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 10, 0,
+                        0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, test_item,
+                     &cas, OPERATION_SET, vbucket) == expect);
+    h1->release(h, NULL, test_item);
+}
+
+/*
+ * A takeover sends the backfill of its vbuckets with the changes made
+ * while it runs, and then hands the vbuckets over
+ */
+static enum test_result tap_takeover_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    char key[32];
+    const int nkeys = 50;
+    /* The last event we sent for the key: 1 mutation, 2 deletion */
+    int last[nkeys + 1];
+    memset(last, 0, sizeof(last));
+
+    assert(vbucket_command(h, h1, PROTOCOL_BINARY_CMD_SET_VBUCKET, 1,
+                           vbucket_state_active) == ENGINE_SUCCESS);
+    for (int ii = 0; ii < nkeys; ++ii) {
+        snprintf(key, sizeof(key), "takeover_%d", ii);
+        takeover_store(h, h1, key, 1, ENGINE_SUCCESS);
+        snprintf(key, sizeof(key), "other_%d", ii);
+        takeover_store(h, h1, key, 0, ENGINE_SUCCESS);
+    }
+
+    uint8_t list[] = { 0, 1, 0, 1 };
+    const void *cookie = test_harness.create_cookie();
+    TAP_ITERATOR ti = h1->get_tap_iterator(h, cookie, NULL, 0,
+                                           TAP_CONNECT_FLAG_LIST_VBUCKETS |
+                                           TAP_CONNECT_FLAG_TAKEOVER_VBUCKETS,
+                                           list, sizeof(list));
+    assert(ti != NULL);
+
+    int nevents = 0;
+    int nswitched = 0;
+    tap_event_t e;
+    do {
+        item *it;
+        void *engine_specific;
+        uint16_t nengine_specific;
+        uint8_t ttl;
+        uint16_t flags;
+        uint32_t seqno;
+        uint16_t vbucket;
+        e = ti(h, cookie, &it, &engine_specific, &nengine_specific, &ttl,
+               &flags, &seqno, &vbucket);
+        if (e == TAP_MUTATION || e == TAP_DELETION) {
+            assert(vbucket == 1);
+            item_info info = { .nvalue = 1 };
+            assert(h1->get_item_info(h, cookie, it, &info));
+            int idx = nkeys;
+            if (info.nkey != 12 || memcmp(info.key, "takeover_new", 12) != 0) {
+                assert(info.nkey > 9 && memcmp(info.key, "takeover_", 9) == 0);
+                char buffer[info.nkey - 8];
+                memcpy(buffer, (char*)info.key + 9, info.nkey - 9);
+                buffer[info.nkey - 9] = '\0';
+                idx = atoi(buffer);
+            }
+            last[idx] = e == TAP_MUTATION ? 1 : 2;
+            h1->release(h, cookie, it);
+            if (++nevents == 1) {
+                /* Changes made during the backfill */
+                takeover_store(h, h1, "takeover_new", 1, ENGINE_SUCCESS);
+                uint64_t cas = 0;
+                assert(h1->remove(h, NULL, "takeover_0", 10, &cas,
+                                  1) == ENGINE_SUCCESS);
+            }
+        } else if (e == TAP_VBUCKET_SET) {
+            assert(vbucket == 1 && nengine_specific == sizeof(vbucket_state_t));
+            vbucket_state_t state;
+            memcpy(&state, engine_specific, sizeof(state));
+            assert(ntohl(state) == vbucket_state_active);
+            ++nswitched;
+        }
+    } while (e != TAP_DISCONNECT);
+
+    assert(nswitched == 1);
+    assert(last[0] == 2);
+    for (int ii = 1; ii <= nkeys; ++ii) {
+        assert(last[ii] == 1);
+    }
+
+    /* The vbucket is gone from here, and the others are still here */
+    takeover_store(h, h1, "takeover_0", 1, ENGINE_NOT_MY_VBUCKET);
+    takeover_store(h, h1, "other_0", 0, ENGINE_SUCCESS);
+    return SUCCESS;
+}
+
+struct checkpoint_events {
+    int mutations;
+    int deletions;
+    int checkpoints;
+    /* The seqno of the end we're asked to ack (0 if none) */
+    uint32_t ack;
+};
+
+/* Take the events of a checkpoint stream until it has nothing to send */
+static void checkpoint_drain(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                             const void *cookie, TAP_ITERATOR ti,
+                             struct checkpoint_events *events) {
+    uint64_t started = 0;
+    tap_event_t e;
+    memset(events, 0, sizeof(*events));
+    do {
+        item *it;
+        void *engine_specific;
+        uint16_t nengine_specific;
+        uint8_t ttl;
+        uint16_t flags;
+        uint32_t seqno;
+        uint16_t vbucket;
+        e = ti(h, cookie, &it, &engine_specific, &nengine_specific, &ttl,
+               &flags, &seqno, &vbucket);
+        assert(e != TAP_DISCONNECT);
+        if (e == TAP_PAUSE) {
+            break;
+        }
+        assert(vbucket == 1);
+
+        item_info info = { .nvalue = 1 };
+        assert(h1->get_item_info(h, cookie, it, &info));
+        if (e == TAP_MUTATION) {
+            ++events->mutations;
+        } else if (e == TAP_DELETION) {
+            assert((flags & TAP_FLAG_NO_VALUE) != 0);
+            ++events->deletions;
+        } else {
+            /* The id of the checkpoint, in network byte order */
+            assert(e == TAP_CHECKPOINT_START || e == TAP_CHECKPOINT_END);
+            assert(info.nkey == 0 && info.nbytes == 8);
+            const uint8_t *ptr = info.value[0].iov_base;
+            uint64_t id = 0;
+            for (int ii = 0; ii < 8; ++ii) {
+                id = (id << 8) | ptr[ii];
+            }
+            if (e == TAP_CHECKPOINT_START) {
+                assert(started == 0 && id != 0);
+                started = id;
+            } else {
+                assert(started == id);
+                started = 0;
+                ++events->checkpoints;
+                if ((flags & TAP_FLAG_ACK) != 0) {
+                    events->ack = seqno;
+                }
+            }
+        }
+        h1->release(h, cookie, it);
+    } while (true);
+    assert(started == 0);
+}
+
+static uint64_t checkpoint_resumed;
+static uint64_t checkpoint_backfills;
+static void checkpoint_stats_handler(const char *key, const uint16_t klen,
+                                     const char *val, const uint32_t vlen,
+                                     const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 18 && memcmp(key, "checkpoint:resumed", klen) == 0) {
+        checkpoint_resumed = strtoull(buffer, NULL, 10);
+    } else if (klen == 20 && memcmp(key, "checkpoint:backfills", klen) == 0) {
+        checkpoint_backfills = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * A registered client gets a backfill the first time, and then just the
+ * checkpoints after the last one it acked
+ */
+static enum test_result checkpoint_resume_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    char key[32];
+    const char *name = "replica";
+
+    assert(vbucket_command(h, h1, PROTOCOL_BINARY_CMD_SET_VBUCKET, 1,
+                           vbucket_state_active) == ENGINE_SUCCESS);
+    for (int ii = 0; ii < 10; ++ii) {
+        snprintf(key, sizeof(key), "checkpoint_%d", ii);
+        takeover_store(h, h1, key, 1, ENGINE_SUCCESS);
+        snprintf(key, sizeof(key), "other_%d", ii);
+        takeover_store(h, h1, key, 0, ENGINE_SUCCESS);
+    }
+
+    /* The vbuckets, and no checkpoints of ours */
+    uint8_t userdata[] = { 0, 1, 0, 1, 0, 0 };
+    uint32_t flags = TAP_CONNECT_FLAG_LIST_VBUCKETS | TAP_CONNECT_CHECKPOINT |
+        TAP_CONNECT_REGISTERED_CLIENT;
+    const void *cookie = test_harness.create_cookie();
+    TAP_ITERATOR ti = h1->get_tap_iterator(h, cookie, name, strlen(name),
+                                           flags, userdata, sizeof(userdata));
+    assert(ti != NULL);
+
+    /* The backfill, and the keys changed since the last checkpoint */
+    struct checkpoint_events events;
+    checkpoint_drain(h, h1, cookie, ti, &events);
+    assert(events.mutations > 10 && events.deletions == 0);
+    assert(events.checkpoints == 1 && events.ack != 0);
+    assert(h1->tap_notify(h, cookie, NULL, 0, 0, 0, TAP_ACK, events.ack,
+                          NULL, 0, 0, 0, 0, NULL, 0, 0) == ENGINE_SUCCESS);
+
+    /*
+     * Changes while we're connected, which we don't ack. They wake us up
+     * (the mock server doesn't keep the cookie around for the
+     * notification, so we have to wait for it)
+     */
+    test_harness.lock_cookie(cookie);
+    for (int ii = 0; ii < 3; ++ii) {
+        snprintf(key, sizeof(key), "checkpoint_new_%d", ii);
+        takeover_store(h, h1, key, 1, ENGINE_SUCCESS);
+    }
+    uint64_t cas = 0;
+    assert(h1->remove(h, NULL, "checkpoint_0", 12, &cas, 1) == ENGINE_SUCCESS);
+    takeover_store(h, h1, "other_new", 0, ENGINE_SUCCESS);
+    test_harness.waitfor_cookie(cookie);
+    test_harness.unlock_cookie(cookie);
+    checkpoint_drain(h, h1, cookie, ti, &events);
+    assert(events.mutations == 3 && events.deletions == 1);
+    assert(events.checkpoints >= 1 && events.ack != 0);
+    test_harness.destroy_cookie(cookie);
+
+    /* We get them again, and nothing else */
+    cookie = test_harness.create_cookie();
+    ti = h1->get_tap_iterator(h, cookie, name, strlen(name),
+                              flags, userdata, sizeof(userdata));
+    assert(ti != NULL);
+    checkpoint_drain(h, h1, cookie, ti, &events);
+    assert(events.mutations == 3 && events.deletions == 1);
+    test_harness.destroy_cookie(cookie);
+
+    /* Someone with a checkpoint we no longer have gets a backfill */
+    uint8_t old[] = { 0, 1, 0, 1, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 1 };
+    cookie = test_harness.create_cookie();
+    ti = h1->get_tap_iterator(h, cookie, NULL, 0,
+                              TAP_CONNECT_FLAG_LIST_VBUCKETS |
+                              TAP_CONNECT_CHECKPOINT, old, sizeof(old));
+    assert(ti != NULL);
+    checkpoint_drain(h, h1, cookie, ti, &events);
+    assert(events.mutations >= 12 && events.ack == 0);
+    test_harness.destroy_cookie(cookie);
+
+    h1->get_stats(h, NULL, "checkpoint", 10, checkpoint_stats_handler);
+    assert(checkpoint_resumed == 1);
+    assert(checkpoint_backfills == 2);
+    return SUCCESS;
+}
+
+static uint64_t purge_reclaimed;
+static uint64_t purge_pending;
+static void purge_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 23 && memcmp(key, "vbucket_purge:reclaimed", klen) == 0) {
+        purge_reclaimed = strtoull(buffer, NULL, 10);
+    } else if (klen == 21 && memcmp(key, "vbucket_purge:pending", klen) == 0) {
+        purge_pending = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * The items of a vbucket we remove are reclaimed in the background, and
+ * the ones of the other vbuckets are left alone
+ */
+static enum test_result vbucket_purge_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[32];
+    size_t keylen;
+
+    assert(vbucket_command(h, h1, PROTOCOL_BINARY_CMD_SET_VBUCKET, 1,
+                           vbucket_state_active) == ENGINE_SUCCESS);
+    for (int ii = 0; ii < 200; ++ii) {
+        keylen = snprintf(key, sizeof(key), "vbucket_purge_%d", ii);
+        assert(h1->allocate(h, NULL, &test_item, key, keylen, 10, 0,
+                            0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, ii % 2) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
 
-    // Set expiry time to 10 secs..
-    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
-    assert(ret == ENGINE_SUCCESS);
-    assert(last_response != NULL);
-    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
-    assert(last_response->response.keylen == 0);
-    assert(last_response->response.extlen == 0);
-    assert(last_response->response.bodylen == 0);
-    release_last_response();
+    assert(vbucket_command(h, h1, PROTOCOL_BINARY_CMD_DEL_VBUCKET, 1,
+                           0) == ENGINE_SUCCESS);
+    for (int ii = 0; ii < 500; ++ii) {
+        assert(h1->get_stats(h, NULL, "scrub", 5,
+                             purge_stats_handler) == ENGINE_SUCCESS);
+        if (purge_reclaimed == 100 && purge_pending == 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(purge_reclaimed == 100 && purge_pending == 0);
+
+    assert(vbucket_command(h, h1, PROTOCOL_BINARY_CMD_SET_VBUCKET, 1,
+                           vbucket_state_active) == ENGINE_SUCCESS);
+    for (int ii = 0; ii < 200; ++ii) {
+        keylen = snprintf(key, sizeof(key), "vbucket_purge_%d", ii);
+        ENGINE_ERROR_CODE r = h1->get(h, NULL, &test_item, key, keylen,
+                                      ii % 2);
+        if (ii % 2 == 0) {
+            assert(r == ENGINE_SUCCESS);
+            h1->release(h, NULL, test_item);
+        } else {
+            assert(r == ENGINE_KEY_ENOENT);
+        }
+    }
+    return SUCCESS;
+}
 
-    // time-travel 11 secs..
-    test_harness.time_travel(11);
+static int count_restart_items(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    char key[32];
+    size_t keylen;
+    int found = 0;
 
-    // The item should have expired now...
-    item *item = NULL;
-    assert(h1->get(h, NULL, &item, key, keylen, 0) == ENGINE_KEY_ENOENT);
+    for (int ii = 0; ii < 1000; ++ii) {
+        keylen = snprintf(key, sizeof(key), "restart_test_%d", ii);
+        if (h1->get(h, NULL, &test_item, key, keylen, 0) == ENGINE_SUCCESS) {
+            item_info info = { .nvalue = 1 };
+            assert(h1->get_item_info(h, NULL, test_item, &info) == true);
+            assert(info.value[0].iov_len == sizeof(int));
+            assert(*(int*)info.value[0].iov_base == ii);
+            h1->release(h, NULL, test_item);
+            ++found;
+        }
+    }
+    return found;
+}
 
-    // Verify that it doesn't accept bogus packets. extlen is mandatory
-    r.touch.message.header.request.extlen = 0;
-    r.touch.message.header.request.bodylen = htonl(keylen);
-    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
-    assert(ret == ENGINE_SUCCESS);
-    assert(last_response != NULL);
-    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
-    release_last_response();
+/*
+ * The items stored in a memory file should survive a restart of the
+ * engine, unless the configuration changed
+ */
+static enum test_result restart_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    char path[64], meta[80], cfg[128];
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[32];
+    size_t keylen;
 
-    // key is mandatory!
-    r.touch.message.header.request.extlen = 4;
-    r.touch.message.header.request.keylen = 0;
-    r.touch.message.header.request.bodylen = htonl(4);
-    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
-    assert(ret == ENGINE_SUCCESS);
-    assert(last_response != NULL);
-    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
-    release_last_response();
+    snprintf(path, sizeof(path), "/tmp/restart_test.%lu", (unsigned long)getpid());
+    snprintf(meta, sizeof(meta), "%s.meta", path);
+    snprintf(cfg, sizeof(cfg), "memory_file=%s;cache_size=8388608", path);
+    unlink(path);
+    unlink(meta);
 
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, cfg, true, false);
+    for (int ii = 0; ii < 1000; ++ii) {
+        keylen = snprintf(key, sizeof(key), "restart_test_%d", ii);
+        assert(h1->allocate(h, NULL, &test_item, key, keylen, sizeof(int), 0,
+                            0) == ENGINE_SUCCESS);
+        item_info info = { .nvalue = 1 };
+        assert(h1->get_item_info(h, NULL, test_item, &info) == true);
+        *(int*)info.value[0].iov_base = ii;
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    restart_attached = true;
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         restart_stats_handler) == ENGINE_SUCCESS);
+    assert(!restart_attached);
+
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, cfg, true, false);
+    assert(access(meta, F_OK) != 0);
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         restart_stats_handler) == ENGINE_SUCCESS);
+    assert(restart_attached);
+    assert(restart_restored == 1000);
+    assert(count_restart_items(h, h1) == 1000);
+
+    /* The new items must not overwrite the restored ones */
+    keylen = snprintf(key, sizeof(key), "restart_test_new");
+    assert(h1->allocate(h, NULL, &test_item, key, keylen, 10, 0,
+                        0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    assert(count_restart_items(h, h1) == 1000);
+
+    /* A different configuration gives us an empty cache */
+    snprintf(cfg, sizeof(cfg), "memory_file=%s;cache_size=16777216", path);
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, cfg, true, false);
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         restart_stats_handler) == ENGINE_SUCCESS);
+    assert(!restart_attached);
+    assert(count_restart_items(h, h1) == 0);
+
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, "", true, false);
+    unlink(path);
+    unlink(meta);
     return SUCCESS;
 }
 
-static enum test_result gat_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    union request {
-        protocol_binary_request_gat gat;
-        char buffer[512];
-    };
+static uint64_t snapshot_written;
+static uint64_t snapshot_loaded;
+static uint64_t snapshot_bad_blocks;
+static void snapshot_stats_handler(const char *key, const uint16_t klen,
+                                   const char *val, const uint32_t vlen,
+                                   const void *cookie) {
+    char v[vlen + 1];
+    memcpy(v, val, vlen);
+    v[vlen] = '\0';
+
+    if (klen == 16 && memcmp(key, "snapshot:written", 16) == 0) {
+        snapshot_written = strtoull(v, NULL, 10);
+    } else if (klen == 15 && memcmp(key, "snapshot:loaded", 15) == 0) {
+        snapshot_loaded = strtoull(v, NULL, 10);
+    } else if (klen == 19 && memcmp(key, "snapshot:bad_blocks", 19) == 0) {
+        snapshot_bad_blocks = strtoull(v, NULL, 10);
+    }
+}
 
-    void *key = "get_test_key";
-    size_t keylen = strlen(key);
-    union request r = {
-        .gat = {
-            .message = {
-                .header.request = {
-                    .magic = PROTOCOL_BINARY_REQ,
-                    .opcode = PROTOCOL_BINARY_CMD_GAT,
-                    .keylen = htons((uint16_t)keylen),
-                    .extlen = 4,
-                    .datatype = PROTOCOL_BINARY_RAW_BYTES,
-                    .vbucket = 0,
-                    .bodylen = htonl(keylen + 4),
-                    .opaque = 0xdeadbeef,
-                    .cas = 0
-                },
-                .body = {
-                    .expiration = htonl(10)
-                }
-            }
+static void get_snapshot_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    snapshot_written = snapshot_loaded = snapshot_bad_blocks = 0;
+    assert(h1->get_stats(h, NULL, "snapshot", 8,
+                         snapshot_stats_handler) == ENGINE_SUCCESS);
+}
+
+static uint16_t snapshot_command(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    protocol_binary_request_no_extras r = {
+        .message.header.request = {
+            .magic = PROTOCOL_BINARY_REQ,
+            .opcode = PROTOCOL_BINARY_CMD_SNAPSHOT,
+            .datatype = PROTOCOL_BINARY_RAW_BYTES
         }
     };
-
-    memcpy(r.buffer + sizeof(r.gat.bytes), key, keylen);
-    ENGINE_ERROR_CODE ret;
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    assert(ret == ENGINE_SUCCESS);
-    assert(last_response != NULL);
-    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
-    assert(last_response->response.keylen == 0);
-    assert(last_response->response.extlen == 0);
-    assert(last_response->response.bodylen == 0);
+    assert(h1->unknown_command(h, NULL, &r.message.header,
+                               response_handler) == ENGINE_SUCCESS);
+    uint16_t status = ntohs(last_response->response.status);
     release_last_response();
+    return status;
+}
 
-    // store and get a key
-    assert(get_test(h, h1) == SUCCESS);
-
-    // Set expiry time to 10 secs..
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    assert(ret == ENGINE_SUCCESS);
-    assert(last_response != NULL);
-    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
-    assert(last_response->response.keylen == 0);
-    assert(last_response->response.extlen == 4);
-    assert(ntohl(last_response->response.bodylen) == 5); // get_test sets 1 byte datalen
-    release_last_response();
+/*
+ * The items in a snapshot are there when we start the engine again,
+ * unless the block they're in is damaged
+ */
+static enum test_result snapshot_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    char path[64], cfg[128];
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[32];
+    size_t keylen;
 
-    // time-travel 11 secs..
-    test_harness.time_travel(11);
+    assert(snapshot_command(h, h1) == PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
 
-    // The item should have expired now...
-    item *item = NULL;
-    assert(h1->get(h, NULL, &item, key, keylen, 0) == ENGINE_KEY_ENOENT);
+    snprintf(path, sizeof(path), "/tmp/snapshot_test.%lu", (unsigned long)getpid());
+    snprintf(cfg, sizeof(cfg),
+             "snapshot_file=%s;snapshot_threads=4;slab_chunk_max=16384", path);
+    unlink(path);
 
-    // Verify that it doesn't accept bogus packets. extlen is mandatory
-    r.gat.message.header.request.extlen = 0;
-    r.gat.message.header.request.bodylen = htonl(keylen);
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    assert(ret == ENGINE_SUCCESS);
-    assert(last_response != NULL);
-    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
-    release_last_response();
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, cfg, true, false);
+    get_snapshot_stats(h, h1);
+    assert(snapshot_loaded == 0);
+    for (int ii = 0; ii < 1000; ++ii) {
+        keylen = snprintf(key, sizeof(key), "restart_test_%d", ii);
+        assert(h1->allocate(h, NULL, &test_item, key, keylen, sizeof(int), 0,
+                            0) == ENGINE_SUCCESS);
+        item_info info = { .nvalue = 1 };
+        assert(h1->get_item_info(h, NULL, test_item, &info) == true);
+        *(int*)info.value[0].iov_base = ii;
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    /* And one in pieces */
+    large_item_info info = { .info = { .nvalue = 128 } };
+    assert(h1->allocate(h, NULL, &test_item, "snapshot_large", 14, 300000,
+                        0, 0) == ENGINE_SUCCESS);
+    assert(h1->get_item_info(h, NULL, test_item, &info.info) == true);
+    assert(info.info.nvalue > 1);
+    large_value_fill(&info.info, 0);
+    assert(h1->store(h, NULL, test_item,
+                     &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
 
-    // key is mandatory!
-    r.gat.message.header.request.extlen = 4;
-    r.gat.message.header.request.keylen = 0;
-    r.gat.message.header.request.bodylen = htonl(4);
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    assert(ret == ENGINE_SUCCESS);
-    assert(last_response != NULL);
-    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
-    release_last_response();
+    assert(snapshot_command(h, h1) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    for (int ii = 0; ii < 1000 && snapshot_written == 0; ++ii) {
+        usleep(10000);
+        get_snapshot_stats(h, h1);
+    }
+    assert(snapshot_written == 1);
+
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, cfg, true, false);
+    get_snapshot_stats(h, h1);
+    assert(snapshot_loaded == 1001 && snapshot_bad_blocks == 0);
+    assert(count_restart_items(h, h1) == 1000);
+    assert(h1->get(h, NULL, &test_item, "snapshot_large", 14, 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 128;
+    assert(h1->get_item_info(h, NULL, test_item, &info.info) == true);
+    assert(large_value_check(&info.info, 0));
+    h1->release(h, NULL, test_item);
 
+    /* Damage the block (all of them fit in one), after the 32 bytes of
+     * the file header and the 16 of the block header */
+    FILE *fp = fopen(path, "r+b");
+    assert(fp != NULL);
+    assert(fseek(fp, 32 + 16 + 100, SEEK_SET) == 0);
+    int c = fgetc(fp);
+    assert(c != EOF);
+    assert(fseek(fp, -1, SEEK_CUR) == 0);
+    assert(fputc(c ^ 0xff, fp) != EOF);
+    assert(fclose(fp) == 0);
+
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, cfg, true, false);
+    get_snapshot_stats(h, h1);
+    assert(snapshot_bad_blocks == 1 && snapshot_loaded == 0);
+    assert(count_restart_items(h, h1) == 0);
+
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, "", true, false);
+    unlink(path);
     return SUCCESS;
 }
 
-static enum test_result gatq_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    union request {
-        protocol_binary_request_gat gat;
-        char buffer[512];
-    };
+static uint64_t journal_records;
+static uint64_t journal_commits;
+static uint64_t journal_committed_ops;
+static uint64_t journal_max_batch;
+static uint64_t journal_compactions;
+static uint64_t journal_compact_kept;
+static uint64_t journal_replayed;
+static uint64_t journal_replay_torn;
+static void journal_stats_handler(const char *key, const uint16_t klen,
+                                  const char *val, const uint32_t vlen,
+                                  const void *cookie) {
+    char v[vlen + 1];
+    memcpy(v, val, vlen);
+    v[vlen] = '\0';
+    (void)cookie;
+    if (klen == 15 && memcmp(key, "journal:records", 15) == 0) {
+        journal_records = strtoull(v, NULL, 10);
+    } else if (klen == 15 && memcmp(key, "journal:commits", 15) == 0) {
+        journal_commits = strtoull(v, NULL, 10);
+    } else if (klen == 21 && memcmp(key, "journal:committed_ops", 21) == 0) {
+        journal_committed_ops = strtoull(v, NULL, 10);
+    } else if (klen == 17 && memcmp(key, "journal:max_batch", 17) == 0) {
+        journal_max_batch = strtoull(v, NULL, 10);
+    } else if (klen == 19 && memcmp(key, "journal:compactions", 19) == 0) {
+        journal_compactions = strtoull(v, NULL, 10);
+    } else if (klen == 20 && memcmp(key, "journal:compact_kept", 20) == 0) {
+        journal_compact_kept = strtoull(v, NULL, 10);
+    } else if (klen == 16 && memcmp(key, "journal:replayed", 16) == 0) {
+        journal_replayed = strtoull(v, NULL, 10);
+    } else if (klen == 19 && memcmp(key, "journal:replay_torn", 19) == 0) {
+        journal_replay_torn = strtoull(v, NULL, 10);
+    }
+}
 
-    void *key = "get_test_key";
-    size_t keylen = strlen(key);
-    union request r = {
-        .gat = {
-            .message = {
-                .header.request = {
-                    .magic = PROTOCOL_BINARY_REQ,
-                    .opcode = PROTOCOL_BINARY_CMD_GATQ,
-                    .keylen = htons((uint16_t)keylen),
-                    .extlen = 4,
-                    .datatype = PROTOCOL_BINARY_RAW_BYTES,
-                    .vbucket = 0,
-                    .bodylen = htonl(keylen + 4),
-                    .opaque = 0xdeadbeef,
-                    .cas = 0
-                },
-                .body = {
-                    .expiration = htonl(10)
-                }
-            }
-        }
-    };
+static void get_journal_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    assert(h1->get_stats(h, NULL, "journal", 7,
+                         journal_stats_handler) == ENGINE_SUCCESS);
+}
 
-    memcpy(r.buffer + sizeof(r.gat.bytes), key, keylen);
-    ENGINE_ERROR_CODE ret;
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    assert(ret == ENGINE_SUCCESS);
+#define JOURNAL_THREADS 8
+#define JOURNAL_KEYS 160
+
+static void *journal_store_main(void *arg) {
+    struct expand_thread_args *args = arg;
+    ENGINE_HANDLE *h = args->h;
+    ENGINE_HANDLE_V1 *h1 = args->h1;
+
+    for (int ii = 0; ii < JOURNAL_KEYS; ++ii) {
+        int id = args->id * JOURNAL_KEYS + ii;
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "journal_%d", id);
+        item *it;
+        uint64_t cas = 0;
+        assert(h1->allocate(h, NULL, &it, key, keylen, sizeof(int),
+                            0, 0) == ENGINE_SUCCESS);
+        item_info info = { .nvalue = 1 };
+        assert(h1->get_item_info(h, NULL, it, &info) == true);
+        memcpy(info.value[0].iov_base, &id, sizeof(id));
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        assert(cas != 0);
+        h1->release(h, NULL, it);
+    }
+    return NULL;
+}
 
-    // GATQ is quiet and should not produce any result
-    assert(last_response == NULL);
+static bool journal_value_is(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                             const char *key, const char *value) {
+    item *it;
+    if (h1->get(h, NULL, &it, key, strlen(key), 0) != ENGINE_SUCCESS) {
+        return false;
+    }
+    item_info info = { .nvalue = 1 };
+    uint64_t cas = 0;
+    if (h1->get_item_info(h, NULL, it, &info)) {
+        cas = info.cas;
+    }
+    bool ret = value_equals(h, h1, it, value, cas);
+    h1->release(h, NULL, it);
+    return ret;
+}
 
-    // store and get a key
-    assert(get_test(h, h1) == SUCCESS);
+static void journal_check(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *it;
+    for (int id = 0; id < JOURNAL_THREADS * JOURNAL_KEYS; ++id) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "journal_%d", id);
+        ENGINE_ERROR_CODE ret = h1->get(h, NULL, &it, key, keylen, 0);
+        if (id == 0) {
+            assert(ret == ENGINE_KEY_ENOENT);
+            continue;
+        }
+        assert(ret == ENGINE_SUCCESS);
+        item_info info = { .nvalue = 1 };
+        assert(h1->get_item_info(h, NULL, it, &info) == true);
+        assert(info.value[0].iov_len == sizeof(int));
+        assert(memcmp(info.value[0].iov_base, &id, sizeof(id)) == 0);
+        h1->release(h, NULL, it);
+    }
+    assert(h1->get(h, NULL, &it, "journal_flushed", 15, 0) == ENGINE_KEY_ENOENT);
+    assert(journal_value_is(h, h1, "journal_counter", "15"));
+    assert(journal_value_is(h, h1, "journal_append", "foobar"));
+}
 
-    // Set expiry time to 10 secs..
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    assert(ret == ENGINE_SUCCESS);
-    assert(last_response != NULL);
-    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
-    assert(last_response->response.keylen == 0);
-    assert(last_response->response.extlen == 4);
-    assert(ntohl(last_response->response.bodylen) == 5); // get_test sets 1 byte datalen
-    release_last_response();
+/*
+ * What we store through the journal engine is there when we start it
+ * again: the changes of the clients are committed in groups, the log is
+ * replayed by several threads and compacted in the background, and a
+ * torn record at the end of it is dropped
+ */
+static enum test_result journal_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    char engine[PATH_MAX], path[64], file[80], cfg[256];
+    item *it;
+    uint64_t cas = 0, result = 0;
+
+    /* It sits next to the default engine */
+    const char *slash = strrchr(test_harness.engine_path, '/');
+    size_t ndir = slash == NULL ? 0 : (size_t)(slash - test_harness.engine_path) + 1;
+    snprintf(engine, sizeof(engine), "%.*s%s", (int)ndir,
+             test_harness.engine_path, "journal_engine.so");
+    snprintf(path, sizeof(path), "/tmp/journal_test.%lu", (unsigned long)getpid());
+    const char *suffixes[] = { "", ".base", ".old" };
+    for (int ii = 0; ii < 3; ++ii) {
+        snprintf(file, sizeof(file), "%s%s", path, suffixes[ii]);
+        unlink(file);
+    }
+    snprintf(cfg, sizeof(cfg),
+             "journal_file=%s;journal_interval=5;journal_replay_threads=4", path);
 
-    // time-travel 11 secs..
-    test_harness.time_travel(11);
+    /* The flush needs a current time it can go back a second from (the
+     * one of the mock server starts over with every engine) */
+    test_harness.time_travel(3);
+    test_harness.reload_engine(&h, &h1, engine, cfg, true, false);
+    append_value(h, h1, "journal_flushed", "gone", OPERATION_SET, &cas);
+    assert(h1->flush(h, NULL, 0) == ENGINE_SUCCESS);
 
-    // The item should have expired now...
-    item *item = NULL;
-    assert(h1->get(h, NULL, &item, key, keylen, 0) == ENGINE_KEY_ENOENT);
+    pthread_t tid[JOURNAL_THREADS];
+    struct expand_thread_args args[JOURNAL_THREADS];
+    for (int ii = 0; ii < JOURNAL_THREADS; ++ii) {
+        args[ii] = (struct expand_thread_args){ .h = h, .h1 = h1, .id = ii };
+        assert(pthread_create(&tid[ii], NULL, journal_store_main, &args[ii]) == 0);
+    }
+    for (int ii = 0; ii < JOURNAL_THREADS; ++ii) {
+        assert(pthread_join(tid[ii], NULL) == 0);
+    }
+    cas = 0;
+    assert(h1->remove(h, NULL, "journal_0", 9, &cas, 0) == ENGINE_SUCCESS);
+    assert(h1->arithmetic(h, NULL, "journal_counter", 15, true, true, 5, 10, 0,
+                          &cas, &result, 0) == ENGINE_SUCCESS);
+    assert(result == 10);
+    assert(h1->arithmetic(h, NULL, "journal_counter", 15, true, false, 5, 0, 0,
+                          &cas, &result, 0) == ENGINE_SUCCESS);
+    assert(result == 15);
+    append_value(h, h1, "journal_append", "foo", OPERATION_SET, &cas);
+    append_value(h, h1, "journal_append", "bar", OPERATION_APPEND, &cas);
+
+    /* A commit for more than one of them */
+    get_journal_stats(h, h1);
+    uint64_t records = JOURNAL_THREADS * JOURNAL_KEYS + 7;
+    assert(journal_records == records && journal_committed_ops == records);
+    assert(journal_commits < records && journal_max_batch > 1);
+
+    test_harness.reload_engine(&h, &h1, engine, cfg, true, false);
+    get_journal_stats(h, h1);
+    assert(journal_replayed == records);
+    journal_check(h, h1);
+
+    /* Compact it: the next commit starts a new log */
+    strcat(cfg, ";journal_compact_size=1");
+    test_harness.reload_engine(&h, &h1, engine, cfg, true, false);
+    append_value(h, h1, "journal_compact", "x", OPERATION_SET, &cas);
+    cas = 0;
+    assert(h1->remove(h, NULL, "journal_compact", 15, &cas, 0) == ENGINE_SUCCESS);
+    for (int ii = 0; ii < 1000 && journal_compactions == 0; ++ii) {
+        usleep(10000);
+        get_journal_stats(h, h1);
+    }
+    assert(journal_compactions == 1);
+    /* The keys we stored but journal_0, the counter, the one we append to
+     * and the one the log we compacted had a set of */
+    records = JOURNAL_THREADS * JOURNAL_KEYS + 2;
+    assert(journal_compact_kept == records);
+
+    /* And tear the last record */
+    cfg[strlen(cfg) - strlen(";journal_compact_size=1")] = '\0';
+    test_harness.reload_engine(&h, &h1, engine, cfg, true, false);
+    append_value(h, h1, "journal_torn", "torn", OPERATION_SET, &cas);
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, "", true, false);
+    struct stat st;
+    assert(stat(path, &st) == 0 && st.st_size > 1);
+    assert(truncate(path, st.st_size - 1) == 0);
+
+    test_harness.reload_engine(&h, &h1, engine, cfg, true, false);
+    get_journal_stats(h, h1);
+    assert(journal_replay_torn == 1);
+    assert(journal_replayed == records + 1);
+    assert(h1->get(h, NULL, &it, "journal_torn", 12, 0) == ENGINE_KEY_ENOENT);
+    assert(h1->get(h, NULL, &it, "journal_compact", 15, 0) == ENGINE_KEY_ENOENT);
+    journal_check(h, h1);
+
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, "", true, false);
+    for (int ii = 0; ii < 3; ++ii) {
+        snprintf(file, sizeof(file), "%s%s", path, suffixes[ii]);
+        unlink(file);
+    }
+    return SUCCESS;
+}
 
-    // Verify that it doesn't accept bogus packets. extlen is mandatory
-    r.gat.message.header.request.extlen = 0;
-    r.gat.message.header.request.bodylen = htonl(keylen);
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    assert(ret == ENGINE_SUCCESS);
-    assert(last_response != NULL);
-    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
-    release_last_response();
+static uint64_t startup_prefault_bytes;
+static uint64_t startup_prefault_threads;
+static uint64_t startup_prefault_usec;
+static uint64_t startup_total_usec;
+static void startup_stats_handler(const char *key, const uint16_t klen,
+                                  const char *val, const uint32_t vlen,
+                                  const void *cookie) {
+    char v[vlen + 1];
+    memcpy(v, val, vlen);
+    v[vlen] = '\0';
+    (void)cookie;
+    if (klen == 22 && memcmp(key, "startup:prefault_bytes", 22) == 0) {
+        startup_prefault_bytes = strtoull(v, NULL, 10);
+    } else if (klen == 24 && memcmp(key, "startup:prefault_threads", 24) == 0) {
+        startup_prefault_threads = strtoull(v, NULL, 10);
+    } else if (klen == 21 && memcmp(key, "startup:prefault_usec", 21) == 0) {
+        startup_prefault_usec = strtoull(v, NULL, 10);
+    } else if (klen == 18 && memcmp(key, "startup:total_usec", 18) == 0) {
+        startup_total_usec = strtoull(v, NULL, 10);
+    }
+}
 
-    // key is mandatory!
-    r.gat.message.header.request.extlen = 4;
-    r.gat.message.header.request.keylen = 0;
-    r.gat.message.header.request.bodylen = htonl(4);
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    assert(ret == ENGINE_SUCCESS);
-    assert(last_response != NULL);
-    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
-    release_last_response();
+/*
+ * With prefault_threads the arena we preallocate is touched at startup,
+ * and "stats startup" tells how long it took
+ */
+static enum test_result prefault_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    uint64_t cas = 0;
+    item *it;
 
+    assert(h1->get_stats(h, NULL, "startup", 7,
+                         startup_stats_handler) == ENGINE_SUCCESS);
+    assert(startup_prefault_threads == 4);
+    assert(startup_prefault_bytes > 0);
+    assert(startup_total_usec >= startup_prefault_usec);
+
+    /* The memory is still ours to use */
+    append_value(h, h1, "prefault_test", "value", OPERATION_SET, &cas);
+    assert(h1->get(h, NULL, &it, "prefault_test", 13, 0) == ENGINE_SUCCESS);
+    assert(value_equals(h, h1, it, "value", cas));
+    h1->release(h, NULL, it);
+
+    /* Without it nothing is touched */
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path,
+                               "preallocate=true;cache_size=33554432", true, false);
+    startup_prefault_threads = startup_prefault_bytes = 1;
+    assert(h1->get_stats(h, NULL, "startup", 7,
+                         startup_stats_handler) == ENGINE_SUCCESS);
+    assert(startup_prefault_threads == 0 && startup_prefault_bytes == 0);
     return SUCCESS;
 }
 
@@ -800,22 +3568,122 @@ engine_test_t* get_tests(void) {
         {"replace test", replace_test, NULL, NULL, NULL},
         {"append test", append_test, NULL, NULL, NULL},
         {"prepend test", prepend_test, NULL, NULL, NULL},
+        {"append slack test", append_slack_test, NULL, NULL,
+         "append_slack=100"},
         {"store test", store_test, NULL, NULL, NULL},
         {"get test", get_test, NULL, NULL, NULL},
+        {"get multi test", get_multi_test, NULL, NULL, NULL},
+        {"get multi test (striped locks)", get_multi_test, NULL, NULL,
+         "lock_stripes=16"},
+        {"store multi test", store_multi_test, NULL, NULL, NULL},
+        {"store multi test (striped locks)", store_multi_test, NULL, NULL,
+         "lock_stripes=16"},
         {"expiry test", expiry_test, NULL, NULL, NULL},
         {"remove test", remove_test, NULL, NULL, NULL},
         {"release test", release_test, NULL, NULL, NULL},
         {"incr test", incr_test, NULL, NULL, NULL},
         {"mt incr test", mt_incr_test, NULL, NULL, NULL},
+        {"mt incr test (striped locks)", mt_incr_test, NULL, NULL,
+         "lock_stripes=16"},
+        {"mt store test", mt_store_test, NULL, NULL, NULL},
+        {"mt store test (striped locks)", mt_store_test, NULL, NULL,
+         "lock_stripes=16"},
+        {"mt store test (huge pages)", mt_store_test, NULL, NULL,
+         "huge_pages=true"},
+        {"mt hash expansion test", mt_expand_test, NULL, NULL, NULL},
+        {"hash shrink test", hash_shrink_test, NULL, NULL,
+         "hash_shrink_delay=1;lock_stripes=16"},
+        {"mt hash expansion test (striped locks)", mt_expand_test, NULL, NULL,
+         "lock_stripes=64"},
+        {"mt hash expansion test (bulk move)", mt_expand_test, NULL, NULL,
+         "lock_stripes=64;hash_bulk_move=64"},
+        {"mt hash expansion test (bloom filter)", mt_expand_test, NULL, NULL,
+         "lock_stripes=64;bloom_filter=true"},
+        {"bloom filter test", bloom_filter_test, NULL, NULL,
+         "bloom_filter=true"},
         {"decr test", decr_test, NULL, NULL, NULL},
+        {"counter test", counter_test, NULL, NULL, NULL},
         {"flush test", flush_test, NULL, NULL, NULL},
+        {"flush test (striped locks)", flush_test, NULL, NULL,
+         "lock_stripes=16"},
         {"get item info test", get_item_info_test, NULL, NULL, NULL},
+        {"item layout test", item_layout_test, NULL, NULL, NULL},
         {"set cas test", item_set_cas_test, NULL, NULL, NULL},
+        {"mutate range test", mutate_range_test, NULL, NULL, NULL},
+        {"large item test", large_item_test, NULL, NULL,
+         "slab_chunk_max=16384"},
+        {"compression test", compression_test, NULL, NULL,
+         "compress_min=128;slab_chunk_max=16384"},
+        {"dedup test", dedup_test, NULL, NULL,
+         "dedup_min=1024;slab_chunk_max=16384"},
+        {"ext store test", ext_store_test, NULL, NULL, NULL},
+        {"hot cache test", hot_cache_test, NULL, NULL,
+         "hot_cache=16;hot_cache_threshold=4"},
+        {"mt store test (hot cache)", mt_store_test, NULL, NULL,
+         "hot_cache=16;hot_cache_threshold=2;lock_stripes=16"},
+        {"lease test", lease_test, NULL, NULL,
+         "lease_timeout=2;lock_stripes=16"},
         {"LRU test", lru_test, NULL, NULL, "cache_size=48"},
+        {"LRU test (segmented)", lru_test, NULL, NULL,
+         "cache_size=48;segmented_lru=true"},
+        {"segmented LRU test", segmented_lru_test, NULL, NULL,
+         "cache_size=48;segmented_lru=true"},
+        {"segmented LRU test (striped locks)", segmented_lru_test, NULL, NULL,
+         "cache_size=48;segmented_lru=true;lock_stripes=16"},
+        {"admission filter test", admission_filter_test, NULL, NULL,
+         "cache_size=48;admission_filter=true"},
+        {"admission filter test (segmented LRU)", admission_filter_test,
+         NULL, NULL, "cache_size=48;admission_filter=true;segmented_lru=true"},
+        {"LRU crawler test", lru_crawler_test, NULL, NULL,
+         "lru_crawler=true;lru_crawler_interval=0"},
+        {"LRU crawler test (striped locks)", lru_crawler_test, NULL, NULL,
+         "lru_crawler=true;lru_crawler_interval=0;lock_stripes=16"},
+        {"LRU crawler flush test", lru_crawler_flush_test, NULL, NULL,
+         "lru_crawler=true;lru_crawler_interval=3600;lock_stripes=16"},
+        {"slabs reassign test", slabs_reassign_test, NULL, NULL,
+         "slab_reassign=true"},
+        {"slabs reassign test (striped locks)", slabs_reassign_test, NULL, NULL,
+         "slab_reassign=true;lock_stripes=16"},
+        {"slabs reassign test (huge pages)", slabs_reassign_test, NULL, NULL,
+         "slab_reassign=true;huge_pages=true;preallocate=true"},
+        {"slab magazine test", slab_magazine_test, NULL, NULL,
+         "slab_magazine_size=32"},
+        {"mt store test (magazines)", mt_store_test, NULL, NULL,
+         "slab_magazine_size=32;lock_stripes=16"},
+        {"slabs reassign test (disabled)", slabs_reassign_disabled_test,
+         NULL, NULL, NULL},
+        {"slab release test", slab_release_test, NULL, NULL,
+         "slab_release=true;slab_automove_interval=0"},
+#ifndef COMPACT_ITEMS
+        /* The compact items live in a single region */
+        {"shared arena test", shared_arena_test, NULL, NULL,
+         "shared_arena=8m;arena_reserved=2m;cache_size=4m"},
+#endif
+        {"tap backfill test", tap_backfill_test, NULL, NULL,
+         "tap_batch=16;lock_stripes=16;ignore_vbucket=true"},
+        {"vbucket purge test", vbucket_purge_test, NULL, NULL, NULL},
+        {"tap takeover test", tap_takeover_test, NULL, NULL,
+         "tap_batch=16"},
+        {"tap takeover test (striped locks)", tap_takeover_test, NULL, NULL,
+         "tap_batch=16;lock_stripes=16"},
+        {"checkpoint resume test", checkpoint_resume_test, NULL, NULL,
+         "checkpoint_size=4;tap_batch=16"},
+        {"checkpoint resume test (striped locks)", checkpoint_resume_test,
+         NULL, NULL, "checkpoint_size=4;tap_batch=16;lock_stripes=16"},
+        {"vbucket purge test (striped locks)", vbucket_purge_test, NULL, NULL,
+         "lock_stripes=16"},
+        {"restart test", restart_test, NULL, NULL, NULL},
+        {"snapshot test", snapshot_test, NULL, NULL, NULL},
+        {"journal test", journal_test, NULL, NULL, NULL},
+        {"prefault test", prefault_test, NULL, NULL,
+         "preallocate=true;prefault_threads=4;cache_size=33554432"},
+        {"stats sizes test", stats_sizes_test, NULL, NULL, NULL},
         {"get stats test", get_stats_test, NULL, NULL, NULL},
         {"reset stats test", reset_stats_test, NULL, NULL, NULL},
         {"get stats struct test", get_stats_struct_test, NULL, NULL, NULL},
         {"aggregate stats test", aggregate_stats_test, NULL, NULL, NULL},
+        {"command handlers test", command_handlers_test, NULL, NULL, NULL},
+        {"namespace test", namespace_test, NULL, NULL, "namespaces=true"},
         {"touch", touch_test, NULL, NULL, NULL},
         {"Get And Touch", gat_test, NULL, NULL, NULL},
         {"Get And Touch Quiet", gatq_test, NULL, NULL, NULL},
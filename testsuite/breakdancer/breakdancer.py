@@ -37,12 +37,16 @@ class Action(object):
 
     Action.postconditions is the collection of conditions that must
     all be true after the effect of the action completes.
+
+    Action.concurrent is false for the actions that can't be mixed
+    into the concurrent tests.
     """
 
     preconditions = []
     effect = None
     postconditions = []
     enabled = True
+    concurrent = True
 
     @property
     def name(self):
@@ -50,6 +54,21 @@ class Action(object):
         n = self.__class__.__name__
         return n[0].lower() + n[1:]
 
+class Background(object):
+    """Something going on while the actions of a concurrent test run.
+
+    Background.actions are the actions it performs as far as the state
+    is concerned (if it changes the state at all)."""
+
+    actions = []
+    enabled = True
+
+    @property
+    def name(self):
+        """The name of this background (default derived from class name)"""
+        n = self.__class__.__name__
+        return n[0].lower() + n[1:]
+
 class Driver(object):
     """The driver "performs" the test."""
 
@@ -76,6 +95,29 @@ class Driver(object):
     def postSuite(self, seq):
         """Invoked with the sequence of tests after all of them are run."""
 
+    def preConcurrentSuite(self, tests):
+        """Invoked with the (mix, background) pairs of the concurrent
+        tests before any are run."""
+
+    def concurrentTest(self, mix, background, states, outcomes):
+        """Invoked for every concurrent test with the mix of actions,
+        the background, the states the test may end up in and the
+        outcomes (errored or not) every action of the mix may have."""
+
+    def postConcurrentSuite(self, tests):
+        """Invoked with the concurrent tests after all of them are run."""
+
+def performAction(a, state):
+    """Perform an action on the state, True if it errored."""
+    haserror = not all(p(state) for p in a.preconditions)
+    if not haserror:
+        try:
+            a.effect(state)
+            haserror = not all(p(state) for p in a.postconditions)
+        except:
+            haserror = True
+    return haserror
+
 def runTest(actions, driver, duplicates=3, length=4):
     """Run a test with the given collection of actions and driver.
 
@@ -95,17 +137,55 @@ def runTest(actions, driver, duplicates=3, length=4):
         driver.startSequence(seq)
         for a in seq:
             driver.startAction(a)
-            haserror = not all(p(state) for p in a.preconditions)
-            if not haserror:
-                try:
-                    a.effect(state)
-                    haserror = not all(p(state) for p in a.postconditions)
-                except:
-                    haserror = True
+            haserror = performAction(a, state)
             driver.endAction(a, state, haserror)
         driver.endSequence(seq, state)
     driver.postSuite(tests)
 
+def reachableStates(actions, state, depth):
+    """The states any sequence of at most `depth' of the actions
+    (performed in any order, each as often as it likes) leads to from
+    the given state."""
+
+    freeze = lambda s: tuple(sorted(s.items()))
+    seen = {freeze(state): state}
+    frontier = [state]
+    for i in range(depth):
+        following = []
+        for s in frontier:
+            for a in actions:
+                n = dict(s)
+                performAction(a, n)
+                if freeze(n) not in seen:
+                    seen[freeze(n)] = n
+                    following.append(n)
+        frontier = following
+    return seen.values()
+
+def runConcurrentTest(actions, backgrounds, driver, mix=3, depth=4):
+    """Run concurrent tests with the given actions, backgrounds and driver.
+
+    Every combination of `mix' of the actions is run with every
+    background: the threads of the test perform the actions of the mix
+    in whatever order on the same keys, so all we know is what the
+    actions (and the background) may have done to a key.  That is the
+    states reachable with `depth' actions, and what the actions of the
+    mix may do in each of them.
+    """
+
+    instances = sorted((a() for a in actions if a.concurrent),
+                       key=lambda a: a.name)
+    tests = [(m, b()) for m in itertools.combinations(instances, mix)
+             for b in sorted(backgrounds, key=lambda b: b.__name__)]
+    driver.preConcurrentSuite(tests)
+    for (m, b) in tests:
+        states = reachableStates(list(m) + [a() for a in b.actions],
+                                 driver.newState(), depth)
+        outcomes = dict((a, set(performAction(a, dict(s)) for s in states))
+                        for a in m)
+        driver.concurrentTest(m, b, states, outcomes)
+    driver.postConcurrentSuite(tests)
+
 def findActions(classes):
     """Helper function to extract action subclasses from a collection
     of classes."""
@@ -115,3 +195,13 @@ def findActions(classes):
         if Action in __t.__mro__ and __t != Action and __t.enabled:
             actions.append(__t)
     return actions
+
+def findBackgrounds(classes):
+    """Helper function to extract background subclasses from a
+    collection of classes."""
+
+    backgrounds = []
+    for __t in (t for t in classes if isinstance(type, type(t))):
+        if Background in __t.__mro__ and __t != Background and __t.enabled:
+            backgrounds.append(__t)
+    return backgrounds
@@ -1,7 +1,7 @@
 #!/usr/bin/env python
 
 import breakdancer
-from breakdancer import Condition, Effect, Action, Driver
+from breakdancer import Condition, Effect, Action, Background, Driver
 
 TESTKEY = 'testkey'
 
@@ -112,6 +112,9 @@ class Flush(Action):
 
     effect = FlushEffect()
     postconditions = [NothingExistsCondition()]
+    # the Flusher does it in the concurrent tests (and a delay moves
+    # the clock of everyone)
+    concurrent = False
 
 class Delay(Flush):
     pass
@@ -152,12 +155,36 @@ class DecrWithDefault(Action):
     effect = ArithmeticEffect(-1)
     postconditions = [ExistsAsNumber()]
 
+######################################################################
+# Backgrounds
+######################################################################
+
+class Idle(Background):
+
+    kind = 'BACKGROUND_IDLE'
+
+class HashExpansion(Background):
+
+    kind = 'BACKGROUND_EXPAND'
+
+class Flusher(Background):
+
+    actions = [Flush]
+    kind = 'BACKGROUND_FLUSH'
+
+class Scrubber(Background):
+
+    kind = 'BACKGROUND_SCRUB'
+
 ######################################################################
 # Driver
 ######################################################################
 
 class EngineTestAppDriver(Driver):
 
+    def __init__(self):
+        self.tests = []
+
     def preSuite(self, seq):
         print '#include "suite_stubs.h"'
         print ""
@@ -182,15 +209,63 @@ class EngineTestAppDriver(Driver):
         print s
 
     def postSuite(self, seq):
+        for seq in sorted(seq):
+            self.tests.append((', '.join(a.name for a in seq),
+                               self.testName(seq)))
+
+    def concurrentTest(self, mix, background, states, outcomes):
+        name = ('test_concurrent_' + '_'.join(a.name for a in mix) +
+                '_' + background.name)
+        desc = ('concurrent %s with %s'
+                % (', '.join(a.name for a in mix), background.name))
+        f = "static enum test_result %s" % name
+        print ("%s(ENGINE_HANDLE *h,\n%sENGINE_HANDLE_V1 *h1) {"
+               % (f, " " * (len(f) + 1)))
+        print "    static const struct concurrent_op ops[] = {"
+        for a in mix:
+            can = []
+            if False in outcomes[a]:
+                can.append('CAN_SUCCEED')
+            if True in outcomes[a]:
+                can.append('CAN_FAIL')
+            print '        { "%s", %sKey, %s },' % (a.name, a.name,
+                                                   ' | '.join(can))
+        print "    };"
+
+        values = set()
+        for state in states:
+            v = state.get(TESTKEY)
+            if v is None:
+                values.add('VALUE_MISSING')
+                continue
+            if v.startswith(PrependEffect.prefix):
+                values.add('VALUE_PREFIX')
+            if v.endswith(AppendEffect.suffix):
+                values.add('VALUE_SUFFIX')
+            if v.isdigit():
+                values.add('VALUE_NUMBER')
+        print "    static const struct concurrent_test test = {"
+        print '        "%s", ops, %d, %s,' % (desc, len(mix), background.kind)
+        print "        %s" % ' | '.join(v for v in ('VALUE_MISSING',
+                                                      'VALUE_NUMBER',
+                                                      'VALUE_PREFIX',
+                                                      'VALUE_SUFFIX')
+                                         if v in values)
+        print "    };"
+        print "    return runConcurrent(h, h1, &test);"
+        print "}"
+        print ""
+        self.tests.append((desc, name))
+
+    def printTests(self):
         print """MEMCACHED_PUBLIC_API
 engine_test_t* get_tests(void) {
 
     static engine_test_t tests[]  = {
 """
-        for seq in sorted(seq):
+        for (name, fn) in self.tests:
             print '        {"%s",\n         %s,\n         test_setup, teardown, NULL},' % (
-                ', '.join(a.name for a in seq),
-                self.testName(seq))
+                name, fn)
 
         print """        {NULL, NULL, NULL, NULL, NULL}
     };
@@ -220,5 +295,10 @@ engine_test_t* get_tests(void) {
             print "    assertHasNoError();" + vs
 
 if __name__ == '__main__':
-    breakdancer.runTest(breakdancer.findActions(globals().values()),
-                        EngineTestAppDriver())
+    driver = EngineTestAppDriver()
+    actions = breakdancer.findActions(globals().values())
+    breakdancer.runTest(actions, driver)
+    breakdancer.runConcurrentTest(actions,
+                                  breakdancer.findBackgrounds(globals().values()),
+                                  driver)
+    driver.printTests()
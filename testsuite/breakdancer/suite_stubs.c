@@ -1,7 +1,14 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <inttypes.h>
 
 #include <memcached/engine.h>
 
@@ -29,8 +36,9 @@ void delay(int amt) {
     hasError = false;
 }
 
-static void storeItem(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
-                      ENGINE_STORE_OPERATION op) {
+static ENGINE_ERROR_CODE storeItem(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                   const char *k,
+                                   ENGINE_STORE_OPERATION op) {
     item *it = NULL;
     uint64_t cas = 0;
     char *value = "0";
@@ -48,7 +56,7 @@ static void storeItem(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
     ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
 
     rv = h1->allocate(h, cookie, &it,
-                      key, strlen(key),
+                      k, strlen(k),
                       vlen, flags, expiry);
     assert(rv == ENGINE_SUCCESS);
 
@@ -62,36 +70,74 @@ static void storeItem(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
     h1->item_set_cas(h, cookie, it, 0);
 
     rv = h1->store(h, cookie, it, &cas, op, 0);
+    h1->release(h, cookie, it);
 
-    hasError = rv != ENGINE_SUCCESS;
+    return rv;
+}
+
+static ENGINE_ERROR_CODE arithmetic(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                    const char *k, bool incr, bool create) {
+    uint64_t cas;
+    uint64_t result;
+    return h1->arithmetic(h, NULL, k, strlen(k), incr, create, 1, 0, expiry,
+                          &cas, &result, 0);
+}
+
+ENGINE_ERROR_CODE addKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k) {
+    return storeItem(h, h1, k, OPERATION_ADD);
+}
+
+ENGINE_ERROR_CODE appendKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k) {
+    return storeItem(h, h1, k, OPERATION_APPEND);
+}
+
+ENGINE_ERROR_CODE decrKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k) {
+    return arithmetic(h, h1, k, false, false);
+}
+
+ENGINE_ERROR_CODE decrWithDefaultKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k) {
+    return arithmetic(h, h1, k, false, true);
+}
+
+ENGINE_ERROR_CODE prependKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k) {
+    return storeItem(h, h1, k, OPERATION_PREPEND);
+}
+
+ENGINE_ERROR_CODE deleteKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k) {
+    uint64_t cas = 0;
+    return h1->remove(h, NULL, k, strlen(k), &cas, 0);
+}
+
+ENGINE_ERROR_CODE setKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k) {
+    return storeItem(h, h1, k, OPERATION_SET);
+}
+
+ENGINE_ERROR_CODE incrKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k) {
+    return arithmetic(h, h1, k, true, false);
+}
+
+ENGINE_ERROR_CODE incrWithDefaultKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k) {
+    return arithmetic(h, h1, k, true, true);
 }
 
 void add(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    storeItem(h, h1, OPERATION_ADD);
+    hasError = addKey(h, h1, key) != ENGINE_SUCCESS;
 }
 
 void append(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    storeItem(h, h1, OPERATION_APPEND);
+    hasError = appendKey(h, h1, key) != ENGINE_SUCCESS;
 }
 
 void decr(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    uint64_t cas;
-    uint64_t result;
-    hasError = h1->arithmetic(h, NULL, key, strlen(key), false, false, 1, 0, expiry,
-                              &cas, &result,
-                              0) != ENGINE_SUCCESS;
+    hasError = decrKey(h, h1, key) != ENGINE_SUCCESS;
 }
 
 void decrWithDefault(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    uint64_t cas;
-    uint64_t result;
-    hasError = h1->arithmetic(h, NULL, key, strlen(key), false, true, 1, 0, expiry,
-                              &cas, &result,
-                              0) != ENGINE_SUCCESS;
+    hasError = decrWithDefaultKey(h, h1, key) != ENGINE_SUCCESS;
 }
 
 void prepend(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    storeItem(h, h1, OPERATION_PREPEND);
+    hasError = prependKey(h, h1, key) != ENGINE_SUCCESS;
 }
 
 void flush(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
@@ -99,27 +145,19 @@ void flush(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
 }
 
 void del(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    hasError = h1->remove(h, NULL, key, strlen(key), 0, 0) != ENGINE_SUCCESS;
+    hasError = deleteKey(h, h1, key) != ENGINE_SUCCESS;
 }
 
 void set(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    storeItem(h, h1, OPERATION_SET);
+    hasError = setKey(h, h1, key) != ENGINE_SUCCESS;
 }
 
 void incr(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    uint64_t cas;
-    uint64_t result;
-    hasError = h1->arithmetic(h, NULL, key, strlen(key), true, false, 1, 0, expiry,
-                              &cas, &result,
-                              0) != ENGINE_SUCCESS;
+    hasError = incrKey(h, h1, key) != ENGINE_SUCCESS;
 }
 
 void incrWithDefault(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    uint64_t cas;
-    uint64_t result;
-    hasError = h1->arithmetic(h, NULL, key, strlen(key), true, true, 1, 0, expiry,
-                              &cas, &result,
-                              0) != ENGINE_SUCCESS;
+    hasError = incrWithDefaultKey(h, h1, key) != ENGINE_SUCCESS;
 }
 
 
@@ -154,6 +192,329 @@ void assertNotExists(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     assert(rv == ENGINE_KEY_ENOENT);
 }
 
+/*
+ * The concurrent tests
+ */
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_KEYS 8
+#define CONCURRENT_ITERATIONS 5000
+/* Past the 1.5 items per bucket of the 2^16 buckets we start with */
+#define CONCURRENT_EXPAND_ITEMS 100000
+
+static const char *counter = "counter";
+
+struct concurrent_thread {
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *h1;
+    const struct concurrent_test *test;
+    pthread_t tid;
+    int id;
+    uint64_t iterations;
+    uint64_t ops;
+};
+
+static volatile bool concurrent_stop;
+static volatile bool background_done;
+
+static void violated(const struct concurrent_test *test,
+                     const char *k, const char *fmt, ...) {
+    va_list ap;
+    fprintf(stderr, "%s: %s: ", test->name, k);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    abort();
+}
+
+/* The errors the engine may tell us an action failed with */
+static bool expectedError(ENGINE_ERROR_CODE rv) {
+    switch (rv) {
+    case ENGINE_KEY_ENOENT:
+    case ENGINE_KEY_EEXISTS:
+    case ENGINE_NOT_STORED:
+    case ENGINE_EINVAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Check that the value is ("prefix-")* number ("-suffix")* with the
+ * parts the test allows. A decr that makes the number shorter may
+ * leave the number padded with spaces.
+ */
+static void checkValueForm(const struct concurrent_test *test, const char *k,
+                           const char *value, size_t len) {
+    static const char prefix[] = "prefix-";
+    static const char suffix[] = "-suffix";
+    const size_t plen = sizeof(prefix) - 1;
+    const size_t slen = sizeof(suffix) - 1;
+    const char *p = value;
+    const char *end = value + len;
+    bool prefixed = false;
+    bool suffixed = false;
+
+    while ((size_t)(end - p) >= plen && memcmp(p, prefix, plen) == 0) {
+        p += plen;
+        prefixed = true;
+    }
+    while ((size_t)(end - p) >= slen && memcmp(end - slen, suffix, slen) == 0) {
+        end -= slen;
+        suffixed = true;
+    }
+    while (end > p && end[-1] == ' ') {
+        --end;
+    }
+    bool number = p < end;
+    for (const char *d = p; d < end; ++d) {
+        number &= isdigit((unsigned char)*d) != 0;
+    }
+
+    if (!number ||
+        (prefixed && (test->values & VALUE_PREFIX) == 0) ||
+        (suffixed && (test->values & VALUE_SUFFIX) == 0) ||
+        (!prefixed && !suffixed && (test->values & VALUE_NUMBER) == 0)) {
+        violated(test, k, "unexpected value ``%.*s''", (int)len, value);
+    }
+}
+
+/*
+ * Get the key and check its value, copied to buf (as a string, if it
+ * fits) for the caller
+ */
+static bool getValue(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                     const struct concurrent_test *test, const char *k,
+                     char *buf, size_t bufsize) {
+    item *i = NULL;
+    ENGINE_ERROR_CODE rv = h1->get(h, NULL, &i, k, strlen(k), 0);
+    if (rv == ENGINE_KEY_ENOENT) {
+        if ((test->values & VALUE_MISSING) == 0) {
+            violated(test, k, "missing");
+        }
+        return false;
+    } else if (rv != ENGINE_SUCCESS) {
+        violated(test, k, "get failed with %d", rv);
+    } else if ((test->values & ~VALUE_MISSING) == 0) {
+        violated(test, k, "exists");
+    }
+
+    item_info info;
+    info.nvalue = 1;
+    if (!h1->get_item_info(h, NULL, i, &info) || info.nvalue != 1) {
+        abort();
+    }
+    checkValueForm(test, k, info.value[0].iov_base, info.value[0].iov_len);
+    size_t len = info.value[0].iov_len < bufsize - 1 ?
+        info.value[0].iov_len : bufsize - 1;
+    memcpy(buf, info.value[0].iov_base, len);
+    buf[len] = '\0';
+    h1->release(h, NULL, i);
+    return true;
+}
+
+static uint64_t incrCounter(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                            const struct concurrent_test *test,
+                            const char *k) {
+    uint64_t cas;
+    uint64_t result;
+    ENGINE_ERROR_CODE rv = h1->arithmetic(h, NULL, k, strlen(k), true, true,
+                                          1, 1, expiry, &cas, &result, 0);
+    if (rv != ENGINE_SUCCESS) {
+        violated(test, k, "increment failed with %d", rv);
+    }
+    return result;
+}
+
+static void *concurrentMain(void *arg) {
+    struct concurrent_thread *t = arg;
+    const struct concurrent_test *test = t->test;
+    unsigned int seed = t->id;
+    char mine[32];
+    char k[32];
+    char buf[64];
+
+    snprintf(mine, sizeof(mine), "counter:%d", t->id);
+    while (!concurrent_stop &&
+           (t->iterations < CONCURRENT_ITERATIONS ||
+            (test->background == BACKGROUND_EXPAND && !background_done))) {
+        const struct concurrent_op *op = &test->ops[rand_r(&seed) % test->nops];
+        snprintf(k, sizeof(k), "key%d", rand_r(&seed) % CONCURRENT_KEYS);
+        ENGINE_ERROR_CODE rv = op->fn(t->h, t->h1, k);
+        if (rv == ENGINE_SUCCESS) {
+            if ((op->outcomes & CAN_SUCCEED) == 0) {
+                violated(test, k, "%s succeeded", op->name);
+            }
+        } else if (!expectedError(rv)) {
+            violated(test, k, "%s failed with %d", op->name, rv);
+        } else if ((op->outcomes & CAN_FAIL) == 0) {
+            violated(test, k, "%s failed", op->name);
+        }
+
+        snprintf(k, sizeof(k), "key%d", rand_r(&seed) % CONCURRENT_KEYS);
+        getValue(t->h, t->h1, test, k, buf, sizeof(buf));
+
+        uint64_t n = incrCounter(t->h, t->h1, test, mine);
+        if (test->background != BACKGROUND_FLUSH && n != t->iterations + 1) {
+            violated(test, mine, "is %"PRIu64" after %"PRIu64" increments",
+                     n, t->iterations + 1);
+        }
+        incrCounter(t->h, t->h1, test, counter);
+        ++t->iterations;
+        t->ops += 4;
+    }
+    return NULL;
+}
+
+static void concurrentStats(const char *key, const uint16_t klen,
+                            const char *val, const uint32_t vlen,
+                            const void *cookie) {
+    bool *expanding = (bool*)cookie;
+    if (klen == 17 && memcmp(key, "hash_is_expanding", klen) == 0) {
+        *expanding = vlen == 4 && memcmp(val, "true", vlen) == 0;
+    }
+}
+
+static bool scrubResponse(const void *key, uint16_t keylen,
+                          const void *ext, uint8_t extlen,
+                          const void *body, uint32_t bodylen,
+                          uint8_t datatype, uint16_t status,
+                          uint64_t cas, const void *cookie) {
+    (void)key; (void)keylen; (void)ext; (void)extlen; (void)body;
+    (void)bodylen; (void)datatype; (void)cas; (void)cookie;
+    assert(status == PROTOCOL_BINARY_RESPONSE_SUCCESS ||
+           status == PROTOCOL_BINARY_RESPONSE_EBUSY);
+    return true;
+}
+
+static void *backgroundMain(void *arg) {
+    struct concurrent_thread *t = arg;
+    ENGINE_HANDLE *h = t->h;
+    ENGINE_HANDLE_V1 *h1 = t->h1;
+
+    switch (t->test->background) {
+    case BACKGROUND_IDLE:
+        break;
+    case BACKGROUND_EXPAND:
+        for (int ii = 0; ii < CONCURRENT_EXPAND_ITEMS; ++ii) {
+            char k[32];
+            snprintf(k, sizeof(k), "fill:%d", ii);
+            if (setKey(h, h1, k) != ENGINE_SUCCESS) {
+                violated(t->test, k, "set failed");
+            }
+            ++t->ops;
+        }
+        /* Keep the threads going till the items are in the new table */
+        for (int ii = 0; ii < 1000; ++ii) {
+            bool expanding = false;
+            if (h1->get_stats(h, &expanding, "hash", 4,
+                              concurrentStats) != ENGINE_SUCCESS ||
+                !expanding) {
+                break;
+            }
+            usleep(10000);
+        }
+        break;
+    case BACKGROUND_FLUSH:
+        while (!concurrent_stop) {
+            if (h1->flush(h, NULL, 0) != ENGINE_SUCCESS) {
+                violated(t->test, "*", "flush failed");
+            }
+            ++t->ops;
+            usleep(100);
+        }
+        break;
+    case BACKGROUND_SCRUB:
+        while (!concurrent_stop) {
+            protocol_binary_request_no_extras scrub = {
+                .message.header.request = {
+                    .magic = PROTOCOL_BINARY_REQ,
+                    .opcode = PROTOCOL_BINARY_CMD_SCRUB
+                }
+            };
+            if (h1->unknown_command(h, NULL, &scrub.message.header,
+                                    scrubResponse) != ENGINE_SUCCESS) {
+                violated(t->test, "*", "scrub failed");
+            }
+            ++t->ops;
+            usleep(100);
+        }
+        break;
+    }
+    background_done = true;
+    return NULL;
+}
+
+static void recordOps(const struct concurrent_test *test, double ops_per_sec) {
+    const char *path = getenv("BREAKDANCER_RESULTS");
+    if (path == NULL) {
+        return;
+    }
+    FILE *fp = fopen(path, "a");
+    if (fp != NULL) {
+        fprintf(fp, "%s: %.0f ops/s\n", test->name, ops_per_sec);
+        fclose(fp);
+    }
+}
+
+enum test_result runConcurrent(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                               const struct concurrent_test *test) {
+    struct concurrent_thread threads[CONCURRENT_THREADS + 1];
+    struct timeval start, end;
+
+    concurrent_stop = false;
+    background_done = false;
+    gettimeofday(&start, NULL);
+    for (int ii = 0; ii <= CONCURRENT_THREADS; ++ii) {
+        threads[ii] = (struct concurrent_thread){
+            .h = h, .h1 = h1, .test = test, .id = ii
+        };
+        assert(pthread_create(&threads[ii].tid, NULL,
+                              ii == CONCURRENT_THREADS ?
+                              backgroundMain : concurrentMain,
+                              &threads[ii]) == 0);
+    }
+
+    uint64_t iterations = 0;
+    uint64_t ops = 0;
+    for (int ii = 0; ii < CONCURRENT_THREADS; ++ii) {
+        assert(pthread_join(threads[ii].tid, NULL) == 0);
+        iterations += threads[ii].iterations;
+        ops += threads[ii].ops;
+    }
+    concurrent_stop = true;
+    assert(pthread_join(threads[CONCURRENT_THREADS].tid, NULL) == 0);
+    ops += threads[CONCURRENT_THREADS].ops;
+    gettimeofday(&end, NULL);
+
+    /* Now that everyone is done the keys have to stay the way they are */
+    for (int ii = 0; ii < CONCURRENT_KEYS; ++ii) {
+        char k[32];
+        char first[64], second[64];
+        snprintf(k, sizeof(k), "key%d", ii);
+        bool found = getValue(h, h1, test, k, first, sizeof(first));
+        if (getValue(h, h1, test, k, second, sizeof(second)) != found ||
+            (found && strcmp(first, second) != 0)) {
+            violated(test, k, "changed from ``%s''", found ? first : "");
+        }
+    }
+
+    if (test->background != BACKGROUND_FLUSH) {
+        uint64_t n = incrCounter(h, h1, test, counter);
+        if (n != iterations + 1) {
+            violated(test, counter, "is %"PRIu64" after %"PRIu64" increments",
+                     n, iterations + 1);
+        }
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) +
+        (end.tv_usec - start.tv_usec) / 1e6;
+    recordOps(test, seconds > 0 ? ops / seconds : 0);
+    return SUCCESS;
+}
+
 MEMCACHED_PUBLIC_API
 bool setup_suite(struct test_harness *th) {
     testHarness = *th;
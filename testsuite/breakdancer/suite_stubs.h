@@ -37,6 +37,68 @@ void assertNotExists(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1);
 #define assertHasError() assert(hasError)
 #define assertHasNoError() assert(!hasError)
 
+/*
+ * The concurrent tests: threads performing a mix of the actions on the
+ * same few keys while something else goes on in the background. All we
+ * know is what the actions of the mix (and the background) may do to a
+ * key, so that's what we check: the outcomes of the actions, the values
+ * of the keys (while the threads run and once they're done), and that
+ * the counters every thread increments on the side don't lose an
+ * increment (unless the background flushes them).
+ */
+
+/* The outcomes an action may have */
+#define CAN_SUCCEED 1
+#define CAN_FAIL 2
+
+/* The values a key may have */
+#define VALUE_MISSING 1
+#define VALUE_NUMBER 2
+#define VALUE_PREFIX 4
+#define VALUE_SUFFIX 8
+
+enum concurrent_background {
+    BACKGROUND_IDLE,
+    /** Store enough items for the hash table to grow (and wait for it) */
+    BACKGROUND_EXPAND,
+    /** Flush everything over and over */
+    BACKGROUND_FLUSH,
+    /** Start a scrub over and over */
+    BACKGROUND_SCRUB
+};
+
+struct concurrent_op {
+    const char *name;
+    ENGINE_ERROR_CODE (*fn)(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                            const char *k);
+    int outcomes;
+};
+
+struct concurrent_test {
+    const char *name;
+    const struct concurrent_op *ops;
+    int nops;
+    enum concurrent_background background;
+    int values;
+};
+
+ENGINE_ERROR_CODE addKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k);
+ENGINE_ERROR_CODE appendKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k);
+ENGINE_ERROR_CODE decrKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k);
+ENGINE_ERROR_CODE decrWithDefaultKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k);
+ENGINE_ERROR_CODE prependKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k);
+ENGINE_ERROR_CODE deleteKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k);
+ENGINE_ERROR_CODE setKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k);
+ENGINE_ERROR_CODE incrKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k);
+ENGINE_ERROR_CODE incrWithDefaultKey(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *k);
+
+/**
+ * Run a concurrent test. The operations per second it did are appended
+ * to the file named by $BREAKDANCER_RESULTS (if set).
+ */
+enum test_result runConcurrent(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                               const struct concurrent_test *test);
+
 extern int expiry;
 extern bool hasError;
 extern struct test_harness testHarness;
@@ -3,9 +3,136 @@
 
 #ifdef ENABLE_DTRACE
 #include "memcached_dtrace.h"
+#elif defined(ENABLE_SDT)
+/*
+ * The probes of memcached_dtrace.d as Linux USDT probes (for bpftrace,
+ * perf and systemtap) without the dtrace tool. They have no semaphores,
+ * so the _ENABLED() checks can't tell if anyone is listening.
+ */
+#include <sys/sdt.h>
+#define MEMCACHED_ASSOC_DELETE(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, assoc__delete, arg0, arg1, arg2)
+#define MEMCACHED_ASSOC_DELETE_ENABLED() (1)
+#define MEMCACHED_ASSOC_EXPAND_DONE(arg0, arg1) \
+    DTRACE_PROBE2(memcached, assoc__expand__done, arg0, arg1)
+#define MEMCACHED_ASSOC_EXPAND_DONE_ENABLED() (1)
+#define MEMCACHED_ASSOC_EXPAND_START(arg0) \
+    DTRACE_PROBE1(memcached, assoc__expand__start, arg0)
+#define MEMCACHED_ASSOC_EXPAND_START_ENABLED() (1)
+#define MEMCACHED_ASSOC_EXPAND_STEP(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, assoc__expand__step, arg0, arg1, arg2)
+#define MEMCACHED_ASSOC_EXPAND_STEP_ENABLED() (1)
+#define MEMCACHED_ASSOC_FIND(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, assoc__find, arg0, arg1, arg2)
+#define MEMCACHED_ASSOC_FIND_ENABLED() (1)
+#define MEMCACHED_ASSOC_INSERT(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, assoc__insert, arg0, arg1, arg2)
+#define MEMCACHED_ASSOC_INSERT_ENABLED() (1)
+#define MEMCACHED_COMMAND_ADD(arg0, arg1, arg2, arg3, arg4) \
+    DTRACE_PROBE5(memcached, command__add, arg0, arg1, arg2, arg3, arg4)
+#define MEMCACHED_COMMAND_ADD_ENABLED() (1)
+#define MEMCACHED_COMMAND_APPEND(arg0, arg1, arg2, arg3, arg4) \
+    DTRACE_PROBE5(memcached, command__append, arg0, arg1, arg2, arg3, arg4)
+#define MEMCACHED_COMMAND_APPEND_ENABLED() (1)
+#define MEMCACHED_COMMAND_CAS(arg0, arg1, arg2, arg3, arg4) \
+    DTRACE_PROBE5(memcached, command__cas, arg0, arg1, arg2, arg3, arg4)
+#define MEMCACHED_COMMAND_CAS_ENABLED() (1)
+#define MEMCACHED_COMMAND_DECR(arg0, arg1, arg2, arg3) \
+    DTRACE_PROBE4(memcached, command__decr, arg0, arg1, arg2, arg3)
+#define MEMCACHED_COMMAND_DECR_ENABLED() (1)
+#define MEMCACHED_COMMAND_DELETE(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, command__delete, arg0, arg1, arg2)
+#define MEMCACHED_COMMAND_DELETE_ENABLED() (1)
+#define MEMCACHED_COMMAND_GET(arg0, arg1, arg2, arg3, arg4) \
+    DTRACE_PROBE5(memcached, command__get, arg0, arg1, arg2, arg3, arg4)
+#define MEMCACHED_COMMAND_GET_ENABLED() (1)
+#define MEMCACHED_COMMAND_INCR(arg0, arg1, arg2, arg3) \
+    DTRACE_PROBE4(memcached, command__incr, arg0, arg1, arg2, arg3)
+#define MEMCACHED_COMMAND_INCR_ENABLED() (1)
+#define MEMCACHED_COMMAND_PREPEND(arg0, arg1, arg2, arg3, arg4) \
+    DTRACE_PROBE5(memcached, command__prepend, arg0, arg1, arg2, arg3, arg4)
+#define MEMCACHED_COMMAND_PREPEND_ENABLED() (1)
+#define MEMCACHED_COMMAND_REPLACE(arg0, arg1, arg2, arg3, arg4) \
+    DTRACE_PROBE5(memcached, command__replace, arg0, arg1, arg2, arg3, arg4)
+#define MEMCACHED_COMMAND_REPLACE_ENABLED() (1)
+#define MEMCACHED_COMMAND_SET(arg0, arg1, arg2, arg3, arg4) \
+    DTRACE_PROBE5(memcached, command__set, arg0, arg1, arg2, arg3, arg4)
+#define MEMCACHED_COMMAND_SET_ENABLED() (1)
+#define MEMCACHED_CONN_ALLOCATE(arg0) \
+    DTRACE_PROBE1(memcached, conn__allocate, arg0)
+#define MEMCACHED_CONN_ALLOCATE_ENABLED() (1)
+#define MEMCACHED_CONN_BLOCK(arg0, arg1) \
+    DTRACE_PROBE2(memcached, conn__block, arg0, arg1)
+#define MEMCACHED_CONN_BLOCK_ENABLED() (1)
+#define MEMCACHED_CONN_CREATE(arg0) \
+    DTRACE_PROBE1(memcached, conn__create, arg0)
+#define MEMCACHED_CONN_CREATE_ENABLED() (1)
+#define MEMCACHED_CONN_DESTROY(arg0) \
+    DTRACE_PROBE1(memcached, conn__destroy, arg0)
+#define MEMCACHED_CONN_DESTROY_ENABLED() (1)
+#define MEMCACHED_CONN_DISPATCH(arg0, arg1) \
+    DTRACE_PROBE2(memcached, conn__dispatch, arg0, arg1)
+#define MEMCACHED_CONN_DISPATCH_ENABLED() (1)
+#define MEMCACHED_CONN_RELEASE(arg0) \
+    DTRACE_PROBE1(memcached, conn__release, arg0)
+#define MEMCACHED_CONN_RELEASE_ENABLED() (1)
+#define MEMCACHED_CONN_RESUME(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, conn__resume, arg0, arg1, arg2)
+#define MEMCACHED_CONN_RESUME_ENABLED() (1)
+#define MEMCACHED_ITEM_BUMP(arg0, arg1, arg2, arg3, arg4) \
+    DTRACE_PROBE5(memcached, item__bump, arg0, arg1, arg2, arg3, arg4)
+#define MEMCACHED_ITEM_BUMP_ENABLED() (1)
+#define MEMCACHED_ITEM_EVICT(arg0, arg1, arg2, arg3) \
+    DTRACE_PROBE4(memcached, item__evict, arg0, arg1, arg2, arg3)
+#define MEMCACHED_ITEM_EVICT_ENABLED() (1)
+#define MEMCACHED_ITEM_LINK(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, item__link, arg0, arg1, arg2)
+#define MEMCACHED_ITEM_LINK_ENABLED() (1)
+#define MEMCACHED_ITEM_REMOVE(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, item__remove, arg0, arg1, arg2)
+#define MEMCACHED_ITEM_REMOVE_ENABLED() (1)
+#define MEMCACHED_ITEM_REPLACE(arg0, arg1, arg2, arg3, arg4, arg5) \
+    DTRACE_PROBE6(memcached, item__replace, arg0, arg1, arg2, arg3, arg4, arg5)
+#define MEMCACHED_ITEM_REPLACE_ENABLED() (1)
+#define MEMCACHED_ITEM_UNLINK(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, item__unlink, arg0, arg1, arg2)
+#define MEMCACHED_ITEM_UNLINK_ENABLED() (1)
+#define MEMCACHED_ITEM_UPDATE(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, item__update, arg0, arg1, arg2)
+#define MEMCACHED_ITEM_UPDATE_ENABLED() (1)
+#define MEMCACHED_LOCK_WAIT(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, lock__wait, arg0, arg1, arg2)
+#define MEMCACHED_LOCK_WAIT_ENABLED() (1)
+#define MEMCACHED_PROCESS_COMMAND_END(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, process__command__end, arg0, arg1, arg2)
+#define MEMCACHED_PROCESS_COMMAND_END_ENABLED() (1)
+#define MEMCACHED_PROCESS_COMMAND_START(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, process__command__start, arg0, arg1, arg2)
+#define MEMCACHED_PROCESS_COMMAND_START_ENABLED() (1)
+#define MEMCACHED_SLABS_ALLOCATE(arg0, arg1, arg2, arg3) \
+    DTRACE_PROBE4(memcached, slabs__allocate, arg0, arg1, arg2, arg3)
+#define MEMCACHED_SLABS_ALLOCATE_ENABLED() (1)
+#define MEMCACHED_SLABS_ALLOCATE_FAILED(arg0, arg1) \
+    DTRACE_PROBE2(memcached, slabs__allocate__failed, arg0, arg1)
+#define MEMCACHED_SLABS_ALLOCATE_FAILED_ENABLED() (1)
+#define MEMCACHED_SLABS_FREE(arg0, arg1, arg2) \
+    DTRACE_PROBE3(memcached, slabs__free, arg0, arg1, arg2)
+#define MEMCACHED_SLABS_FREE_ENABLED() (1)
+#define MEMCACHED_SLABS_SLABCLASS_ALLOCATE(arg0) \
+    DTRACE_PROBE1(memcached, slabs__slabclass__allocate, arg0)
+#define MEMCACHED_SLABS_SLABCLASS_ALLOCATE_ENABLED() (1)
+#define MEMCACHED_SLABS_SLABCLASS_ALLOCATE_FAILED(arg0) \
+    DTRACE_PROBE1(memcached, slabs__slabclass__allocate__failed, arg0)
+#define MEMCACHED_SLABS_SLABCLASS_ALLOCATE_FAILED_ENABLED() (1)
 #else
 #define MEMCACHED_ASSOC_DELETE(arg0, arg1, arg2)
 #define MEMCACHED_ASSOC_DELETE_ENABLED() (0)
+#define MEMCACHED_ASSOC_EXPAND_DONE(arg0, arg1)
+#define MEMCACHED_ASSOC_EXPAND_DONE_ENABLED() (0)
+#define MEMCACHED_ASSOC_EXPAND_START(arg0)
+#define MEMCACHED_ASSOC_EXPAND_START_ENABLED() (0)
+#define MEMCACHED_ASSOC_EXPAND_STEP(arg0, arg1, arg2)
+#define MEMCACHED_ASSOC_EXPAND_STEP_ENABLED() (0)
 #define MEMCACHED_ASSOC_FIND(arg0, arg1, arg2)
 #define MEMCACHED_ASSOC_FIND_ENABLED() (0)
 #define MEMCACHED_ASSOC_INSERT(arg0, arg1, arg2)
@@ -32,6 +159,8 @@
 #define MEMCACHED_COMMAND_SET_ENABLED() (0)
 #define MEMCACHED_CONN_ALLOCATE(arg0)
 #define MEMCACHED_CONN_ALLOCATE_ENABLED() (0)
+#define MEMCACHED_CONN_BLOCK(arg0, arg1)
+#define MEMCACHED_CONN_BLOCK_ENABLED() (0)
 #define MEMCACHED_CONN_CREATE(arg0)
 #define MEMCACHED_CONN_CREATE_ENABLED() (0)
 #define MEMCACHED_CONN_DESTROY(arg0)
@@ -40,6 +169,12 @@
 #define MEMCACHED_CONN_DISPATCH_ENABLED() (0)
 #define MEMCACHED_CONN_RELEASE(arg0)
 #define MEMCACHED_CONN_RELEASE_ENABLED() (0)
+#define MEMCACHED_CONN_RESUME(arg0, arg1, arg2)
+#define MEMCACHED_CONN_RESUME_ENABLED() (0)
+#define MEMCACHED_ITEM_BUMP(arg0, arg1, arg2, arg3, arg4)
+#define MEMCACHED_ITEM_BUMP_ENABLED() (0)
+#define MEMCACHED_ITEM_EVICT(arg0, arg1, arg2, arg3)
+#define MEMCACHED_ITEM_EVICT_ENABLED() (0)
 #define MEMCACHED_ITEM_LINK(arg0, arg1, arg2)
 #define MEMCACHED_ITEM_LINK_ENABLED() (0)
 #define MEMCACHED_ITEM_REMOVE(arg0, arg1, arg2)
@@ -50,6 +185,8 @@
 #define MEMCACHED_ITEM_UNLINK_ENABLED() (0)
 #define MEMCACHED_ITEM_UPDATE(arg0, arg1, arg2)
 #define MEMCACHED_ITEM_UPDATE_ENABLED() (0)
+#define MEMCACHED_LOCK_WAIT(arg0, arg1, arg2)
+#define MEMCACHED_LOCK_WAIT_ENABLED() (0)
 #define MEMCACHED_PROCESS_COMMAND_END(arg0, arg1, arg2)
 #define MEMCACHED_PROCESS_COMMAND_END_ENABLED() (0)
 #define MEMCACHED_PROCESS_COMMAND_START(arg0, arg1, arg2)